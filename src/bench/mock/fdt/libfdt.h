@@ -0,0 +1,29 @@
+#ifndef _MOCK_LIBFDT_H
+#define _MOCK_LIBFDT_H
+
+#include <stdint.h>
+
+#define FDT_ERR_NOTFOUND 1
+
+typedef uint32_t fdt32_t;
+
+static inline uint32_t fdt32_to_cpu(fdt32_t x)
+{
+  return __builtin_bswap32(x);
+}
+
+static inline int fdt_node_offset_by_compatible(const void *fdt, int startoffset,
+                                                const char *compatible)
+{
+  return -FDT_ERR_NOTFOUND;
+}
+
+static inline const void *fdt_getprop(const void *fdt, int nodeoffset,
+                                      const char *name, int *lenp)
+{
+  if (lenp)
+    *lenp = -FDT_ERR_NOTFOUND;
+  return NULL;
+}
+
+#endif
@@ -0,0 +1,47 @@
+// Mock of the spike device interface for the device microbenchmark:
+// only what the device plugins use.
+#ifndef _MOCK_RISCV_ABSTRACT_DEVICE_H
+#define _MOCK_RISCV_ABSTRACT_DEVICE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+
+typedef uint64_t reg_t;
+
+#define UNUSED __attribute__((unused))
+#define PGSIZE 4096
+
+class sim_t;
+
+class abstract_device_t {
+ public:
+  virtual bool load(reg_t addr, size_t len, uint8_t* bytes) = 0;
+  virtual bool store(reg_t addr, size_t len, const uint8_t* bytes) = 0;
+  virtual reg_t size() { return PGSIZE; }
+  virtual void tick(reg_t UNUSED rtc_ticks) {}
+  virtual ~abstract_device_t() {}
+};
+
+// the host is little endian
+template <typename T>
+void write_little_endian_reg(T* word, reg_t addr, size_t len, const uint8_t* bytes)
+{
+  memcpy((uint8_t *)word + (addr % sizeof(T)), bytes, len);
+}
+
+template <typename T>
+void read_little_endian_reg(T word, reg_t addr, size_t len, uint8_t* bytes)
+{
+  memcpy(bytes, (uint8_t *)&word + (addr % sizeof(T)), len);
+}
+
+// the benchmark creates the devices itself
+#define REGISTER_DEVICE(name, parse, generate)
+
+#endif
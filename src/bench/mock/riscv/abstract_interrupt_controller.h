@@ -0,0 +1,12 @@
+#ifndef _MOCK_RISCV_ABSTRACT_INTERRUPT_CONTROLLER_H
+#define _MOCK_RISCV_ABSTRACT_INTERRUPT_CONTROLLER_H
+
+#include "abstract_device.h"
+
+class abstract_interrupt_controller_t {
+ public:
+  virtual void set_interrupt_level(uint32_t interrupt_id, int level) = 0;
+  virtual ~abstract_interrupt_controller_t() {}
+};
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef _MOCK_RISCV_DTS_H
+#define _MOCK_RISCV_DTS_H
+
+#include "abstract_device.h"
+
+// there is no device tree: the devices are created by the benchmark
+static inline int fdt_get_node_addr_size(const void *fdt, int node, reg_t *addr,
+                                         unsigned long *size, const char *field)
+{
+  return -1;
+}
+
+#endif
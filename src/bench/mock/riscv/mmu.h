@@ -0,0 +1,40 @@
+// Mock debug MMU: loads and stores in the flat memory of the mock
+// simulator. An access outside of it is a bug of the device model.
+#ifndef _MOCK_RISCV_MMU_H
+#define _MOCK_RISCV_MMU_H
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include "abstract_device.h"
+
+class mmu_t {
+ public:
+  mmu_t(uint8_t* mem, reg_t base, size_t size) : mem(mem), base(base), size(size) {}
+
+  template<typename T> T load(reg_t addr) {
+    T val;
+    memcpy(&val, translate(addr, sizeof(T)), sizeof(T));
+    return val;
+  }
+
+  template<typename T> void store(reg_t addr, T val) {
+    memcpy(translate(addr, sizeof(T)), &val, sizeof(T));
+  }
+
+ private:
+  uint8_t* translate(reg_t addr, size_t len) {
+    if (addr < base || addr - base > size - len) {
+      fprintf(stderr, "mmu_t: access to 0x%" PRIx64 " outside of the memory\n",
+              (uint64_t)addr);
+      abort();
+    }
+    return mem + (addr - base);
+  }
+
+  uint8_t* mem;
+  reg_t base;
+  size_t size;
+};
+
+#endif
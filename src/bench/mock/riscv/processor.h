@@ -0,0 +1,6 @@
+#ifndef _MOCK_RISCV_PROCESSOR_H
+#define _MOCK_RISCV_PROCESSOR_H
+
+#include "abstract_device.h"
+
+#endif
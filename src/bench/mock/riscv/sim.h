@@ -0,0 +1,47 @@
+// Mock simulator: one block of host memory at mem_base, no MMIO.
+#ifndef _MOCK_RISCV_SIM_H
+#define _MOCK_RISCV_SIM_H
+
+#include <sys/mman.h>
+#include "simif.h"
+#include "mmu.h"
+#include "abstract_interrupt_controller.h"
+
+class sim_t : public simif_t {
+ public:
+  sim_t(reg_t mem_base, size_t mem_size, abstract_interrupt_controller_t* intctrl)
+    : mem_base(mem_base), mem_size(mem_size), intctrl(intctrl) {
+    mem = (uint8_t *)mmap(NULL, mem_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
+      perror("mmap");
+      exit(1);
+    }
+    debug_mmu = new mmu_t(mem, mem_base, mem_size);
+  }
+
+  ~sim_t() {
+    delete debug_mmu;
+    munmap(mem, mem_size);
+  }
+
+  char* addr_to_mem(reg_t paddr) override {
+    if (paddr < mem_base || paddr - mem_base >= mem_size)
+      return NULL;
+    return (char *)mem + (paddr - mem_base);
+  }
+
+  bool mmio_load(reg_t paddr, size_t len, uint8_t* bytes) override { return false; }
+  bool mmio_store(reg_t paddr, size_t len, const uint8_t* bytes) override { return false; }
+
+  abstract_interrupt_controller_t* get_intctrl() const { return intctrl; }
+
+  uint8_t* mem;
+  reg_t mem_base;
+  size_t mem_size;
+
+ private:
+  abstract_interrupt_controller_t* intctrl;
+};
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef _MOCK_RISCV_SIMIF_H
+#define _MOCK_RISCV_SIMIF_H
+
+#include "abstract_device.h"
+
+class mmu_t;
+
+class simif_t {
+ public:
+  virtual char* addr_to_mem(reg_t paddr) = 0;
+  virtual bool mmio_load(reg_t paddr, size_t len, uint8_t* bytes) = 0;
+  virtual bool mmio_store(reg_t paddr, size_t len, const uint8_t* bytes) = 0;
+  virtual ~simif_t() = default;
+  mmu_t* debug_mmu = nullptr;
+};
+
+#endif
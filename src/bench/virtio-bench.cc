@@ -0,0 +1,1850 @@
+/*
+ * Virtio device microbenchmark
+ *
+ * Runs the block, 9p, network, console, virtio-fs, balloon and pmem
+ * device plugins against the mock simulator of bench/mock (flat host memory, no
+ * device tree) and plays the guest driver: the requests are built in the split
+ * rings of the guest memory and submitted with QUEUE_NOTIFY writes, as in
+ * a Linux guest. For each workload the request rate, the throughput and the
+ * host time per descriptor are reported.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include "../virtio-block.h"
+#include "../virtio-9p-disk.h"
+#include "../virtio-net.h"
+#include "../virtio-console.h"
+#include "../virtio-fs.h"
+#include "../virtio-balloon.h"
+#include "../virtio-pmem.h"
+#include "../cutils.h"
+
+/* guest physical memory */
+#define RAM_BASE 0x80000000
+#define RAM_SIZE (256 << 20)
+#define PAGE_SIZE 4096
+
+/* virtio MMIO registers and ring layout, as seen by the guest */
+#define VIRTIO_MMIO_DEVICE_FEATURES     0x010
+#define VIRTIO_MMIO_DEVICE_FEATURES_SEL 0x014
+#define VIRTIO_MMIO_DRIVER_FEATURES     0x020
+#define VIRTIO_MMIO_DRIVER_FEATURES_SEL 0x024
+#define VIRTIO_MMIO_QUEUE_SEL           0x030
+#define VIRTIO_MMIO_QUEUE_NUM_MAX       0x034
+#define VIRTIO_MMIO_QUEUE_NUM           0x038
+#define VIRTIO_MMIO_QUEUE_READY         0x044
+#define VIRTIO_MMIO_QUEUE_NOTIFY        0x050
+#define VIRTIO_MMIO_INTERRUPT_STATUS    0x060
+#define VIRTIO_MMIO_INTERRUPT_ACK       0x064
+#define VIRTIO_MMIO_STATUS              0x070
+#define VIRTIO_MMIO_QUEUE_DESC_LOW      0x080
+#define VIRTIO_MMIO_QUEUE_DESC_HIGH     0x084
+#define VIRTIO_MMIO_QUEUE_AVAIL_LOW     0x090
+#define VIRTIO_MMIO_QUEUE_AVAIL_HIGH    0x094
+#define VIRTIO_MMIO_QUEUE_USED_LOW      0x0a0
+#define VIRTIO_MMIO_QUEUE_USED_HIGH     0x0a4
+#define VIRTIO_MMIO_CONFIG              0x100
+
+#define VIRTIO_STATUS_ACKNOWLEDGE 1
+#define VIRTIO_STATUS_DRIVER      2
+#define VIRTIO_STATUS_DRIVER_OK   4
+#define VIRTIO_STATUS_FEATURES_OK 8
+
+#define VIRTIO_F_INDIRECT_DESC 28
+#define VIRTIO_F_VERSION_1     32
+
+#define VRING_DESC_F_NEXT     1
+#define VRING_DESC_F_WRITE    2
+#define VRING_DESC_F_INDIRECT 4
+
+#define VRING_USED_F_NO_NOTIFY 1
+
+#define MAX_SLOTS 16 /* requests in flight */
+#define MAX_QUEUES 6
+#define MAX_SEGS  (2 + (1 << 20) / PAGE_SIZE + 2)
+
+/* the device stops if no request completes for that long */
+#define STALL_TIMEOUT_NS 2000000000LL
+
+static int64_t get_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* the interrupt line of the device: only the rising edges are counted */
+class bench_intctrl_t : public abstract_interrupt_controller_t {
+public:
+    void set_interrupt_level(uint32_t interrupt_id, int level) override {
+        if (level && !this->level)
+            raised++;
+        this->level = level;
+    }
+    int level = 0;
+    uint64_t raised = 0;
+};
+
+typedef struct {
+    uint64_t addr;
+    uint32_t len;
+    BOOL write;
+} Seg;
+
+typedef struct {
+    int index;
+    int num;
+    uint64_t desc_addr, avail_addr, used_addr;
+    uint16_t avail_idx, last_used_idx;
+    int free_head, nb_free;
+    int slot_of_head[MAX_SLOTS * 2];
+} GuestQueue;
+
+/* results of one workload */
+typedef struct {
+    uint64_t ops, bytes, descs, irqs, kicks;
+    int64_t ns;
+} BenchStats;
+
+typedef struct {
+    sim_t *sim;
+    bench_intctrl_t intctrl;
+    virtio_base_t *dev;
+    uint64_t alloc_ptr;
+    GuestQueue q[MAX_QUEUES];
+    /* per request slot: descriptors of the indirect table and buffers */
+    uint64_t table_addr[MAX_SLOTS];
+    uint64_t buf_addr[MAX_SLOTS];
+    size_t buf_size;
+    uint64_t kicks; /* QUEUE_NOTIFY writes */
+} Bench;
+
+/* options */
+static int64_t duration_ns = 500000000;
+static int queue_depth = 1;
+static const char *scratch_dir = "/tmp";
+static std::vector<std::string> blk_args, p9_args, net_args, con_args, fs_args,
+    balloon_args, pmem_args;
+
+static void fatal(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(stderr, "virtio-bench: ");
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    exit(1);
+}
+
+static uint8_t *gpa(Bench *b, uint64_t addr)
+{
+    return (uint8_t *)b->sim->addr_to_mem(addr);
+}
+
+static uint64_t guest_alloc(Bench *b, size_t size)
+{
+    uint64_t addr = b->alloc_ptr;
+
+    size = (size + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+    if (addr + size > RAM_BASE + RAM_SIZE)
+        fatal("out of guest memory\n");
+    b->alloc_ptr += size;
+    return addr;
+}
+
+static uint32_t mmio_read(Bench *b, uint32_t offset)
+{
+    uint8_t buf[4];
+    b->dev->load(offset, 4, buf);
+    return get_le32(buf);
+}
+
+static void mmio_write(Bench *b, uint32_t offset, uint32_t val)
+{
+    uint8_t buf[4];
+    put_le32(buf, val);
+    b->dev->store(offset, 4, buf);
+}
+
+static void queue_setup(Bench *b, GuestQueue *q, int index)
+{
+    int i;
+
+    mmio_write(b, VIRTIO_MMIO_QUEUE_SEL, index);
+    q->index = index;
+    q->num = mmio_read(b, VIRTIO_MMIO_QUEUE_NUM_MAX);
+    if (q->num > MAX_SLOTS * 2)
+        q->num = MAX_SLOTS * 2;
+    q->desc_addr = guest_alloc(b, 16 * q->num);
+    q->avail_addr = guest_alloc(b, 6 + 2 * q->num);
+    q->used_addr = guest_alloc(b, 6 + 8 * q->num);
+    q->avail_idx = 0;
+    q->last_used_idx = 0;
+    for(i = 0; i < q->num; i++)
+        put_le16(gpa(b, q->desc_addr + 16 * i + 14), i + 1);
+    q->free_head = 0;
+    q->nb_free = q->num;
+
+    mmio_write(b, VIRTIO_MMIO_QUEUE_NUM, q->num);
+    mmio_write(b, VIRTIO_MMIO_QUEUE_DESC_LOW, q->desc_addr);
+    mmio_write(b, VIRTIO_MMIO_QUEUE_DESC_HIGH, q->desc_addr >> 32);
+    mmio_write(b, VIRTIO_MMIO_QUEUE_AVAIL_LOW, q->avail_addr);
+    mmio_write(b, VIRTIO_MMIO_QUEUE_AVAIL_HIGH, q->avail_addr >> 32);
+    mmio_write(b, VIRTIO_MMIO_QUEUE_USED_LOW, q->used_addr);
+    mmio_write(b, VIRTIO_MMIO_QUEUE_USED_HIGH, q->used_addr >> 32);
+    mmio_write(b, VIRTIO_MMIO_QUEUE_READY, 1);
+}
+
+/* negotiate VIRTIO_F_VERSION_1, the indirect descriptors and the
+   device features of the mask dev_features if offered, then set up the
+   first nb_queues queues and a buffer of buf_size bytes per request
+   slot */
+static void bench_init(Bench *b, virtio_base_t *dev, int nb_queues,
+                       size_t buf_size, uint64_t dev_features = 0)
+{
+    uint64_t features;
+    int i;
+
+    b->dev = dev;
+    b->alloc_ptr = RAM_BASE;
+    b->kicks = 0;
+    mmio_write(b, VIRTIO_MMIO_STATUS, 0);
+    mmio_write(b, VIRTIO_MMIO_STATUS,
+               VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+    mmio_write(b, VIRTIO_MMIO_DEVICE_FEATURES_SEL, 0);
+    features = mmio_read(b, VIRTIO_MMIO_DEVICE_FEATURES);
+    mmio_write(b, VIRTIO_MMIO_DEVICE_FEATURES_SEL, 1);
+    features |= (uint64_t)mmio_read(b, VIRTIO_MMIO_DEVICE_FEATURES) << 32;
+    if (!(features & (1ULL << VIRTIO_F_INDIRECT_DESC)))
+        fatal("the device does not offer the indirect descriptors\n");
+    features &= (1ULL << VIRTIO_F_INDIRECT_DESC) | (1ULL << VIRTIO_F_VERSION_1) |
+        dev_features;
+    mmio_write(b, VIRTIO_MMIO_DRIVER_FEATURES_SEL, 0);
+    mmio_write(b, VIRTIO_MMIO_DRIVER_FEATURES, features);
+    mmio_write(b, VIRTIO_MMIO_DRIVER_FEATURES_SEL, 1);
+    mmio_write(b, VIRTIO_MMIO_DRIVER_FEATURES, features >> 32);
+    mmio_write(b, VIRTIO_MMIO_STATUS, VIRTIO_STATUS_ACKNOWLEDGE |
+               VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_FEATURES_OK);
+    if (!(mmio_read(b, VIRTIO_MMIO_STATUS) & VIRTIO_STATUS_FEATURES_OK))
+        fatal("feature negotiation failed\n");
+
+    for(i = 0; i < nb_queues; i++)
+        queue_setup(b, &b->q[i], i);
+    b->buf_size = buf_size;
+    for(i = 0; i < MAX_SLOTS; i++) {
+        b->table_addr[i] = guest_alloc(b, MAX_SEGS * 16);
+        b->buf_addr[i] = guest_alloc(b, buf_size);
+    }
+    mmio_write(b, VIRTIO_MMIO_STATUS, VIRTIO_STATUS_ACKNOWLEDGE |
+               VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_FEATURES_OK |
+               VIRTIO_STATUS_DRIVER_OK);
+}
+
+/* split [addr, addr + len) at the page boundaries, as the Linux drivers
+   do for the buffers which are not physically contiguous */
+static int add_segs(Seg *segs, int n, uint64_t addr, uint32_t len, BOOL write)
+{
+    uint32_t l;
+
+    while (len > 0) {
+        l = PAGE_SIZE - (addr & (PAGE_SIZE - 1));
+        if (l > len)
+            l = len;
+        segs[n].addr = addr;
+        segs[n].len = l;
+        segs[n].write = write;
+        n++;
+        addr += l;
+        len -= l;
+    }
+    return n;
+}
+
+static void write_desc(uint8_t *p, const Seg *seg, uint16_t flags, uint16_t next)
+{
+    put_le64(p, seg->addr);
+    put_le32(p + 8, seg->len);
+    put_le16(p + 12, flags | (seg->write ? VRING_DESC_F_WRITE : 0));
+    put_le16(p + 14, next);
+}
+
+/* make a buffer available, in the indirect table of the slot if it
+   has more than one segment. Return the number of descriptors. */
+static int queue_add(Bench *b, GuestQueue *q, int slot, const Seg *segs, int n)
+{
+    Seg table;
+    int head, i;
+
+    if (q->nb_free == 0)
+        fatal("queue %d is full\n", q->index);
+    head = q->free_head;
+    q->free_head = get_le16(gpa(b, q->desc_addr + 16 * head + 14));
+    q->nb_free--;
+    if (n == 1) {
+        write_desc(gpa(b, q->desc_addr + 16 * head), &segs[0], 0, 0);
+    } else {
+        for(i = 0; i < n; i++)
+            write_desc(gpa(b, b->table_addr[slot] + 16 * i), &segs[i],
+                       i + 1 < n ? VRING_DESC_F_NEXT : 0, i + 1);
+        table.addr = b->table_addr[slot];
+        table.len = 16 * n;
+        table.write = FALSE;
+        write_desc(gpa(b, q->desc_addr + 16 * head), &table,
+                   VRING_DESC_F_INDIRECT, 0);
+    }
+    q->slot_of_head[head] = slot;
+    put_le16(gpa(b, q->avail_addr + 4 + 2 * (q->avail_idx % q->num)), head);
+    q->avail_idx++;
+    /* the index is published after the ring entry */
+    __atomic_store_n((uint16_t *)gpa(b, q->avail_addr + 2), q->avail_idx,
+                     __ATOMIC_RELEASE);
+    return n;
+}
+
+/* return the slot of the next used buffer or -1 */
+static int queue_get_used(Bench *b, GuestQueue *q, uint32_t *plen)
+{
+    uint16_t used_idx;
+    uint8_t *e;
+    int head;
+
+    used_idx = __atomic_load_n((uint16_t *)gpa(b, q->used_addr + 2),
+                               __ATOMIC_ACQUIRE);
+    if (used_idx == q->last_used_idx)
+        return -1;
+    e = gpa(b, q->used_addr + 4 + 8 * (q->last_used_idx % q->num));
+    head = get_le32(e);
+    *plen = get_le32(e + 4);
+    q->last_used_idx++;
+    /* one ring descriptor per buffer */
+    put_le16(gpa(b, q->desc_addr + 16 * head + 14), q->free_head);
+    q->free_head = head;
+    q->nb_free++;
+    return q->slot_of_head[head];
+}
+
+/* VIRTIO_F_EVENT_IDX is not negotiated: the device suppresses the
+   notifications with used->flags */
+static void queue_notify(Bench *b, GuestQueue *q)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (get_le16(gpa(b, q->used_addr)) & VRING_USED_F_NO_NOTIFY)
+        return;
+    mmio_write(b, VIRTIO_MMIO_QUEUE_NOTIFY, q->index);
+    b->kicks++;
+}
+
+/* let the device deliver its asynchronous completions, then acknowledge
+   the interrupt as the guest handler would */
+static void bench_poll(Bench *b)
+{
+    uint32_t isr;
+
+    b->dev->tick(1);
+    if (b->intctrl.level) {
+        isr = mmio_read(b, VIRTIO_MMIO_INTERRUPT_STATUS);
+        mmio_write(b, VIRTIO_MMIO_INTERRUPT_ACK, isr);
+    }
+}
+
+/* one request type of a workload */
+typedef struct BenchOp {
+    /* queue the next request of the slot, return its descriptor count */
+    int (*submit)(Bench *b, struct BenchOp *op, int slot);
+    /* check the reply, return the transferred bytes */
+    uint64_t (*complete)(Bench *b, struct BenchOp *op, int slot, uint32_t len);
+    void *opaque;
+    int queue_idx; /* queue of the requests */
+} BenchOp;
+
+/* keep queue_depth requests in flight on the queue of op for
+   duration_ns */
+static void run_requests(Bench *b, BenchOp *op, BenchStats *st)
+{
+    GuestQueue *q = &b->q[op->queue_idx];
+    int64_t start, now, deadline, last_progress;
+    int slot, in_flight, kick;
+    uint32_t len;
+    uint64_t irqs0, kicks0;
+
+    memset(st, 0, sizeof(*st));
+    irqs0 = b->intctrl.raised;
+    kicks0 = b->kicks;
+    start = get_time_ns();
+    deadline = start + duration_ns;
+    last_progress = start;
+    for(slot = 0; slot < queue_depth; slot++)
+        st->descs += op->submit(b, op, slot);
+    in_flight = queue_depth;
+    queue_notify(b, q);
+    while (in_flight > 0) {
+        kick = 0;
+        now = get_time_ns();
+        while ((slot = queue_get_used(b, q, &len)) >= 0) {
+            st->bytes += op->complete(b, op, slot, len);
+            st->ops++;
+            in_flight--;
+            if (now < deadline) {
+                st->descs += op->submit(b, op, slot);
+                in_flight++;
+                kick = 1;
+            }
+            last_progress = now;
+        }
+        if (kick)
+            queue_notify(b, q);
+        else if (now - last_progress > STALL_TIMEOUT_NS)
+            fatal("no completion for %d requests\n", in_flight);
+        bench_poll(b);
+    }
+    st->ns = get_time_ns() - start;
+    st->irqs = b->intctrl.raised - irqs0;
+    st->kicks = b->kicks - kicks0;
+}
+
+static void print_header(void)
+{
+    printf("%-6s %-20s %3s %10s %10s %9s %7s %7s\n",
+           "device", "workload", "qd", "ops/s", "MB/s", "ns/desc", "irq/op",
+           "kick/op");
+}
+
+static void print_stats(const char *dev, const char *name, const BenchStats *st)
+{
+    double s = st->ns / 1e9;
+
+    printf("%-6s %-20s %3d %10.0f %10.1f %9.0f %7.2f %7.2f\n", dev, name,
+           queue_depth, st->ops / s, st->bytes / s / 1e6,
+           st->descs ? (double)st->ns / st->descs : 0.0,
+           st->ops ? (double)st->irqs / st->ops : 0.0,
+           st->ops ? (double)st->kicks / st->ops : 0.0);
+    fflush(stdout);
+}
+
+/* device arguments: the options given on the command line first, the
+   plugins keep the first value of an option */
+static std::vector<std::string> device_args(const std::vector<std::string>& user,
+                                            std::vector<std::string> defaults)
+{
+    std::vector<std::string> args = user;
+    args.insert(args.end(), defaults.begin(), defaults.end());
+    return args;
+}
+
+static bool has_arg(const std::vector<std::string>& args, const char *key)
+{
+    size_t len = strlen(key);
+    for (auto& arg : args) {
+        if (arg.compare(0, len, key) == 0 && arg.size() > len && arg[len] == '=')
+            return true;
+    }
+    return false;
+}
+
+/*********************************************************************/
+/* block device */
+
+#define VIRTIO_BLK_T_IN  0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_S_OK  0
+
+#define BLK_IMAGE_SIZE (64 << 20)
+
+typedef struct {
+    uint32_t type;
+    uint32_t size;
+    uint64_t image_sectors;
+    uint64_t next_sector;
+} BlkOp;
+
+/* slot buffer: the request header and the status byte in the first
+   page, then the data */
+static int blk_submit(Bench *b, BenchOp *op, int slot)
+{
+    BlkOp *o = (BlkOp *)op->opaque;
+    uint64_t addr = b->buf_addr[slot];
+    uint8_t *hdr = gpa(b, addr);
+    Seg segs[MAX_SEGS];
+    int n;
+
+    if (o->next_sector + o->size / 512 > o->image_sectors)
+        o->next_sector = 0;
+    put_le32(hdr, o->type);
+    put_le32(hdr + 4, 0);
+    put_le64(hdr + 8, o->next_sector);
+    o->next_sector += o->size / 512;
+    hdr[16] = 0xff;
+
+    segs[0].addr = addr;
+    segs[0].len = 16;
+    segs[0].write = FALSE;
+    n = add_segs(segs, 1, addr + PAGE_SIZE, o->size, o->type == VIRTIO_BLK_T_IN);
+    segs[n].addr = addr + 16;
+    segs[n].len = 1;
+    segs[n].write = TRUE;
+    n++;
+    return queue_add(b, &b->q[0], slot, segs, n);
+}
+
+static uint64_t blk_complete(Bench *b, BenchOp *op, int slot, uint32_t len)
+{
+    BlkOp *o = (BlkOp *)op->opaque;
+    uint8_t status = gpa(b, b->buf_addr[slot])[16];
+
+    if (status != VIRTIO_BLK_S_OK)
+        fatal("block request failed with status %d\n", status);
+    return o->size;
+}
+
+static int create_image(const char *filename, size_t size)
+{
+    uint8_t buf[65536];
+    size_t pos;
+    int fd, i;
+
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    /* the data is written so that the reads do not hit holes */
+    for(i = 0; i < (int)sizeof(buf); i++)
+        buf[i] = i * 7;
+    for(pos = 0; pos < size; pos += sizeof(buf)) {
+        if (write(fd, buf, sizeof(buf)) != (ssize_t)sizeof(buf)) {
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+static void bench_blk(void)
+{
+    static const uint32_t sizes[] = { 4096, 65536, 1 << 20 };
+    std::string img;
+    std::vector<std::string> args;
+    struct stat st;
+    BenchStats stats;
+    Bench b;
+    BlkOp o;
+    BenchOp op = { blk_submit, blk_complete, &o };
+    char name[64];
+    int i, rw;
+
+    if (has_arg(blk_args, "img")) {
+        args = device_args(blk_args, { "stats=/dev/null" });
+        for (auto& arg : blk_args) {
+            if (arg.compare(0, 4, "img=") == 0)
+                img = arg.substr(4);
+        }
+    } else {
+        img = std::string(scratch_dir) + "/virtio-bench.img";
+        if (create_image(img.c_str(), BLK_IMAGE_SIZE) < 0)
+            fatal("could not create %s\n", img.c_str());
+        args = device_args(blk_args, { "img=" + img, "stats=/dev/null" });
+    }
+    if (stat(img.c_str(), &st) < 0 || st.st_size < (1 << 20))
+        fatal("%s: the image must be at least 1 MiB\n", img.c_str());
+
+    for(rw = 0; rw < 2; rw++) {
+        for(i = 0; i < (int)countof(sizes); i++) {
+            b.sim = new sim_t(RAM_BASE, RAM_SIZE, &b.intctrl);
+            bench_init(&b, new virtioblk_t(b.sim, &b.intctrl, VIRTIO_IRQ, args),
+                       1, PAGE_SIZE + sizes[i]);
+            o.type = rw ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+            o.size = sizes[i];
+            o.image_sectors = st.st_size / 512;
+            o.next_sector = 0;
+            run_requests(&b, &op, &stats);
+            snprintf(name, sizeof(name), "%s %uK", rw ? "write" : "read",
+                     sizes[i] / 1024);
+            print_stats("blk", name, &stats);
+            delete b.dev;
+            delete b.sim;
+        }
+    }
+    if (!has_arg(blk_args, "img"))
+        unlink(img.c_str());
+}
+
+/*********************************************************************/
+/* 9p */
+
+#define P9_MSIZE (128 * 1024)
+#define P9_NB_FILES 64
+#define P9_FILE_SIZE (256 * 1024)
+
+#define P9_TLERROR  6
+#define P9_TLOPEN   12
+#define P9_TGETATTR 24
+#define P9_TVERSION 100
+#define P9_TATTACH  104
+#define P9_TWALK    110
+#define P9_TREAD    116
+#define P9_TCLUNK   120
+
+/* fids: 0 is the root, then one opened and one walked fid per file and
+   one per slot for the walk workloads */
+#define FID_OPEN(i)   (100 + (i))
+#define FID_WALKED(i) (200 + (i))
+#define FID_SLOT(i)   (300 + (i))
+
+enum {
+    P9_WL_WALK,    /* walk + clunk */
+    P9_WL_GETATTR,
+    P9_WL_READ,
+    P9_WL_MIX,     /* walk, getattr, lopen, read 4K, clunk */
+};
+
+typedef struct {
+    int workload;
+    uint32_t read_size;
+    int step[MAX_SLOTS];
+    int file[MAX_SLOTS];
+    uint64_t offset[MAX_SLOTS];
+    int next_file;
+    uint8_t last_type[MAX_SLOTS];
+} P9Op;
+
+typedef struct {
+    uint8_t *buf;
+    int pos;
+} P9Msg;
+
+static void p9_start(P9Msg *m, uint8_t *buf, int type, int tag)
+{
+    m->buf = buf;
+    buf[4] = type;
+    put_le16(buf + 5, tag);
+    m->pos = 7;
+}
+
+static void p9_put16(P9Msg *m, uint16_t v) { put_le16(m->buf + m->pos, v); m->pos += 2; }
+static void p9_put32(P9Msg *m, uint32_t v) { put_le32(m->buf + m->pos, v); m->pos += 4; }
+static void p9_put64(P9Msg *m, uint64_t v) { put_le64(m->buf + m->pos, v); m->pos += 8; }
+
+static void p9_put_str(P9Msg *m, const char *s)
+{
+    int len = strlen(s);
+    p9_put16(m, len);
+    memcpy(m->buf + m->pos, s, len);
+    m->pos += len;
+}
+
+/* slot buffer: the request in the first page, then the reply */
+static int p9_queue(Bench *b, int slot, P9Msg *m, uint32_t reply_size)
+{
+    uint64_t addr = b->buf_addr[slot];
+    Seg segs[MAX_SEGS];
+    int n;
+
+    put_le32(m->buf, m->pos);
+    n = add_segs(segs, 0, addr, m->pos, FALSE);
+    n = add_segs(segs, n, addr + PAGE_SIZE, reply_size, TRUE);
+    return queue_add(b, &b->q[0], slot, segs, n);
+}
+
+static uint8_t *p9_reply(Bench *b, int slot, int type)
+{
+    uint8_t *r = gpa(b, b->buf_addr[slot] + PAGE_SIZE);
+
+    if (r[4] == P9_TLERROR + 1)
+        fatal("9p request %d failed: %s\n", type, strerror(get_le32(r + 7)));
+    if (r[4] != type + 1)
+        fatal("9p request %d: unexpected reply %d\n", type, r[4]);
+    return r;
+}
+
+static void p9_file_name(char *buf, int size, int i)
+{
+    snprintf(buf, size, "file%d", i);
+}
+
+static int p9_submit_walk(Bench *b, int slot, int fid, int newfid, int file)
+{
+    P9Msg m;
+    char name[32];
+
+    p9_start(&m, gpa(b, b->buf_addr[slot]), P9_TWALK, slot + 1);
+    p9_put32(&m, fid);
+    p9_put32(&m, newfid);
+    p9_put16(&m, 1);
+    p9_file_name(name, sizeof(name), file);
+    p9_put_str(&m, name);
+    return p9_queue(b, slot, &m, 128);
+}
+
+static int p9_submit_fid(Bench *b, int slot, int type, int fid)
+{
+    P9Msg m;
+
+    p9_start(&m, gpa(b, b->buf_addr[slot]), type, slot + 1);
+    p9_put32(&m, fid);
+    switch(type) {
+    case P9_TGETATTR:
+        p9_put64(&m, 0x3fff);
+        return p9_queue(b, slot, &m, 160);
+    case P9_TLOPEN:
+        p9_put32(&m, O_RDONLY);
+        return p9_queue(b, slot, &m, 64);
+    default:
+        return p9_queue(b, slot, &m, 64);
+    }
+}
+
+static int p9_submit_read(Bench *b, int slot, int fid, uint64_t offset,
+                          uint32_t count)
+{
+    P9Msg m;
+
+    p9_start(&m, gpa(b, b->buf_addr[slot]), P9_TREAD, slot + 1);
+    p9_put32(&m, fid);
+    p9_put64(&m, offset);
+    p9_put32(&m, count);
+    return p9_queue(b, slot, &m, 11 + count);
+}
+
+static int p9_submit(Bench *b, BenchOp *op, int slot)
+{
+    P9Op *o = (P9Op *)op->opaque;
+    int step = o->step[slot]++;
+    int file = o->file[slot];
+    int type, ret;
+
+    switch(o->workload) {
+    case P9_WL_WALK:
+        type = (step & 1) ? P9_TCLUNK : P9_TWALK;
+        break;
+    case P9_WL_GETATTR:
+        type = P9_TGETATTR;
+        break;
+    case P9_WL_READ:
+        type = P9_TREAD;
+        break;
+    default:
+        {
+            static const int mix[] = { P9_TWALK, P9_TGETATTR, P9_TLOPEN,
+                                       P9_TREAD, P9_TCLUNK };
+            type = mix[step % (int)countof(mix)];
+        }
+        break;
+    }
+    if (type == P9_TWALK || o->workload == P9_WL_GETATTR ||
+        o->workload == P9_WL_READ) {
+        /* next file, spread over the slots */
+        if (o->workload != P9_WL_READ ||
+            o->offset[slot] + o->read_size > P9_FILE_SIZE) {
+            file = o->next_file++ % P9_NB_FILES;
+            o->file[slot] = file;
+            o->offset[slot] = 0;
+        }
+    }
+
+    o->last_type[slot] = type;
+    switch(type) {
+    case P9_TWALK:
+        ret = p9_submit_walk(b, slot, 0, FID_SLOT(slot), file);
+        break;
+    case P9_TGETATTR:
+        ret = p9_submit_fid(b, slot, type, o->workload == P9_WL_GETATTR ?
+                            FID_WALKED(file) : FID_SLOT(slot));
+        break;
+    case P9_TREAD:
+        ret = p9_submit_read(b, slot, o->workload == P9_WL_READ ?
+                             FID_OPEN(file) : FID_SLOT(slot),
+                             o->offset[slot], o->read_size);
+        o->offset[slot] += o->read_size;
+        break;
+    default:
+        ret = p9_submit_fid(b, slot, type, FID_SLOT(slot));
+        break;
+    }
+    return ret;
+}
+
+static uint64_t p9_complete(Bench *b, BenchOp *op, int slot, uint32_t len)
+{
+    P9Op *o = (P9Op *)op->opaque;
+    int type = o->last_type[slot];
+    uint8_t *r = p9_reply(b, slot, type);
+
+    if (type == P9_TREAD) {
+        if (get_le32(r + 7) != o->read_size)
+            fatal("short 9p read\n");
+        return o->read_size;
+    }
+    return 0;
+}
+
+/* one request at a time, for the setup */
+static uint8_t *p9_call(Bench *b, P9Msg *m, uint32_t reply_size)
+{
+    int64_t start = get_time_ns();
+    uint32_t len;
+    int type = m->buf[4];
+
+    p9_queue(b, 0, m, reply_size);
+    queue_notify(b, &b->q[0]);
+    while (queue_get_used(b, &b->q[0], &len) < 0) {
+        if (get_time_ns() - start > STALL_TIMEOUT_NS)
+            fatal("9p request %d did not complete\n", type);
+        bench_poll(b);
+    }
+    return p9_reply(b, 0, type);
+}
+
+static int create_tree(const std::string& dir)
+{
+    uint8_t buf[P9_FILE_SIZE];
+    char name[32];
+    std::string path;
+    int fd, i;
+
+    if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST)
+        return -1;
+    for(i = 0; i < (int)sizeof(buf); i++)
+        buf[i] = i * 13;
+    for(i = 0; i < P9_NB_FILES; i++) {
+        p9_file_name(name, sizeof(name), i);
+        path = dir + "/" + name;
+        fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return -1;
+        if (write(fd, buf, sizeof(buf)) != (ssize_t)sizeof(buf)) {
+            close(fd);
+            return -1;
+        }
+        close(fd);
+    }
+    return 0;
+}
+
+static void remove_tree(const std::string& dir)
+{
+    char name[32];
+    std::string path;
+    int i;
+
+    for(i = 0; i < P9_NB_FILES; i++) {
+        p9_file_name(name, sizeof(name), i);
+        path = dir + "/" + name;
+        unlink(path.c_str());
+    }
+    rmdir(dir.c_str());
+}
+
+static void bench_9p(void)
+{
+    static const struct {
+        const char *name;
+        int workload;
+        uint32_t read_size;
+    } workloads[] = {
+        { "walk+clunk", P9_WL_WALK, 0 },
+        { "getattr", P9_WL_GETATTR, 0 },
+        { "read 4K", P9_WL_READ, 4096 },
+        { "read 64K", P9_WL_READ, 65536 },
+        { "walk/getattr/read", P9_WL_MIX, 4096 },
+    };
+    std::string dir = std::string(scratch_dir) + "/virtio-bench.9p";
+    BenchStats stats;
+    Bench b;
+    P9Op o;
+    BenchOp op = { p9_submit, p9_complete, &o };
+    P9Msg m;
+    uint8_t *r;
+    int i;
+
+    if (create_tree(dir) < 0)
+        fatal("could not create %s\n", dir.c_str());
+    b.sim = new sim_t(RAM_BASE, RAM_SIZE, &b.intctrl);
+    bench_init(&b, new virtio9p_t(b.sim, &b.intctrl, VIRTIO_9P_FS_IRQ,
+                                  device_args(p9_args, { "path=" + dir,
+                                              "tag=bench", "stats=/dev/null" })),
+               1, PAGE_SIZE + P9_MSIZE);
+
+    p9_start(&m, gpa(&b, b.buf_addr[0]), P9_TVERSION, 0xffff);
+    p9_put32(&m, P9_MSIZE);
+    p9_put_str(&m, "9P2000.L");
+    r = p9_call(&b, &m, 64);
+    if (get_le32(r + 7) < 65536 + 11)
+        fatal("9p msize %u is too small\n", get_le32(r + 7));
+    p9_start(&m, gpa(&b, b.buf_addr[0]), P9_TATTACH, 1);
+    p9_put32(&m, 0);
+    p9_put32(&m, ~0u);
+    p9_put_str(&m, "bench");
+    p9_put_str(&m, "");
+    p9_put32(&m, 0);
+    p9_call(&b, &m, 64);
+    for(i = 0; i < P9_NB_FILES; i++) {
+        char name[32];
+        p9_file_name(name, sizeof(name), i);
+        p9_start(&m, gpa(&b, b.buf_addr[0]), P9_TWALK, 1);
+        p9_put32(&m, 0);
+        p9_put32(&m, FID_OPEN(i));
+        p9_put16(&m, 1);
+        p9_put_str(&m, name);
+        p9_call(&b, &m, 128);
+        p9_start(&m, gpa(&b, b.buf_addr[0]), P9_TLOPEN, 1);
+        p9_put32(&m, FID_OPEN(i));
+        p9_put32(&m, O_RDONLY);
+        p9_call(&b, &m, 64);
+        p9_start(&m, gpa(&b, b.buf_addr[0]), P9_TWALK, 1);
+        p9_put32(&m, 0);
+        p9_put32(&m, FID_WALKED(i));
+        p9_put16(&m, 1);
+        p9_put_str(&m, name);
+        p9_call(&b, &m, 128);
+    }
+
+    for(i = 0; i < (int)countof(workloads); i++) {
+        int slot;
+        memset(&o, 0, sizeof(o));
+        o.workload = workloads[i].workload;
+        o.read_size = workloads[i].read_size;
+        /* each slot reads its own file */
+        for(slot = 0; slot < MAX_SLOTS; slot++)
+            o.file[slot] = slot % P9_NB_FILES;
+        o.next_file = MAX_SLOTS;
+        run_requests(&b, &op, &stats);
+        print_stats("9p", workloads[i].name, &stats);
+    }
+    delete b.dev;
+    delete b.sim;
+    remove_tree(dir);
+}
+
+/*********************************************************************/
+/* virtio-fs */
+
+#define FUSE_LOOKUP   1
+#define FUSE_FORGET   2
+#define FUSE_GETATTR  3
+#define FUSE_OPEN     14
+#define FUSE_READ     15
+#define FUSE_RELEASE  18
+#define FUSE_INIT     26
+
+#define FUSE_IN_HEADER_SIZE  40
+#define FUSE_OUT_HEADER_SIZE 16
+#define FS_ROOT_ID 1
+
+/* the request queue, after the high priority queue */
+#define FS_REQ_QUEUE 1
+
+enum {
+    FS_WL_LOOKUP,  /* lookup + forget */
+    FS_WL_GETATTR,
+    FS_WL_READ,
+    FS_WL_MIX,     /* lookup, getattr, open, read 4K, release, forget */
+};
+
+typedef struct {
+    int workload;
+    uint32_t read_size;
+    uint64_t nodeid[P9_NB_FILES]; /* looked up once at setup */
+    uint64_t fh[P9_NB_FILES];
+    int step[MAX_SLOTS];
+    int file[MAX_SLOTS];
+    uint64_t offset[MAX_SLOTS];
+    uint64_t slot_nodeid[MAX_SLOTS]; /* MIX: current lookup and open */
+    uint64_t slot_fh[MAX_SLOTS];
+    int next_file;
+    uint32_t last_opcode[MAX_SLOTS];
+    uint64_t unique;
+} FSOp;
+
+/* the arguments follow the returned header */
+static uint8_t *fs_start(Bench *b, FSOp *o, int slot, uint32_t opcode,
+                         uint64_t nodeid)
+{
+    uint8_t *p = gpa(b, b->buf_addr[slot]);
+
+    memset(p, 0, FUSE_IN_HEADER_SIZE);
+    put_le32(p + 4, opcode);
+    put_le64(p + 8, ++o->unique);
+    put_le64(p + 16, nodeid);
+    o->last_opcode[slot] = opcode;
+    return p + FUSE_IN_HEADER_SIZE;
+}
+
+/* slot buffer: the request in the first page, then the reply. FORGET
+   has no reply. */
+static int fs_queue(Bench *b, int slot, int arg_len, uint32_t reply_size)
+{
+    uint64_t addr = b->buf_addr[slot];
+    Seg segs[MAX_SEGS];
+    int n, len = FUSE_IN_HEADER_SIZE + arg_len;
+
+    put_le32(gpa(b, addr), len);
+    n = add_segs(segs, 0, addr, len, FALSE);
+    if (reply_size > 0)
+        n = add_segs(segs, n, addr + PAGE_SIZE, reply_size, TRUE);
+    return queue_add(b, &b->q[FS_REQ_QUEUE], slot, segs, n);
+}
+
+static uint8_t *fs_reply(Bench *b, FSOp *o, int slot)
+{
+    uint8_t *r = gpa(b, b->buf_addr[slot] + PAGE_SIZE);
+    int32_t err = get_le32(r + 4);
+
+    if (err < 0)
+        fatal("fuse request %d failed: %s\n", o->last_opcode[slot],
+              strerror(-err));
+    return r + FUSE_OUT_HEADER_SIZE;
+}
+
+static int fs_submit_lookup(Bench *b, FSOp *o, int slot, int file)
+{
+    char *name = (char *)fs_start(b, o, slot, FUSE_LOOKUP, FS_ROOT_ID);
+
+    p9_file_name(name, 32, file);
+    return fs_queue(b, slot, strlen(name) + 1, FUSE_OUT_HEADER_SIZE + 128);
+}
+
+static int fs_submit_read(Bench *b, FSOp *o, int slot, uint64_t nodeid,
+                          uint64_t fh, uint64_t offset, uint32_t size)
+{
+    uint8_t *arg = fs_start(b, o, slot, FUSE_READ, nodeid);
+
+    memset(arg, 0, 40);
+    put_le64(arg, fh);
+    put_le64(arg + 8, offset);
+    put_le32(arg + 16, size);
+    return fs_queue(b, slot, 40, FUSE_OUT_HEADER_SIZE + size);
+}
+
+static int fs_submit(Bench *b, BenchOp *op, int slot)
+{
+    FSOp *o = (FSOp *)op->opaque;
+    int step = o->step[slot]++;
+    int file = o->file[slot];
+    uint32_t opcode;
+    uint8_t *arg;
+
+    switch(o->workload) {
+    case FS_WL_LOOKUP:
+        opcode = (step & 1) ? FUSE_FORGET : FUSE_LOOKUP;
+        break;
+    case FS_WL_GETATTR:
+        opcode = FUSE_GETATTR;
+        break;
+    case FS_WL_READ:
+        opcode = FUSE_READ;
+        break;
+    default:
+        {
+            static const uint32_t mix[] = { FUSE_LOOKUP, FUSE_GETATTR,
+                                            FUSE_OPEN, FUSE_READ,
+                                            FUSE_RELEASE, FUSE_FORGET };
+            opcode = mix[step % (int)countof(mix)];
+        }
+        break;
+    }
+    if (opcode == FUSE_LOOKUP || o->workload == FS_WL_GETATTR ||
+        o->workload == FS_WL_READ) {
+        /* next file, spread over the slots */
+        if (o->workload != FS_WL_READ ||
+            o->offset[slot] + o->read_size > P9_FILE_SIZE) {
+            file = o->next_file++ % P9_NB_FILES;
+            o->file[slot] = file;
+            o->offset[slot] = 0;
+        }
+    }
+
+    switch(opcode) {
+    case FUSE_LOOKUP:
+        return fs_submit_lookup(b, o, slot, file);
+    case FUSE_FORGET:
+        arg = fs_start(b, o, slot, opcode, o->workload == FS_WL_MIX ?
+                       o->slot_nodeid[slot] : o->nodeid[file]);
+        put_le64(arg, 1);
+        return fs_queue(b, slot, 8, 0);
+    case FUSE_GETATTR:
+        arg = fs_start(b, o, slot, opcode, o->workload == FS_WL_MIX ?
+                       o->slot_nodeid[slot] : o->nodeid[file]);
+        memset(arg, 0, 16);
+        return fs_queue(b, slot, 16, FUSE_OUT_HEADER_SIZE + 104);
+    case FUSE_OPEN:
+        arg = fs_start(b, o, slot, opcode, o->slot_nodeid[slot]);
+        put_le32(arg, O_RDONLY);
+        put_le32(arg + 4, 0);
+        return fs_queue(b, slot, 8, FUSE_OUT_HEADER_SIZE + 16);
+    case FUSE_RELEASE:
+        arg = fs_start(b, o, slot, opcode, o->slot_nodeid[slot]);
+        memset(arg, 0, 24);
+        put_le64(arg, o->slot_fh[slot]);
+        return fs_queue(b, slot, 24, FUSE_OUT_HEADER_SIZE);
+    default:
+        if (o->workload == FS_WL_MIX)
+            return fs_submit_read(b, o, slot, o->slot_nodeid[slot],
+                                  o->slot_fh[slot], 0, o->read_size);
+        o->offset[slot] += o->read_size;
+        return fs_submit_read(b, o, slot, o->nodeid[file], o->fh[file],
+                              o->offset[slot] - o->read_size, o->read_size);
+    }
+}
+
+static uint64_t fs_complete(Bench *b, BenchOp *op, int slot, uint32_t len)
+{
+    FSOp *o = (FSOp *)op->opaque;
+    uint32_t opcode = o->last_opcode[slot];
+    uint8_t *r;
+
+    if (opcode == FUSE_FORGET)
+        return 0;
+    r = fs_reply(b, o, slot);
+    switch(opcode) {
+    case FUSE_LOOKUP:
+        o->slot_nodeid[slot] = get_le64(r);
+        break;
+    case FUSE_OPEN:
+        o->slot_fh[slot] = get_le64(r);
+        break;
+    case FUSE_READ:
+        if (len != FUSE_OUT_HEADER_SIZE + o->read_size)
+            fatal("short fuse read\n");
+        return o->read_size;
+    }
+    return 0;
+}
+
+/* one request at a time, for the setup */
+static uint8_t *fs_call(Bench *b, FSOp *o, int arg_len, uint32_t reply_size)
+{
+    int64_t start = get_time_ns();
+    uint32_t len;
+
+    fs_queue(b, 0, arg_len, reply_size);
+    queue_notify(b, &b->q[FS_REQ_QUEUE]);
+    while (queue_get_used(b, &b->q[FS_REQ_QUEUE], &len) < 0) {
+        if (get_time_ns() - start > STALL_TIMEOUT_NS)
+            fatal("fuse request %d did not complete\n", o->last_opcode[0]);
+        bench_poll(b);
+    }
+    return fs_reply(b, o, 0);
+}
+
+static void bench_fs(void)
+{
+    static const struct {
+        const char *name;
+        int workload;
+        uint32_t read_size;
+    } workloads[] = {
+        { "lookup+forget", FS_WL_LOOKUP, 0 },
+        { "getattr", FS_WL_GETATTR, 0 },
+        { "read 4K", FS_WL_READ, 4096 },
+        { "read 64K", FS_WL_READ, 65536 },
+        { "lookup/open/read", FS_WL_MIX, 4096 },
+    };
+    std::string dir = std::string(scratch_dir) + "/virtio-bench.fs";
+    BenchStats stats;
+    Bench b;
+    FSOp o;
+    BenchOp op = { fs_submit, fs_complete, &o, FS_REQ_QUEUE };
+    uint8_t *arg, *r;
+    int i, slot;
+
+    if (create_tree(dir) < 0)
+        fatal("could not create %s\n", dir.c_str());
+    b.sim = new sim_t(RAM_BASE, RAM_SIZE, &b.intctrl);
+    bench_init(&b, new virtiofs_t(b.sim, &b.intctrl, VIRTIO_FS_IRQ,
+                                  device_args(fs_args, { "path=" + dir,
+                                              "tag=bench" })),
+               2, PAGE_SIZE + 65536 + FUSE_OUT_HEADER_SIZE);
+
+    memset(&o, 0, sizeof(o));
+    arg = fs_start(&b, &o, 0, FUSE_INIT, 0);
+    memset(arg, 0, 64);
+    put_le32(arg, 7);
+    put_le32(arg + 4, 31);
+    put_le32(arg + 8, 65536);
+    r = fs_call(&b, &o, 64, FUSE_OUT_HEADER_SIZE + 64);
+    if (get_le32(r + 20) < 65536)
+        fatal("fuse max_write %u is too small\n", get_le32(r + 20));
+    for(i = 0; i < P9_NB_FILES; i++) {
+        char *name = (char *)fs_start(&b, &o, 0, FUSE_LOOKUP, FS_ROOT_ID);
+        p9_file_name(name, 32, i);
+        r = fs_call(&b, &o, strlen(name) + 1, FUSE_OUT_HEADER_SIZE + 128);
+        o.nodeid[i] = get_le64(r);
+        arg = fs_start(&b, &o, 0, FUSE_OPEN, o.nodeid[i]);
+        put_le32(arg, O_RDONLY);
+        put_le32(arg + 4, 0);
+        r = fs_call(&b, &o, 8, FUSE_OUT_HEADER_SIZE + 16);
+        o.fh[i] = get_le64(r);
+    }
+
+    for(i = 0; i < (int)countof(workloads); i++) {
+        o.workload = workloads[i].workload;
+        o.read_size = workloads[i].read_size;
+        memset(o.step, 0, sizeof(o.step));
+        memset(o.offset, 0, sizeof(o.offset));
+        /* each slot reads its own file */
+        for(slot = 0; slot < MAX_SLOTS; slot++)
+            o.file[slot] = slot % P9_NB_FILES;
+        o.next_file = MAX_SLOTS;
+        run_requests(&b, &op, &stats);
+        print_stats("fs", workloads[i].name, &stats);
+    }
+    delete b.dev;
+    delete b.sim;
+    remove_tree(dir);
+}
+
+/*********************************************************************/
+/* network */
+
+#define NET_HDR_SIZE 12 /* virtio_net_hdr with num_buffers */
+#define NET_RX_BUF_SIZE 2048
+#define NET_RX_QUEUE 0
+#define NET_TX_QUEUE 1
+
+/* the gateway of the user network answers the ICMP echo requests */
+static const uint8_t net_guest_ip[4] = { 10, 0, 2, 15 };
+static const uint8_t net_gateway_ip[4] = { 10, 0, 2, 2 };
+
+static uint16_t ip_checksum(const uint8_t *buf, int len)
+{
+    uint32_t sum = 0;
+    int i;
+
+    for(i = 0; i + 1 < len; i += 2)
+        sum += (buf[i] << 8) | buf[i + 1];
+    if (len & 1)
+        sum += buf[len - 1] << 8;
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return ~sum;
+}
+
+/* Ethernet frame of frame_len bytes: an ARP request for the gateway if
+   frame_len is 0, an ICMP echo request otherwise. Return its length. */
+static int net_build_frame(uint8_t *f, const uint8_t *mac, int frame_len)
+{
+    uint8_t *ip, *icmp;
+    int i, ip_len;
+
+    memcpy(f + 6, mac, 6);
+    if (frame_len == 0) {
+        memset(f, 0xff, 6);
+        f[12] = 0x08; f[13] = 0x06;
+        uint8_t *a = f + 14;
+        memset(a, 0, 28);
+        a[1] = 1; a[2] = 0x08; a[4] = 6; a[5] = 4; a[7] = 1;
+        memcpy(a + 8, mac, 6);
+        memcpy(a + 14, net_guest_ip, 4);
+        memcpy(a + 24, net_gateway_ip, 4);
+        return 42;
+    }
+    /* the gateway MAC address is not checked by the user network */
+    memset(f, 0x52, 6);
+    f[12] = 0x08; f[13] = 0x00;
+    ip = f + 14;
+    ip_len = frame_len - 14;
+    memset(ip, 0, 20);
+    ip[0] = 0x45;
+    ip[2] = ip_len >> 8;
+    ip[3] = ip_len;
+    ip[8] = 64;
+    ip[9] = 1; /* ICMP */
+    memcpy(ip + 12, net_guest_ip, 4);
+    memcpy(ip + 16, net_gateway_ip, 4);
+    put_be16(ip + 10, ip_checksum(ip, 20));
+    icmp = ip + 20;
+    memset(icmp, 0, 8);
+    icmp[0] = 8; /* echo request */
+    icmp[5] = 1;
+    for(i = 8; i < ip_len - 20; i++)
+        icmp[i] = i;
+    put_be16(icmp + 2, ip_checksum(icmp, ip_len - 20));
+    return frame_len;
+}
+
+static void net_add_rx_buf(Bench *b, int slot, uint64_t *descs)
+{
+    Seg seg;
+
+    seg.addr = b->buf_addr[slot / 2] + (slot & 1) * NET_RX_BUF_SIZE;
+    seg.len = NET_RX_BUF_SIZE;
+    seg.write = TRUE;
+    *descs += queue_add(b, &b->q[NET_RX_QUEUE], slot, &seg, 1);
+}
+
+/* receive the frames, refilling the RX ring. Return the number of
+   frames of the expected Ethernet type. */
+static int net_rx(Bench *b, int ethertype, uint64_t *bytes, uint64_t *descs)
+{
+    GuestQueue *q = &b->q[NET_RX_QUEUE];
+    uint32_t len;
+    uint8_t *f;
+    int slot, n = 0, refill = 0;
+
+    while ((slot = queue_get_used(b, q, &len)) >= 0) {
+        f = gpa(b, b->buf_addr[slot / 2] + (slot & 1) * NET_RX_BUF_SIZE) +
+            NET_HDR_SIZE;
+        if (len > NET_HDR_SIZE + 14 && get_be16(f + 12) == ethertype) {
+            n++;
+            *bytes += len - NET_HDR_SIZE;
+        }
+        net_add_rx_buf(b, slot, descs);
+        refill = 1;
+    }
+    if (refill)
+        queue_notify(b, q);
+    return n;
+}
+
+/* after the two receive buffers of the slot: the virtio-net header,
+   then the frame. All the slots send the same frame, so a free slot
+   may be taken in any order. */
+static int net_tx(Bench *b, int slot, int frame_len)
+{
+    Seg segs[2];
+
+    segs[0].addr = b->buf_addr[slot] + 2 * NET_RX_BUF_SIZE;
+    segs[0].len = NET_HDR_SIZE;
+    segs[0].write = FALSE;
+    segs[1].addr = segs[0].addr + NET_HDR_SIZE;
+    segs[1].len = frame_len;
+    segs[1].write = FALSE;
+    return queue_add(b, &b->q[NET_TX_QUEUE], slot, segs, 2);
+}
+
+static void bench_net(void)
+{
+    static const int frame_sizes[] = { 64, 512, 1514 };
+    BenchStats st;
+    Bench b;
+    uint8_t mac[6];
+    uint64_t irqs0, kicks0, tx_bytes;
+    int64_t start, now, deadline, last_progress;
+    int i, slot, in_flight, tx_free, frame_len, len, kick;
+    uint32_t ulen;
+    char name[64];
+
+    b.sim = new sim_t(RAM_BASE, RAM_SIZE, &b.intctrl);
+    bench_init(&b, new virtionet_t(b.sim, &b.intctrl, VIRTIO_NET_IRQ,
+                                   device_args(net_args, { "driver=user",
+                                               "hostfwd=tcp:127.0.0.1:0-:22" })),
+               2, 3 * NET_RX_BUF_SIZE);
+    for(i = 0; i < 6; i++) {
+        uint8_t v;
+        b.dev->load(VIRTIO_MMIO_CONFIG + i, 1, &v);
+        mac[i] = v;
+    }
+    /* two receive buffers per slot */
+    st.descs = 0;
+    for(slot = 0; slot < 2 * MAX_SLOTS && slot < b.q[NET_RX_QUEUE].num; slot++)
+        net_add_rx_buf(&b, slot, &st.descs);
+    queue_notify(&b, &b.q[NET_RX_QUEUE]);
+
+    /* the user network learns the guest MAC address from its ARP request */
+    memset(gpa(&b, b.buf_addr[0] + 2 * NET_RX_BUF_SIZE), 0, NET_HDR_SIZE);
+    len = net_build_frame(gpa(&b, b.buf_addr[0] + 2 * NET_RX_BUF_SIZE) +
+                          NET_HDR_SIZE, mac, 0);
+    net_tx(&b, 0, len);
+    queue_notify(&b, &b.q[NET_TX_QUEUE]);
+    start = get_time_ns();
+    tx_bytes = 0;
+    while (net_rx(&b, 0x0806, &tx_bytes, &st.descs) == 0) {
+        if (get_time_ns() - start > STALL_TIMEOUT_NS)
+            fatal("no ARP reply from the user network\n");
+        bench_poll(&b);
+    }
+    while (queue_get_used(&b, &b.q[NET_TX_QUEUE], &ulen) < 0)
+        bench_poll(&b);
+
+    for(i = 0; i < (int)countof(frame_sizes); i++) {
+        frame_len = frame_sizes[i];
+        for(slot = 0; slot < queue_depth; slot++) {
+            uint8_t *p = gpa(&b, b.buf_addr[slot] + 2 * NET_RX_BUF_SIZE);
+            memset(p, 0, NET_HDR_SIZE);
+            net_build_frame(p + NET_HDR_SIZE, mac, frame_len);
+        }
+        memset(&st, 0, sizeof(st));
+        irqs0 = b.intctrl.raised;
+        kicks0 = b.kicks;
+        start = get_time_ns();
+        deadline = start + duration_ns;
+        last_progress = start;
+        /* an operation is an echo request and its reply: queue_depth
+           requests wait for their reply */
+        in_flight = 0;
+        tx_free = queue_depth;
+        for (;;) {
+            now = get_time_ns();
+            kick = 0;
+            while (now < deadline && tx_free > 0 && in_flight < queue_depth) {
+                st.descs += net_tx(&b, queue_depth - tx_free, frame_len);
+                st.bytes += frame_len;
+                tx_free--;
+                in_flight++;
+                kick = 1;
+            }
+            if (kick)
+                queue_notify(&b, &b.q[NET_TX_QUEUE]);
+            bench_poll(&b);
+            while (queue_get_used(&b, &b.q[NET_TX_QUEUE], &ulen) >= 0)
+                tx_free++;
+            len = net_rx(&b, 0x0800, &st.bytes, &st.descs);
+            if (len > 0) {
+                in_flight -= len;
+                st.ops += len;
+                last_progress = now;
+            } else if (now - last_progress > STALL_TIMEOUT_NS) {
+                fatal("no echo reply for %d requests\n", in_flight);
+            }
+            if (now >= deadline && in_flight <= 0 && tx_free == queue_depth)
+                break;
+        }
+        st.ns = get_time_ns() - start;
+        st.irqs = b.intctrl.raised - irqs0;
+        st.kicks = b.kicks - kicks0;
+        snprintf(name, sizeof(name), "ping %d", frame_len);
+        print_stats("net", name, &st);
+    }
+    delete b.dev;
+    delete b.sim;
+}
+
+/*********************************************************************/
+/* console device */
+
+#define VIRTIO_CONSOLE_F_MULTIPORT 1
+
+#define CON_CTRL_RX 2
+#define CON_CTRL_TX 3
+#define CON_PORT1_TX 5
+#define CON_CTRL_BUF_SIZE 64
+
+#define VIRTIO_CONSOLE_DEVICE_READY 0
+#define VIRTIO_CONSOLE_DEVICE_ADD   1
+#define VIRTIO_CONSOLE_PORT_READY   3
+#define VIRTIO_CONSOLE_PORT_OPEN    6
+#define VIRTIO_CONSOLE_PORT_NAME    7
+
+typedef struct {
+    uint32_t size;
+} ConOp;
+
+static int con_submit(Bench *b, BenchOp *op, int slot)
+{
+    ConOp *o = (ConOp *)op->opaque;
+    Seg segs[MAX_SEGS];
+    int n;
+
+    n = add_segs(segs, 0, b->buf_addr[slot], o->size, FALSE);
+    return queue_add(b, &b->q[CON_PORT1_TX], slot, segs, n);
+}
+
+static uint64_t con_complete(Bench *b, BenchOp *op, int slot, uint32_t len)
+{
+    return ((ConOp *)op->opaque)->size;
+}
+
+/* the control buffers of the driver use the slots MAX_SLOTS / 2 and
+   up, the messages to the device the slot MAX_SLOTS - 1 */
+static void con_add_ctrl_buf(Bench *b, int slot)
+{
+    Seg seg;
+
+    seg.addr = b->buf_addr[MAX_SLOTS / 2] + slot * CON_CTRL_BUF_SIZE;
+    seg.len = CON_CTRL_BUF_SIZE;
+    seg.write = TRUE;
+    queue_add(b, &b->q[CON_CTRL_RX], slot, &seg, 1);
+}
+
+static void con_send_ctrl(Bench *b, uint32_t id, int event, int value)
+{
+    uint8_t *p = gpa(b, b->buf_addr[MAX_SLOTS - 1]);
+    uint32_t len;
+    Seg seg;
+
+    put_le32(p, id);
+    put_le16(p + 4, event);
+    put_le16(p + 6, value);
+    seg.addr = b->buf_addr[MAX_SLOTS - 1];
+    seg.len = 8;
+    seg.write = FALSE;
+    queue_add(b, &b->q[CON_CTRL_TX], 0, &seg, 1);
+    queue_notify(b, &b->q[CON_CTRL_TX]);
+    while (queue_get_used(b, &b->q[CON_CTRL_TX], &len) < 0)
+        bench_poll(b);
+}
+
+/* wait for the control message event of port id, as the Linux driver
+   does when it adds the ports */
+static void con_wait_ctrl(Bench *b, uint32_t id, int event)
+{
+    GuestQueue *q = &b->q[CON_CTRL_RX];
+    int64_t start = get_time_ns();
+    uint8_t *p;
+    uint32_t len;
+    int slot;
+
+    for (;;) {
+        while ((slot = queue_get_used(b, q, &len)) >= 0) {
+            p = gpa(b, b->buf_addr[MAX_SLOTS / 2] + slot * CON_CTRL_BUF_SIZE);
+            con_add_ctrl_buf(b, slot);
+            queue_notify(b, q);
+            if (len >= 8 && get_le32(p) == id && get_le16(p + 4) == event)
+                return;
+        }
+        if (get_time_ns() - start > STALL_TIMEOUT_NS)
+            fatal("no console control message %d for port %d\n", event, id);
+        bench_poll(b);
+    }
+}
+
+/* the guest writes to the second port (a log channel): an operation
+   is a buffer given to the device */
+static void bench_con(void)
+{
+    static const uint32_t sizes[] = { 80, 4096, 65536 };
+    BenchStats st;
+    Bench b;
+    ConOp o;
+    BenchOp op = { con_submit, con_complete, &o, CON_PORT1_TX };
+    char name[64];
+    int i;
+
+    b.sim = new sim_t(RAM_BASE, RAM_SIZE, &b.intctrl);
+    bench_init(&b, new virtiocon_t(b.sim, &b.intctrl, VIRTIO_CONSOLE_IRQ,
+                                   device_args(con_args, { "port0=null",
+                                               "port1=file:/dev/null",
+                                               "name1=bench" })),
+               6, 65536, 1ULL << VIRTIO_CONSOLE_F_MULTIPORT);
+    for(i = 0; i < 8; i++)
+        con_add_ctrl_buf(&b, i);
+    queue_notify(&b, &b.q[CON_CTRL_RX]);
+    con_send_ctrl(&b, 0, VIRTIO_CONSOLE_DEVICE_READY, 1);
+    con_wait_ctrl(&b, 1, VIRTIO_CONSOLE_DEVICE_ADD);
+    con_send_ctrl(&b, 1, VIRTIO_CONSOLE_PORT_READY, 1);
+    con_wait_ctrl(&b, 1, VIRTIO_CONSOLE_PORT_OPEN);
+    con_send_ctrl(&b, 1, VIRTIO_CONSOLE_PORT_OPEN, 1);
+
+    for(i = 0; i < (int)countof(sizes); i++) {
+        o.size = sizes[i];
+        run_requests(&b, &op, &st);
+        snprintf(name, sizeof(name), "write %d", sizes[i]);
+        print_stats("con", name, &st);
+    }
+    delete b.dev;
+    delete b.sim;
+}
+
+/*********************************************************************/
+/* balloon */
+
+#define VIRTIO_BALLOON_F_REPORTING 5
+
+#define BALLOON_INFLATE_Q   0
+#define BALLOON_REPORTING_Q 2
+
+#define BALLOON_REPORT_SIZE (4 << 20) /* a pageblock of the guest */
+#define BALLOON_NB_PFNS 256 /* VIRTIO_BALLOON_ARRAY_PFNS_MAX of Linux */
+
+typedef struct {
+    BOOL inflate;
+    uint64_t region_addr[MAX_SLOTS]; /* pages given to the device */
+} BalloonOp;
+
+/* the pages of the slot are written first, so that each request has
+   host memory to release */
+static void balloon_touch(Bench *b, uint64_t addr, uint32_t size)
+{
+    uint32_t pos;
+
+    for(pos = 0; pos < size; pos += PAGE_SIZE)
+        gpa(b, addr)[pos] = 0xa5;
+}
+
+static int balloon_submit(Bench *b, BenchOp *op, int slot)
+{
+    BalloonOp *o = (BalloonOp *)op->opaque;
+    uint64_t addr = o->region_addr[slot];
+    uint8_t *pfns;
+    Seg seg;
+    int i;
+
+    if (o->inflate) {
+        balloon_touch(b, addr, BALLOON_NB_PFNS * PAGE_SIZE);
+        pfns = gpa(b, b->buf_addr[slot]);
+        for(i = 0; i < BALLOON_NB_PFNS; i++)
+            put_le32(pfns + 4 * i, (addr >> 12) + i);
+        seg.addr = b->buf_addr[slot];
+        seg.len = 4 * BALLOON_NB_PFNS;
+        seg.write = FALSE;
+    } else {
+        /* one free range per request */
+        balloon_touch(b, addr, BALLOON_REPORT_SIZE);
+        seg.addr = addr;
+        seg.len = BALLOON_REPORT_SIZE;
+        seg.write = TRUE;
+    }
+    return queue_add(b, &b->q[op->queue_idx], slot, &seg, 1);
+}
+
+static uint64_t balloon_complete(Bench *b, BenchOp *op, int slot, uint32_t len)
+{
+    BalloonOp *o = (BalloonOp *)op->opaque;
+
+    /* the released pages read as zero */
+    if (gpa(b, o->region_addr[slot])[0] != 0)
+        fatal("the balloon pages were not released\n");
+    return o->inflate ? BALLOON_NB_PFNS * PAGE_SIZE : BALLOON_REPORT_SIZE;
+}
+
+static void bench_balloon(void)
+{
+    BenchStats st;
+    Bench b;
+    BalloonOp o;
+    BenchOp op = { balloon_submit, balloon_complete, &o };
+    int slot;
+
+    b.sim = new sim_t(RAM_BASE, RAM_SIZE, &b.intctrl);
+    bench_init(&b, new virtioballoon_t(b.sim, &b.intctrl, VIRTIO_BALLOON_IRQ,
+                                       device_args(balloon_args,
+                                                   { "stats=/dev/null" })),
+               3, PAGE_SIZE, 1ULL << VIRTIO_BALLOON_F_REPORTING);
+    for(slot = 0; slot < MAX_SLOTS; slot++)
+        o.region_addr[slot] = guest_alloc(&b, BALLOON_REPORT_SIZE);
+
+    o.inflate = TRUE;
+    op.queue_idx = BALLOON_INFLATE_Q;
+    run_requests(&b, &op, &st);
+    print_stats("bln", "inflate 1M", &st);
+
+    o.inflate = FALSE;
+    op.queue_idx = BALLOON_REPORTING_Q;
+    run_requests(&b, &op, &st);
+    print_stats("bln", "report 4M", &st);
+    delete b.dev;
+    delete b.sim;
+}
+
+/*********************************************************************/
+/* pmem */
+
+#define PMEM_IMAGE_SIZE (32 << 20)
+/* the region is at the end of the guest memory */
+#define PMEM_BASE (RAM_BASE + RAM_SIZE - PMEM_IMAGE_SIZE)
+
+typedef struct {
+    uint32_t dirty_size; /* bytes of the region written before a flush */
+    uint64_t next_offset;
+} PmemOp;
+
+/* slot buffer: the request type, then the status */
+static int pmem_submit(Bench *b, BenchOp *op, int slot)
+{
+    PmemOp *o = (PmemOp *)op->opaque;
+    uint64_t addr = b->buf_addr[slot];
+    uint32_t pos;
+    Seg segs[2];
+
+    if (o->next_offset + o->dirty_size > PMEM_IMAGE_SIZE)
+        o->next_offset = 0;
+    for(pos = 0; pos < o->dirty_size; pos += PAGE_SIZE)
+        gpa(b, PMEM_BASE + o->next_offset + pos)[0]++;
+    o->next_offset += o->dirty_size;
+    put_le32(gpa(b, addr), 0); /* VIRTIO_PMEM_REQ_TYPE_FLUSH */
+    put_le32(gpa(b, addr + 4), 0xffffffff);
+    segs[0].addr = addr;
+    segs[0].len = 4;
+    segs[0].write = FALSE;
+    segs[1].addr = addr + 4;
+    segs[1].len = 4;
+    segs[1].write = TRUE;
+    return queue_add(b, &b->q[0], slot, segs, 2);
+}
+
+static uint64_t pmem_complete(Bench *b, BenchOp *op, int slot, uint32_t len)
+{
+    PmemOp *o = (PmemOp *)op->opaque;
+
+    if (len != 4 || get_le32(gpa(b, b->buf_addr[slot] + 4)) != 0)
+        fatal("pmem flush failed\n");
+    return o->dirty_size;
+}
+
+static void bench_pmem(void)
+{
+    static const uint32_t sizes[] = { 0, 4096, 65536 };
+    std::string img;
+    uint8_t buf[PAGE_SIZE];
+    BenchStats st;
+    Bench b;
+    PmemOp o;
+    BenchOp op = { pmem_submit, pmem_complete, &o };
+    char name[64];
+    int fd, i;
+
+    img = std::string(scratch_dir) + "/virtio-bench-pmem.img";
+    if (create_image(img.c_str(), PMEM_IMAGE_SIZE) < 0)
+        fatal("could not create %s\n", img.c_str());
+    b.sim = new sim_t(RAM_BASE, RAM_SIZE, &b.intctrl);
+    bench_init(&b, new virtiopmem_t(b.sim, &b.intctrl, VIRTIO_PMEM_IRQ,
+                                    device_args(pmem_args,
+                                                { "img=" + img, "mode=rw",
+                                                  "base=" + std::to_string(PMEM_BASE),
+                                                  "stats=/dev/null" })),
+               1, PAGE_SIZE);
+    /* the image is in the region */
+    if (gpa(&b, PMEM_BASE + 65536 + 1)[0] != 7)
+        fatal("the image is not in the pmem region\n");
+
+    o.next_offset = 0;
+    op.queue_idx = 0;
+    for(i = 0; i < (int)countof(sizes); i++) {
+        o.dirty_size = sizes[i];
+        run_requests(&b, &op, &st);
+        if (sizes[i] == 0)
+            snprintf(name, sizeof(name), "flush clean");
+        else
+            snprintf(name, sizeof(name), "flush %uK dirty", sizes[i] / 1024);
+        print_stats("pmem", name, &st);
+    }
+    delete b.dev;
+
+    /* the last written page went to the image */
+    fd = open(img.c_str(), O_RDONLY);
+    if (fd < 0 || pread(fd, buf, PAGE_SIZE, o.next_offset - PAGE_SIZE) !=
+        PAGE_SIZE || memcmp(buf, gpa(&b, PMEM_BASE + o.next_offset - PAGE_SIZE),
+                            PAGE_SIZE) != 0)
+        fatal("the pmem region was not written back\n");
+    close(fd);
+    delete b.sim;
+    unlink(img.c_str());
+}
+
+static void help(void)
+{
+    printf("usage: virtio-bench [options] [blk] [9p] [net] [con] [fs] [balloon] [pmem]\n"
+           "\n"
+           "Options:\n"
+           "-t ms     duration of each workload (default 500)\n"
+           "-q depth  requests in flight (default 1, max %d)\n"
+           "-d dir    directory of the block image and shared files (default /tmp)\n"
+           "-b opt    option of the block device, e.g. -b cache=writeback\n"
+           "-p opt    option of the 9p device, e.g. -p async=4\n"
+           "-n opt    option of the network device, e.g. -n irq_batch=8\n"
+           "-c opt    option of the console device, e.g. -c port1=file:log\n"
+           "-f opt    option of the virtio-fs device, e.g. -f cache=none\n"
+           "-l opt    option of the balloon device, e.g. -l reporting=0\n"
+           "-m opt    option of the pmem device, e.g. -m irq_batch=8\n",
+           MAX_SLOTS);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    BOOL run_blk, run_9p, run_net, run_con, run_fs, run_balloon, run_pmem;
+    int c, i;
+
+    while ((c = getopt(argc, argv, "t:q:d:b:p:n:c:f:l:m:h")) != -1) {
+        switch(c) {
+        case 't':
+            duration_ns = strtoll(optarg, NULL, 0) * 1000000;
+            break;
+        case 'q':
+            queue_depth = strtol(optarg, NULL, 0);
+            if (queue_depth < 1 || queue_depth > MAX_SLOTS)
+                help();
+            break;
+        case 'd':
+            scratch_dir = optarg;
+            break;
+        case 'b':
+            blk_args.push_back(optarg);
+            break;
+        case 'p':
+            p9_args.push_back(optarg);
+            break;
+        case 'n':
+            net_args.push_back(optarg);
+            break;
+        case 'c':
+            con_args.push_back(optarg);
+            break;
+        case 'f':
+            fs_args.push_back(optarg);
+            break;
+        case 'l':
+            balloon_args.push_back(optarg);
+            break;
+        case 'm':
+            pmem_args.push_back(optarg);
+            break;
+        default:
+            help();
+        }
+    }
+    run_blk = run_9p = run_net = run_con = run_fs = run_balloon = run_pmem =
+        (optind == argc);
+    for(i = optind; i < argc; i++) {
+        if (!strcmp(argv[i], "blk"))
+            run_blk = TRUE;
+        else if (!strcmp(argv[i], "9p"))
+            run_9p = TRUE;
+        else if (!strcmp(argv[i], "net"))
+            run_net = TRUE;
+        else if (!strcmp(argv[i], "con"))
+            run_con = TRUE;
+        else if (!strcmp(argv[i], "fs"))
+            run_fs = TRUE;
+        else if (!strcmp(argv[i], "balloon"))
+            run_balloon = TRUE;
+        else if (!strcmp(argv[i], "pmem"))
+            run_pmem = TRUE;
+        else
+            help();
+    }
+
+    print_header();
+    if (run_blk)
+        bench_blk();
+    if (run_9p)
+        bench_9p();
+    if (run_net)
+        bench_net();
+    if (run_con)
+        bench_con();
+    if (run_fs)
+        bench_fs();
+    if (run_balloon)
+        bench_balloon();
+    if (run_pmem)
+        bench_pmem();
+    return 0;
+}
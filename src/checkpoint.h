@@ -0,0 +1,125 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+// Device state saved alongside the architectural checkpoint of the
+// simulator. A blob is little endian:
+//   magic (u32), device name (u32 length + bytes), version of the
+//   device state (u32), payload length (u32), payload
+// The payload layout belongs to the device, which refuses a blob with
+// another name or a newer version than its own.
+
+#define DEVICE_STATE_MAGIC 0x53445053 // "SPDS"
+
+class device_state_writer_t {
+public:
+  device_state_writer_t(std::vector<uint8_t>& blob, const char *name,
+                        uint32_t version) : blob(blob) {
+    put_u32(DEVICE_STATE_MAGIC);
+    put_string(name);
+    put_u32(version);
+    len_pos = blob.size();
+    put_u32(0);
+  }
+
+  // set the payload length, once the device state is written
+  void end() {
+    uint32_t len = blob.size() - len_pos - 4;
+    for (int i = 0; i < 4; i++)
+      blob[len_pos + i] = len >> (8 * i);
+  }
+
+  void put_u8(uint8_t v) { blob.push_back(v); }
+  void put_u16(uint16_t v) { put_le(v, 2); }
+  void put_u32(uint32_t v) { put_le(v, 4); }
+  void put_u64(uint64_t v) { put_le(v, 8); }
+  void put_bytes(const void *buf, size_t len) {
+    const uint8_t *p = (const uint8_t *)buf;
+    blob.insert(blob.end(), p, p + len);
+  }
+  void put_string(const std::string& s) {
+    put_u32(s.size());
+    put_bytes(s.data(), s.size());
+  }
+
+private:
+  void put_le(uint64_t v, int n) {
+    for (int i = 0; i < n; i++)
+      blob.push_back(v >> (8 * i));
+  }
+
+  std::vector<uint8_t>& blob;
+  size_t len_pos;
+};
+
+// A read past the end of the payload returns zeros and sets the error
+// flag, so that the device checks ok() once after reading its fields.
+class device_state_reader_t {
+public:
+  device_state_reader_t(const std::vector<uint8_t>& blob, const char *name,
+                        uint32_t max_version)
+    : buf(blob.data()), pos(0), end(blob.size()), error(false) {
+    if (get_u32() != DEVICE_STATE_MAGIC || get_string() != name) {
+      error = true;
+      return;
+    }
+    ver = get_u32();
+    uint32_t len = get_u32();
+    if (error || ver > max_version || len > end - pos) {
+      error = true;
+      return;
+    }
+    end = pos + len;
+  }
+
+  bool ok() const { return !error; }
+  uint32_t version() const { return ver; }
+
+  uint8_t get_u8() { return get_le(1); }
+  uint16_t get_u16() { return get_le(2); }
+  uint32_t get_u32() { return get_le(4); }
+  uint64_t get_u64() { return get_le(8); }
+  void get_bytes(void *dst, size_t len) {
+    if (error || len > end - pos) {
+      error = true;
+      memset(dst, 0, len);
+      return;
+    }
+    memcpy(dst, buf + pos, len);
+    pos += len;
+  }
+  std::string get_string() {
+    uint32_t len = get_u32();
+    if (error || len > end - pos) {
+      error = true;
+      return std::string();
+    }
+    std::string s((const char *)buf + pos, len);
+    pos += len;
+    return s;
+  }
+
+private:
+  uint64_t get_le(int n) {
+    uint64_t v = 0;
+    if (error || (size_t)n > end - pos) {
+      error = true;
+      return 0;
+    }
+    for (int i = 0; i < n; i++)
+      v |= (uint64_t)buf[pos++] << (8 * i);
+    return v;
+  }
+
+  const uint8_t *buf;
+  size_t pos;
+  size_t end;
+  uint32_t ver = 0;
+  bool error;
+};
+
+#endif // CHECKPOINT_H
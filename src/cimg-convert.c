@@ -0,0 +1,409 @@
+/*
+ * Convert a raw block image to the compressed image format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include "cutils.h"
+#include "lz4.h"
+#include "cimg.h"
+
+/* stored chunk, found by the hash of its content */
+typedef struct StoredChunk {
+    struct StoredChunk *hash_next;
+    uint64_t hash;
+    uint64_t data_offset;
+    uint32_t size;
+    uint32_t method;
+} StoredChunk;
+
+typedef struct {
+    int fd; /* where the chunks are stored */
+    uint64_t end; /* end of the stored chunks */
+    int chunk_bits;
+    StoredChunk **hash_table;
+    int hash_size;
+    int nb_stored;
+    uint8_t *comp_buf;
+    uint8_t *cmp_buf;
+} ChunkStore;
+
+static void fatal(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static void fatal(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(stderr, "cimg-convert: ");
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+    exit(1);
+}
+
+static void write_all(int fd, const void *buf, size_t len, uint64_t offset)
+{
+    ssize_t ret;
+    while (len > 0) {
+        ret = pwrite(fd, buf, len, offset);
+        if (ret <= 0) {
+            perror("write");
+            exit(1);
+        }
+        buf = (const uint8_t *)buf + ret;
+        len -= ret;
+        offset += ret;
+    }
+}
+
+/* 64 bit hash of the chunk content. The chunks with the same hash are
+   compared before being shared. */
+static uint64_t chunk_hash(const uint8_t *buf, int len)
+{
+    uint64_t h, w;
+    int i;
+
+    h = 0x9e3779b97f4a7c15ULL ^ len;
+    for(i = 0; i < len; i += 8) {
+        memcpy(&w, buf + i, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 29;
+    }
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static BOOL is_zero(const uint8_t *buf, int len)
+{
+    int i;
+    for(i = 0; i < len; i++) {
+        if (buf[i] != 0)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static void store_add(ChunkStore *st, uint64_t hash, uint64_t data_offset,
+                      uint32_t size, uint32_t method)
+{
+    StoredChunk *c, **new_table, *c1;
+    int i, h, new_size;
+
+    if (st->nb_stored >= st->hash_size) {
+        new_size = st->hash_size * 2;
+        new_table = mallocz(sizeof(new_table[0]) * new_size);
+        for(i = 0; i < st->hash_size; i++) {
+            for(c = st->hash_table[i]; c; c = c1) {
+                c1 = c->hash_next;
+                h = c->hash & (new_size - 1);
+                c->hash_next = new_table[h];
+                new_table[h] = c;
+            }
+        }
+        free(st->hash_table);
+        st->hash_table = new_table;
+        st->hash_size = new_size;
+    }
+    c = mallocz(sizeof(*c));
+    c->hash = hash;
+    c->data_offset = data_offset;
+    c->size = size;
+    c->method = method;
+    h = hash & (st->hash_size - 1);
+    c->hash_next = st->hash_table[h];
+    st->hash_table[h] = c;
+    st->nb_stored++;
+}
+
+/* return TRUE if the stored chunk has the content buf */
+static BOOL store_compare(ChunkStore *st, StoredChunk *c, const uint8_t *buf)
+{
+    int chunk_size = 1 << st->chunk_bits;
+
+    if (pread(st->fd, st->comp_buf, c->size, c->data_offset) != c->size)
+        return FALSE;
+    if (c->method == CIMG_METHOD_RAW)
+        return c->size == chunk_size && !memcmp(st->comp_buf, buf, chunk_size);
+    if (lz4_decompress(st->cmp_buf, chunk_size, st->comp_buf, c->size) !=
+        chunk_size)
+        return FALSE;
+    return !memcmp(st->cmp_buf, buf, chunk_size);
+}
+
+/* find or store the chunk. Return TRUE if it was already stored. */
+static BOOL store_chunk(ChunkStore *st, const uint8_t *buf, BOOL compress,
+                        uint64_t *pdata_offset, uint32_t *psize,
+                        uint32_t *pmethod)
+{
+    uint8_t h[CIMG_BLOB_HEADER_SIZE];
+    StoredChunk *c;
+    uint64_t hash;
+    int chunk_size, size;
+    uint32_t method;
+    const uint8_t *data;
+
+    chunk_size = 1 << st->chunk_bits;
+    hash = chunk_hash(buf, chunk_size);
+    for(c = st->hash_table[hash & (st->hash_size - 1)]; c; c = c->hash_next) {
+        if (c->hash == hash && store_compare(st, c, buf)) {
+            *pdata_offset = c->data_offset;
+            *psize = c->size;
+            *pmethod = c->method;
+            return TRUE;
+        }
+    }
+
+    size = 0;
+    if (compress)
+        size = lz4_compress(st->comp_buf, chunk_size - 1, buf, chunk_size);
+    if (size > 0) {
+        method = CIMG_METHOD_LZ4;
+        data = st->comp_buf;
+    } else {
+        /* not compressible */
+        method = CIMG_METHOD_RAW;
+        size = chunk_size;
+        data = buf;
+    }
+    memset(h, 0, sizeof(h));
+    put_le64(h + CIMG_B_HASH, hash);
+    put_le32(h + CIMG_B_SIZE, size);
+    put_le32(h + CIMG_B_METHOD, method);
+    put_le32(h + CIMG_B_CHUNK_BITS, st->chunk_bits);
+    write_all(st->fd, h, sizeof(h), st->end);
+    write_all(st->fd, data, size, st->end + sizeof(h));
+    store_add(st, hash, st->end + sizeof(h), size, method);
+    *pdata_offset = st->end + sizeof(h);
+    *psize = size;
+    *pmethod = method;
+    st->end += sizeof(h) + size;
+    return FALSE;
+}
+
+/* open or create the pack file and index the chunks it contains */
+static void store_open_pack(ChunkStore *st, const char *filename)
+{
+    uint8_t h[CIMG_HEADER_SIZE];
+    struct stat stat_buf;
+    uint64_t pos;
+    uint32_t size;
+
+    st->fd = open(filename, O_RDWR | O_CREAT, 0644);
+    if (st->fd < 0 || fstat(st->fd, &stat_buf) < 0) {
+        perror(filename);
+        exit(1);
+    }
+    if (stat_buf.st_size == 0) {
+        memset(h, 0, sizeof(h));
+        memcpy(h + CIMG_H_MAGIC, CIMG_PACK_MAGIC, 8);
+        put_le32(h + CIMG_H_VERSION, CIMG_VERSION);
+        put_le32(h + CIMG_H_CHUNK_BITS, st->chunk_bits);
+        write_all(st->fd, h, sizeof(h), 0);
+        st->end = CIMG_HEADER_SIZE;
+        return;
+    }
+    if (pread(st->fd, h, sizeof(h), 0) != sizeof(h) ||
+        memcmp(h + CIMG_H_MAGIC, CIMG_PACK_MAGIC, 8) != 0 ||
+        get_le32(h + CIMG_H_VERSION) != CIMG_VERSION)
+        fatal("%s: not a pack file", filename);
+    if (get_le32(h + CIMG_H_CHUNK_BITS) != st->chunk_bits)
+        fatal("%s: the pack uses %d KiB chunks", filename,
+              1 << (get_le32(h + CIMG_H_CHUNK_BITS) - 10));
+    pos = CIMG_HEADER_SIZE;
+    for(;;) {
+        if (pos + CIMG_BLOB_HEADER_SIZE > stat_buf.st_size)
+            break;
+        if (pread(st->fd, h, CIMG_BLOB_HEADER_SIZE, pos) !=
+            CIMG_BLOB_HEADER_SIZE)
+            break;
+        size = get_le32(h + CIMG_B_SIZE);
+        if (pos + CIMG_BLOB_HEADER_SIZE + size > stat_buf.st_size)
+            break;
+        store_add(st, get_le64(h + CIMG_B_HASH), pos + CIMG_BLOB_HEADER_SIZE,
+                  size, get_le32(h + CIMG_B_METHOD));
+        pos += CIMG_BLOB_HEADER_SIZE + size;
+    }
+    /* a truncated chunk left by an interrupted conversion is
+       overwritten */
+    st->end = pos;
+}
+
+static void help(void)
+{
+    printf("usage: cimg-convert [options] input.img output.cimg\n"
+           "\n"
+           "Convert a raw block image to a read only compressed and deduplicated image.\n"
+           "\n"
+           "Options:\n"
+           "-b chunk_kib  chunk size in KiB, power of two from 4 to 1024 (default %d)\n"
+           "-p pack       store the chunks in the pack file, shared by the images\n"
+           "              converted with the same pack\n"
+           "-r            do not compress the chunks\n",
+           1 << (CIMG_DEFAULT_CHUNK_BITS - 10));
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    const char *in_filename, *out_filename, *pack_filename;
+    char pack_path[PATH_MAX];
+    ChunkStore st_s, *st = &st_s;
+    uint8_t h[CIMG_HEADER_SIZE], *buf, *index, *e;
+    uint64_t image_size, nb_chunks, i, index_offset, data_offset;
+    uint64_t nb_zero, nb_shared, stored_bytes;
+    uint32_t size, method;
+    int c, chunk_bits, chunk_size, in_fd, out_fd;
+    ssize_t ret;
+    BOOL compress;
+    struct stat stat_buf;
+
+    chunk_bits = CIMG_DEFAULT_CHUNK_BITS;
+    pack_filename = NULL;
+    compress = TRUE;
+    while ((c = getopt(argc, argv, "hb:p:r")) != -1) {
+        switch(c) {
+        case 'b':
+            {
+                int kib = strtol(optarg, NULL, 0);
+                for(chunk_bits = CIMG_MIN_CHUNK_BITS;
+                    chunk_bits <= CIMG_MAX_CHUNK_BITS &&
+                        (1 << (chunk_bits - 10)) != kib; chunk_bits++)
+                    continue;
+                if (chunk_bits > CIMG_MAX_CHUNK_BITS)
+                    fatal("invalid chunk size: %s", optarg);
+            }
+            break;
+        case 'p':
+            pack_filename = optarg;
+            break;
+        case 'r':
+            compress = FALSE;
+            break;
+        default:
+            help();
+        }
+    }
+    if (optind + 2 != argc)
+        help();
+    in_filename = argv[optind];
+    out_filename = argv[optind + 1];
+    chunk_size = 1 << chunk_bits;
+
+    in_fd = open(in_filename, O_RDONLY);
+    if (in_fd < 0 || fstat(in_fd, &stat_buf) < 0) {
+        perror(in_filename);
+        exit(1);
+    }
+    image_size = stat_buf.st_size;
+    nb_chunks = (image_size + chunk_size - 1) >> chunk_bits;
+
+    memset(st, 0, sizeof(*st));
+    st->chunk_bits = chunk_bits;
+    st->hash_size = 1024;
+    st->hash_table = mallocz(sizeof(st->hash_table[0]) * st->hash_size);
+    st->comp_buf = malloc(chunk_size);
+    st->cmp_buf = malloc(chunk_size);
+    index_offset = CIMG_HEADER_SIZE;
+    if (pack_filename) {
+        store_open_pack(st, pack_filename);
+        /* the images can be used from any directory */
+        if (!realpath(pack_filename, pack_path))
+            fatal("%s: cannot resolve the path", pack_filename);
+        if (strlen(pack_path) >= CIMG_PACK_NAME_SIZE)
+            fatal("%s: path too long", pack_path);
+    } else {
+        /* the chunks follow the index */
+        st->end = (index_offset + nb_chunks * CIMG_ENTRY_SIZE +
+                   CIMG_HEADER_SIZE - 1) & ~(uint64_t)(CIMG_HEADER_SIZE - 1);
+        pack_path[0] = '\0';
+    }
+    out_fd = open(out_filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        perror(out_filename);
+        exit(1);
+    }
+    if (!pack_filename)
+        st->fd = out_fd;
+
+    buf = malloc(chunk_size);
+    index = mallocz(nb_chunks * CIMG_ENTRY_SIZE);
+    nb_zero = 0;
+    nb_shared = 0;
+    stored_bytes = 0;
+    for(i = 0; i < nb_chunks; i++) {
+        /* the last chunk is padded with zeros */
+        memset(buf, 0, chunk_size);
+        ret = pread(in_fd, buf, chunk_size, i << chunk_bits);
+        if (ret < 0) {
+            perror(in_filename);
+            exit(1);
+        }
+        e = index + i * CIMG_ENTRY_SIZE;
+        if (is_zero(buf, chunk_size)) {
+            put_le32(e + CIMG_E_METHOD, CIMG_METHOD_ZERO);
+            nb_zero++;
+            continue;
+        }
+        if (store_chunk(st, buf, compress, &data_offset, &size, &method))
+            nb_shared++;
+        else
+            stored_bytes += CIMG_BLOB_HEADER_SIZE + size;
+        put_le64(e + CIMG_E_OFFSET, data_offset);
+        put_le32(e + CIMG_E_SIZE, size);
+        put_le32(e + CIMG_E_METHOD, method);
+    }
+
+    write_all(out_fd, index, nb_chunks * CIMG_ENTRY_SIZE, index_offset);
+    memset(h, 0, sizeof(h));
+    memcpy(h + CIMG_H_MAGIC, CIMG_MAGIC, 8);
+    put_le32(h + CIMG_H_VERSION, CIMG_VERSION);
+    put_le32(h + CIMG_H_CHUNK_BITS, chunk_bits);
+    put_le64(h + CIMG_H_IMAGE_SIZE, image_size);
+    put_le64(h + CIMG_H_NB_CHUNKS, nb_chunks);
+    put_le64(h + CIMG_H_INDEX_OFFSET, index_offset);
+    strcpy((char *)h + CIMG_H_PACK_NAME, pack_path);
+    write_all(out_fd, h, sizeof(h), 0);
+    /* the header is written last: an interrupted conversion does not
+       leave a valid image */
+    if (fsync(out_fd) < 0 || (pack_filename && fsync(st->fd) < 0)) {
+        perror("fsync");
+        exit(1);
+    }
+
+    printf("%s: %" PRIu64 " chunks of %d KiB, %" PRIu64 " zero, %" PRIu64
+           " shared, %" PRIu64 " bytes stored (%.1f%%)\n",
+           out_filename, nb_chunks, chunk_size >> 10, nb_zero, nb_shared,
+           stored_bytes,
+           image_size ? 100.0 * stored_bytes / image_size : 0.0);
+    close(in_fd);
+    close(out_fd);
+    return 0;
+}
@@ -0,0 +1,74 @@
+/*
+ * Compressed and deduplicated block image format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef CIMG_H
+#define CIMG_H
+
+/* A .cimg image is read only and split in fixed size chunks. It
+   contains:
+   - a header (CIMG_HEADER_SIZE bytes),
+   - the chunk index: one entry per chunk giving where its data is
+     stored and how it is compressed,
+   - the stored chunks, unless they are in a pack file.
+   The stored chunks are identified by the hash of their content, so
+   that identical chunks are stored once. A pack file holds the chunks
+   of several images: it starts with a header and is only appended to.
+   All the values are little endian. */
+
+#define CIMG_MAGIC "SPIKECIM"
+#define CIMG_PACK_MAGIC "SPIKECPK"
+#define CIMG_VERSION 1
+#define CIMG_HEADER_SIZE 4096
+
+#define CIMG_MIN_CHUNK_BITS 12
+#define CIMG_MAX_CHUNK_BITS 20
+#define CIMG_DEFAULT_CHUNK_BITS 16
+
+/* image and pack header */
+#define CIMG_H_MAGIC        0
+#define CIMG_H_VERSION      8 /* le32 */
+#define CIMG_H_CHUNK_BITS  12 /* le32 */
+#define CIMG_H_IMAGE_SIZE  16 /* le64, in bytes (image only) */
+#define CIMG_H_NB_CHUNKS   24 /* le64 (image only) */
+#define CIMG_H_INDEX_OFFSET 32 /* le64 (image only) */
+/* path of the pack file, relative to the image directory if not
+   absolute. Empty if the chunks are stored in the image. */
+#define CIMG_H_PACK_NAME   64
+#define CIMG_PACK_NAME_SIZE 1024
+
+/* index entry */
+#define CIMG_E_OFFSET 0 /* le64, offset of the data in the image or pack */
+#define CIMG_E_SIZE   8 /* le32, stored size */
+#define CIMG_E_METHOD 12 /* le32 */
+#define CIMG_ENTRY_SIZE 16
+
+#define CIMG_METHOD_ZERO 0 /* not stored */
+#define CIMG_METHOD_RAW  1
+#define CIMG_METHOD_LZ4  2 /* LZ4 block format */
+
+/* stored chunk: a header followed by the data */
+#define CIMG_B_HASH   0 /* le64, of the uncompressed chunk */
+#define CIMG_B_SIZE   8 /* le32, stored size */
+#define CIMG_B_METHOD 12 /* le32 */
+#define CIMG_B_CHUNK_BITS 16 /* le32 */
+#define CIMG_BLOB_HEADER_SIZE 24
+
+#endif /* CIMG_H */
@@ -0,0 +1,239 @@
+#ifndef DEVICE_SCHED_H
+#define DEVICE_SCHED_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "list.h"
+
+// Deadlines of a device in spike RTC ticks, and completions posted by
+// its backend threads.
+//
+// The timers are kept in a hierarchical timer wheel: DEVICE_SCHED_LEVELS
+// levels of DEVICE_SCHED_SLOTS slots, a level covering
+// DEVICE_SCHED_SLOTS times the range of the previous one. A timer is
+// filed in the slot of its expiry tick at the lowest level whose range
+// contains it, and moved down one level when the lower levels wrap.
+// Arming and cancelling a timer are O(1), and the ticks without a
+// pending timer cost a bitmap test, so that the tick of an idle device
+// does nothing. The deadlines past the range of the wheel are moved
+// down again when they come in range.
+//
+// The structures have no constructor: they are usable once their init()
+// method is called, also after a memset to zero. They are only accessed
+// by the simulation thread, except device_mailbox_t::post().
+
+#define DEVICE_SCHED_LEVEL_BITS 6
+#define DEVICE_SCHED_SLOTS (1 << DEVICE_SCHED_LEVEL_BITS)
+#define DEVICE_SCHED_LEVELS 4 // 2^24 ticks
+
+struct device_timer_t {
+  struct list_head link;
+  uint64_t expires; // tick of the deadline
+  // called by device_sched_t::advance() once the deadline is reached,
+  // the timer is disarmed and can be armed again
+  void (*cb)(device_timer_t *t);
+  void *opaque;
+  int level; // < 0 if not armed
+  int slot;
+
+  void init(void (*cb)(device_timer_t *t), void *opaque) {
+    link.prev = link.next = NULL;
+    expires = 0;
+    this->cb = cb;
+    this->opaque = opaque;
+    level = -1;
+    slot = 0;
+  }
+  bool armed() const { return level >= 0; }
+};
+
+struct device_sched_t {
+  uint64_t next_tick; // first tick not processed yet
+  int nb_armed;
+  uint64_t slot_mask[DEVICE_SCHED_LEVELS]; // non empty slots
+  struct list_head slots[DEVICE_SCHED_LEVELS][DEVICE_SCHED_SLOTS];
+
+  void init(uint64_t now) {
+    for (int l = 0; l < DEVICE_SCHED_LEVELS; l++) {
+      for (int i = 0; i < DEVICE_SCHED_SLOTS; i++)
+        init_list_head(&slots[l][i]);
+      slot_mask[l] = 0;
+    }
+    nb_armed = 0;
+    next_tick = now + 1;
+  }
+
+  // disarm all the timers and restart at tick 'now'
+  void reset(uint64_t now) {
+    for (int l = 0; l < DEVICE_SCHED_LEVELS; l++) {
+      for (int i = 0; i < DEVICE_SCHED_SLOTS; i++) {
+        while (!list_empty(&slots[l][i])) {
+          device_timer_t *t = list_entry(slots[l][i].next, device_timer_t, link);
+          list_del(&t->link);
+          t->level = -1;
+        }
+      }
+      slot_mask[l] = 0;
+    }
+    nb_armed = 0;
+    next_tick = now + 1;
+  }
+
+  // restart at tick 'now', e.g. when a checkpoint is restored: the
+  // armed timers keep the delay left before their deadline
+  void rebase(uint64_t now) {
+    struct list_head list;
+    uint64_t shift = now + 1 - next_tick;
+
+    init_list_head(&list);
+    for (int l = 0; l < DEVICE_SCHED_LEVELS; l++) {
+      for (int i = 0; i < DEVICE_SCHED_SLOTS; i++) {
+        while (!list_empty(&slots[l][i])) {
+          struct list_head *el = slots[l][i].next;
+          list_del(el);
+          list_add_tail(el, &list);
+        }
+      }
+      slot_mask[l] = 0;
+    }
+    next_tick = now + 1;
+    while (!list_empty(&list)) {
+      device_timer_t *t = list_entry(list.next, device_timer_t, link);
+      list_del(&t->link);
+      t->expires += shift;
+      insert(t);
+    }
+  }
+
+  bool idle() const { return nb_armed == 0; }
+  // last tick processed by advance()
+  uint64_t now() const { return next_tick - 1; }
+
+  // the callback of t is called at the first advance() to a tick >=
+  // expires, at the next one if the deadline is already past
+  void arm(device_timer_t *t, uint64_t expires) {
+    if (t->armed())
+      cancel(t);
+    t->expires = expires;
+    insert(t);
+    nb_armed++;
+  }
+
+  void cancel(device_timer_t *t) {
+    if (!t->armed())
+      return;
+    list_del(&t->link);
+    if (list_empty(&slots[t->level][t->slot]))
+      slot_mask[t->level] &= ~(1ULL << t->slot);
+    t->level = -1;
+    nb_armed--;
+  }
+
+  // run the timers whose deadline is <= now, in deadline order
+  void advance(uint64_t now) {
+    while (next_tick <= now) {
+      if (nb_armed == 0) {
+        next_tick = now + 1;
+        break;
+      }
+      uint64_t tick = next_tick;
+      int idx = tick & (DEVICE_SCHED_SLOTS - 1);
+      if (idx == 0) {
+        cascade(tick);
+      } else if ((slot_mask[0] >> idx) == 0) {
+        // nothing before the next wrap of the first level
+        uint64_t wrap = (tick | (DEVICE_SCHED_SLOTS - 1)) + 1;
+        next_tick = wrap <= now ? wrap : now + 1;
+        continue;
+      }
+      next_tick = tick + 1;
+      if (slot_mask[0] & (1ULL << idx))
+        run_slot(idx);
+    }
+  }
+
+private:
+  void insert(device_timer_t *t) {
+    uint64_t expires = t->expires < next_tick ? next_tick : t->expires;
+    uint64_t delta = expires - next_tick;
+    int level = 0;
+
+    while (level < DEVICE_SCHED_LEVELS - 1 &&
+           delta >= (1ULL << (DEVICE_SCHED_LEVEL_BITS * (level + 1))))
+      level++;
+    if (delta >> (DEVICE_SCHED_LEVEL_BITS * DEVICE_SCHED_LEVELS))
+      expires = next_tick + (1ULL << (DEVICE_SCHED_LEVEL_BITS * DEVICE_SCHED_LEVELS)) - 1;
+    t->level = level;
+    t->slot = (expires >> (DEVICE_SCHED_LEVEL_BITS * level)) & (DEVICE_SCHED_SLOTS - 1);
+    list_add_tail(&t->link, &slots[level][t->slot]);
+    slot_mask[level] |= 1ULL << t->slot;
+  }
+
+  // move the timers of the slots reached at 'tick' one level down
+  void cascade(uint64_t tick) {
+    for (int l = 1; l < DEVICE_SCHED_LEVELS; l++) {
+      int idx = (tick >> (DEVICE_SCHED_LEVEL_BITS * l)) & (DEVICE_SCHED_SLOTS - 1);
+      struct list_head *head = &slots[l][idx];
+      while (!list_empty(head)) {
+        device_timer_t *t = list_entry(head->next, device_timer_t, link);
+        list_del(&t->link);
+        insert(t);
+      }
+      slot_mask[l] &= ~(1ULL << idx);
+      if (idx != 0)
+        break;
+    }
+  }
+
+  // the callbacks can arm and cancel any timer
+  void run_slot(int idx) {
+    struct list_head *head = &slots[0][idx];
+    while (!list_empty(head)) {
+      device_timer_t *t = list_entry(head->next, device_timer_t, link);
+      list_del(&t->link);
+      t->level = -1;
+      nb_armed--;
+      t->cb(t);
+    }
+    slot_mask[0] &= ~(1ULL << idx);
+  }
+};
+
+// Completions posted by any thread and taken by the simulation thread,
+// e.g. from the device tick. T has a 'T *next' field. The elements are
+// taken in the order they were posted. An all zero mailbox is empty.
+template <typename T>
+struct device_mailbox_t {
+  T *head; // most recent first
+
+  void init() { head = NULL; }
+
+  // return true if the mailbox was empty
+  bool post(T *e) {
+    e->next = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&head, &e->next, e, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      continue;
+    return e->next == NULL;
+  }
+
+  // a single load, for the ticks without completions
+  bool pending() const {
+    return __atomic_load_n(&head, __ATOMIC_RELAXED) != NULL;
+  }
+
+  // the posted elements, linked by 'next' in posting order
+  T *take() {
+    T *e = __atomic_exchange_n(&head, (T *)NULL, __ATOMIC_ACQUIRE);
+    T *list = NULL;
+    while (e) {
+      T *next = e->next;
+      e->next = list;
+      list = e;
+      e = next;
+    }
+    return list;
+  }
+};
+
+#endif // DEVICE_SCHED_H
@@ -0,0 +1,151 @@
+/*
+ * Guest memory access for the DMA capable devices
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef DMA_H
+#define DMA_H
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <riscv/simif.h>
+#include <riscv/mmu.h>
+
+/* the guest RAM is contiguous in the host within a page */
+#define DMA_PAGE_SIZE 4096
+
+/* Resolve a guest physical address to a host pointer through the
+   simulator memory map. simif_t::addr_to_mem() returns NULL for MMIO
+   and unbacked addresses, in which case the caller must fall back to
+   the debug MMU. */
+static inline uint8_t *dma_get_ram_ptr(const simif_t *sim, reg_t paddr)
+{
+    return (uint8_t *)const_cast<simif_t *>(sim)->addr_to_mem(paddr);
+}
+
+/* copy len bytes of guest memory at paddr to buf: one lookup and one
+   memcpy per guest page */
+static inline void dma_memcpy_from_ram(const simif_t *sim, uint8_t *buf,
+                                       reg_t paddr, size_t len)
+{
+    mmu_t *simdram = sim->debug_mmu;
+    uint8_t *ptr;
+    size_t l, i;
+
+    while (len > 0) {
+        l = DMA_PAGE_SIZE - (paddr & (DMA_PAGE_SIZE - 1));
+        if (l > len)
+            l = len;
+        ptr = dma_get_ram_ptr(sim, paddr);
+        if (ptr) {
+            memcpy(buf, ptr, l);
+        } else {
+            for(i = 0; i < l; i++)
+                buf[i] = simdram->load<uint8_t>(paddr + i);
+        }
+        paddr += l;
+        buf += l;
+        len -= l;
+    }
+}
+
+static inline void dma_memcpy_to_ram(const simif_t *sim, reg_t paddr,
+                                     const uint8_t *buf, size_t len)
+{
+    mmu_t *simdram = sim->debug_mmu;
+    uint8_t *ptr;
+    size_t l, i;
+
+    while (len > 0) {
+        l = DMA_PAGE_SIZE - (paddr & (DMA_PAGE_SIZE - 1));
+        if (l > len)
+            l = len;
+        ptr = dma_get_ram_ptr(sim, paddr);
+        if (ptr) {
+            memcpy(ptr, buf, l);
+        } else {
+            for(i = 0; i < l; i++)
+                simdram->store<uint8_t>(paddr + i, buf[i]);
+        }
+        paddr += l;
+        buf += l;
+        len -= l;
+    }
+}
+
+/* release the host memory of the guest RAM [paddr, paddr + len), e.g.
+   the pages freed by the guest. The guest pages are gathered in runs
+   which are contiguous in the host, and the host pages wholly inside a
+   run are given back with madvise(MADV_DONTNEED): they read as zero
+   when touched again. The rest of the range is left unchanged. Return
+   the number of bytes released.
+
+   The lookup of a page the guest has never touched allocates it in a
+   sparse memory such as the mem_t of spike, which gives each guest page
+   its own host block. Such a memory is detected by the first two
+   consecutive guest pages which are not contiguous in the host, and the
+   pages are no longer looked up: nothing can be released there without
+   a virtio_set_ram_discard() function which knows the memory layout of
+   the simulator. */
+static inline uint64_t dma_discard_ram(const simif_t *sim, reg_t paddr,
+                                       uint64_t len)
+{
+    static uintptr_t host_page_size;
+    static bool sparse_ram;
+    uint8_t *run, *ptr;
+    uintptr_t start, end;
+    uint64_t run_len, l, released;
+
+    if (!host_page_size)
+        host_page_size = sysconf(_SC_PAGESIZE);
+    released = 0;
+    while (len > 0 && !sparse_ram) {
+        run = NULL;
+        run_len = 0;
+        while (len > 0) {
+            l = DMA_PAGE_SIZE - (paddr & (DMA_PAGE_SIZE - 1));
+            if (l > len)
+                l = len;
+            ptr = dma_get_ram_ptr(sim, paddr);
+            if (run && ptr != run + run_len) {
+                if (ptr)
+                    sparse_ram = true;
+                break;
+            }
+            paddr += l;
+            len -= l;
+            if (!ptr)
+                break;
+            if (!run)
+                run = ptr;
+            run_len += l;
+        }
+        if (!run)
+            continue;
+        start = ((uintptr_t)run + host_page_size - 1) & ~(host_page_size - 1);
+        end = ((uintptr_t)run + run_len) & ~(host_page_size - 1);
+        if (end > start && madvise((void *)start, end - start,
+                                   MADV_DONTNEED) == 0)
+            released += end - start;
+    }
+    return released;
+}
+
+#endif /* DMA_H */
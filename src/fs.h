@@ -23,6 +23,7 @@
  */
 
 #include <inttypes.h>
+#include <sys/uio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -93,6 +94,7 @@ extern "C" {
 #define	P9_ENOTDIR   20
 #define P9_EINVAL    22
 #define	P9_ENOSPC    28
+#define	P9_EROFS     30
 #define P9_ENOTEMPTY 39
 #define P9_EPROTO    71
 #define P9_ENOTSUP   524
@@ -156,6 +158,16 @@ typedef struct {
     char *client_id;
 } FSLock;
 
+/* cache statistics */
+typedef struct {
+    uint64_t attr_hits;
+    uint64_t attr_misses;
+    uint64_t dir_hits; /* readdir served from a directory snapshot */
+    uint64_t dir_misses; /* directory snapshots taken */
+    uint64_t wb_writes; /* writes buffered */
+    uint64_t wb_flushes; /* host writes of the buffers */
+} FSStats;
+
 typedef void FSOpenCompletionFunc(FSDevice *fs, FSQID *qid, int err,
                                   void *opaque);
 
@@ -185,6 +197,12 @@ struct FSDevice {
             uint8_t *buf, int count);
     int (*fs_write)(FSDevice *fs, FSFile *f, uint64_t offset,
              const uint8_t *buf, int count);
+    /* same as fs_read/fs_write with a scatter-gather list, e.g. the
+       guest buffers. Can be NULL. */
+    int (*fs_readv)(FSDevice *fs, FSFile *f, uint64_t offset,
+                    const struct iovec *iov, int iovcnt);
+    int (*fs_writev)(FSDevice *fs, FSFile *f, uint64_t offset,
+                     const struct iovec *iov, int iovcnt);
     int (*fs_link)(FSDevice *fs, FSFile *df, FSFile *f, const char *name);
     int (*fs_symlink)(FSDevice *fs, FSQID *qid,
                       FSFile *f, const char *name, const char *symgt, uint32_t gid);
@@ -197,9 +215,24 @@ struct FSDevice {
     int (*fs_unlinkat)(FSDevice *fs, FSFile *f, const char *name);
     int (*fs_lock)(FSDevice *fs, FSFile *f, const FSLock *lock);
     int (*fs_getlock)(FSDevice *fs, FSFile *f, FSLock *lock);
+    /* write the data buffered for the file. Can be NULL. */
+    int (*fs_fsync)(FSDevice *fs, FSFile *f);
+    /* called periodically by the device, e.g. to write the buffered
+       data. Can be NULL. */
+    void (*fs_poll)(FSDevice *fs);
+    void (*fs_get_stats)(FSDevice *fs, FSStats *st); /* can be NULL */
+    /* path of the file relative to the root, its uid and its open
+       flags (P9_O_x, -1 if it is not opened), so that the device can
+       save its fids. Return < 0 if the file cannot be saved. Can be
+       NULL. */
+    int (*fs_get_file_info)(FSDevice *fs, FSFile *f, char *buf, int buf_size,
+                            uint32_t *puid, int *popen_flags);
 };
 
 FSDevice *fs_disk_init(const char *root_path);
+int fs_disk_set_attr_cache(FSDevice *fs, int max_entries, int ttl_ms);
+void fs_disk_set_writeback(FSDevice *fs, int delay_ms);
+FSDevice *fs_archive_init(const char *filename);
 
 void fs_export_file(const char *filename,
                     const uint8_t *buf, int buf_len);
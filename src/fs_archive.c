@@ -0,0 +1,848 @@
+/*
+ * Read-only filesystem served from a tar archive
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <inttypes.h>
+#include <assert.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "cutils.h"
+#include "fs.h"
+
+/* The archive (ustar, GNU or pax tar) is mapped read only and its
+   headers are parsed once into a tree of nodes. The file data is not
+   copied: the nodes point into the mapping, so that walk, getattr,
+   readdir and read are served from memory. */
+
+#define TAR_BLOCK_SIZE 512
+
+typedef struct FSNode {
+    struct FSNode *parent; /* the root is its own parent */
+    struct FSNode *hash_next;
+    char *name;
+    uint32_t mode; /* P9_S_IFx and permission bits */
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t nlink;
+    uint64_t rdev;
+    uint64_t size;
+    uint64_t mtime;
+    uint64_t ino;
+    const uint8_t *data; /* regular files, in the mapping */
+    char *link_target; /* symbolic links */
+    /* directories, in archive order */
+    int nb_children;
+    int children_size;
+    struct FSNode **children;
+} FSNode;
+
+typedef struct {
+    FSDevice common;
+    uint8_t *map_base;
+    size_t map_size;
+    FSNode *root;
+    int nb_nodes;
+    int nodes_size;
+    FSNode **nodes; /* all the nodes, ino - 1 is the index */
+    /* lookup of (parent, name) */
+    int hash_bits;
+    FSNode **hash_table;
+} FSDeviceArchive;
+
+struct FSFile {
+    FSNode *node;
+    uint32_t uid;
+    BOOL is_opened;
+};
+
+static uint32_t node_hash(FSNode *parent, const char *name, int name_len)
+{
+    uint32_t h;
+    int i;
+
+    h = 2166136261 ^ (uint32_t)((uintptr_t)parent * 0x9e3779b1);
+    for(i = 0; i < name_len; i++) {
+        h ^= (uint8_t)name[i];
+        h *= 16777619;
+    }
+    return h;
+}
+
+static FSNode *node_lookup(FSDeviceArchive *fs, FSNode *parent,
+                           const char *name, int name_len)
+{
+    FSNode *n;
+    uint32_t h;
+
+    h = node_hash(parent, name, name_len) & ((1 << fs->hash_bits) - 1);
+    for(n = fs->hash_table[h]; n != NULL; n = n->hash_next) {
+        if (n->parent == parent && !strncmp(n->name, name, name_len) &&
+            n->name[name_len] == '\0')
+            return n;
+    }
+    return NULL;
+}
+
+static void node_hash_insert(FSDeviceArchive *fs, FSNode *n)
+{
+    uint32_t h;
+
+    h = node_hash(n->parent, n->name, strlen(n->name)) &
+        ((1 << fs->hash_bits) - 1);
+    n->hash_next = fs->hash_table[h];
+    fs->hash_table[h] = n;
+}
+
+static int node_hash_resize(FSDeviceArchive *fs, int hash_bits)
+{
+    FSNode **tab;
+    int i;
+
+    tab = mallocz(sizeof(tab[0]) << hash_bits);
+    if (!tab)
+        return -1;
+    free(fs->hash_table);
+    fs->hash_table = tab;
+    fs->hash_bits = hash_bits;
+    /* the root is not in the table */
+    for(i = 1; i < fs->nb_nodes; i++)
+        node_hash_insert(fs, fs->nodes[i]);
+    return 0;
+}
+
+static FSNode *node_new(FSDeviceArchive *fs, FSNode *parent,
+                        const char *name, int name_len, uint32_t mode)
+{
+    FSNode *n, **tab;
+    int size;
+
+    if (fs->nb_nodes >= fs->nodes_size) {
+        size = max_int(fs->nodes_size * 2, 64);
+        tab = realloc(fs->nodes, sizeof(tab[0]) * size);
+        if (!tab)
+            return NULL;
+        fs->nodes = tab;
+        fs->nodes_size = size;
+    }
+    n = mallocz(sizeof(*n));
+    if (!n)
+        return NULL;
+    n->name = malloc(name_len + 1);
+    if (!n->name) {
+        free(n);
+        return NULL;
+    }
+    memcpy(n->name, name, name_len);
+    n->name[name_len] = '\0';
+    n->mode = mode;
+    n->nlink = ((mode & P9_S_IFMT) == P9_S_IFDIR) ? 2 : 1;
+    fs->nodes[fs->nb_nodes++] = n;
+    n->ino = fs->nb_nodes;
+    if (!parent) {
+        n->parent = n;
+        return n;
+    }
+    n->parent = parent;
+    if (parent->nb_children >= parent->children_size) {
+        size = max_int(parent->children_size * 2, 8);
+        tab = realloc(parent->children, sizeof(tab[0]) * size);
+        if (!tab)
+            return NULL;
+        parent->children = tab;
+        parent->children_size = size;
+    }
+    parent->children[parent->nb_children++] = n;
+    if ((mode & P9_S_IFMT) == P9_S_IFDIR)
+        parent->nlink++;
+    if (fs->nb_nodes > (1 << fs->hash_bits)) {
+        if (node_hash_resize(fs, fs->hash_bits + 1) < 0)
+            return NULL;
+    } else {
+        node_hash_insert(fs, n);
+    }
+    return n;
+}
+
+/* Find the node of path, creating it with mode if it does not exist
+   and the missing parent directories with mode 0755. "." and empty
+   components are skipped, the root is returned for an empty path. */
+static FSNode *node_find_path(FSDeviceArchive *fs, const char *path,
+                              BOOL create, uint32_t mode)
+{
+    FSNode *n, *n1;
+    const char *p, *q;
+    int len;
+
+    n = fs->root;
+    p = path;
+    for(;;) {
+        while (*p == '/')
+            p++;
+        if (*p == '\0')
+            break;
+        q = strchr(p, '/');
+        len = q ? q - p : strlen(p);
+        if (len == 1 && p[0] == '.') {
+            /* nothing to do */
+        } else if (len == 2 && p[0] == '.' && p[1] == '.') {
+            n = n->parent;
+        } else {
+            if ((n->mode & P9_S_IFMT) != P9_S_IFDIR)
+                return NULL;
+            n1 = node_lookup(fs, n, p, len);
+            if (!n1) {
+                if (!create)
+                    return NULL;
+                /* the last component gets the mode of the entry */
+                for(q = p + len; *q == '/'; q++);
+                n1 = node_new(fs, n, p, len,
+                              *q == '\0' ? mode : (P9_S_IFDIR | 0755));
+                if (!n1)
+                    return NULL;
+            }
+            n = n1;
+        }
+        p += len;
+    }
+    return n;
+}
+
+/* octal, or base-256 if the high bit of the first byte is set (GNU) */
+static uint64_t tar_get_num(const uint8_t *p, int len)
+{
+    uint64_t v;
+    int i;
+
+    v = 0;
+    if (p[0] & 0x80) {
+        v = p[0] & 0x3f;
+        for(i = 1; i < len; i++)
+            v = (v << 8) | p[i];
+        return v;
+    }
+    for(i = 0; i < len && (p[i] == ' ' || p[i] == '\0'); i++);
+    for(; i < len && p[i] >= '0' && p[i] <= '7'; i++)
+        v = (v << 3) | (p[i] - '0');
+    return v;
+}
+
+static BOOL tar_check_sum(const uint8_t *h)
+{
+    uint32_t sum;
+    int i;
+
+    sum = 0;
+    for(i = 0; i < TAR_BLOCK_SIZE; i++) {
+        if (i >= 148 && i < 156)
+            sum += ' ';
+        else
+            sum += h[i];
+    }
+    return sum == tar_get_num(h + 148, 8);
+}
+
+/* copy a fixed size field which is not necessarily null terminated */
+static char *tar_get_str(const uint8_t *p, int len)
+{
+    char *s;
+    int l;
+
+    for(l = 0; l < len && p[l] != '\0'; l++);
+    s = malloc(l + 1);
+    memcpy(s, p, l);
+    s[l] = '\0';
+    return s;
+}
+
+typedef struct {
+    char *path;
+    char *link_path;
+    BOOL has_size;
+    uint64_t size;
+    BOOL has_uid, has_gid, has_mtime;
+    uint32_t uid, gid;
+    uint64_t mtime;
+} TarExtHeader;
+
+static void tar_ext_header_reset(TarExtHeader *eh)
+{
+    free(eh->path);
+    free(eh->link_path);
+    memset(eh, 0, sizeof(*eh));
+}
+
+/* pax records: "<len> <key>=<value>\n" */
+static int tar_parse_pax(TarExtHeader *eh, const uint8_t *buf, uint64_t size)
+{
+    const char *p, *end, *key, *eq, *val;
+    char *r;
+    uint64_t len;
+    int val_len;
+
+    p = (const char *)buf;
+    end = p + size;
+    while (p < end && *p != '\0') {
+        len = strtoull(p, &r, 10);
+        if (len == 0 || *r != ' ' || len > (uint64_t)(end - p) ||
+            p[len - 1] != '\n')
+            return -1;
+        key = r + 1;
+        eq = memchr(key, '=', p + len - key);
+        if (!eq)
+            return -1;
+        val = eq + 1;
+        val_len = p + len - 1 - val;
+        if (eq - key == 4 && !memcmp(key, "path", 4)) {
+            free(eh->path);
+            eh->path = strndup(val, val_len);
+        } else if (eq - key == 8 && !memcmp(key, "linkpath", 8)) {
+            free(eh->link_path);
+            eh->link_path = strndup(val, val_len);
+        } else if (eq - key == 4 && !memcmp(key, "size", 4)) {
+            eh->has_size = TRUE;
+            eh->size = strtoull(val, NULL, 10);
+        } else if (eq - key == 3 && !memcmp(key, "uid", 3)) {
+            eh->has_uid = TRUE;
+            eh->uid = strtoul(val, NULL, 10);
+        } else if (eq - key == 3 && !memcmp(key, "gid", 3)) {
+            eh->has_gid = TRUE;
+            eh->gid = strtoul(val, NULL, 10);
+        } else if (eq - key == 5 && !memcmp(key, "mtime", 5)) {
+            /* the fractional part is ignored */
+            eh->has_mtime = TRUE;
+            eh->mtime = strtoull(val, NULL, 10);
+        }
+        p += len;
+    }
+    return 0;
+}
+
+static uint32_t tar_type_to_mode(int type)
+{
+    switch(type) {
+    case '2':
+        return P9_S_IFLNK;
+    case '3':
+        return P9_S_IFCHR;
+    case '4':
+        return P9_S_IFBLK;
+    case '5':
+        return P9_S_IFDIR;
+    case '6':
+        return P9_S_IFIFO;
+    default:
+        return P9_S_IFREG;
+    }
+}
+
+static void tar_add_entry(FSDeviceArchive *fs, const uint8_t *h,
+                         TarExtHeader *eh, const uint8_t *data,
+                         uint64_t size)
+{
+    FSNode *n, *target;
+    char *path, *link_path, *prefix, *p;
+    int type;
+    uint32_t mode;
+
+    type = h[156];
+    if (eh->path) {
+        path = strdup(eh->path);
+    } else {
+        path = tar_get_str(h, 100);
+        if (!memcmp(h + 257, "ustar", 5) && h[345] != '\0') {
+            prefix = tar_get_str(h + 345, 155);
+            p = malloc(strlen(prefix) + 1 + strlen(path) + 1);
+            sprintf(p, "%s/%s", prefix, path);
+            free(prefix);
+            free(path);
+            path = p;
+        }
+    }
+    if (eh->link_path)
+        link_path = strdup(eh->link_path);
+    else
+        link_path = tar_get_str(h + 157, 100);
+
+    mode = tar_type_to_mode(type) | (tar_get_num(h + 100, 8) & 07777);
+    if (type == '1') {
+        /* hard link: share the data and the inode of the target */
+        target = node_find_path(fs, link_path, FALSE, 0);
+        if (!target || (target->mode & P9_S_IFMT) == P9_S_IFDIR)
+            goto done;
+        n = node_find_path(fs, path, TRUE, target->mode);
+        if (!n || n == target)
+            goto done;
+        n->mode = target->mode;
+        n->data = target->data;
+        n->size = target->size;
+        n->ino = target->ino;
+        target->nlink++;
+        n->nlink = target->nlink;
+    } else {
+        n = node_find_path(fs, path, TRUE, mode);
+        if (!n)
+            goto done; /* e.g. below a file */
+        /* a later entry replaces an earlier one */
+        n->mode = mode;
+        n->size = 0;
+        n->data = NULL;
+        free(n->link_target);
+        n->link_target = NULL;
+        if (type == '2') {
+            n->link_target = link_path;
+            link_path = NULL;
+            n->size = strlen(n->link_target);
+        } else if ((mode & P9_S_IFMT) == P9_S_IFREG) {
+            n->data = data;
+            n->size = size;
+        } else if (type == '3' || type == '4') {
+            n->rdev = makedev(tar_get_num(h + 329, 8),
+                              tar_get_num(h + 337, 8));
+        }
+    }
+    n->uid = eh->has_uid ? eh->uid : tar_get_num(h + 108, 8);
+    n->gid = eh->has_gid ? eh->gid : tar_get_num(h + 116, 8);
+    n->mtime = eh->has_mtime ? eh->mtime : tar_get_num(h + 136, 12);
+ done:
+    free(path);
+    free(link_path);
+}
+
+static int tar_parse(FSDeviceArchive *fs)
+{
+    const uint8_t *h, *data;
+    TarExtHeader eh_s, *eh = &eh_s;
+    uint64_t pos, size;
+    int type, ret;
+
+    memset(eh, 0, sizeof(*eh));
+    ret = -1;
+    pos = 0;
+    while (pos + TAR_BLOCK_SIZE <= fs->map_size) {
+        h = fs->map_base + pos;
+        if (h[0] == '\0')
+            break; /* end of archive */
+        if (!tar_check_sum(h)) {
+            fprintf(stderr, "fs_archive: bad header checksum at offset %" PRIu64 "\n", pos);
+            goto done;
+        }
+        type = h[156];
+        size = tar_get_num(h + 124, 12);
+        if (eh->has_size && type != 'x' && type != 'g' &&
+            type != 'L' && type != 'K')
+            size = eh->size;
+        data = h + TAR_BLOCK_SIZE;
+        pos += TAR_BLOCK_SIZE;
+        if (size > fs->map_size - pos) {
+            fprintf(stderr, "fs_archive: truncated archive\n");
+            goto done;
+        }
+        pos += (size + TAR_BLOCK_SIZE - 1) & ~(uint64_t)(TAR_BLOCK_SIZE - 1);
+        switch(type) {
+        case 'L': /* GNU long name */
+            free(eh->path);
+            eh->path = strndup((const char *)data, size);
+            break;
+        case 'K': /* GNU long link name */
+            free(eh->link_path);
+            eh->link_path = strndup((const char *)data, size);
+            break;
+        case 'x':
+            if (tar_parse_pax(eh, data, size) < 0) {
+                fprintf(stderr, "fs_archive: invalid pax header\n");
+                goto done;
+            }
+            break;
+        case 'g':
+            /* global headers are ignored */
+            break;
+        default:
+            tar_add_entry(fs, h, eh, data, size);
+            tar_ext_header_reset(eh);
+            break;
+        }
+    }
+    /* the end of archive blocks may be missing */
+    ret = 0;
+ done:
+    tar_ext_header_reset(eh);
+    return ret;
+}
+
+static void node_to_qid(FSQID *qid, FSNode *n)
+{
+    if ((n->mode & P9_S_IFMT) == P9_S_IFDIR)
+        qid->type = P9_QTDIR;
+    else if ((n->mode & P9_S_IFMT) == P9_S_IFLNK)
+        qid->type = P9_QTSYMLINK;
+    else
+        qid->type = P9_QTFILE;
+    qid->version = 0;
+    qid->path = n->ino;
+}
+
+static FSFile *fid_create(FSDevice *fs, FSNode *n, uint32_t uid)
+{
+    FSFile *f;
+    f = mallocz(sizeof(*f));
+    f->node = n;
+    f->uid = uid;
+    return f;
+}
+
+static void fs_delete(FSDevice *fs, FSFile *f)
+{
+    free(f);
+}
+
+static void fs_statfs(FSDevice *fs1, FSStatFS *st)
+{
+    FSDeviceArchive *fs = (FSDeviceArchive *)fs1;
+    st->f_bsize = TAR_BLOCK_SIZE;
+    st->f_blocks = fs->map_size / TAR_BLOCK_SIZE;
+    st->f_bfree = 0;
+    st->f_bavail = 0;
+    st->f_files = fs->nb_nodes;
+    st->f_ffree = 0;
+}
+
+static int fs_attach(FSDevice *fs1, FSFile **pf,
+                     FSQID *qid, uint32_t uid,
+                     const char *uname, const char *aname)
+{
+    FSDeviceArchive *fs = (FSDeviceArchive *)fs1;
+
+    *pf = fid_create(fs1, fs->root, uid);
+    node_to_qid(qid, fs->root);
+    return 0;
+}
+
+static int fs_walk(FSDevice *fs1, FSFile **pf, FSQID *qids,
+                   FSFile *f, int n, char **names)
+{
+    FSDeviceArchive *fs = (FSDeviceArchive *)fs1;
+    FSNode *node, *node1;
+    int i;
+
+    node = f->node;
+    for(i = 0; i < n; i++) {
+        if (!strcmp(names[i], "..")) {
+            node1 = node->parent;
+        } else if (!strcmp(names[i], ".")) {
+            node1 = node;
+        } else {
+            if ((node->mode & P9_S_IFMT) != P9_S_IFDIR)
+                break;
+            node1 = node_lookup(fs, node, names[i], strlen(names[i]));
+            if (!node1)
+                break;
+        }
+        node = node1;
+        node_to_qid(&qids[i], node);
+    }
+    *pf = fid_create(fs1, node, f->uid);
+    return i;
+}
+
+static int fs_mkdir(FSDevice *fs, FSQID *qid, FSFile *f,
+                    const char *name, uint32_t mode, uint32_t gid)
+{
+    return -P9_EROFS;
+}
+
+static int fs_open(FSDevice *fs, FSQID *qid, FSFile *f, uint32_t flags,
+                   FSOpenCompletionFunc *cb, void *opaque)
+{
+    if ((flags & P9_O_NOACCESS) != P9_O_RDONLY ||
+        (flags & (P9_O_TRUNC | P9_O_CREAT)))
+        return -P9_EROFS;
+    node_to_qid(qid, f->node);
+    f->is_opened = TRUE;
+    return 0;
+}
+
+static int fs_create(FSDevice *fs, FSQID *qid, FSFile *f, const char *name,
+                     uint32_t flags, uint32_t mode, uint32_t gid)
+{
+    return -P9_EROFS;
+}
+
+static int fs_readdir(FSDevice *fs, FSFile *f, uint64_t offset,
+                      uint8_t *buf, int count)
+{
+    FSNode *dir, *n;
+    const char *name;
+    int len, pos, name_len;
+    uint64_t i;
+    FSQID qid;
+
+    dir = f->node;
+    if (!f->is_opened || (dir->mode & P9_S_IFMT) != P9_S_IFDIR)
+        return -P9_EPROTO;
+    /* offset 0 is ".", 1 is "..", then the entries in archive order */
+    pos = 0;
+    for(i = offset; i < dir->nb_children + 2; i++) {
+        if (i == 0) {
+            n = dir;
+            name = ".";
+        } else if (i == 1) {
+            n = dir->parent;
+            name = "..";
+        } else {
+            n = dir->children[i - 2];
+            name = n->name;
+        }
+        name_len = strlen(name);
+        len = 13 + 8 + 1 + 2 + name_len;
+        if ((pos + len) > count)
+            break;
+        node_to_qid(&qid, n);
+        buf[pos++] = qid.type;
+        put_le32(buf + pos, qid.version);
+        pos += 4;
+        put_le64(buf + pos, qid.path);
+        pos += 8;
+        put_le64(buf + pos, i + 1);
+        pos += 8;
+        /* the DT_x values are the file type bits of the mode */
+        buf[pos++] = (n->mode & P9_S_IFMT) >> 12;
+        put_le16(buf + pos, name_len);
+        pos += 2;
+        memcpy(buf + pos, name, name_len);
+        pos += name_len;
+    }
+    return pos;
+}
+
+static int fs_read(FSDevice *fs, FSFile *f, uint64_t offset,
+                   uint8_t *buf, int count)
+{
+    FSNode *n = f->node;
+
+    if (!f->is_opened || (n->mode & P9_S_IFMT) == P9_S_IFDIR)
+        return -P9_EPROTO;
+    if (!n->data || offset >= n->size)
+        return 0;
+    if (count > n->size - offset)
+        count = n->size - offset;
+    memcpy(buf, n->data + offset, count);
+    return count;
+}
+
+static int fs_readv(FSDevice *fs, FSFile *f, uint64_t offset,
+                    const struct iovec *iov, int iovcnt)
+{
+    int i, ret, total;
+
+    total = 0;
+    for(i = 0; i < iovcnt; i++) {
+        ret = fs_read(fs, f, offset + total, iov[i].iov_base, iov[i].iov_len);
+        if (ret < 0)
+            return ret;
+        total += ret;
+        if (ret < iov[i].iov_len)
+            break;
+    }
+    return total;
+}
+
+static int fs_write(FSDevice *fs, FSFile *f, uint64_t offset,
+                    const uint8_t *buf, int count)
+{
+    return -P9_EROFS;
+}
+
+static int fs_writev(FSDevice *fs, FSFile *f, uint64_t offset,
+                     const struct iovec *iov, int iovcnt)
+{
+    return -P9_EROFS;
+}
+
+static void fs_close(FSDevice *fs, FSFile *f)
+{
+    f->is_opened = FALSE;
+}
+
+static int fs_stat(FSDevice *fs, FSFile *f, FSStat *st)
+{
+    FSNode *n = f->node;
+
+    node_to_qid(&st->qid, n);
+    st->st_mode = n->mode;
+    st->st_uid = n->uid;
+    st->st_gid = n->gid;
+    st->st_nlink = n->nlink;
+    st->st_rdev = n->rdev;
+    st->st_size = n->size;
+    st->st_blksize = 4096;
+    st->st_blocks = (n->size + 511) / 512;
+    st->st_atime_sec = n->mtime;
+    st->st_atime_nsec = 0;
+    st->st_mtime_sec = n->mtime;
+    st->st_mtime_nsec = 0;
+    st->st_ctime_sec = n->mtime;
+    st->st_ctime_nsec = 0;
+    return 0;
+}
+
+static int fs_setattr(FSDevice *fs, FSFile *f, uint32_t mask,
+                      uint32_t mode, uint32_t uid, uint32_t gid,
+                      uint64_t size, uint64_t atime_sec, uint64_t atime_nsec,
+                      uint64_t mtime_sec, uint64_t mtime_nsec)
+{
+    return -P9_EROFS;
+}
+
+static int fs_link(FSDevice *fs, FSFile *df, FSFile *f, const char *name)
+{
+    return -P9_EROFS;
+}
+
+static int fs_symlink(FSDevice *fs, FSQID *qid,
+                      FSFile *f, const char *name, const char *symgt, uint32_t gid)
+{
+    return -P9_EROFS;
+}
+
+static int fs_mknod(FSDevice *fs, FSQID *qid,
+                    FSFile *f, const char *name, uint32_t mode, uint32_t major,
+                    uint32_t minor, uint32_t gid)
+{
+    return -P9_EROFS;
+}
+
+static int fs_readlink(FSDevice *fs, char *buf, int buf_size, FSFile *f)
+{
+    FSNode *n = f->node;
+
+    if (!n->link_target)
+        return -P9_EINVAL;
+    pstrcpy(buf, buf_size, n->link_target);
+    return 0;
+}
+
+static int fs_renameat(FSDevice *fs, FSFile *f, const char *name,
+                       FSFile *new_f, const char *new_name)
+{
+    return -P9_EROFS;
+}
+
+static int fs_unlinkat(FSDevice *fs, FSFile *f, const char *name)
+{
+    return -P9_EROFS;
+}
+
+/* nothing can change the files, so the locks are only advisory */
+static int fs_lock(FSDevice *fs, FSFile *f, const FSLock *lock)
+{
+    return P9_LOCK_SUCCESS;
+}
+
+static int fs_getlock(FSDevice *fs, FSFile *f, FSLock *lock)
+{
+    lock->type = P9_LOCK_TYPE_UNLCK;
+    return 0;
+}
+
+static void fs_archive_end(FSDevice *fs1)
+{
+    FSDeviceArchive *fs = (FSDeviceArchive *)fs1;
+    FSNode *n;
+    int i;
+
+    for(i = 0; i < fs->nb_nodes; i++) {
+        n = fs->nodes[i];
+        free(n->name);
+        free(n->link_target);
+        free(n->children);
+        free(n);
+    }
+    free(fs->nodes);
+    free(fs->hash_table);
+    if (fs->map_base)
+        munmap(fs->map_base, fs->map_size);
+}
+
+FSDevice *fs_archive_init(const char *filename)
+{
+    FSDeviceArchive *fs;
+    struct stat st;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+
+    fs = mallocz(sizeof(*fs));
+    fs->map_size = st.st_size;
+    if (fs->map_size > 0) {
+        fs->map_base = mmap(NULL, fs->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (fs->map_base == MAP_FAILED) {
+            close(fd);
+            free(fs);
+            return NULL;
+        }
+    }
+    close(fd);
+
+    fs->common.fs_end = fs_archive_end;
+    fs->common.fs_delete = fs_delete;
+    fs->common.fs_statfs = fs_statfs;
+    fs->common.fs_attach = fs_attach;
+    fs->common.fs_walk = fs_walk;
+    fs->common.fs_mkdir = fs_mkdir;
+    fs->common.fs_open = fs_open;
+    fs->common.fs_create = fs_create;
+    fs->common.fs_stat = fs_stat;
+    fs->common.fs_setattr = fs_setattr;
+    fs->common.fs_close = fs_close;
+    fs->common.fs_readdir = fs_readdir;
+    fs->common.fs_read = fs_read;
+    fs->common.fs_write = fs_write;
+    fs->common.fs_readv = fs_readv;
+    fs->common.fs_writev = fs_writev;
+    fs->common.fs_link = fs_link;
+    fs->common.fs_symlink = fs_symlink;
+    fs->common.fs_mknod = fs_mknod;
+    fs->common.fs_readlink = fs_readlink;
+    fs->common.fs_renameat = fs_renameat;
+    fs->common.fs_unlinkat = fs_unlinkat;
+    fs->common.fs_lock = fs_lock;
+    fs->common.fs_getlock = fs_getlock;
+
+    fs->root = node_new(fs, NULL, "", 0, P9_S_IFDIR | 0755);
+    if (!fs->root || node_hash_resize(fs, 8) < 0 || tar_parse(fs) < 0) {
+        fs_end((FSDevice *)fs);
+        return NULL;
+    }
+    return (FSDevice *)fs;
+}
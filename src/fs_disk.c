@@ -34,39 +34,252 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "cutils.h"
 #include "list.h"
 #include "fs.h"
 
+/* cache of the lstat() results, including the failed ones, indexed by
+   path. The entries expire after ttl ms and are invalidated by the
+   operations of the server which modify them. The changes made by the
+   host are only seen after the expiration. */
+typedef struct FSAttrEntry {
+    struct list_head link; /* LRU list, most recently used first */
+    struct FSAttrEntry *hash_next;
+    uint32_t hash;
+    int err; /* errno of lstat(), 0 if OK */
+    struct stat st;
+    int64_t expire_time; /* in ms */
+    char path[0];
+} FSAttrEntry;
+
+typedef struct {
+    pthread_mutex_t lock; /* the requests may be executed by threads */
+    int max_entries;
+    int nb_entries;
+    int64_t ttl; /* in ms */
+    int hash_bits;
+    FSAttrEntry **hash_table;
+    struct list_head lru;
+    /* incremented by each invalidation: the result of an lstat() which
+       ran meanwhile is not cached */
+    uint64_t gen;
+} FSAttrCache;
+
+/* writeback mode: the small writes which extend the previous one are
+   accumulated per fid and written when the buffer is full, when the
+   fid is closed, when the file is read, synced, stat'ed or changed
+   through any fid, before a rename or unlink, or after delay ms. */
+#define FS_WB_BUF_SIZE (64 * 1024)
+#define FS_WB_MAX_WRITE (16 * 1024) /* larger writes are not buffered */
+
+/* the fids on the same host path share an interned FSPath, found by
+   its parent and its last component and freed with its last
+   reference. A walk only allocates the components which are not
+   referenced by another fid or one of their descendants. */
+typedef struct FSPath {
+    struct FSPath *parent; /* NULL for the root */
+    struct FSPath *hash_next;
+    uint32_t hash;
+    int ref_count; /* protected by path_lock */
+    int len;
+    char str[0]; /* complete path */
+} FSPath;
+
 typedef struct {
     FSDevice common;
     char *root_path;
+    FSAttrCache *attr_cache; /* NULL if disabled */
+    BOOL writeback;
+    int64_t wb_delay; /* in ms */
+    /* protects the write buffers, which are also flushed from
+       fs_poll() */
+    pthread_mutex_t wb_lock;
+    struct list_head wb_dirty; /* files with buffered data, oldest first */
+    int wb_nb_dirty;
+    FSStats stats; /* updated atomically */
+    /* interned paths */
+    pthread_mutex_t path_lock;
+    FSPath *root;
+    int nb_paths;
+    int path_hash_bits;
+    FSPath **path_hash; /* the root is not in the table */
 } FSDeviceDisk;
 
+#define FS_STAT_INC(fs, field) \
+    __atomic_fetch_add(&((FSDeviceDisk *)(fs))->stats.field, 1, __ATOMIC_RELAXED)
+
 static void fs_close(FSDevice *fs, FSFile *f);
 
+typedef struct {
+    uint64_t ino;
+    uint32_t name_pos; /* in FSDirList.names */
+    uint16_t name_len;
+    uint8_t type; /* P9_QTx */
+    uint8_t d_type;
+} FSDirEntry;
+
+/* snapshot of the entries of an opened directory, taken when it is
+   read at offset 0. The readdir offset of an entry is its index + 1,
+   so that a read resumes without seeking the host directory. */
+typedef struct {
+    int count;
+    int size;
+    FSDirEntry *tab;
+    char *names;
+    int names_len;
+    int names_size;
+} FSDirList;
+
 struct FSFile {
     uint32_t uid;
-    char *path; /* complete path */
+    FSPath *path;
     BOOL is_opened;
     BOOL is_dir;
+    uint32_t open_flags; /* P9_O_x, to reopen the file */
     union {
         int fd;
         DIR *dirp;
     } u;
+    FSDirList *dir_list; /* NULL until the directory is read */
+    /* writeback mode */
+    uint8_t *wb_buf;
+    uint64_t wb_offset; /* file offset of wb_buf */
+    int wb_len; /* > 0 if the file is in the dirty list */
+    int wb_err; /* error of a deferred write, returned by the next
+                   write or fsync */
+    int64_t wb_time; /* when the first byte was buffered, in ms */
+    struct list_head wb_link;
 };
 
+static uint32_t path_hash(FSPath *parent, const char *name)
+{
+    uint32_t h = 2166136261U ^ (uint32_t)(uintptr_t)parent;
+    while (*name != '\0')
+        h = (h ^ (uint8_t)*name++) * 16777619U;
+    return h;
+}
+
+static FSPath *fs_path_new_root(const char *root_path)
+{
+    FSPath *p;
+    int len;
+
+    len = strlen(root_path);
+    p = mallocz(sizeof(*p) + len + 1);
+    if (!p)
+        return NULL;
+    p->ref_count = 1;
+    p->len = len;
+    memcpy(p->str, root_path, len + 1);
+    return p;
+}
+
+/* The path lock must be held. */
+static void fs_path_resize(FSDeviceDisk *fs, int hash_bits)
+{
+    FSPath **tab, *p, *p_next;
+    int i;
+
+    tab = mallocz(sizeof(tab[0]) << hash_bits);
+    if (!tab)
+        return; /* keep the longer chains */
+    for(i = 0; i < (1 << fs->path_hash_bits); i++) {
+        for(p = fs->path_hash[i]; p != NULL; p = p_next) {
+            p_next = p->hash_next;
+            p->hash_next = tab[p->hash & ((1 << hash_bits) - 1)];
+            tab[p->hash & ((1 << hash_bits) - 1)] = p;
+        }
+    }
+    free(fs->path_hash);
+    fs->path_hash = tab;
+    fs->path_hash_bits = hash_bits;
+}
+
+/* return a reference to the path of name in parent, or NULL if not
+   enough memory */
+static FSPath *fs_path_get(FSDevice *fs1, FSPath *parent, const char *name)
+{
+    FSDeviceDisk *fs = (FSDeviceDisk *)fs1;
+    FSPath *p, **pp;
+    uint32_t h;
+    int name_len;
+
+    h = path_hash(parent, name);
+    pthread_mutex_lock(&fs->path_lock);
+    pp = &fs->path_hash[h & ((1 << fs->path_hash_bits) - 1)];
+    for(p = *pp; p != NULL; p = p->hash_next) {
+        if (p->hash == h && p->parent == parent &&
+            !strcmp(p->str + parent->len + 1, name)) {
+            p->ref_count++;
+            goto done;
+        }
+    }
+    name_len = strlen(name);
+    p = malloc(sizeof(*p) + parent->len + 1 + name_len + 1);
+    if (!p)
+        goto done;
+    p->parent = parent;
+    parent->ref_count++;
+    p->hash = h;
+    p->ref_count = 1;
+    p->len = parent->len + 1 + name_len;
+    memcpy(p->str, parent->str, parent->len);
+    p->str[parent->len] = '/';
+    memcpy(p->str + parent->len + 1, name, name_len + 1);
+    p->hash_next = *pp;
+    *pp = p;
+    if (++fs->nb_paths > (1 << fs->path_hash_bits))
+        fs_path_resize(fs, fs->path_hash_bits + 1);
+ done:
+    pthread_mutex_unlock(&fs->path_lock);
+    return p;
+}
+
+static FSPath *fs_path_dup(FSDevice *fs1, FSPath *p)
+{
+    FSDeviceDisk *fs = (FSDeviceDisk *)fs1;
+
+    pthread_mutex_lock(&fs->path_lock);
+    p->ref_count++;
+    pthread_mutex_unlock(&fs->path_lock);
+    return p;
+}
+
+/* release a reference, and the parents which are no longer used */
+static void fs_path_put(FSDevice *fs1, FSPath *p)
+{
+    FSDeviceDisk *fs = (FSDeviceDisk *)fs1;
+    FSPath *parent, **pp;
+
+    pthread_mutex_lock(&fs->path_lock);
+    while (p != NULL && --p->ref_count == 0) {
+        parent = p->parent;
+        if (parent) {
+            pp = &fs->path_hash[p->hash & ((1 << fs->path_hash_bits) - 1)];
+            while (*pp != p)
+                pp = &(*pp)->hash_next;
+            *pp = p->hash_next;
+            fs->nb_paths--;
+        }
+        free(p);
+        p = parent;
+    }
+    pthread_mutex_unlock(&fs->path_lock);
+}
+
 static void fs_delete(FSDevice *fs, FSFile *f)
 {
     if (f->is_opened)
         fs_close(fs, f);
-    free(f->path);
+    fs_path_put(fs, f->path);
     free(f);
 }
 
-/* warning: path belong to fid_create() */
-static FSFile *fid_create(FSDevice *s1, char *path, uint32_t uid)
+/* warning: the reference to path belongs to fid_create() */
+static FSFile *fid_create(FSDevice *s1, FSPath *path, uint32_t uid)
 {
     FSFile *f;
     f = (FSFile*)mallocz(sizeof(*f));
@@ -130,6 +343,308 @@ static int p9_flags_to_host(int flags)
     return ret;
 }
 
+static int64_t get_time_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t attr_hash(const char *path)
+{
+    uint32_t h = 2166136261U;
+    while (*path != '\0')
+        h = (h ^ (uint8_t)*path++) * 16777619U;
+    return h;
+}
+
+/* return the entry of path or NULL. The cache lock must be held. */
+static FSAttrEntry **attr_find(FSAttrCache *c, const char *path,
+                               uint32_t h)
+{
+    FSAttrEntry **pe, *e;
+
+    pe = &c->hash_table[h >> (32 - c->hash_bits)];
+    for(e = *pe; e != NULL; e = *pe) {
+        if (e->hash == h && !strcmp(e->path, path))
+            return pe;
+        pe = &e->hash_next;
+    }
+    return NULL;
+}
+
+static void attr_remove(FSAttrCache *c, FSAttrEntry **pe)
+{
+    FSAttrEntry *e = *pe;
+
+    *pe = e->hash_next;
+    list_del(&e->link);
+    c->nb_entries--;
+    free(e);
+}
+
+/* same as lstat() */
+static int fs_lstat(FSDevice *fs1, const char *path, struct stat *st)
+{
+    FSAttrCache *c = ((FSDeviceDisk *)fs1)->attr_cache;
+    FSAttrEntry **pe, *e;
+    uint32_t h;
+    uint64_t gen;
+    int64_t now;
+    int err;
+
+    if (!c)
+        return lstat(path, st);
+    h = attr_hash(path);
+    now = get_time_ms();
+    pthread_mutex_lock(&c->lock);
+    pe = attr_find(c, path, h);
+    if (pe) {
+        e = *pe;
+        if (now < e->expire_time) {
+            FS_STAT_INC(fs1, attr_hits);
+            list_del(&e->link);
+            list_add(&e->link, &c->lru);
+            *st = e->st;
+            err = e->err;
+            pthread_mutex_unlock(&c->lock);
+            if (err != 0) {
+                errno = err;
+                return -1;
+            }
+            return 0;
+        }
+        attr_remove(c, pe);
+    }
+    gen = c->gen;
+    pthread_mutex_unlock(&c->lock);
+    FS_STAT_INC(fs1, attr_misses);
+
+    err = lstat(path, st) != 0 ? errno : 0;
+
+    e = malloc(sizeof(*e) + strlen(path) + 1);
+    if (e) {
+        e->hash = h;
+        e->err = err;
+        e->st = *st;
+        e->expire_time = now + c->ttl;
+        strcpy(e->path, path);
+        pthread_mutex_lock(&c->lock);
+        if (c->gen != gen) {
+            /* the result may predate a modification */
+            pthread_mutex_unlock(&c->lock);
+            free(e);
+            goto done;
+        }
+        /* another thread may have added it meanwhile */
+        pe = attr_find(c, path, h);
+        if (pe)
+            attr_remove(c, pe);
+        if (c->nb_entries >= c->max_entries) {
+            FSAttrEntry *e1 = list_entry(c->lru.prev, FSAttrEntry, link);
+            attr_remove(c, attr_find(c, e1->path, e1->hash));
+        }
+        pe = &c->hash_table[h >> (32 - c->hash_bits)];
+        e->hash_next = *pe;
+        *pe = e;
+        list_add(&e->link, &c->lru);
+        c->nb_entries++;
+        pthread_mutex_unlock(&c->lock);
+    }
+ done:
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/* forget the attributes of path after it was modified */
+static void fs_attr_invalidate(FSDevice *fs1, const char *path)
+{
+    FSAttrCache *c = ((FSDeviceDisk *)fs1)->attr_cache;
+    FSAttrEntry **pe;
+
+    if (!c)
+        return;
+    pthread_mutex_lock(&c->lock);
+    c->gen++;
+    pe = attr_find(c, path, attr_hash(path));
+    if (pe)
+        attr_remove(c, pe);
+    pthread_mutex_unlock(&c->lock);
+}
+
+static void fs_attr_invalidate_all(FSDevice *fs1)
+{
+    FSAttrCache *c = ((FSDeviceDisk *)fs1)->attr_cache;
+    struct list_head *el, *el1;
+    FSAttrEntry *e;
+
+    if (!c)
+        return;
+    pthread_mutex_lock(&c->lock);
+    c->gen++;
+    list_for_each_safe(el, el1, &c->lru) {
+        e = list_entry(el, FSAttrEntry, link);
+        free(e);
+    }
+    init_list_head(&c->lru);
+    memset(c->hash_table, 0, sizeof(c->hash_table[0]) << c->hash_bits);
+    c->nb_entries = 0;
+    pthread_mutex_unlock(&c->lock);
+}
+
+/* write the buffered data of the file. The wb_lock must be held. */
+static void fs_wb_flush_locked(FSDeviceDisk *fs, FSFile *f)
+{
+    int ret, pos;
+
+    if (f->wb_len == 0)
+        return;
+    pos = 0;
+    while (pos < f->wb_len) {
+        ret = pwrite(f->u.fd, f->wb_buf + pos, f->wb_len - pos,
+                     f->wb_offset + pos);
+        if (ret <= 0) {
+            if (ret < 0 && errno == EINTR)
+                continue;
+            f->wb_err = -errno_to_p9(ret < 0 ? errno : EIO);
+            break;
+        }
+        pos += ret;
+    }
+    FS_STAT_INC(fs, wb_flushes);
+    f->wb_len = 0;
+    list_del(&f->wb_link);
+    __atomic_sub_fetch(&fs->wb_nb_dirty, 1, __ATOMIC_RELAXED);
+    fs_attr_invalidate(&fs->common, f->path->str);
+}
+
+/* write the buffered data of all the fids on the path of f before the
+   file is accessed: the buffers belong to the fids, and the file may be
+   read or truncated through another fid */
+static void fs_wb_flush(FSDevice *fs1, FSFile *f)
+{
+    FSDeviceDisk *fs = (FSDeviceDisk *)fs1;
+    struct list_head *el, *el1;
+    FSFile *f1;
+
+    if (!fs->writeback || f->is_dir ||
+        __atomic_load_n(&fs->wb_nb_dirty, __ATOMIC_RELAXED) == 0)
+        return;
+    pthread_mutex_lock(&fs->wb_lock);
+    list_for_each_safe(el, el1, &fs->wb_dirty) {
+        f1 = list_entry(el, FSFile, wb_link);
+        /* the paths are interned */
+        if (f1->path == f->path)
+            fs_wb_flush_locked(fs, f1);
+    }
+    pthread_mutex_unlock(&fs->wb_lock);
+}
+
+/* write all the buffered data, e.g. before the paths change */
+static void fs_wb_flush_all(FSDevice *fs1)
+{
+    FSDeviceDisk *fs = (FSDeviceDisk *)fs1;
+
+    if (__atomic_load_n(&fs->wb_nb_dirty, __ATOMIC_RELAXED) == 0)
+        return;
+    pthread_mutex_lock(&fs->wb_lock);
+    while (!list_empty(&fs->wb_dirty))
+        fs_wb_flush_locked(fs, list_entry(fs->wb_dirty.next, FSFile,
+                                          wb_link));
+    pthread_mutex_unlock(&fs->wb_lock);
+}
+
+/* buffer a write if possible. Return FALSE if it must be done
+   directly, otherwise set *pret to the result of the write. */
+static BOOL fs_wb_write(FSDevice *fs1, FSFile *f, uint64_t offset,
+                        const struct iovec *iov, int iovcnt, int *pret)
+{
+    FSDeviceDisk *fs = (FSDeviceDisk *)fs1;
+    int i, count, err;
+
+    count = 0;
+    for(i = 0; i < iovcnt; i++)
+        count += iov[i].iov_len;
+    pthread_mutex_lock(&fs->wb_lock);
+    if (f->wb_len > 0 &&
+        (offset != f->wb_offset + f->wb_len ||
+         f->wb_len + count > FS_WB_BUF_SIZE))
+        fs_wb_flush_locked(fs, f);
+    /* report the error of a deferred write */
+    err = f->wb_err;
+    if (err != 0) {
+        f->wb_err = 0;
+        pthread_mutex_unlock(&fs->wb_lock);
+        *pret = err;
+        return TRUE;
+    }
+    if (count > FS_WB_MAX_WRITE) {
+        pthread_mutex_unlock(&fs->wb_lock);
+        return FALSE;
+    }
+    if (!f->wb_buf) {
+        f->wb_buf = malloc(FS_WB_BUF_SIZE);
+        if (!f->wb_buf) {
+            pthread_mutex_unlock(&fs->wb_lock);
+            return FALSE;
+        }
+    }
+    if (f->wb_len == 0) {
+        f->wb_offset = offset;
+        f->wb_time = get_time_ms();
+        list_add_tail(&f->wb_link, &fs->wb_dirty);
+        __atomic_add_fetch(&fs->wb_nb_dirty, 1, __ATOMIC_RELAXED);
+    }
+    for(i = 0; i < iovcnt; i++) {
+        memcpy(f->wb_buf + f->wb_len, iov[i].iov_base, iov[i].iov_len);
+        f->wb_len += iov[i].iov_len;
+    }
+    FS_STAT_INC(fs, wb_writes);
+    if (f->wb_len == FS_WB_BUF_SIZE)
+        fs_wb_flush_locked(fs, f);
+    pthread_mutex_unlock(&fs->wb_lock);
+    *pret = count;
+    return TRUE;
+}
+
+/* write the buffers older than the writeback delay */
+static void fs_disk_poll(FSDevice *fs1)
+{
+    FSDeviceDisk *fs = (FSDeviceDisk *)fs1;
+    FSFile *f;
+    int64_t now;
+
+    if (__atomic_load_n(&fs->wb_nb_dirty, __ATOMIC_RELAXED) == 0)
+        return;
+    now = get_time_ms();
+    pthread_mutex_lock(&fs->wb_lock);
+    while (!list_empty(&fs->wb_dirty)) {
+        f = list_entry(fs->wb_dirty.next, FSFile, wb_link);
+        if (now - f->wb_time < fs->wb_delay)
+            break;
+        fs_wb_flush_locked(fs, f);
+    }
+    pthread_mutex_unlock(&fs->wb_lock);
+}
+
+static int fs_fsync(FSDevice *fs1, FSFile *f)
+{
+    FSDeviceDisk *fs = (FSDeviceDisk *)fs1;
+    int err;
+
+    if (!f->is_opened || f->is_dir || !fs->writeback)
+        return 0;
+    fs_wb_flush(fs1, f);
+    pthread_mutex_lock(&fs->wb_lock);
+    err = f->wb_err;
+    f->wb_err = 0;
+    pthread_mutex_unlock(&fs->wb_lock);
+    return err;
+}
+
 static void stat_to_qid(FSQID *qid, const struct stat *st)
 {
     if (S_ISDIR(st->st_mode))
@@ -181,7 +696,7 @@ static int fs_attach(FSDevice *fs1, FSFile **pf,
         *pf = NULL;
         return -errno_to_p9(errno);
     }
-    f = fid_create(fs1, strdup(fs->root_path), uid);
+    f = fid_create(fs1, fs_path_dup(fs1, fs->root), uid);
     stat_to_qid(qid, &st);
     *pf = f;
     return 0;
@@ -190,18 +705,20 @@ static int fs_attach(FSDevice *fs1, FSFile **pf,
 static int fs_walk(FSDevice *fs, FSFile **pf, FSQID *qids,
                    FSFile *f, int n, char **names)
 {
-    char *path, *path1;
+    FSPath *path, *path1;
     struct stat st;
     int i;
 
-    path = strdup(f->path);
+    path = fs_path_dup(fs, f->path);
     for(i = 0; i < n; i++) {
-        path1 = compose_path(path, names[i]);
-        if (lstat(path1, &st) != 0) {
-            free(path1);
+        path1 = fs_path_get(fs, path, names[i]);
+        if (!path1)
+            break;
+        if (fs_lstat(fs, path1->str, &st) != 0) {
+            fs_path_put(fs, path1);
             break;
         }
-        free(path);
+        fs_path_put(fs, path);
         path = path1;
         stat_to_qid(&qids[i], &st);
     }
@@ -216,12 +733,14 @@ static int fs_mkdir(FSDevice *fs, FSQID *qid, FSFile *f,
     char *path;
     struct stat st;
     
-    path = compose_path(f->path, name);
+    path = compose_path(f->path->str, name);
     if (mkdir(path, mode) < 0) {
         free(path);
         return -errno_to_p9(errno);
     }
-    if (lstat(path, &st) != 0) {
+    fs_attr_invalidate(fs, f->path->str);
+    fs_attr_invalidate(fs, path);
+    if (fs_lstat(fs, path, &st) != 0) {
         free(path);
         return -errno_to_p9(errno);
     }
@@ -236,13 +755,13 @@ static int fs_open(FSDevice *fs, FSQID *qid, FSFile *f, uint32_t flags,
     struct stat st;
     fs_close(fs, f);
 
-    if (stat(f->path, &st) != 0) 
+    if (stat(f->path->str, &st) != 0) 
         return -errno_to_p9(errno);
     stat_to_qid(qid, &st);
     
     if (S_ISDIR(st.st_mode)) {
         DIR *dirp;
-        dirp = opendir(f->path);
+        dirp = opendir(f->path->str);
         if (!dirp)
             return -errno_to_p9(errno);
         f->is_opened = TRUE;
@@ -250,13 +769,16 @@ static int fs_open(FSDevice *fs, FSQID *qid, FSFile *f, uint32_t flags,
         f->u.dirp = dirp;
     } else {
         int fd;
-        fd = open(f->path, p9_flags_to_host(flags) & ~O_CREAT);
+        fd = open(f->path->str, p9_flags_to_host(flags) & ~O_CREAT);
         if (fd < 0)
             return -errno_to_p9(errno);
+        if (p9_flags_to_host(flags) & O_TRUNC)
+            fs_attr_invalidate(fs, f->path->str);
         f->is_opened = TRUE;
         f->is_dir = FALSE;
         f->u.fd = fd;
     }
+    f->open_flags = flags & ~(P9_O_CREAT | P9_O_EXCL | P9_O_TRUNC);
     return 0;
 }
 
@@ -264,84 +786,175 @@ static int fs_create(FSDevice *fs, FSQID *qid, FSFile *f, const char *name,
                      uint32_t flags, uint32_t mode, uint32_t gid)
 {
     struct stat st;
-    char *path;
+    FSPath *path;
     int ret, fd;
 
     fs_close(fs, f);
     
-    path = compose_path(f->path, name);
-    fd = open(path, p9_flags_to_host(flags) | O_CREAT, mode);
+    path = fs_path_get(fs, f->path, name);
+    if (!path)
+        return -P9_ENOSPC;
+    fd = open(path->str, p9_flags_to_host(flags) | O_CREAT, mode);
     if (fd < 0) {
-        free(path);
+        fs_path_put(fs, path);
         return -errno_to_p9(errno);
     }
-    ret = lstat(path, &st);
+    fs_attr_invalidate(fs, f->path->str);
+    fs_attr_invalidate(fs, path->str);
+    ret = fs_lstat(fs, path->str, &st);
     if (ret != 0) {
-        free(path);
+        fs_path_put(fs, path);
         close(fd);
         return -errno_to_p9(errno);
     }
-    free(f->path);
+    fs_path_put(fs, f->path);
     f->path = path;
     f->is_opened = TRUE;
     f->is_dir = FALSE;
     f->u.fd = fd;
+    f->open_flags = flags & ~(P9_O_CREAT | P9_O_EXCL | P9_O_TRUNC);
     stat_to_qid(qid, &st);
     return 0;
 }
 
-static int fs_readdir(FSDevice *fs, FSFile *f, uint64_t offset,
-                      uint8_t *buf, int count)
+static int fs_get_file_info(FSDevice *fs1, FSFile *f, char *buf, int buf_size,
+                            uint32_t *puid, int *popen_flags)
+{
+    FSDeviceDisk *fs = (FSDeviceDisk *)fs1;
+    const char *p;
+    int len;
+
+    len = strlen(fs->root_path);
+    if (strncmp(f->path->str, fs->root_path, len) != 0)
+        return -1;
+    p = f->path->str + len;
+    while (*p == '/')
+        p++;
+    if (strlen(p) >= buf_size)
+        return -1;
+    pstrcpy(buf, buf_size, p);
+    *puid = f->uid;
+    *popen_flags = f->is_opened ? (int)f->open_flags : -1;
+    return 0;
+}
+
+static void fs_dir_list_free(FSDirList *dl)
 {
+    if (!dl)
+        return;
+    free(dl->tab);
+    free(dl->names);
+    free(dl);
+}
+
+/* read all the entries of the directory in one pass. Return NULL if
+   not enough memory. */
+static FSDirList *fs_dir_list_read(FSDevice *fs, FSFile *f)
+{
+    FSDirList *dl;
+    FSDirEntry *e;
     struct dirent *de;
-    int len, pos, name_len, type, d_type;
+    int name_len, d_type;
 
-    if (!f->is_opened || !f->is_dir)
-        return -P9_EPROTO;
-    if (offset == 0)
-        rewinddir(f->u.dirp);
-    else
-        seekdir(f->u.dirp, offset);
-    pos = 0;
+    dl = mallocz(sizeof(*dl));
+    if (!dl)
+        return NULL;
+    rewinddir(f->u.dirp);
     for(;;) {
         de = readdir(f->u.dirp);
         if (de == NULL)
             break;
         name_len = strlen(de->d_name);
-        len = 13 + 8 + 1 + 2 + name_len;
-        if ((pos + len) > count)
-            break;
-        offset = telldir(f->u.dirp);
+        if (dl->count == dl->size) {
+            int new_size = max_int(dl->size * 2, 64);
+            FSDirEntry *new_tab;
+            new_tab = realloc(dl->tab, sizeof(dl->tab[0]) * new_size);
+            if (!new_tab)
+                goto fail;
+            dl->tab = new_tab;
+            dl->size = new_size;
+        }
+        if (dl->names_len + name_len > dl->names_size) {
+            int new_size = max_int(dl->names_size * 2,
+                                   dl->names_len + name_len + 1024);
+            char *new_names;
+            new_names = realloc(dl->names, new_size);
+            if (!new_names)
+                goto fail;
+            dl->names = new_names;
+            dl->names_size = new_size;
+        }
         d_type = de->d_type;
         if (d_type == DT_UNKNOWN) {
             char *path;
             struct stat st;
-            path = compose_path(f->path, de->d_name);
-            if (lstat(path, &st) == 0) {
+            path = compose_path(f->path->str, de->d_name);
+            if (fs_lstat(fs, path, &st) == 0) {
                 d_type = st.st_mode >> 12;
             } else {
                 d_type = DT_REG; /* default */
             }
             free(path);
         }
+        e = &dl->tab[dl->count++];
+        e->ino = de->d_ino;
+        e->name_pos = dl->names_len;
+        e->name_len = name_len;
+        e->d_type = d_type;
         if (d_type == DT_DIR)
-            type = P9_QTDIR;
+            e->type = P9_QTDIR;
         else if (d_type == DT_LNK)
-            type = P9_QTSYMLINK;
+            e->type = P9_QTSYMLINK;
         else
-            type = P9_QTFILE;
-        buf[pos++] = type;
+            e->type = P9_QTFILE;
+        memcpy(dl->names + dl->names_len, de->d_name, name_len);
+        dl->names_len += name_len;
+    }
+    return dl;
+ fail:
+    fs_dir_list_free(dl);
+    return NULL;
+}
+
+static int fs_readdir(FSDevice *fs, FSFile *f, uint64_t offset,
+                      uint8_t *buf, int count)
+{
+    FSDirList *dl;
+    FSDirEntry *e;
+    int len, pos;
+    uint64_t i;
+
+    if (!f->is_opened || !f->is_dir)
+        return -P9_EPROTO;
+    /* a read from the start sees the current content */
+    if (offset == 0 || !f->dir_list) {
+        FS_STAT_INC(fs, dir_misses);
+        fs_dir_list_free(f->dir_list);
+        f->dir_list = fs_dir_list_read(fs, f);
+        if (!f->dir_list)
+            return -P9_EIO;
+    } else {
+        FS_STAT_INC(fs, dir_hits);
+    }
+    dl = f->dir_list;
+    pos = 0;
+    for(i = offset; i < dl->count; i++) {
+        e = &dl->tab[i];
+        len = 13 + 8 + 1 + 2 + e->name_len;
+        if ((pos + len) > count)
+            break;
+        buf[pos++] = e->type;
         put_le32(buf + pos, 0); /* version */
         pos += 4;
-        put_le64(buf + pos, de->d_ino);
+        put_le64(buf + pos, e->ino);
         pos += 8;
-        put_le64(buf + pos, offset);
+        put_le64(buf + pos, i + 1);
         pos += 8;
-        buf[pos++] = d_type;
-        put_le16(buf + pos, name_len);
+        buf[pos++] = e->d_type;
+        put_le16(buf + pos, e->name_len);
         pos += 2;
-        memcpy(buf + pos, de->d_name, name_len);
-        pos += name_len;
+        memcpy(buf + pos, dl->names + e->name_pos, e->name_len);
+        pos += e->name_len;
     }
     return pos;
 }
@@ -353,6 +966,7 @@ static int fs_read(FSDevice *fs, FSFile *f, uint64_t offset,
 
     if (!f->is_opened || f->is_dir)
         return -P9_EPROTO;
+    fs_wb_flush(fs, f);
     ret = pread(f->u.fd, buf, count, offset);
     if (ret < 0) 
         return -errno_to_p9(errno);
@@ -360,6 +974,21 @@ static int fs_read(FSDevice *fs, FSFile *f, uint64_t offset,
         return ret;
 }
 
+static int fs_readv(FSDevice *fs, FSFile *f, uint64_t offset,
+                    const struct iovec *iov, int iovcnt)
+{
+    int ret;
+
+    if (!f->is_opened || f->is_dir)
+        return -P9_EPROTO;
+    fs_wb_flush(fs, f);
+    ret = preadv(f->u.fd, iov, iovcnt, offset);
+    if (ret < 0) 
+        return -errno_to_p9(errno);
+    else
+        return ret;
+}
+
 static int fs_write(FSDevice *fs, FSFile *f, uint64_t offset,
                     const uint8_t *buf, int count)
 {
@@ -367,7 +996,34 @@ static int fs_write(FSDevice *fs, FSFile *f, uint64_t offset,
 
     if (!f->is_opened || f->is_dir)
         return -P9_EPROTO;
+    if (((FSDeviceDisk *)fs)->writeback) {
+        struct iovec iov;
+        iov.iov_base = (void *)buf;
+        iov.iov_len = count;
+        if (fs_wb_write(fs, f, offset, &iov, 1, &ret))
+            return ret;
+    }
     ret = pwrite(f->u.fd, buf, count, offset);
+    fs_attr_invalidate(fs, f->path->str);
+    if (ret < 0) 
+        return -errno_to_p9(errno);
+    else
+        return ret;
+}
+
+static int fs_writev(FSDevice *fs, FSFile *f, uint64_t offset,
+                     const struct iovec *iov, int iovcnt)
+{
+    int ret;
+
+    if (!f->is_opened || f->is_dir)
+        return -P9_EPROTO;
+    if (((FSDeviceDisk *)fs)->writeback) {
+        if (fs_wb_write(fs, f, offset, iov, iovcnt, &ret))
+            return ret;
+    }
+    ret = pwritev(f->u.fd, iov, iovcnt, offset);
+    fs_attr_invalidate(fs, f->path->str);
     if (ret < 0) 
         return -errno_to_p9(errno);
     else
@@ -378,10 +1034,17 @@ static void fs_close(FSDevice *fs, FSFile *f)
 {
     if (!f->is_opened)
         return;
-    if (f->is_dir)
+    if (f->is_dir) {
         closedir(f->u.dirp);
-    else
+        fs_dir_list_free(f->dir_list);
+        f->dir_list = NULL;
+    } else {
+        fs_wb_flush(fs, f);
         close(f->u.fd);
+        free(f->wb_buf);
+        f->wb_buf = NULL;
+        f->wb_err = 0;
+    }
     f->is_opened = FALSE;
 }
 
@@ -389,7 +1052,8 @@ static int fs_stat(FSDevice *fs, FSFile *f, FSStat *st)
 {
     struct stat st1;
 
-    if (lstat(f->path, &st1) != 0)
+    fs_wb_flush(fs, f);
+    if (fs_lstat(fs, f->path->str, &st1) != 0)
         return -P9_ENOENT;
     stat_to_qid(&st->qid, &st1);
     st->st_mode = st1.st_mode;
@@ -416,20 +1080,22 @@ static int fs_setattr(FSDevice *fs, FSFile *f, uint32_t mask,
 {
     BOOL ctime_updated = FALSE;
 
+    fs_wb_flush(fs, f);
+    fs_attr_invalidate(fs, f->path->str);
     if (mask & (P9_SETATTR_UID | P9_SETATTR_GID)) {
-        if (lchown(f->path, (mask & P9_SETATTR_UID) ? uid : -1,
+        if (lchown(f->path->str, (mask & P9_SETATTR_UID) ? uid : -1,
                    (mask & P9_SETATTR_GID) ? gid : -1) < 0)
             return -errno_to_p9(errno);
         ctime_updated = TRUE;
     }
     /* must be done after uid change for suid */
     if (mask & P9_SETATTR_MODE) {
-        if (chmod(f->path, mode) < 0)
+        if (chmod(f->path->str, mode) < 0)
             return -errno_to_p9(errno);
         ctime_updated = TRUE;
     }
     if (mask & P9_SETATTR_SIZE) {
-        if (truncate(f->path, size) < 0)
+        if (truncate(f->path->str, size) < 0)
             return -errno_to_p9(errno);
         ctime_updated = TRUE;
     }
@@ -459,12 +1125,12 @@ static int fs_setattr(FSDevice *fs, FSFile *f, uint32_t mask,
             ts[1].tv_sec = 0;
             ts[1].tv_nsec = UTIME_OMIT;
         }
-        if (utimensat(AT_FDCWD, f->path, ts, AT_SYMLINK_NOFOLLOW) < 0)
+        if (utimensat(AT_FDCWD, f->path->str, ts, AT_SYMLINK_NOFOLLOW) < 0)
             return -errno_to_p9(errno);
         ctime_updated = TRUE;
     }
     if ((mask & P9_SETATTR_CTIME) && !ctime_updated) {
-        if (lchown(f->path, -1, -1) < 0)
+        if (lchown(f->path->str, -1, -1) < 0)
             return -errno_to_p9(errno);
     }
     return 0;
@@ -474,11 +1140,14 @@ static int fs_link(FSDevice *fs, FSFile *df, FSFile *f, const char *name)
 {
     char *path;
     
-    path = compose_path(df->path, name);
-    if (link(f->path, path) < 0) {
+    path = compose_path(df->path->str, name);
+    if (link(f->path->str, path) < 0) {
         free(path);
         return -errno_to_p9(errno);
     }
+    fs_attr_invalidate(fs, df->path->str);
+    fs_attr_invalidate(fs, f->path->str);
+    fs_attr_invalidate(fs, path);
     free(path);
     return 0;
 }
@@ -489,12 +1158,14 @@ static int fs_symlink(FSDevice *fs, FSQID *qid,
     char *path;
     struct stat st;
     
-    path = compose_path(f->path, name);
+    path = compose_path(f->path->str, name);
     if (symlink(symgt, path) < 0) {
         free(path);
         return -errno_to_p9(errno);
     }
-    if (lstat(path, &st) != 0) {
+    fs_attr_invalidate(fs, f->path->str);
+    fs_attr_invalidate(fs, path);
+    if (fs_lstat(fs, path, &st) != 0) {
         free(path);
         return -errno_to_p9(errno);
     }
@@ -510,12 +1181,14 @@ static int fs_mknod(FSDevice *fs, FSQID *qid,
     char *path;
     struct stat st;
     
-    path = compose_path(f->path, name);
+    path = compose_path(f->path->str, name);
     if (mknod(path, mode, makedev(major, minor)) < 0) {
         free(path);
         return -errno_to_p9(errno);
     }
-    if (lstat(path, &st) != 0) {
+    fs_attr_invalidate(fs, f->path->str);
+    fs_attr_invalidate(fs, path);
+    if (fs_lstat(fs, path, &st) != 0) {
         free(path);
         return -errno_to_p9(errno);
     }
@@ -527,7 +1200,7 @@ static int fs_mknod(FSDevice *fs, FSQID *qid,
 static int fs_readlink(FSDevice *fs, char *buf, int buf_size, FSFile *f)
 {
     int ret;
-    ret = readlink(f->path, buf, buf_size - 1);
+    ret = readlink(f->path->str, buf, buf_size - 1);
     if (ret < 0)
         return -errno_to_p9(errno);
     buf[ret] = '\0';
@@ -540,11 +1213,14 @@ static int fs_renameat(FSDevice *fs, FSFile *f, const char *name,
     char *path, *new_path;
     int ret;
 
-    path = compose_path(f->path, name);
-    new_path = compose_path(new_f->path, new_name);
+    fs_wb_flush_all(fs);
+    path = compose_path(f->path->str, name);
+    new_path = compose_path(new_f->path->str, new_name);
     ret = rename(path, new_path);
     free(path);
     free(new_path);
+    /* the paths below a renamed directory change too */
+    fs_attr_invalidate_all(fs);
     if (ret < 0)
         return -errno_to_p9(errno);
     return 0;
@@ -555,8 +1231,11 @@ static int fs_unlinkat(FSDevice *fs, FSFile *f, const char *name)
     char *path;
     int ret;
 
-    path = compose_path(f->path, name);
+    fs_wb_flush_all(fs);
+    path = compose_path(f->path->str, name);
     ret = remove(path);
+    fs_attr_invalidate(fs, f->path->str);
+    fs_attr_invalidate(fs, path);
     free(path);
     if (ret < 0)
         return -errno_to_p9(errno);
@@ -617,9 +1296,66 @@ static int fs_getlock(FSDevice *fs, FSFile *f, FSLock *lock)
 static void fs_disk_end(FSDevice *fs1)
 {
     FSDeviceDisk *fs = (FSDeviceDisk *)fs1;
+    FSAttrCache *c = fs->attr_cache;
+
+    /* write the buffered data of the files which are still opened */
+    fs_wb_flush_all(fs1);
+    if (c) {
+        fs_attr_invalidate_all(fs1);
+        pthread_mutex_destroy(&c->lock);
+        free(c->hash_table);
+        free(c);
+    }
+    fs_path_put(fs1, fs->root);
+    free(fs->path_hash);
+    pthread_mutex_destroy(&fs->path_lock);
     free(fs->root_path);
 }
 
+static void fs_disk_get_stats(FSDevice *fs1, FSStats *st)
+{
+    FSDeviceDisk *fs = (FSDeviceDisk *)fs1;
+    *st = fs->stats;
+}
+
+/* buffer the small sequential writes for up to delay_ms ms */
+void fs_disk_set_writeback(FSDevice *fs1, int delay_ms)
+{
+    FSDeviceDisk *fs = (FSDeviceDisk *)fs1;
+
+    fs->writeback = TRUE;
+    fs->wb_delay = max_int(delay_ms, 0);
+}
+
+/* cache the attributes of up to max_entries paths for ttl_ms ms.
+   Return < 0 if the cache could not be allocated. */
+int fs_disk_set_attr_cache(FSDevice *fs1, int max_entries, int ttl_ms)
+{
+    FSDeviceDisk *fs = (FSDeviceDisk *)fs1;
+    FSAttrCache *c;
+
+    if (max_entries <= 0 || ttl_ms <= 0 || fs->attr_cache)
+        return 0;
+    c = mallocz(sizeof(*c));
+    if (!c)
+        return -1;
+    c->max_entries = max_entries;
+    c->ttl = ttl_ms;
+    c->hash_bits = 4;
+    while ((1 << c->hash_bits) < max_entries && c->hash_bits < 24)
+        c->hash_bits++;
+    c->hash_table = mallocz(sizeof(c->hash_table[0]) << c->hash_bits);
+    if (!c->hash_table) {
+        free(c);
+        return -1;
+    }
+    pthread_mutex_init(&c->lock, NULL);
+    init_list_head(&c->lru);
+    fs->attr_cache = c;
+    return 0;
+}
+
+
 FSDevice *fs_disk_init(const char *root_path)
 {
     FSDeviceDisk *fs;
@@ -645,6 +1381,8 @@ FSDevice *fs_disk_init(const char *root_path)
     fs->common.fs_readdir = fs_readdir;
     fs->common.fs_read = fs_read;
     fs->common.fs_write = fs_write;
+    fs->common.fs_readv = fs_readv;
+    fs->common.fs_writev = fs_writev;
     fs->common.fs_link = fs_link;
     fs->common.fs_symlink = fs_symlink;
     fs->common.fs_mknod = fs_mknod;
@@ -653,7 +1391,21 @@ FSDevice *fs_disk_init(const char *root_path)
     fs->common.fs_unlinkat = fs_unlinkat;
     fs->common.fs_lock = fs_lock;
     fs->common.fs_getlock = fs_getlock;
+    fs->common.fs_fsync = fs_fsync;
+    fs->common.fs_poll = fs_disk_poll;
+    fs->common.fs_get_stats = fs_disk_get_stats;
+    fs->common.fs_get_file_info = fs_get_file_info;
     
+    pthread_mutex_init(&fs->wb_lock, NULL);
+    init_list_head(&fs->wb_dirty);
     fs->root_path = strdup(root_path);
+    pthread_mutex_init(&fs->path_lock, NULL);
+    fs->root = fs_path_new_root(root_path);
+    fs->path_hash_bits = 8;
+    fs->path_hash = mallocz(sizeof(fs->path_hash[0]) << fs->path_hash_bits);
+    if (!fs->root || !fs->path_hash) {
+        fs_end((FSDevice *)fs);
+        return NULL;
+    }
     return (FSDevice *)fs;
 }
@@ -6,7 +6,14 @@
 #include <stddef.h>
 #include <vector>
 #include <map>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "iceblk.h"
+#include "checkpoint.h"
+#include "dma.h"
 
 #define BLKDEV_ADDR      0
 #define BLKDEV_OFFSET    8
@@ -21,7 +28,17 @@
 #define BLKDEV_SECTOR_SIZE 512
 #define BLKDEV_SECTOR_SHIFT 9
 
-#define MAX_REQUEST_LENGTH 16
+// default maximum request length in sectors, and maximum number of
+// trackers (the tags are read as bytes)
+#define MAX_REQUEST_LENGTH 128
+#define MAX_TRACKERS 256
+
+// mode=rw: granularity of the dirty tracking, and interval in ticks
+// between two syncs of the written chunks to the image
+#define BLKDEV_CHUNK_SHIFT 16
+#define BLKDEV_SYNC_INTERVAL (1 << 20)
+
+#define ICEBLK_STATE_VERSION 1
 
 /* #define DEBUG_BLKDEV */
 
@@ -51,99 +68,209 @@ iceblk_t::iceblk_t(
   }
 
 
-  auto it = argmap.find("img");
+  max_request_length = MAX_REQUEST_LENGTH;
+  auto it = argmap.find("max_request_length");
+  if (it != argmap.end()) {
+    max_request_length = strtoul(it->second.c_str(), NULL, 0);
+    if (max_request_length == 0) {
+      max_request_length = MAX_REQUEST_LENGTH;
+    }
+  }
+
+  it = argmap.find("latency");
+  if (it != argmap.end()) {
+    blockdevice_latency = strtoull(it->second.c_str(), NULL, 0);
+  }
+
+  it = argmap.find("bw");
+  if (it != argmap.end()) {
+    blockdevice_bw = strtoull(it->second.c_str(), NULL, 0);
+  }
+
+  it = argmap.find("trackers");
+  if (it != argmap.end()) {
+    trackers = std::max(1, std::min(MAX_TRACKERS, (int)strtol(it->second.c_str(), NULL, 0)));
+  }
+
+  it = argmap.find("mode");
+  if (it != argmap.end() && it->second == "rw") {
+    shared = true;
+  }
+
+  void* map;
+  it = argmap.find("img");
   if (it == argmap.end()) {
     blockdevice_size = (sizeof(uint64_t)/sizeof(uint8_t)) * BLKDEV_SECTOR_SIZE * 8;
-    blockdevice = (uint64_t*)malloc(sizeof(uint64_t) * blockdevice_size);
+    map_size = blockdevice_size;
+    shared = false;
+    map = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
   } else {
     std::string img_path = it->second;
-    FILE* fp = fopen(img_path.c_str(), "r");
-    if (fp == nullptr) {
+    int fd = open(img_path.c_str(), shared ? O_RDWR : O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0) {
       printf("Error opening file %s\n", img_path.c_str());
       exit(1);
     }
 
-    fseek(fp, 0, SEEK_END);
-    uint64_t img_sz = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-
-    uint64_t sectors_in_img = (img_sz + BLKDEV_SECTOR_SIZE) / BLKDEV_SECTOR_SIZE;
+    // a partial last sector is in the last page of the file, so it
+    // reads as zero instead of faulting
+    uint64_t img_sz = st.st_size;
+    uint64_t sectors_in_img = (img_sz + BLKDEV_SECTOR_SIZE - 1) / BLKDEV_SECTOR_SIZE;
     blockdevice_size = sectors_in_img * BLKDEV_SECTOR_SIZE;
-    blockdevice = (uint64_t*)malloc(blockdevice_size);
+    map_size = blockdevice_size;
 
-    fread((void*)blockdevice, sizeof(uint64_t), img_sz/sizeof(uint64_t), fp);
-    fclose(fp);
+    // snapshot (default): the writes are kept in private copies of the
+    // pages, the image is not modified
+    map = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+               shared ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    close(fd);
+  }
+  if (map == MAP_FAILED) {
+    perror("iceblk: mmap");
+    exit(1);
+  }
+  blockdevice = (uint64_t*)map;
+  if (shared) {
+    dirty_chunks.resize((map_size >> BLKDEV_CHUNK_SHIFT) + 1);
+  } else {
+    written_chunks.resize((map_size >> BLKDEV_CHUNK_SHIFT) + 1);
   }
 
+  requests.resize(trackers);
   for (int i = 0; i < trackers; i++) {
     idle_tags.push(i);
   }
+
+  sched.init(cur_tick);
+  complete_timer.init(complete_timer_cb, this);
+  sync_timer.init(sync_timer_cb, this);
 }
 
 iceblk_t::~iceblk_t() {
-  free(blockdevice);
+  sync_blockdevice();
+  munmap(blockdevice, map_size);
 }
 
-void iceblk_t::handle_request() {
-  assert(req_addr % 8 == 0);
-  if (req_write) handle_write_request();
-  else handle_read_request();
-  intctrl->set_interrupt_level(interrupt_id, 1);
+// write the chunks modified since the last sync back to the image
+void iceblk_t::sync_blockdevice() {
+  if (!dirty) return;
+  size_t n = dirty_chunks.size();
+  for (size_t i = 0; i < n; i++) {
+    if (!dirty_chunks[i]) continue;
+    size_t j = i;
+    while (j < n && dirty_chunks[j]) {
+      dirty_chunks[j] = false;
+      j++;
+    }
+    size_t start = i << BLKDEV_CHUNK_SHIFT;
+    size_t end = std::min(j << BLKDEV_CHUNK_SHIFT, map_size);
+    if (msync((uint8_t*)blockdevice + start, end - start, MS_SYNC) < 0) {
+      perror("iceblk: msync");
+    }
+    i = j;
+  }
+  dirty = false;
 }
 
-void iceblk_t::handle_read_request() {
-  mmu_t* simdram = sim->debug_mmu;
-  uint64_t data;
-  for (reg_t sidx = 0; sidx < req_len; sidx++) {
-    for (reg_t i = 0; i < BLKDEV_SECTOR_SIZE; i += 8) {
-      read_blockdevice_u64(&data, sidx + req_offset, i);
-      simdram->store<uint64_t>(req_addr + sidx * BLKDEV_SECTOR_SIZE + i, data);
-    }
+void iceblk_t::handle_request(const blkdev_request_t& req) {
+  assert(req.addr % 8 == 0);
+  if (req.len > max_request_length) {
+    // failed like the requests past the end of the image
+    fprintf(stderr, "iceblk: request of %" PRIu64 " sectors over the maximum"
+            " of %" PRIu64 " ignored\n", (uint64_t)req.len,
+            (uint64_t)max_request_length);
+  } else if (req.write) {
+    handle_write_request(req);
+  } else {
+    handle_read_request(req);
   }
+  intctrl->set_interrupt_level(interrupt_id, 1);
+}
+
+// the registers are set by the guest: a request past the end of the
+// image fails, it completes without any transfer
+bool iceblk_t::request_in_range(const blkdev_request_t& req) {
+  reg_t nsectors = blockdevice_size / BLKDEV_SECTOR_SIZE;
+  if (req.offset <= nsectors && req.len <= nsectors - req.offset)
+    return true;
+  fprintf(stderr, "iceblk: %s of sectors %" PRIu64 "+%" PRIu64
+          " past the end of the image ignored\n",
+          req.write ? "write" : "read", (uint64_t)req.offset, (uint64_t)req.len);
+  return false;
 }
 
-void iceblk_t::read_blockdevice_u64(uint64_t* data, reg_t sidx, reg_t boff) {
-  assert(boff % 8 == 0);
-  assert(sidx * BLKDEV_SECTOR_SIZE + boff < blockdevice_size);
-  reg_t byte_idx = sidx * BLKDEV_SECTOR_SIZE + boff;
-  reg_t bytes_per_elem = sizeof(uint64_t) / sizeof(uint8_t);
-  reg_t blkdev_idx = byte_idx / bytes_per_elem;
-  *data = blockdevice[blkdev_idx];
-  blkdev_printf("blkdev rd: [%" PRIu64 "]: 0x%" PRIx64 "\n", blkdev_idx, *data);
+// the sectors are copied between the image mapping and the guest
+// memory in bulk, page by page
+void iceblk_t::handle_read_request(const blkdev_request_t& req) {
+  if (!request_in_range(req)) return;
+  size_t offset = req.offset * BLKDEV_SECTOR_SIZE;
+  size_t len = req.len * BLKDEV_SECTOR_SIZE;
+  blkdev_printf("blkdev rd: sector %" PRIu64 " count %" PRIu64 "\n", req.offset, req.len);
+  dma_memcpy_to_ram(sim, req.addr, (uint8_t*)blockdevice + offset, len);
 }
 
-void iceblk_t::handle_write_request() {
-  mmu_t* simdram = sim->debug_mmu;
-  for (reg_t sidx = 0; sidx < req_len; sidx++) {
-    for (reg_t i = 0; i < BLKDEV_SECTOR_SIZE; i+= 8) {
-      uint64_t data = simdram->load<uint64_t>(req_addr + sidx * BLKDEV_SECTOR_SIZE + i);
-      write_blockdevice_u64(data, sidx, i);
+void iceblk_t::handle_write_request(const blkdev_request_t& req) {
+  if (!request_in_range(req)) return;
+  size_t offset = req.offset * BLKDEV_SECTOR_SIZE;
+  size_t len = req.len * BLKDEV_SECTOR_SIZE;
+  blkdev_printf("blkdev wr: sector %" PRIu64 " count %" PRIu64 "\n", req.offset, req.len);
+  dma_memcpy_from_ram(sim, (uint8_t*)blockdevice + offset, req.addr, len);
+  if (len > 0) {
+    for (size_t i = offset >> BLKDEV_CHUNK_SHIFT; i <= (offset + len - 1) >> BLKDEV_CHUNK_SHIFT; i++) {
+      if (shared)
+        dirty_chunks[i] = true;
+      else
+        written_chunks[i] = true;
+    }
+    if (shared) {
+      dirty = true;
+      if (!sync_timer.armed())
+        sched.arm(&sync_timer, cur_tick + BLKDEV_SYNC_INTERVAL);
     }
   }
 }
 
-void iceblk_t::write_blockdevice_u64(uint64_t data, reg_t sidx, reg_t boff) {
-  reg_t byte_idx = sidx * BLKDEV_SECTOR_SIZE + boff;
-  assert(byte_idx < blockdevice_size);
+// the request registers are latched in an idle tracker, so that the
+// guest can set up the next request while this one is in flight
+bool iceblk_t::post_request(unsigned int* tag) {
+  if (idle_tags.empty()) return false;
+  *tag = idle_tags.front();
+  idle_tags.pop();
+  requests[*tag] = next_req;
 
-  reg_t bytes_per_elem = sizeof(uint64_t) / sizeof(uint8_t);
-  reg_t blkdev_idx = byte_idx / bytes_per_elem;
-  blockdevice[blkdev_idx] = data;
-  blkdev_printf("blkdev wr: [%" PRIu64 "]: 0x%" PRIx64 "\n", blkdev_idx, data);
-}
+  // fast-forward: no simulated disk time
+  if (blockdevice_latency == 0) {
+    handle_request(requests[*tag]);
+    cmpl_tags.push(*tag);
+    return true;
+  }
 
-void iceblk_t::post_request() {
-  pending_tags.push(idle_tags.front());
-  idle_tags.pop();
+  uint64_t start = std::max(cur_tick, channel_free_tick);
+  if (blockdevice_bw > 0) {
+    // an oversized request fails, it does not hold the channel longer
+    uint64_t bytes = std::min(next_req.len, max_request_length) * BLKDEV_SECTOR_SIZE;
+    channel_free_tick = start + (bytes + blockdevice_bw - 1) / blockdevice_bw;
+  } else {
+    channel_free_tick = start;
+  }
+  requests[*tag].ready_tick = channel_free_tick + blockdevice_latency;
+  pending_tags.push(*tag);
+  if (!complete_timer.armed())
+    sched.arm(&complete_timer, requests[*tag].ready_tick);
+  return true;
 }
 
 bool iceblk_t::load(reg_t addr, size_t len, uint8_t* bytes) {
   if (len > 8) return false;
 
-  int tag;
+  unsigned int tag;
   switch (addr) {
     case BLKDEV_REQUEST:
-      post_request();
+      // return the tag of the posted request
+      if (!post_request(&tag)) return false;
+      read_little_endian_reg(tag, 0, len, bytes);
       break;
     case BLKDEV_NREQUEST:
       read_little_endian_reg((int)idle_tags.size(), 0, len, bytes);
@@ -169,7 +296,7 @@ bool iceblk_t::load(reg_t addr, size_t len, uint8_t* bytes) {
       read_little_endian_reg((int)(blockdevice_size / BLKDEV_SECTOR_SIZE), 0, len, bytes);
       break;
     case BLKDEV_MAX_REQUEST_LENGTH:
-      read_little_endian_reg((int)(MAX_REQUEST_LENGTH), 0, len, bytes);
+      read_little_endian_reg((int)max_request_length, 0, len, bytes);
       break;
     default:
       return false;
@@ -182,16 +309,16 @@ bool iceblk_t::store(reg_t addr, size_t len, const uint8_t* bytes) {
 
   switch (addr) {
     case BLKDEV_ADDR:
-      write_little_endian_reg(&req_addr, 0, len, bytes);
+      write_little_endian_reg(&next_req.addr, 0, len, bytes);
       break;
     case BLKDEV_OFFSET:
-      write_little_endian_reg(&req_offset, 0, len, bytes);
+      write_little_endian_reg(&next_req.offset, 0, len, bytes);
       break;
     case BLKDEV_LEN:
-      write_little_endian_reg(&req_len, 0, len, bytes);
+      write_little_endian_reg(&next_req.len, 0, len, bytes);
       break;
     case BLKDEV_WRITE:
-      write_little_endian_reg(&req_write, 0, len, bytes);
+      write_little_endian_reg(&next_req.write, 0, len, bytes);
       break;
     default:
       return false;
@@ -199,16 +326,146 @@ bool iceblk_t::store(reg_t addr, size_t len, const uint8_t* bytes) {
   return true;
 }
 
+// the transfers are serialized and have the same latency: the
+// requests complete in order
+void iceblk_t::complete_requests() {
+  while (!pending_tags.empty() &&
+         requests[pending_tags.front()].ready_tick <= cur_tick) {
+    unsigned int tag = pending_tags.front();
+    handle_request(requests[tag]);
+    cmpl_tags.push(tag);
+    pending_tags.pop();
+  }
+  if (!pending_tags.empty())
+    sched.arm(&complete_timer, requests[pending_tags.front()].ready_tick);
+}
+
+void iceblk_t::complete_timer_cb(device_timer_t *t) {
+  ((iceblk_t*)t->opaque)->complete_requests();
+}
+
+void iceblk_t::sync_timer_cb(device_timer_t *t) {
+  ((iceblk_t*)t->opaque)->sync_blockdevice();
+}
+
 void iceblk_t::tick(reg_t rtc_ticks) {
-  if (++cur_tick % blockdevice_latency == 0) {
-    cur_tick = 0;
+  cur_tick++;
+  sched.advance(cur_tick);
+}
+
+static void put_request(device_state_writer_t& w, const blkdev_request_t& req) {
+  w.put_u64(req.addr);
+  w.put_u64(req.offset);
+  w.put_u64(req.len);
+  w.put_u64(req.write);
+  w.put_u64(req.ready_tick);
+}
+
+static blkdev_request_t get_request(device_state_reader_t& r) {
+  blkdev_request_t req;
+  req.addr = r.get_u64();
+  req.offset = r.get_u64();
+  req.len = r.get_u64();
+  req.write = r.get_u64();
+  req.ready_tick = r.get_u64();
+  return req;
+}
+
+static void put_tags(device_state_writer_t& w, std::queue<unsigned int> tags) {
+  w.put_u32(tags.size());
+  for (; !tags.empty(); tags.pop())
+    w.put_u32(tags.front());
+}
+
+static bool get_tags(device_state_reader_t& r, std::queue<unsigned int>& tags, int trackers) {
+  uint32_t n = r.get_u32();
+  for (uint32_t i = 0; i < n && r.ok(); i++) {
+    unsigned int tag = r.get_u32();
+    if (tag >= (unsigned int)trackers) return false;
+    tags.push(tag);
   }
+  return r.ok();
+}
 
-  if (cur_tick > 0 || pending_tags.empty()) return;
+bool iceblk_t::checkpoint(std::vector<uint8_t>& blob) {
+  if (shared) {
+    fprintf(stderr, "iceblk: mode=rw cannot be checkpointed\n");
+    return false;
+  }
+  device_state_writer_t w(blob, "iceblk", ICEBLK_STATE_VERSION);
+  w.put_u64(blockdevice_size);
+  w.put_u32(trackers);
+  w.put_u64(cur_tick);
+  w.put_u64(channel_free_tick);
+  put_request(w, next_req);
+  for (auto& req : requests)
+    put_request(w, req);
+  put_tags(w, idle_tags);
+  put_tags(w, pending_tags);
+  put_tags(w, cmpl_tags);
+  w.put_u32(std::count(written_chunks.begin(), written_chunks.end(), true));
+  for (size_t i = 0; i < written_chunks.size(); i++) {
+    if (!written_chunks[i]) continue;
+    size_t start = i << BLKDEV_CHUNK_SHIFT;
+    w.put_u32(i);
+    w.put_bytes((uint8_t*)blockdevice + start,
+                std::min(start + (1 << BLKDEV_CHUNK_SHIFT), map_size) - start);
+  }
+  w.end();
+  return true;
+}
 
-  handle_request();
-  cmpl_tags.push(pending_tags.front());
-  pending_tags.pop();
+// a failure once the chunks are being restored leaves the image
+// content undefined
+bool iceblk_t::restore(const std::vector<uint8_t>& blob) {
+  device_state_reader_t r(blob, "iceblk", ICEBLK_STATE_VERSION);
+  if (shared || r.get_u64() != blockdevice_size ||
+      r.get_u32() != (uint32_t)trackers)
+    return false;
+  uint64_t cur_tick1 = r.get_u64();
+  uint64_t channel_free_tick1 = r.get_u64();
+  blkdev_request_t next_req1 = get_request(r);
+  std::vector<blkdev_request_t> requests1(trackers);
+  for (auto& req : requests1)
+    req = get_request(r);
+  std::queue<unsigned int> idle1, pending1, cmpl1;
+  if (!get_tags(r, idle1, trackers) || !get_tags(r, pending1, trackers) ||
+      !get_tags(r, cmpl1, trackers))
+    return false;
+
+  // back to the image content: the private pages are dropped
+  for (size_t i = 0; i < written_chunks.size(); i++) {
+    if (!written_chunks[i]) continue;
+    size_t start = i << BLKDEV_CHUNK_SHIFT;
+    madvise((uint8_t*)blockdevice + start,
+            std::min(start + (1 << BLKDEV_CHUNK_SHIFT), map_size) - start,
+            MADV_DONTNEED);
+    written_chunks[i] = false;
+  }
+  uint32_t n = r.get_u32();
+  for (uint32_t k = 0; k < n && r.ok(); k++) {
+    size_t i = r.get_u32();
+    if (i >= written_chunks.size()) return false;
+    size_t start = i << BLKDEV_CHUNK_SHIFT;
+    r.get_bytes((uint8_t*)blockdevice + start,
+                std::min(start + (1 << BLKDEV_CHUNK_SHIFT), map_size) - start);
+    written_chunks[i] = true;
+  }
+  if (!r.ok()) return false;
+
+  cur_tick = cur_tick1;
+  channel_free_tick = channel_free_tick1;
+  next_req = next_req1;
+  requests.swap(requests1);
+  idle_tags.swap(idle1);
+  pending_tags.swap(pending1);
+  cmpl_tags.swap(cmpl1);
+  // no sync deadline: mode=rw is not checkpointed
+  sched.reset(cur_tick);
+  if (!pending_tags.empty())
+    sched.arm(&complete_timer, requests[pending_tags.front()].ready_tick);
+  intctrl->set_interrupt_level(interrupt_id, cmpl_tags.empty() ? 0 : 1);
+  return true;
 }
 
 int fdt_parse_blkdev(
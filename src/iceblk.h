@@ -14,11 +14,21 @@
 #include <riscv/sim.h>
 #include <riscv/dts.h>
 #include <fdt/libfdt.h>
+#include "device_sched.h"
 
 #define BLKDEV_BASE         0x10015000
 #define BLKDEV_INTERRUPT_ID 2
 #define BLKDEV_SIZE        0x1000
 
+// request posted by the guest, one per tracker
+struct blkdev_request_t {
+  reg_t addr   = 0;
+  reg_t offset = 0;
+  reg_t len    = 0;
+  reg_t write  = 0;
+  uint64_t ready_tick = 0; // completed on this tick
+};
+
 class iceblk_t : public abstract_device_t {
 public:
   iceblk_t(
@@ -30,36 +40,62 @@ public:
   bool load(reg_t addr, size_t len, uint8_t* bytes) override;
   bool store(reg_t addr, size_t len, const uint8_t* bytes) override;
   void tick(reg_t rtc_ticks) override;
+  // Device state, see checkpoint.h. The chunks written by the guest
+  // are part of the state. mode=rw, which writes the image itself,
+  // cannot be checkpointed.
+  bool checkpoint(std::vector<uint8_t>& blob);
+  bool restore(const std::vector<uint8_t>& blob);
 
 private:
-  void post_request();
-  void handle_request();
-  void handle_read_request();
-  void handle_write_request();
+  bool post_request(unsigned int* tag);
+  void handle_request(const blkdev_request_t& req);
+  bool request_in_range(const blkdev_request_t& req);
+  void handle_read_request(const blkdev_request_t& req);
+  void handle_write_request(const blkdev_request_t& req);
 
-  void read_blockdevice_u64(uint64_t* data, reg_t sector_idx, reg_t byte_offset);
-  void write_blockdevice_u64(uint64_t data, reg_t sector_idx, reg_t byte_offset);
+  void sync_blockdevice();
+  void complete_requests();
+  static void complete_timer_cb(device_timer_t *t);
+  static void sync_timer_cb(device_timer_t *t);
 
 private:
+  // timing model: a request completes blockdevice_latency ticks after
+  // its transfer, the transfers are serialized at blockdevice_bw bytes
+  // per tick (0: unlimited). With blockdevice_latency = 0, the
+  // requests complete when they are posted.
   uint64_t blockdevice_latency = 500;
+  uint64_t blockdevice_bw = 0;
+  uint64_t channel_free_tick = 0;
   uint64_t cur_tick = 0;
+  // the completion of the first pending request and the next sync are
+  // the only deadlines: the other ticks do nothing
+  device_sched_t sched;
+  device_timer_t complete_timer;
+  device_timer_t sync_timer;
+  // the image is mapped in memory, its pages are read on first access
   uint64_t* blockdevice;
   uint64_t blockdevice_size;
+  size_t map_size;
+  // mode=rw: shared mapping, the written chunks are synced to the image
+  bool shared = false;
+  std::vector<bool> dirty_chunks;
+  bool dirty = false;
+  // snapshot mode: chunks with private copies of the image pages
+  std::vector<bool> written_chunks;
 
   const simif_t* sim;
   abstract_interrupt_controller_t *intctrl;
   uint32_t interrupt_id;
 
   int trackers = 1;
+  reg_t max_request_length;
   std::queue<unsigned int> idle_tags;
   std::queue<unsigned int> pending_tags;
   std::queue<unsigned int> cmpl_tags;
+  std::vector<blkdev_request_t> requests; // indexed by tag
 
-  // FIXME : When tracker > 1, need to change these to queues as well
-  reg_t req_addr   = 0;
-  reg_t req_offset = 0;
-  reg_t req_len    = 0;
-  reg_t req_write  = 0;
+  // request being set up by the guest, copied to its tracker when posted
+  blkdev_request_t next_req;
 };
 
 #endif //__BLKDEV_H__
@@ -0,0 +1,197 @@
+/*
+ * LZ4 block format compression
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "lz4.h"
+
+/* A sequence is a token (literal length:4, match length - 4:4), the
+   literal length extension, the literals, a 16 bit little endian
+   match offset and the match length extension. The lengths equal to
+   15 are extended with bytes added until one is not 255. The last
+   sequence only has literals: the last LZ4_LAST_LITERALS bytes are
+   always literals and no match starts in the last LZ4_MF_LIMIT
+   bytes. */
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MF_LIMIT 12
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_HASH_BITS 12
+
+static inline uint32_t lz4_read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline int lz4_hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+static uint8_t *lz4_put_length(uint8_t *op, int len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+/* emit the literals from anchor to ip and the match (if match_len > 0) */
+static uint8_t *lz4_put_sequence(uint8_t *op, const uint8_t *anchor,
+                                 const uint8_t *ip, int offset, int match_len)
+{
+    uint8_t *token = op++;
+    int lit_len = ip - anchor;
+
+    if (lit_len >= 15) {
+        *token = 15 << 4;
+        op = lz4_put_length(op, lit_len - 15);
+    } else {
+        *token = lit_len << 4;
+    }
+    memcpy(op, anchor, lit_len);
+    op += lit_len;
+    if (match_len > 0) {
+        *op++ = offset;
+        *op++ = offset >> 8;
+        match_len -= LZ4_MIN_MATCH;
+        if (match_len >= 15) {
+            *token |= 15;
+            op = lz4_put_length(op, match_len - 15);
+        } else {
+            *token |= match_len;
+        }
+    }
+    return op;
+}
+
+/* maximum size of a sequence */
+static inline int lz4_sequence_bound(int lit_len, int match_len)
+{
+    return 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1;
+}
+
+int lz4_compress(uint8_t *dst, int dst_size, const uint8_t *src, int src_size)
+{
+    int32_t table[1 << LZ4_HASH_BITS];
+    const uint8_t *ip, *anchor, *ref, *mf_limit, *match_limit;
+    const uint8_t *iend = src + src_size;
+    uint8_t *op = dst, *oend = dst + dst_size;
+    int h, len;
+
+    memset(table, 0xff, sizeof(table));
+    ip = anchor = src;
+    mf_limit = iend - LZ4_MF_LIMIT;
+    match_limit = iend - LZ4_LAST_LITERALS;
+    while (ip < mf_limit) {
+        h = lz4_hash(lz4_read32(ip));
+        ref = src + table[h];
+        table[h] = ip - src;
+        if (ref < src || ip - ref > LZ4_MAX_OFFSET ||
+            lz4_read32(ref) != lz4_read32(ip)) {
+            ip++;
+            continue;
+        }
+        /* extend the match backwards and forwards */
+        while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+            ip--;
+            ref--;
+        }
+        len = LZ4_MIN_MATCH;
+        while (ip + len < match_limit && ip[len] == ref[len])
+            len++;
+        if (oend - op < lz4_sequence_bound(ip - anchor, len))
+            return 0;
+        op = lz4_put_sequence(op, anchor, ip, ip - ref, len);
+        ip += len;
+        anchor = ip;
+    }
+    if (oend - op < lz4_sequence_bound(iend - anchor, 0))
+        return 0;
+    op = lz4_put_sequence(op, anchor, iend, 0, 0);
+    return op - dst;
+}
+
+static int lz4_get_length(const uint8_t **pip, const uint8_t *iend, int len)
+{
+    const uint8_t *ip = *pip;
+    int b;
+
+    do {
+        if (ip >= iend)
+            return -1;
+        b = *ip++;
+        len += b;
+    } while (b == 255);
+    *pip = ip;
+    return len;
+}
+
+int lz4_decompress(uint8_t *dst, int dst_size, const uint8_t *src,
+                   int src_size)
+{
+    const uint8_t *ip = src, *iend = src + src_size, *ref;
+    uint8_t *op = dst, *oend = dst + dst_size;
+    int token, len, offset;
+
+    while (ip < iend) {
+        token = *ip++;
+        len = token >> 4;
+        if (len == 15 && (len = lz4_get_length(&ip, iend, len)) < 0)
+            return -1;
+        if (len > iend - ip || len > oend - op)
+            return -1;
+        memcpy(op, ip, len);
+        ip += len;
+        op += len;
+        if (ip == iend)
+            break; /* last sequence */
+        if (iend - ip < 2)
+            return -1;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op - dst)
+            return -1;
+        len = token & 15;
+        if (len == 15 && (len = lz4_get_length(&ip, iend, len)) < 0)
+            return -1;
+        len += LZ4_MIN_MATCH;
+        if (len > oend - op)
+            return -1;
+        ref = op - offset;
+        if (offset >= len) {
+            memcpy(op, ref, len);
+            op += len;
+        } else {
+            /* overlapping copy */
+            while (len-- > 0)
+                *op++ = *ref++;
+        }
+    }
+    return op - dst;
+}
@@ -0,0 +1,46 @@
+/*
+ * LZ4 block format compression
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+/* maximum compressed size of src_size bytes */
+#define LZ4_COMPRESS_BOUND(src_size) ((src_size) + (src_size) / 255 + 16)
+
+/* Return the compressed size or 0 if it does not fit in dst_size
+   bytes. The output is compatible with the LZ4 block format. */
+int lz4_compress(uint8_t *dst, int dst_size, const uint8_t *src, int src_size);
+/* Return the decompressed size or -1 if the input is invalid or does
+   not fit in dst_size bytes. */
+int lz4_decompress(uint8_t *dst, int dst_size, const uint8_t *src,
+                   int src_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LZ4_H */
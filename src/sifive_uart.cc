@@ -1,4 +1,9 @@
 #include "sifive_uart.h"
+#include "checkpoint.h"
+#include <unistd.h>
+#include <map>
+
+#define UART_STATE_VERSION 1
 
 bool sifive_uart_t::load(reg_t addr, size_t len, uint8_t* bytes) {
   if (addr >= 0x1000 || len > 4) return false;
@@ -21,7 +26,7 @@ bool sifive_uart_t::load(reg_t addr, size_t len, uint8_t* bytes) {
 bool sifive_uart_t::store(reg_t addr, size_t len, const uint8_t* bytes) {
   if (addr >= 0x1000 || len > 4) return false;
   switch (addr) {
-  case UART_TXFIFO: canonical_terminal_t::write(*bytes); return true;
+  case UART_TXFIFO: write_tx(*bytes); return true;
   case UART_TXCTRL: memcpy(&txctrl, bytes, len); return true;
   case UART_RXCTRL: memcpy(&rxctrl, bytes, len); return true;
   case UART_IE:     memcpy(&ie, bytes, len); update_interrupts(); return true;
@@ -30,7 +35,21 @@ bool sifive_uart_t::store(reg_t addr, size_t len, const uint8_t* bytes) {
   }
 }
 
+// one write system call for the buffered output
+void sifive_uart_t::flush_tx() {
+  size_t pos = 0;
+  while (pos < tx_len) {
+    ssize_t ret = ::write(STDOUT_FILENO, tx_buf + pos, tx_len - pos);
+    if (ret <= 0) abort();
+    pos += ret;
+  }
+  tx_len = 0;
+}
+
 void sifive_uart_t::tick(reg_t UNUSED rtc_ticks) {
+  if (tx_len > 0) flush_tx();
+  if (++rx_poll_ticks < rx_poll_interval) return;
+  rx_poll_ticks = 0;
   if (rx_fifo.size() >= UART_RX_FIFO_SIZE) return;
   int rc = canonical_terminal_t::read();
   if (rc < 0) return;
@@ -38,6 +57,49 @@ void sifive_uart_t::tick(reg_t UNUSED rtc_ticks) {
   update_interrupts();
 }
 
+bool sifive_uart_t::checkpoint(std::vector<uint8_t>& blob) {
+  flush_tx();
+  device_state_writer_t w(blob, "sifive_uart", UART_STATE_VERSION);
+  w.put_u32(ie);
+  w.put_u32(ip);
+  w.put_u32(txctrl);
+  w.put_u32(rxctrl);
+  w.put_u32(div);
+  w.put_u64(rx_poll_ticks);
+  std::queue<uint8_t> q = rx_fifo;
+  w.put_u32(q.size());
+  for (; !q.empty(); q.pop())
+    w.put_u8(q.front());
+  w.end();
+  return true;
+}
+
+bool sifive_uart_t::restore(const std::vector<uint8_t>& blob) {
+  device_state_reader_t r(blob, "sifive_uart", UART_STATE_VERSION);
+  uint32_t ie1 = r.get_u32();
+  uint32_t ip1 = r.get_u32();
+  uint32_t txctrl1 = r.get_u32();
+  uint32_t rxctrl1 = r.get_u32();
+  uint32_t div1 = r.get_u32();
+  uint64_t rx_poll_ticks1 = r.get_u64();
+  uint32_t n = r.get_u32();
+  std::queue<uint8_t> q;
+  for (uint32_t i = 0; i < n && r.ok(); i++)
+    q.push(r.get_u8());
+  if (!r.ok() || n > UART_RX_FIFO_SIZE) return false;
+
+  flush_tx();
+  ie = ie1;
+  ip = ip1;
+  txctrl = txctrl1;
+  rxctrl = rxctrl1;
+  div = div1;
+  rx_poll_ticks = rx_poll_ticks1;
+  rx_fifo.swap(q);
+  update_interrupts();
+  return true;
+}
+
 int fdt_parse_sifive_uart(const void *fdt, reg_t *sifive_uart_addr,
 			  const char *compatible) {
   int nodeoffset, len, rc;
@@ -59,7 +121,19 @@ int fdt_parse_sifive_uart(const void *fdt, reg_t *sifive_uart_addr,
 sifive_uart_t* sifive_uart_parse_from_fdt(const void* fdt, const sim_t* sim, reg_t* base, std::vector<std::string> sargs) {
   if (fdt_parse_sifive_uart(fdt, base, "sifive,uart0") == 0) {
     printf("Found uart at %lx\n", *base);
-    return new sifive_uart_t(sim->get_intctrl(), 1);
+    std::map<std::string, std::string> argmap;
+    for (auto arg : sargs) {
+      size_t eq_idx = arg.find('=');
+      if (eq_idx != std::string::npos) {
+        argmap.insert(std::pair<std::string, std::string>(arg.substr(0, eq_idx), arg.substr(eq_idx+1)));
+      }
+    }
+    reg_t rx_poll_interval = UART_RX_POLL_INTERVAL;
+    auto it = argmap.find("rx_poll_interval");
+    if (it != argmap.end()) {
+      rx_poll_interval = strtoul(it->second.c_str(), NULL, 0);
+    }
+    return new sifive_uart_t(sim->get_intctrl(), 1, rx_poll_interval);
   } else {
     return nullptr;
   }
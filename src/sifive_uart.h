@@ -31,14 +31,27 @@
 #define UART_IP_TXWM       (1)
 #define UART_IP_RXWM       (2)
 
+// the output is written to the terminal on newline, when the buffer is
+// full and on every tick. The input is polled every rx_poll_interval
+// ticks.
+#define UART_TX_BUF_SIZE (256)
+#define UART_RX_POLL_INTERVAL (10)
+
 class sifive_uart_t : public abstract_device_t {
 public:
-  sifive_uart_t(abstract_interrupt_controller_t *intctrl, reg_t int_id) :
-    ie(0), ip(0), txctrl(0), rxctrl(0), div(0), interrupt_id(int_id), intctrl(intctrl) {}
+  sifive_uart_t(abstract_interrupt_controller_t *intctrl, reg_t int_id,
+                reg_t rx_poll_interval = UART_RX_POLL_INTERVAL) :
+    ie(0), ip(0), txctrl(0), rxctrl(0), div(0), interrupt_id(int_id), intctrl(intctrl),
+    tx_len(0), rx_poll_interval(rx_poll_interval ? rx_poll_interval : 1), rx_poll_ticks(0) {}
+  ~sifive_uart_t() { flush_tx(); }
 
   bool load(reg_t addr, size_t len, uint8_t* bytes) override;
   bool store(reg_t addr, size_t len, const uint8_t* bytes) override;
   void tick(reg_t UNUSED rtc_ticks) override;
+  // device state, see checkpoint.h. The buffered output is written
+  // first.
+  bool checkpoint(std::vector<uint8_t>& blob);
+  bool restore(const std::vector<uint8_t>& blob);
 
 private:
   std::queue<uint8_t> rx_fifo;
@@ -49,6 +62,17 @@ private:
   uint32_t div;
   reg_t interrupt_id;
   abstract_interrupt_controller_t *intctrl;
+  char tx_buf[UART_TX_BUF_SIZE];
+  size_t tx_len;
+  reg_t rx_poll_interval;
+  reg_t rx_poll_ticks;
+
+  void write_tx(uint8_t ch) {
+    tx_buf[tx_len++] = ch;
+    if (ch == '\n' || tx_len == UART_TX_BUF_SIZE) flush_tx();
+  }
+
+  void flush_tx();
 
   uint64_t read_ip() {
     uint64_t ret = 0;
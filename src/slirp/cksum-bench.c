@@ -0,0 +1,252 @@
+/*
+ * Internet checksum microbenchmark
+ *
+ * Compares the checksum kernels of cksum.c against the historical BSD
+ * 16 bit loop, first for correctness and then for throughput.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "slirp.h"
+
+#define BUF_SIZE (65536 + 64)
+
+static const char *impl_names[] = { "generic", "sse2", "avx2", "neon" };
+
+/* the BSD in_cksum() loop that cksum.c used before, for reference */
+static uint16_t cksum_ref(const uint8_t *buf, int mlen)
+{
+    const uint16_t *w = (const uint16_t *)buf;
+    int sum = 0;
+    int byte_swapped = 0;
+    union {
+        uint8_t c[2];
+        uint16_t s;
+    } s_util;
+    union {
+        uint16_t s[2];
+        uint32_t l;
+    } l_util;
+
+#define ADDCARRY(x)  (x > 65535 ? x -= 65535 : x)
+#define REDUCE {l_util.l = sum; sum = l_util.s[0] + l_util.s[1]; (void)ADDCARRY(sum);}
+    if (mlen <= 0)
+        goto cont;
+    if ((1 & (long)w) && (mlen > 0)) {
+        REDUCE;
+        sum <<= 8;
+        s_util.c[0] = *(const uint8_t *)w;
+        w = (const uint16_t *)((const uint8_t *)w + 1);
+        mlen--;
+        byte_swapped = 1;
+    }
+    while ((mlen -= 32) >= 0) {
+        sum += w[0]; sum += w[1]; sum += w[2]; sum += w[3];
+        sum += w[4]; sum += w[5]; sum += w[6]; sum += w[7];
+        sum += w[8]; sum += w[9]; sum += w[10]; sum += w[11];
+        sum += w[12]; sum += w[13]; sum += w[14]; sum += w[15];
+        w += 16;
+    }
+    mlen += 32;
+    while ((mlen -= 8) >= 0) {
+        sum += w[0]; sum += w[1]; sum += w[2]; sum += w[3];
+        w += 4;
+    }
+    mlen += 8;
+    if (mlen == 0 && byte_swapped == 0)
+        goto cont;
+    REDUCE;
+    while ((mlen -= 2) >= 0)
+        sum += *w++;
+    if (byte_swapped) {
+        REDUCE;
+        sum <<= 8;
+        if (mlen == -1) {
+            s_util.c[1] = *(const uint8_t *)w;
+            sum += s_util.s;
+            mlen = 0;
+        } else {
+            mlen = -1;
+        }
+    } else if (mlen == -1) {
+        s_util.c[0] = *(const uint8_t *)w;
+    }
+cont:
+    if (mlen == -1) {
+        s_util.c[1] = 0;
+        sum += s_util.s;
+    }
+    REDUCE;
+    return ~sum & 0xffff;
+#undef REDUCE
+#undef ADDCARRY
+}
+
+static int64_t get_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* check the selected kernel on every length and alignment */
+static int check_impl(const uint8_t *buf)
+{
+    int len, off;
+    uint16_t a, b;
+
+    for (off = 0; off < 8; off++) {
+        for (len = 0; len <= 4096; len++) {
+            a = cksum_ref(buf + off, len);
+            b = cksum_buf(buf + off, len);
+            if (a != b) {
+                printf("mismatch: len=%d off=%d ref=%04x got=%04x\n",
+                       len, off, a, b);
+                return -1;
+            }
+        }
+    }
+    a = cksum_ref(buf, 65535);
+    b = cksum_buf(buf, 65535);
+    if (a != b) {
+        printf("mismatch: len=65535 ref=%04x got=%04x\n", a, b);
+        return -1;
+    }
+    return 0;
+}
+
+/* rewrite random fields of a checksummed header and check it stays valid */
+static int check_adjust(uint8_t *buf)
+{
+    uint16_t sum, old16, new16;
+    uint32_t old32, new32;
+    int i, pos;
+
+    memset(buf + 2, 0, 2);
+    sum = cksum_buf(buf, 256);
+    memcpy(buf + 2, &sum, 2);
+    for (i = 0; i < 100000; i++) {
+        /* the checksum lives at offset 2, so leave the first word alone */
+        pos = 4 + (rand() % 63) * 4;
+        memcpy(&old32, buf + pos, 4);
+        new32 = (i & 1) ? (uint32_t)rand() : ~old32;
+        memcpy(buf + pos, &new32, 4);
+        sum = cksum_adjust32(sum, old32, new32);
+        memcpy(buf + 2, &sum, 2);
+
+        pos += 2 * (rand() & 1);
+        memcpy(&old16, buf + pos, 2);
+        new16 = rand();
+        memcpy(buf + pos, &new16, 2);
+        sum = cksum_adjust16(sum, old16, new16);
+        memcpy(buf + 2, &sum, 2);
+
+        if (cksum_buf(buf, 256) != 0) {
+            printf("incremental update mismatch at iteration %d\n", i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static double bench(uint16_t (*func)(const uint8_t *buf, int len),
+                    const uint8_t *buf, int len, unsigned *result)
+{
+    /* called through a volatile pointer so the loop is not folded away */
+    uint16_t (*volatile f)(const uint8_t *buf, int len) = func;
+    int64_t t0, dt, iter, n;
+    unsigned acc = 0;
+
+    /* run at least 64 MB through the kernel */
+    int64_t best = INT64_MAX;
+    int rep;
+
+    /* best of 5 runs of at least 64 MB each */
+    n = (64 << 20) / len + 1;
+    for (rep = 0; rep < 5; rep++) {
+        acc = 0;
+        t0 = get_time_ns();
+        for (iter = 0; iter < n; iter++)
+            acc += f(buf, len);
+        dt = get_time_ns() - t0;
+        if (dt < best)
+            best = dt;
+    }
+    *result = acc;
+    return (double)len * n / best * 1e9 / (1 << 20);
+}
+
+static uint16_t cksum_cur(const uint8_t *buf, int len)
+{
+    return cksum_buf(buf, len);
+}
+
+int main(int argc, char **argv)
+{
+    static const int sizes[] = { 20, 40, 64, 576, 1500, 9000, 65535 };
+    uint8_t *buf;
+    unsigned res, res_ref;
+    const char *best;
+    double ref_mbs, mbs;
+    int i, j, err = 0;
+
+    buf = malloc(BUF_SIZE);
+    srand(1);
+    for (i = 0; i < BUF_SIZE; i++)
+        buf[i] = rand();
+
+    best = cksum_get_impl();
+    printf("%-8s %8s %12s", "size", "ref MB/s", "");
+    for (j = 0; j < countof(impl_names); j++) {
+        if (cksum_set_impl(impl_names[j]) == 0)
+            printf(" %10s", impl_names[j]);
+    }
+    printf("\n");
+
+    for (j = 0; j < countof(impl_names); j++) {
+        if (cksum_set_impl(impl_names[j]) < 0)
+            continue;
+        if (check_impl(buf) < 0 || check_adjust(buf + 1) < 0) {
+            printf("%s: FAILED\n", impl_names[j]);
+            err = 1;
+        }
+    }
+
+    for (i = 0; i < countof(sizes); i++) {
+        ref_mbs = bench(cksum_ref, buf, sizes[i], &res_ref);
+        printf("%-8d %8.0f %12s", sizes[i], ref_mbs, "speedup:");
+        for (j = 0; j < countof(impl_names); j++) {
+            if (cksum_set_impl(impl_names[j]) < 0)
+                continue;
+            mbs = bench(cksum_cur, buf, sizes[i], &res);
+            if (res != res_ref)
+                err = 1;
+            printf(" %9.2fx", mbs / ref_mbs);
+        }
+        printf("\n");
+    }
+    printf("runtime selection: %s\n", best);
+    free(buf);
+    return err;
+}
@@ -97,7 +97,14 @@ icmp_input(struct mbuf *m, int hlen)
   DEBUG_ARG("icmp_type = %d", icp->icmp_type);
   switch (icp->icmp_type) {
   case ICMP_ECHO:
+  {
+    /* only the type changes, so patch the verified checksum in place */
+    uint16_t old_word, new_word;
+    memcpy(&old_word, &icp->icmp_type, 2);
     icp->icmp_type = ICMP_ECHOREPLY;
+    memcpy(&new_word, &icp->icmp_type, 2);
+    icp->icmp_cksum = cksum_adjust16(icp->icmp_cksum, old_word, new_word);
+  }
     ip->ip_len += hlen;	             /* since ip_input subtracts this */
     if (ip->ip_dst.s_addr == slirp->vhost_addr.s_addr) {
       icmp_reflect(m);
@@ -309,21 +316,11 @@ icmp_reflect(struct mbuf *m)
   register struct ip *ip = mtod(m, struct ip *);
   int hlen = ip->ip_hl << 2;
   int optlen = hlen - sizeof(struct ip );
-  register struct icmp *icp;
 
   /*
-   * Send an icmp packet back to the ip level,
-   * after supplying a checksum.
+   * Send an icmp packet back to the ip level.  The caller updated the
+   * icmp checksum incrementally when it rewrote the header.
    */
-  m->m_data += hlen;
-  m->m_len -= hlen;
-  icp = mtod(m, struct icmp *);
-
-  icp->icmp_cksum = 0;
-  icp->icmp_cksum = cksum(m, ip->ip_len - hlen);
-
-  m->m_data -= hlen;
-  m->m_len += hlen;
 
   /* fill in ip */
   if (optlen > 0) {
@@ -4,6 +4,7 @@
 #ifdef CONFIG_SLIRP
 
 #include <netinet/in.h>
+#include <sys/uio.h>
 
 struct Slirp;
 typedef struct Slirp Slirp;
@@ -28,6 +29,7 @@ void slirp_select_poll(Slirp *slirp,
                        int select_error);
 
 void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len);
+void slirp_inputv(Slirp *slirp, const struct iovec *iov, int iovcnt);
 
 /* you must provide the following functions: */
 int slirp_can_output(void *opaque);
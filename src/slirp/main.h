@@ -28,8 +28,8 @@ extern int ctty_closed;
 
 extern char *slirp_tty;
 extern char *exec_shell;
-extern u_int curtime;
-extern fd_set *global_readfds, *global_writefds, *global_xfds;
+extern __thread u_int curtime;
+extern __thread fd_set *global_readfds, *global_writefds, *global_xfds;
 extern struct in_addr loopback_addr;
 extern char *username;
 extern char *socket_path;
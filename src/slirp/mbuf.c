@@ -13,56 +13,182 @@
  * could hold, an external malloced buffer is pointed to
  * by m_ext (and the data pointers) and M_EXT is set in
  * the flags
+ *
+ * The mbufs are allocated by slabs and kept in a free list per Slirp
+ * instance. A slab whose mbufs are all free is released once more
+ * than MBUF_FREE_MAX mbufs are free. The external buffers of up to
+ * MCLUSTER_SIZE bytes are fixed size clusters, also kept in a free
+ * list, so that growing an mbuf does not realloc() repeatedly.
  */
 
 #include "slirp.h"
 
-#define MBUF_THRESH 30
-
 /*
  * Find a nice value for msize
  * XXX if_maxlinkhdr already in mtu
  */
 #define SLIRP_MSIZE (IF_MTU + IF_MAXLINKHDR + offsetof(struct mbuf, m_dat) + 6)
+#define MBUF_STRIDE ((SLIRP_MSIZE + 7) & ~7)
+
+#define MBUF_SLAB_COUNT 32	/* mbufs per slab */
+#define MBUF_FREE_MAX 256	/* high-water mark of the free mbufs */
+
+/* largest IP datagram and link header */
+#define MCLUSTER_SIZE (65536 + IF_MAXLINKHDR)
+#define MCLUSTER_FREE_MAX 8	/* high-water mark of the free clusters */
+
+struct mbuf_slab {
+	struct mbuf_slab *next, *prev;
+	int nb_used;
+	/* followed by MBUF_SLAB_COUNT mbufs of MBUF_STRIDE bytes */
+	double dummy; /* alignment */
+};
+
+struct mbuf_cluster {
+	struct mbuf_cluster *next;
+};
+
+#define slab_mbuf(slab, i) \
+	((struct mbuf *)((char *)&(slab)->dummy + (i) * MBUF_STRIDE))
 
 void
 m_init(Slirp *slirp)
 {
     slirp->m_freelist.m_next = slirp->m_freelist.m_prev = &slirp->m_freelist;
     slirp->m_usedlist.m_next = slirp->m_usedlist.m_prev = &slirp->m_usedlist;
+    slirp->mbuf_free = 0;
+    slirp->mbuf_slabs = NULL;
+    slirp->cluster_freelist = NULL;
+    slirp->cluster_free = 0;
+}
+
+/* free the slabs and clusters, all the mbufs become invalid */
+void
+m_cleanup(Slirp *slirp)
+{
+	struct mbuf_slab *slab;
+	struct mbuf_cluster *c;
+	struct mbuf *m;
+	int i;
+
+	while ((slab = slirp->mbuf_slabs) != NULL) {
+		/* the clusters are also allocated with malloc() */
+		for (i = 0; i < MBUF_SLAB_COUNT; i++) {
+			m = slab_mbuf(slab, i);
+			if ((m->m_flags & M_EXT) && !(m->m_flags & M_FREELIST))
+				free(m->m_ext);
+		}
+		slirp->mbuf_slabs = slab->next;
+		free(slab);
+	}
+	while ((c = slirp->cluster_freelist) != NULL) {
+		slirp->cluster_freelist = c->next;
+		free(c);
+	}
+	m_init(slirp);
+	slirp->mbuf_alloced = 0;
+}
+
+static int
+m_slab_alloc(Slirp *slirp)
+{
+	struct mbuf_slab *slab;
+	struct mbuf *m;
+	int i;
+
+	slab = (struct mbuf_slab *)malloc(offsetof(struct mbuf_slab, dummy) +
+					  MBUF_SLAB_COUNT * MBUF_STRIDE);
+	if (slab == NULL)
+		return -1;
+	slab->nb_used = 0;
+	slab->prev = NULL;
+	slab->next = slirp->mbuf_slabs;
+	if (slab->next)
+		slab->next->prev = slab;
+	slirp->mbuf_slabs = slab;
+	for (i = 0; i < MBUF_SLAB_COUNT; i++) {
+		m = slab_mbuf(slab, i);
+		m->slirp = slirp;
+		m->m_slab = slab;
+		m->m_flags = M_FREELIST;
+		insque(m,&slirp->m_freelist);
+	}
+	slirp->mbuf_free += MBUF_SLAB_COUNT;
+	slirp->mbuf_alloced += MBUF_SLAB_COUNT;
+	return 0;
+}
+
+/* all the mbufs of the slab are in the free list */
+static void
+m_slab_free(Slirp *slirp, struct mbuf_slab *slab)
+{
+	int i;
+
+	for (i = 0; i < MBUF_SLAB_COUNT; i++)
+		remque(slab_mbuf(slab, i));
+	slirp->mbuf_free -= MBUF_SLAB_COUNT;
+	slirp->mbuf_alloced -= MBUF_SLAB_COUNT;
+	if (slab->prev)
+		slab->prev->next = slab->next;
+	else
+		slirp->mbuf_slabs = slab->next;
+	if (slab->next)
+		slab->next->prev = slab->prev;
+	free(slab);
+}
+
+static char *
+m_cluster_get(Slirp *slirp)
+{
+	struct mbuf_cluster *c;
+
+	c = slirp->cluster_freelist;
+	if (c == NULL)
+		return (char *)malloc(MCLUSTER_SIZE);
+	slirp->cluster_freelist = c->next;
+	slirp->cluster_free--;
+	return (char *)c;
+}
+
+static void
+m_cluster_put(Slirp *slirp, char *p)
+{
+	struct mbuf_cluster *c = (struct mbuf_cluster *)p;
+
+	if (slirp->cluster_free >= MCLUSTER_FREE_MAX) {
+		free(p);
+		return;
+	}
+	c->next = slirp->cluster_freelist;
+	slirp->cluster_freelist = c;
+	slirp->cluster_free++;
 }
 
 /*
  * Get an mbuf from the free list, if there are none
- * malloc one
- *
- * Because fragmentation can occur if we alloc new mbufs and
- * free old mbufs, we mark all mbufs above mbuf_thresh as M_DOFREE,
- * which tells m_free to actually free() it
+ * allocate a new slab
  */
 struct mbuf *
 m_get(Slirp *slirp)
 {
 	register struct mbuf *m;
-	int flags = 0;
 
 	DEBUG_CALL("m_get");
 
 	if (slirp->m_freelist.m_next == &slirp->m_freelist) {
-		m = (struct mbuf *)malloc(SLIRP_MSIZE);
-		if (m == NULL) goto end_error;
-		slirp->mbuf_alloced++;
-		if (slirp->mbuf_alloced > MBUF_THRESH)
-			flags = M_DOFREE;
-		m->slirp = slirp;
-	} else {
-		m = slirp->m_freelist.m_next;
-		remque(m);
+		if (m_slab_alloc(slirp) < 0) {
+			m = NULL;
+			goto end_error;
+		}
 	}
+	m = slirp->m_freelist.m_next;
+	remque(m);
+	slirp->mbuf_free--;
+	m->m_slab->nb_used++;
 
 	/* Insert it in the used list */
 	insque(m,&slirp->m_usedlist);
-	m->m_flags = (flags | M_USEDLIST);
+	m->m_flags = M_USEDLIST;
 
 	/* Initialise it */
 	m->m_size = SLIRP_MSIZE - offsetof(struct mbuf, m_dat);
@@ -83,23 +209,29 @@ m_free(struct mbuf *m)
   DEBUG_ARG("m = %lx", (long )m);
 
   if(m) {
+	Slirp *slirp = m->slirp;
+	struct mbuf_slab *slab = m->m_slab;
+
 	/* Remove from m_usedlist */
 	if (m->m_flags & M_USEDLIST)
 	   remque(m);
 
 	/* If it's M_EXT, free() it */
-	if (m->m_flags & M_EXT)
+	if (m->m_flags & M_CLUSTER)
+	   m_cluster_put(slirp, m->m_ext);
+	else if (m->m_flags & M_EXT)
 	   free(m->m_ext);
 
 	/*
-	 * Either free() it or put it on the free list
+	 * Put it on the free list, and release its slab above the
+	 * high-water mark
 	 */
-	if (m->m_flags & M_DOFREE) {
-		m->slirp->mbuf_alloced--;
-		free(m);
-	} else if ((m->m_flags & M_FREELIST) == 0) {
-		insque(m,&m->slirp->m_freelist);
+	if ((m->m_flags & M_FREELIST) == 0) {
+		insque(m,&slirp->m_freelist);
 		m->m_flags = M_FREELIST; /* Clobber other flags */
+		slirp->mbuf_free++;
+		if (--slab->nb_used == 0 && slirp->mbuf_free > MBUF_FREE_MAX)
+			m_slab_free(slirp, slab);
 	}
   } /* if(m) */
 }
@@ -132,9 +264,34 @@ m_inc(struct mbuf *m, int size)
 	int datasize;
 
 	/* some compiles throw up on gotos.  This one we can fake. */
-        if(m->m_size>size) return;
+        if(m->m_size>=size) return;
 
-        if (m->m_flags & M_EXT) {
+        if (size <= MCLUSTER_SIZE) {
+	  /* the mbuf cannot be a cluster already */
+	  char *dat;
+	  dat = m_cluster_get(m->slirp);
+	  if (m->m_flags & M_EXT) {
+	    datasize = m->m_data - m->m_ext;
+	    memcpy(dat, m->m_ext, m->m_size);
+	    free(m->m_ext);
+	  } else {
+	    datasize = m->m_data - m->m_dat;
+	    memcpy(dat, m->m_dat, m->m_size);
+	  }
+	  m->m_ext = dat;
+	  m->m_data = m->m_ext + datasize;
+	  m->m_flags |= M_EXT | M_CLUSTER;
+	  size = MCLUSTER_SIZE;
+        } else if (m->m_flags & M_CLUSTER) {
+	  char *dat;
+	  datasize = m->m_data - m->m_ext;
+	  dat = (char *)malloc(size);
+	  memcpy(dat, m->m_ext, m->m_size);
+	  m_cluster_put(m->slirp, m->m_ext);
+	  m->m_ext = dat;
+	  m->m_data = m->m_ext + datasize;
+	  m->m_flags &= ~M_CLUSTER;
+        } else if (m->m_flags & M_EXT) {
 	  datasize = m->m_data - m->m_ext;
 	  m->m_ext = (char *)realloc(m->m_ext,size);
 	  m->m_data = m->m_ext + datasize;
@@ -33,15 +33,14 @@ static const uint8_t special_ethaddr[6] = {
 
 static const uint8_t zero_ethaddr[6] = { 0, 0, 0, 0, 0, 0 };
 
-/* XXX: suppress those select globals */
-fd_set *global_readfds, *global_writefds, *global_xfds;
+/* XXX: suppress those select globals. Each instance is polled by its
+   own thread, so they are per thread. */
+__thread fd_set *global_readfds, *global_writefds, *global_xfds;
 
-u_int curtime;
-static u_int time_fasttimo, last_slowtimo;
-static int do_slowtimo;
+__thread u_int curtime;
 
-static struct in_addr dns_addr;
-static u_int dns_addr_time;
+static __thread struct in_addr dns_addr;
+static __thread u_int dns_addr_time;
 
 #ifdef _WIN32
 
@@ -97,7 +96,7 @@ static void winsock_cleanup(void)
 
 #else
 
-static struct stat dns_addr_stat;
+static __thread struct stat dns_addr_stat;
 
 int get_dns_addr(struct in_addr *pdns_addr)
 {
@@ -227,6 +226,7 @@ Slirp *slirp_init(int restricted, struct in_addr vnetwork,
 
 void slirp_cleanup(Slirp *slirp)
 {
+    m_cleanup(slirp);
     free(slirp->tftp_prefix);
     free(slirp->bootp_filename);
     free(slirp);
@@ -251,14 +251,14 @@ void slirp_select_fill(Slirp *slirp, int *pnfds,
 	/*
 	 * First, TCP sockets
 	 */
-	do_slowtimo = 0;
+	slirp->do_slowtimo = 0;
 
 	{
 		/*
 		 * *_slowtimo needs calling if there are IP fragments
 		 * in the fragment queue, or there are TCP connections active
 		 */
-		do_slowtimo |= ((slirp->tcb.so_next != &slirp->tcb) ||
+		slirp->do_slowtimo |= ((slirp->tcb.so_next != &slirp->tcb) ||
 		    (&slirp->ipq.ip_link != slirp->ipq.ip_link.next));
 
 		for (so = slirp->tcb.so_next; so != &slirp->tcb;
@@ -268,8 +268,8 @@ void slirp_select_fill(Slirp *slirp, int *pnfds,
 			/*
 			 * See if we need a tcp_fasttimo
 			 */
-			if (time_fasttimo == 0 && so->so_tcpcb->t_flags & TF_DELACK)
-			   time_fasttimo = curtime; /* Flag when we want a fasttimo */
+			if (slirp->time_fasttimo == 0 && so->so_tcpcb->t_flags & TF_DELACK)
+			   slirp->time_fasttimo = curtime; /* Flag when we want a fasttimo */
 
 			/*
 			 * NOFDREF can include still connecting to local-host,
@@ -331,7 +331,7 @@ void slirp_select_fill(Slirp *slirp, int *pnfds,
 					udp_detach(so);
 					continue;
 				} else
-					do_slowtimo = 1; /* Let socket expire */
+					slirp->do_slowtimo = 1; /* Let socket expire */
 			}
 
 			/*
@@ -371,14 +371,14 @@ void slirp_select_poll(Slirp *slirp,
 	/*
 	 * See if anything has timed out
 	 */
-		if (time_fasttimo && ((curtime - time_fasttimo) >= 2)) {
+		if (slirp->time_fasttimo && ((curtime - slirp->time_fasttimo) >= 2)) {
 			tcp_fasttimo(slirp);
-			time_fasttimo = 0;
+			slirp->time_fasttimo = 0;
 		}
-		if (do_slowtimo && ((curtime - last_slowtimo) >= 499)) {
+		if (slirp->do_slowtimo && ((curtime - slirp->last_slowtimo) >= 499)) {
 			ip_slowtimo(slirp);
 			tcp_slowtimo(slirp);
-			last_slowtimo = curtime;
+			slirp->last_slowtimo = curtime;
 		}
 
 	/*
@@ -659,6 +659,67 @@ void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
     }
 }
 
+/* copy [offset, offset + len) of the iovec to buf */
+static void iov_to_buf(const struct iovec *iov, int iovcnt, int offset,
+                       uint8_t *buf, int len)
+{
+    int i, l;
+
+    for(i = 0; i < iovcnt && len > 0; i++) {
+        if (offset >= iov[i].iov_len) {
+            offset -= iov[i].iov_len;
+            continue;
+        }
+        l = min(len, iov[i].iov_len - offset);
+        memcpy(buf, (uint8_t *)iov[i].iov_base + offset, l);
+        buf += l;
+        len -= l;
+        offset = 0;
+    }
+}
+
+/* same as slirp_input() for a frame in several buffers: an IP packet
+   is gathered directly into its mbuf */
+void slirp_inputv(Slirp *slirp, const struct iovec *iov, int iovcnt)
+{
+    uint8_t buf[64];
+    struct mbuf *m;
+    int i, pkt_len, proto;
+
+    pkt_len = 0;
+    for(i = 0; i < iovcnt; i++)
+        pkt_len += iov[i].iov_len;
+    if (pkt_len < ETH_HLEN)
+        return;
+
+    iov_to_buf(iov, iovcnt, 0, buf, ETH_HLEN);
+    proto = ntohs(*(uint16_t *)(buf + 12));
+    switch(proto) {
+    case ETH_P_ARP:
+        pkt_len = min(pkt_len, sizeof(buf));
+        iov_to_buf(iov, iovcnt, 0, buf, pkt_len);
+        arp_input(slirp, buf, pkt_len);
+        break;
+    case ETH_P_IP:
+        m = m_get(slirp);
+        if (!m)
+            return;
+        if (M_FREEROOM(m) < pkt_len + 2) {
+            m_inc(m, pkt_len + 2);
+        }
+        m->m_len = pkt_len + 2;
+        iov_to_buf(iov, iovcnt, 0, (uint8_t *)m->m_data + 2, pkt_len);
+
+        m->m_data += 2 + ETH_HLEN;
+        m->m_len -= 2 + ETH_HLEN;
+
+        ip_input(m);
+        break;
+    default:
+        break;
+    }
+}
+
 /* output the IP packet to the ethernet device */
 void if_encap(Slirp *slirp, const uint8_t *ip_data, int ip_data_len)
 {
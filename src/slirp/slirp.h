@@ -183,9 +183,18 @@ struct Slirp {
     struct timeval tt;
     struct ex_list *exec_list;
 
+    /* timers */
+    u_int time_fasttimo;
+    u_int last_slowtimo;
+    int do_slowtimo;
+
     /* mbuf states */
     struct mbuf m_freelist, m_usedlist;
     int mbuf_alloced;
+    int mbuf_free;          /* number of mbufs in m_freelist */
+    struct mbuf_slab *mbuf_slabs;
+    struct mbuf_cluster *cluster_freelist;
+    int cluster_free;       /* number of clusters in cluster_freelist */
 
     /* if states */
     int if_queued;          /* number of packets queued so far */
@@ -255,6 +264,11 @@ void lprint(const char *, ...) __attribute__((format(printf, 1, 2)));
 
 /* cksum.c */
 int cksum(struct mbuf *m, int len);
+uint16_t cksum_buf(const void *buf, int len);
+uint16_t cksum_adjust16(uint16_t sum, uint16_t old_val, uint16_t new_val);
+uint16_t cksum_adjust32(uint16_t sum, uint32_t old_val, uint32_t new_val);
+int cksum_set_impl(const char *name);
+const char *cksum_get_impl(void);
 
 /* if.c */
 void if_init(Slirp *);
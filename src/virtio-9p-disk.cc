@@ -7,34 +7,6 @@
 #include "virtio-9p-disk.h"
 #include "cutils.h"
 
-
-int fdt_parse_virtio9p(
-    const void *fdt,
-    reg_t* blkdev_addr,
-    uint32_t* blkdev_int_id,
-    const char *compatible) {
-  int nodeoffset, rc, len;
-  const fdt32_t *reg_p;
-
-  nodeoffset = fdt_node_offset_by_compatible(fdt, -1, compatible);
-  if (nodeoffset < 0)
-    return nodeoffset;
-
-  rc = fdt_get_node_addr_size(fdt, nodeoffset, blkdev_addr, NULL, "reg");
-  if (rc < 0 || !blkdev_addr)
-    return -ENODEV;
-
-  reg_p = (fdt32_t *)fdt_getprop(fdt, nodeoffset, "interrupts", &len);
-  if (blkdev_int_id) {
-    if (reg_p)
-      *blkdev_int_id = fdt32_to_cpu(*reg_p);
-    else
-      *blkdev_int_id = VIRTIO_9P_FS_IRQ;
-  }
-
-  return 0;
-}
-
 virtio9p_t::virtio9p_t(
       const simif_t* sim,
       abstract_interrupt_controller_t *intctrl,
@@ -52,18 +24,31 @@ virtio9p_t::virtio9p_t(
   }
 
   std::string fname;
+  std::string archive_fname;
   std::string mount_tag = "/dev/root";
+  uint32_t max_msize = 512 * 1024;
+  int async_threads = 0;
+  int attr_cache_entries = 0;
+  int attr_ttl_ms = 1000;
+  bool writeback = false;
   
   auto it = argmap.find("path");
-  if (it == argmap.end()) {
+  if (it != argmap.end()) {
+    fname = it->second;
+  }
+
+  it = argmap.find("archive");
+  if (it != argmap.end()) {
+    archive_fname = it->second;
+  }
+
+  if (fname.empty() == archive_fname.empty()) {
     // invalid block device.
-    printf("Virtio 9p disk fs device plugin INIT ERROR: `path` argument not specified.\n"
-            "Please use spike option --device=virtio9p,path=/path/to/folder to use an exist host filesystem folder path.\n");
+    printf("Virtio 9p disk fs device plugin INIT ERROR: exactly one of `path` or `archive` must be specified.\n"
+            "Please use spike option --device=virtio9p,path=/path/to/folder to use an exist host filesystem folder path,\n"
+            "or --device=virtio9p,archive=/path/to/file.tar to serve a tar archive read only.\n");
     exit(1);
   }
-  else {
-    fname = it->second;
-  }
 
   it = argmap.find("tag");
   if (it != argmap.end()) {
@@ -72,55 +57,118 @@ virtio9p_t::virtio9p_t(
   else {
     printf("Virtio 9p disk fs device plugin INIT WARN: `tag` argument not specified. Use default %s\n", mount_tag.c_str());
   }
+
+  it = argmap.find("msize");
+  if (it != argmap.end()) {
+    max_msize = strtoul(it->second.c_str(), NULL, 0);
+  }
+
+  it = argmap.find("async");
+  if (it != argmap.end()) {
+    async_threads = strtol(it->second.c_str(), NULL, 0);
+  }
+
+  it = argmap.find("cache");
+  if (it != argmap.end()) {
+    if (it->second == "writeback") {
+      writeback = true;
+    }
+    else if (it->second != "none") {
+      printf("Virtio 9p disk fs device plugin INIT WARN: unknown `cache` mode %s, use none\n", it->second.c_str());
+    }
+  }
+
+  it = argmap.find("attr_cache");
+  if (it != argmap.end()) {
+    attr_cache_entries = strtol(it->second.c_str(), NULL, 0);
+  }
+
+  it = argmap.find("attr_ttl");
+  if (it != argmap.end()) {
+    attr_ttl_ms = strtol(it->second.c_str(), NULL, 0);
+  }
   
   int irq_num;
   VIRTIOBusDef vbus_s, *vbus = &vbus_s;
-  FSDevice* fs = fs_disk_init(fname.c_str());
-  if (!fs) {
-    printf("Virtio 9p disk fs device plugin INIT ERROR: `path` %s must be a directory\n", fname.c_str());
-    exit(1);
+  FSDevice* fs;
+  if (!archive_fname.empty()) {
+    fs = fs_archive_init(archive_fname.c_str());
+    if (!fs) {
+      printf("Virtio 9p disk fs device plugin INIT ERROR: could not load the tar archive %s\n", archive_fname.c_str());
+      exit(1);
+    }
+    // nothing to cache or to write back: the archive is in memory and read only
+  }
+  else {
+    fs = fs_disk_init(fname.c_str());
+    if (!fs) {
+      printf("Virtio 9p disk fs device plugin INIT ERROR: `path` %s must be a directory\n", fname.c_str());
+      exit(1);
+    }
+    if (writeback) {
+      fs_disk_set_writeback(fs, 100);
+    }
+    if (fs_disk_set_attr_cache(fs, attr_cache_entries, attr_ttl_ms) < 0) {
+      printf("Virtio 9p disk fs device plugin: could not allocate the attribute cache.\n");
+    }
   }
 
   memset(vbus, 0, sizeof(*vbus));
-  vbus->addr = VIRTIO_9P_FS_BASE;
-  irq_num  = VIRTIO_9P_FS_IRQ;
+  irq_num  = interrupt_id;
   irq = new IRQSpike(intctrl, irq_num);
   vbus->irq = irq;
 
-  virtio_dev = virtio_9p_init(vbus, fs, mount_tag.c_str(), sim);
-  vbus->addr += VIRTIO_SIZE;
+  virtio_dev = virtio_9p_init(vbus, fs, mount_tag.c_str(), max_msize, sim);
+  if (virtio_9p_set_async(virtio_dev, async_threads) < 0) {
+    printf("Virtio 9p disk fs device plugin: could not start the worker threads, using synchronous requests.\n");
+  }
+  setup_common_options();
+  setup_stats(virtio_9p_dump_stats);
 
 }
 
 virtio9p_t::~virtio9p_t() {
+    if (virtio_dev) {
+        drain();
+        virtio_9p_stop_async(virtio_dev);
+    }
     if (irq) delete irq;
 }
 
+/* deliver the completed asynchronous requests */
+void virtio9p_t::poll() {
+    virtio_9p_poll(virtio_dev);
+}
+
+void virtio9p_t::tick(reg_t rtc_ticks) {
+    poll();
+    virtio_base_t::tick(rtc_ticks);
+}
+
+
+/* instances already generated and created, in the order of the
+   --device options */
+static int virtio9p_nb_dts, virtio9p_nb_devices;
 
 std::string virtio9p_generate_dts(const sim_t* sim, const std::vector<std::string>& args) {
-  std::stringstream s;
-  s << std::hex 
-    << "    virtio9p: virtio@" << VIRTIO_9P_FS_BASE << " {\n"
-    << "      compatible = \"virtio,mmio\";\n"
-       "      interrupt-parent = <&PLIC>;\n"
-       "      interrupts = <" << std::dec << VIRTIO_9P_FS_IRQ;
-    reg_t virtio9pbs = VIRTIO_9P_FS_BASE;
-    reg_t virtio9psz = VIRTIO_SIZE;
-  s << std::hex << ">;\n"
-       "      reg = <0x" << (virtio9pbs >> 32) << " 0x" << (virtio9pbs & (uint32_t)-1) <<
-                   " 0x" << (virtio9psz >> 32) << " 0x" << (virtio9psz & (uint32_t)-1) << ">;\n"
-       "    };\n";
-    return s.str();
+  reg_t addr;
+  uint32_t irq;
+  int index = virtio9p_nb_dts++;
+
+  virtio_mmio_placement(args, index, VIRTIO_9P_FS_BASE, VIRTIO_9P_FS_IRQ, &addr, &irq);
+  return virtio_mmio_generate_dts("virtio9p", index, addr, irq);
 }
 
 virtio9p_t* virtio9p_parse_from_fdt(
   const void* fdt, const sim_t* sim, reg_t* base,
     std::vector<std::string> sargs)
 {
-  uint32_t blkdev_int_id;
-  if (fdt_parse_virtio9p(fdt, base, &blkdev_int_id, "virtio,mmio") == 0) {
+  uint32_t irq;
+
+  virtio_mmio_placement(sargs, virtio9p_nb_devices++, VIRTIO_9P_FS_BASE, VIRTIO_9P_FS_IRQ, base, &irq);
+  if (fdt_parse_virtio_mmio(fdt, *base, &irq) >= 0) {
     abstract_interrupt_controller_t* intctrl = sim->get_intctrl();
-    return new virtio9p_t(sim, intctrl, blkdev_int_id, sargs);
+    return new virtio9p_t(sim, intctrl, irq, sargs);
   } else {
     return nullptr;
   }
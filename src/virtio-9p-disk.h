@@ -23,5 +23,8 @@ public:
       uint32_t interrupt_id,
       std::vector<std::string> sargs);
   ~virtio9p_t();
+  void tick(reg_t rtc_ticks) override;
+protected:
+  void poll() override;
 private:
 };
\ No newline at end of file
@@ -0,0 +1,95 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include "virtio-balloon.h"
+#include "cutils.h"
+
+virtioballoon_t::virtioballoon_t(
+      const simif_t* sim,
+      abstract_interrupt_controller_t *intctrl,
+      uint32_t interrupt_id,
+      std::vector<std::string> sargs)
+  : virtio_base_t(sim, intctrl, interrupt_id, sargs)
+{
+  std::map<std::string, std::string> argmap;
+
+  for (auto arg : sargs) {
+    size_t eq_idx = arg.find('=');
+    if (eq_idx != std::string::npos) {
+      argmap.insert(std::pair<std::string, std::string>(arg.substr(0, eq_idx), arg.substr(eq_idx+1)));
+    }
+  }
+
+  uint64_t size_mb = 0;
+  bool deflate_on_oom = true;
+  bool reporting = true;
+
+  auto it = argmap.find("size");
+  if (it != argmap.end()) {
+    size_mb = strtoull(it->second.c_str(), NULL, 0);
+    if (size_mb > (UINT32_MAX >> 8)) {
+      printf("Virtio balloon device plugin INIT ERROR: `size` %s is too large.\n", it->second.c_str());
+      exit(1);
+    }
+  }
+
+  it = argmap.find("deflate_on_oom");
+  if (it != argmap.end()) {
+    deflate_on_oom = strtol(it->second.c_str(), NULL, 0) != 0;
+  }
+
+  it = argmap.find("reporting");
+  if (it != argmap.end()) {
+    reporting = strtol(it->second.c_str(), NULL, 0) != 0;
+  }
+
+  int irq_num;
+  VIRTIOBusDef vbus_s, *vbus = &vbus_s;
+
+  memset(vbus, 0, sizeof(*vbus));
+  irq_num  = interrupt_id;
+  irq = new IRQSpike(intctrl, irq_num);
+  vbus->irq = irq;
+
+  // the target is in 4 KiB pages
+  virtio_dev = virtio_balloon_init(vbus, size_mb << 8, deflate_on_oom,
+                                   reporting, sim);
+  setup_common_options();
+  setup_stats(virtio_balloon_dump_stats);
+}
+
+virtioballoon_t::~virtioballoon_t() {
+    if (irq) delete irq;
+}
+
+
+/* instances already generated and created, in the order of the
+   --device options */
+static int virtioballoon_nb_dts, virtioballoon_nb_devices;
+
+std::string virtioballoon_generate_dts(const sim_t* sim, const std::vector<std::string>& args) {
+  reg_t addr;
+  uint32_t irq;
+  int index = virtioballoon_nb_dts++;
+
+  virtio_mmio_placement(args, index, VIRTIO_BALLOON_BASE, VIRTIO_BALLOON_IRQ, &addr, &irq);
+  return virtio_mmio_generate_dts("virtioballoon", index, addr, irq);
+}
+
+virtioballoon_t* virtioballoon_parse_from_fdt(
+  const void* fdt, const sim_t* sim, reg_t* base,
+    std::vector<std::string> sargs)
+{
+  uint32_t irq;
+
+  virtio_mmio_placement(sargs, virtioballoon_nb_devices++, VIRTIO_BALLOON_BASE, VIRTIO_BALLOON_IRQ, base, &irq);
+  if (fdt_parse_virtio_mmio(fdt, *base, &irq) >= 0) {
+    abstract_interrupt_controller_t* intctrl = sim->get_intctrl();
+    return new virtioballoon_t(sim, intctrl, irq, sargs);
+  } else {
+    return nullptr;
+  }
+}
+
+REGISTER_DEVICE(virtioballoon, virtioballoon_parse_from_fdt, virtioballoon_generate_dts);
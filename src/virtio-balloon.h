@@ -0,0 +1,24 @@
+#include <sys/select.h>
+#include <riscv/abstract_device.h>
+#include <riscv/simif.h>
+#include <riscv/abstract_interrupt_controller.h>
+#include <riscv/mmu.h>
+#include <riscv/processor.h>
+#include <riscv/simif.h>
+#include <riscv/sim.h>
+#include <riscv/dts.h>
+#include <fdt/libfdt.h>
+#include "virtio.h"
+
+#define VIRTIO_BALLOON_BASE 0x40014000
+#define VIRTIO_BALLOON_IRQ       6
+
+class virtioballoon_t: public virtio_base_t {
+public:
+  virtioballoon_t(
+      const simif_t* sim,
+      abstract_interrupt_controller_t *intctrl,
+      uint32_t interrupt_id,
+      std::vector<std::string> sargs);
+  ~virtioballoon_t();
+};
@@ -5,41 +5,16 @@
 #include <assert.h>
 #include <stdarg.h>
 #include "virtio-block.h"
+#include "checkpoint.h"
 #include "cutils.h"
 
-int fdt_parse_virtioblk(
-    const void *fdt,
-    reg_t* blkdev_addr,
-    uint32_t* blkdev_int_id,
-    const char *compatible) {
-  int nodeoffset, rc, len;
-  const fdt32_t *reg_p;
-
-  nodeoffset = fdt_node_offset_by_compatible(fdt, -1, compatible);
-  if (nodeoffset < 0)
-    return nodeoffset;
-
-  rc = fdt_get_node_addr_size(fdt, nodeoffset, blkdev_addr, NULL, "reg");
-  if (rc < 0 || !blkdev_addr)
-    return -ENODEV;
-
-  reg_p = (fdt32_t *)fdt_getprop(fdt, nodeoffset, "interrupts", &len);
-  if (blkdev_int_id) {
-    if (reg_p)
-      *blkdev_int_id = fdt32_to_cpu(*reg_p);
-    else
-      *blkdev_int_id = VIRTIO_IRQ;
-  }
-
-  return 0;
-}
-
 virtioblk_t::virtioblk_t(
       const simif_t* sim,
       abstract_interrupt_controller_t *intctrl,
       uint32_t interrupt_id,
       std::vector<std::string> sargs)
-  : virtio_base_t(sim, intctrl, interrupt_id, sargs)
+  : virtio_base_t(sim, intctrl, interrupt_id, sargs), bs(NULL),
+    commit_overlay(false)
 {
   std::map<std::string, std::string> argmap;
 
@@ -50,8 +25,16 @@ virtioblk_t::virtioblk_t(
     }
   }
 
-  std::string fname;
+  std::string overlay_fname;
   BlockDeviceModeEnum block_device_mode = BF_MODE_RW;
+  BlockDeviceCacheEnum block_device_cache = BF_CACHE_WRITETHROUGH;
+  int async_threads = 0;
+  int num_queues = 1;
+  int read_cache_mb = 0;
+  int chunk_cache_mb = 0;
+  bool use_io_uring = false;
+  bool merge = true;
+  bool sort = false;
   
   auto it = argmap.find("img");
   if (it == argmap.end()) {
@@ -72,61 +55,192 @@ virtioblk_t::virtioblk_t(
         else if (it->second == "snapshot") {
             block_device_mode = BF_MODE_SNAPSHOT;
         }
+        else if (it->second == "mmap") {
+            block_device_mode = BF_MODE_MMAP;
+        }
+        else if (it->second == "mmap-snapshot") {
+            block_device_mode = BF_MODE_MMAP_SNAPSHOT;
+        }
+        else if (it->second == "overlay") {
+            block_device_mode = BF_MODE_OVERLAY;
+        }
         else {
             block_device_mode = BF_MODE_RW;
         }
     }
 
+    if (block_device_mode == BF_MODE_OVERLAY) {
+        it = argmap.find("overlay");
+        if (it == argmap.end()) {
+            printf("Virtio block device plugin INIT ERROR: `overlay` argument not specified.\n"
+                    "Please use spike option --device=virtioblk,img=file,mode=overlay,overlay=file.\n");
+            exit(1);
+        }
+        overlay_fname = it->second;
+        it = argmap.find("commit");
+        if (it != argmap.end() && it->second == "on") {
+            commit_overlay = true;
+        }
+    }
+
+    it = argmap.find("cache");
+    if (it != argmap.end()) {
+        if (it->second == "none") {
+            block_device_cache = BF_CACHE_NONE;
+        }
+        else if (it->second == "writeback") {
+            block_device_cache = BF_CACHE_WRITEBACK;
+        }
+        else {
+            block_device_cache = BF_CACHE_WRITETHROUGH;
+        }
+    }
+
+    it = argmap.find("async");
+    if (it != argmap.end()) {
+        async_threads = strtol(it->second.c_str(), NULL, 0);
+    }
+
+    it = argmap.find("aio");
+    if (it != argmap.end() && it->second == "io_uring") {
+        use_io_uring = true;
+    }
+
+    it = argmap.find("queues");
+    if (it != argmap.end()) {
+        num_queues = strtol(it->second.c_str(), NULL, 0);
+    }
+
+    it = argmap.find("readcache");
+    if (it != argmap.end()) {
+        read_cache_mb = strtol(it->second.c_str(), NULL, 0);
+    }
+
+    it = argmap.find("chunkcache");
+    if (it != argmap.end()) {
+        chunk_cache_mb = strtol(it->second.c_str(), NULL, 0);
+    }
+
+    it = argmap.find("merge");
+    if (it != argmap.end()) {
+        merge = it->second != "off";
+    }
+
+    it = argmap.find("sort");
+    if (it != argmap.end()) {
+        sort = it->second == "on";
+    }
+
 
     int irq_num;
     VIRTIOBusDef vbus_s, *vbus = &vbus_s;
-    BlockDevice* bs = block_device_init(fname.c_str(), block_device_mode); //initialization
+    bs = block_device_init(fname.c_str(), block_device_mode,
+                           block_device_cache); //initialization
+    if (block_device_mode == BF_MODE_OVERLAY &&
+        block_device_open_overlay(bs, overlay_fname.c_str()) < 0) {
+        printf("Virtio block device plugin INIT ERROR: cannot open overlay `%s`.\n",
+               overlay_fname.c_str());
+        exit(1);
+    }
+    if (use_io_uring && block_device_set_io_uring(bs) < 0) {
+        printf("Virtio block device plugin: io_uring is not available, using %s.\n",
+               async_threads > 0 ? "the I/O threads" : "synchronous I/O");
+    }
+    if (block_device_set_async(bs, async_threads) < 0) {
+        printf("Virtio block device plugin: could not start the I/O threads, using synchronous I/O.\n");
+    }
+    if (block_device_set_read_cache(bs, read_cache_mb) < 0) {
+        printf("Virtio block device plugin: could not allocate the read cache.\n");
+    }
+    if (chunk_cache_mb > 0 && block_device_set_chunk_cache(bs, chunk_cache_mb) < 0) {
+        printf("Virtio block device plugin: `chunkcache` ignored, `%s` is not a compressed image.\n",
+               fname.c_str());
+    }
 
     memset(vbus, 0, sizeof(*vbus));
-    vbus->addr = VIRTIO_BASE_ADDR;
-    irq_num = VIRTIO_IRQ;
+    irq_num = interrupt_id;
     irq = new IRQSpike(intctrl, irq_num);
 
-    // only one virtio block device
     //REQUIRE: register irq_num as plic_irq number
     // vbus->irq = &s->plci_irq[irq_num];
     vbus->irq = irq;
 
-    virtio_dev = virtio_block_init(vbus, bs, sim);
-    vbus->addr += VIRTIO_SIZE;
+    virtio_dev = virtio_block_init(vbus, bs, sim, num_queues);
+    virtio_block_set_merge(virtio_dev, merge, sort);
+    setup_common_options();
+    setup_stats(virtio_block_dump_stats);
 
 
 }
 
 virtioblk_t::~virtioblk_t() {
+    /* the queued writes are done before the cached data is written back */
+    if (virtio_dev)
+        drain();
+    if (bs)
+        block_device_stop_async(bs);
+    if (bs && block_device_flush(bs) < 0)
+        printf("Virtio block device plugin: could not flush `%s`.\n",
+               fname.c_str());
+    if (commit_overlay && block_device_commit(bs, fname.c_str()) < 0)
+        printf("Virtio block device plugin: could not commit the overlay to `%s`.\n",
+               fname.c_str());
     if (irq) delete irq;
 }
 
+/* deliver the completed asynchronous requests */
+void virtioblk_t::poll() {
+    if (bs && bs->poll)
+        bs->poll(bs);
+}
+
+void virtioblk_t::tick(reg_t rtc_ticks) {
+    poll();
+    virtio_base_t::tick(rtc_ticks);
+}
+
+bool virtioblk_t::save_backend(device_state_writer_t& w, const std::string& prefix) {
+    std::string ovl_fname = prefix + ".ovl";
+    int ret = block_device_checkpoint(bs, ovl_fname.c_str());
+
+    if (ret < 0)
+        return false;
+    /* empty if nothing can be written */
+    w.put_string(ret > 0 ? ovl_fname : "");
+    return true;
+}
+
+bool virtioblk_t::load_backend(device_state_reader_t& r) {
+    std::string ovl_fname = r.get_string();
+
+    return r.ok() &&
+        block_device_restore(bs, ovl_fname.empty() ? NULL : ovl_fname.c_str()) == 0;
+}
+
+
+/* instances already generated and created, in the order of the
+   --device options */
+static int virtioblk_nb_dts, virtioblk_nb_devices;
 
 std::string virtioblk_generate_dts(const sim_t* sim, const std::vector<std::string>& args) {
-  std::stringstream s;
-  s << std::hex 
-    << "    virtioblk: virtio@" << VIRTIO_BASE_ADDR << " {\n"
-    << "      compatible = \"virtio,mmio\";\n"
-       "      interrupt-parent = <&PLIC>;\n"
-       "      interrupts = <" << std::dec << VIRTIO_IRQ;
-    reg_t virtioblkbs = VIRTIO_BASE_ADDR;
-    reg_t virtioblksz = VIRTIO_SIZE;
-  s << std::hex << ">;\n"
-       "      reg = <0x" << (virtioblkbs >> 32) << " 0x" << (virtioblkbs & (uint32_t)-1) <<
-                   " 0x" << (virtioblksz >> 32) << " 0x" << (virtioblksz & (uint32_t)-1) << ">;\n"
-       "    };\n";
-    return s.str();
+  reg_t addr;
+  uint32_t irq;
+  int index = virtioblk_nb_dts++;
+
+  virtio_mmio_placement(args, index, VIRTIO_BASE_ADDR, VIRTIO_IRQ, &addr, &irq);
+  return virtio_mmio_generate_dts("virtioblk", index, addr, irq);
 }
 
 virtioblk_t* virtioblk_parse_from_fdt(
   const void* fdt, const sim_t* sim, reg_t* base,
     std::vector<std::string> sargs)
 {
-  uint32_t blkdev_int_id;
-  if (fdt_parse_virtioblk(fdt, base, &blkdev_int_id, "virtio,mmio") == 0) {
+  uint32_t irq;
+
+  virtio_mmio_placement(sargs, virtioblk_nb_devices++, VIRTIO_BASE_ADDR, VIRTIO_IRQ, base, &irq);
+  if (fdt_parse_virtio_mmio(fdt, *base, &irq) >= 0) {
     abstract_interrupt_controller_t* intctrl = sim->get_intctrl();
-    return new virtioblk_t(sim, intctrl, blkdev_int_id, sargs);
+    return new virtioblk_t(sim, intctrl, irq, sargs);
   } else {
     return nullptr;
   }
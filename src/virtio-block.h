@@ -22,5 +22,14 @@ public:
       uint32_t interrupt_id,
       std::vector<std::string> sargs);
   ~virtioblk_t();
+  void tick(reg_t rtc_ticks) override;
+protected:
+  void poll() override;
+  // the written sectors are saved in the overlay file <prefix>.ovl
+  bool save_backend(device_state_writer_t& w, const std::string& prefix) override;
+  bool load_backend(device_state_reader_t& r) override;
 private:
+  BlockDevice *bs;
+  std::string fname;
+  bool commit_overlay; // write the overlay back to the image at exit
 };
\ No newline at end of file
@@ -0,0 +1,369 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "virtio-console.h"
+#include "cutils.h"
+
+/*******************************************************/
+/* backends */
+
+#define CONSOLE_OUT_BUF_SIZE 65536
+#define CONSOLE_IN_BUF_SIZE 65536
+
+typedef enum {
+    CONSOLE_NULL,
+    CONSOLE_STDIO,
+    CONSOLE_FILE, /* output only */
+    CONSOLE_SOCKET, /* listening Unix socket, one client at a time */
+} ConsoleBackendType;
+
+/* The output of the guest is accumulated and written with one system
+   call when the buffer is full. The interactive backends (stdio and
+   sockets) are also flushed at each tick. */
+struct ConsoleBackend {
+    CharacterDevice cs;
+    ConsoleBackendType type;
+    int out_fd; /* -1 if the output is dropped */
+    int in_fd; /* -1 if no input */
+    int listen_fd; /* CONSOLE_SOCKET only */
+    uint8_t *out_buf;
+    int out_len;
+};
+
+static void console_close_client(ConsoleBackend *b)
+{
+    close(b->in_fd);
+    b->in_fd = -1;
+    b->out_fd = -1;
+    b->out_len = 0;
+}
+
+static void console_writev(ConsoleBackend *b, struct iovec *iov, int iovcnt)
+{
+    ssize_t ret;
+
+    while (iovcnt > 0 && b->out_fd >= 0) {
+        ret = writev(b->out_fd, iov, min_int(iovcnt, IOV_MAX));
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if (b->type == CONSOLE_SOCKET) {
+                console_close_client(b);
+            } else {
+                perror("virtio console");
+                b->out_fd = -1;
+            }
+            return;
+        }
+        while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+}
+
+static void console_flush(ConsoleBackend *b)
+{
+    struct iovec iov;
+
+    if (b->out_len == 0)
+        return;
+    iov.iov_base = b->out_buf;
+    iov.iov_len = b->out_len;
+    b->out_len = 0;
+    console_writev(b, &iov, 1);
+}
+
+static void console_write_data(void *opaque, const struct iovec *iov,
+                               int iovcnt)
+{
+    ConsoleBackend *b = (ConsoleBackend *)opaque;
+    struct iovec iov1[VIRTIO_CONSOLE_MAX_IOV];
+    size_t len;
+    int i;
+
+    if (b->out_fd < 0)
+        return;
+    len = 0;
+    for(i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    if (b->out_len + len > CONSOLE_OUT_BUF_SIZE) {
+        console_flush(b);
+        if (len > CONSOLE_OUT_BUF_SIZE) {
+            /* large enough to be written directly */
+            memcpy(iov1, iov, sizeof(iov[0]) * iovcnt);
+            console_writev(b, iov1, iovcnt);
+            return;
+        }
+    }
+    for(i = 0; i < iovcnt; i++) {
+        memcpy(b->out_buf + b->out_len, iov[i].iov_base, iov[i].iov_len);
+        b->out_len += iov[i].iov_len;
+    }
+}
+
+/* accept a client on the listening socket. Its data replace the
+   previous client's. */
+static void console_accept(ConsoleBackend *b)
+{
+    int fd;
+
+    fd = accept(b->listen_fd, NULL, NULL);
+    if (fd < 0)
+        return;
+    if (b->in_fd >= 0)
+        console_close_client(b);
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    b->in_fd = fd;
+    b->out_fd = fd;
+}
+
+static int console_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(fd, 1) < 0) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+/* spec is stdio, null, file:<path> or unix:<path>. Return NULL if the
+   backend cannot be opened. */
+static ConsoleBackend *console_open(const std::string& spec)
+{
+    ConsoleBackend *b;
+
+    b = (ConsoleBackend *)mallocz(sizeof(*b));
+    b->out_fd = -1;
+    b->in_fd = -1;
+    b->listen_fd = -1;
+    if (spec == "stdio") {
+        b->type = CONSOLE_STDIO;
+        b->out_fd = STDOUT_FILENO;
+        b->in_fd = STDIN_FILENO;
+    } else if (spec == "null") {
+        b->type = CONSOLE_NULL;
+    } else if (spec.compare(0, 5, "file:") == 0) {
+        b->type = CONSOLE_FILE;
+        b->out_fd = open(spec.c_str() + 5, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (b->out_fd < 0)
+            goto fail;
+    } else if (spec.compare(0, 5, "unix:") == 0) {
+        b->type = CONSOLE_SOCKET;
+        b->listen_fd = console_listen(spec.c_str() + 5);
+        if (b->listen_fd < 0)
+            goto fail;
+    } else {
+        goto fail;
+    }
+    b->out_buf = (uint8_t *)malloc(CONSOLE_OUT_BUF_SIZE);
+    b->cs.opaque = b;
+    b->cs.write_data = console_write_data;
+    return b;
+ fail:
+    free(b);
+    return NULL;
+}
+
+static void console_free(ConsoleBackend *b)
+{
+    console_flush(b);
+    if (b->type == CONSOLE_FILE)
+        close(b->out_fd);
+    else if (b->type == CONSOLE_SOCKET) {
+        if (b->in_fd >= 0)
+            close(b->in_fd);
+        close(b->listen_fd);
+    }
+    free(b->out_buf);
+    free(b);
+}
+
+/* give the available input to the guest, at most what its buffers can
+   hold */
+static void console_poll_input(ConsoleBackend *b, VIRTIODevice *s, int port,
+                               uint8_t *buf)
+{
+    struct pollfd pfd;
+    int len;
+    ssize_t ret;
+
+    if (b->listen_fd >= 0)
+        console_accept(b);
+    if (b->in_fd < 0)
+        return;
+    len = virtio_console_get_write_len(s, port);
+    if (len == 0)
+        return;
+    pfd.fd = b->in_fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 0) <= 0)
+        return;
+    ret = read(b->in_fd, buf, min_int(len, CONSOLE_IN_BUF_SIZE));
+    if (ret > 0) {
+        virtio_console_write_data(s, port, buf, ret);
+    } else if (ret == 0 || (errno != EINTR && errno != EAGAIN)) {
+        /* end of file */
+        if (b->type == CONSOLE_SOCKET)
+            console_close_client(b);
+        else
+            b->in_fd = -1;
+    }
+}
+
+/*******************************************************/
+
+virtiocon_t::virtiocon_t(
+      const simif_t* sim,
+      abstract_interrupt_controller_t *intctrl,
+      uint32_t interrupt_id,
+      std::vector<std::string> sargs)
+  : virtio_base_t(sim, intctrl, interrupt_id, sargs), nb_ports(0),
+    rx_poll_interval(VIRTIO_CONSOLE_RX_POLL_INTERVAL)
+{
+  std::map<std::string, std::string> argmap;
+
+  for (auto arg : sargs) {
+    size_t eq_idx = arg.find('=');
+    if (eq_idx != std::string::npos) {
+      argmap.insert(std::pair<std::string, std::string>(arg.substr(0, eq_idx), arg.substr(eq_idx+1)));
+    }
+  }
+
+  std::string names[VIRTIO_CONSOLE_MAX_PORTS];
+  const char *port_names[VIRTIO_CONSOLE_MAX_PORTS];
+  CharacterDevice *port_devs[VIRTIO_CONSOLE_MAX_PORTS];
+
+  // the ports are numbered without holes: port<n> needs port<n-1>
+  for (int i = 0; i < VIRTIO_CONSOLE_MAX_PORTS; i++) {
+    std::string spec = i == 0 ? "stdio" : "";
+    auto it = argmap.find("port" + std::to_string(i));
+    if (it != argmap.end())
+      spec = it->second;
+    if (spec.empty())
+      break;
+    ports[i] = console_open(spec);
+    if (!ports[i]) {
+      printf("Virtio console device plugin INIT ERROR: could not open the backend `%s` of port %d.\n"
+             "Please use stdio, null, file:/path/to/log or unix:/path/to/socket.\n",
+             spec.c_str(), i);
+      exit(1);
+    }
+    it = argmap.find("name" + std::to_string(i));
+    if (it != argmap.end())
+      names[i] = it->second;
+    port_names[i] = names[i].empty() ? NULL : names[i].c_str();
+    port_devs[i] = &ports[i]->cs;
+    nb_ports++;
+  }
+
+  auto it = argmap.find("rx_poll_interval");
+  if (it != argmap.end()) {
+    rx_poll_interval = strtoul(it->second.c_str(), NULL, 0);
+  }
+
+  int irq_num;
+  VIRTIOBusDef vbus_s, *vbus = &vbus_s;
+
+  memset(vbus, 0, sizeof(*vbus));
+  irq_num  = interrupt_id;
+  irq = new IRQSpike(intctrl, irq_num);
+  vbus->irq = irq;
+
+  virtio_dev = virtio_console_init(vbus, port_devs, port_names, nb_ports, sim);
+  setup_common_options();
+  rx_poll_timer.init(rx_poll_cb, this);
+  device_sched_t *sched = virtio_get_sched(virtio_dev);
+  sched->arm(&rx_poll_timer, sched->now() + rx_poll_interval);
+}
+
+virtiocon_t::~virtiocon_t() {
+    for (int i = 0; i < nb_ports; i++)
+        console_free(ports[i]);
+    if (irq) delete irq;
+}
+
+bool virtiocon_t::save_backend(device_state_writer_t& w, const std::string& prefix) {
+    for (int i = 0; i < nb_ports; i++)
+        console_flush(ports[i]);
+    return true;
+}
+
+void virtiocon_t::tick(reg_t rtc_ticks) {
+    virtio_console_poll(virtio_dev);
+    for (int i = 0; i < nb_ports; i++) {
+        if (ports[i]->type != CONSOLE_FILE)
+            console_flush(ports[i]);
+    }
+    virtio_base_t::tick(rtc_ticks);
+}
+
+/* run by virtio_tick() every rx_poll_interval ticks */
+void virtiocon_t::rx_poll_cb(device_timer_t *t) {
+    virtiocon_t *con = (virtiocon_t *)t->opaque;
+    device_sched_t *sched = virtio_get_sched(con->virtio_dev);
+    uint8_t buf[CONSOLE_IN_BUF_SIZE];
+
+    for (int i = 0; i < con->nb_ports; i++)
+        console_poll_input(con->ports[i], con->virtio_dev, i, buf);
+    sched->arm(&con->rx_poll_timer, sched->now() + con->rx_poll_interval);
+}
+
+
+/* instances already generated and created, in the order of the
+   --device options */
+static int virtiocon_nb_dts, virtiocon_nb_devices;
+
+std::string virtiocon_generate_dts(const sim_t* sim, const std::vector<std::string>& args) {
+  reg_t addr;
+  uint32_t irq;
+  int index = virtiocon_nb_dts++;
+
+  virtio_mmio_placement(args, index, VIRTIO_CONSOLE_BASE, VIRTIO_CONSOLE_IRQ, &addr, &irq);
+  return virtio_mmio_generate_dts("virtiocon", index, addr, irq);
+}
+
+virtiocon_t* virtiocon_parse_from_fdt(
+  const void* fdt, const sim_t* sim, reg_t* base,
+    std::vector<std::string> sargs)
+{
+  uint32_t irq;
+
+  virtio_mmio_placement(sargs, virtiocon_nb_devices++, VIRTIO_CONSOLE_BASE, VIRTIO_CONSOLE_IRQ, base, &irq);
+  if (fdt_parse_virtio_mmio(fdt, *base, &irq) >= 0) {
+    abstract_interrupt_controller_t* intctrl = sim->get_intctrl();
+    return new virtiocon_t(sim, intctrl, irq, sargs);
+  } else {
+    return nullptr;
+  }
+}
+
+REGISTER_DEVICE(virtiocon, virtiocon_parse_from_fdt, virtiocon_generate_dts);
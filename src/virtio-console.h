@@ -0,0 +1,39 @@
+#include <sys/select.h>
+#include <riscv/abstract_device.h>
+#include <riscv/simif.h>
+#include <riscv/abstract_interrupt_controller.h>
+#include <riscv/mmu.h>
+#include <riscv/processor.h>
+#include <riscv/simif.h>
+#include <riscv/sim.h>
+#include <riscv/dts.h>
+#include <fdt/libfdt.h>
+#include "virtio.h"
+#include "device_sched.h"
+
+#define VIRTIO_CONSOLE_BASE 0x40012000
+#define VIRTIO_CONSOLE_IRQ       3
+#define VIRTIO_CONSOLE_RX_POLL_INTERVAL 10
+
+typedef struct ConsoleBackend ConsoleBackend;
+
+class virtiocon_t: public virtio_base_t {
+public:
+  virtiocon_t(
+      const simif_t* sim,
+      abstract_interrupt_controller_t *intctrl,
+      uint32_t interrupt_id,
+      std::vector<std::string> sargs);
+  ~virtiocon_t();
+  void tick(reg_t rtc_ticks) override;
+protected:
+  // the buffered output is written before the state is saved
+  bool save_backend(device_state_writer_t& w, const std::string& prefix) override;
+private:
+  static void rx_poll_cb(device_timer_t *t);
+
+  ConsoleBackend *ports[VIRTIO_CONSOLE_MAX_PORTS];
+  int nb_ports;
+  reg_t rx_poll_interval; // ticks between two polls of the input
+  device_timer_t rx_poll_timer;
+};
@@ -0,0 +1,187 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include "virtio-fs.h"
+#include "fs.h"
+#include "cutils.h"
+
+virtiofs_t::virtiofs_t(
+      const simif_t* sim,
+      abstract_interrupt_controller_t *intctrl,
+      uint32_t interrupt_id,
+      std::vector<std::string> sargs)
+  : virtio_base_t(sim, intctrl, interrupt_id, sargs)
+{
+  std::map<std::string, std::string> argmap;
+
+  for (auto arg : sargs) {
+    size_t eq_idx = arg.find('=');
+    if (eq_idx != std::string::npos) {
+      argmap.insert(std::pair<std::string, std::string>(arg.substr(0, eq_idx), arg.substr(eq_idx+1)));
+    }
+  }
+
+  std::string fname;
+  std::string archive_fname;
+  std::string tag = "/dev/root";
+  int num_queues = 1;
+  int cache_mode = VIRTIO_FS_CACHE_AUTO;
+  int timeout_ms = -1;
+  uint32_t max_write = VIRTIO_FS_MAX_WRITE;
+  int attr_cache_entries = 0;
+  int attr_ttl_ms = 1000;
+
+  auto it = argmap.find("path");
+  if (it != argmap.end()) {
+    fname = it->second;
+  }
+
+  it = argmap.find("archive");
+  if (it != argmap.end()) {
+    archive_fname = it->second;
+  }
+
+  if (fname.empty() == archive_fname.empty()) {
+    printf("Virtio fs device plugin INIT ERROR: exactly one of `path` or `archive` must be specified.\n"
+            "Please use spike option --device=virtiofs,path=/path/to/folder to share a host folder,\n"
+            "or --device=virtiofs,archive=/path/to/file.tar to serve a tar archive read only.\n");
+    exit(1);
+  }
+
+  it = argmap.find("tag");
+  if (it != argmap.end()) {
+    tag = it->second;
+    if (tag.empty() || tag.size() > 36) {
+      printf("Virtio fs device plugin INIT ERROR: `tag` must have 1 to 36 characters.\n");
+      exit(1);
+    }
+  }
+  else {
+    printf("Virtio fs device plugin INIT WARN: `tag` argument not specified. Use default %s\n", tag.c_str());
+  }
+
+  it = argmap.find("queues");
+  if (it != argmap.end()) {
+    num_queues = strtol(it->second.c_str(), NULL, 0);
+    if (num_queues < 1 || num_queues > VIRTIO_FS_MAX_REQUEST_QUEUES) {
+      printf("Virtio fs device plugin INIT ERROR: `queues` must be between 1 and %d.\n", VIRTIO_FS_MAX_REQUEST_QUEUES);
+      exit(1);
+    }
+  }
+
+  it = argmap.find("cache");
+  if (it != argmap.end()) {
+    if (it->second == "none") {
+      cache_mode = VIRTIO_FS_CACHE_NONE;
+    }
+    else if (it->second == "always") {
+      cache_mode = VIRTIO_FS_CACHE_ALWAYS;
+    }
+    else if (it->second != "auto") {
+      printf("Virtio fs device plugin INIT WARN: unknown `cache` mode %s, use auto\n", it->second.c_str());
+    }
+  }
+
+  it = argmap.find("timeout");
+  if (it != argmap.end()) {
+    timeout_ms = strtol(it->second.c_str(), NULL, 0);
+  }
+  if (timeout_ms < 0) {
+    timeout_ms = cache_mode == VIRTIO_FS_CACHE_ALWAYS ? 86400 * 1000 : 1000;
+  }
+
+  it = argmap.find("max_write");
+  if (it != argmap.end()) {
+    max_write = strtoul(it->second.c_str(), NULL, 0);
+  }
+
+  it = argmap.find("attr_cache");
+  if (it != argmap.end()) {
+    attr_cache_entries = strtol(it->second.c_str(), NULL, 0);
+  }
+
+  it = argmap.find("attr_ttl");
+  if (it != argmap.end()) {
+    attr_ttl_ms = strtol(it->second.c_str(), NULL, 0);
+  }
+
+  int irq_num;
+  VIRTIOBusDef vbus_s, *vbus = &vbus_s;
+  FSDevice* fs;
+  if (!archive_fname.empty()) {
+    fs = fs_archive_init(archive_fname.c_str());
+    if (!fs) {
+      printf("Virtio fs device plugin INIT ERROR: could not load the tar archive %s\n", archive_fname.c_str());
+      exit(1);
+    }
+  }
+  else {
+    fs = fs_disk_init(fname.c_str());
+    if (!fs) {
+      printf("Virtio fs device plugin INIT ERROR: `path` %s must be a directory\n", fname.c_str());
+      exit(1);
+    }
+    if (fs_disk_set_attr_cache(fs, attr_cache_entries, attr_ttl_ms) < 0) {
+      printf("Virtio fs device plugin: could not allocate the attribute cache.\n");
+    }
+  }
+
+  memset(vbus, 0, sizeof(*vbus));
+  irq_num  = interrupt_id;
+  irq = new IRQSpike(intctrl, irq_num);
+  vbus->irq = irq;
+
+  virtio_dev = virtio_fs_init(vbus, fs, tag.c_str(), num_queues, max_write,
+                              cache_mode, timeout_ms, sim);
+  if (!virtio_dev) {
+    printf("Virtio fs device plugin INIT ERROR: could not attach the root directory\n");
+    exit(1);
+  }
+  setup_common_options();
+}
+
+virtiofs_t::~virtiofs_t() {
+    if (irq) delete irq;
+}
+
+/* let the backend write its buffered data */
+void virtiofs_t::poll() {
+    virtio_fs_poll(virtio_dev);
+}
+
+void virtiofs_t::tick(reg_t rtc_ticks) {
+    poll();
+    virtio_base_t::tick(rtc_ticks);
+}
+
+
+/* instances already generated and created, in the order of the
+   --device options */
+static int virtiofs_nb_dts, virtiofs_nb_devices;
+
+std::string virtiofs_generate_dts(const sim_t* sim, const std::vector<std::string>& args) {
+  reg_t addr;
+  uint32_t irq;
+  int index = virtiofs_nb_dts++;
+
+  virtio_mmio_placement(args, index, VIRTIO_FS_BASE, VIRTIO_FS_IRQ, &addr, &irq);
+  return virtio_mmio_generate_dts("virtiofs", index, addr, irq);
+}
+
+virtiofs_t* virtiofs_parse_from_fdt(
+  const void* fdt, const sim_t* sim, reg_t* base,
+    std::vector<std::string> sargs)
+{
+  uint32_t irq;
+
+  virtio_mmio_placement(sargs, virtiofs_nb_devices++, VIRTIO_FS_BASE, VIRTIO_FS_IRQ, base, &irq);
+  if (fdt_parse_virtio_mmio(fdt, *base, &irq) >= 0) {
+    abstract_interrupt_controller_t* intctrl = sim->get_intctrl();
+    return new virtiofs_t(sim, intctrl, irq, sargs);
+  } else {
+    return nullptr;
+  }
+}
+
+REGISTER_DEVICE(virtiofs, virtiofs_parse_from_fdt, virtiofs_generate_dts);
@@ -0,0 +1,27 @@
+#include <sys/select.h>
+#include <riscv/abstract_device.h>
+#include <riscv/simif.h>
+#include <riscv/abstract_interrupt_controller.h>
+#include <riscv/mmu.h>
+#include <riscv/processor.h>
+#include <riscv/simif.h>
+#include <riscv/sim.h>
+#include <riscv/dts.h>
+#include <fdt/libfdt.h>
+#include "virtio.h"
+
+#define VIRTIO_FS_BASE 0x40013000
+#define VIRTIO_FS_IRQ       4
+
+class virtiofs_t: public virtio_base_t {
+public:
+  virtiofs_t(
+      const simif_t* sim,
+      abstract_interrupt_controller_t *intctrl,
+      uint32_t interrupt_id,
+      std::vector<std::string> sargs);
+  ~virtiofs_t();
+  void tick(reg_t rtc_ticks) override;
+protected:
+  void poll() override;
+};
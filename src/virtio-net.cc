@@ -4,31 +4,45 @@
 #include <inttypes.h>
 #include <assert.h>
 #include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+#endif
 #include "virtio-net.h"
 #include "cutils.h"
 
 /*******************************************************/
 /* slirp */
 #ifdef CONFIG_SLIRP
-static Slirp *slirp_state;
-
-static void slirp_write_packet(EthernetDevice *net,
+static void slirp_write_packet(EthernetDevice *net, int queue_pair,
                                const uint8_t *buf, int len)
 {
     Slirp *slirp_state = (Slirp *) net->opaque;
     slirp_input(slirp_state, buf, len);
 }
 
+static void slirp_write_packetv(EthernetDevice *net, int queue_pair,
+                                const struct iovec *iov, int iovcnt)
+{
+    Slirp *slirp_state = (Slirp *) net->opaque;
+    slirp_inputv(slirp_state, iov, iovcnt);
+}
+
 int slirp_can_output(void *opaque)
 {
     EthernetDevice *net = (EthernetDevice *) opaque;
-    return net->device_can_write_packet(net);
+    return net->device_can_write_packet(net, NET_QUEUE_ANY);
 }
 
 void slirp_output(void *opaque, const uint8_t *pkt, int pkt_len)
 {
     EthernetDevice *net = (EthernetDevice *) opaque;
-    return net->device_write_packet(net, pkt, pkt_len);
+    net->device_write_packet(net, NET_QUEUE_ANY, pkt, pkt_len);
 }
 
 static void slirp_select_fill1(EthernetDevice *net, int *pfd_max,
@@ -47,7 +61,8 @@ static void slirp_select_poll1(EthernetDevice *net,
     slirp_select_poll(slirp_state, rfds, wfds, efds, (select_ret <= 0));
 }
 
-static EthernetDevice *slirp_open(void)
+/* each instance has its own slirp stack, polled by its I/O thread */
+static EthernetDevice *slirp_open(const uint8_t *mac_addr)
 {
     EthernetDevice *net;
     struct in_addr net_addr  = { .s_addr = htonl(0x0a000200) }; /* 10.0.2.0 */
@@ -59,23 +74,12 @@ static EthernetDevice *slirp_open(void)
     const char *vhostname = NULL;
     int restricted = 0;
     
-    if (slirp_state) {
-        fprintf(stderr, "Only a single slirp instance is allowed\n");
-        return NULL;
-    }
     net = (EthernetDevice *) mallocz(sizeof(*net));
-
-    slirp_state = slirp_init(restricted, net_addr, mask, host, vhostname,
+    memcpy(net->mac_addr, mac_addr, sizeof(net->mac_addr));
+    net->opaque = slirp_init(restricted, net_addr, mask, host, vhostname,
                              "", bootfile, dhcp, dns, net);
-    
-    net->mac_addr[0] = 0x02;
-    net->mac_addr[1] = 0x00;
-    net->mac_addr[2] = 0x00;
-    net->mac_addr[3] = 0x00;
-    net->mac_addr[4] = 0x00;
-    net->mac_addr[5] = 0x01;
-    net->opaque = slirp_state;
     net->write_packet = slirp_write_packet;
+    net->write_packetv = slirp_write_packetv;
     net->select_fill = slirp_select_fill1;
     net->select_poll = slirp_select_poll1;
     
@@ -84,40 +88,580 @@ static EthernetDevice *slirp_open(void)
 
 #endif /* CONFIG_SLIRP */
 
+/*******************************************************/
+/* TAP */
+#if defined(__linux__)
 
-int fdt_parse_virtionet(
-    const void *fdt,
-    reg_t* blkdev_addr,
-    uint32_t* blkdev_int_id,
-    const char *compatible) {
-  int nodeoffset, rc, len;
-  const fdt32_t *reg_p;
-
-  nodeoffset = fdt_node_offset_by_compatible(fdt, -1, compatible);
-  if (nodeoffset < 0)
-    return nodeoffset;
-
-  rc = fdt_get_node_addr_size(fdt, nodeoffset, blkdev_addr, NULL, "reg");
-  if (rc < 0 || !blkdev_addr)
-    return -ENODEV;
-
-  reg_p = (fdt32_t *)fdt_getprop(fdt, nodeoffset, "interrupts", &len);
-  if (blkdev_int_id) {
-    if (reg_p)
-      *blkdev_int_id = fdt32_to_cpu(*reg_p);
-    else
-      *blkdev_int_id = VIRTIO_NET_IRQ;
-  }
+#define TAP_VNET_HDR_LEN 12 /* struct virtio_net_hdr_mrg_rxbuf */
+#define TAP_MAX_FRAME_LEN (TAP_VNET_HDR_LEN + 65536)
+#define TAP_READ_BATCH 64 /* maximum number of frames read per wakeup */
+
+typedef struct {
+    int nb_fds; /* one per queue pair with IFF_MULTI_QUEUE */
+    int fds[NET_MAX_QUEUE_PAIRS];
+    BOOL select_filled[NET_MAX_QUEUE_PAIRS];
+    uint8_t buf[TAP_MAX_FRAME_LEN];
+} TapState;
+
+/* queue pair of the frames read from the queue i */
+static int tap_queue_pair(TapState *s, int i)
+{
+    return s->nb_fds > 1 ? i : NET_QUEUE_ANY;
+}
+
+static void tap_write_packet(EthernetDevice *net, int queue_pair,
+                             const uint8_t *buf, int len)
+{
+    TapState *s = (TapState *) net->opaque;
+
+    if (write(s->fds[queue_pair % s->nb_fds], buf, len) < 0) {
+        /* the frame is dropped if the interface queue is full */
+    }
+}
+
+static void tap_write_packetv(EthernetDevice *net, int queue_pair,
+                              const struct iovec *iov, int iovcnt)
+{
+    TapState *s = (TapState *) net->opaque;
+
+    if (writev(s->fds[queue_pair % s->nb_fds], iov, iovcnt) < 0) {
+        /* the frame is dropped if the interface queue is full */
+    }
+}
+
+static void tap_select_fill(EthernetDevice *net, int *pfd_max,
+                            fd_set *rfds, fd_set *wfds, fd_set *efds,
+                            int *pdelay)
+{
+    TapState *s = (TapState *) net->opaque;
+    int i, fd;
+
+    for(i = 0; i < s->nb_fds; i++) {
+        fd = s->fds[i];
+        s->select_filled[i] =
+            net->device_can_write_packet(net, tap_queue_pair(s, i));
+        if (s->select_filled[i]) {
+            FD_SET(fd, rfds);
+            *pfd_max = max_int(*pfd_max, fd);
+        }
+    }
+}
+
+static void tap_select_poll(EthernetDevice *net,
+                            fd_set *rfds, fd_set *wfds, fd_set *efds,
+                            int select_ret)
+{
+    TapState *s = (TapState *) net->opaque;
+    int i, j, ret, queue_pair;
 
-  return 0;
+    if (select_ret <= 0)
+        return;
+    for(i = 0; i < s->nb_fds; i++) {
+        if (!s->select_filled[i] || !FD_ISSET(s->fds[i], rfds))
+            continue;
+        queue_pair = tap_queue_pair(s, i);
+        /* the fd is non blocking: read the queued frames until it is
+           empty or the device cannot accept more */
+        for(j = 0; j < TAP_READ_BATCH; j++) {
+            ret = read(s->fds[i], s->buf, sizeof(s->buf));
+            if (ret <= 0)
+                break;
+            net->device_write_packet(net, queue_pair, s->buf, ret);
+            if (!net->device_can_write_packet(net, queue_pair))
+                break;
+        }
+    }
 }
 
+static void tap_set_offload(EthernetDevice *net, int flags)
+{
+    TapState *s = (TapState *) net->opaque;
+    unsigned int tun_flags = 0;
+    int i;
+
+    if (flags & NET_OFFLOAD_CSUM)
+        tun_flags |= TUN_F_CSUM;
+    if (flags & NET_OFFLOAD_TSO4)
+        tun_flags |= TUN_F_TSO4;
+    for(i = 0; i < s->nb_fds; i++) {
+        if (ioctl(s->fds[i], TUNSETOFFLOAD, tun_flags) < 0)
+            perror("TUNSETOFFLOAD");
+    }
+}
+
+/* open a queue of the interface, return -1 on error */
+static int tap_open_queue(const char *ifname, BOOL multi_queue)
+{
+    struct ifreq ifr;
+    int fd, hdr_len;
+
+    fd = open("/dev/net/tun", O_RDWR);
+    if (fd < 0) {
+        perror("/dev/net/tun");
+        return -1;
+    }
+    memset(&ifr, 0, sizeof(ifr));
+    /* the frames are prefixed by a virtio-net header */
+    ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR;
+    if (multi_queue)
+        ifr.ifr_flags |= IFF_MULTI_QUEUE;
+    pstrcpy(ifr.ifr_name, sizeof(ifr.ifr_name), ifname);
+    if (ioctl(fd, TUNSETIFF, (void *) &ifr) < 0) {
+        fprintf(stderr, "Error: could not configure the TAP interface '%s': %s\n",
+                ifname, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    hdr_len = TAP_VNET_HDR_LEN;
+    if (ioctl(fd, TUNSETVNETHDRSZ, &hdr_len) < 0 ||
+        ioctl(fd, TUNSETOFFLOAD, 0) < 0) {
+        perror("TUNSETVNETHDRSZ");
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+/* with nb_queues > 1, the interface is opened with IFF_MULTI_QUEUE
+   and each queue pair of the device has its own queue */
+static EthernetDevice *tap_open(const char *ifname, int nb_queues,
+                                const uint8_t *mac_addr)
+{
+    EthernetDevice *net;
+    TapState *s;
+    int i, fd;
+
+    nb_queues = min_int(max_int(nb_queues, 1), NET_MAX_QUEUE_PAIRS);
+    s = (TapState *) mallocz(sizeof(*s));
+    for(i = 0; i < nb_queues; i++) {
+        fd = tap_open_queue(ifname, nb_queues > 1);
+        if (fd < 0) {
+            while (--i >= 0)
+                close(s->fds[i]);
+            free(s);
+            return NULL;
+        }
+        s->fds[i] = fd;
+    }
+    s->nb_fds = nb_queues;
+
+    net = (EthernetDevice *) mallocz(sizeof(*net));
+    memcpy(net->mac_addr, mac_addr, sizeof(net->mac_addr));
+    net->opaque = s;
+    net->vnet_hdr_len = TAP_VNET_HDR_LEN;
+    net->write_packet = tap_write_packet;
+    net->write_packetv = tap_write_packetv;
+    net->select_fill = tap_select_fill;
+    net->select_poll = tap_select_poll;
+    net->set_offload = tap_set_offload;
+    return net;
+}
+
+#endif /* __linux__ */
+
+/*******************************************************/
+/* network I/O thread */
+
+/* The backend (its file descriptors and timers) is run by a dedicated
+   thread sleeping in select(). The frames are exchanged with the
+   simulation thread through single producer / single consumer rings,
+   so that the device tick only reads an index when there is no
+   traffic. Each queue pair has its own receive ring, so that a guest
+   queue without buffers does not hold the frames of the others. */
+
+#define NET_RING_SIZE 256 /* power of two */
+#define NET_POLL_DELAY_MS 10 /* maximum sleep, for the backend timers */
+#define NET_IO_BUF_SIZE (12 + 14 + 65535) /* virtio-net header and frame */
+
+/* The packets of a ring slot are reused, so that no memory is
+   allocated once the slots have grown to the frame size. */
+typedef struct {
+    void *opaque; /* of net_io_write_packet_async() */
+    int queue_pair;
+    int len;
+    int iovcnt; /* != 0 if buf contains the iovec array of a frame
+                   still in guest memory */
+    int size; /* allocated size of buf */
+    uint8_t buf[0];
+} NetPacket;
+
+typedef struct {
+    uint32_t head; /* written by the producer */
+    uint32_t tail; /* written by the consumer */
+    NetPacket *tab[NET_RING_SIZE];
+} NetRing;
+
+/* opaque values of the sent write_packet_async() frames */
+typedef struct {
+    uint32_t head;
+    uint32_t tail;
+    void *tab[NET_RING_SIZE];
+} NetDoneRing;
+
+struct NetIOThread {
+    EthernetDevice *net;
+    /* original backend and device callbacks */
+    void (*backend_write_packet)(EthernetDevice *net, int queue_pair,
+                                 const uint8_t *buf, int len);
+    bool (*device_can_write_packet)(EthernetDevice *net, int queue_pair);
+    bool (*device_write_packet)(EthernetDevice *net, int queue_pair,
+                                const uint8_t *buf, int len);
+    int nb_queue_pairs;
+    NetRing tx; /* guest -> backend */
+    NetRing rx[NET_MAX_QUEUE_PAIRS]; /* backend -> guest */
+    NetDoneRing tx_done;
+    int tx_async_pending; /* frames of tx and tx_done, used by the
+                             simulation thread */
+    uint8_t *tx_buf; /* for the backends without write_packetv() */
+    pthread_t thread;
+    BOOL thread_started;
+    int wakeup_fds[2]; /* pipe waking up the thread */
+    int sleeping; /* TRUE if the thread may be in select() */
+    int stop;
+};
+
+static BOOL net_ring_full(NetRing *r)
+{
+    return __atomic_load_n(&r->head, __ATOMIC_RELAXED) -
+        __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= NET_RING_SIZE;
+}
+
+/* return the packet of the next free slot with at least size bytes,
+   or NULL */
+static NetPacket *net_ring_alloc(NetRing *r, int size)
+{
+    NetPacket **ppkt, *pkt;
+
+    if (net_ring_full(r))
+        return NULL;
+    ppkt = &r->tab[r->head & (NET_RING_SIZE - 1)];
+    pkt = *ppkt;
+    if (!pkt || pkt->size < size) {
+        pkt = (NetPacket *) realloc(pkt, sizeof(*pkt) + size);
+        if (!pkt)
+            return NULL;
+        pkt->size = size;
+        *ppkt = pkt;
+    }
+    return pkt;
+}
+
+static void net_ring_commit(NetRing *r)
+{
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+static BOOL net_ring_push(NetRing *r, int queue_pair,
+                          const uint8_t *buf, int len)
+{
+    NetPacket *pkt;
+
+    pkt = net_ring_alloc(r, len);
+    if (!pkt)
+        return FALSE;
+    pkt->opaque = NULL;
+    pkt->queue_pair = queue_pair;
+    pkt->len = len;
+    pkt->iovcnt = 0;
+    memcpy(pkt->buf, buf, len);
+    net_ring_commit(r);
+    return TRUE;
+}
+
+/* return the oldest packet without removing it, or NULL */
+static NetPacket *net_ring_peek(NetRing *r)
+{
+    uint32_t tail = r->tail;
+
+    if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail)
+        return NULL;
+    return r->tab[tail & (NET_RING_SIZE - 1)];
+}
+
+/* the packet stays allocated for the producer */
+static void net_ring_pop(NetRing *r)
+{
+    __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+}
+
+static void net_ring_free(NetRing *r)
+{
+    int i;
+
+    for(i = 0; i < NET_RING_SIZE; i++) {
+        free(r->tab[i]);
+        r->tab[i] = NULL;
+    }
+}
+
+static void net_io_wakeup(NetIOThread *io)
+{
+    uint8_t b = 0;
+
+    /* only one write while the thread sleeps */
+    if (__atomic_exchange_n(&io->sleeping, FALSE, __ATOMIC_SEQ_CST)) {
+        if (write(io->wakeup_fds[1], &b, 1) < 0) {
+            /* the pipe is full: the thread is woken up anyway */
+        }
+    }
+}
+
+/* called by the device with a frame sent by the guest */
+static void net_io_write_packet(EthernetDevice *net, int queue_pair,
+                                const uint8_t *buf, int len)
+{
+    NetIOThread *io = (NetIOThread *) net->opaque_io;
+
+    /* the frame is dropped if the ring is full */
+    net_ring_push(&io->tx, queue_pair, buf, len);
+    net_io_wakeup(io);
+}
+
+/* called by the device: the frame is sent by the I/O thread from the
+   guest memory */
+static bool net_io_write_packet_async(EthernetDevice *net, int queue_pair,
+                                      const struct iovec *iov, int iovcnt,
+                                      void *opaque)
+{
+    NetIOThread *io = (NetIOThread *) net->opaque_io;
+    NetPacket *pkt;
+    int i;
+
+    /* tx_done cannot overflow */
+    if (io->tx_async_pending >= NET_RING_SIZE)
+        return false;
+    pkt = net_ring_alloc(&io->tx, iovcnt * sizeof(struct iovec));
+    if (!pkt)
+        return false;
+    pkt->opaque = opaque;
+    pkt->queue_pair = queue_pair;
+    pkt->len = 0;
+    for(i = 0; i < iovcnt; i++)
+        pkt->len += iov[i].iov_len;
+    pkt->iovcnt = iovcnt;
+    memcpy(pkt->buf, iov, iovcnt * sizeof(struct iovec));
+    net_ring_commit(&io->tx);
+    io->tx_async_pending++;
+    net_io_wakeup(io);
+    return true;
+}
+
+/* called by the backend in the I/O thread */
+static bool net_io_can_write_packet(EthernetDevice *net, int queue_pair)
+{
+    NetIOThread *io = (NetIOThread *) net->opaque_io;
+    int i;
+
+    if (queue_pair >= 0)
+        return !net_ring_full(&io->rx[queue_pair % io->nb_queue_pairs]);
+    for(i = 0; i < io->nb_queue_pairs; i++) {
+        if (net_ring_full(&io->rx[i]))
+            return false;
+    }
+    return true;
+}
+
+static bool net_io_device_write_packet(EthernetDevice *net, int queue_pair,
+                                       const uint8_t *buf, int len)
+{
+    NetIOThread *io = (NetIOThread *) net->opaque_io;
+    int hdr_len;
+
+    /* steer by flow so that the frames of a connection stay in order */
+    if (queue_pair < 0) {
+        hdr_len = min_int(net->vnet_hdr_len, len);
+        queue_pair = net_flow_hash(buf + hdr_len, len - hdr_len);
+    }
+    queue_pair = (unsigned int) queue_pair % io->nb_queue_pairs;
+    /* the backend checked net_io_can_write_packet() */
+    return net_ring_push(&io->rx[queue_pair], queue_pair, buf, len);
+}
+
+static void net_io_write_iov(NetIOThread *io, NetPacket *pkt)
+{
+    EthernetDevice *net = io->net;
+    const struct iovec *iov = (const struct iovec *) pkt->buf;
+    int i, pos;
+
+    if (net->write_packetv) {
+        net->write_packetv(net, pkt->queue_pair, iov, pkt->iovcnt);
+        return;
+    }
+    if (pkt->len > NET_IO_BUF_SIZE)
+        return;
+    pos = 0;
+    for(i = 0; i < pkt->iovcnt; i++) {
+        memcpy(io->tx_buf + pos, iov[i].iov_base, iov[i].iov_len);
+        pos += iov[i].iov_len;
+    }
+    io->backend_write_packet(net, pkt->queue_pair, io->tx_buf, pos);
+}
+
+/* one iteration of the backend loop: send the pending frames, wait
+   for up to delay_ms and run the backend */
+static void net_io_iterate(NetIOThread *io, int delay_ms)
+{
+    EthernetDevice *net = io->net;
+    NetPacket *pkt;
+    NetDoneRing *r;
+    fd_set rfds, wfds, efds;
+    struct timeval tv;
+    int fd_max, ret;
+    uint8_t buf[64];
+
+    while ((pkt = net_ring_peek(&io->tx)) != NULL) {
+        if (pkt->iovcnt == 0) {
+            io->backend_write_packet(net, pkt->queue_pair, pkt->buf, pkt->len);
+        } else {
+            net_io_write_iov(io, pkt);
+            /* the device can reuse the guest buffers */
+            r = &io->tx_done;
+            r->tab[r->head & (NET_RING_SIZE - 1)] = pkt->opaque;
+            __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+        }
+        net_ring_pop(&io->tx);
+    }
+
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    FD_ZERO(&efds);
+    fd_max = -1;
+    if (io->thread_started) {
+        fd_max = io->wakeup_fds[0];
+        FD_SET(fd_max, &rfds);
+    }
+    net->select_fill(net, &fd_max, &rfds, &wfds, &efds, &delay_ms);
+    if (io->thread_started) {
+        __atomic_store_n(&io->sleeping, TRUE, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        /* a frame queued before the flag was set would not wake us up */
+        if (net_ring_peek(&io->tx) || __atomic_load_n(&io->stop, __ATOMIC_RELAXED))
+            delay_ms = 0;
+    }
+    tv.tv_sec = delay_ms / 1000;
+    tv.tv_usec = (delay_ms % 1000) * 1000;
+    ret = select(fd_max + 1, &rfds, &wfds, &efds, &tv);
+    if (io->thread_started) {
+        __atomic_store_n(&io->sleeping, FALSE, __ATOMIC_RELAXED);
+        if (ret > 0 && FD_ISSET(io->wakeup_fds[0], &rfds)) {
+            while (read(io->wakeup_fds[0], buf, sizeof(buf)) > 0)
+                continue;
+        }
+    }
+    net->select_poll(net, &rfds, &wfds, &efds, ret);
+}
+
+static void *net_io_thread(void *opaque)
+{
+    NetIOThread *io = (NetIOThread *) opaque;
+
+    while (!__atomic_load_n(&io->stop, __ATOMIC_RELAXED))
+        net_io_iterate(io, NET_POLL_DELAY_MS);
+    return NULL;
+}
+
+/* Run the backend of net in a thread. Must be called after
+   virtio_net_init(). If the thread cannot be created, the backend is
+   polled by net_io_poll(). */
+NetIOThread *net_io_start(EthernetDevice *net)
+{
+    NetIOThread *io;
+    int i;
+
+    io = (NetIOThread *) mallocz(sizeof(*io));
+    io->net = net;
+    io->nb_queue_pairs = max_int(net->nb_queue_pairs, 1);
+    io->backend_write_packet = net->write_packet;
+    io->device_can_write_packet = net->device_can_write_packet;
+    io->device_write_packet = net->device_write_packet;
+    io->tx_buf = (uint8_t *) malloc(NET_IO_BUF_SIZE);
+    net->opaque_io = io;
+    net->write_packet = net_io_write_packet;
+    if (net->device_write_done)
+        net->write_packet_async = net_io_write_packet_async;
+    net->device_can_write_packet = net_io_can_write_packet;
+    net->device_write_packet = net_io_device_write_packet;
+
+    io->wakeup_fds[0] = io->wakeup_fds[1] = -1;
+    if (pipe(io->wakeup_fds) == 0) {
+        for(i = 0; i < 2; i++)
+            fcntl(io->wakeup_fds[i], F_SETFL, O_NONBLOCK);
+        io->thread_started = TRUE;
+        if (pthread_create(&io->thread, NULL, net_io_thread, io) != 0)
+            io->thread_started = FALSE;
+    }
+    if (!io->thread_started)
+        fprintf(stderr, "virtio-net: could not start the I/O thread, polling the backend on each tick\n");
+    return io;
+}
+
+/* called by the simulation thread: give the received frames to the
+   guest while it has buffers */
+void net_io_poll(NetIOThread *io)
+{
+    EthernetDevice *net = io->net;
+    NetRing *r;
+    NetDoneRing *d;
+    NetPacket *pkt;
+    int i;
+
+    if (!io->thread_started)
+        net_io_iterate(io, 0);
+    d = &io->tx_done;
+    while (d->tail != __atomic_load_n(&d->head, __ATOMIC_ACQUIRE)) {
+        net->device_write_done(net, d->tab[d->tail & (NET_RING_SIZE - 1)]);
+        __atomic_store_n(&d->tail, d->tail + 1, __ATOMIC_RELEASE);
+        io->tx_async_pending--;
+    }
+    for(i = 0; i < io->nb_queue_pairs; i++) {
+        r = &io->rx[i];
+        while ((pkt = net_ring_peek(r)) != NULL &&
+               io->device_can_write_packet(net, i)) {
+            /* kept until the guest made enough buffers available */
+            if (!io->device_write_packet(net, i, pkt->buf, pkt->len))
+                break;
+            net_ring_pop(r);
+        }
+    }
+}
+
+void net_io_stop(NetIOThread *io)
+{
+    EthernetDevice *net = io->net;
+    int i;
+
+    if (io->thread_started) {
+        __atomic_store_n(&io->stop, TRUE, __ATOMIC_RELAXED);
+        __atomic_store_n(&io->sleeping, TRUE, __ATOMIC_RELAXED);
+        net_io_wakeup(io);
+        pthread_join(io->thread, NULL);
+    }
+    for(i = 0; i < 2; i++) {
+        if (io->wakeup_fds[i] >= 0)
+            close(io->wakeup_fds[i]);
+    }
+    net_ring_free(&io->tx);
+    for(i = 0; i < io->nb_queue_pairs; i++)
+        net_ring_free(&io->rx[i]);
+    free(io->tx_buf);
+    net->write_packet = io->backend_write_packet;
+    net->write_packet_async = NULL;
+    net->device_can_write_packet = io->device_can_write_packet;
+    net->device_write_packet = io->device_write_packet;
+    net->opaque_io = NULL;
+    free(io);
+}
+
+/* instances constructed so far, for their default MAC address */
+static int virtionet_nb_instances;
+
 virtionet_t::virtionet_t(
       const simif_t* sim,
       abstract_interrupt_controller_t *intctrl,
       uint32_t interrupt_id,
       std::vector<std::string> sargs)
-  : virtio_base_t(sim, intctrl, interrupt_id, sargs)
+  : virtio_base_t(sim, intctrl, interrupt_id, sargs), io(NULL)
 {
   std::map<std::string, std::string> argmap;
 
@@ -130,6 +674,13 @@ virtionet_t::virtionet_t(
 
   std::string driver;
   std::string hostfwd;
+  std::string ifname;
+  int queues = 1;
+  std::string pcap;
+  int snaplen = 0;
+  /* locally administered, the last byte is 1 + the instance number */
+  uint8_t mac_addr[6] = { 0x02, 0x00, 0x00, 0x00, 0x00,
+                          (uint8_t) (1 + virtionet_nb_instances++) };
   
   auto it = argmap.find("driver");
   if (it == argmap.end()) {
@@ -153,65 +704,131 @@ virtionet_t::virtionet_t(
       else {
         hostfwd = it->second;
       }
+  } else if (driver == "tap") {
+    auto it = argmap.find("ifname");
+    if (it == argmap.end()) {
+      printf("Virtio net device plugin INIT ERROR: `ifname` argument not specified.\n"
+              "Please use spike option --device=virtionet,driver=tap,ifname=tap0 to use an existing host TAP interface.\n");
+      exit(1);
+    }
+    ifname = it->second;
+  } else {
+    printf("Virtio net device plugin INIT ERROR: unknown driver `%s`, `user` or `tap` expected.\n", driver.c_str());
+    exit(1);
+  }
+
+  it = argmap.find("queues");
+  if (it != argmap.end()) {
+    queues = atoi(it->second.c_str());
+    if (queues < 1 || queues > NET_MAX_QUEUE_PAIRS) {
+      printf("Virtio net device plugin INIT ERROR: `queues` must be between 1 and %d\n",
+             NET_MAX_QUEUE_PAIRS);
+      exit(1);
+    }
+  }
+
+  it = argmap.find("pcap");
+  if (it != argmap.end())
+    pcap = it->second;
+  it = argmap.find("snaplen");
+  if (it != argmap.end())
+    snaplen = atoi(it->second.c_str());
+
+  it = argmap.find("mac");
+  if (it != argmap.end()) {
+    unsigned int b[6];
+    char c;
+    int i;
+
+    if (sscanf(it->second.c_str(), "%x:%x:%x:%x:%x:%x%c",
+               &b[0], &b[1], &b[2], &b[3], &b[4], &b[5], &c) != 6 ||
+        b[0] > 0xff || b[1] > 0xff || b[2] > 0xff || b[3] > 0xff ||
+        b[4] > 0xff || b[5] > 0xff || (b[0] & 1)) {
+      printf("Virtio net device plugin INIT ERROR: `mac` %s must be a unicast address, e.g. 02:00:00:00:00:01\n",
+             it->second.c_str());
+      exit(1);
+    }
+    for(i = 0; i < 6; i++)
+      mac_addr[i] = b[i];
   }
 
   int irq_num;
   VIRTIOBusDef vbus_s, *vbus = &vbus_s;
 
-  EthernetDevice * net;
+  EthernetDevice * net = NULL;
   if (driver == "user") {
-    net = (EthernetDevice *) slirp_open();
-    if (!net){
-      printf("Virtio net disk fs device plugin INIT ERROR: `path` %s must be a directory\n", driver.c_str());
+    net = (EthernetDevice *) slirp_open(mac_addr);
+  } else {
+#if defined(__linux__)
+    net = tap_open(ifname.c_str(), queues, mac_addr);
+#endif
+    if (!net) {
+      printf("Virtio net device plugin INIT ERROR: could not open the TAP interface `%s`\n", ifname.c_str());
       exit(1);
     }
-  } 
-  
-  Slirp * slirp_ptr = (Slirp *) net->opaque;
+  }
 
   memset(vbus, 0, sizeof(*vbus));
-  vbus->addr = VIRTIO_NET_BASE;
-  irq_num  = VIRTIO_NET_IRQ;
+  irq_num  = interrupt_id;
   irq = new IRQSpike(intctrl, irq_num);
   vbus->irq = irq;
 
-  virtio_dev = virtio_net_init(vbus, net, sim);
-
-  slirp_hostfwd(slirp_ptr, hostfwd.c_str(), NULL);
+  virtio_dev = virtio_net_init(vbus, net, queues, sim);
+  setup_common_options();
+  if (!pcap.empty() &&
+      virtio_net_set_capture(virtio_dev, pcap.c_str(), snaplen) < 0) {
+    printf("Virtio net device plugin INIT ERROR: could not create the pcap file `%s`\n", pcap.c_str());
+    exit(1);
+  }
 
-  vbus->addr += VIRTIO_SIZE;
+  if (driver == "user")
+    slirp_hostfwd((Slirp *) net->opaque, hostfwd.c_str(), NULL);
+  /* from now on, the backend is only accessed by the I/O thread */
+  io = net_io_start(net);
 
 }
 
 virtionet_t::~virtionet_t() {
+    if (io) net_io_stop(io);
+    if (virtio_dev) virtio_net_set_capture(virtio_dev, NULL, 0);
     if (irq) delete irq;
 }
 
+/* deliver the frames received by the I/O thread */
+void virtionet_t::poll() {
+    net_io_poll(io);
+    virtio_net_poll(virtio_dev);
+}
+
+void virtionet_t::tick(reg_t rtc_ticks) {
+    poll();
+    virtio_base_t::tick(rtc_ticks);
+}
+
+
+/* instances already generated and created, in the order of the
+   --device options */
+static int virtionet_nb_dts, virtionet_nb_devices;
 
 std::string virtionet_generate_dts(const sim_t* sim, const std::vector<std::string>& args) {
-  std::stringstream s;
-  s << std::hex 
-    << "    virtionet: virtio@" << VIRTIO_NET_BASE << " {\n"
-    << "      compatible = \"virtio,mmio\";\n"
-       "      interrupt-parent = <&PLIC>;\n"
-       "      interrupts = <" << std::dec << VIRTIO_NET_IRQ;
-    reg_t virtio9pbs = VIRTIO_NET_BASE;
-    reg_t virtio9psz = VIRTIO_SIZE;
-  s << std::hex << ">;\n"
-       "      reg = <0x" << (virtio9pbs >> 32) << " 0x" << (virtio9pbs & (uint32_t)-1) <<
-                   " 0x" << (virtio9psz >> 32) << " 0x" << (virtio9psz & (uint32_t)-1) << ">;\n"
-       "    };\n";
-    return s.str();
+  reg_t addr;
+  uint32_t irq;
+  int index = virtionet_nb_dts++;
+
+  virtio_mmio_placement(args, index, VIRTIO_NET_BASE, VIRTIO_NET_IRQ, &addr, &irq);
+  return virtio_mmio_generate_dts("virtionet", index, addr, irq);
 }
 
 virtionet_t* virtionet_parse_from_fdt(
   const void* fdt, const sim_t* sim, reg_t* base,
     std::vector<std::string> sargs)
 {
-  uint32_t blkdev_int_id;
-  if (fdt_parse_virtionet(fdt, base, &blkdev_int_id, "virtio,mmio") == 0) {
+  uint32_t irq;
+
+  virtio_mmio_placement(sargs, virtionet_nb_devices++, VIRTIO_NET_BASE, VIRTIO_NET_IRQ, base, &irq);
+  if (fdt_parse_virtio_mmio(fdt, *base, &irq) >= 0) {
     abstract_interrupt_controller_t* intctrl = sim->get_intctrl();
-    return new virtionet_t(sim, intctrl, blkdev_int_id, sargs);
+    return new virtionet_t(sim, intctrl, irq, sargs);
   } else {
     return nullptr;
   }
@@ -15,6 +15,12 @@
 #define VIRTIO_NET_BASE 0x50011000
 #define VIRTIO_NET_IRQ       5
 
+typedef struct NetIOThread NetIOThread;
+
+NetIOThread *net_io_start(EthernetDevice *net);
+void net_io_poll(NetIOThread *io);
+void net_io_stop(NetIOThread *io);
+
 class virtionet_t: public virtio_base_t {
 public:
   virtionet_t(
@@ -23,5 +29,9 @@ public:
       uint32_t interrupt_id,
       std::vector<std::string> sargs);
   ~virtionet_t();
+  void tick(reg_t rtc_ticks) override;
+protected:
+  void poll() override;
 private:
+  NetIOThread *io;
 };
\ No newline at end of file
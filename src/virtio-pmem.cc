@@ -0,0 +1,114 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include "virtio-pmem.h"
+#include "cutils.h"
+
+virtiopmem_t::virtiopmem_t(
+      const simif_t* sim,
+      abstract_interrupt_controller_t *intctrl,
+      uint32_t interrupt_id,
+      std::vector<std::string> sargs)
+  : virtio_base_t(sim, intctrl, interrupt_id, sargs), bs(NULL)
+{
+  std::map<std::string, std::string> argmap;
+
+  for (auto arg : sargs) {
+    size_t eq_idx = arg.find('=');
+    if (eq_idx != std::string::npos) {
+      argmap.insert(std::pair<std::string, std::string>(arg.substr(0, eq_idx), arg.substr(eq_idx+1)));
+    }
+  }
+
+  uint64_t base;
+  bool write_back = false;
+
+  auto it = argmap.find("img");
+  if (it == argmap.end()) {
+    printf("Virtio pmem device plugin INIT ERROR: `img` argument not specified.\n");
+    exit(1);
+  }
+  fname = it->second;
+
+  it = argmap.find("base");
+  if (it == argmap.end()) {
+    printf("Virtio pmem device plugin INIT ERROR: `base` argument not specified.\n"
+           "Please declare the region as memory of spike with -m and give its address.\n");
+    exit(1);
+  }
+  base = strtoull(it->second.c_str(), NULL, 0);
+
+  it = argmap.find("mode");
+  if (it != argmap.end()) {
+    if (it->second == "rw") {
+      write_back = true;
+    } else if (it->second != "snapshot") {
+      printf("Virtio pmem device plugin INIT ERROR: unknown mode `%s`.\n",
+             it->second.c_str());
+      exit(1);
+    }
+  }
+
+  int irq_num;
+  VIRTIOBusDef vbus_s, *vbus = &vbus_s;
+
+  // the image is only read, and written back by the flushes in rw mode
+  bs = block_device_init(fname.c_str(), write_back ? BF_MODE_RW : BF_MODE_RO,
+                         BF_CACHE_WRITETHROUGH);
+
+  memset(vbus, 0, sizeof(*vbus));
+  irq_num  = interrupt_id;
+  irq = new IRQSpike(intctrl, irq_num);
+  vbus->irq = irq;
+
+  virtio_dev = virtio_pmem_init(vbus, bs, base, write_back, sim);
+  if (!virtio_dev) {
+    printf("Virtio pmem device plugin INIT ERROR: could not load `%s` at 0x%" PRIx64 ".\n"
+           "The region must be memory of spike, as large as the image rounded up to 2 MiB.\n",
+           fname.c_str(), base);
+    exit(1);
+  }
+  setup_common_options();
+  setup_stats(virtio_pmem_dump_stats);
+}
+
+virtiopmem_t::~virtiopmem_t() {
+    /* the changes not flushed by the guest are kept, as with a mapping
+       of the image */
+    if (virtio_dev && virtio_pmem_flush(virtio_dev) < 0)
+        printf("Virtio pmem device plugin: could not write back `%s`.\n",
+               fname.c_str());
+    if (irq) delete irq;
+}
+
+
+/* instances already generated and created, in the order of the
+   --device options */
+static int virtiopmem_nb_dts, virtiopmem_nb_devices;
+
+std::string virtiopmem_generate_dts(const sim_t* sim, const std::vector<std::string>& args) {
+  reg_t addr;
+  uint32_t irq;
+  int index = virtiopmem_nb_dts++;
+
+  virtio_mmio_placement(args, index, VIRTIO_PMEM_BASE, VIRTIO_PMEM_IRQ, &addr, &irq);
+  return virtio_mmio_generate_dts("virtiopmem", index, addr, irq);
+}
+
+virtiopmem_t* virtiopmem_parse_from_fdt(
+  const void* fdt, const sim_t* sim, reg_t* base,
+    std::vector<std::string> sargs)
+{
+  uint32_t irq;
+
+  virtio_mmio_placement(sargs, virtiopmem_nb_devices++, VIRTIO_PMEM_BASE, VIRTIO_PMEM_IRQ, base, &irq);
+  if (fdt_parse_virtio_mmio(fdt, *base, &irq) >= 0) {
+    abstract_interrupt_controller_t* intctrl = sim->get_intctrl();
+    return new virtiopmem_t(sim, intctrl, irq, sargs);
+  } else {
+    return nullptr;
+  }
+}
+
+REGISTER_DEVICE(virtiopmem, virtiopmem_parse_from_fdt, virtiopmem_generate_dts);
@@ -0,0 +1,27 @@
+#include <sys/select.h>
+#include <riscv/abstract_device.h>
+#include <riscv/simif.h>
+#include <riscv/abstract_interrupt_controller.h>
+#include <riscv/mmu.h>
+#include <riscv/processor.h>
+#include <riscv/simif.h>
+#include <riscv/sim.h>
+#include <riscv/dts.h>
+#include <fdt/libfdt.h>
+#include "virtio.h"
+
+#define VIRTIO_PMEM_BASE 0x40015000
+#define VIRTIO_PMEM_IRQ       7
+
+class virtiopmem_t: public virtio_base_t {
+public:
+  virtiopmem_t(
+      const simif_t* sim,
+      abstract_interrupt_controller_t *intctrl,
+      uint32_t interrupt_id,
+      std::vector<std::string> sargs);
+  ~virtiopmem_t();
+private:
+  BlockDevice *bs;
+  std::string fname;
+};
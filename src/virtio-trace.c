@@ -0,0 +1,432 @@
+/*
+ * Convert the virtio device traces to the Chrome trace event format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <inttypes.h>
+
+#include "cutils.h"
+#include "virtio-trace.h"
+
+#define VIRTIO_NET_ID 1
+#define VIRTIO_BLK_ID 2
+#define VIRTIO_CONSOLE_ID 3
+#define VIRTIO_BALLOON_ID 5
+#define VIRTIO_9P_ID 9
+#define VIRTIO_FS_ID 26
+#define VIRTIO_PMEM_ID 27
+
+#define MAX_DESC 65536
+
+/* a buffer taken by the device, until it is used */
+typedef struct {
+    BOOL popped;
+    BOOL submitted;
+    int64_t pop_ns;
+    int64_t submit_ns;
+    uint64_t pop_ticks;
+    uint64_t submit_ticks;
+    uint32_t type; /* request type given at the submission */
+    BOOL has_type;
+    uint32_t read_size;
+    uint32_t write_size;
+    uint32_t bytes;
+} DescState;
+
+typedef struct {
+    DescState *desc; /* MAX_DESC entries */
+    int in_flight; /* popped, not used */
+    int backend; /* submitted, not completed */
+} QueueTrace;
+
+typedef struct {
+    const char *filename;
+    uint32_t device_id;
+    int pid;
+    QueueTrace *queues[256];
+} DeviceTrace;
+
+static FILE *out;
+static int64_t base_ns; /* time origin of the output */
+static uint64_t next_id = 1;
+static BOOL first_event = TRUE;
+
+static void fatal(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+static void fatal(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(stderr, "virtio-trace: ");
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+    exit(1);
+}
+
+static const char *get_9p_op_name(int id)
+{
+    static const struct {
+        uint8_t id;
+        const char *name;
+    } op_names[] = {
+        { 8, "statfs" }, { 12, "lopen" }, { 14, "lcreate" },
+        { 16, "symlink" }, { 18, "mknod" }, { 22, "readlink" },
+        { 24, "getattr" }, { 26, "setattr" }, { 30, "xattrwalk" },
+        { 40, "readdir" }, { 50, "fsync" }, { 52, "lock" },
+        { 54, "getlock" }, { 70, "link" }, { 72, "mkdir" },
+        { 74, "renameat" }, { 76, "unlinkat" }, { 100, "version" },
+        { 104, "attach" }, { 108, "flush" }, { 110, "walk" },
+        { 116, "read" }, { 118, "write" }, { 120, "clunk" },
+    };
+    int i;
+    for(i = 0; i < countof(op_names); i++) {
+        if (op_names[i].id == id)
+            return op_names[i].name;
+    }
+    return NULL;
+}
+
+static const char *get_fuse_op_name(int id)
+{
+    static const struct {
+        uint8_t id;
+        const char *name;
+    } op_names[] = {
+        { 1, "lookup" }, { 2, "forget" }, { 3, "getattr" },
+        { 4, "setattr" }, { 5, "readlink" }, { 6, "symlink" },
+        { 8, "mknod" }, { 9, "mkdir" }, { 10, "unlink" },
+        { 11, "rmdir" }, { 12, "rename" }, { 13, "link" },
+        { 14, "open" }, { 15, "read" }, { 16, "write" },
+        { 17, "statfs" }, { 18, "release" }, { 20, "fsync" },
+        { 25, "flush" }, { 26, "init" }, { 27, "opendir" },
+        { 28, "readdir" }, { 29, "releasedir" }, { 30, "fsyncdir" },
+        { 35, "create" }, { 36, "interrupt" }, { 38, "destroy" },
+        { 42, "batch_forget" }, { 44, "readdirplus" }, { 45, "rename2" },
+    };
+    int i;
+    for(i = 0; i < countof(op_names); i++) {
+        if (op_names[i].id == id)
+            return op_names[i].name;
+    }
+    return NULL;
+}
+
+static const char *get_device_name(uint32_t device_id)
+{
+    switch(device_id) {
+    case VIRTIO_NET_ID:
+        return "virtio-net";
+    case VIRTIO_BLK_ID:
+        return "virtio-blk";
+    case VIRTIO_9P_ID:
+        return "virtio-9p";
+    case VIRTIO_CONSOLE_ID:
+        return "virtio-console";
+    case VIRTIO_FS_ID:
+        return "virtio-fs";
+    case VIRTIO_BALLOON_ID:
+        return "virtio-balloon";
+    case VIRTIO_PMEM_ID:
+        return "virtio-pmem";
+    default:
+        return "virtio";
+    }
+}
+
+/* name of the request of a buffer */
+static void get_request_name(char *buf, int buf_size, DeviceTrace *d,
+                             int queue_idx, const DescState *ds)
+{
+    static const char *blk_names[] = {
+        "read", "write", "flush", "discard", "write_zeroes", "other",
+    };
+    static const char *balloon_names[] = { "inflate", "deflate", "report" };
+    const char *name;
+
+    name = NULL;
+    switch(d->device_id) {
+    case VIRTIO_BLK_ID:
+        if (ds->has_type && ds->type < countof(blk_names))
+            name = blk_names[ds->type];
+        break;
+    case VIRTIO_9P_ID:
+        if (ds->has_type)
+            name = get_9p_op_name(ds->type);
+        break;
+    case VIRTIO_FS_ID:
+        if (ds->has_type)
+            name = get_fuse_op_name(ds->type);
+        break;
+    case VIRTIO_NET_ID:
+    case VIRTIO_CONSOLE_ID:
+        name = (queue_idx & 1) ? "tx" : "rx";
+        break;
+    case VIRTIO_BALLOON_ID:
+        if (queue_idx < countof(balloon_names))
+            name = balloon_names[queue_idx];
+        break;
+    case VIRTIO_PMEM_ID:
+        if (ds->has_type && ds->type == 0)
+            name = "flush";
+        break;
+    }
+    if (name)
+        snprintf(buf, buf_size, "%s", name);
+    else if (ds->has_type)
+        snprintf(buf, buf_size, "type %u", ds->type);
+    else
+        snprintf(buf, buf_size, "request");
+}
+
+static double get_ts(int64_t ns)
+{
+    return (double)(ns - base_ns) / 1000.0;
+}
+
+/* start a JSON event with the common fields */
+static void event_start(const char *ph, const char *name, const char *cat,
+                        DeviceTrace *d, int queue_idx, int64_t ns)
+{
+    fprintf(out, "%s\n{\"ph\":\"%s\",\"name\":\"%s\",\"cat\":\"%s\","
+            "\"pid\":%d,\"tid\":%d,\"ts\":%.3f",
+            first_event ? "" : ",", ph, name, cat, d->pid, queue_idx,
+            get_ts(ns));
+    first_event = FALSE;
+}
+
+static void counter_event(DeviceTrace *d, int queue_idx, QueueTrace *q,
+                          int64_t ns)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "queue %d depth", queue_idx);
+    event_start("C", name, "depth", d, queue_idx, ns);
+    fprintf(out, ",\"args\":{\"device\":%d,\"backend\":%d}}",
+            q->in_flight, q->backend);
+}
+
+static void metadata_event(const char *type, DeviceTrace *d, int tid,
+                           const char *name)
+{
+    fprintf(out, "%s\n{\"ph\":\"M\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,"
+            "\"args\":{\"name\":\"%s\"}}",
+            first_event ? "" : ",", type, d->pid, tid, name);
+    first_event = FALSE;
+}
+
+/* async begin/end pair, emitted once the end is known */
+static void span_event(const char *name, const char *cat, DeviceTrace *d,
+                       int queue_idx, int desc_idx, int64_t start_ns,
+                       int64_t end_ns, uint64_t start_ticks,
+                       uint64_t end_ticks, const char *args)
+{
+    uint64_t id = next_id++;
+    event_start("b", name, cat, d, queue_idx, start_ns);
+    fprintf(out, ",\"id\":\"0x%" PRIx64 "\",\"args\":{\"desc\":%d,"
+            "\"ticks\":%" PRIu64 "%s}}", id, desc_idx, start_ticks, args);
+    event_start("e", name, cat, d, queue_idx, end_ns);
+    fprintf(out, ",\"id\":\"0x%" PRIx64 "\",\"args\":{\"ticks\":%" PRIu64
+            "}}", id, end_ticks);
+}
+
+static QueueTrace *get_queue(DeviceTrace *d, int queue_idx)
+{
+    QueueTrace *q = d->queues[queue_idx];
+    char name[32];
+
+    if (!q) {
+        q = mallocz(sizeof(*q));
+        q->desc = mallocz(sizeof(q->desc[0]) * MAX_DESC);
+        d->queues[queue_idx] = q;
+        if (queue_idx == 0xff)
+            snprintf(name, sizeof(name), "config");
+        else
+            snprintf(name, sizeof(name), "queue %d", queue_idx);
+        metadata_event("thread_name", d, queue_idx, name);
+    }
+    return q;
+}
+
+static void convert_event(DeviceTrace *d, const uint8_t *buf)
+{
+    int64_t ns = get_le64(buf + VTRACE_E_HOST_NS);
+    uint64_t ticks = get_le64(buf + VTRACE_E_TICKS);
+    int type = buf[VTRACE_E_TYPE];
+    int queue_idx = buf[VTRACE_E_QUEUE];
+    int desc_idx = get_le16(buf + VTRACE_E_DESC);
+    uint32_t arg0 = get_le32(buf + VTRACE_E_ARG0);
+    uint32_t arg1 = get_le32(buf + VTRACE_E_ARG1);
+    QueueTrace *q = get_queue(d, queue_idx);
+    DescState *ds = &q->desc[desc_idx];
+    char name[32], args[96];
+
+    switch(type) {
+    case VTRACE_EV_NOTIFY:
+        event_start("i", "notify", "notify", d, queue_idx, ns);
+        fprintf(out, ",\"s\":\"t\",\"args\":{\"avail_idx\":%u,"
+                "\"ticks\":%" PRIu64 "}}", arg0, ticks);
+        break;
+    case VTRACE_EV_IRQ:
+        event_start("i", "irq", "irq", d, queue_idx, ns);
+        fprintf(out, ",\"s\":\"t\",\"args\":{\"status\":%u,"
+                "\"ticks\":%" PRIu64 "}}", arg0, ticks);
+        break;
+    case VTRACE_EV_POP:
+        if (ds->popped)
+            q->in_flight--; /* the end of the previous one was lost */
+        memset(ds, 0, sizeof(*ds));
+        ds->popped = TRUE;
+        ds->pop_ns = ns;
+        ds->pop_ticks = ticks;
+        ds->read_size = arg0;
+        ds->write_size = arg1;
+        q->in_flight++;
+        counter_event(d, queue_idx, q, ns);
+        break;
+    case VTRACE_EV_SUBMIT:
+        if (ds->submitted)
+            q->backend--;
+        ds->submitted = TRUE;
+        ds->submit_ns = ns;
+        ds->submit_ticks = ticks;
+        ds->type = arg0;
+        ds->has_type = TRUE;
+        ds->bytes = arg1;
+        q->backend++;
+        counter_event(d, queue_idx, q, ns);
+        break;
+    case VTRACE_EV_COMPLETE:
+        if (!ds->submitted)
+            break;
+        ds->submitted = FALSE;
+        q->backend--;
+        get_request_name(name, sizeof(name), d, queue_idx, ds);
+        snprintf(args, sizeof(args), ",\"bytes\":%u,\"status\":%d",
+                 ds->bytes, (int)arg0);
+        span_event(name, "backend", d, queue_idx, desc_idx, ds->submit_ns, ns,
+                   ds->submit_ticks, ticks, args);
+        counter_event(d, queue_idx, q, ns);
+        break;
+    case VTRACE_EV_USED:
+        if (!ds->popped)
+            break;
+        ds->popped = FALSE;
+        q->in_flight--;
+        get_request_name(name, sizeof(name), d, queue_idx, ds);
+        snprintf(args, sizeof(args), ",\"read_size\":%u,\"write_size\":%u,"
+                 "\"used_len\":%u", ds->read_size, ds->write_size, arg0);
+        span_event(name, "request", d, queue_idx, desc_idx, ds->pop_ns, ns,
+                   ds->pop_ticks, ticks, args);
+        counter_event(d, queue_idx, q, ns);
+        break;
+    default:
+        break;
+    }
+}
+
+static FILE *open_trace(const char *filename, uint8_t *h)
+{
+    FILE *f;
+
+    f = fopen(filename, "rb");
+    if (!f) {
+        perror(filename);
+        exit(1);
+    }
+    if (fread(h, 1, VTRACE_HEADER_SIZE, f) != VTRACE_HEADER_SIZE ||
+        memcmp(h + VTRACE_H_MAGIC, VTRACE_MAGIC, 8) != 0)
+        fatal("%s: not a virtio trace", filename);
+    if (get_le32(h + VTRACE_H_VERSION) > VTRACE_VERSION)
+        fatal("%s: unsupported trace version %u", filename,
+              get_le32(h + VTRACE_H_VERSION));
+    return f;
+}
+
+static void help(void)
+{
+    printf("usage: virtio-trace output.json trace...\n"
+           "\n"
+           "Convert the traces of the virtio devices (trace= option) of a\n"
+           "run to a single JSON file for chrome://tracing or Perfetto.\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    uint8_t h[VTRACE_HEADER_SIZE], buf[VTRACE_EVENT_SIZE];
+    DeviceTrace *d;
+    FILE *f;
+    char name[256];
+    uint64_t nb_events, nb_lost;
+    int64_t start_ns;
+    int i, nb_files;
+
+    if (argc < 3)
+        help();
+    nb_files = argc - 2;
+
+    /* the traces of a run share the same clock */
+    base_ns = INT64_MAX;
+    for(i = 0; i < nb_files; i++) {
+        f = open_trace(argv[i + 2], h);
+        start_ns = get_le64(h + VTRACE_H_START_NS);
+        if (start_ns < base_ns)
+            base_ns = start_ns;
+        fclose(f);
+    }
+
+    out = fopen(argv[1], "w");
+    if (!out) {
+        perror(argv[1]);
+        exit(1);
+    }
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for(i = 0; i < nb_files; i++) {
+        d = mallocz(sizeof(*d));
+        d->filename = argv[i + 2];
+        d->pid = i + 1;
+        f = open_trace(d->filename, h);
+        d->device_id = get_le32(h + VTRACE_H_DEVICE_ID);
+        snprintf(name, sizeof(name), "%s %s", get_device_name(d->device_id),
+                 d->filename);
+        metadata_event("process_name", d, 0, name);
+
+        nb_events = 0;
+        while (fread(buf, 1, VTRACE_EVENT_SIZE, f) == VTRACE_EVENT_SIZE) {
+            convert_event(d, buf);
+            nb_events++;
+        }
+        fclose(f);
+        nb_lost = get_le64(h + VTRACE_H_NB_LOST);
+        if (get_le64(h + VTRACE_H_NB_EVENTS) != nb_events)
+            fprintf(stderr, "%s: incomplete trace\n", d->filename);
+        if (nb_lost > 0)
+            fprintf(stderr, "%s: %" PRIu64 " events lost\n", d->filename,
+                    nb_lost);
+        printf("%s: %s, %" PRIu64 " events\n", d->filename,
+               get_device_name(d->device_id), nb_events);
+    }
+    fprintf(out, "\n]}\n");
+    fclose(out);
+    return 0;
+}
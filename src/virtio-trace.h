@@ -0,0 +1,63 @@
+/*
+ * Binary trace format of the virtio device events
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef VIRTIO_TRACE_H
+#define VIRTIO_TRACE_H
+
+/* A trace file holds the events of one device: a header
+   (VTRACE_HEADER_SIZE bytes) followed by fixed size events in the
+   order they were recorded. The host times of all the devices come
+   from the same clock (CLOCK_MONOTONIC), so the traces of a run can
+   be merged. All the values are little endian. */
+
+#define VTRACE_MAGIC "SPIKEVTR"
+#define VTRACE_VERSION 1
+#define VTRACE_HEADER_SIZE 64
+
+/* header */
+#define VTRACE_H_MAGIC      0
+#define VTRACE_H_VERSION    8 /* le32 */
+#define VTRACE_H_DEVICE_ID 12 /* le32, virtio device ID */
+#define VTRACE_H_START_NS  16 /* le64, host time when the trace started */
+#define VTRACE_H_NB_EVENTS 24 /* le64, set when the trace is closed */
+#define VTRACE_H_NB_LOST   32 /* le64, events the writer could not keep up with */
+
+/* event */
+#define VTRACE_E_HOST_NS  0 /* le64, host time in ns */
+#define VTRACE_E_TICKS    8 /* le64, RTC ticks of spike seen by the device */
+#define VTRACE_E_TYPE    16 /* u8, VTRACE_EV_x */
+#define VTRACE_E_QUEUE   17 /* u8 */
+#define VTRACE_E_DESC    18 /* le16, head descriptor of the buffer */
+#define VTRACE_E_ARG0    20 /* le32 */
+#define VTRACE_E_ARG1    24 /* le32 */
+#define VTRACE_EVENT_SIZE 32
+
+/* event types and their arguments */
+#define VTRACE_EV_NOTIFY   0 /* arg0: last available index seen by the device */
+#define VTRACE_EV_POP      1 /* arg0: read size, arg1: write size */
+#define VTRACE_EV_SUBMIT   2 /* to the backend. arg0: request type, arg1: bytes */
+#define VTRACE_EV_COMPLETE 3 /* by the backend. arg0: status (< 0 or 1 if
+                                failed), arg1: reply bytes */
+#define VTRACE_EV_USED     4 /* published. arg0: used length */
+#define VTRACE_EV_IRQ      5 /* arg0: interrupt status. queue: 0xff for a
+                                configuration change */
+
+#endif /* VIRTIO_TRACE_H */
@@ -27,10 +27,34 @@
 #include <inttypes.h>
 #include <assert.h>
 #include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sched.h>
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define CONFIG_IO_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 #include "virtio.h"
+#include "dma.h"
 #include "cutils.h"
 #include "fs.h"
 #include "list.h"
+#include "lz4.h"
+#include "cimg.h"
+#include "checkpoint.h"
+#include "device_sched.h"
+#include "virtio-trace.h"
 
 // #define DEBUG_VIRTIO
 
@@ -63,35 +87,110 @@
 #define VIRTIO_MMIO_QUEUE_USED_HIGH	0x0a4
 #define VIRTIO_MMIO_CONFIG_GENERATION	0x0fc
 #define VIRTIO_MMIO_CONFIG		0x100
-/* The following interface is not implemented yet,
- * which were added in VirtIO v1.2 */
+/* shared memory regions, added in VirtIO v1.2 */
 #define VIRTIO_MMIO_SHM_SEL         0x0ac
 #define VIRTIO_MMIO_SHM_LEN_LOW     0x0b0
 #define VIRTIO_MMIO_SHM_LEN_HIGH    0x0b4
 #define VIRTIO_MMIO_SHM_BASE_LOW    0x0b8
 #define VIRTIO_MMIO_SHM_BASE_HIGH   0x0bc
+/* The following interface is not implemented yet,
+ * which was added in VirtIO v1.2 */
 #define VIRTIO_MMIO_QUEUE_RESET     0x0c0
 
-#define MAX_QUEUE 8
+#define MAX_QUEUE 17 /* NET_MAX_QUEUE_PAIRS pairs and the control queue */
 #define MAX_CONFIG_SPACE_SIZE 256
 #define MAX_QUEUE_NUM 16
+#define MAX_SHM_REGION 4
+
+#define MAX_9P_MSIZE (512 * 1024)
+#define DEFAULT_9P_MSIZE 8192
+
+/* guest buffer fragment, never crosses a guest page */
+typedef struct {
+    uint8_t *ptr; /* host pointer, NULL if only reachable through the MMU */
+    virtio_phys_addr_t addr;
+    uint32_t len;
+} VIRTIOSeg;
+
+/* scatter-gather list of a descriptor chain. It is built once when the
+   request is taken from the avail ring and stays valid until the
+   descriptor is consumed. */
+typedef struct {
+    VIRTIOSeg *seg;
+    int nb_segs; /* device readable segments first, then writable ones */
+    int nb_read_segs;
+    int max_segs;
+    int read_size;
+    int write_size;
+    int nb_descs; /* ring slots used by the buffer (packed ring only) */
+    /* position of the last access in each direction (0 = read, 1 =
+       write) so that sequential accesses do not rescan the list */
+    int cur_seg[2];
+    int cur_pos[2];
+} VIRTIOIOVec;
 
-#define MAX_9P_MSIZE 0xE000
+typedef struct {
+    uint32_t id;
+    uint32_t len;
+} VIRTIOUsedElem;
 
 typedef struct {
     uint32_t ready; /* 0 or 1 */
     uint32_t num;
+    /* split ring: free running index in the avail ring. packed ring:
+       position of the next descriptor in the descriptor ring */
     uint16_t last_avail_idx;
     virtio_phys_addr_t desc_addr;
     virtio_phys_addr_t avail_addr;
     virtio_phys_addr_t used_addr;
     BOOL manual_recv; /* if TRUE, the device_recv() callback is not called */
+    VIRTIOIOVec iov[MAX_QUEUE_NUM]; /* indexed by head descriptor */
+    /* packed ring only */
+    BOOL avail_wrap_counter;
+    BOOL used_wrap_counter;
+    int pending_descs; /* ring slots of the buffer returned by the last peek */
+    /* used elements not yet published to the guest */
+    BOOL batch_used; /* if TRUE, the used elements are published by
+                        virtio_queue_flush_used() */
+    int nb_used_pending;
+    VIRTIOUsedElem used_pending[MAX_QUEUE_NUM];
+    /* interrupt suppression */
+    uint16_t used_idx; /* shadow of used->idx, next used position for packed */
+    uint16_t signalled_used; /* used->idx when the guest was last signalled */
+    BOOL signalled_used_valid;
+    int irq_pending; /* completions not signalled yet */
+    uint64_t irq_pending_tick; /* tick of the first pending completion */
+    device_timer_t irq_timer; /* irq_max_delay deadline */
+    /* polling mode */
+    BOOL polling; /* the driver notifications are suppressed */
+    uint64_t poll_last_tick; /* tick of the last buffer found by polling */
 } QueueState;
 
 #define VRING_DESC_F_NEXT	1
 #define VRING_DESC_F_WRITE	2
 #define VRING_DESC_F_INDIRECT	4
 
+#define VRING_AVAIL_F_NO_INTERRUPT 1
+#define VRING_USED_F_NO_NOTIFY     1
+
+/* packed ring descriptor flags */
+#define VRING_PACKED_DESC_F_AVAIL (1 << 7)
+#define VRING_PACKED_DESC_F_USED  (1 << 15)
+
+/* packed ring event suppression flags */
+#define VRING_PACKED_EVENT_FLAG_ENABLE  0
+#define VRING_PACKED_EVENT_FLAG_DISABLE 1
+#define VRING_PACKED_EVENT_FLAG_DESC    2
+
+/* device status bits */
+#define VIRTIO_STATUS_DRIVER_OK 4
+
+/* feature bits common to all devices */
+#define VIRTIO_RING_F_INDIRECT_DESC 28
+#define VIRTIO_RING_F_EVENT_IDX     29
+#define VIRTIO_F_VERSION_1          32
+#define VIRTIO_F_RING_PACKED        34
+
 // #define OPT_MEMCPY_RAM
 
 typedef struct {
@@ -101,6 +200,13 @@ typedef struct {
     uint16_t next;
 } VIRTIODesc;
 
+typedef struct {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id; /* buffer id */
+    uint16_t flags; /* VRING_DESC_F_x and VRING_PACKED_DESC_F_x */
+} VIRTIOPackedDesc;
+
 
 /* return < 0 to stop the notification (it must be manually restarted
    later), 0 if OK */
@@ -111,27 +217,69 @@ typedef int VIRTIODeviceRecvFunc(VIRTIODevice *s1, int queue_idx,
 /* return NULL if no RAM at this address. The mapping is valid for one page */
 typedef uint8_t *VIRTIOGetRAMPtrFunc(VIRTIODevice *s, virtio_phys_addr_t paddr, BOOL is_rw);
 
+/* a window of guest physical memory shared between the device and the
+   driver (e.g. to map the host files). It is RAM of the simulator, so
+   the guest accesses it with plain loads and stores. */
+typedef struct {
+    virtio_phys_addr_t base;
+    uint64_t len; /* 0 if the region does not exist */
+} VIRTIOShmRegion;
+
 struct VIRTIODevice {
     const simif_t* sim;
     /* MMIO only */
     IRQSpike* irq;
+    VIRTIOGetRAMPtrFunc *get_ram_ptr;
     int debug;
 
     uint32_t int_status;
     uint32_t status;
     uint32_t device_features_sel;
+    uint32_t driver_features_sel;
+    uint64_t driver_features;
     uint32_t queue_sel; /* currently selected queue */
     QueueState queue[MAX_QUEUE];
+    uint32_t shm_sel; /* currently selected shared memory region */
 
     /* device specific */
     uint32_t device_id;
     uint32_t vendor_id;
-    uint32_t device_features;
+    uint64_t device_features;
     VIRTIODeviceRecvFunc *device_recv;
+    /* called at the end of a queue notification, after all the
+       available requests were received. Can be NULL. */
+    void (*device_notify_end)(VIRTIODevice *s, int queue_idx);
+    void (*device_reset)(VIRTIODevice *s); /* can be NULL */
     void (*config_write)(VIRTIODevice *s); /* called after the config
                                               is written */
+    /* device state, see virtio_save_state(). Can be NULL. */
+    BOOL (*device_busy)(VIRTIODevice *s);
+    int (*device_save)(VIRTIODevice *s, device_state_writer_t *w);
+    int (*device_load)(VIRTIODevice *s, device_state_reader_t *r);
     uint32_t config_space_size; /* in bytes, must be multiple of 4 */
     uint8_t config_space[MAX_CONFIG_SPACE_SIZE];
+    VIRTIOShmRegion shm[MAX_SHM_REGION];
+
+    /* interrupt coalescing: signal the guest after irq_max_batch
+       completions or irq_max_delay ticks, whichever comes first */
+    int irq_max_batch;
+    int irq_max_delay;
+    uint32_t irq_pending_mask; /* queues with pending completions */
+    uint64_t ticks;
+    /* deadlines of the transport and of the device, advanced by
+       virtio_tick() */
+    device_sched_t sched;
+
+    /* polling mode: the notifications are only recorded and the queues
+       are processed by virtio_tick(). A queue with new buffers is
+       polled with the notifications suppressed until it stays empty
+       for poll_idle_ticks ticks. 0 = the notifications are processed
+       synchronously. */
+    int poll_idle_ticks;
+    uint32_t notify_pending_mask; /* queues notified since the last tick */
+    device_timer_t poll_timer;
+
+    struct VIRTIOTrace *trace; /* NULL if the events are not traced */
 };
 
 #define SECTOR_SIZE 512
@@ -144,1981 +292,9231 @@ static int64_t bf_get_sector_count(BlockDevice *bs)
 
 //#define DUMP_BLOCK_READ
 
-static int bf_read_async(BlockDevice *bs,
-                         uint64_t sector_num, uint8_t *buf, int n,
-                         BlockDeviceCompletionFunc *cb, VIRTIODevice *opaque)
+/* alignment of the buffers and transfers when using O_DIRECT */
+#define BF_DIRECT_ALIGN 512
+
+static int iov_size(const struct iovec *iov, int iovcnt)
 {
-    BlockDeviceFile *bf = bs->opaque;
-    //    printf("bf_read_async: sector_num=%" PRId64 " n=%d\n", sector_num, n);
-#ifdef DUMP_BLOCK_READ
-    {
-        static FILE *f;
-        if (!f)
-            f = fopen("/tmp/read_sect.txt", "wb");
-        fprintf(f, "%" PRId64 " %d\n", sector_num, n);
+    int i, len = 0;
+    for(i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    return len;
+}
+
+static BOOL iov_is_aligned(const struct iovec *iov, int iovcnt, int align)
+{
+    int i;
+    for(i = 0; i < iovcnt; i++) {
+        if (((uintptr_t)iov[i].iov_base | iov[i].iov_len) & (align - 1))
+            return FALSE;
     }
-#endif
-    if (!bf->f)
-        return -1;
-    if (bf->mode == BF_MODE_SNAPSHOT) {
-        int i;
-        for(i = 0; i < n; i++) {
-            if (!bf->sector_table[sector_num]) {
-                fseek(bf->f, sector_num * SECTOR_SIZE, SEEK_SET);
-                fread(buf, 1, SECTOR_SIZE, bf->f);
-            } else {
-                memcpy(buf, bf->sector_table[sector_num], SECTOR_SIZE);
-            }
-            sector_num++;
-            buf += SECTOR_SIZE;
-        }
-    } else {
-        fseek(bf->f, sector_num * SECTOR_SIZE, SEEK_SET);
-        fread(buf, 1, n * SECTOR_SIZE, bf->f);
+    return TRUE;
+}
+
+static void iov_from_buf(const struct iovec *iov, int iovcnt,
+                         const uint8_t *buf)
+{
+    int i;
+    for(i = 0; i < iovcnt; i++) {
+        memcpy(iov[i].iov_base, buf, iov[i].iov_len);
+        buf += iov[i].iov_len;
     }
-    /* synchronous read */
-        // printf("bf_read_async successfully finished.\n");
-    return 0;
 }
 
-static int bf_write_async(BlockDevice *bs,
-                          uint64_t sector_num, const uint8_t *buf, int n,
-                          BlockDeviceCompletionFunc *cb, VIRTIODevice *opaque)
+static void iov_to_buf(uint8_t *buf, const struct iovec *iov, int iovcnt)
 {
-    BlockDeviceFile *bf = bs->opaque;
-    int ret;
+    int i;
+    for(i = 0; i < iovcnt; i++) {
+        memcpy(buf, iov[i].iov_base, iov[i].iov_len);
+        buf += iov[i].iov_len;
+    }
+}
 
-    switch(bf->mode) {
-    case BF_MODE_RO:
-        ret = -1; /* error */
-        break;
-    case BF_MODE_RW:
-        fseek(bf->f, sector_num * SECTOR_SIZE, SEEK_SET);
-        fwrite(buf, 1, n * SECTOR_SIZE, bf->f);
-        ret = 0;
-        break;
-    case BF_MODE_SNAPSHOT:
-        {
-            int i;
-            if ((sector_num + n) > bf->nb_sectors)
-                return -1;
-            for(i = 0; i < n; i++) {
-                if (!bf->sector_table[sector_num]) {
-                    bf->sector_table[sector_num] = (uint8_t*)malloc(SECTOR_SIZE);
-                }
-                memcpy(bf->sector_table[sector_num], buf, SECTOR_SIZE);
-                sector_num++;
-                buf += SECTOR_SIZE;
-            }
-            ret = 0;
+/* copy len bytes to the iovec array, starting at byte offset */
+static void iov_from_buf_at(const struct iovec *iov, int iovcnt, size_t offset,
+                            const uint8_t *buf, size_t len)
+{
+    size_t l;
+    int i;
+    for(i = 0; i < iovcnt && len > 0; i++) {
+        if (offset >= iov[i].iov_len) {
+            offset -= iov[i].iov_len;
+            continue;
         }
-        break;
-    default:
-        abort();
+        l = iov[i].iov_len - offset;
+        if (l > len)
+            l = len;
+        memcpy((uint8_t *)iov[i].iov_base + offset, buf, l);
+        buf += l;
+        len -= l;
+        offset = 0;
     }
+}
 
-    return ret;
+static void iov_memset_at(const struct iovec *iov, int iovcnt, size_t offset,
+                          int c, size_t len)
+{
+    size_t l;
+    int i;
+    for(i = 0; i < iovcnt && len > 0; i++) {
+        if (offset >= iov[i].iov_len) {
+            offset -= iov[i].iov_len;
+            continue;
+        }
+        l = iov[i].iov_len - offset;
+        if (l > len)
+            l = len;
+        memset((uint8_t *)iov[i].iov_base + offset, c, l);
+        len -= l;
+        offset = 0;
+    }
 }
 
-BlockDevice *block_device_init(const char *filename,
-                                      BlockDeviceModeEnum mode)
+/* compressed image (.cimg, see cimg.h): read only, the chunks are
+   decompressed on demand into a bounded LRU chunk cache */
+
+#define BF_CIMG_DEFAULT_CACHE_MB 32
+#define BF_CIMG_NO_CHUNK UINT64_MAX /* unused cache entry */
+
+typedef struct BlockDeviceCImgChunk {
+    struct list_head link; /* LRU list, most recent first */
+    struct BlockDeviceCImgChunk *hash_next;
+    uint64_t chunk_idx; /* BF_CIMG_NO_CHUNK if not in the hash table */
+    uint8_t *data; /* chunk_size bytes */
+} BlockDeviceCImgChunk;
+
+struct BlockDeviceCImg {
+    int fd; /* header and index */
+    int pack_fd; /* stored chunks, same as fd if they are in the image */
+    int chunk_bits;
+    uint64_t image_size;
+    uint64_t nb_chunks;
+    uint8_t *map; /* header and index, shared with the other users */
+    size_t map_size;
+    const uint8_t *index;
+    /* protects the chunk cache, which is also used by the worker
+       threads */
+    pthread_mutex_t lock;
+    int max_chunks;
+    int nb_chunks_alloc;
+    struct list_head lru;
+    BlockDeviceCImgChunk **hash;
+    int hash_mask;
+    uint8_t *comp_buf; /* compressed chunk */
+};
+
+static inline int bf_cimg_hash(BlockDeviceCImg *ci, uint64_t chunk_idx)
 {
-    BlockDevice *bs;
-    BlockDeviceFile *bf;
-    int64_t file_size;
-    FILE *f;
-    const char *mode_str;
+    return (chunk_idx * 0x9e3779b97f4a7c15ULL >> 32) & ci->hash_mask;
+}
 
-    if (mode == BF_MODE_RW) {
-        mode_str = "r+b";
-    } else {
-        mode_str = "rb";
+/* size the chunk cache for size_mb MiB of decompressed data */
+static void bf_cimg_set_cache_size(BlockDeviceCImg *ci, int size_mb)
+{
+    BlockDeviceCImgChunk *c;
+    struct list_head *el, *el1;
+    int hash_size, h;
+
+    ci->max_chunks = ((int64_t)size_mb << 20) >> ci->chunk_bits;
+    if (ci->max_chunks < 4)
+        ci->max_chunks = 4;
+    /* free the least recently used chunks above the limit */
+    list_for_each_prev_safe(el, el1, &ci->lru) {
+        if (ci->nb_chunks_alloc <= ci->max_chunks)
+            break;
+        c = list_entry(el, BlockDeviceCImgChunk, link);
+        list_del(&c->link);
+        free(c->data);
+        free(c);
+        ci->nb_chunks_alloc--;
     }
-    
-    f = fopen(filename, mode_str);
-    if (!f) {
+    for(hash_size = 1; hash_size < ci->max_chunks * 2; hash_size <<= 1)
+        continue;
+    free(ci->hash);
+    ci->hash = (BlockDeviceCImgChunk **)mallocz(sizeof(ci->hash[0]) *
+                                                hash_size);
+    ci->hash_mask = hash_size - 1;
+    list_for_each(el, &ci->lru) {
+        c = list_entry(el, BlockDeviceCImgChunk, link);
+        if (c->chunk_idx == BF_CIMG_NO_CHUNK)
+            continue;
+        h = bf_cimg_hash(ci, c->chunk_idx);
+        c->hash_next = ci->hash[h];
+        ci->hash[h] = c;
+    }
+}
+
+/* return the cimg state or NULL if the file is not a compressed
+   image */
+static BlockDeviceCImg *bf_cimg_open(const char *filename)
+{
+    BlockDeviceCImg *ci;
+    uint8_t h[CIMG_HEADER_SIZE];
+    char pack_name[CIMG_PACK_NAME_SIZE], *path;
+    const char *p;
+    uint64_t index_offset;
+    void *map;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (pread(fd, h, sizeof(h), 0) != sizeof(h) ||
+        memcmp(h + CIMG_H_MAGIC, CIMG_MAGIC, 8) != 0) {
+        close(fd);
+        return NULL;
+    }
+    ci = (BlockDeviceCImg *)mallocz(sizeof(*ci));
+    ci->fd = fd;
+    ci->chunk_bits = get_le32(h + CIMG_H_CHUNK_BITS);
+    ci->image_size = get_le64(h + CIMG_H_IMAGE_SIZE);
+    ci->nb_chunks = get_le64(h + CIMG_H_NB_CHUNKS);
+    index_offset = get_le64(h + CIMG_H_INDEX_OFFSET);
+    if (get_le32(h + CIMG_H_VERSION) != CIMG_VERSION ||
+        ci->chunk_bits < CIMG_MIN_CHUNK_BITS ||
+        ci->chunk_bits > CIMG_MAX_CHUNK_BITS ||
+        ci->nb_chunks != (ci->image_size + (1 << ci->chunk_bits) - 1) >>
+        ci->chunk_bits ||
+        index_offset < CIMG_HEADER_SIZE) {
+        fprintf(stderr, "%s: unsupported compressed image\n", filename);
+        exit(1);
+    }
+    ci->map_size = index_offset + ci->nb_chunks * CIMG_ENTRY_SIZE;
+    map = mmap(NULL, ci->map_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
         perror(filename);
         exit(1);
     }
-    fseek(f, 0, SEEK_END);
-    file_size = ftello(f);
+    ci->map = (uint8_t *)map;
+    ci->index = ci->map + index_offset;
 
-    bs = (BlockDevice*)mallocz(sizeof(*bs));
-    bf = (BlockDeviceFile*)mallocz(sizeof(*bf));
+    memcpy(pack_name, h + CIMG_H_PACK_NAME, CIMG_PACK_NAME_SIZE);
+    pack_name[CIMG_PACK_NAME_SIZE - 1] = '\0';
+    if (pack_name[0] == '\0') {
+        ci->pack_fd = fd;
+    } else {
+        p = strrchr(filename, '/');
+        if (pack_name[0] == '/' || !p) {
+            path = strdup(pack_name);
+        } else {
+            path = (char *)malloc(p - filename + 1 + strlen(pack_name) + 1);
+            memcpy(path, filename, p - filename + 1);
+            strcpy(path + (p - filename + 1), pack_name);
+        }
+        ci->pack_fd = open(path, O_RDONLY);
+        if (ci->pack_fd < 0) {
+            perror(path);
+            exit(1);
+        }
+        free(path);
+    }
 
-    bf->mode = mode;
-    bf->nb_sectors = file_size / 512;
-    bf->f = f;
+    pthread_mutex_init(&ci->lock, NULL);
+    init_list_head(&ci->lru);
+    ci->comp_buf = (uint8_t *)malloc(1 << ci->chunk_bits);
+    bf_cimg_set_cache_size(ci, BF_CIMG_DEFAULT_CACHE_MB);
+    return ci;
+}
 
-    if (mode == BF_MODE_SNAPSHOT) {
-        bf->sector_table = (uint8_t**)mallocz(sizeof(bf->sector_table[0]) *
-                                   bf->nb_sectors);
+/* return the decompressed chunk, reading it if it is not cached. Must
+   be called with ci->lock held. Return NULL if error. */
+static const uint8_t *bf_cimg_get_chunk(BlockDeviceCImg *ci,
+                                        uint64_t chunk_idx)
+{
+    BlockDeviceCImgChunk *c, **pc;
+    const uint8_t *e;
+    int chunk_size, size, h;
+    ssize_t ret;
+
+    h = bf_cimg_hash(ci, chunk_idx);
+    for(c = ci->hash[h]; c; c = c->hash_next) {
+        if (c->chunk_idx == chunk_idx) {
+            list_del(&c->link);
+            list_add(&c->link, &ci->lru);
+            return c->data;
+        }
     }
-    
-    bs->opaque = bf;
-    bs->get_sector_count = bf_get_sector_count;
-    bs->read_async = bf_read_async;
-    bs->write_async = bf_write_async;
-    return bs;
-}
 
-static uint32_t virtio_mmio_read(VIRTIODevice *opaque, uint32_t offset1, int size_log2);
-static void virtio_mmio_write(VIRTIODevice *opaque, uint32_t offset,
-                              uint32_t val, int size_log2);
+    chunk_size = 1 << ci->chunk_bits;
+    if (ci->nb_chunks_alloc < ci->max_chunks) {
+        /* the cache memory is only allocated when used */
+        c = (BlockDeviceCImgChunk *)mallocz(sizeof(*c));
+        c->data = (uint8_t *)malloc(chunk_size);
+        c->chunk_idx = BF_CIMG_NO_CHUNK;
+        ci->nb_chunks_alloc++;
+    } else {
+        c = list_entry(ci->lru.prev, BlockDeviceCImgChunk, link);
+        list_del(&c->link);
+    }
+    if (c->chunk_idx != BF_CIMG_NO_CHUNK) {
+        for(pc = &ci->hash[bf_cimg_hash(ci, c->chunk_idx)]; *pc != c;
+            pc = &(*pc)->hash_next)
+            continue;
+        *pc = c->hash_next;
+    }
 
-static void virtio_reset(VIRTIODevice *s)
+    e = ci->index + chunk_idx * CIMG_ENTRY_SIZE;
+    size = get_le32(e + CIMG_E_SIZE);
+    switch(get_le32(e + CIMG_E_METHOD)) {
+    case CIMG_METHOD_RAW:
+        ret = pread(ci->pack_fd, c->data, chunk_size,
+                    get_le64(e + CIMG_E_OFFSET));
+        if (ret != chunk_size || size != chunk_size)
+            goto fail;
+        break;
+    case CIMG_METHOD_LZ4:
+        if (size <= 0 || size > chunk_size ||
+            pread(ci->pack_fd, ci->comp_buf, size,
+                  get_le64(e + CIMG_E_OFFSET)) != size ||
+            lz4_decompress(c->data, chunk_size, ci->comp_buf, size) !=
+            chunk_size)
+            goto fail;
+        break;
+    default:
+        goto fail;
+    }
+    c->chunk_idx = chunk_idx;
+    c->hash_next = ci->hash[h];
+    ci->hash[h] = c;
+    list_add(&c->link, &ci->lru);
+    return c->data;
+ fail:
+    /* reused first */
+    c->chunk_idx = BF_CIMG_NO_CHUNK;
+    list_add_tail(&c->link, &ci->lru);
+    return NULL;
+}
+
+static int bf_cimg_preadv(BlockDeviceCImg *ci, const struct iovec *iov,
+                          int iovcnt, uint64_t offset)
 {
-    int i;
+    const uint8_t *data, *e;
+    uint64_t chunk_idx;
+    size_t pos, len, l, chunk_offset;
+    int ret;
 
-    s->status = 0;
-    s->queue_sel = 0;
-    s->device_features_sel = 0;
-    s->int_status = 0;
-    for(i = 0; i < MAX_QUEUE; i++) {
-        QueueState *qs = &s->queue[i];
-        qs->ready = 0;
-        qs->num = MAX_QUEUE_NUM;
-        qs->desc_addr = 0;
-        qs->avail_addr = 0;
-        qs->used_addr = 0;
-        qs->last_avail_idx = 0;
+    len = iov_size(iov, iovcnt);
+    if (offset + len > ci->image_size)
+        return -1;
+    ret = 0;
+    for(pos = 0; pos < len; pos += l) {
+        chunk_idx = (offset + pos) >> ci->chunk_bits;
+        chunk_offset = (offset + pos) & (((uint64_t)1 << ci->chunk_bits) - 1);
+        l = ((size_t)1 << ci->chunk_bits) - chunk_offset;
+        if (l > len - pos)
+            l = len - pos;
+        e = ci->index + chunk_idx * CIMG_ENTRY_SIZE;
+        if (get_le32(e + CIMG_E_METHOD) == CIMG_METHOD_ZERO) {
+            iov_memset_at(iov, iovcnt, pos, 0, l);
+            continue;
+        }
+        pthread_mutex_lock(&ci->lock);
+        data = bf_cimg_get_chunk(ci, chunk_idx);
+        if (data)
+            iov_from_buf_at(iov, iovcnt, pos, data + chunk_offset, l);
+        pthread_mutex_unlock(&ci->lock);
+        if (!data) {
+            ret = -1;
+            break;
+        }
     }
+    return ret;
 }
 
+/* decompress the chunks of a compressed image with a cache of size_mb
+   MiB. Return < 0 if the image is not compressed. */
+int block_device_set_chunk_cache(BlockDevice *bs, int size_mb)
+{
+    BlockDeviceCImg *ci = bs->opaque->cimg;
 
-static void virtio_init(VIRTIODevice *s, VIRTIOBusDef *bus,
-                        uint32_t device_id, int config_space_size,
-                        VIRTIODeviceRecvFunc *device_recv, const simif_t* sim)
+    if (!ci || size_mb <= 0)
+        return -1;
+    pthread_mutex_lock(&ci->lock);
+    bf_cimg_set_cache_size(ci, size_mb);
+    pthread_mutex_unlock(&ci->lock);
+    return 0;
+}
+
+/* finish a positional transfer of which the first 'done' bytes were
+   transferred, looping on the short transfers. Return < 0 if error or
+   end of file. */
+static int bf_rw_rest(int fd, const struct iovec *iov, int iovcnt,
+                      uint64_t offset, size_t done, BOOL is_write)
 {
-    memset(s, 0, sizeof(*s));
+    struct iovec *iov1;
+    ssize_t ret;
+    int i, n, err;
 
-    {
-        s->sim = sim;
-        /* MMIO case */
-        s->irq = bus->irq;
+    if (done >= (size_t)iov_size(iov, iovcnt))
+        return 0;
+    offset += done;
+    iov1 = (struct iovec *)malloc(sizeof(iov[0]) * iovcnt);
+    n = 0;
+    for(i = 0; i < iovcnt; i++) {
+        if (done >= iov[i].iov_len) {
+            done -= iov[i].iov_len;
+            continue;
+        }
+        iov1[n].iov_base = (uint8_t *)iov[i].iov_base + done;
+        iov1[n].iov_len = iov[i].iov_len - done;
+        done = 0;
+        n++;
     }
-
-    s->device_id = device_id;
-    s->vendor_id = 0xffff;
-    s->config_space_size = config_space_size;
-    s->device_recv = device_recv;
-    virtio_reset(s);
+    err = 0;
+    i = 0;
+    while (i < n) {
+        if (is_write)
+            ret = pwritev(fd, iov1 + i, n - i, offset);
+        else
+            ret = preadv(fd, iov1 + i, n - i, offset);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            err = -1;
+            break;
+        }
+        offset += ret;
+        while (i < n && (size_t)ret >= iov1[i].iov_len) {
+            ret -= iov1[i].iov_len;
+            i++;
+        }
+        if (i < n) {
+            iov1[i].iov_base = (uint8_t *)iov1[i].iov_base + ret;
+            iov1[i].iov_len -= ret;
+        }
+    }
+    free(iov1);
+    return err;
 }
 
-static uint16_t virtio_read16(VIRTIODevice *s, virtio_phys_addr_t addr)
+/* positional vectored I/O. With O_DIRECT, unaligned buffers go through
+   an aligned bounce buffer. */
+static int bf_preadv(BlockDeviceFile *bf, const struct iovec *iov, int iovcnt,
+                     uint64_t offset)
 {
-    mmu_t* simdram = s->sim->debug_mmu;
-    return simdram->load<uint16_t>(addr);
+    struct iovec iov1;
+    uint8_t *buf;
+    int len;
+    ssize_t ret;
+
+    if (bf->cimg)
+        return bf_cimg_preadv(bf->cimg, iov, iovcnt, offset);
+    if (!bf->direct || iov_is_aligned(iov, iovcnt, BF_DIRECT_ALIGN)) {
+        ret = preadv(bf->fd, iov, iovcnt, offset);
+        if (ret < 0 && errno != EINTR)
+            return -1;
+        return bf_rw_rest(bf->fd, iov, iovcnt, offset, max_int(ret, 0),
+                          FALSE);
+    }
+    len = iov_size(iov, iovcnt);
+    if (posix_memalign((void **)&buf, BF_DIRECT_ALIGN, len) != 0)
+        return -1;
+    iov1.iov_base = buf;
+    iov1.iov_len = len;
+    ret = bf_rw_rest(bf->fd, &iov1, 1, offset, 0, FALSE);
+    if (ret >= 0)
+        iov_from_buf(iov, iovcnt, buf);
+    free(buf);
+    return ret;
 }
 
-static void virtio_write16(VIRTIODevice *s, virtio_phys_addr_t addr,
-                           uint16_t val)
+static int bf_pwritev(BlockDeviceFile *bf, const struct iovec *iov, int iovcnt,
+                      uint64_t offset)
 {
-    mmu_t* simdram = s->sim->debug_mmu;
-    simdram->store<uint16_t>(addr, val);
+    struct iovec iov1;
+    uint8_t *buf;
+    int len;
+    ssize_t ret;
+
+    if (!bf->direct || iov_is_aligned(iov, iovcnt, BF_DIRECT_ALIGN)) {
+        ret = pwritev(bf->fd, iov, iovcnt, offset);
+        if (ret < 0 && errno != EINTR)
+            return -1;
+        return bf_rw_rest(bf->fd, iov, iovcnt, offset, max_int(ret, 0),
+                          TRUE);
+    }
+    len = iov_size(iov, iovcnt);
+    if (posix_memalign((void **)&buf, BF_DIRECT_ALIGN, len) != 0)
+        return -1;
+    iov_to_buf(buf, iov, iovcnt);
+    iov1.iov_base = buf;
+    iov1.iov_len = len;
+    ret = bf_rw_rest(bf->fd, &iov1, 1, offset, 0, TRUE);
+    free(buf);
+    return ret;
 }
 
-static void virtio_write32(VIRTIODevice *s, virtio_phys_addr_t addr,
-                           uint32_t val)
+static int bf_pread(BlockDeviceFile *bf, uint8_t *buf, int len,
+                    uint64_t offset)
 {
-    mmu_t* simdram = s->sim->debug_mmu;
-    simdram->store<uint32_t>(addr, val);
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    return bf_preadv(bf, &iov, 1, offset);
 }
 
-static int memcpy_from_ram_intrapage(VIRTIODevice *s, uint8_t *buf,
-                                  virtio_phys_addr_t addr, int count)
+/* TRUE if the n sectors at sector_num are not all in the image. The
+   sector number comes from the guest, so the sum may wrap. */
+static inline BOOL bf_out_of_range(BlockDeviceFile *bf, uint64_t sector_num,
+                                   uint64_t n)
 {
-    mmu_t* simdram = s->sim->debug_mmu;
-    int l = 0;
-    while (count > 0) {
-#ifdef OPT_MEMCPY_RAM
-        if (addr & 1 || count < 2) {
-            *(buf+l) = simdram->load<uint8_t>(addr);
-            count -= 1;
-            l += 1;
-            addr += 1;
-        }
-        else if (addr & 2 || count < 4) {
-            *(uint16_t*)(buf+l) = simdram->load<uint16_t>(addr);
-            count -= 2;
-            l += 2;
-            addr += 2;
-        }
-        else if (addr & 4 || count < 8) {
-            *(uint32_t*)(buf+l) = simdram->load<uint32_t>(addr);
-            count -= 4;
-            l += 4;
-            addr += 4;
-        }
-        else {// addr is 8byte aligned
-            *(uint64_t*)(buf+l) = simdram->load<uint64_t>(addr);
-            count -= 8;
-            l += 8;
-            addr += 8;
-        }
-#else 
-        buf[l] = simdram->load<uint8_t>(addr+l);
-        l++;
-        count--;
-#endif
-    }
-    return l;
+    return sector_num > (uint64_t)bf->nb_sectors ||
+        n > (uint64_t)bf->nb_sectors - sector_num;
 }
 
-static int memcpy_to_ram_intrapage(VIRTIODevice *s, virtio_phys_addr_t addr,
-                                   const uint8_t *buf, int count)
+/* snapshot mode: the written sectors are kept in 64 KiB clusters
+   allocated on demand from an arena. A two-level table maps the cluster
+   index to the cluster and a bitmap tells which of its sectors were
+   written, so the memory used grows with the written data only. The
+   same table holds the dirty data of the write-back cache. */
+
+#define BF_CLUSTER_BITS 7 /* sectors per cluster (log2) */
+#define BF_CLUSTER_SECTORS (1 << BF_CLUSTER_BITS)
+#define BF_CLUSTER_SIZE (BF_CLUSTER_SECTORS * SECTOR_SIZE)
+#define BF_L2_BITS 9 /* clusters per second level table (log2) */
+#define BF_L2_SIZE (1 << BF_L2_BITS)
+#define BF_ARENA_CLUSTERS 16 /* clusters allocated at once */
+
+typedef struct {
+    uint8_t *data; /* BF_CLUSTER_SIZE bytes */
+    uint64_t dirty[BF_CLUSTER_SECTORS / 64]; /* written sectors */
+} BlockDeviceCluster;
+
+struct BlockDeviceSnapshot {
+    int l1_size;
+    BlockDeviceCluster **l1_table; /* l1_size tables of BF_L2_SIZE entries */
+    /* arena */
+    uint8_t *arena_ptr;
+    int arena_left; /* free clusters at arena_ptr */
+    uint8_t *free_list; /* released clusters, linked by their first bytes */
+    int64_t nb_clusters; /* allocated clusters */
+    int64_t nb_dirty_sectors;
+    int64_t dirty_time; /* write-back cache: time of the oldest dirty data */
+};
+
+static BlockDeviceSnapshot *bf_snapshot_init(int64_t nb_sectors)
 {
-    mmu_t* simdram = s->sim->debug_mmu;
-    int l = 0;
-    while (count > 0) {
-#ifdef OPT_MEMCPY_RAM
-        if (addr & 1 || count < 2) {
-            simdram->store<uint8_t>(addr, *(uint8_t*)(buf+l));
-            count -= 1;
-            l += 1;
-            addr += 1;
-        }
-        else if (addr & 2 || count < 4) {
-            simdram->store<uint16_t>(addr, *(uint16_t*)(buf+l));
-            count -= 2;
-            l += 2;
-            addr += 2;
-        }
-        else if (addr & 4 || count < 8) {
-            simdram->store<uint32_t>(addr, *(uint32_t*)(buf+l));
-            count -= 4;
-            l += 4;
-            addr += 4;
-        }
-        else {// addr is 8byte aligned
-            simdram->store<uint64_t>(addr, *(uint64_t*)(buf+l));
-            count -= 8;
-            l += 8;
-            addr += 8;
-        }
-#else 
-        simdram->store<uint8_t>(addr+l, buf[l]);
-        l++;
-        count--;
-#endif
-    }
-    return l;
+    BlockDeviceSnapshot *sn;
+    int64_t nb_clusters;
+
+    sn = (BlockDeviceSnapshot *)mallocz(sizeof(*sn));
+    nb_clusters = (nb_sectors + BF_CLUSTER_SECTORS - 1) >> BF_CLUSTER_BITS;
+    sn->l1_size = (nb_clusters + BF_L2_SIZE - 1) >> BF_L2_BITS;
+    sn->l1_table = (BlockDeviceCluster **)mallocz(sizeof(sn->l1_table[0]) *
+                                                  max_int(sn->l1_size, 1));
+    return sn;
 }
 
-static int virtio_memcpy_from_ram(VIRTIODevice *s, uint8_t *buf,
-                                  virtio_phys_addr_t addr, int count)
+/* return the cluster containing sector_num or NULL if none of its
+   sectors were written. If alloc is TRUE, the cluster is allocated. */
+static BlockDeviceCluster *bf_snapshot_find(BlockDeviceSnapshot *sn,
+                                            uint64_t sector_num, BOOL alloc)
 {
-    uint8_t *ptr;
-    int l;
-
-    while (count > 0) {
-        l = min_int(count, VIRTIO_PAGE_SIZE - (addr & (VIRTIO_PAGE_SIZE - 1)));
-        memcpy_from_ram_intrapage(s, buf, addr, l);
-#ifdef DEBUG_VIRTIO
-        printf("Copying from ram paddr %#lx of length %#x to buf %p :\n",
-            addr, l, buf);
-        for (int i = 0; i < l; i++) {
-            printf("%x ", buf[i]);
+    uint64_t cluster_idx = sector_num >> BF_CLUSTER_BITS;
+    BlockDeviceCluster *l2, *c;
+
+    l2 = sn->l1_table[cluster_idx >> BF_L2_BITS];
+    if (!l2) {
+        if (!alloc)
+            return NULL;
+        l2 = (BlockDeviceCluster *)mallocz(sizeof(l2[0]) * BF_L2_SIZE);
+        sn->l1_table[cluster_idx >> BF_L2_BITS] = l2;
+    }
+    c = &l2[cluster_idx & (BF_L2_SIZE - 1)];
+    if (!c->data) {
+        if (!alloc)
+            return NULL;
+        if (sn->free_list) {
+            c->data = sn->free_list;
+            sn->free_list = *(uint8_t **)c->data;
+        } else {
+            if (sn->arena_left == 0) {
+                /* aligned so that it can be written with O_DIRECT */
+                if (posix_memalign((void **)&sn->arena_ptr, 4096,
+                                   BF_CLUSTER_SIZE * BF_ARENA_CLUSTERS) != 0)
+                    abort();
+                sn->arena_left = BF_ARENA_CLUSTERS;
+            }
+            c->data = sn->arena_ptr;
+            sn->arena_ptr += BF_CLUSTER_SIZE;
+            sn->arena_left--;
         }
-        putchar('\n');
-#endif 
-        addr += l;
-        buf += l;
-        count -= l;
+        sn->nb_clusters++;
     }
-    return 0;
+    return c;
 }
 
-static int virtio_memcpy_to_ram(VIRTIODevice *s, virtio_phys_addr_t addr, 
-                                const uint8_t *buf, int count)
+/* give the cluster memory back to the arena */
+static void bf_snapshot_release(BlockDeviceSnapshot *sn, BlockDeviceCluster *c)
 {
-    uint8_t *ptr;
-    int l;
+    int k;
 
-    while (count > 0) {
-        l = min_int(count, VIRTIO_PAGE_SIZE - (addr & (VIRTIO_PAGE_SIZE - 1)));
-        memcpy_to_ram_intrapage(s, addr, buf, l);
-        addr += l;
-        buf += l;
-        count -= l;
+    for(k = 0; k < BF_CLUSTER_SECTORS / 64; k++) {
+        sn->nb_dirty_sectors -= __builtin_popcountll(c->dirty[k]);
+        c->dirty[k] = 0;
     }
-    return 0;
+    *(uint8_t **)c->data = sn->free_list;
+    sn->free_list = c->data;
+    c->data = NULL;
+    sn->nb_clusters--;
 }
 
-static int get_desc(VIRTIODevice *s, VIRTIODesc *desc,  
-                    int queue_idx, int desc_idx)
+static inline BOOL bf_cluster_is_dirty(const BlockDeviceCluster *c, int idx)
 {
-    QueueState *qs = &s->queue[queue_idx];
-    return virtio_memcpy_from_ram(s, (uint8_t *)desc, qs->desc_addr +
-                                  desc_idx * sizeof(VIRTIODesc),
-                                  sizeof(VIRTIODesc));
+    return c && ((c->dirty[idx >> 6] >> (idx & 63)) & 1);
 }
 
-static int memcpy_to_from_queue(VIRTIODevice *s, uint8_t *buf,
-                                int queue_idx, int desc_idx,
-                                int offset, int count, BOOL to_queue)
+/* Dirty runs are copied with a single memcpy per cluster and clean
+   runs are read from the image with a single call. */
+static int bf_snapshot_read(BlockDeviceFile *bf, uint64_t sector_num,
+                            uint8_t *buf, int n)
 {
-    VIRTIODesc desc;
-    int l, f_write_flag;
+    BlockDeviceSnapshot *sn = bf->snapshot;
+    BlockDeviceCluster *c;
+    uint64_t sec;
+    int i, j, idx, end;
+    BOOL dirty;
 
-#ifdef DEBUG_VIRTIO
-    if (to_queue) {
-        printf("Reading from buf %p, len = %u, to queue qidx = %d, desc_idx = %d\n",
-            buf, count, queue_idx, desc_idx);
-    }
-    else {
-        printf("Reading from queue qidx = %d, desc_idx = %d, offset = %u, len = %u, to buf %p\n",
-            queue_idx, desc_idx, offset, count, buf);
+    if (bf_out_of_range(bf, sector_num, n))
+        return -1;
+    for(i = 0; i < n; i = j) {
+        sec = sector_num + i;
+        c = bf_snapshot_find(sn, sec, FALSE);
+        idx = sec & (BF_CLUSTER_SECTORS - 1);
+        dirty = bf_cluster_is_dirty(c, idx);
+        if (dirty) {
+            /* dirty run inside the cluster */
+            end = min_int(n - i, BF_CLUSTER_SECTORS - idx);
+            for(j = 1; j < end && bf_cluster_is_dirty(c, idx + j); j++)
+                continue;
+            memcpy(buf + i * SECTOR_SIZE, c->data + idx * SECTOR_SIZE,
+                   j * SECTOR_SIZE);
+            j += i;
+        } else {
+            /* clean run, possibly spanning several clusters */
+            j = i + 1;
+            while (j < n) {
+                sec = sector_num + j;
+                idx = sec & (BF_CLUSTER_SECTORS - 1);
+                if (idx == 0)
+                    c = bf_snapshot_find(sn, sec, FALSE);
+                if (!c) {
+                    /* skip the whole clean cluster */
+                    j += BF_CLUSTER_SECTORS - idx;
+                    continue;
+                }
+                if (bf_cluster_is_dirty(c, idx))
+                    break;
+                j++;
+            }
+            j = min_int(j, n);
+            if (bf_pread(bf, buf + i * SECTOR_SIZE, (j - i) * SECTOR_SIZE,
+                         (sector_num + i) * SECTOR_SIZE) < 0)
+                return -1;
+        }
     }
-#endif
-    if (count == 0)
-        return 0;
+    return 0;
+}
 
-    get_desc(s, &desc, queue_idx, desc_idx);
+static int bf_snapshot_write(BlockDeviceFile *bf, uint64_t sector_num,
+                             const uint8_t *buf, int n)
+{
+    BlockDeviceSnapshot *sn = bf->snapshot;
+    BlockDeviceCluster *c;
+    int idx, l, k;
 
-    if (to_queue) {
-        f_write_flag = VRING_DESC_F_WRITE;
-        /* find the first write descriptor */
-        for(;;) {
-            if ((desc.flags & VRING_DESC_F_WRITE) == f_write_flag)
-                break;
-            if (!(desc.flags & VRING_DESC_F_NEXT))
-                return -1;
-            desc_idx = desc.next;
-            get_desc(s, &desc, queue_idx, desc_idx);
+    if (bf_out_of_range(bf, sector_num, n))
+        return -1;
+    while (n > 0) {
+        c = bf_snapshot_find(sn, sector_num, TRUE);
+        idx = sector_num & (BF_CLUSTER_SECTORS - 1);
+        l = min_int(n, BF_CLUSTER_SECTORS - idx);
+        memcpy(c->data + idx * SECTOR_SIZE, buf, l * SECTOR_SIZE);
+        for(k = idx; k < idx + l; k++) {
+            uint64_t mask = (uint64_t)1 << (k & 63);
+            if (!(c->dirty[k >> 6] & mask)) {
+                c->dirty[k >> 6] |= mask;
+                sn->nb_dirty_sectors++;
+            }
         }
-    } else {
-        f_write_flag = 0;
+        sector_num += l;
+        buf += l * SECTOR_SIZE;
+        n -= l;
     }
+    return 0;
+}
 
-    /* find the descriptor at offset */
-    for(;;) {
-#ifdef DEBUG_VIRTIO
-        printf("Searching for desc at offset %u, desc_idx = %d, desc.flags = %#x, desc.len = %u\n",
-            offset, desc_idx, desc.flags, desc.len);
-#endif 
-        if ((desc.flags & VRING_DESC_F_WRITE) != f_write_flag)
-            return -1;
-        if (offset < desc.len)
-            break;
-        if (!(desc.flags & VRING_DESC_F_NEXT))
-            return -1;
-        desc_idx = desc.next;
-        offset -= desc.len;
-        get_desc(s, &desc, queue_idx, desc_idx);
+/* forget the written sectors: they read again from the image */
+static void bf_snapshot_drop(BlockDeviceSnapshot *sn, uint64_t sector_num,
+                             int n)
+{
+    BlockDeviceCluster *c;
+    int idx, l, k;
+
+    while (n > 0) {
+        c = bf_snapshot_find(sn, sector_num, FALSE);
+        idx = sector_num & (BF_CLUSTER_SECTORS - 1);
+        l = min_int(n, BF_CLUSTER_SECTORS - idx);
+        if (c) {
+            for(k = idx; k < idx + l; k++) {
+                uint64_t mask = (uint64_t)1 << (k & 63);
+                if (c->dirty[k >> 6] & mask) {
+                    c->dirty[k >> 6] &= ~mask;
+                    sn->nb_dirty_sectors--;
+                }
+            }
+            for(k = 0; k < BF_CLUSTER_SECTORS / 64 && !c->dirty[k]; k++)
+                continue;
+            if (k == BF_CLUSTER_SECTORS / 64)
+                bf_snapshot_release(sn, c);
+        }
+        sector_num += l;
+        n -= l;
     }
-#ifdef DEBUG_VIRTIO
-        printf("Desc located at desc_idx %d, offset = %u\n",
-            desc_idx, offset);
-#endif 
+}
 
-    for(;;) {
-        l = min_int(count, desc.len - offset);
-#ifdef DEBUG_VIRTIO
-        printf("Reading queue of length %d ..., count = %d\n",
-            l, count);
-#endif 
-        if (to_queue)
-            virtio_memcpy_to_ram(s, desc.addr + offset, buf, l);
-        else
-            virtio_memcpy_from_ram(s, buf, desc.addr + offset, l);
-        count -= l;
-        if (count == 0)
-            break;
-        offset += l;
-        buf += l;
-        if (offset == desc.len) {
-            if (!(desc.flags & VRING_DESC_F_NEXT))
+/* overlay mode: same layout as the snapshot mode, but the clusters are
+   stored in a file so that the writes survive across runs. The file
+   contains:
+   - a header (BF_OVL_HEADER_SIZE bytes),
+   - the cluster index: one BlockDeviceOverlayEntry per cluster of the
+     base image,
+   - the data clusters, in allocation order, starting at data_offset.
+   Only the header and the index are memory-mapped, so opening an
+   existing overlay does not read its data. */
+
+#define BF_OVL_MAGIC "SPIKEOVL"
+#define BF_OVL_VERSION 1
+#define BF_OVL_HEADER_SIZE 4096
+
+/* header fields (little endian) */
+#define BF_OVL_H_MAGIC             0
+#define BF_OVL_H_VERSION           8 /* le32 */
+#define BF_OVL_H_CLUSTER_BITS     12 /* le32 */
+#define BF_OVL_H_NB_SECTORS       16 /* le64, size of the base image */
+#define BF_OVL_H_NB_CLUSTERS      24 /* le64, number of index entries */
+#define BF_OVL_H_DATA_OFFSET      32 /* le64 */
+#define BF_OVL_H_NB_DATA_CLUSTERS 40 /* le64, allocated data clusters */
+
+/* index entry (little endian) */
+#define BF_OVL_E_DATA_CLUSTER 0 /* le64, data cluster + 1, 0 if none */
+#define BF_OVL_E_DIRTY        8 /* BF_CLUSTER_SECTORS bits */
+#define BF_OVL_ENTRY_SIZE (8 + BF_CLUSTER_SECTORS / 8)
+
+struct BlockDeviceOverlay {
+    char *filename;
+    int fd;
+    uint8_t *map; /* header and index */
+    size_t map_size;
+    uint64_t nb_clusters;
+    uint64_t data_offset;
+};
+
+static uint8_t *bf_overlay_entry(BlockDeviceOverlay *ov, uint64_t sector_num)
+{
+    return ov->map + BF_OVL_HEADER_SIZE +
+        (sector_num >> BF_CLUSTER_BITS) * BF_OVL_ENTRY_SIZE;
+}
+
+static inline BOOL bf_overlay_is_dirty(const uint8_t *e, int idx)
+{
+    return (e[BF_OVL_E_DIRTY + (idx >> 3)] >> (idx & 7)) & 1;
+}
+
+/* file offset of the sector in the data clusters */
+static uint64_t bf_overlay_data_pos(BlockDeviceOverlay *ov, const uint8_t *e,
+                                    int idx)
+{
+    return ov->data_offset +
+        (get_le64(e + BF_OVL_E_DATA_CLUSTER) - 1) * BF_CLUSTER_SIZE +
+        idx * SECTOR_SIZE;
+}
+
+static int bf_overlay_read(BlockDeviceFile *bf, uint64_t sector_num,
+                           uint8_t *buf, int n)
+{
+    BlockDeviceOverlay *ov = bf->overlay;
+    const uint8_t *e;
+    uint64_t sec;
+    int i, j, idx, end;
+
+    if (bf_out_of_range(bf, sector_num, n))
+        return -1;
+    for(i = 0; i < n; i = j) {
+        sec = sector_num + i;
+        e = bf_overlay_entry(ov, sec);
+        idx = sec & (BF_CLUSTER_SECTORS - 1);
+        if (bf_overlay_is_dirty(e, idx)) {
+            /* dirty run inside the cluster */
+            end = min_int(n - i, BF_CLUSTER_SECTORS - idx);
+            for(j = 1; j < end && bf_overlay_is_dirty(e, idx + j); j++)
+                continue;
+            if (pread(ov->fd, buf + i * SECTOR_SIZE, j * SECTOR_SIZE,
+                      bf_overlay_data_pos(ov, e, idx)) < 0)
                 return -1;
-            desc_idx = desc.next;
-            get_desc(s, &desc, queue_idx, desc_idx);
-            if ((desc.flags & VRING_DESC_F_WRITE) != f_write_flag)
+            j += i;
+        } else {
+            /* clean run, possibly spanning several clusters */
+            for(j = i + 1; j < n; j++) {
+                sec = sector_num + j;
+                idx = sec & (BF_CLUSTER_SECTORS - 1);
+                if (idx == 0)
+                    e = bf_overlay_entry(ov, sec);
+                if (bf_overlay_is_dirty(e, idx))
+                    break;
+            }
+            if (bf_pread(bf, buf + i * SECTOR_SIZE, (j - i) * SECTOR_SIZE,
+                         (sector_num + i) * SECTOR_SIZE) < 0)
                 return -1;
-            offset = 0;
         }
     }
-#ifdef DEBUG_VIRTIO
-    printf("Reading successfully finished.\n");
-#endif 
     return 0;
 }
 
-static int memcpy_from_queue(VIRTIODevice *s, void *buf,
-                             int queue_idx, int desc_idx,
-                             int offset, int count)
+static int bf_overlay_write(BlockDeviceFile *bf, uint64_t sector_num,
+                            const uint8_t *buf, int n)
 {
-    return memcpy_to_from_queue(s, (uint8_t*)buf, queue_idx, desc_idx, offset, count,
-                                FALSE);
+    BlockDeviceOverlay *ov = bf->overlay;
+    uint8_t *e;
+    uint64_t nb_data_clusters;
+    int idx, l, k;
+
+    if (bf_out_of_range(bf, sector_num, n))
+        return -1;
+    while (n > 0) {
+        e = bf_overlay_entry(ov, sector_num);
+        if (get_le64(e + BF_OVL_E_DATA_CLUSTER) == 0) {
+            /* allocate a data cluster at the end of the file */
+            nb_data_clusters = get_le64(ov->map + BF_OVL_H_NB_DATA_CLUSTERS);
+            put_le64(ov->map + BF_OVL_H_NB_DATA_CLUSTERS,
+                     nb_data_clusters + 1);
+            put_le64(e + BF_OVL_E_DATA_CLUSTER, nb_data_clusters + 1);
+        }
+        idx = sector_num & (BF_CLUSTER_SECTORS - 1);
+        l = min_int(n, BF_CLUSTER_SECTORS - idx);
+        if (pwrite(ov->fd, buf, l * SECTOR_SIZE,
+                   bf_overlay_data_pos(ov, e, idx)) < 0)
+            return -1;
+        /* the sectors are marked dirty once their data is written */
+        for(k = idx; k < idx + l; k++)
+            e[BF_OVL_E_DIRTY + (k >> 3)] |= 1 << (k & 7);
+        sector_num += l;
+        buf += l * SECTOR_SIZE;
+        n -= l;
+    }
+    return 0;
 }
 
-static int memcpy_to_queue(VIRTIODevice *s,
-                           int queue_idx, int desc_idx,
-                           int offset, const void *buf, int count)
+/* forget the written sectors. The data clusters stay allocated but
+   the fully clean ones are punched out of the overlay file. */
+static void bf_overlay_drop(BlockDeviceOverlay *ov, uint64_t sector_num,
+                            int n)
 {
-    return memcpy_to_from_queue(s, (uint8_t *)buf, queue_idx, desc_idx, offset,
-                                count, TRUE);
+    uint8_t *e;
+    int idx, l, k;
+
+    while (n > 0) {
+        e = bf_overlay_entry(ov, sector_num);
+        idx = sector_num & (BF_CLUSTER_SECTORS - 1);
+        l = min_int(n, BF_CLUSTER_SECTORS - idx);
+        if (get_le64(e + BF_OVL_E_DATA_CLUSTER) != 0) {
+            for(k = idx; k < idx + l; k++)
+                e[BF_OVL_E_DIRTY + (k >> 3)] &= ~(1 << (k & 7));
+            for(k = 0; k < BF_CLUSTER_SECTORS / 8 &&
+                    !e[BF_OVL_E_DIRTY + k]; k++)
+                continue;
+            if (k == BF_CLUSTER_SECTORS / 8) {
+                fallocate(ov->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                          bf_overlay_data_pos(ov, e, 0), BF_CLUSTER_SIZE);
+            }
+        }
+        sector_num += l;
+        n -= l;
+    }
 }
 
-/* signal that the descriptor has been consumed */
-static void virtio_consume_desc(VIRTIODevice *s,
-                                int queue_idx, int desc_idx, int desc_len)
+/* number of index entries and offset of the data clusters of the
+   overlay of an image of nb_sectors */
+static uint64_t bf_overlay_layout(int64_t nb_sectors, uint64_t *pnb_clusters)
 {
-    QueueState *qs = &s->queue[queue_idx];
-    virtio_phys_addr_t addr;
-    uint32_t index;
-    addr = qs->used_addr + 2;
-    index = virtio_read16(s, addr);
-    virtio_write16(s, addr, index + 1);
-    addr = qs->used_addr + 4 + (index & (qs->num - 1)) * 8;
-    virtio_write32(s, addr, desc_idx);
-    virtio_write32(s, addr + 4, desc_len);
-    s->int_status |= 1;
-    set_irq(s->irq, 1);
+    uint64_t nb_clusters, data_offset;
+
+    nb_clusters = (nb_sectors + BF_CLUSTER_SECTORS - 1) >> BF_CLUSTER_BITS;
+    data_offset = BF_OVL_HEADER_SIZE + nb_clusters * BF_OVL_ENTRY_SIZE;
+    data_offset = (data_offset + BF_CLUSTER_SIZE - 1) & ~(uint64_t)(BF_CLUSTER_SIZE - 1);
+    *pnb_clusters = nb_clusters;
+    return data_offset;
 }
 
-static int get_desc_rw_size(VIRTIODevice *s, 
-                             int *pread_size, int *pwrite_size,
-                             int queue_idx, int desc_idx)
+/* header of an empty overlay */
+static void bf_overlay_init_header(uint8_t *h, int64_t nb_sectors)
 {
-    VIRTIODesc desc;
-    int read_size, write_size;
+    uint64_t nb_clusters, data_offset;
+
+    data_offset = bf_overlay_layout(nb_sectors, &nb_clusters);
+    memset(h, 0, BF_OVL_HEADER_SIZE);
+    memcpy(h + BF_OVL_H_MAGIC, BF_OVL_MAGIC, 8);
+    put_le32(h + BF_OVL_H_VERSION, BF_OVL_VERSION);
+    put_le32(h + BF_OVL_H_CLUSTER_BITS, BF_CLUSTER_BITS);
+    put_le64(h + BF_OVL_H_NB_SECTORS, nb_sectors);
+    put_le64(h + BF_OVL_H_NB_CLUSTERS, nb_clusters);
+    put_le64(h + BF_OVL_H_DATA_OFFSET, data_offset);
+}
 
-    read_size = 0;
-    write_size = 0;
-    get_desc(s, &desc, queue_idx, desc_idx);
+/* read the header of an existing overlay. Return < 0 if it is not an
+   overlay of an image of nb_sectors. */
+static int bf_overlay_read_header(int fd, uint8_t *h, int64_t nb_sectors,
+                                  const char *filename)
+{
+    uint64_t nb_clusters, data_offset;
+
+    data_offset = bf_overlay_layout(nb_sectors, &nb_clusters);
+    if (pread(fd, h, BF_OVL_HEADER_SIZE, 0) != BF_OVL_HEADER_SIZE ||
+        memcmp(h + BF_OVL_H_MAGIC, BF_OVL_MAGIC, 8) != 0 ||
+        get_le32(h + BF_OVL_H_VERSION) != BF_OVL_VERSION ||
+        get_le32(h + BF_OVL_H_CLUSTER_BITS) != BF_CLUSTER_BITS ||
+        get_le64(h + BF_OVL_H_NB_SECTORS) != (uint64_t)nb_sectors ||
+        get_le64(h + BF_OVL_H_NB_CLUSTERS) != nb_clusters ||
+        get_le64(h + BF_OVL_H_DATA_OFFSET) != data_offset) {
+        fprintf(stderr, "%s: invalid overlay or base image size mismatch\n",
+                filename);
+        return -1;
+    }
+    return 0;
+}
 
-    for(;;) {
-        if (desc.flags & VRING_DESC_F_WRITE)
-            break;
-        read_size += desc.len;
-        if (!(desc.flags & VRING_DESC_F_NEXT))
-            goto done;
-        desc_idx = desc.next;
-        get_desc(s, &desc, queue_idx, desc_idx);
+/* open or create the overlay file of the base image. Return < 0 if
+   error. */
+int block_device_open_overlay(BlockDevice *bs, const char *filename)
+{
+    BlockDeviceFile *bf = bs->opaque;
+    BlockDeviceOverlay *ov;
+    uint64_t nb_clusters, data_offset;
+    uint8_t h[BF_OVL_HEADER_SIZE];
+    struct stat st;
+    void *map;
+    int fd;
+
+    if (bf->mode != BF_MODE_OVERLAY || bf->overlay)
+        return -1;
+    fd = open(filename, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        perror(filename);
+        return -1;
     }
-    
-    for(;;) {
-        if (!(desc.flags & VRING_DESC_F_WRITE))
-            return -1;
-        write_size += desc.len;
-        if (!(desc.flags & VRING_DESC_F_NEXT))
-            break;
-        desc_idx = desc.next;
-        get_desc(s, &desc, queue_idx, desc_idx);
+    data_offset = bf_overlay_layout(bf->nb_sectors, &nb_clusters);
+    if (fstat(fd, &st) < 0)
+        goto fail;
+    if (st.st_size == 0) {
+        /* new overlay */
+        bf_overlay_init_header(h, bf->nb_sectors);
+        if (pwrite(fd, h, sizeof(h), 0) != sizeof(h) ||
+            ftruncate(fd, data_offset) < 0)
+            goto fail;
+    } else {
+        if (bf_overlay_read_header(fd, h, bf->nb_sectors, filename) < 0)
+            goto fail;
     }
-
- done:
-    *pread_size = read_size;
-    *pwrite_size = write_size;
+    map = mmap(NULL, data_offset, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror(filename);
+        goto fail;
+    }
+    ov = (BlockDeviceOverlay *)mallocz(sizeof(*ov));
+    ov->filename = strdup(filename);
+    ov->fd = fd;
+    ov->map = (uint8_t *)map;
+    ov->map_size = data_offset;
+    ov->nb_clusters = nb_clusters;
+    ov->data_offset = data_offset;
+    bf->overlay = ov;
     return 0;
+ fail:
+    close(fd);
+    return -1;
 }
 
-/* XXX: test if the queue is ready ? */
-static void queue_notify(VIRTIODevice *s, int queue_idx)
+/* write the overlay back to the base image and empty it. Return < 0 if
+   error. */
+int block_device_commit(BlockDevice *bs, const char *base_filename)
 {
-    QueueState *qs = &s->queue[queue_idx];
-    uint16_t avail_idx;
-    int desc_idx, read_size, write_size;
+    BlockDeviceFile *bf = bs->opaque;
+    BlockDeviceOverlay *ov = bf->overlay;
+    uint8_t buf[BF_CLUSTER_SIZE];
+    uint8_t *e;
+    uint64_t c;
+    int fd, i, j, ret;
+
+    /* the compressed images are read only */
+    if (!ov || bf->cimg)
+        return -1;
+    fd = open(base_filename, O_WRONLY);
+    if (fd < 0) {
+        perror(base_filename);
+        return -1;
+    }
+    ret = 0;
+    for(c = 0; c < ov->nb_clusters && ret == 0; c++) {
+        e = bf_overlay_entry(ov, c << BF_CLUSTER_BITS);
+        if (get_le64(e + BF_OVL_E_DATA_CLUSTER) == 0)
+            continue;
+        for(i = 0; i < BF_CLUSTER_SECTORS; i = j) {
+            if (!bf_overlay_is_dirty(e, i)) {
+                j = i + 1;
+                continue;
+            }
+            for(j = i + 1; j < BF_CLUSTER_SECTORS &&
+                    bf_overlay_is_dirty(e, j); j++)
+                continue;
+            if (pread(ov->fd, buf, (j - i) * SECTOR_SIZE,
+                      bf_overlay_data_pos(ov, e, i)) < 0 ||
+                pwrite(fd, buf, (j - i) * SECTOR_SIZE,
+                       ((c << BF_CLUSTER_BITS) + i) * SECTOR_SIZE) < 0) {
+                ret = -1;
+                break;
+            }
+        }
+    }
+    if (ret == 0 && fsync(fd) == 0) {
+        /* the base image is up to date: empty the overlay */
+        memset(ov->map + BF_OVL_HEADER_SIZE, 0,
+               ov->nb_clusters * BF_OVL_ENTRY_SIZE);
+        put_le64(ov->map + BF_OVL_H_NB_DATA_CLUSTERS, 0);
+        msync(ov->map, ov->map_size, MS_SYNC);
+        if (ftruncate(ov->fd, ov->data_offset) < 0)
+            ret = -1;
+    } else {
+        ret = -1;
+    }
+    close(fd);
+    return ret;
+}
 
-    if (qs->manual_recv)
-        return;
+/* device state: the written sectors are saved in a file with the
+   overlay layout. In overlay mode, it is a clone of the overlay which
+   shares its data blocks on the file systems with reflinks (btrfs,
+   XFS), so that saving and restoring do not copy the data. */
 
-    avail_idx = virtio_read16(s, qs->avail_addr + 2);
-#ifdef DEBUG_VIRTIO
-    printf("avail_idx = %d, qs->last_avail_idx = %d\n",
-        avail_idx, qs->last_avail_idx);
-#endif 
-    while (qs->last_avail_idx != avail_idx) {
-        desc_idx = virtio_read16(s, qs->avail_addr + 4 + 
-                                 (qs->last_avail_idx & (qs->num - 1)) * 2);
-        if (!get_desc_rw_size(s, &read_size, &write_size, queue_idx, desc_idx)) {
-#ifdef DEBUG_VIRTIO
-            {
-                printf("queue_notify: idx=%d read_size=%d write_size=%d\n",
-                       queue_idx, read_size, write_size);
-            }
+#define BF_COPY_BUF_SIZE (1 << 20)
+
+static int bf_flush(BlockDeviceFile *bf);
+static void bf_rcache_invalidate(BlockDeviceReadCache *rc,
+                                 uint64_t sector_num, int n);
+
+/* copy the file src_fd to dst_filename, sharing the data blocks if
+   possible */
+static int bf_clone_file(int src_fd, const char *dst_filename)
+{
+    struct stat st;
+    uint8_t *buf;
+    loff_t in_pos, out_pos;
+    ssize_t ret;
+    int fd;
+
+    fd = open(dst_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(dst_filename);
+        return -1;
+    }
+#ifdef FICLONE
+    if (ioctl(fd, FICLONE, src_fd) == 0) {
+        close(fd);
+        return 0;
+    }
 #endif
-            if (s->device_recv(s, queue_idx, desc_idx,
-                               read_size, write_size) < 0)
+    if (fstat(src_fd, &st) < 0)
+        goto fail;
+    /* copy_file_range() also shares the blocks on some file systems
+       (NFS, FUSE) */
+    in_pos = 0;
+    out_pos = 0;
+    while (in_pos < st.st_size) {
+        ret = copy_file_range(src_fd, &in_pos, fd, &out_pos,
+                              st.st_size - in_pos, 0);
+        if (ret <= 0)
+            break;
+    }
+    if (in_pos < st.st_size) {
+        buf = (uint8_t *)malloc(BF_COPY_BUF_SIZE);
+        while (in_pos < st.st_size) {
+            ret = pread(src_fd, buf, BF_COPY_BUF_SIZE, in_pos);
+            if (ret <= 0 || pwrite(fd, buf, ret, in_pos) != ret)
                 break;
+            in_pos += ret;
         }
-        qs->last_avail_idx++;
+        free(buf);
+        if (in_pos < st.st_size)
+            goto fail;
     }
+    close(fd);
+    return 0;
+ fail:
+    perror(dst_filename);
+    close(fd);
+    return -1;
 }
 
-static uint32_t virtio_config_read(VIRTIODevice *s, uint32_t offset,
-                                   int size_log2)
+/* write the dirty clusters of the snapshot mode in an overlay file */
+static int bf_snapshot_save(BlockDeviceFile *bf, const char *filename)
 {
-    uint32_t val;
-    switch(size_log2) {
-    case 0:
-        if (offset < s->config_space_size) {
-            val = s->config_space[offset];
-        } else {
-            val = 0;
-        }
-        break;
-    case 1:
-        if (offset < (s->config_space_size - 1)) {
-            val = get_le16(&s->config_space[offset]);
-        } else {
-            val = 0;
-        }
-        break;
-    case 2:
-        if (offset < (s->config_space_size - 3)) {
-            val = get_le32(s->config_space + offset);
-        } else {
-            val = 0;
+    BlockDeviceSnapshot *sn = bf->snapshot;
+    BlockDeviceCluster *c;
+    uint64_t nb_clusters, data_offset, cluster_idx, nb_data_clusters;
+    uint8_t *index, h[BF_OVL_HEADER_SIZE];
+    uint8_t *e;
+    int fd, i, k, ret;
+
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(filename);
+        return -1;
+    }
+    data_offset = bf_overlay_layout(bf->nb_sectors, &nb_clusters);
+    index = (uint8_t *)mallocz(data_offset - BF_OVL_HEADER_SIZE);
+    nb_data_clusters = 0;
+    ret = 0;
+    for(i = 0; i < sn->l1_size && ret == 0; i++) {
+        if (!sn->l1_table[i])
+            continue;
+        for(k = 0; k < BF_L2_SIZE; k++) {
+            c = &sn->l1_table[i][k];
+            if (!c->data)
+                continue;
+            cluster_idx = ((uint64_t)i << BF_L2_BITS) + k;
+            e = index + cluster_idx * BF_OVL_ENTRY_SIZE;
+            put_le64(e + BF_OVL_E_DATA_CLUSTER, nb_data_clusters + 1);
+            /* same bit order as the snapshot bitmap */
+            for(int j = 0; j < BF_CLUSTER_SECTORS / 64; j++)
+                put_le64(e + BF_OVL_E_DIRTY + j * 8, c->dirty[j]);
+            if (pwrite(fd, c->data, BF_CLUSTER_SIZE, data_offset +
+                       nb_data_clusters * BF_CLUSTER_SIZE) != BF_CLUSTER_SIZE) {
+                ret = -1;
+                break;
+            }
+            nb_data_clusters++;
         }
-        break;
-    default:
-        abort();
     }
-#ifdef DEBUG_VIRTIO
-    {
-        printf("virto_config_read: offset=0x%x val=0x%x size=%d\n", 
-               offset, val, 1 << size_log2);
+    bf_overlay_init_header(h, bf->nb_sectors);
+    put_le64(h + BF_OVL_H_NB_DATA_CLUSTERS, nb_data_clusters);
+    if (ret < 0 ||
+        pwrite(fd, h, sizeof(h), 0) != sizeof(h) ||
+        pwrite(fd, index, data_offset - BF_OVL_HEADER_SIZE,
+               BF_OVL_HEADER_SIZE) != (ssize_t)(data_offset - BF_OVL_HEADER_SIZE) ||
+        ftruncate(fd, data_offset + nb_data_clusters * BF_CLUSTER_SIZE) < 0) {
+        perror(filename);
+        ret = -1;
     }
-#endif
-    return val;
+    free(index);
+    close(fd);
+    return ret;
 }
 
-static void virtio_config_write(VIRTIODevice *s, uint32_t offset,
-                                uint32_t val, int size_log2)
+/* replace the written sectors of the snapshot mode by the ones of an
+   overlay file, NULL to drop them all */
+static int bf_snapshot_load(BlockDeviceFile *bf, const char *filename)
 {
-    switch(size_log2) {
-    case 0:
-        if (offset < s->config_space_size) {
-            s->config_space[offset] = val;
-            if (s->config_write)
-                s->config_write(s);
-        }
-        break;
-    case 1:
-        if (offset < s->config_space_size - 1) {
-            put_le16(s->config_space + offset, val);
-            if (s->config_write)
-                s->config_write(s);
+    BlockDeviceSnapshot *sn = bf->snapshot;
+    uint64_t nb_clusters, data_offset, c, sec;
+    uint8_t *index, h[BF_OVL_HEADER_SIZE], buf[BF_CLUSTER_SIZE];
+    uint8_t *e;
+    int fd, i, j, ret;
+
+    for(sec = 0; sec < (uint64_t)bf->nb_sectors; sec += BF_CLUSTER_SECTORS)
+        bf_snapshot_drop(sn, sec, BF_CLUSTER_SECTORS);
+    if (!filename)
+        return 0;
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror(filename);
+        return -1;
+    }
+    if (bf_overlay_read_header(fd, h, bf->nb_sectors, filename) < 0) {
+        close(fd);
+        return -1;
+    }
+    data_offset = bf_overlay_layout(bf->nb_sectors, &nb_clusters);
+    index = (uint8_t *)malloc(data_offset - BF_OVL_HEADER_SIZE);
+    ret = 0;
+    if (pread(fd, index, data_offset - BF_OVL_HEADER_SIZE,
+              BF_OVL_HEADER_SIZE) != (ssize_t)(data_offset - BF_OVL_HEADER_SIZE))
+        ret = -1;
+    for(c = 0; c < nb_clusters && ret == 0; c++) {
+        e = index + c * BF_OVL_ENTRY_SIZE;
+        if (get_le64(e + BF_OVL_E_DATA_CLUSTER) == 0)
+            continue;
+        if (pread(fd, buf, BF_CLUSTER_SIZE,
+                  data_offset + (get_le64(e + BF_OVL_E_DATA_CLUSTER) - 1) *
+                  BF_CLUSTER_SIZE) < 0) {
+            ret = -1;
+            break;
         }
-        break;
-    case 2:
-        if (offset < s->config_space_size - 3) {
-            put_le32(s->config_space + offset, val);
-            if (s->config_write)
-                s->config_write(s);
+        for(i = 0; i < BF_CLUSTER_SECTORS; i = j) {
+            if (!bf_overlay_is_dirty(e, i)) {
+                j = i + 1;
+                continue;
+            }
+            for(j = i + 1; j < BF_CLUSTER_SECTORS &&
+                    bf_overlay_is_dirty(e, j); j++)
+                continue;
+            bf_snapshot_write(bf, (c << BF_CLUSTER_BITS) + i,
+                              buf + i * SECTOR_SIZE, j - i);
         }
-        break;
     }
+    if (ret < 0)
+        perror(filename);
+    free(index);
+    close(fd);
+    return ret;
 }
 
-static uint32_t virtio_mmio_read(VIRTIODevice *opaque, uint32_t offset, int size_log2)
+/* save the written sectors to filename. Return 1 if the file is
+   written, 0 if nothing can be written in this mode, < 0 if error. No
+   request must be in progress. */
+int block_device_checkpoint(BlockDevice *bs, const char *filename)
 {
-    VIRTIODevice *s = (VIRTIODevice*)opaque;
-    uint32_t val;
+    BlockDeviceFile *bf = bs->opaque;
 
-    if (offset >= VIRTIO_MMIO_CONFIG) {
-        return virtio_config_read(s, offset - VIRTIO_MMIO_CONFIG, size_log2);
+    switch(bf->mode) {
+    case BF_MODE_RO:
+    case BF_MODE_MMAP:
+        return 0;
+    case BF_MODE_SNAPSHOT:
+        return bf_snapshot_save(bf, filename) < 0 ? -1 : 1;
+    case BF_MODE_OVERLAY:
+        if (bf_flush(bf) < 0 || bf_clone_file(bf->overlay->fd, filename) < 0)
+            return -1;
+        return 1;
+    default:
+        /* the image itself is modified */
+        fprintf(stderr, "block device: the rw and mmap-snapshot modes cannot be checkpointed\n");
+        return -1;
     }
+}
 
-    if (size_log2 == 2) {
-        switch(offset) {
-        case VIRTIO_MMIO_MAGIC_VALUE:
-            val = 0x74726976;
-            break;
-        case VIRTIO_MMIO_VERSION:
-            val = 2;
-            break;
-        case VIRTIO_MMIO_DEVICE_ID:
-            val = s->device_id;
-            break;
-        case VIRTIO_MMIO_VENDOR_ID:
-            val = s->vendor_id;
-            break;
-        case VIRTIO_MMIO_DEVICE_FEATURES:
-            switch(s->device_features_sel) {
-            case 0:
-                val = s->device_features;
-                break;
-            case 1:
-                val = 1; /* version 1 */
-                break;
-            default:
-                val = 0;
-                break;
+/* restore the written sectors saved by block_device_checkpoint(),
+   NULL if it wrote no file. The file is left unchanged so that it can
+   be restored again. Return < 0 if error. */
+int block_device_restore(BlockDevice *bs, const char *filename)
+{
+    BlockDeviceFile *bf = bs->opaque;
+    BlockDeviceOverlay *ov;
+    char *ov_filename;
+    uint64_t sec;
+    int fd, ret;
+
+    switch(bf->mode) {
+    case BF_MODE_RO:
+    case BF_MODE_MMAP:
+        ret = filename ? -1 : 0;
+        break;
+    case BF_MODE_SNAPSHOT:
+        ret = bf_snapshot_load(bf, filename);
+        break;
+    case BF_MODE_OVERLAY:
+        /* the working overlay becomes a clone of the saved one */
+        ov = bf->overlay;
+        ov_filename = ov->filename;
+        munmap(ov->map, ov->map_size);
+        close(ov->fd);
+        free(ov);
+        bf->overlay = NULL;
+        if (filename) {
+            fd = open(filename, O_RDONLY);
+            if (fd < 0) {
+                perror(filename);
+                ret = -1;
+            } else {
+                ret = bf_clone_file(fd, ov_filename);
+                close(fd);
             }
-            break;
-        case VIRTIO_MMIO_DEVICE_FEATURES_SEL:
-            val = s->device_features_sel;
-            break;
-        case VIRTIO_MMIO_QUEUE_SEL:
-            val = s->queue_sel;
-            break;
-        case VIRTIO_MMIO_QUEUE_NUM_MAX:
-            val = MAX_QUEUE_NUM;
-            break;
-        case VIRTIO_MMIO_QUEUE_NUM:
-            val = s->queue[s->queue_sel].num;
-            break;
-        case VIRTIO_MMIO_QUEUE_DESC_LOW:
-            val = s->queue[s->queue_sel].desc_addr;
-            break;
-        case VIRTIO_MMIO_QUEUE_AVAIL_LOW:
-            val = s->queue[s->queue_sel].avail_addr;
-            break;
-        case VIRTIO_MMIO_QUEUE_USED_LOW:
-            val = s->queue[s->queue_sel].used_addr;
-            break;
-#if VIRTIO_ADDR_BITS == 64
-        case VIRTIO_MMIO_QUEUE_DESC_HIGH:
-            val = s->queue[s->queue_sel].desc_addr >> 32;
-            break;
-        case VIRTIO_MMIO_QUEUE_AVAIL_HIGH:
-            val = s->queue[s->queue_sel].avail_addr >> 32;
-            break;
-        case VIRTIO_MMIO_QUEUE_USED_HIGH:
-            val = s->queue[s->queue_sel].used_addr >> 32;
-            break;
-#endif
-        case VIRTIO_MMIO_QUEUE_READY:
-            val = s->queue[s->queue_sel].ready;
-            break;
-        case VIRTIO_MMIO_INTERRUPT_STATUS:
-            val = s->int_status;
-            break;
-        case VIRTIO_MMIO_STATUS:
-            val = s->status;
-            break;
-        case VIRTIO_MMIO_CONFIG_GENERATION:
-            val = 0;
-            break;
-        default:
-            val = 0;
-            break;
+        } else {
+            ret = truncate(ov_filename, 0);
         }
-    } else {
-        val = 0;
+        if (block_device_open_overlay(bs, ov_filename) < 0)
+            ret = -1;
+        free(ov_filename);
+        break;
+    default:
+        ret = -1;
+        break;
     }
-#ifdef DEBUG_VIRTIO
-    {
-        printf("virto_mmio_read: offset=0x%x val=0x%x size=%d\n", 
-               offset, val, 1 << size_log2);
+    if (bf->rcache) {
+        for(sec = 0; sec < (uint64_t)bf->nb_sectors; sec += 1 << 30)
+            bf_rcache_invalidate(bf->rcache, sec,
+                                 min_int(bf->nb_sectors - sec, 1 << 30));
     }
-#endif
-    return val;
+    return ret;
 }
 
-#if VIRTIO_ADDR_BITS == 64
-static void set_low32(virtio_phys_addr_t *paddr, uint32_t val)
+static int bf_cow_read(BlockDeviceFile *bf, uint64_t sector_num,
+                       uint8_t *buf, int n)
 {
-    *paddr = (*paddr & ~(virtio_phys_addr_t)0xffffffff) | val;
+    if (bf->overlay)
+        return bf_overlay_read(bf, sector_num, buf, n);
+    if (bf->snapshot)
+        return bf_snapshot_read(bf, sector_num, buf, n);
+    return -1;
 }
 
-static void set_high32(virtio_phys_addr_t *paddr, uint32_t val)
+static int bf_cow_write(BlockDeviceFile *bf, uint64_t sector_num,
+                        const uint8_t *buf, int n)
 {
-    *paddr = (*paddr & 0xffffffff) | ((virtio_phys_addr_t)val << 32);
+    if (bf->overlay)
+        return bf_overlay_write(bf, sector_num, buf, n);
+    if (bf->snapshot)
+        return bf_snapshot_write(bf, sector_num, buf, n);
+    return -1;
 }
-#else
-static void set_low32(virtio_phys_addr_t *paddr, uint32_t val)
+
+static void bf_cow_drop(BlockDeviceFile *bf, uint64_t sector_num, int n)
 {
-    *paddr = val;
+    if (bf->overlay)
+        bf_overlay_drop(bf->overlay, sector_num, n);
+    else if (bf->snapshot)
+        bf_snapshot_drop(bf->snapshot, sector_num, n);
 }
-#endif
 
-static void virtio_mmio_write(VIRTIODevice *opaque, uint32_t offset,
-                              uint32_t val, int size_log2)
+/* write-back cache (BF_MODE_RW with BF_CACHE_WRITEBACK): the writes are
+   kept in the cluster table and written back to the image on flush,
+   when there is too much dirty data or when it is too old. */
+
+#define BF_WRITEBACK_MAX_DIRTY ((64 << 20) / SECTOR_SIZE) /* in sectors */
+#define BF_WRITEBACK_DELAY_MS 1000
+#define BF_WRITEBACK_MAX_IOV 256
+
+static int64_t bf_get_time_ms(void)
 {
-    VIRTIODevice *s = (VIRTIODevice*)opaque;
-    
-#ifdef DEBUG_VIRTIO
-    {
-        printf("virto_mmio_write: offset=0x%x val=0x%x size=%d\n",
-               offset, val, 1 << size_log2);
-    }
-#endif
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    if (offset >= VIRTIO_MMIO_CONFIG) {
-        virtio_config_write(s, offset - VIRTIO_MMIO_CONFIG, val, size_log2);
-        return;
-    }
+/* write the dirty sectors to the image. The dirty runs which are
+   contiguous on disk are written with a single pwritev. Return < 0 if
+   error, in which case the data stays in the cache. */
+static int bf_writeback(BlockDeviceFile *bf)
+{
+    BlockDeviceSnapshot *sn = bf->snapshot;
+    struct iovec iov[BF_WRITEBACK_MAX_IOV];
+    BlockDeviceCluster *l2, *c;
+    uint64_t sec, run_start, run_end;
+    int l1, l2_idx, i, j, iovcnt;
 
-    if (size_log2 == 2) {
-        switch(offset) {
-        case VIRTIO_MMIO_DEVICE_FEATURES_SEL:
-            s->device_features_sel = val;
-            break;
-        case VIRTIO_MMIO_QUEUE_SEL:
-            if (val < MAX_QUEUE)
-                s->queue_sel = val;
-            break;
-        case VIRTIO_MMIO_QUEUE_NUM:
-            if ((val & (val - 1)) == 0 && val > 0) {
-                s->queue[s->queue_sel].num = val;
-            }
-            break;
-        case VIRTIO_MMIO_QUEUE_DESC_LOW:
-            set_low32(&s->queue[s->queue_sel].desc_addr, val);
-            break;
-        case VIRTIO_MMIO_QUEUE_AVAIL_LOW:
-            set_low32(&s->queue[s->queue_sel].avail_addr, val);
-            break;
-        case VIRTIO_MMIO_QUEUE_USED_LOW:
-            set_low32(&s->queue[s->queue_sel].used_addr, val);
-            break;
-#if VIRTIO_ADDR_BITS == 64
-        case VIRTIO_MMIO_QUEUE_DESC_HIGH:
-            set_high32(&s->queue[s->queue_sel].desc_addr, val);
-            break;
-        case VIRTIO_MMIO_QUEUE_AVAIL_HIGH:
-            set_high32(&s->queue[s->queue_sel].avail_addr, val);
-            break;
-        case VIRTIO_MMIO_QUEUE_USED_HIGH:
-            set_high32(&s->queue[s->queue_sel].used_addr, val);
-            break;
-#endif
-        case VIRTIO_MMIO_STATUS:
-            s->status = val;
-            if (val == 0) {
-                /* reset */
-                set_irq(s->irq, 0);
-                virtio_reset(s);
-            }
-            break;
-        case VIRTIO_MMIO_QUEUE_READY:
-            s->queue[s->queue_sel].ready = val & 1;
-            break;
-        case VIRTIO_MMIO_QUEUE_NOTIFY:
-            if (val < MAX_QUEUE)
-#ifdef DEBUG_VIRTIO
-            {
-        printf("queue_notify on qidx %d invoked by MMIO write begin.\n", val);
-#endif
-                queue_notify(s, val);
-#ifdef DEBUG_VIRTIO
-        printf("queue_notify on qidx %d invoked by MMIO write finished.\n", val);
-            }
-#endif
-            break;
-        case VIRTIO_MMIO_INTERRUPT_ACK:
-            s->int_status &= ~val;
-            if (s->int_status == 0) {
-                set_irq(s->irq, 0);
+    if (sn->nb_dirty_sectors == 0)
+        return 0;
+    iovcnt = 0;
+    run_start = run_end = 0;
+    for(l1 = 0; l1 < sn->l1_size; l1++) {
+        l2 = sn->l1_table[l1];
+        if (!l2)
+            continue;
+        for(l2_idx = 0; l2_idx < BF_L2_SIZE; l2_idx++) {
+            c = &l2[l2_idx];
+            if (!c->data)
+                continue;
+            sec = ((uint64_t)l1 * BF_L2_SIZE + l2_idx) << BF_CLUSTER_BITS;
+            for(i = 0; i < BF_CLUSTER_SECTORS; i = j) {
+                if (!bf_cluster_is_dirty(c, i)) {
+                    j = i + 1;
+                    continue;
+                }
+                for(j = i + 1; j < BF_CLUSTER_SECTORS &&
+                        bf_cluster_is_dirty(c, j); j++)
+                    continue;
+                if (iovcnt > 0 &&
+                    (run_end != sec + i || iovcnt == BF_WRITEBACK_MAX_IOV)) {
+                    if (bf_pwritev(bf, iov, iovcnt,
+                                   run_start * SECTOR_SIZE) < 0)
+                        return -1;
+                    iovcnt = 0;
+                }
+                if (iovcnt == 0)
+                    run_start = sec + i;
+                iov[iovcnt].iov_base = c->data + i * SECTOR_SIZE;
+                iov[iovcnt].iov_len = (j - i) * SECTOR_SIZE;
+                iovcnt++;
+                run_end = sec + j;
             }
-            break;
         }
     }
+    if (iovcnt > 0 &&
+        bf_pwritev(bf, iov, iovcnt, run_start * SECTOR_SIZE) < 0)
+        return -1;
+
+    /* all the data is on disk: release the clusters */
+    for(l1 = 0; l1 < sn->l1_size; l1++) {
+        l2 = sn->l1_table[l1];
+        if (!l2)
+            continue;
+        for(l2_idx = 0; l2_idx < BF_L2_SIZE; l2_idx++) {
+            if (l2[l2_idx].data)
+                bf_snapshot_release(sn, &l2[l2_idx]);
+        }
+    }
+    return 0;
 }
 
-void virtio_set_debug(VIRTIODevice *s, int debug)
+/* make the completed writes persistent */
+static int bf_flush(BlockDeviceFile *bf)
 {
-    s->debug = debug;
+    switch(bf->mode) {
+    case BF_MODE_RW:
+        if (bf->snapshot && bf_writeback(bf) < 0)
+            return -1;
+        return fdatasync(bf->fd) < 0 ? -1 : 0;
+    case BF_MODE_OVERLAY:
+        if (fdatasync(bf->overlay->fd) < 0 ||
+            msync(bf->overlay->map, bf->overlay->map_size, MS_SYNC) < 0)
+            return -1;
+        return 0;
+    default:
+        /* nothing is persistent */
+        return 0;
+    }
 }
 
-static void virtio_config_change_notify(VIRTIODevice *s)
+static int bf_cached_write(BlockDeviceFile *bf, uint64_t sector_num,
+                           const uint8_t *buf, int n)
 {
-    /* INT_CONFIG interrupt */
-    s->int_status |= 2;
-    set_irq(s->irq, 1);
-}
+    BlockDeviceSnapshot *sn = bf->snapshot;
 
-/*********************************************************************/
-/* block device */
+    if (bf->mode != BF_MODE_RW)
+        return bf_cow_write(bf, sector_num, buf, n);
+    if (sn->nb_dirty_sectors == 0)
+        sn->dirty_time = bf_get_time_ms();
+    if (bf_snapshot_write(bf, sector_num, buf, n) < 0)
+        return -1;
+    if (sn->nb_dirty_sectors >= BF_WRITEBACK_MAX_DIRTY)
+        return bf_writeback(bf);
+    return 0;
+}
 
-typedef struct {
-    uint32_t type;
+/* synchronous I/O of n sectors. The file is only accessed with
+   positional I/O so that the worker threads can use it concurrently. */
+static int bf_readv_uncached(BlockDeviceFile *bf, uint64_t sector_num,
+                             const struct iovec *iov, int iovcnt, int n)
+{
     uint8_t *buf;
-    int write_size;
-    int queue_idx;
-    int desc_idx;
-} BlockRequest;
+    int ret;
 
-struct VIRTIOBlockDevice : public VIRTIODevice {
-public:
-    BlockDevice *bs;
+    if (bf->map) {
+        /* copied straight from the mapped image */
+        if (bf_out_of_range(bf, sector_num, n))
+            return -1;
+        iov_from_buf(iov, iovcnt, bf->map + sector_num * SECTOR_SIZE);
+        return 0;
+    }
+    if (!bf->snapshot && !bf->overlay)
+        return bf_preadv(bf, iov, iovcnt, sector_num * SECTOR_SIZE);
+    if (iovcnt == 1)
+        return bf_cow_read(bf, sector_num, (uint8_t *)iov[0].iov_base, n);
+    buf = (uint8_t *)malloc(n * SECTOR_SIZE);
+    ret = bf_cow_read(bf, sector_num, buf, n);
+    if (ret == 0)
+        iov_from_buf(iov, iovcnt, buf);
+    free(buf);
+    return ret;
+}
 
-    BOOL req_in_progress;
-    BlockRequest req; /* request in progress */
-} ;
+/* read cache: LRU cache of image clusters filled by the sequential
+   read streams. A stream is detected when a read starts where a
+   recent one ended. The clusters following it are read ahead with a
+   window which doubles at each sequential read: by a worker thread if
+   the I/O is asynchronous, otherwise together with the missed
+   clusters so that a single host read serves the whole window. The
+   writes invalidate the cached clusters. */
+
+#define BF_RA_STREAMS 4 /* concurrent sequential streams */
+#define BF_RA_MIN_CLUSTERS 2
+#define BF_RA_MAX_CLUSTERS 16 /* 1 MiB */
+#define BF_RC_MAX_FILL 64 /* clusters read at once */
+
+typedef enum {
+    BF_RC_FREE,
+    BF_RC_LOADING, /* being read, not usable yet */
+    BF_RC_VALID,
+} BlockDeviceCacheStateEnum;
+
+typedef struct BlockDeviceCacheEntry {
+    struct list_head link; /* LRU list, most recent first */
+    struct BlockDeviceCacheEntry *hash_next;
+    BlockDeviceCacheStateEnum state;
+    uint64_t cluster_idx;
+    uint64_t gen; /* BF_RC_LOADING: cache generation when reserved */
+    uint8_t *data; /* BF_CLUSTER_SIZE bytes */
+} BlockDeviceCacheEntry;
 
 typedef struct {
-    uint32_t type;
-    uint32_t ioprio;
-    uint64_t sector_num;
-} BlockRequestHeader;
+    uint64_t next_sector; /* sector following the last read */
+    int window; /* read-ahead window in clusters, 0 if not sequential */
+    int64_t last_use;
+} BlockDeviceReadStream;
+
+struct BlockDeviceReadCache {
+    /* protects the entries, which are also used by the worker threads */
+    pthread_mutex_t lock;
+    int nb_entries;
+    BlockDeviceCacheEntry *entries;
+    uint8_t *data;
+    struct list_head lru;
+    BlockDeviceCacheEntry **hash;
+    int hash_mask;
+    uint64_t nb_clusters; /* full clusters of the image */
+    /* incremented when cached data is invalidated, so that the clusters
+       read during a write are not used */
+    uint64_t gen;
+    /* only accessed by the simulation thread */
+    BlockDeviceReadStream streams[BF_RA_STREAMS];
+    int64_t use_count;
+};
 
-#define VIRTIO_BLK_T_IN          0
-#define VIRTIO_BLK_T_OUT         1
-#define VIRTIO_BLK_T_FLUSH       4
-#define VIRTIO_BLK_T_FLUSH_OUT   5
+static inline int bf_rcache_hash(BlockDeviceReadCache *rc, uint64_t cluster_idx)
+{
+    return (cluster_idx * 0x9e3779b97f4a7c15ULL >> 32) & rc->hash_mask;
+}
 
-#define VIRTIO_BLK_S_OK     0
-#define VIRTIO_BLK_S_IOERR  1
-#define VIRTIO_BLK_S_UNSUPP 2
+static BlockDeviceCacheEntry *bf_rcache_lookup(BlockDeviceReadCache *rc,
+                                               uint64_t cluster_idx)
+{
+    BlockDeviceCacheEntry *e;
 
-#define SECTOR_SIZE 512
+    for(e = rc->hash[bf_rcache_hash(rc, cluster_idx)]; e; e = e->hash_next) {
+        if (e->cluster_idx == cluster_idx)
+            return e;
+    }
+    return NULL;
+}
 
-static void virtio_block_req_end(VIRTIODevice *s, int ret)
+/* remove the entry from the cache and make it the next one reused */
+static void bf_rcache_drop(BlockDeviceReadCache *rc, BlockDeviceCacheEntry *e)
 {
-    VIRTIOBlockDevice *s1 = (VIRTIOBlockDevice *)s;
-    int write_size;
-    int queue_idx = s1->req.queue_idx;
-    int desc_idx = s1->req.desc_idx;
-    uint8_t *buf, buf1[1];
-#ifdef DEBUG_VIRTIO
-    printf("Entering req end func... ret = %d, req type =in?%d\n", ret, s1->req.type);
-#endif 
-    switch(s1->req.type) {
-    case VIRTIO_BLK_T_IN:
-        write_size = s1->req.write_size;
-        buf = s1->req.buf;
-        if (ret < 0) {
-            buf[write_size - 1] = VIRTIO_BLK_S_IOERR;
-        } else {
-            buf[write_size - 1] = VIRTIO_BLK_S_OK;
-        }
-        memcpy_to_queue(s, queue_idx, desc_idx, 0, buf, write_size);
-        free(buf);
-        virtio_consume_desc(s, queue_idx, desc_idx, write_size);
-        break;
-    case VIRTIO_BLK_T_OUT:
-        if (ret < 0)
-            buf1[0] = VIRTIO_BLK_S_IOERR;
+    BlockDeviceCacheEntry **pe;
+
+    for(pe = &rc->hash[bf_rcache_hash(rc, e->cluster_idx)]; *pe != e;
+        pe = &(*pe)->hash_next)
+        continue;
+    *pe = e->hash_next;
+    e->state = BF_RC_FREE;
+    list_del(&e->link);
+    list_add_tail(&e->link, &rc->lru);
+}
+
+/* reserve an entry for the cluster, evicting the least recently used
+   one. Return NULL if all the entries are being read. */
+static BlockDeviceCacheEntry *bf_rcache_alloc(BlockDeviceReadCache *rc,
+                                              uint64_t cluster_idx)
+{
+    BlockDeviceCacheEntry *e;
+    struct list_head *el;
+    int h;
+
+    list_for_each_prev(el, &rc->lru) {
+        e = list_entry(el, BlockDeviceCacheEntry, link);
+        if (e->state == BF_RC_LOADING)
+            continue;
+        if (e->state == BF_RC_VALID)
+            bf_rcache_drop(rc, e);
+        e->state = BF_RC_LOADING;
+        e->cluster_idx = cluster_idx;
+        e->gen = rc->gen;
+        h = bf_rcache_hash(rc, cluster_idx);
+        e->hash_next = rc->hash[h];
+        rc->hash[h] = e;
+        list_del(&e->link);
+        list_add(&e->link, &rc->lru);
+        return e;
+    }
+    return NULL;
+}
+
+/* reserve the entries of the missing clusters from first to last. The
+   first missing cluster is returned in *pfirst, and iov is set to the
+   buffers of the contiguous reserved clusters. Return their number. */
+static int bf_rcache_reserve(BlockDeviceReadCache *rc, uint64_t first,
+                             uint64_t last, uint64_t *pfirst,
+                             struct iovec *iov)
+{
+    BlockDeviceCacheEntry *e;
+    uint64_t c;
+    int cnt;
+
+    if (last >= rc->nb_clusters) {
+        if (rc->nb_clusters == 0)
+            return 0;
+        last = rc->nb_clusters - 1;
+    }
+    pthread_mutex_lock(&rc->lock);
+    while (first <= last && bf_rcache_lookup(rc, first))
+        first++;
+    cnt = 0;
+    for(c = first; c <= last && cnt < BF_RC_MAX_FILL; c++) {
+        if (bf_rcache_lookup(rc, c))
+            break;
+        e = bf_rcache_alloc(rc, c);
+        if (!e)
+            break;
+        iov[cnt].iov_base = e->data;
+        iov[cnt].iov_len = BF_CLUSTER_SIZE;
+        cnt++;
+    }
+    pthread_mutex_unlock(&rc->lock);
+    *pfirst = first;
+    return cnt;
+}
+
+/* the reserved clusters were read (ret = 0) or not */
+static void bf_rcache_fill_end(BlockDeviceReadCache *rc, uint64_t first,
+                               int cnt, int ret)
+{
+    BlockDeviceCacheEntry *e;
+    int i;
+
+    pthread_mutex_lock(&rc->lock);
+    for(i = 0; i < cnt; i++) {
+        e = bf_rcache_lookup(rc, first + i);
+        if (!e || e->state != BF_RC_LOADING)
+            continue;
+        if (ret == 0 && e->gen == rc->gen)
+            e->state = BF_RC_VALID;
         else
-            buf1[0] = VIRTIO_BLK_S_OK;
-        memcpy_to_queue(s, queue_idx, desc_idx, 0, buf1, sizeof(buf1));
-        virtio_consume_desc(s, queue_idx, desc_idx, 1);
-        break;
-    default:
-        abort();
+            bf_rcache_drop(rc, e);
     }
+    pthread_mutex_unlock(&rc->lock);
 }
 
-static void virtio_block_req_cb(VIRTIODevice *opaque, int ret)
+/* copy the sectors from the cache if they are all present. Return
+   FALSE otherwise. */
+static BOOL bf_rcache_copy(BlockDeviceReadCache *rc, uint64_t sector_num,
+                           int n, const struct iovec *iov, int iovcnt)
 {
-    VIRTIODevice *s = opaque;
-    VIRTIOBlockDevice *s1 = (VIRTIOBlockDevice *)s;
+    BlockDeviceCacheEntry *e;
+    uint64_t c, first, last, start, end;
+    BOOL ret = FALSE;
 
-    virtio_block_req_end(s, ret);
-    
-    s1->req_in_progress = FALSE;
+    first = sector_num >> BF_CLUSTER_BITS;
+    last = (sector_num + n - 1) >> BF_CLUSTER_BITS;
+    if (n <= 0 || last >= rc->nb_clusters)
+        return FALSE;
+    pthread_mutex_lock(&rc->lock);
+    for(c = first; c <= last; c++) {
+        e = bf_rcache_lookup(rc, c);
+        if (!e || e->state != BF_RC_VALID)
+            goto done;
+    }
+    for(c = first; c <= last; c++) {
+        e = bf_rcache_lookup(rc, c);
+        start = c << BF_CLUSTER_BITS;
+        if (start < sector_num)
+            start = sector_num;
+        end = (c + 1) << BF_CLUSTER_BITS;
+        if (end > sector_num + n)
+            end = sector_num + n;
+        iov_from_buf_at(iov, iovcnt, (start - sector_num) * SECTOR_SIZE,
+                        e->data + (start & (BF_CLUSTER_SECTORS - 1)) *
+                        SECTOR_SIZE,
+                        (end - start) * SECTOR_SIZE);
+        list_del(&e->link);
+        list_add(&e->link, &rc->lru);
+    }
+    ret = TRUE;
+ done:
+    pthread_mutex_unlock(&rc->lock);
+    return ret;
+}
 
-    /* handle next requests */
-    queue_notify((VIRTIODevice *)s, s1->req.queue_idx);
+/* forget the cached clusters overlapping the sectors */
+static void bf_rcache_invalidate(BlockDeviceReadCache *rc,
+                                 uint64_t sector_num, int n)
+{
+    BlockDeviceCacheEntry *e;
+    uint64_t c, first, last;
+    int i;
+
+    if (n <= 0)
+        return;
+    first = sector_num >> BF_CLUSTER_BITS;
+    last = (sector_num + n - 1) >> BF_CLUSTER_BITS;
+    pthread_mutex_lock(&rc->lock);
+    rc->gen++;
+    if (last - first >= (uint64_t)rc->nb_entries) {
+        for(i = 0; i < rc->nb_entries; i++) {
+            e = &rc->entries[i];
+            if (e->state == BF_RC_VALID && e->cluster_idx >= first &&
+                e->cluster_idx <= last)
+                bf_rcache_drop(rc, e);
+        }
+    } else {
+        for(c = first; c <= last; c++) {
+            e = bf_rcache_lookup(rc, c);
+            if (e && e->state == BF_RC_VALID)
+                bf_rcache_drop(rc, e);
+        }
+    }
+    pthread_mutex_unlock(&rc->lock);
 }
 
-/* XXX: handle async I/O */
-static int virtio_block_recv_request(VIRTIODevice *s, int queue_idx,
-                                     int desc_idx, int read_size,
-                                     int write_size)
+/* return the read-ahead window (in clusters) of the stream the read
+   belongs to, or 0 if it is not sequential */
+static int bf_ra_update(BlockDeviceReadCache *rc, uint64_t sector_num, int n)
 {
-    VIRTIOBlockDevice *s1 = (VIRTIOBlockDevice *)s;
-    BlockDevice *bs = s1->bs;
-    BlockRequestHeader h;
-    uint8_t *buf;
-    int len, ret;
+    BlockDeviceReadStream *st, *lru;
+    int i;
 
-#ifdef DEBUG_VIRTIO
-        printf("Entering recv req function ... qidx = %d, desc_idx = %d, read_size = %d, write_size = %d\n",
-            queue_idx, desc_idx, read_size, write_size);
-#endif
+    rc->use_count++;
+    lru = &rc->streams[0];
+    for(i = 0; i < BF_RA_STREAMS; i++) {
+        st = &rc->streams[i];
+        if (st->last_use != 0 && st->next_sector == sector_num) {
+            if (st->window == 0)
+                st->window = BF_RA_MIN_CLUSTERS;
+            else
+                st->window = min_int(st->window * 2, BF_RA_MAX_CLUSTERS);
+            st->next_sector = sector_num + n;
+            st->last_use = rc->use_count;
+            return st->window;
+        }
+        if (st->last_use < lru->last_use)
+            lru = st;
+    }
+    /* new stream */
+    lru->next_sector = sector_num + n;
+    lru->window = 0;
+    lru->last_use = rc->use_count;
+    return 0;
+}
 
-    if (s1->req_in_progress)
-#ifdef DEBUG_VIRTIO
-    {
-        printf("Request in progress, exit recv req function.\n");
+/* read through the read cache. If ra_window > 0, the missing clusters
+   and the ra_window clusters following the read are loaded in the
+   cache. */
+static int bf_readv(BlockDeviceFile *bf, uint64_t sector_num,
+                    const struct iovec *iov, int iovcnt, int n, int ra_window)
+{
+    BlockDeviceReadCache *rc = bf->rcache;
+    struct iovec iov1[BF_RC_MAX_FILL];
+    uint64_t first, last;
+    int cnt;
+
+    if (!rc)
+        return bf_readv_uncached(bf, sector_num, iov, iovcnt, n);
+    if (bf_rcache_copy(rc, sector_num, n, iov, iovcnt))
+        return 0;
+    if (ra_window > 0 && n > 0) {
+        last = ((sector_num + n - 1) >> BF_CLUSTER_BITS) + ra_window;
+        cnt = bf_rcache_reserve(rc, sector_num >> BF_CLUSTER_BITS, last,
+                                &first, iov1);
+        if (cnt > 0) {
+            bf_rcache_fill_end(rc, first, cnt,
+                               bf_readv_uncached(bf, first << BF_CLUSTER_BITS,
+                                                 iov1, cnt,
+                                                 cnt * BF_CLUSTER_SECTORS));
+        }
+        if (bf_rcache_copy(rc, sector_num, n, iov, iovcnt))
+            return 0;
+    }
+    return bf_readv_uncached(bf, sector_num, iov, iovcnt, n);
+}
+
+/* cache the sectors of the image with size_mb MiB of memory. Return
+   < 0 if error. */
+int block_device_set_read_cache(BlockDevice *bs, int size_mb)
+{
+    BlockDeviceFile *bf = bs->opaque;
+    BlockDeviceReadCache *rc;
+    int i, hash_size;
+
+    /* the mapped images are read from the host page cache */
+    if (size_mb <= 0 || bf->rcache || bf->map)
+        return 0;
+    rc = (BlockDeviceReadCache *)mallocz(sizeof(*rc));
+    rc->nb_entries = (int64_t)size_mb * (1 << 20) / BF_CLUSTER_SIZE;
+    if (posix_memalign((void **)&rc->data, 4096,
+                       (size_t)rc->nb_entries * BF_CLUSTER_SIZE) != 0) {
+        free(rc);
         return -1;
     }
-#else
+    rc->entries = (BlockDeviceCacheEntry *)mallocz(sizeof(rc->entries[0]) *
+                                                    rc->nb_entries);
+    init_list_head(&rc->lru);
+    for(i = 0; i < rc->nb_entries; i++) {
+        rc->entries[i].data = rc->data + (size_t)i * BF_CLUSTER_SIZE;
+        list_add_tail(&rc->entries[i].link, &rc->lru);
+    }
+    for(hash_size = 1; hash_size < rc->nb_entries * 2; hash_size <<= 1)
+        continue;
+    rc->hash = (BlockDeviceCacheEntry **)mallocz(sizeof(rc->hash[0]) *
+                                                 hash_size);
+    rc->hash_mask = hash_size - 1;
+    rc->nb_clusters = bf->nb_sectors >> BF_CLUSTER_BITS;
+    pthread_mutex_init(&rc->lock, NULL);
+    bf->rcache = rc;
+    return 0;
+}
+
+static int bf_writev(BlockDeviceFile *bf, uint64_t sector_num,
+                     const struct iovec *iov, int iovcnt, int n)
+{
+    uint8_t *buf;
+    int ret;
+
+    switch(bf->mode) {
+    case BF_MODE_RO:
+    case BF_MODE_MMAP:
+        ret = -1; /* error */
+        break;
+    case BF_MODE_RW:
+        if (!bf->snapshot) {
+            ret = bf_pwritev(bf, iov, iovcnt, sector_num * SECTOR_SIZE);
+            break;
+        }
+        /* fall thru: write-back cache */
+    case BF_MODE_SNAPSHOT:
+    case BF_MODE_OVERLAY:
+        if (iovcnt == 1) {
+            ret = bf_cached_write(bf, sector_num,
+                                  (const uint8_t *)iov[0].iov_base, n);
+            break;
+        }
+        buf = (uint8_t *)malloc(n * SECTOR_SIZE);
+        iov_to_buf(buf, iov, iovcnt);
+        ret = bf_cached_write(bf, sector_num, buf, n);
+        free(buf);
+        break;
+    case BF_MODE_MMAP_SNAPSHOT:
+        /* the private mapping keeps the modified pages */
+        if (bf_out_of_range(bf, sector_num, n))
+            return -1;
+        iov_to_buf(bf->map + sector_num * SECTOR_SIZE, iov, iovcnt);
+        ret = 0;
+        break;
+    default:
+        abort();
+    }
+    /* after the write, so that a concurrent read ahead is discarded */
+    if (bf->rcache)
+        bf_rcache_invalidate(bf->rcache, sector_num, n);
+    return ret;
+}
+
+/* used when the host cannot zero a range without writing it */
+static uint8_t bf_zero_cluster[BF_CLUSTER_SIZE]
+    __attribute__((aligned(4096)));
+
+static int bf_write_zeroes(BlockDeviceFile *bf, uint64_t sector_num, int n)
+{
+    struct iovec iov;
+    int l;
+
+    iov.iov_base = bf_zero_cluster;
+    while (n > 0) {
+        l = min_int(n, BF_CLUSTER_SECTORS);
+        iov.iov_len = l * SECTOR_SIZE;
+        if (bf_writev(bf, sector_num, &iov, 1, l) < 0)
+            return -1;
+        sector_num += l;
+        n -= l;
+    }
+    return 0;
+}
+
+/* discard (zeroes = FALSE) or zero n sectors. The raw images use hole
+   punching so that the freed blocks are given back to the host file
+   system. */
+static int bf_discard(BlockDeviceFile *bf, uint64_t sector_num, int n,
+                      BOOL zeroes, BOOL unmap)
+{
+    off_t pos, len;
+    long page_size;
+    uint64_t start, end;
+
+    if (bf_out_of_range(bf, sector_num, n))
         return -1;
-#endif 
-    if (memcpy_from_queue(s, &h, queue_idx, desc_idx, 0, sizeof(h)) < 0)
-        return 0;
-    s1->req.type = h.type;
-    s1->req.queue_idx = queue_idx;
-    s1->req.desc_idx = desc_idx;
-#ifdef DEBUG_VIRTIO
-    printf("req in?=%d\n",h.type);
-#endif
-    switch(h.type) {
-    case VIRTIO_BLK_T_IN:
-        s1->req.buf = (uint8_t*)malloc(write_size);
-        s1->req.write_size = write_size;
-        ret = bs->read_async(bs, h.sector_num, s1->req.buf, 
-                             (write_size - 1) / SECTOR_SIZE,
-                             virtio_block_req_cb, s);
-        if (ret > 0) {
-            /* asyncronous read */
-            s1->req_in_progress = TRUE;
-        } else {
-            virtio_block_req_end(s, ret);
+    switch(bf->mode) {
+    case BF_MODE_RO:
+    case BF_MODE_MMAP:
+        return -1;
+    case BF_MODE_RW:
+        /* the cached data must not be written back over the range */
+        if (bf->snapshot)
+            bf_snapshot_drop(bf->snapshot, sector_num, n);
+        pos = (off_t)sector_num * SECTOR_SIZE;
+        len = (off_t)n * SECTOR_SIZE;
+        if (!zeroes || unmap) {
+            if (fallocate(bf->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                          pos, len) == 0)
+                return 0;
+            if (!zeroes) {
+                /* discarding is only a hint */
+                return (errno == EOPNOTSUPP || errno == ENOSYS) ? 0 : -1;
+            }
         }
+        if (fallocate(bf->fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+                      pos, len) == 0)
+            return 0;
         break;
-    case VIRTIO_BLK_T_OUT:
-        assert(write_size >= 1);
-        len = read_size - sizeof(h);
-        buf = (uint8_t*)malloc(len);
-        memcpy_from_queue(s, buf, queue_idx, desc_idx, sizeof(h), len);
-        ret = bs->write_async(bs, h.sector_num, buf, len / SECTOR_SIZE,
-                              virtio_block_req_cb, s);
-        free(buf);
-        if (ret > 0) {
-            /* asyncronous write */
-            s1->req_in_progress = TRUE;
-        } else {
-            virtio_block_req_end(s, ret);
+    case BF_MODE_SNAPSHOT:
+    case BF_MODE_OVERLAY:
+        if (!zeroes) {
+            bf_cow_drop(bf, sector_num, n);
+            return 0;
         }
         break;
+    case BF_MODE_MMAP_SNAPSHOT:
+        if (zeroes) {
+            memset(bf->map + sector_num * SECTOR_SIZE, 0, n * SECTOR_SIZE);
+        } else {
+            /* the private copies of the whole pages are dropped */
+            page_size = sysconf(_SC_PAGESIZE);
+            start = (sector_num * SECTOR_SIZE + page_size - 1) &
+                ~(uint64_t)(page_size - 1);
+            end = ((sector_num + n) * SECTOR_SIZE) & ~(uint64_t)(page_size - 1);
+            if (start < end)
+                madvise(bf->map + start, end - start, MADV_DONTNEED);
+        }
+        return 0;
     default:
-        break;
+        abort();
+    }
+    return bf_write_zeroes(bf, sector_num, n);
+}
+
+static int bf_discard_ranges(BlockDeviceFile *bf, const BlockDeviceRange *ranges,
+                             int nb_ranges, BOOL zeroes, BOOL unmap)
+{
+    int i, ret;
+
+    for(i = 0; i < nb_ranges; i++) {
+        ret = bf_discard(bf, ranges[i].sector_num, ranges[i].nb_sectors,
+                         zeroes, unmap);
+        if (bf->rcache)
+            bf_rcache_invalidate(bf->rcache, ranges[i].sector_num,
+                                 ranges[i].nb_sectors);
+        if (ret < 0)
+            return -1;
     }
-#ifdef DEBUG_VIRTIO
-    printf("Exiting recv req function ... qidx = %d, desc_idx = %d, read_size = %d, write_size = %d\n",
-        queue_idx, desc_idx, read_size, write_size);
-#endif
     return 0;
 }
 
-VIRTIODevice *virtio_block_init(VIRTIOBusDef *bus, BlockDevice *bs, const simif_t* sim)
+/*********************************************************************/
+/* asynchronous I/O: the requests are executed by a pool of worker
+   threads. The completed requests are pushed on a lock-free list and
+   delivered to the device by bf_poll() from the simulation thread. */
+
+typedef enum {
+    BF_OP_READ,
+    BF_OP_WRITE,
+    BF_OP_FLUSH,
+    BF_OP_DISCARD,
+    BF_OP_WRITE_ZEROES,
+    BF_OP_WRITEBACK, /* background write-back, no completion callback */
+    BF_OP_PREFETCH, /* read ahead in the read cache, no completion callback */
+} BlockDeviceOpEnum;
+
+typedef struct BlockDeviceAIOReq {
+    struct BlockDeviceAIOReq *next;
+    BlockDeviceOpEnum op;
+    uint64_t sector_num;
+    int n;
+    int ret;
+    BlockDeviceCompletionFunc *cb;
+    void *opaque;
+    BOOL unmap; /* BF_OP_WRITE_ZEROES */
+    /* BF_OP_DISCARD and BF_OP_WRITE_ZEROES: the ranges are stored in
+       place of the iovec array */
+    BlockDeviceRange *ranges;
+    int iovcnt; /* or number of ranges */
+    struct iovec iov[0];
+} BlockDeviceAIOReq;
+
+struct BlockDeviceAIO {
+    BlockDeviceFile *bf;
+    int nb_threads;
+    pthread_t *threads;
+    pthread_mutex_t lock; /* protects the submission queue */
+    pthread_cond_t cond;
+    BlockDeviceAIOReq *submit_head;
+    BlockDeviceAIOReq **submit_tail;
+    /* serializes the accesses to the snapshot or overlay cluster table */
+    pthread_mutex_t snapshot_lock;
+    device_mailbox_t<BlockDeviceAIOReq> done; /* completed requests */
+    BOOL writeback_pending; /* a BF_OP_WRITEBACK request is queued */
+    BOOL stop; /* the threads exit once the queue is empty */
+};
+
+static void *bf_aio_worker(void *opaque)
 {
-    VIRTIOBlockDevice *s;
-    uint64_t nb_sectors;
+    BlockDeviceAIO *aio = (BlockDeviceAIO *)opaque;
+    BlockDeviceFile *bf = aio->bf;
+    BlockDeviceAIOReq *req;
+    BOOL snapshot = (bf->snapshot || bf->overlay);
 
-    s = (VIRTIOBlockDevice *)mallocz(sizeof(*s));
-    virtio_init(s, bus,
-                2, 8, virtio_block_recv_request, sim);
-    s->bs = bs;
-    
-    nb_sectors = bs->get_sector_count(bs);
-    put_le32(s->config_space, nb_sectors);
-    put_le32(s->config_space + 4, nb_sectors >> 32);
+    for(;;) {
+        pthread_mutex_lock(&aio->lock);
+        while (!aio->submit_head && !aio->stop)
+            pthread_cond_wait(&aio->cond, &aio->lock);
+        req = aio->submit_head;
+        if (!req) {
+            pthread_mutex_unlock(&aio->lock);
+            break;
+        }
+        aio->submit_head = req->next;
+        if (!aio->submit_head)
+            aio->submit_tail = &aio->submit_head;
+        pthread_mutex_unlock(&aio->lock);
+
+        if (snapshot)
+            pthread_mutex_lock(&aio->snapshot_lock);
+        switch(req->op) {
+        case BF_OP_READ:
+            req->ret = bf_readv(bf, req->sector_num, req->iov, req->iovcnt,
+                                req->n, 0);
+            break;
+        case BF_OP_WRITE:
+            req->ret = bf_writev(bf, req->sector_num, req->iov, req->iovcnt,
+                                 req->n);
+            break;
+        case BF_OP_FLUSH:
+            req->ret = bf_flush(bf);
+            break;
+        case BF_OP_DISCARD:
+        case BF_OP_WRITE_ZEROES:
+            req->ret = bf_discard_ranges(bf, req->ranges, req->iovcnt,
+                                         req->op == BF_OP_WRITE_ZEROES,
+                                         req->unmap);
+            break;
+        case BF_OP_WRITEBACK:
+            req->ret = bf_writeback(bf);
+            break;
+        case BF_OP_PREFETCH:
+            req->ret = bf_readv_uncached(bf, req->sector_num, req->iov,
+                                         req->iovcnt, req->n);
+            bf_rcache_fill_end(bf->rcache, req->sector_num >> BF_CLUSTER_BITS,
+                               req->iovcnt, req->ret);
+            break;
+        }
+        if (snapshot)
+            pthread_mutex_unlock(&aio->snapshot_lock);
 
-    return (VIRTIODevice *)s;
+        aio->done.post(req);
+    }
+    return NULL;
 }
 
-/*********************************************************************/
-/* 9p filesystem device */
+static void bf_aio_queue(BlockDeviceAIO *aio, BlockDeviceAIOReq *req)
+{
+    pthread_mutex_lock(&aio->lock);
+    *aio->submit_tail = req;
+    aio->submit_tail = &req->next;
+    pthread_cond_signal(&aio->cond);
+    pthread_mutex_unlock(&aio->lock);
+}
 
-typedef struct {
-    struct list_head link;
-    uint32_t fid;
-    FSFile *fd;
-} FIDDesc;
+static int bf_aio_submit(BlockDeviceFile *bf, BlockDeviceOpEnum op,
+                         uint64_t sector_num, const struct iovec *iov,
+                         int iovcnt, int n,
+                         BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    BlockDeviceAIO *aio = bf->aio;
+    BlockDeviceAIOReq *req;
+
+    req = (BlockDeviceAIOReq *)mallocz(sizeof(*req) +
+                                       sizeof(req->iov[0]) * iovcnt);
+    req->op = op;
+    req->sector_num = sector_num;
+    req->n = n;
+    req->cb = cb;
+    req->opaque = opaque;
+    req->iovcnt = iovcnt;
+    if (iovcnt > 0)
+        memcpy(req->iov, iov, sizeof(req->iov[0]) * iovcnt);
+
+    bf_aio_queue(aio, req);
+    return 1; /* asynchronous */
+}
 
-struct VIRTIO9PDevice : public VIRTIODevice {
-    FSDevice *fs;
-    uint32_t msize; /* maximum message size */
-    struct list_head fid_list; /* list of FIDDesc */
-    BOOL req_in_progress;
+static int bf_aio_submit_ranges(BlockDeviceFile *bf, BlockDeviceOpEnum op,
+                                const BlockDeviceRange *ranges, int nb_ranges,
+                                BOOL unmap,
+                                BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    BlockDeviceAIOReq *req;
+
+    req = (BlockDeviceAIOReq *)mallocz(sizeof(*req) +
+                                       sizeof(ranges[0]) * nb_ranges);
+    req->op = op;
+    req->cb = cb;
+    req->opaque = opaque;
+    req->unmap = unmap;
+    req->ranges = (BlockDeviceRange *)req->iov;
+    req->iovcnt = nb_ranges;
+    memcpy(req->ranges, ranges, sizeof(ranges[0]) * nb_ranges);
+    bf_aio_queue(bf->aio, req);
+    return 1; /* asynchronous */
+}
+
+/*********************************************************************/
+/* io_uring: the requests are queued in the submission ring and
+   submitted together by bf_uring_submit() at the end of the queue
+   notification. The completions are reaped by bf_poll(). Only the
+   reads and writes of the image file go through the ring, the other
+   requests are executed synchronously. */
+
+#ifdef CONFIG_IO_URING
+
+#define BF_URING_ENTRIES 256 /* more than the requests in flight */
+
+struct BlockDeviceURing {
+    int ring_fd;
+    BOOL fixed_file; /* the image fd is registered as file 0 */
+    /* submission ring */
+    void *sq_ring;
+    size_t sq_ring_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned sq_pending; /* queued but not submitted */
+    /* completion ring */
+    void *cq_ring;
+    size_t cq_ring_size;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
 };
 
-static FIDDesc *fid_find1(VIRTIO9PDevice *s, uint32_t fid)
+static int bf_uring_enter(BlockDeviceURing *u, unsigned to_submit)
 {
-    struct list_head *el;
-    FIDDesc *f;
+    return syscall(__NR_io_uring_enter, u->ring_fd, to_submit, 0, 0,
+                   NULL, 0);
+}
 
-    list_for_each(el, &s->fid_list) {
-        f = list_entry(el, FIDDesc, link);
-        if (f->fid == fid)
-            return f;
+/* queue a request in the submission ring. Return < 0 if the ring is
+   full. */
+static int bf_uring_queue(BlockDeviceFile *bf, int opcode, uint64_t offset,
+                          BlockDeviceAIOReq *req)
+{
+    BlockDeviceURing *u = bf->uring;
+    struct io_uring_sqe *sqe;
+    unsigned tail, idx;
+
+    tail = *u->sq_tail;
+    if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >=
+        u->sq_entries)
+        return -1;
+    idx = tail & *u->sq_mask;
+    sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    if (u->fixed_file) {
+        sqe->fd = 0;
+        sqe->flags = IOSQE_FIXED_FILE;
+    } else {
+        sqe->fd = bf->fd;
     }
-    return NULL;
+    sqe->off = offset;
+    if (opcode == IORING_OP_FSYNC) {
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    } else {
+        sqe->addr = (uintptr_t)req->iov;
+        sqe->len = req->iovcnt;
+    }
+    sqe->user_data = (uintptr_t)req;
+    u->sq_array[idx] = idx;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->sq_pending++;
+    return 0;
 }
 
-static FSFile *fid_find(VIRTIO9PDevice *s, uint32_t fid)
+/* submit the queued requests with a single system call */
+static void bf_uring_submit(BlockDevice *bs)
 {
-    FIDDesc *f;
+    BlockDeviceURing *u = bs->opaque->uring;
+    int ret;
 
-    f = fid_find1(s, fid);
-    if (!f)
-        return NULL;
-    return f->fd;
+    while (u->sq_pending > 0) {
+        ret = bf_uring_enter(u, u->sq_pending);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            /* EAGAIN or EBUSY: retried by bf_poll() once completions
+               have been reaped */
+            break;
+        }
+        u->sq_pending -= ret;
+    }
 }
 
-static void fid_delete(VIRTIO9PDevice *s, uint32_t fid)
+static void bf_uring_reap(BlockDeviceFile *bf)
 {
-    FIDDesc *f;
+    BlockDeviceURing *u = bf->uring;
+    BlockDeviceAIOReq *req, *list, **plast;
+    struct io_uring_cqe *cqe;
+    unsigned head, tail;
+
+    head = *u->cq_head;
+    tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail)
+        return;
+    list = NULL;
+    plast = &list;
+    for(; head != tail; head++) {
+        cqe = &u->cqes[head & *u->cq_mask];
+        req = (BlockDeviceAIOReq *)(uintptr_t)cqe->user_data;
+        if (cqe->res < 0)
+            req->ret = -1;
+        else if (req->op == BF_OP_FLUSH)
+            req->ret = 0;
+        else
+            /* a short transfer is completed synchronously */
+            req->ret = bf_rw_rest(bf->fd, req->iov, req->iovcnt,
+                                  req->sector_num * SECTOR_SIZE, cqe->res,
+                                  req->op == BF_OP_WRITE);
+        req->next = NULL;
+        *plast = req;
+        plast = &req->next;
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    /* the callbacks may queue new requests */
+    for(req = list; req; req = list) {
+        list = req->next;
+        req->cb(req->opaque, req->ret);
+        free(req);
+    }
+}
 
-    f = fid_find1(s, fid);
-    if (f) {
-        s->fs->fs_delete(s->fs, f->fd);
-        list_del(&f->link);
-        free(f);
+/* return 1 if the request was queued in the ring, 0 if the ring cannot
+   be used for it */
+static int bf_uring_rw(BlockDeviceFile *bf, int opcode, uint64_t sector_num,
+                       const struct iovec *iov, int iovcnt,
+                       BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    BlockDeviceAIOReq *req;
+
+    /* the unaligned O_DIRECT transfers need a bounce buffer */
+    if (bf->direct && iovcnt > 0 &&
+        !iov_is_aligned(iov, iovcnt, BF_DIRECT_ALIGN))
+        return 0;
+    req = (BlockDeviceAIOReq *)mallocz(sizeof(*req) +
+                                       sizeof(req->iov[0]) * iovcnt);
+    if (opcode == IORING_OP_READV)
+        req->op = BF_OP_READ;
+    else if (opcode == IORING_OP_WRITEV)
+        req->op = BF_OP_WRITE;
+    else
+        req->op = BF_OP_FLUSH;
+    req->sector_num = sector_num;
+    req->cb = cb;
+    req->opaque = opaque;
+    req->iovcnt = iovcnt;
+    if (iovcnt > 0)
+        memcpy(req->iov, iov, sizeof(req->iov[0]) * iovcnt);
+    if (bf_uring_queue(bf, opcode, sector_num * SECTOR_SIZE, req) < 0) {
+        free(req);
+        return 0;
     }
+    return 1;
 }
 
-static void fid_set(VIRTIO9PDevice *s, uint32_t fid, FSFile *fd)
+#endif /* CONFIG_IO_URING */
+
+/* write back the dirty data once it is old enough */
+static void bf_writeback_poll(BlockDeviceFile *bf)
 {
-    FIDDesc *f;
+    BlockDeviceSnapshot *sn = bf->snapshot;
 
-    f = fid_find1(s, fid);
-    if (f) {
-        s->fs->fs_delete(s->fs, f->fd);
-        f->fd = fd;
-    } else {
-        f = (FIDDesc*)malloc(sizeof(*f));
-        f->fid = fid;
-        f->fd = fd;
-        list_add(&f->link, &s->fid_list);
+    if (__atomic_load_n(&sn->nb_dirty_sectors, __ATOMIC_RELAXED) == 0 ||
+        bf_get_time_ms() - __atomic_load_n(&sn->dirty_time,
+                                           __ATOMIC_RELAXED) <
+        BF_WRITEBACK_DELAY_MS)
+        return;
+    if (!bf->aio) {
+        bf_writeback(bf);
+    } else if (!bf->aio->writeback_pending) {
+        /* done by a worker thread */
+        bf->aio->writeback_pending = TRUE;
+        bf_aio_submit(bf, BF_OP_WRITEBACK, 0, NULL, 0, 0, NULL, NULL);
     }
 }
 
-#ifdef DEBUG_VIRTIO
+/* load the ra_window clusters following the read in the read cache */
+static void bf_readahead_async(BlockDeviceFile *bf, uint64_t sector_num,
+                               int n, int ra_window)
+{
+    struct iovec iov[BF_RC_MAX_FILL];
+    uint64_t first, last;
+    int cnt;
+
+    first = ((sector_num + n - 1) >> BF_CLUSTER_BITS) + 1;
+    last = first + ra_window - 1;
+    cnt = bf_rcache_reserve(bf->rcache, first, last, &first, iov);
+    if (cnt > 0)
+        bf_aio_submit(bf, BF_OP_PREFETCH, first << BF_CLUSTER_BITS, iov, cnt,
+                      cnt * BF_CLUSTER_SECTORS, NULL, NULL);
+}
 
-typedef struct {
-    uint8_t tag;
-    const char *name;
-} Virtio9POPName;
+static void bf_aio_poll(BlockDeviceAIO *aio)
+{
+    BlockDeviceAIOReq *req, *next;
 
-static const Virtio9POPName virtio_9p_op_names[] = {
-    { 8, "statfs" },
-    { 12, "lopen" },
-    { 14, "lcreate" },
-    { 16, "symlink" },
-    { 18, "mknod" },
-    { 22, "readlink" },
-    { 24, "getattr" },
-    { 26, "setattr" },
-    { 30, "xattrwalk" },
-    { 40, "readdir" },
-    { 50, "fsync" },
-    { 52, "lock" },
-    { 54, "getlock" },
-    { 70, "link" },
-    { 72, "mkdir" },
-    { 74, "renameat" },
-    { 76, "unlinkat" },
-    { 100, "version" },
-    { 104, "attach" },
-    { 108, "flush" },
-    { 110, "walk" },
-    { 116, "read" },
-    { 118, "write" },
-    { 120, "clunk" },
-    { 0, NULL },
-};
+    if (!aio->done.pending())
+        return;
+    for(req = aio->done.take(); req; req = next) {
+        next = req->next;
+        if (req->op == BF_OP_WRITEBACK)
+            aio->writeback_pending = FALSE;
+        else if (req->op != BF_OP_PREFETCH)
+            req->cb(req->opaque, req->ret);
+        free(req);
+    }
+}
 
-static const char *get_9p_op_name(int tag)
+static void bf_poll(BlockDevice *bs)
 {
-    const Virtio9POPName *p;
-    for(p = virtio_9p_op_names; p->name != NULL; p++) {
-        if (p->tag == tag)
-            return p->name;
+    BlockDeviceFile *bf = bs->opaque;
+
+    if (bf->mode == BF_MODE_RW && bf->snapshot)
+        bf_writeback_poll(bf);
+#ifdef CONFIG_IO_URING
+    if (bf->uring) {
+        bf_uring_reap(bf);
+        /* nothing else submits them if no request arrives */
+        if (bf->uring->sq_pending > 0)
+            bf_uring_submit(bs);
     }
-    return NULL;
+#endif
+    if (bf->aio)
+        bf_aio_poll(bf->aio);
 }
 
-#endif /* DEBUG_VIRTIO */
-
-static int marshall(VIRTIO9PDevice *s, 
-                    uint8_t *buf1, int max_len, const char *fmt, ...)
+/* execute the requests on nb_threads host threads. Return < 0 if the
+   threads could not be created. */
+int block_device_set_async(BlockDevice *bs, int nb_threads)
 {
-    va_list ap;
-    int c;
-    uint32_t val;
-    uint64_t val64;
-    uint8_t *buf, *buf_end;
+    BlockDeviceFile *bf = bs->opaque;
+    BlockDeviceAIO *aio;
+    int i;
 
-#ifdef DEBUG_VIRTIO
-    
-        printf(" ->");
-#endif
-    va_start(ap, fmt);
-    buf = buf1;
-    buf_end = buf1 + max_len;
-    for(;;) {
-        c = *fmt++;
-        if (c == '\0')
-            break;
-        switch(c) {
-        case 'b':
-            assert(buf + 1 <= buf_end);
-            val = va_arg(ap, int);
-#ifdef DEBUG_VIRTIO
-            
-                printf(" b=%d", val);
-#endif
-            buf[0] = val;
-            buf += 1;
-            break;
-        case 'h':
-            assert(buf + 2 <= buf_end);
-            val = va_arg(ap, int);
-#ifdef DEBUG_VIRTIO
-            
-                printf(" h=%d", val);
-#endif
-            put_le16(buf, val);
-            buf += 2;
-            break;
-        case 'w':
-            assert(buf + 4 <= buf_end);
-            val = va_arg(ap, int);
-#ifdef DEBUG_VIRTIO
-            
-                printf(" w=%d", val);
-#endif
-            put_le32(buf, val);
-            buf += 4;
+    if (nb_threads <= 0 || bf->aio || bf->uring)
+        return 0;
+    aio = (BlockDeviceAIO *)mallocz(sizeof(*aio));
+    aio->bf = bf;
+    aio->threads = (pthread_t *)mallocz(sizeof(aio->threads[0]) * nb_threads);
+    pthread_mutex_init(&aio->lock, NULL);
+    pthread_cond_init(&aio->cond, NULL);
+    pthread_mutex_init(&aio->snapshot_lock, NULL);
+    aio->submit_tail = &aio->submit_head;
+    for(i = 0; i < nb_threads; i++) {
+        if (pthread_create(&aio->threads[i], NULL, bf_aio_worker, aio) != 0)
             break;
-        case 'd':
-            assert(buf + 8 <= buf_end);
-            val64 = va_arg(ap, uint64_t);
-#ifdef DEBUG_VIRTIO
-            
-                printf(" d=%" PRId64, val64);
+    }
+    aio->nb_threads = i;
+    if (i == 0) {
+        free(aio->threads);
+        free(aio);
+        return -1;
+    }
+    bf->aio = aio;
+    bs->poll = bf_poll;
+    return 0;
+}
+
+/* execute the queued requests, stop the threads and deliver the last
+   completions. The later requests are executed synchronously. */
+void block_device_stop_async(BlockDevice *bs)
+{
+    BlockDeviceFile *bf = bs->opaque;
+    BlockDeviceAIO *aio = bf->aio;
+    int i;
+
+    if (!aio)
+        return;
+    pthread_mutex_lock(&aio->lock);
+    aio->stop = TRUE;
+    pthread_cond_broadcast(&aio->cond);
+    pthread_mutex_unlock(&aio->lock);
+    for(i = 0; i < aio->nb_threads; i++)
+        pthread_join(aio->threads[i], NULL);
+    bf_aio_poll(aio);
+    bf->aio = NULL;
+    pthread_mutex_destroy(&aio->lock);
+    pthread_cond_destroy(&aio->cond);
+    pthread_mutex_destroy(&aio->snapshot_lock);
+    free(aio->threads);
+    free(aio);
+}
+
+/* use io_uring for the reads and writes of the image file. Return < 0
+   if it is not available. */
+int block_device_set_io_uring(BlockDevice *bs)
+{
+#ifdef CONFIG_IO_URING
+    BlockDeviceFile *bf = bs->opaque;
+    struct io_uring_params p;
+    BlockDeviceURing *u;
+    void *ptr;
+    int fd;
+
+    if (bf->uring)
+        return 0;
+    if (bf->aio || bf->fd < 0)
+        return -1;
+    memset(&p, 0, sizeof(p));
+    fd = syscall(__NR_io_uring_setup, BF_URING_ENTRIES, &p);
+    if (fd < 0)
+        return -1;
+    u = (BlockDeviceURing *)mallocz(sizeof(*u));
+    u->ring_fd = fd;
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_ring_size > u->sq_ring_size)
+            u->sq_ring_size = u->cq_ring_size;
+        u->cq_ring_size = u->sq_ring_size;
+    }
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED)
+        goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ring = u->sq_ring;
+    } else {
+        u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (u->cq_ring == MAP_FAILED)
+            goto fail_sq;
+    }
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ptr = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ptr == MAP_FAILED)
+        goto fail_cq;
+    u->sqes = (struct io_uring_sqe *)ptr;
+    u->sq_head = (unsigned *)((uint8_t *)u->sq_ring + p.sq_off.head);
+    u->sq_tail = (unsigned *)((uint8_t *)u->sq_ring + p.sq_off.tail);
+    u->sq_mask = (unsigned *)((uint8_t *)u->sq_ring + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)((uint8_t *)u->sq_ring + p.sq_off.array);
+    u->sq_entries = p.sq_entries;
+    u->cq_head = (unsigned *)((uint8_t *)u->cq_ring + p.cq_off.head);
+    u->cq_tail = (unsigned *)((uint8_t *)u->cq_ring + p.cq_off.tail);
+    u->cq_mask = (unsigned *)((uint8_t *)u->cq_ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)((uint8_t *)u->cq_ring + p.cq_off.cqes);
+    /* saves the file lookup of each request */
+    u->fixed_file = (syscall(__NR_io_uring_register, fd,
+                             IORING_REGISTER_FILES, &bf->fd, 1) == 0);
+    bf->uring = u;
+    bs->submit = bf_uring_submit;
+    bs->poll = bf_poll;
+    return 0;
+ fail_cq:
+    if (u->cq_ring != u->sq_ring)
+        munmap(u->cq_ring, u->cq_ring_size);
+ fail_sq:
+    munmap(u->sq_ring, u->sq_ring_size);
+ fail:
+    close(fd);
+    free(u);
+    return -1;
+#else
+    return -1;
 #endif
-            put_le64(buf, val64);
-            buf += 8;
-            break;
-        case 's':
-            {
-                char *str;
-                int len;
-                str = va_arg(ap, char *);
-#ifdef DEBUG_VIRTIO
-                
-                    printf(" s=\"%s\"", str);
+}
+
+static int bf_readv_async(BlockDevice *bs,
+                          uint64_t sector_num, const struct iovec *iov,
+                          int iovcnt,
+                          BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    BlockDeviceFile *bf = bs->opaque;
+    int n, ret, ra_window;
+
+    if (bf->fd < 0)
+        return -1;
+    n = iov_size(iov, iovcnt) / SECTOR_SIZE;
+#ifdef DUMP_BLOCK_READ
+    {
+        static FILE *f;
+        if (!f)
+            f = fopen("/tmp/read_sect.txt", "wb");
+        fprintf(f, "%" PRId64 " %d\n", sector_num, n);
+    }
 #endif
-                len = strlen(str);
-                assert(len <= 65535);
-                assert(buf + 2 + len <= buf_end);
-                put_le16(buf, len);
-                buf += 2;
-                memcpy(buf, str, len);
-                buf += len;
-            }
-            break;
-        case 'Q':
-            {
-                FSQID *qid;
-                assert(buf + 13 <= buf_end);
-                qid = va_arg(ap, FSQID *);
-#ifdef DEBUG_VIRTIO
-                
-                    printf(" Q=%d:%d:%" PRIu64, qid->type, qid->version, qid->path);
+    /* the streams are detected in the submission order */
+    ra_window = 0;
+    if (bf->rcache)
+        ra_window = bf_ra_update(bf->rcache, sector_num, n);
+#ifdef CONFIG_IO_URING
+    if (bf->uring && !bf->snapshot && !bf->overlay && !bf->rcache &&
+        !bf->cimg &&
+        !bf_out_of_range(bf, sector_num, n) &&
+        bf_uring_rw(bf, IORING_OP_READV, sector_num, iov, iovcnt, cb, opaque))
+        return 1;
 #endif
-                buf[0] = qid->type;
-                put_le32(buf + 1, qid->version);
-                put_le64(buf + 5, qid->path);
-                buf += 13;
-            }
-            break;
-        default:
-            abort();
-        }
+    if (bf->aio) {
+        ret = bf_aio_submit(bf, BF_OP_READ, sector_num, iov, iovcnt, n,
+                            cb, opaque);
+        if (ra_window > 0)
+            bf_readahead_async(bf, sector_num, n, ra_window);
+        return ret;
     }
-    va_end(ap);
-    return buf - buf1;
+    /* synchronous read */
+    return bf_readv(bf, sector_num, iov, iovcnt, n, ra_window);
 }
 
-/* return < 0 if error */
-/* XXX: free allocated strings in case of error */
-static int unmarshall(VIRTIO9PDevice *s, int queue_idx,
-                      int desc_idx, int *poffset, const char *fmt, ...)
+static int bf_writev_async(BlockDevice *bs,
+                           uint64_t sector_num, const struct iovec *iov,
+                           int iovcnt,
+                           BlockDeviceCompletionFunc *cb, void *opaque)
 {
-    VIRTIODevice *s1 = (VIRTIODevice *)s;
-    va_list ap;
-    int offset, c;
-    uint8_t buf[16];
+    BlockDeviceFile *bf = bs->opaque;
+    int n;
 
-    offset = *poffset;
-    va_start(ap, fmt);
-    for(;;) {
-        c = *fmt++;
-        if (c == '\0')
-            break;
-        switch(c) {
-        case 'b':
-            {
-                uint8_t *ptr;
-                if (memcpy_from_queue(s1, buf, queue_idx, desc_idx, offset, 1))
-                    return -1;
-                ptr = va_arg(ap, uint8_t *);
-                *ptr = buf[0];
-                offset += 1;
-#ifdef DEBUG_VIRTIO
-                
-                    printf(" b=%d", *ptr);
-#endif
-            }
-            break;
-        case 'h':
-            {
-                uint16_t *ptr;
-                if (memcpy_from_queue(s1, buf, queue_idx, desc_idx, offset, 2))
-                    return -1;
-                ptr = va_arg(ap, uint16_t *);
-                *ptr = get_le16(buf);
-                offset += 2;
-#ifdef DEBUG_VIRTIO
-                
-                    printf(" h=%d", *ptr);
-#endif
-            }
-            break;
-        case 'w':
-            {
-                uint32_t *ptr;
-                if (memcpy_from_queue(s1, buf, queue_idx, desc_idx, offset, 4))
-                    return -1;
-                ptr = va_arg(ap, uint32_t *);
-                *ptr = get_le32(buf);
-                offset += 4;
-#ifdef DEBUG_VIRTIO
-                
-                    printf(" w=%d", *ptr);
+    if (bf->mode == BF_MODE_RO || bf->mode == BF_MODE_MMAP || bf->fd < 0)
+        return -1;
+    n = iov_size(iov, iovcnt) / SECTOR_SIZE;
+#ifdef CONFIG_IO_URING
+    if (bf->uring && bf->mode == BF_MODE_RW && !bf->snapshot && !bf->rcache &&
+        !bf_out_of_range(bf, sector_num, n) &&
+        bf_uring_rw(bf, IORING_OP_WRITEV, sector_num, iov, iovcnt, cb, opaque))
+        return 1;
 #endif
-            }
-            break;
-        case 'd':
-            {
-                uint64_t *ptr;
-                if (memcpy_from_queue(s1, buf, queue_idx, desc_idx, offset, 8))
-                    return -1;
-                ptr = va_arg(ap, uint64_t *);
-                *ptr = get_le64(buf);
-                offset += 8;
-#ifdef DEBUG_VIRTIO
-                
-                    printf(" d=%" PRId64, *ptr);
+    if (bf->aio)
+        return bf_aio_submit(bf, BF_OP_WRITE, sector_num, iov, iovcnt, n,
+                             cb, opaque);
+    return bf_writev(bf, sector_num, iov, iovcnt, n);
+}
+
+static int bf_flush_async(BlockDevice *bs,
+                          BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    BlockDeviceFile *bf = bs->opaque;
+
+    if (bf->fd < 0)
+        return -1;
+#ifdef CONFIG_IO_URING
+    if (bf->uring && bf->mode == BF_MODE_RW && !bf->snapshot &&
+        bf_uring_rw(bf, IORING_OP_FSYNC, 0, NULL, 0, cb, opaque))
+        return 1;
 #endif
-            }
-            break;
-        case 's':
-            {
-                char *str, **ptr;
-                int len;
+    if (bf->aio)
+        return bf_aio_submit(bf, BF_OP_FLUSH, 0, NULL, 0, 0, cb, opaque);
+    return bf_flush(bf);
+}
 
-                if (memcpy_from_queue(s1, buf, queue_idx, desc_idx, offset, 2))
-                    return -1;
-                len = get_le16(buf);
-                offset += 2;
-                str = (char*)malloc(len + 1);
-                if (memcpy_from_queue(s1, str, queue_idx, desc_idx, offset, len))
-                    return -1;
-                str[len] = '\0';
-                offset += len;
-                ptr = va_arg(ap, char **);
-                *ptr = str;
+static int bf_discard_async(BlockDevice *bs,
+                            const BlockDeviceRange *ranges, int nb_ranges,
+                            BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    BlockDeviceFile *bf = bs->opaque;
+
+    if (bf->aio)
+        return bf_aio_submit_ranges(bf, BF_OP_DISCARD, ranges, nb_ranges,
+                                    FALSE, cb, opaque);
+    return bf_discard_ranges(bf, ranges, nb_ranges, FALSE, FALSE);
+}
+
+static int bf_write_zeroes_async(BlockDevice *bs,
+                                 const BlockDeviceRange *ranges, int nb_ranges,
+                                 int unmap,
+                                 BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    BlockDeviceFile *bf = bs->opaque;
+
+    if (bf->aio)
+        return bf_aio_submit_ranges(bf, BF_OP_WRITE_ZEROES, ranges, nb_ranges,
+                                    unmap, cb, opaque);
+    return bf_discard_ranges(bf, ranges, nb_ranges, TRUE, unmap);
+}
+
+/* synchronous flush, e.g. before exiting. Return < 0 if error. */
+int block_device_flush(BlockDevice *bs)
+{
+    BlockDeviceFile *bf = bs->opaque;
+    int ret;
+
+    if (bf->fd < 0)
+        return -1;
+    if (bf->aio)
+        pthread_mutex_lock(&bf->aio->snapshot_lock);
+    ret = bf_flush(bf);
+    if (bf->aio)
+        pthread_mutex_unlock(&bf->aio->snapshot_lock);
+    return ret;
+}
+
+static int bf_read_async(BlockDevice *bs,
+                         uint64_t sector_num, uint8_t *buf, int n,
+                         BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = n * SECTOR_SIZE;
+    return bf_readv_async(bs, sector_num, &iov, 1, cb, opaque);
+}
+
+static int bf_write_async(BlockDevice *bs,
+                          uint64_t sector_num, const uint8_t *buf, int n,
+                          BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    struct iovec iov;
+    iov.iov_base = (void *)buf;
+    iov.iov_len = n * SECTOR_SIZE;
+    return bf_writev_async(bs, sector_num, &iov, 1, cb, opaque);
+}
+
+BlockDevice *block_device_init(const char *filename,
+                               BlockDeviceModeEnum mode,
+                               BlockDeviceCacheEnum cache)
+{
+    BlockDevice *bs;
+    BlockDeviceFile *bf;
+    BlockDeviceCImg *cimg;
+    int64_t file_size;
+    int fd, flags;
+    BOOL direct;
+
+    cimg = bf_cimg_open(filename);
+    if (cimg) {
+        /* read only: the writes are kept in memory */
+        if (mode == BF_MODE_RW || mode == BF_MODE_MMAP_SNAPSHOT) {
+            if (mode == BF_MODE_RW)
+                fprintf(stderr, "%s: compressed image, using snapshot mode\n",
+                        filename);
+            mode = BF_MODE_SNAPSHOT;
+        } else if (mode == BF_MODE_MMAP) {
+            mode = BF_MODE_RO;
+        }
+        cache = BF_CACHE_WRITETHROUGH;
+    }
+    if (mode == BF_MODE_RW) {
+        flags = O_RDWR;
+    } else {
+        flags = O_RDONLY;
+    }
+
+    direct = FALSE;
+    fd = -1;
+    if (cimg) {
+        fd = cimg->fd;
+        file_size = cimg->image_size;
+    }
+    /* the mapped pages are in the page cache anyway */
+    if (!cimg && cache == BF_CACHE_NONE &&
+        mode != BF_MODE_MMAP && mode != BF_MODE_MMAP_SNAPSHOT) {
+        fd = open(filename, flags | O_DIRECT);
+        if (fd >= 0) {
+            direct = TRUE;
+        } else if (errno == EINVAL) {
+            /* e.g. tmpfs */
+            fprintf(stderr, "%s: O_DIRECT not supported, using the page cache\n",
+                    filename);
+        }
+    }
+    if (fd < 0) {
+        fd = open(filename, flags);
+        if (fd < 0) {
+            perror(filename);
+            exit(1);
+        }
+    }
+    if (!cimg)
+        file_size = lseek(fd, 0, SEEK_END);
+
+    bs = (BlockDevice*)mallocz(sizeof(*bs));
+    bf = (BlockDeviceFile*)mallocz(sizeof(*bf));
+
+    bf->mode = mode;
+    bf->nb_sectors = file_size / 512;
+    bf->fd = fd;
+    bf->direct = direct;
+    bf->cimg = cimg;
+
+    if (mode == BF_MODE_SNAPSHOT ||
+        (mode == BF_MODE_RW && cache == BF_CACHE_WRITEBACK)) {
+        bf->snapshot = bf_snapshot_init(bf->nb_sectors);
+    }
+
+    if ((mode == BF_MODE_MMAP || mode == BF_MODE_MMAP_SNAPSHOT) &&
+        file_size > 0) {
+        void *map;
+        /* MAP_SHARED lets all the processes using the same image share
+           the host page cache */
+        if (mode == BF_MODE_MMAP)
+            map = mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0);
+        else
+            map = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                       fd, 0);
+        if (map == MAP_FAILED) {
+            perror(filename);
+            exit(1);
+        }
+        bf->map = (uint8_t *)map;
+        bf->map_size = file_size;
+    }
+    
+    bs->opaque = bf;
+    bs->get_sector_count = bf_get_sector_count;
+    bs->read_async = bf_read_async;
+    bs->write_async = bf_write_async;
+    bs->readv_async = bf_readv_async;
+    bs->writev_async = bf_writev_async;
+    bs->flush_async = bf_flush_async;
+    if (mode != BF_MODE_RO && mode != BF_MODE_MMAP) {
+        bs->discard_async = bf_discard_async;
+        bs->write_zeroes_async = bf_write_zeroes_async;
+    }
+    if (bf->snapshot && mode == BF_MODE_RW) {
+        /* the write-back cache is written back when polled */
+        bs->poll = bf_poll;
+    }
+    return bs;
+}
+
+static int64_t virtio_get_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*********************************************************************/
+/* event tracing (see virtio-trace.h) */
+
+#define VIRTIO_TRACE_DEFAULT_EVENTS 65536
+#define VIRTIO_TRACE_WRITE_BATCH 4096
+
+/* The events are recorded by the simulator thread and by the backend
+   threads without locking: a producer takes the next slot of the ring
+   with an atomic increment of head, then writes its event number last
+   to publish it. A writer thread saves the events to the file. When it
+   falls behind by the size of the ring, the oldest events are
+   overwritten and counted as lost. */
+typedef struct {
+    uint64_t host_ns;
+    uint64_t ticks;
+    uint32_t seq; /* event number + 1 (low bits), 0 while it is written */
+    uint8_t type;
+    uint8_t queue;
+    uint16_t desc;
+    uint32_t arg0;
+    uint32_t arg1;
+} VIRTIOTraceEvent;
+
+typedef struct VIRTIOTrace {
+    int fd;
+    VIRTIOTraceEvent *ring;
+    uint64_t mask; /* number of events in the ring - 1 */
+    uint64_t head; /* next event number */
+    uint64_t tail; /* next event to write, only used by the writer */
+    uint64_t nb_written;
+    uint64_t nb_lost;
+    int stop;
+    pthread_t thread;
+} VIRTIOTrace;
+
+static void virtio_trace_event(VIRTIODevice *s, VIRTIOTrace *t, int type,
+                               int queue_idx, int desc_idx, uint32_t arg0,
+                               uint32_t arg1)
+{
+    VIRTIOTraceEvent *e;
+    uint64_t n;
+
+    n = __atomic_fetch_add(&t->head, 1, __ATOMIC_RELAXED);
+    e = &t->ring[n & t->mask];
+    __atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&e->host_ns, virtio_get_time_ns(), __ATOMIC_RELAXED);
+    __atomic_store_n(&e->ticks, __atomic_load_n(&s->ticks, __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&e->type, type, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->queue, queue_idx, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->desc, desc_idx, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->arg0, arg0, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->arg1, arg1, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->seq, (uint32_t)(n + 1), __ATOMIC_RELEASE);
+}
+
+static inline void virtio_trace(VIRTIODevice *s, int type, int queue_idx,
+                                int desc_idx, uint32_t arg0, uint32_t arg1)
+{
+    VIRTIOTrace *t = __atomic_load_n(&s->trace, __ATOMIC_ACQUIRE);
+    if (t)
+        virtio_trace_event(s, t, type, queue_idx, desc_idx, arg0, arg1);
+}
+
+/* copy the event n to buf. Return 1 if done, 0 if it is not published
+   yet and -1 if it was overwritten. */
+static int virtio_trace_read(VIRTIOTrace *t, uint64_t n, uint8_t *buf)
+{
+    VIRTIOTraceEvent *e = &t->ring[n & t->mask];
+    uint32_t seq;
+
+    seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+    if (seq == (uint32_t)(n + 1)) {
+        put_le64(buf + VTRACE_E_HOST_NS,
+                 __atomic_load_n(&e->host_ns, __ATOMIC_RELAXED));
+        put_le64(buf + VTRACE_E_TICKS,
+                 __atomic_load_n(&e->ticks, __ATOMIC_RELAXED));
+        buf[VTRACE_E_TYPE] = __atomic_load_n(&e->type, __ATOMIC_RELAXED);
+        buf[VTRACE_E_QUEUE] = __atomic_load_n(&e->queue, __ATOMIC_RELAXED);
+        put_le16(buf + VTRACE_E_DESC,
+                 __atomic_load_n(&e->desc, __ATOMIC_RELAXED));
+        put_le32(buf + VTRACE_E_ARG0,
+                 __atomic_load_n(&e->arg0, __ATOMIC_RELAXED));
+        put_le32(buf + VTRACE_E_ARG1,
+                 __atomic_load_n(&e->arg1, __ATOMIC_RELAXED));
+        memset(buf + VTRACE_E_ARG1 + 4, 0,
+               VTRACE_EVENT_SIZE - VTRACE_E_ARG1 - 4);
+        /* a producer may have taken the slot during the copy */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) == seq)
+            return 1;
+    }
+    return __atomic_load_n(&t->head, __ATOMIC_ACQUIRE) - n > t->mask ? -1 : 0;
+}
+
+/* write the published events. Return the number of events handled. */
+static int virtio_trace_flush(VIRTIOTrace *t, uint8_t *buf)
+{
+    uint64_t head, n0;
+    int n, ret;
+
+    head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+    if (head - t->tail > t->mask + 1) {
+        t->nb_lost += head - t->tail - (t->mask + 1);
+        t->tail = head - (t->mask + 1);
+    }
+    n0 = t->tail;
+    n = 0;
+    while (t->tail < head && n < VIRTIO_TRACE_WRITE_BATCH) {
+        ret = virtio_trace_read(t, t->tail, buf + n * VTRACE_EVENT_SIZE);
+        if (ret == 0)
+            break;
+        if (ret > 0)
+            n++;
+        else
+            t->nb_lost++;
+        t->tail++;
+    }
+    if (n > 0) {
+        if (write(t->fd, buf, n * VTRACE_EVENT_SIZE) !=
+            n * VTRACE_EVENT_SIZE) {
+            fprintf(stderr, "virtio: trace write error: %s\n",
+                    strerror(errno));
+            t->nb_lost += n;
+        } else {
+            t->nb_written += n;
+        }
+    }
+    return t->tail - n0;
+}
+
+static void *virtio_trace_thread(void *opaque)
+{
+    VIRTIOTrace *t = (VIRTIOTrace *)opaque;
+    uint8_t *buf;
+    int stop;
+
+    buf = (uint8_t *)malloc(VIRTIO_TRACE_WRITE_BATCH * VTRACE_EVENT_SIZE);
+    for(;;) {
+        stop = __atomic_load_n(&t->stop, __ATOMIC_ACQUIRE);
+        if (virtio_trace_flush(t, buf) == 0) {
+            if (stop)
+                break;
+            usleep(10000);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+static void virtio_trace_close(VIRTIOTrace *t)
+{
+    uint8_t buf[16];
+
+    __atomic_store_n(&t->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(t->thread, NULL);
+    /* the events taken but never published are lost */
+    t->nb_lost += t->head - t->tail;
+    put_le64(buf, t->nb_written);
+    put_le64(buf + 8, t->nb_lost);
+    if (pwrite(t->fd, buf, sizeof(buf), VTRACE_H_NB_EVENTS) != sizeof(buf))
+        fprintf(stderr, "virtio: trace write error: %s\n", strerror(errno));
+    if (t->nb_lost > 0) {
+        fprintf(stderr, "virtio: %" PRIu64 " events lost from the trace\n",
+                t->nb_lost);
+    }
+    close(t->fd);
+    free(t->ring);
+    free(t);
+}
+
+/* record the events of the device to filename in a ring of nb_events
+   events (rounded to a power of two, a default size if <= 0). Stop
+   tracing if filename is NULL. Return < 0 if the file cannot be
+   created. */
+int virtio_set_trace(VIRTIODevice *s, const char *filename, int nb_events)
+{
+    VIRTIOTrace *t = s->trace;
+    uint8_t hdr[VTRACE_HEADER_SIZE];
+    uint64_t size;
+    int fd;
+
+    if (t) {
+        __atomic_store_n(&s->trace, (VIRTIOTrace *)NULL, __ATOMIC_RELAXED);
+        virtio_trace_close(t);
+    }
+    if (!filename)
+        return 0;
+
+    if (nb_events <= 0)
+        nb_events = VIRTIO_TRACE_DEFAULT_EVENTS;
+    for(size = 1024; size < (uint64_t)nb_events; size *= 2)
+        continue;
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr + VTRACE_H_MAGIC, VTRACE_MAGIC, 8);
+    put_le32(hdr + VTRACE_H_VERSION, VTRACE_VERSION);
+    put_le32(hdr + VTRACE_H_DEVICE_ID, s->device_id);
+    put_le64(hdr + VTRACE_H_START_NS, virtio_get_time_ns());
+    if (write(fd, hdr, sizeof(hdr)) != sizeof(hdr)) {
+        close(fd);
+        return -1;
+    }
+    t = (VIRTIOTrace *)mallocz(sizeof(*t));
+    t->fd = fd;
+    t->mask = size - 1;
+    t->ring = (VIRTIOTraceEvent *)mallocz(size * sizeof(VIRTIOTraceEvent));
+    if (pthread_create(&t->thread, NULL, virtio_trace_thread, t) != 0) {
+        free(t->ring);
+        free(t);
+        close(fd);
+        return -1;
+    }
+    __atomic_store_n(&s->trace, t, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static BOOL virtio_has_feature(VIRTIODevice *s, int bit)
+{
+    return (s->driver_features >> bit) & 1;
+}
+
+static uint32_t virtio_mmio_read(VIRTIODevice *opaque, uint32_t offset1, int size_log2);
+static void virtio_mmio_write(VIRTIODevice *opaque, uint32_t offset,
+                              uint32_t val, int size_log2);
+
+static void virtio_reset(VIRTIODevice *s)
+{
+    int i;
+
+    s->status = 0;
+    s->queue_sel = 0;
+    s->shm_sel = 0;
+    s->device_features_sel = 0;
+    s->driver_features_sel = 0;
+    s->driver_features = 0;
+    s->int_status = 0;
+    s->irq_pending_mask = 0;
+    s->notify_pending_mask = 0;
+    /* first, as the requests in progress may still access the queues */
+    if (s->device_reset)
+        s->device_reset(s);
+    /* the timers of the device are left to device_reset() */
+    s->sched.cancel(&s->poll_timer);
+    for(i = 0; i < MAX_QUEUE; i++) {
+        QueueState *qs = &s->queue[i];
+        qs->ready = 0;
+        qs->num = MAX_QUEUE_NUM;
+        qs->desc_addr = 0;
+        qs->avail_addr = 0;
+        qs->used_addr = 0;
+        qs->last_avail_idx = 0;
+        qs->avail_wrap_counter = TRUE;
+        qs->used_wrap_counter = TRUE;
+        qs->pending_descs = 0;
+        qs->batch_used = FALSE;
+        qs->nb_used_pending = 0;
+        qs->used_idx = 0;
+        qs->signalled_used = 0;
+        qs->signalled_used_valid = FALSE;
+        qs->irq_pending = 0;
+        s->sched.cancel(&qs->irq_timer);
+        qs->polling = FALSE;
+    }
+}
+
+
+/* NULL for MMIO and unbacked addresses, in which case the caller must
+   fall back to the debug MMU */
+static uint8_t *virtio_mmio_get_ram_ptr(VIRTIODevice *s,
+                                        virtio_phys_addr_t paddr, BOOL is_rw)
+{
+    return dma_get_ram_ptr(s->sim, paddr);
+}
+
+static void virtio_irq_timer_cb(device_timer_t *t);
+static void virtio_poll_timer_cb(device_timer_t *t);
+
+static void virtio_init(VIRTIODevice *s, VIRTIOBusDef *bus,
+                        uint32_t device_id, int config_space_size,
+                        VIRTIODeviceRecvFunc *device_recv, const simif_t* sim)
+{
+    int i;
+
+    memset(s, 0, sizeof(*s));
+    s->sched.init(0);
+    s->poll_timer.init(virtio_poll_timer_cb, s);
+    for(i = 0; i < MAX_QUEUE; i++)
+        s->queue[i].irq_timer.init(virtio_irq_timer_cb, s);
+
+    {
+        s->sim = sim;
+        /* MMIO case */
+        s->irq = bus->irq;
+        s->get_ram_ptr = virtio_mmio_get_ram_ptr;
+    }
+
+    s->device_id = device_id;
+    s->vendor_id = 0xffff;
+    s->config_space_size = config_space_size;
+    s->device_recv = device_recv;
+    s->device_features = (1 << VIRTIO_RING_F_INDIRECT_DESC) |
+        (1 << VIRTIO_RING_F_EVENT_IDX) |
+        (1ULL << VIRTIO_F_VERSION_1) |
+        (1ULL << VIRTIO_F_RING_PACKED);
+    s->irq_max_batch = 1;
+    s->irq_max_delay = 0;
+    virtio_reset(s);
+}
+
+/* ring fields are naturally aligned so they never cross a page. The
+   debug MMU is only used for MMIO or misaligned addresses. */
+static uint16_t virtio_read16(VIRTIODevice *s, virtio_phys_addr_t addr)
+{
+    uint8_t *ptr = NULL;
+    if (!(addr & 1))
+        ptr = s->get_ram_ptr(s, addr, FALSE);
+    if (ptr)
+        return get_le16(ptr);
+    mmu_t* simdram = s->sim->debug_mmu;
+    return simdram->load<uint16_t>(addr);
+}
+
+static void virtio_write16(VIRTIODevice *s, virtio_phys_addr_t addr,
+                           uint16_t val)
+{
+    uint8_t *ptr = NULL;
+    if (!(addr & 1))
+        ptr = s->get_ram_ptr(s, addr, TRUE);
+    if (ptr) {
+        put_le16(ptr, val);
+        return;
+    }
+    mmu_t* simdram = s->sim->debug_mmu;
+    simdram->store<uint16_t>(addr, val);
+}
+
+static void virtio_write32(VIRTIODevice *s, virtio_phys_addr_t addr,
+                           uint32_t val)
+{
+    uint8_t *ptr = NULL;
+    if (!(addr & 3))
+        ptr = s->get_ram_ptr(s, addr, TRUE);
+    if (ptr) {
+        put_le32(ptr, val);
+        return;
+    }
+    mmu_t* simdram = s->sim->debug_mmu;
+    simdram->store<uint32_t>(addr, val);
+}
+
+static int virtio_memcpy_from_ram(VIRTIODevice *s, uint8_t *buf,
+                                  virtio_phys_addr_t addr, int count)
+{
+    dma_memcpy_from_ram(s->sim, buf, addr, count);
 #ifdef DEBUG_VIRTIO
-                
-                    printf(" s=\"%s\"", *ptr);
-#endif
+    printf("Copying from ram paddr %#lx of length %#x to buf %p :\n",
+        addr, count, buf);
+    for (int i = 0; i < count; i++) {
+        printf("%x ", buf[i]);
+    }
+    putchar('\n');
+#endif 
+    return 0;
+}
+
+static int virtio_memcpy_to_ram(VIRTIODevice *s, virtio_phys_addr_t addr, 
+                                const uint8_t *buf, int count)
+{
+    dma_memcpy_to_ram(s->sim, addr, buf, count);
+    return 0;
+}
+
+static int virtio_read_desc(VIRTIODevice *s, VIRTIODesc *desc,
+                            virtio_phys_addr_t table_addr, int desc_idx)
+{
+    return virtio_memcpy_from_ram(s, (uint8_t *)desc, table_addr +
+                                  desc_idx * sizeof(VIRTIODesc),
+                                  sizeof(VIRTIODesc));
+}
+
+static void virtio_iov_add(VIRTIODevice *s, VIRTIOIOVec *iov,
+                           virtio_phys_addr_t addr, uint32_t len, BOOL is_rw)
+{
+    VIRTIOSeg *seg;
+    uint32_t l;
+
+    while (len > 0) {
+        l = min_int(len, VIRTIO_PAGE_SIZE - (addr & (VIRTIO_PAGE_SIZE - 1)));
+        if (iov->nb_segs >= iov->max_segs) {
+            iov->max_segs = max_int(8, iov->max_segs * 2);
+            iov->seg = (VIRTIOSeg *)realloc(iov->seg, sizeof(iov->seg[0]) *
+                                            iov->max_segs);
+        }
+        seg = &iov->seg[iov->nb_segs++];
+        seg->ptr = s->get_ram_ptr(s, addr, is_rw);
+        seg->addr = addr;
+        seg->len = l;
+        addr += l;
+        len -= l;
+    }
+}
+
+static VIRTIOIOVec *virtio_get_iov(VIRTIODevice *s, int queue_idx,
+                                   int desc_idx)
+{
+    return &s->queue[queue_idx].iov[desc_idx];
+}
+
+static void virtio_iov_reset(VIRTIOIOVec *iov)
+{
+    iov->nb_segs = 0;
+    iov->nb_read_segs = 0;
+    iov->read_size = 0;
+    iov->write_size = 0;
+    iov->nb_descs = 0;
+    iov->cur_seg[0] = iov->cur_seg[1] = -1;
+    iov->cur_pos[0] = iov->cur_pos[1] = 0;
+}
+
+/* append a buffer to the list. Return < 0 if a device readable buffer
+   follows a writable one. */
+static int virtio_iov_add_desc(VIRTIODevice *s, VIRTIOIOVec *iov,
+                               virtio_phys_addr_t addr, uint32_t len,
+                               int flags)
+{
+    if (flags & VRING_DESC_F_WRITE) {
+        virtio_iov_add(s, iov, addr, len, TRUE);
+        iov->write_size += len;
+    } else {
+        /* readable descriptors must come first */
+        if (iov->write_size != 0)
+            return -1;
+        virtio_iov_add(s, iov, addr, len, FALSE);
+        iov->nb_read_segs = iov->nb_segs;
+        iov->read_size += len;
+    }
+    return 0;
+}
+
+static BOOL virtio_indirect_desc_ok(VIRTIODevice *s, uint32_t len)
+{
+    return virtio_has_feature(s, VIRTIO_RING_F_INDIRECT_DESC) &&
+        len != 0 && (len % sizeof(VIRTIODesc)) == 0;
+}
+
+/* walk the descriptor chain once and resolve it to a scatter-gather
+   list. A descriptor with VRING_DESC_F_INDIRECT continues the chain in
+   its descriptor table. Return < 0 if the chain is malformed. */
+static int virtio_iov_build(VIRTIODevice *s, VIRTIOIOVec *iov,
+                            int queue_idx, int desc_idx)
+{
+    QueueState *qs = &s->queue[queue_idx];
+    VIRTIODesc desc;
+    virtio_phys_addr_t table_addr;
+    int n, table_size;
+    BOOL indirect;
+
+    virtio_iov_reset(iov);
+
+    table_addr = qs->desc_addr;
+    table_size = qs->num;
+    indirect = FALSE;
+    virtio_read_desc(s, &desc, table_addr, desc_idx);
+    for(n = 0;; n++) {
+        /* avoid looping forever on a corrupted chain */
+        if (n >= table_size)
+            return -1;
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            /* nested tables are not allowed */
+            if (indirect || !virtio_indirect_desc_ok(s, desc.len))
+                return -1;
+            indirect = TRUE;
+            table_addr = desc.addr;
+            table_size = desc.len / sizeof(VIRTIODesc);
+            n = -1;
+            virtio_read_desc(s, &desc, table_addr, 0);
+            continue;
+        }
+        if (virtio_iov_add_desc(s, iov, desc.addr, desc.len, desc.flags))
+            return -1;
+        if (!(desc.flags & VRING_DESC_F_NEXT))
+            break;
+        desc_idx = desc.next;
+        if (desc_idx >= table_size)
+            return -1;
+        virtio_read_desc(s, &desc, table_addr, desc_idx);
+    }
+    return 0;
+}
+
+/*********************************************************************/
+/* packed ring */
+
+static void virtio_read_packed_desc(VIRTIODevice *s, VIRTIOPackedDesc *desc,
+                                    virtio_phys_addr_t table_addr, int idx)
+{
+    virtio_memcpy_from_ram(s, (uint8_t *)desc, table_addr +
+                           idx * sizeof(VIRTIOPackedDesc),
+                           sizeof(VIRTIOPackedDesc));
+}
+
+static BOOL virtio_packed_desc_is_avail(const VIRTIOPackedDesc *desc,
+                                        BOOL wrap_counter)
+{
+    BOOL avail = (desc->flags & VRING_PACKED_DESC_F_AVAIL) != 0;
+    BOOL used = (desc->flags & VRING_PACKED_DESC_F_USED) != 0;
+    return avail == wrap_counter && used != wrap_counter;
+}
+
+/* build the list of the buffer starting at the current avail position.
+   Return 0 if the ring is empty, 1 if a buffer was found (*pdesc_idx is
+   its buffer id) and < 0 if it is malformed. qs->pending_descs is set to
+   the number of ring slots to skip in all but the first case. */
+static int virtio_packed_peek(VIRTIODevice *s, int queue_idx,
+                              int *pdesc_idx)
+{
+    QueueState *qs = &s->queue[queue_idx];
+    VIRTIOPackedDesc desc, desc1;
+    VIRTIOIOVec *iov;
+    int pos, n, i, id, table_size;
+
+    pos = qs->last_avail_idx;
+    virtio_read_packed_desc(s, &desc, qs->desc_addr, pos);
+    if (!virtio_packed_desc_is_avail(&desc, qs->avail_wrap_counter))
+        return 0;
+    /* the buffer id is in the last descriptor of the chain */
+    n = 1;
+    desc1 = desc;
+    while (desc1.flags & VRING_DESC_F_NEXT) {
+        if (n >= (int)qs->num) {
+            /* the whole ring is skipped */
+            qs->pending_descs = n;
+            return -1;
+        }
+        if (++pos >= (int)qs->num)
+            pos = 0;
+        virtio_read_packed_desc(s, &desc1, qs->desc_addr, pos);
+        n++;
+    }
+    qs->pending_descs = n;
+    id = desc1.id;
+    if (id >= (int)qs->num)
+        return -1;
+    iov = virtio_get_iov(s, queue_idx, id);
+    virtio_iov_reset(iov);
+    iov->nb_descs = n;
+    pos = qs->last_avail_idx;
+    for(i = 0; i < n; i++) {
+        if (i != 0) {
+            if (++pos >= (int)qs->num)
+                pos = 0;
+            virtio_read_packed_desc(s, &desc, qs->desc_addr, pos);
+        }
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            virtio_phys_addr_t table_addr;
+            int j;
+            if (!virtio_indirect_desc_ok(s, desc.len))
+                return -1;
+            /* the table entries are used in order */
+            table_addr = desc.addr;
+            table_size = desc.len / sizeof(VIRTIOPackedDesc);
+            for(j = 0; j < table_size; j++) {
+                virtio_read_packed_desc(s, &desc1, table_addr, j);
+                if (desc1.flags & VRING_DESC_F_INDIRECT)
+                    return -1;
+                if (virtio_iov_add_desc(s, iov, desc1.addr, desc1.len,
+                                        desc1.flags))
+                    return -1;
+            }
+        } else {
+            if (virtio_iov_add_desc(s, iov, desc.addr, desc.len, desc.flags))
+                return -1;
+        }
+    }
+    *pdesc_idx = id;
+    return 1;
+}
+
+static void virtio_packed_advance(VIRTIODevice *s, int queue_idx)
+{
+    QueueState *qs = &s->queue[queue_idx];
+    int pos;
+
+    pos = qs->last_avail_idx + qs->pending_descs;
+    if (pos >= (int)qs->num) {
+        pos -= qs->num;
+        qs->avail_wrap_counter = !qs->avail_wrap_counter;
+    }
+    qs->last_avail_idx = pos;
+}
+
+static void virtio_packed_consume_desc(VIRTIODevice *s, int queue_idx,
+                                       int desc_idx, int desc_len)
+{
+    QueueState *qs = &s->queue[queue_idx];
+    VIRTIOIOVec *iov = virtio_get_iov(s, queue_idx, desc_idx);
+    virtio_phys_addr_t addr;
+    uint16_t flags;
+    int pos;
+
+    addr = qs->desc_addr + qs->used_idx * sizeof(VIRTIOPackedDesc);
+    virtio_write32(s, addr + 8, desc_len);
+    virtio_write16(s, addr + 12, desc_idx);
+    flags = 0;
+    if (qs->used_wrap_counter)
+        flags |= VRING_PACKED_DESC_F_AVAIL | VRING_PACKED_DESC_F_USED;
+    if (desc_len != 0)
+        flags |= VRING_DESC_F_WRITE;
+    /* the flags must be written last, they make the element visible */
+    virtio_write16(s, addr + 14, flags);
+
+    pos = qs->used_idx + iov->nb_descs;
+    if (pos >= (int)qs->num) {
+        pos -= qs->num;
+        qs->used_wrap_counter = !qs->used_wrap_counter;
+    }
+    qs->used_idx = pos;
+}
+
+/*********************************************************************/
+
+/* peek at the next available buffer and build its scatter-gather
+   list, without removing it from the ring. Return 0 if the ring is
+   empty, 1 if a buffer was found and < 0 if it is malformed. In the
+   last two cases virtio_queue_advance() must be called to skip it. */
+static int virtio_queue_peek(VIRTIODevice *s, int queue_idx, int *pdesc_idx)
+{
+    QueueState *qs = &s->queue[queue_idx];
+    uint16_t avail_idx;
+    int desc_idx;
+
+    if (virtio_has_feature(s, VIRTIO_F_RING_PACKED))
+        return virtio_packed_peek(s, queue_idx, pdesc_idx);
+
+    avail_idx = virtio_read16(s, qs->avail_addr + 2);
+    if (qs->last_avail_idx == avail_idx)
+        return 0;
+    desc_idx = virtio_read16(s, qs->avail_addr + 4 + 
+                             (qs->last_avail_idx & (qs->num - 1)) * 2);
+    if (desc_idx >= (int)qs->num)
+        return -1;
+    if (virtio_iov_build(s, virtio_get_iov(s, queue_idx, desc_idx),
+                         queue_idx, desc_idx))
+        return -1;
+    *pdesc_idx = desc_idx;
+    return 1;
+}
+
+static void virtio_queue_advance(VIRTIODevice *s, int queue_idx)
+{
+    if (virtio_has_feature(s, VIRTIO_F_RING_PACKED))
+        virtio_packed_advance(s, queue_idx);
+    else
+        s->queue[queue_idx].last_avail_idx++;
+}
+
+/* return TRUE if the driver made buffers available */
+static BOOL virtio_queue_has_avail(VIRTIODevice *s, int queue_idx)
+{
+    QueueState *qs = &s->queue[queue_idx];
+    VIRTIOPackedDesc desc;
+
+    if (!qs->ready)
+        return FALSE;
+    if (virtio_has_feature(s, VIRTIO_F_RING_PACKED)) {
+        virtio_read_packed_desc(s, &desc, qs->desc_addr, qs->last_avail_idx);
+        return virtio_packed_desc_is_avail(&desc, qs->avail_wrap_counter);
+    }
+    return qs->last_avail_idx != virtio_read16(s, qs->avail_addr + 2);
+}
+
+static int memcpy_to_from_queue(VIRTIODevice *s, uint8_t *buf,
+                                int queue_idx, int desc_idx,
+                                int offset, int count, BOOL to_queue)
+{
+    VIRTIOIOVec *iov = virtio_get_iov(s, queue_idx, desc_idx);
+    VIRTIOSeg *seg;
+    int i, pos, end, l, dir, seg_offset;
+
+#ifdef DEBUG_VIRTIO
+    if (to_queue) {
+        printf("Reading from buf %p, len = %u, to queue qidx = %d, desc_idx = %d\n",
+            buf, count, queue_idx, desc_idx);
+    }
+    else {
+        printf("Reading from queue qidx = %d, desc_idx = %d, offset = %u, len = %u, to buf %p\n",
+            queue_idx, desc_idx, offset, count, buf);
+    }
+#endif
+    if (count == 0)
+        return 0;
+
+    if (to_queue) {
+        dir = 1;
+        i = iov->nb_read_segs;
+        end = iov->nb_segs;
+        if (offset + count > iov->write_size)
+            return -1;
+    } else {
+        dir = 0;
+        i = 0;
+        end = iov->nb_read_segs;
+        if (offset + count > iov->read_size)
+            return -1;
+    }
+    pos = 0;
+    /* resume from the last access if it is before the offset */
+    if (iov->cur_seg[dir] >= 0 && iov->cur_pos[dir] <= offset) {
+        i = iov->cur_seg[dir];
+        pos = iov->cur_pos[dir];
+    }
+
+    /* find the segment at offset */
+    while (offset >= pos + (int)iov->seg[i].len) {
+        pos += iov->seg[i].len;
+        i++;
+    }
+#ifdef DEBUG_VIRTIO
+    printf("Segment located at index %d, offset = %u\n", i, offset - pos);
+#endif
+
+    for(;;) {
+        seg = &iov->seg[i];
+        seg_offset = offset - pos;
+        l = min_int(count, seg->len - seg_offset);
+        if (to_queue) {
+            if (seg->ptr)
+                memcpy(seg->ptr + seg_offset, buf, l);
+            else
+                virtio_memcpy_to_ram(s, seg->addr + seg_offset, buf, l);
+        } else {
+            if (seg->ptr)
+                memcpy(buf, seg->ptr + seg_offset, l);
+            else
+                virtio_memcpy_from_ram(s, buf, seg->addr + seg_offset, l);
+        }
+        count -= l;
+        offset += l;
+        buf += l;
+        if (count == 0)
+            break;
+        pos += seg->len;
+        i++;
+        assert(i < end);
+    }
+    iov->cur_seg[dir] = i;
+    iov->cur_pos[dir] = pos;
+#ifdef DEBUG_VIRTIO
+    printf("Reading successfully finished.\n");
+#endif 
+    return 0;
+}
+
+static int memcpy_from_queue(VIRTIODevice *s, void *buf,
+                             int queue_idx, int desc_idx,
+                             int offset, int count)
+{
+    return memcpy_to_from_queue(s, (uint8_t*)buf, queue_idx, desc_idx, offset, count,
+                                FALSE);
+}
+
+/* return in host_iov the host memory of [offset, offset + count) of the
+   device writable (to_queue = TRUE) or readable part of the buffer, so
+   that it can be accessed without copy. Segments which are contiguous
+   in host memory are merged. Return the number of entries or -1 if a
+   segment is not in host memory or max_iov is too small. */
+static int virtio_queue_get_host_iov(VIRTIODevice *s, int queue_idx,
+                                     int desc_idx, int offset, int count,
+                                     BOOL to_queue, struct iovec *host_iov,
+                                     int max_iov)
+{
+    VIRTIOIOVec *iov = virtio_get_iov(s, queue_idx, desc_idx);
+    VIRTIOSeg *seg;
+    int i, end, l, n, seg_offset;
+
+    if (to_queue) {
+        i = iov->nb_read_segs;
+        end = iov->nb_segs;
+        if (offset + count > iov->write_size)
+            return -1;
+    } else {
+        i = 0;
+        end = iov->nb_read_segs;
+        if (offset + count > iov->read_size)
+            return -1;
+    }
+    n = 0;
+    for(; i < end && count > 0; i++) {
+        seg = &iov->seg[i];
+        if (offset >= (int)seg->len) {
+            offset -= seg->len;
+            continue;
+        }
+        if (!seg->ptr)
+            return -1;
+        seg_offset = offset;
+        offset = 0;
+        l = min_int(count, seg->len - seg_offset);
+        if (n > 0 && (uint8_t *)host_iov[n - 1].iov_base +
+            host_iov[n - 1].iov_len == seg->ptr + seg_offset) {
+            host_iov[n - 1].iov_len += l;
+        } else {
+            if (n >= max_iov)
+                return -1;
+            host_iov[n].iov_base = seg->ptr + seg_offset;
+            host_iov[n].iov_len = l;
+            n++;
+        }
+        count -= l;
+    }
+    return n;
+}
+
+static int memcpy_to_queue(VIRTIODevice *s,
+                           int queue_idx, int desc_idx,
+                           int offset, const void *buf, int count)
+{
+    return memcpy_to_from_queue(s, (uint8_t *)buf, queue_idx, desc_idx, offset,
+                                count, TRUE);
+}
+
+/* same as vring_need_event() in the Linux kernel */
+static BOOL vring_need_event(uint16_t event_idx, uint16_t new_idx,
+                             uint16_t old_idx)
+{
+    return (uint16_t)(new_idx - event_idx - 1) < (uint16_t)(new_idx - old_idx);
+}
+
+/* same as vring_packed_need_event() in QEMU */
+static BOOL vring_packed_need_event(VIRTIODevice *s, int queue_idx,
+                                    uint16_t off_wrap, uint16_t new_idx,
+                                    uint16_t old_idx)
+{
+    QueueState *qs = &s->queue[queue_idx];
+    int off = off_wrap & ~(1 << 15);
+
+    if (qs->used_wrap_counter != (off_wrap >> 15))
+        off -= qs->num;
+    return vring_need_event(off, new_idx, old_idx);
+}
+
+/* raise the used buffer interrupt unless the driver asked not to be
+   signalled for the completions published since the last one */
+static void virtio_queue_signal(VIRTIODevice *s, int queue_idx)
+{
+    QueueState *qs = &s->queue[queue_idx];
+    uint16_t old_idx, new_idx, event_idx;
+    BOOL notify;
+
+    qs->irq_pending = 0;
+    s->irq_pending_mask &= ~(1 << queue_idx);
+    s->sched.cancel(&qs->irq_timer);
+
+    old_idx = qs->signalled_used;
+    new_idx = qs->used_idx;
+    if (virtio_has_feature(s, VIRTIO_F_RING_PACKED)) {
+        /* driver event suppression structure */
+        uint16_t off_wrap = virtio_read16(s, qs->avail_addr);
+        uint16_t flags = virtio_read16(s, qs->avail_addr + 2) & 3;
+        if (flags == VRING_PACKED_EVENT_FLAG_DISABLE)
+            notify = FALSE;
+        else if (flags == VRING_PACKED_EVENT_FLAG_DESC &&
+                 virtio_has_feature(s, VIRTIO_RING_F_EVENT_IDX))
+            notify = !qs->signalled_used_valid ||
+                vring_packed_need_event(s, queue_idx, off_wrap,
+                                        new_idx, old_idx);
+        else
+            notify = TRUE;
+    } else if (virtio_has_feature(s, VIRTIO_RING_F_EVENT_IDX)) {
+        event_idx = virtio_read16(s, qs->avail_addr + 4 + qs->num * 2);
+        notify = !qs->signalled_used_valid ||
+            vring_need_event(event_idx, new_idx, old_idx);
+    } else {
+        notify = !(virtio_read16(s, qs->avail_addr) &
+                   VRING_AVAIL_F_NO_INTERRUPT);
+    }
+    qs->signalled_used = new_idx;
+    qs->signalled_used_valid = TRUE;
+    if (notify) {
+        s->int_status |= 1;
+        set_irq(s->irq, 1);
+        virtio_trace(s, VTRACE_EV_IRQ, queue_idx, 0, s->int_status, 0);
+    }
+}
+
+/* write the pending used elements to the used ring, publish them with
+   a single store of used->idx and signal the driver once */
+static void virtio_queue_flush_used(VIRTIODevice *s, int queue_idx)
+{
+    QueueState *qs = &s->queue[queue_idx];
+    uint8_t buf[MAX_QUEUE_NUM * 8];
+    int i, n, pos, len;
+
+    n = qs->nb_used_pending;
+    if (n == 0)
+        return;
+    qs->nb_used_pending = 0;
+    if (__atomic_load_n(&s->trace, __ATOMIC_RELAXED)) {
+        for(i = 0; i < n; i++)
+            virtio_trace(s, VTRACE_EV_USED, queue_idx, qs->used_pending[i].id,
+                         qs->used_pending[i].len, 0);
+    }
+
+    if (virtio_has_feature(s, VIRTIO_F_RING_PACKED)) {
+        for(i = 0; i < n; i++) {
+            virtio_packed_consume_desc(s, queue_idx, qs->used_pending[i].id,
+                                       qs->used_pending[i].len);
+        }
+    } else {
+        for(i = 0; i < n; i++) {
+            put_le32(buf + i * 8, qs->used_pending[i].id);
+            put_le32(buf + i * 8 + 4, qs->used_pending[i].len);
+        }
+        /* the elements are contiguous except when the ring wraps */
+        pos = qs->used_idx & (qs->num - 1);
+        len = min_int(n, qs->num - pos);
+        virtio_memcpy_to_ram(s, qs->used_addr + 4 + pos * 8, buf, len * 8);
+        if (len < n)
+            virtio_memcpy_to_ram(s, qs->used_addr + 4, buf + len * 8,
+                                 (n - len) * 8);
+        qs->used_idx += n;
+        virtio_write16(s, qs->used_addr + 2, qs->used_idx);
+    }
+
+    if (qs->irq_pending == 0) {
+        qs->irq_pending_tick = s->ticks;
+        s->irq_pending_mask |= 1 << queue_idx;
+    }
+    qs->irq_pending += n;
+    if (qs->irq_pending >= s->irq_max_batch)
+        virtio_queue_signal(s, queue_idx);
+    else if (!qs->irq_timer.armed())
+        s->sched.arm(&qs->irq_timer, qs->irq_pending_tick + s->irq_max_delay);
+}
+
+static void virtio_irq_timer_cb(device_timer_t *t)
+{
+    VIRTIODevice *s = (VIRTIODevice *)t->opaque;
+    QueueState *qs = list_entry(t, QueueState, irq_timer);
+
+    virtio_queue_signal(s, qs - s->queue);
+}
+
+/* signal that the descriptor has been consumed. Inside a
+   queue_notify() pass the used element is only queued. */
+static void virtio_consume_desc(VIRTIODevice *s,
+                                int queue_idx, int desc_idx, int desc_len)
+{
+    QueueState *qs = &s->queue[queue_idx];
+    VIRTIOUsedElem *e;
+
+    /* cannot overflow: each pending element owns a ring entry */
+    assert(qs->nb_used_pending < MAX_QUEUE_NUM);
+    e = &qs->used_pending[qs->nb_used_pending++];
+    e->id = desc_idx;
+    e->len = desc_len;
+    if (!qs->batch_used)
+        virtio_queue_flush_used(s, queue_idx);
+}
+
+/* tell the driver to kick again once it goes past last_avail_idx */
+static void virtio_update_avail_event(VIRTIODevice *s, int queue_idx)
+{
+    QueueState *qs = &s->queue[queue_idx];
+    /* the packed ring device event structure is left enabled */
+    if (!qs->polling &&
+        virtio_has_feature(s, VIRTIO_RING_F_EVENT_IDX) &&
+        !virtio_has_feature(s, VIRTIO_F_RING_PACKED))
+        virtio_write16(s, qs->used_addr + 4 + qs->num * 8,
+                       qs->last_avail_idx);
+}
+
+/* enable or suppress the driver notifications of the queue */
+static void virtio_queue_set_notification(VIRTIODevice *s, int queue_idx,
+                                          BOOL enable)
+{
+    QueueState *qs = &s->queue[queue_idx];
+
+    if (virtio_has_feature(s, VIRTIO_F_RING_PACKED)) {
+        /* flags of the device event suppression structure */
+        virtio_write16(s, qs->used_addr + 2,
+                       enable ? VRING_PACKED_EVENT_FLAG_ENABLE :
+                       VRING_PACKED_EVENT_FLAG_DISABLE);
+    } else if (virtio_has_feature(s, VIRTIO_RING_F_EVENT_IDX)) {
+        /* the driver ignores used->flags. An event index it already
+           went past is only crossed again after the index wraps. */
+        virtio_write16(s, qs->used_addr + 4 + qs->num * 8,
+                       enable ? qs->last_avail_idx :
+                       (uint16_t)(qs->last_avail_idx - 1));
+    } else {
+        virtio_write16(s, qs->used_addr,
+                       enable ? 0 : VRING_USED_F_NO_NOTIFY);
+    }
+}
+
+/* receive the available buffers of the queue. Return the number of
+   buffers taken. */
+static int queue_process(VIRTIODevice *s, int queue_idx)
+{
+    QueueState *qs = &s->queue[queue_idx];
+    VIRTIOIOVec *iov;
+    int ret, desc_idx, read_size, write_size, count;
+
+    if (qs->manual_recv)
+        return 0;
+
+#ifdef DEBUG_VIRTIO
+    printf("qs->last_avail_idx = %d\n", qs->last_avail_idx);
+#endif 
+    /* the completions of this pass are published together */
+    qs->batch_used = TRUE;
+    count = 0;
+    for(;;) {
+        ret = virtio_queue_peek(s, queue_idx, &desc_idx);
+        if (ret == 0)
+            break;
+        if (ret > 0) {
+            iov = virtio_get_iov(s, queue_idx, desc_idx);
+            read_size = iov->read_size;
+            write_size = iov->write_size;
+#ifdef DEBUG_VIRTIO
+            {
+                printf("queue_notify: idx=%d read_size=%d write_size=%d\n",
+                       queue_idx, read_size, write_size);
+            }
+#endif
+            virtio_trace(s, VTRACE_EV_POP, queue_idx, desc_idx,
+                         read_size, write_size);
+            if (s->device_recv(s, queue_idx, desc_idx,
+                               read_size, write_size) < 0)
+                break;
+            count++;
+        }
+        virtio_queue_advance(s, queue_idx);
+    }
+    if (s->device_notify_end)
+        s->device_notify_end(s, queue_idx);
+    qs->batch_used = FALSE;
+    virtio_queue_flush_used(s, queue_idx);
+    virtio_update_avail_event(s, queue_idx);
+    return count;
+}
+
+/* XXX: test if the queue is ready ? */
+static void queue_notify(VIRTIODevice *s, int queue_idx)
+{
+    virtio_trace(s, VTRACE_EV_NOTIFY, queue_idx, 0,
+                 s->queue[queue_idx].last_avail_idx, 0);
+    queue_process(s, queue_idx);
+}
+
+/* process the notified and polled queues. The notifications of a
+   queue are suppressed as long as polling finds new buffers. Return
+   TRUE if a queue is polled or notified again. */
+static BOOL virtio_poll_queues(VIRTIODevice *s)
+{
+    BOOL active = FALSE;
+    int i;
+
+    for(i = 0; i < MAX_QUEUE; i++) {
+        QueueState *qs = &s->queue[i];
+        if (!(s->notify_pending_mask & (1 << i)) && !qs->polling)
+            continue;
+        s->notify_pending_mask &= ~(1 << i);
+        if (!qs->ready)
+            continue;
+        if (queue_process(s, i) > 0) {
+            qs->poll_last_tick = s->ticks;
+            if (!qs->polling) {
+                qs->polling = TRUE;
+                virtio_queue_set_notification(s, i, FALSE);
+            }
+        } else if (qs->polling &&
+                   s->ticks - qs->poll_last_tick >=
+                   (uint64_t)s->poll_idle_ticks) {
+            qs->polling = FALSE;
+            virtio_queue_set_notification(s, i, TRUE);
+            /* the driver may have added buffers without a notification
+               before it saw them enabled */
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (virtio_queue_has_avail(s, i))
+                s->notify_pending_mask |= 1 << i;
+        }
+        active |= qs->polling;
+    }
+    return active || s->notify_pending_mask != 0;
+}
+
+static void virtio_poll_timer_cb(device_timer_t *t)
+{
+    VIRTIODevice *s = (VIRTIODevice *)t->opaque;
+
+    if (virtio_poll_queues(s))
+        s->sched.arm(&s->poll_timer, s->ticks + 1);
+}
+
+static uint32_t virtio_config_read(VIRTIODevice *s, uint32_t offset,
+                                   int size_log2)
+{
+    uint32_t val;
+    switch(size_log2) {
+    case 0:
+        if (offset < s->config_space_size) {
+            val = s->config_space[offset];
+        } else {
+            val = 0;
+        }
+        break;
+    case 1:
+        if (offset < (s->config_space_size - 1)) {
+            val = get_le16(&s->config_space[offset]);
+        } else {
+            val = 0;
+        }
+        break;
+    case 2:
+        if (offset < (s->config_space_size - 3)) {
+            val = get_le32(s->config_space + offset);
+        } else {
+            val = 0;
+        }
+        break;
+    default:
+        abort();
+    }
+#ifdef DEBUG_VIRTIO
+    {
+        printf("virto_config_read: offset=0x%x val=0x%x size=%d\n", 
+               offset, val, 1 << size_log2);
+    }
+#endif
+    return val;
+}
+
+static void virtio_config_write(VIRTIODevice *s, uint32_t offset,
+                                uint32_t val, int size_log2)
+{
+    switch(size_log2) {
+    case 0:
+        if (offset < s->config_space_size) {
+            s->config_space[offset] = val;
+            if (s->config_write)
+                s->config_write(s);
+        }
+        break;
+    case 1:
+        if (offset < s->config_space_size - 1) {
+            put_le16(s->config_space + offset, val);
+            if (s->config_write)
+                s->config_write(s);
+        }
+        break;
+    case 2:
+        if (offset < s->config_space_size - 3) {
+            put_le32(s->config_space + offset, val);
+            if (s->config_write)
+                s->config_write(s);
+        }
+        break;
+    }
+}
+
+/* a region which does not exist has a length (and base) of -1 */
+static uint32_t virtio_mmio_shm_read(VIRTIODevice *s, uint32_t offset)
+{
+    VIRTIOShmRegion *r;
+    uint64_t val;
+
+    r = NULL;
+    if (s->shm_sel < MAX_SHM_REGION && s->shm[s->shm_sel].len != 0)
+        r = &s->shm[s->shm_sel];
+    if (offset == VIRTIO_MMIO_SHM_LEN_LOW ||
+        offset == VIRTIO_MMIO_SHM_LEN_HIGH)
+        val = r ? r->len : (uint64_t)-1;
+    else
+        val = r ? (uint64_t)r->base : (uint64_t)-1;
+    if (offset == VIRTIO_MMIO_SHM_LEN_HIGH ||
+        offset == VIRTIO_MMIO_SHM_BASE_HIGH)
+        val >>= 32;
+    return val;
+}
+
+static uint32_t virtio_mmio_read(VIRTIODevice *opaque, uint32_t offset, int size_log2)
+{
+    VIRTIODevice *s = (VIRTIODevice*)opaque;
+    uint32_t val;
+
+    if (offset >= VIRTIO_MMIO_CONFIG) {
+        return virtio_config_read(s, offset - VIRTIO_MMIO_CONFIG, size_log2);
+    }
+
+    if (size_log2 == 2) {
+        switch(offset) {
+        case VIRTIO_MMIO_MAGIC_VALUE:
+            val = 0x74726976;
+            break;
+        case VIRTIO_MMIO_VERSION:
+            val = 2;
+            break;
+        case VIRTIO_MMIO_DEVICE_ID:
+            val = s->device_id;
+            break;
+        case VIRTIO_MMIO_VENDOR_ID:
+            val = s->vendor_id;
+            break;
+        case VIRTIO_MMIO_DEVICE_FEATURES:
+            switch(s->device_features_sel) {
+            case 0:
+                val = s->device_features;
+                break;
+            case 1:
+                val = s->device_features >> 32;
+                break;
+            default:
+                val = 0;
+                break;
+            }
+            break;
+        case VIRTIO_MMIO_DEVICE_FEATURES_SEL:
+            val = s->device_features_sel;
+            break;
+        case VIRTIO_MMIO_QUEUE_SEL:
+            val = s->queue_sel;
+            break;
+        case VIRTIO_MMIO_QUEUE_NUM_MAX:
+            val = MAX_QUEUE_NUM;
+            break;
+        case VIRTIO_MMIO_QUEUE_NUM:
+            val = s->queue[s->queue_sel].num;
+            break;
+        case VIRTIO_MMIO_QUEUE_DESC_LOW:
+            val = s->queue[s->queue_sel].desc_addr;
+            break;
+        case VIRTIO_MMIO_QUEUE_AVAIL_LOW:
+            val = s->queue[s->queue_sel].avail_addr;
+            break;
+        case VIRTIO_MMIO_QUEUE_USED_LOW:
+            val = s->queue[s->queue_sel].used_addr;
+            break;
+#if VIRTIO_ADDR_BITS == 64
+        case VIRTIO_MMIO_QUEUE_DESC_HIGH:
+            val = s->queue[s->queue_sel].desc_addr >> 32;
+            break;
+        case VIRTIO_MMIO_QUEUE_AVAIL_HIGH:
+            val = s->queue[s->queue_sel].avail_addr >> 32;
+            break;
+        case VIRTIO_MMIO_QUEUE_USED_HIGH:
+            val = s->queue[s->queue_sel].used_addr >> 32;
+            break;
+#endif
+        case VIRTIO_MMIO_QUEUE_READY:
+            val = s->queue[s->queue_sel].ready;
+            break;
+        case VIRTIO_MMIO_INTERRUPT_STATUS:
+            val = s->int_status;
+            break;
+        case VIRTIO_MMIO_STATUS:
+            val = s->status;
+            break;
+        case VIRTIO_MMIO_CONFIG_GENERATION:
+            val = 0;
+            break;
+        case VIRTIO_MMIO_SHM_LEN_LOW:
+        case VIRTIO_MMIO_SHM_LEN_HIGH:
+        case VIRTIO_MMIO_SHM_BASE_LOW:
+        case VIRTIO_MMIO_SHM_BASE_HIGH:
+            val = virtio_mmio_shm_read(s, offset);
+            break;
+        default:
+            val = 0;
+            break;
+        }
+    } else {
+        val = 0;
+    }
+#ifdef DEBUG_VIRTIO
+    {
+        printf("virto_mmio_read: offset=0x%x val=0x%x size=%d\n", 
+               offset, val, 1 << size_log2);
+    }
+#endif
+    return val;
+}
+
+#if VIRTIO_ADDR_BITS == 64
+static void set_low32(virtio_phys_addr_t *paddr, uint32_t val)
+{
+    *paddr = (*paddr & ~(virtio_phys_addr_t)0xffffffff) | val;
+}
+
+static void set_high32(virtio_phys_addr_t *paddr, uint32_t val)
+{
+    *paddr = (*paddr & 0xffffffff) | ((virtio_phys_addr_t)val << 32);
+}
+#else
+static void set_low32(virtio_phys_addr_t *paddr, uint32_t val)
+{
+    *paddr = val;
+}
+#endif
+
+static void virtio_mmio_write(VIRTIODevice *opaque, uint32_t offset,
+                              uint32_t val, int size_log2)
+{
+    VIRTIODevice *s = (VIRTIODevice*)opaque;
+    
+#ifdef DEBUG_VIRTIO
+    {
+        printf("virto_mmio_write: offset=0x%x val=0x%x size=%d\n",
+               offset, val, 1 << size_log2);
+    }
+#endif
+
+    if (offset >= VIRTIO_MMIO_CONFIG) {
+        virtio_config_write(s, offset - VIRTIO_MMIO_CONFIG, val, size_log2);
+        return;
+    }
+
+    if (size_log2 == 2) {
+        switch(offset) {
+        case VIRTIO_MMIO_DEVICE_FEATURES_SEL:
+            s->device_features_sel = val;
+            break;
+        case VIRTIO_MMIO_DRIVER_FEATURES:
+            switch(s->driver_features_sel) {
+            case 0:
+                s->driver_features = (s->driver_features &
+                                      ~(uint64_t)0xffffffff) |
+                    (val & s->device_features);
+                break;
+            case 1:
+                s->driver_features = (s->driver_features & 0xffffffff) |
+                    ((uint64_t)(val & (s->device_features >> 32)) << 32);
+                break;
+            default:
+                break;
+            }
+            break;
+        case VIRTIO_MMIO_DRIVER_FEATURES_SEL:
+            s->driver_features_sel = val;
+            break;
+        case VIRTIO_MMIO_QUEUE_SEL:
+            if (val < MAX_QUEUE)
+                s->queue_sel = val;
+            break;
+        case VIRTIO_MMIO_QUEUE_NUM:
+            if ((val & (val - 1)) == 0 && val > 0 && val <= MAX_QUEUE_NUM) {
+                s->queue[s->queue_sel].num = val;
+            }
+            break;
+        case VIRTIO_MMIO_QUEUE_DESC_LOW:
+            set_low32(&s->queue[s->queue_sel].desc_addr, val);
+            break;
+        case VIRTIO_MMIO_QUEUE_AVAIL_LOW:
+            set_low32(&s->queue[s->queue_sel].avail_addr, val);
+            break;
+        case VIRTIO_MMIO_QUEUE_USED_LOW:
+            set_low32(&s->queue[s->queue_sel].used_addr, val);
+            break;
+#if VIRTIO_ADDR_BITS == 64
+        case VIRTIO_MMIO_QUEUE_DESC_HIGH:
+            set_high32(&s->queue[s->queue_sel].desc_addr, val);
+            break;
+        case VIRTIO_MMIO_QUEUE_AVAIL_HIGH:
+            set_high32(&s->queue[s->queue_sel].avail_addr, val);
+            break;
+        case VIRTIO_MMIO_QUEUE_USED_HIGH:
+            set_high32(&s->queue[s->queue_sel].used_addr, val);
+            break;
+#endif
+        case VIRTIO_MMIO_STATUS:
+            s->status = val;
+            if (val == 0) {
+                /* reset */
+                set_irq(s->irq, 0);
+                virtio_reset(s);
+            }
+            break;
+        case VIRTIO_MMIO_QUEUE_READY:
+            s->queue[s->queue_sel].ready = val & 1;
+            break;
+        case VIRTIO_MMIO_SHM_SEL:
+            s->shm_sel = val;
+            break;
+        case VIRTIO_MMIO_QUEUE_NOTIFY:
+            if (val >= MAX_QUEUE)
+                break;
+            if (s->poll_idle_ticks > 0 && !s->queue[val].manual_recv) {
+                /* processed with the other buffers at the next tick */
+                virtio_trace(s, VTRACE_EV_NOTIFY, val, 0,
+                             s->queue[val].last_avail_idx, 0);
+                s->notify_pending_mask |= 1 << val;
+                if (!s->poll_timer.armed())
+                    s->sched.arm(&s->poll_timer, s->ticks);
+                break;
+            }
+#ifdef DEBUG_VIRTIO
+        printf("queue_notify on qidx %d invoked by MMIO write begin.\n", val);
+#endif
+            queue_notify(s, val);
+#ifdef DEBUG_VIRTIO
+        printf("queue_notify on qidx %d invoked by MMIO write finished.\n", val);
+#endif
+            break;
+        case VIRTIO_MMIO_INTERRUPT_ACK:
+            s->int_status &= ~val;
+            if (s->int_status == 0) {
+                set_irq(s->irq, 0);
+            }
+            break;
+        }
+    }
+}
+
+void virtio_set_debug(VIRTIODevice *s, int debug)
+{
+    s->debug = debug;
+}
+
+void virtio_set_irq_coalescing(VIRTIODevice *s, int max_batch, int max_delay)
+{
+    s->irq_max_batch = max_int(max_batch, 1);
+    s->irq_max_delay = max_int(max_delay, 0);
+}
+
+void virtio_set_polling(VIRTIODevice *s, int idle_ticks)
+{
+    int i;
+
+    s->poll_idle_ticks = max_int(idle_ticks, 0);
+    if (s->poll_idle_ticks > 0)
+        return;
+    /* back to the synchronous processing of the notifications */
+    s->sched.cancel(&s->poll_timer);
+    for(i = 0; i < MAX_QUEUE; i++) {
+        QueueState *qs = &s->queue[i];
+        if (qs->polling) {
+            qs->polling = FALSE;
+            virtio_queue_set_notification(s, i, TRUE);
+            s->notify_pending_mask |= 1 << i;
+        }
+        if ((s->notify_pending_mask & (1 << i)) && qs->ready)
+            queue_process(s, i);
+    }
+    s->notify_pending_mask = 0;
+}
+
+/* The window must be page aligned RAM of the simulator which the guest
+   does not use otherwise. Its content is not part of the device state. */
+int virtio_set_shm_region(VIRTIODevice *s, int id, uint64_t base,
+                          uint64_t len)
+{
+    if (id < 0 || id >= MAX_SHM_REGION)
+        return -1;
+    if (len != 0) {
+        if (((base | len) & (DMA_PAGE_SIZE - 1)) != 0 ||
+            base + len < base ||
+            !s->get_ram_ptr(s, base, TRUE) ||
+            !s->get_ram_ptr(s, base + len - DMA_PAGE_SIZE, TRUE))
+            return -1;
+    }
+    s->shm[id].base = base;
+    s->shm[id].len = len;
+    return 0;
+}
+
+int virtio_shm_get_host_iov(VIRTIODevice *s, int id, uint64_t offset,
+                            uint64_t count, struct iovec *host_iov,
+                            int max_iov)
+{
+    VIRTIOShmRegion *r;
+    virtio_phys_addr_t addr;
+    uint8_t *ptr;
+    uint64_t l;
+    int n;
+
+    if (id < 0 || id >= MAX_SHM_REGION)
+        return -1;
+    r = &s->shm[id];
+    if (offset > r->len || count > r->len - offset)
+        return -1;
+    addr = r->base + offset;
+    n = 0;
+    while (count > 0) {
+        l = DMA_PAGE_SIZE - (addr & (DMA_PAGE_SIZE - 1));
+        if (l > count)
+            l = count;
+        ptr = s->get_ram_ptr(s, addr, TRUE);
+        if (!ptr)
+            return -1;
+        if (n > 0 && (uint8_t *)host_iov[n - 1].iov_base +
+            host_iov[n - 1].iov_len == ptr) {
+            host_iov[n - 1].iov_len += l;
+        } else {
+            if (n >= max_iov)
+                return -1;
+            host_iov[n].iov_base = ptr;
+            host_iov[n].iov_len = l;
+            n++;
+        }
+        addr += l;
+        count -= l;
+    }
+    return n;
+}
+
+/* incremented by SIGUSR1: the devices dump their statistics on their
+   next tick. Each device plugin has its own copy, so the handler calls
+   the one installed before it. */
+static volatile sig_atomic_t virtio_stats_requests;
+static struct sigaction virtio_stats_old_sa;
+
+static void virtio_stats_signal(int sig, siginfo_t *info, void *ctx)
+{
+    virtio_stats_requests++;
+    if (virtio_stats_old_sa.sa_flags & SA_SIGINFO)
+        virtio_stats_old_sa.sa_sigaction(sig, info, ctx);
+    else if (virtio_stats_old_sa.sa_handler != SIG_DFL &&
+             virtio_stats_old_sa.sa_handler != SIG_IGN)
+        virtio_stats_old_sa.sa_handler(sig);
+}
+
+void virtio_install_stats_signal(void)
+{
+    static BOOL installed;
+    struct sigaction sa;
+
+    if (installed)
+        return;
+    installed = TRUE;
+    if (sigaction(SIGUSR1, NULL, &virtio_stats_old_sa) < 0 ||
+        virtio_stats_old_sa.sa_handler == SIG_IGN)
+        return;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = virtio_stats_signal;
+    sa.sa_flags = SA_RESTART | SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+}
+
+/* number of statistics requests received so far */
+int virtio_stats_request_count(void)
+{
+    return virtio_stats_requests;
+}
+
+/* run the deadlines which are due: queues in polling mode, coalesced
+   interrupts whose delay has expired and the timers of the device */
+void virtio_tick(VIRTIODevice *s, uint64_t rtc_ticks)
+{
+    /* also read by the backend threads when tracing */
+    __atomic_store_n(&s->ticks, s->ticks + rtc_ticks, __ATOMIC_RELAXED);
+    s->sched.advance(s->ticks);
+}
+
+device_sched_t *virtio_get_sched(VIRTIODevice *s)
+{
+    return &s->sched;
+}
+
+static void virtio_config_change_notify(VIRTIODevice *s)
+{
+    /* INT_CONFIG interrupt */
+    s->int_status |= 2;
+    set_irq(s->irq, 1);
+    virtio_trace(s, VTRACE_EV_IRQ, 0xff, 0, s->int_status, 0);
+}
+
+/*********************************************************************/
+/* device state */
+
+#define VIRTIO_STATE_VERSION 2
+
+/* TRUE if requests taken from the queues are in progress. Their state
+   is not saved: the caller completes them before saving the device. */
+int virtio_is_busy(VIRTIODevice *s)
+{
+    return s->device_busy && s->device_busy(s);
+}
+
+/* the transport and queue state, then the device specific
+   state. Return < 0 if it cannot be saved. */
+int virtio_save_state(VIRTIODevice *s, device_state_writer_t *w)
+{
+    int i, j;
+
+    if (virtio_is_busy(s))
+        return -1;
+    w->put_u32(VIRTIO_STATE_VERSION);
+    w->put_u32(s->device_id);
+    w->put_u32(s->status);
+    w->put_u32(s->int_status);
+    w->put_u32(s->device_features_sel);
+    w->put_u32(s->driver_features_sel);
+    w->put_u64(s->driver_features);
+    w->put_u32(s->queue_sel);
+    w->put_u32(s->config_space_size);
+    w->put_bytes(s->config_space, s->config_space_size);
+    w->put_u32(s->irq_pending_mask);
+    w->put_u64(s->ticks);
+    w->put_u32(MAX_QUEUE);
+    for(i = 0; i < MAX_QUEUE; i++) {
+        QueueState *qs = &s->queue[i];
+        w->put_u8(qs->ready);
+        w->put_u32(qs->num);
+        w->put_u64(qs->desc_addr);
+        w->put_u64(qs->avail_addr);
+        w->put_u64(qs->used_addr);
+        w->put_u16(qs->last_avail_idx);
+        w->put_u8(qs->avail_wrap_counter);
+        w->put_u8(qs->used_wrap_counter);
+        w->put_u32(qs->pending_descs);
+        w->put_u32(qs->nb_used_pending);
+        for(j = 0; j < qs->nb_used_pending; j++) {
+            w->put_u32(qs->used_pending[j].id);
+            w->put_u32(qs->used_pending[j].len);
+        }
+        w->put_u16(qs->used_idx);
+        w->put_u16(qs->signalled_used);
+        w->put_u8(qs->signalled_used_valid);
+        w->put_u32(qs->irq_pending);
+        w->put_u64(qs->irq_pending_tick);
+    }
+    w->put_u32(s->shm_sel);
+    if (s->device_save)
+        return s->device_save(s, w);
+    return 0;
+}
+
+/* must be called once the guest memory is restored: the buffers
+   made available by the driver are processed. Return < 0 if the state
+   does not belong to this device, which is then reset. */
+int virtio_load_state(VIRTIODevice *s, device_state_reader_t *r)
+{
+    int i, j;
+    uint32_t version;
+
+    if (virtio_is_busy(s))
+        return -1;
+    version = r->get_u32();
+    if (version > VIRTIO_STATE_VERSION || r->get_u32() != s->device_id)
+        goto fail;
+    s->status = r->get_u32();
+    s->int_status = r->get_u32();
+    s->device_features_sel = r->get_u32();
+    s->driver_features_sel = r->get_u32();
+    s->driver_features = r->get_u64();
+    s->queue_sel = r->get_u32();
+    if (r->get_u32() != s->config_space_size)
+        goto fail;
+    r->get_bytes(s->config_space, s->config_space_size);
+    s->irq_pending_mask = r->get_u32();
+    s->ticks = r->get_u64();
+    /* the transport timers are armed again from the saved state, those
+       of the device keep their delay */
+    s->sched.cancel(&s->poll_timer);
+    for(i = 0; i < MAX_QUEUE; i++)
+        s->sched.cancel(&s->queue[i].irq_timer);
+    s->sched.rebase(s->ticks);
+    if (r->get_u32() != MAX_QUEUE)
+        goto fail;
+    for(i = 0; i < MAX_QUEUE; i++) {
+        QueueState *qs = &s->queue[i];
+        qs->ready = r->get_u8();
+        qs->num = r->get_u32();
+        qs->desc_addr = r->get_u64();
+        qs->avail_addr = r->get_u64();
+        qs->used_addr = r->get_u64();
+        qs->last_avail_idx = r->get_u16();
+        qs->avail_wrap_counter = r->get_u8();
+        qs->used_wrap_counter = r->get_u8();
+        qs->pending_descs = r->get_u32();
+        qs->batch_used = FALSE;
+        qs->nb_used_pending = r->get_u32();
+        if (qs->num > MAX_QUEUE_NUM ||
+            (uint32_t)qs->nb_used_pending > MAX_QUEUE_NUM)
+            goto fail;
+        for(j = 0; j < qs->nb_used_pending; j++) {
+            qs->used_pending[j].id = r->get_u32();
+            qs->used_pending[j].len = r->get_u32();
+        }
+        qs->used_idx = r->get_u16();
+        qs->signalled_used = r->get_u16();
+        qs->signalled_used_valid = r->get_u8();
+        qs->irq_pending = r->get_u32();
+        qs->irq_pending_tick = r->get_u64();
+        if (qs->irq_pending > 0)
+            s->sched.arm(&qs->irq_timer,
+                         qs->irq_pending_tick + s->irq_max_delay);
+    }
+    /* no shared memory region before version 2 */
+    s->shm_sel = version >= 2 ? r->get_u32() : 0;
+    if (!r->ok() || (s->device_load && s->device_load(s, r) < 0) ||
+        !r->ok())
+        goto fail;
+    set_irq(s->irq, s->int_status != 0);
+    /* the polling state is not saved: the notifications suppressed in
+       the restored guest memory are enabled again */
+    s->notify_pending_mask = 0;
+    for(i = 0; i < MAX_QUEUE; i++) {
+        s->queue[i].polling = FALSE;
+        if (s->queue[i].ready) {
+            virtio_queue_set_notification(s, i, TRUE);
+            queue_notify(s, i);
+        }
+    }
+    return 0;
+ fail:
+    virtio_reset(s);
+    set_irq(s->irq, 0);
+    return -1;
+}
+
+/*********************************************************************/
+/* block device */
+
+typedef struct {
+    VIRTIODevice *dev;
+    uint32_t type;
+    uint8_t *buf;
+    int write_size;
+    int queue_idx;
+    int desc_idx;
+    int stat_type;
+    int64_t start_time; /* in ns */
+} BlockRequest;
+
+/* statistics, always collected. The histograms have log2 buckets:
+   bucket i counts the values in [2^i, 2^(i+1)), bucket 0 also counts
+   0. */
+
+enum {
+    VIRTIO_BLK_STAT_READ,
+    VIRTIO_BLK_STAT_WRITE,
+    VIRTIO_BLK_STAT_FLUSH,
+    VIRTIO_BLK_STAT_DISCARD,
+    VIRTIO_BLK_STAT_WRITE_ZEROES,
+    VIRTIO_BLK_STAT_OTHER, /* unsupported */
+    VIRTIO_BLK_STAT_TYPES,
+};
+
+#define VIRTIO_HIST_BUCKETS 40
+
+typedef struct {
+    uint64_t requests;
+    uint64_t bytes;
+    uint64_t merges; /* guest segments merged in a single host I/O */
+    uint64_t merged_requests; /* issued with the previous request */
+    uint64_t errors;
+    uint64_t latency_hist[VIRTIO_HIST_BUCKETS]; /* host latency in ns */
+} BlockTypeStats;
+
+/* maximum number of host memory ranges of a request transferred
+   without copy */
+#define VIRTIO_BLK_MAX_HOST_IOV 64
+/* maximum number of host memory ranges of merged requests */
+#define VIRTIO_BLK_MAX_MERGE_IOV 256
+
+/* IN or OUT request transferred without copy, issued at the end of
+   the notification */
+typedef struct {
+    BlockRequest *req;
+    uint64_t sector_num;
+    int nb_sectors;
+    int iov_start; /* in merge_iov */
+    int iovcnt;
+} BlockMergeEntry;
+
+/* requests issued as a single backend operation */
+typedef struct {
+    int nb_reqs;
+    BlockRequest *reqs[MAX_QUEUE_NUM];
+} BlockMergedOp;
+
+struct VIRTIOBlockDevice : public VIRTIODevice {
+public:
+    BlockDevice *bs;
+
+    int num_queues;
+    /* requests in progress, indexed by head descriptor. They can
+       complete in any order. */
+    BlockRequest req[MAX_QUEUE][MAX_QUEUE_NUM];
+
+    /* the IN and OUT requests of a notification are gathered, and
+       those with contiguous sectors are merged, sorted by sector if
+       merge_sort is set */
+    BOOL merge;
+    BOOL merge_sort;
+    int nb_merge;
+    BlockMergeEntry merge_tab[MAX_QUEUE_NUM];
+    int merge_iovcnt;
+    struct iovec merge_iov[MAX_QUEUE_NUM * VIRTIO_BLK_MAX_HOST_IOV];
+
+    int nb_inflight; /* requests in progress */
+    BOOL resetting; /* the completions are not returned to the guest */
+    BlockTypeStats stats[VIRTIO_BLK_STAT_TYPES];
+    uint64_t queue_depth_hist[VIRTIO_HIST_BUCKETS]; /* at submission */
+} ;
+
+typedef struct {
+    uint32_t type;
+    uint32_t ioprio;
+    uint64_t sector_num;
+} BlockRequestHeader;
+
+#define VIRTIO_BLK_F_FLUSH       9
+#define VIRTIO_BLK_F_MQ          12
+#define VIRTIO_BLK_F_DISCARD     13
+#define VIRTIO_BLK_F_WRITE_ZEROES 14
+
+#define VIRTIO_BLK_T_IN          0
+#define VIRTIO_BLK_T_OUT         1
+#define VIRTIO_BLK_T_FLUSH       4
+#define VIRTIO_BLK_T_FLUSH_OUT   5
+#define VIRTIO_BLK_T_DISCARD     11
+#define VIRTIO_BLK_T_WRITE_ZEROES 13
+
+/* discard and write zeroes segment */
+typedef struct {
+    uint64_t sector_num;
+    uint32_t num_sectors;
+    uint32_t flags;
+} BlockRequestSegment;
+
+#define VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP (1 << 0)
+
+#define VIRTIO_BLK_S_OK     0
+#define VIRTIO_BLK_S_IOERR  1
+#define VIRTIO_BLK_S_UNSUPP 2
+
+#define SECTOR_SIZE 512
+
+/* configuration space offsets */
+#define VIRTIO_BLK_CONFIG_NUM_QUEUES              34
+#define VIRTIO_BLK_CONFIG_MAX_DISCARD_SECTORS     36
+#define VIRTIO_BLK_CONFIG_MAX_DISCARD_SEG         40
+#define VIRTIO_BLK_CONFIG_DISCARD_SECTOR_ALIGN    44
+#define VIRTIO_BLK_CONFIG_MAX_WRITE_ZEROES_SECTORS 48
+#define VIRTIO_BLK_CONFIG_MAX_WRITE_ZEROES_SEG    52
+#define VIRTIO_BLK_CONFIG_WRITE_ZEROES_MAY_UNMAP  56
+#define VIRTIO_BLK_CONFIG_SIZE                    60
+
+/* discard and write zeroes limits */
+#define VIRTIO_BLK_MAX_DISCARD_SECTORS (1 << 22) /* per segment */
+#define VIRTIO_BLK_MAX_DISCARD_SEG     32
+#define VIRTIO_BLK_DISCARD_ALIGN       8 /* sectors */
+
+static inline int virtio_hist_bucket(uint64_t v)
+{
+    if (v == 0)
+        return 0;
+    return min_int(63 - __builtin_clzll(v), VIRTIO_HIST_BUCKETS - 1);
+}
+
+static void virtio_block_stat_start(VIRTIOBlockDevice *s, BlockRequest *req,
+                                    int stat_type, uint32_t len)
+{
+    req->stat_type = stat_type;
+    req->start_time = virtio_get_time_ns();
+    virtio_trace(s, VTRACE_EV_SUBMIT, req->queue_idx, req->desc_idx,
+                 stat_type, len);
+    s->stats[stat_type].requests++;
+    s->stats[stat_type].bytes += len;
+    s->nb_inflight++;
+    s->queue_depth_hist[virtio_hist_bucket(s->nb_inflight)]++;
+}
+
+static void virtio_block_stat_end(VIRTIOBlockDevice *s, BlockRequest *req,
+                                  int ret)
+{
+    BlockTypeStats *st = &s->stats[req->stat_type];
+    int64_t d;
+
+    d = virtio_get_time_ns() - req->start_time;
+    virtio_trace(s, VTRACE_EV_COMPLETE, req->queue_idx, req->desc_idx,
+                 ret, 0);
+    st->latency_hist[virtio_hist_bucket(d > 0 ? d : 0)]++;
+    if (ret < 0)
+        st->errors++;
+    s->nb_inflight--;
+}
+
+static void virtio_dump_hist(FILE *f, const uint64_t *hist)
+{
+    int i, n;
+
+    /* the trailing empty buckets are omitted */
+    for(n = VIRTIO_HIST_BUCKETS; n > 0 && hist[n - 1] == 0; n--)
+        continue;
+    fprintf(f, "[");
+    for(i = 0; i < n; i++)
+        fprintf(f, "%s%" PRIu64, i > 0 ? ", " : "", hist[i]);
+    fprintf(f, "]");
+}
+
+/* merge: issue the IN and OUT requests of a notification whose sectors
+   continue each other as a single operation. sort: sort them by sector
+   first, for the storage where seeks are expensive. */
+void virtio_block_set_merge(VIRTIODevice *s, int merge, int sort)
+{
+    VIRTIOBlockDevice *s1 = (VIRTIOBlockDevice *)s;
+
+    s1->merge = merge != 0;
+    s1->merge_sort = merge && sort;
+}
+
+/* write the statistics in JSON */
+void virtio_block_dump_stats(VIRTIODevice *s, FILE *f)
+{
+    static const char *type_names[VIRTIO_BLK_STAT_TYPES] = {
+        "read", "write", "flush", "discard", "write_zeroes", "other",
+    };
+    VIRTIOBlockDevice *s1 = (VIRTIOBlockDevice *)s;
+    BlockTypeStats *st;
+    int i;
+
+    fprintf(f, "{\n  \"in_flight\": %d,\n  \"types\": {\n", s1->nb_inflight);
+    for(i = 0; i < VIRTIO_BLK_STAT_TYPES; i++) {
+        st = &s1->stats[i];
+        fprintf(f, "    \"%s\": { \"requests\": %" PRIu64
+                ", \"bytes\": %" PRIu64 ", \"merges\": %" PRIu64
+                ", \"merged_requests\": %" PRIu64
+                ", \"errors\": %" PRIu64 ", \"latency_ns_log2\": ",
+                type_names[i], st->requests, st->bytes, st->merges,
+                st->merged_requests, st->errors);
+        virtio_dump_hist(f, st->latency_hist);
+        fprintf(f, " }%s\n", i < VIRTIO_BLK_STAT_TYPES - 1 ? "," : "");
+    }
+    fprintf(f, "  },\n  \"queue_depth_log2\": ");
+    virtio_dump_hist(f, s1->queue_depth_hist);
+    fprintf(f, "\n}\n");
+    fflush(f);
+}
+
+static void virtio_block_req_end(BlockRequest *req, int ret)
+{
+    VIRTIODevice *s = req->dev;
+    int write_size;
+    int queue_idx = req->queue_idx;
+    int desc_idx = req->desc_idx;
+    uint8_t *buf, buf1[1];
+#ifdef DEBUG_VIRTIO
+    printf("Entering req end func... ret = %d, req type =in?%d\n", ret, req->type);
+#endif 
+    virtio_block_stat_end((VIRTIOBlockDevice *)s, req, ret);
+    if (((VIRTIOBlockDevice *)s)->resetting) {
+        /* not returned to the driver, which is resetting the device */
+        if (req->type == VIRTIO_BLK_T_IN || req->type == VIRTIO_BLK_T_OUT)
+            free(req->buf);
+        return;
+    }
+    switch(req->type) {
+    case VIRTIO_BLK_T_IN:
+        write_size = req->write_size;
+        buf = req->buf;
+        if (ret < 0)
+            buf1[0] = VIRTIO_BLK_S_IOERR;
+        else
+            buf1[0] = VIRTIO_BLK_S_OK;
+        if (buf) {
+            buf[write_size - 1] = buf1[0];
+            memcpy_to_queue(s, queue_idx, desc_idx, 0, buf, write_size);
+            free(buf);
+        } else {
+            /* the data was read directly in the guest memory */
+            memcpy_to_queue(s, queue_idx, desc_idx, write_size - 1,
+                            buf1, sizeof(buf1));
+        }
+        virtio_consume_desc(s, queue_idx, desc_idx, write_size);
+        break;
+    case VIRTIO_BLK_T_OUT:
+        free(req->buf); /* NULL if the data was written from guest memory */
+        /* fall thru */
+    case VIRTIO_BLK_T_FLUSH:
+    case VIRTIO_BLK_T_DISCARD:
+    case VIRTIO_BLK_T_WRITE_ZEROES:
+        if (ret < 0)
+            buf1[0] = VIRTIO_BLK_S_IOERR;
+        else
+            buf1[0] = VIRTIO_BLK_S_OK;
+        memcpy_to_queue(s, queue_idx, desc_idx, 0, buf1, sizeof(buf1));
+        virtio_consume_desc(s, queue_idx, desc_idx, 1);
+        break;
+    default:
+        abort();
+    }
+}
+
+static void virtio_block_req_cb(void *opaque, int ret)
+{
+    BlockRequest *req = (BlockRequest *)opaque;
+
+    virtio_block_req_end(req, ret);
+}
+
+static void virtio_block_merged_cb(void *opaque, int ret)
+{
+    BlockMergedOp *op = (BlockMergedOp *)opaque;
+    int i;
+
+    /* the requests share the result of the operation */
+    for(i = 0; i < op->nb_reqs; i++)
+        virtio_block_req_end(op->reqs[i], ret);
+    free(op);
+}
+
+/* issue the n requests of tab, whose sectors are contiguous, as a
+   single backend operation */
+static void virtio_block_submit_merged(VIRTIOBlockDevice *s,
+                                       BlockMergeEntry *tab, int n)
+{
+    BlockDevice *bs = s->bs;
+    struct iovec iov[VIRTIO_BLK_MAX_MERGE_IOV], *v;
+    BlockDeviceCompletionFunc *cb;
+    BlockMergedOp *op;
+    void *opaque;
+    int i, k, iovcnt, ret;
+
+    if (n == 1) {
+        v = &s->merge_iov[tab[0].iov_start];
+        iovcnt = tab[0].iovcnt;
+        cb = virtio_block_req_cb;
+        opaque = tab[0].req;
+    } else {
+        /* the host ranges which continue each other are joined */
+        iovcnt = 0;
+        for(i = 0; i < n; i++) {
+            for(k = 0; k < tab[i].iovcnt; k++) {
+                v = &s->merge_iov[tab[i].iov_start + k];
+                if (iovcnt > 0 &&
+                    (uint8_t *)iov[iovcnt - 1].iov_base +
+                    iov[iovcnt - 1].iov_len == v->iov_base)
+                    iov[iovcnt - 1].iov_len += v->iov_len;
+                else
+                    iov[iovcnt++] = *v;
+            }
+        }
+        v = iov;
+        op = (BlockMergedOp *)malloc(sizeof(*op));
+        op->nb_reqs = n;
+        for(i = 0; i < n; i++)
+            op->reqs[i] = tab[i].req;
+        s->stats[tab[0].req->stat_type].merged_requests += n - 1;
+        cb = virtio_block_merged_cb;
+        opaque = op;
+    }
+    if (tab[0].req->type == VIRTIO_BLK_T_IN)
+        ret = bs->readv_async(bs, tab[0].sector_num, v, iovcnt, cb, opaque);
+    else
+        ret = bs->writev_async(bs, tab[0].sector_num, v, iovcnt, cb, opaque);
+    if (ret <= 0)
+        cb(opaque, ret);
+}
+
+/* issue the gathered requests, merging those of the same type whose
+   sectors continue each other */
+static void virtio_block_merge_flush(VIRTIOBlockDevice *s)
+{
+    BlockMergeEntry *tab = s->merge_tab, e;
+    int n, i, j, iovcnt;
+    uint64_t end;
+
+    n = s->nb_merge;
+    if (n == 0)
+        return;
+    s->nb_merge = 0;
+    if (s->merge_sort) {
+        /* stable, so that the overlapping writes keep their order */
+        for(i = 1; i < n; i++) {
+            e = tab[i];
+            for(j = i; j > 0 && tab[j - 1].sector_num > e.sector_num; j--)
+                tab[j] = tab[j - 1];
+            tab[j] = e;
+        }
+    }
+    for(i = 0; i < n; i = j) {
+        end = tab[i].sector_num + tab[i].nb_sectors;
+        iovcnt = tab[i].iovcnt;
+        for(j = i + 1; j < n; j++) {
+            if (tab[j].req->type != tab[i].req->type ||
+                tab[j].sector_num != end ||
+                iovcnt + tab[j].iovcnt > VIRTIO_BLK_MAX_MERGE_IOV)
+                break;
+            end += tab[j].nb_sectors;
+            iovcnt += tab[j].iovcnt;
+        }
+        virtio_block_submit_merged(s, tab + i, j - i);
+    }
+    s->merge_iovcnt = 0;
+}
+
+/* get the host memory ranges of the data of an IN or OUT request in
+   the gathering area. Return the number of ranges or -1 if the request
+   cannot be transferred without copy. */
+static int virtio_block_merge_get_iov(VIRTIOBlockDevice *s, int queue_idx,
+                                      int desc_idx, int offset, int len,
+                                      BOOL to_queue)
+{
+    if (s->nb_merge == MAX_QUEUE_NUM ||
+        s->merge_iovcnt + VIRTIO_BLK_MAX_HOST_IOV >
+        MAX_QUEUE_NUM * VIRTIO_BLK_MAX_HOST_IOV)
+        virtio_block_merge_flush(s);
+    return virtio_queue_get_host_iov(s, queue_idx, desc_idx, offset, len,
+                                     to_queue, s->merge_iov + s->merge_iovcnt,
+                                     VIRTIO_BLK_MAX_HOST_IOV);
+}
+
+static void virtio_block_merge_add(VIRTIOBlockDevice *s, BlockRequest *req,
+                                   uint64_t sector_num, int len, int iovcnt)
+{
+    BlockMergeEntry *e = &s->merge_tab[s->nb_merge++];
+
+    e->req = req;
+    e->sector_num = sector_num;
+    e->nb_sectors = len / SECTOR_SIZE;
+    e->iov_start = s->merge_iovcnt;
+    e->iovcnt = iovcnt;
+    s->merge_iovcnt += iovcnt;
+}
+
+/* TRUE if the n sectors at sector_num are not all on the disk */
+static BOOL virtio_block_out_of_range(VIRTIOBlockDevice *s,
+                                      uint64_t sector_num, uint64_t n)
+{
+    uint64_t nb_sectors = s->bs->get_sector_count(s->bs);
+
+    return sector_num > nb_sectors || n > nb_sectors - sector_num;
+}
+
+static int virtio_block_recv_request(VIRTIODevice *s, int queue_idx,
+                                     int desc_idx, int read_size,
+                                     int write_size)
+{
+    VIRTIOBlockDevice *s1 = (VIRTIOBlockDevice *)s;
+    BlockDevice *bs = s1->bs;
+    BlockRequestHeader h;
+    BlockRequest *req;
+    struct iovec host_iov[VIRTIO_BLK_MAX_HOST_IOV];
+    BlockRequestSegment seg[VIRTIO_BLK_MAX_DISCARD_SEG];
+    BlockDeviceRange ranges[VIRTIO_BLK_MAX_DISCARD_SEG];
+    uint8_t *buf, buf1[1];
+    int len, ret, iovcnt, nb_seg, i;
+    uint32_t flags_mask, unmap;
+
+#ifdef DEBUG_VIRTIO
+        printf("Entering recv req function ... qidx = %d, desc_idx = %d, read_size = %d, write_size = %d\n",
+            queue_idx, desc_idx, read_size, write_size);
+#endif
+
+    if (memcpy_from_queue(s, &h, queue_idx, desc_idx, 0, sizeof(h)) < 0)
+        return 0;
+    /* the head descriptor cannot be reused by the driver before the
+       request completes, so the slot is free */
+    req = &s1->req[queue_idx][desc_idx];
+    req->dev = s;
+    req->type = h.type;
+    req->queue_idx = queue_idx;
+    req->desc_idx = desc_idx;
+#ifdef DEBUG_VIRTIO
+    printf("req in?=%d\n",h.type);
+#endif
+    switch(h.type) {
+    case VIRTIO_BLK_T_IN:
+        req->write_size = write_size;
+        len = ((write_size - 1) / SECTOR_SIZE) * SECTOR_SIZE;
+        virtio_block_stat_start(s1, req, VIRTIO_BLK_STAT_READ, len);
+        if (virtio_block_out_of_range(s1, h.sector_num, len / SECTOR_SIZE)) {
+            req->buf = NULL;
+            virtio_block_req_end(req, -1);
+            break;
+        }
+        /* read directly in the guest memory if possible */
+        iovcnt = -1;
+        if (bs->readv_async && len > 0 && s1->merge) {
+            iovcnt = virtio_block_merge_get_iov(s1, queue_idx, desc_idx, 0,
+                                                len, TRUE);
+            if (iovcnt > 0) {
+                req->buf = NULL;
+                s1->stats[VIRTIO_BLK_STAT_READ].merges += iovcnt - 1;
+                virtio_block_merge_add(s1, req, h.sector_num, len, iovcnt);
+                break;
+            }
+        } else if (bs->readv_async && len > 0) {
+            iovcnt = virtio_queue_get_host_iov(s, queue_idx, desc_idx, 0, len,
+                                               TRUE, host_iov,
+                                               VIRTIO_BLK_MAX_HOST_IOV);
+        }
+        /* the gathered requests are issued first */
+        virtio_block_merge_flush(s1);
+        if (iovcnt > 0) {
+            req->buf = NULL;
+            s1->stats[VIRTIO_BLK_STAT_READ].merges += iovcnt - 1;
+            ret = bs->readv_async(bs, h.sector_num, host_iov, iovcnt,
+                                  virtio_block_req_cb, req);
+        } else {
+            req->buf = (uint8_t*)malloc(write_size);
+            ret = bs->read_async(bs, h.sector_num, req->buf, 
+                                 len / SECTOR_SIZE,
+                                 virtio_block_req_cb, req);
+        }
+        if (ret <= 0)
+            virtio_block_req_end(req, ret);
+        break;
+    case VIRTIO_BLK_T_OUT:
+        assert(write_size >= 1);
+        len = ((read_size - sizeof(h)) / SECTOR_SIZE) * SECTOR_SIZE;
+        virtio_block_stat_start(s1, req, VIRTIO_BLK_STAT_WRITE, len);
+        if (virtio_block_out_of_range(s1, h.sector_num, len / SECTOR_SIZE)) {
+            req->buf = NULL;
+            virtio_block_req_end(req, -1);
+            break;
+        }
+        iovcnt = -1;
+        if (bs->writev_async && len > 0 && s1->merge) {
+            iovcnt = virtio_block_merge_get_iov(s1, queue_idx, desc_idx,
+                                                sizeof(h), len, FALSE);
+            if (iovcnt > 0) {
+                req->buf = NULL;
+                s1->stats[VIRTIO_BLK_STAT_WRITE].merges += iovcnt - 1;
+                virtio_block_merge_add(s1, req, h.sector_num, len, iovcnt);
+                break;
+            }
+        } else if (bs->writev_async && len > 0) {
+            iovcnt = virtio_queue_get_host_iov(s, queue_idx, desc_idx,
+                                               sizeof(h), len, FALSE, host_iov,
+                                               VIRTIO_BLK_MAX_HOST_IOV);
+        }
+        virtio_block_merge_flush(s1);
+        if (iovcnt > 0) {
+            req->buf = NULL;
+            s1->stats[VIRTIO_BLK_STAT_WRITE].merges += iovcnt - 1;
+            ret = bs->writev_async(bs, h.sector_num, host_iov, iovcnt,
+                                   virtio_block_req_cb, req);
+        } else {
+            buf = (uint8_t*)malloc(len);
+            memcpy_from_queue(s, buf, queue_idx, desc_idx, sizeof(h), len);
+            /* freed when the request ends */
+            req->buf = buf;
+            ret = bs->write_async(bs, h.sector_num, buf, len / SECTOR_SIZE,
+                                  virtio_block_req_cb, req);
+        }
+        if (ret <= 0)
+            virtio_block_req_end(req, ret);
+        break;
+    case VIRTIO_BLK_T_FLUSH:
+        if (write_size < 1) {
+            virtio_consume_desc(s, queue_idx, desc_idx, 0);
+            break;
+        }
+        /* issue the gathered writes before the flush */
+        virtio_block_merge_flush(s1);
+        virtio_block_stat_start(s1, req, VIRTIO_BLK_STAT_FLUSH, 0);
+        ret = bs->flush_async(bs, virtio_block_req_cb, req);
+        if (ret <= 0)
+            virtio_block_req_end(req, ret);
+        break;
+    case VIRTIO_BLK_T_DISCARD:
+    case VIRTIO_BLK_T_WRITE_ZEROES:
+        if (!bs->discard_async || write_size < 1) {
+            s1->stats[VIRTIO_BLK_STAT_OTHER].requests++;
+            goto unsupported;
+        }
+        nb_seg = (read_size - (int)sizeof(h)) / (int)sizeof(seg[0]);
+        virtio_block_merge_flush(s1);
+        virtio_block_stat_start(s1, req, h.type == VIRTIO_BLK_T_DISCARD ?
+                                VIRTIO_BLK_STAT_DISCARD :
+                                VIRTIO_BLK_STAT_WRITE_ZEROES, 0);
+        if (nb_seg < 1 || nb_seg > VIRTIO_BLK_MAX_DISCARD_SEG) {
+            virtio_block_req_end(req, -1);
+            break;
+        }
+        memcpy_from_queue(s, seg, queue_idx, desc_idx, sizeof(h),
+                          nb_seg * sizeof(seg[0]));
+        /* unmap is only a valid flag for WRITE_ZEROES */
+        if (h.type == VIRTIO_BLK_T_WRITE_ZEROES)
+            flags_mask = VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP;
+        else
+            flags_mask = 0;
+        /* the ranges are only deallocated if all the segments allow it */
+        unmap = VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP;
+        for(i = 0; i < nb_seg; i++) {
+            if (seg[i].flags & ~flags_mask) {
+                virtio_block_stat_end(s1, req, -1);
+                goto unsupported;
+            }
+            if (seg[i].num_sectors > VIRTIO_BLK_MAX_DISCARD_SECTORS ||
+                virtio_block_out_of_range(s1, seg[i].sector_num,
+                                          seg[i].num_sectors))
+                break;
+            s1->stats[req->stat_type].bytes +=
+                (uint64_t)seg[i].num_sectors * SECTOR_SIZE;
+            unmap &= seg[i].flags;
+            ranges[i].sector_num = seg[i].sector_num;
+            ranges[i].nb_sectors = seg[i].num_sectors;
+        }
+        if (i < nb_seg) {
+            virtio_block_req_end(req, -1);
+            break;
+        }
+        if (h.type == VIRTIO_BLK_T_DISCARD)
+            ret = bs->discard_async(bs, ranges, nb_seg,
+                                    virtio_block_req_cb, req);
+        else
+            ret = bs->write_zeroes_async(bs, ranges, nb_seg, unmap != 0,
+                                         virtio_block_req_cb, req);
+        if (ret <= 0)
+            virtio_block_req_end(req, ret);
+        break;
+    default:
+        s1->stats[VIRTIO_BLK_STAT_OTHER].requests++;
+    unsupported:
+        /* complete it so that the descriptors are returned */
+        if (write_size >= 1) {
+            buf1[0] = VIRTIO_BLK_S_UNSUPP;
+            memcpy_to_queue(s, queue_idx, desc_idx, write_size - 1,
+                            buf1, sizeof(buf1));
+        }
+        virtio_consume_desc(s, queue_idx, desc_idx, write_size);
+        break;
+    }
+#ifdef DEBUG_VIRTIO
+    printf("Exiting recv req function ... qidx = %d, desc_idx = %d, read_size = %d, write_size = %d\n",
+        queue_idx, desc_idx, read_size, write_size);
+#endif
+    return 0;
+}
+
+/* the requests received in a notification are submitted together */
+static void virtio_block_notify_end(VIRTIODevice *s, int queue_idx)
+{
+    BlockDevice *bs = ((VIRTIOBlockDevice *)s)->bs;
+
+    virtio_block_merge_flush((VIRTIOBlockDevice *)s);
+    if (bs->submit)
+        bs->submit(bs);
+}
+
+/* the written sectors are saved by block_device_checkpoint() */
+static BOOL virtio_block_busy(VIRTIODevice *s)
+{
+    return ((VIRTIOBlockDevice *)s)->nb_inflight > 0;
+}
+
+/* the requests in progress may still access the guest memory, so they
+   are completed before the driver can reuse their buffers */
+static void virtio_block_reset(VIRTIODevice *s1)
+{
+    VIRTIOBlockDevice *s = (VIRTIOBlockDevice *)s1;
+    BlockDevice *bs = s->bs;
+
+    s->resetting = TRUE;
+    while (s->nb_inflight > 0) {
+        if (bs->poll)
+            bs->poll(bs);
+        sched_yield();
+    }
+    s->resetting = FALSE;
+}
+
+VIRTIODevice *virtio_block_init(VIRTIOBusDef *bus, BlockDevice *bs,
+                                const simif_t* sim, int num_queues)
+{
+    VIRTIOBlockDevice *s;
+    uint64_t nb_sectors;
+
+    s = (VIRTIOBlockDevice *)mallocz(sizeof(*s));
+    virtio_init(s, bus,
+                2, VIRTIO_BLK_CONFIG_SIZE, virtio_block_recv_request, sim);
+    s->device_notify_end = virtio_block_notify_end;
+    s->device_busy = virtio_block_busy;
+    s->device_reset = virtio_block_reset;
+    s->bs = bs;
+    s->merge = TRUE;
+    
+    nb_sectors = bs->get_sector_count(bs);
+    put_le32(s->config_space, nb_sectors);
+    put_le32(s->config_space + 4, nb_sectors >> 32);
+
+    if (bs->flush_async)
+        s->device_features |= 1 << VIRTIO_BLK_F_FLUSH;
+    if (bs->discard_async && bs->write_zeroes_async) {
+        s->device_features |= (1 << VIRTIO_BLK_F_DISCARD) |
+            (1 << VIRTIO_BLK_F_WRITE_ZEROES);
+        put_le32(s->config_space + VIRTIO_BLK_CONFIG_MAX_DISCARD_SECTORS,
+                 VIRTIO_BLK_MAX_DISCARD_SECTORS);
+        put_le32(s->config_space + VIRTIO_BLK_CONFIG_MAX_DISCARD_SEG,
+                 VIRTIO_BLK_MAX_DISCARD_SEG);
+        put_le32(s->config_space + VIRTIO_BLK_CONFIG_DISCARD_SECTOR_ALIGN,
+                 VIRTIO_BLK_DISCARD_ALIGN);
+        put_le32(s->config_space + VIRTIO_BLK_CONFIG_MAX_WRITE_ZEROES_SECTORS,
+                 VIRTIO_BLK_MAX_DISCARD_SECTORS);
+        put_le32(s->config_space + VIRTIO_BLK_CONFIG_MAX_WRITE_ZEROES_SEG,
+                 VIRTIO_BLK_MAX_DISCARD_SEG);
+        s->config_space[VIRTIO_BLK_CONFIG_WRITE_ZEROES_MAY_UNMAP] = 1;
+    }
+
+    s->num_queues = min_int(max_int(num_queues, 1), MAX_QUEUE);
+    if (s->num_queues > 1) {
+        s->device_features |= 1 << VIRTIO_BLK_F_MQ;
+        put_le16(s->config_space + VIRTIO_BLK_CONFIG_NUM_QUEUES,
+                 s->num_queues);
+    }
+
+    return (VIRTIODevice *)s;
+}
+
+/*********************************************************************/
+/* 9p filesystem device */
+
+/* the data of the read and write requests is transferred directly
+   between the guest buffers and the files. The fragments never
+   cross a guest page, so a full msize payload needs one per page
+   plus the partial pages at both ends. */
+#define VIRTIO_9P_MAX_HOST_IOV (MAX_9P_MSIZE / 4096 + 2)
+
+typedef struct FIDDesc {
+    uint32_t fid;
+    FSFile *fd;
+    struct FIDDesc *next_free; /* in the pool free list */
+} FIDDesc;
+
+#define FID_TABLE_MIN_BITS 6
+#define FID_POOL_CHUNK 256
+
+/* asynchronous mode: the requests are executed by a pool of host
+   threads. The requests operating on the same fid are executed in
+   their arrival order, the others may overlap and complete out of
+   order. */
+#define VIRTIO_9P_REQ_MAX_FIDS 2
+
+typedef struct VIRTIO9PReq {
+    struct VIRTIO9PReq *next; /* in the submission or completion list */
+    int desc_idx;
+    int read_size;
+    int write_size;
+    int reply_len;
+    int nb_fids;
+    uint32_t fids[VIRTIO_9P_REQ_MAX_FIDS];
+    /* a barrier waits for all the previous requests and blocks the
+       next ones (version, flush, rename, unknown operations) */
+    BOOL barrier;
+    BOOL dispatched;
+} VIRTIO9PReq;
+
+typedef struct VIRTIO9PAIO {
+    struct VIRTIO9PDevice *dev;
+    int nb_threads;
+    pthread_t *threads;
+    pthread_mutex_t lock; /* protects the submission queue */
+    pthread_cond_t cond;
+    VIRTIO9PReq *submit_head;
+    VIRTIO9PReq **submit_tail;
+    pthread_mutex_t fid_lock; /* protects the fid table */
+    device_mailbox_t<VIRTIO9PReq> done; /* completed requests */
+    /* owned by the simulator thread: the received requests which are
+       not completed yet, in arrival order */
+    VIRTIO9PReq *active[MAX_QUEUE_NUM];
+    int nb_active;
+    VIRTIO9PReq reqs[MAX_QUEUE_NUM]; /* indexed by head descriptor */
+    BOOL stop; /* the threads exit once the queue is empty */
+} VIRTIO9PAIO;
+
+#define VIRTIO_9P_STAT_OPS 256 /* indexed by T-message type */
+
+typedef struct {
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t bytes_in; /* T-message sizes */
+    uint64_t bytes_out; /* R-message sizes */
+    uint64_t latency_hist[VIRTIO_HIST_BUCKETS]; /* host latency in ns */
+} P9OpStats;
+
+typedef struct {
+    uint8_t id;
+    uint32_t size;
+    int64_t start_time; /* in ns */
+} VIRTIO9PReqStat;
+
+struct VIRTIO9PDevice : public VIRTIODevice {
+    FSDevice *fs;
+    uint32_t msize; /* maximum message size */
+    uint32_t max_msize; /* upper bound for the negotiated msize */
+    /* open addressing hash table of FIDDesc, with linear probing */
+    FIDDesc **fid_table;
+    int fid_table_bits;
+    int fid_count;
+    FIDDesc *fid_free_list; /* FIDDesc are allocated by chunks */
+    BOOL req_in_progress;
+    VIRTIO9PAIO *aio; /* NULL if the requests are synchronous */
+    P9OpStats *op_stats; /* VIRTIO_9P_STAT_OPS entries */
+    VIRTIO9PReqStat req_stats[MAX_QUEUE_NUM]; /* indexed by head descriptor */
+};
+
+/* the fid table is shared by the worker threads in asynchronous
+   mode. The FSFile of a fid is only used by the requests on this fid,
+   which are serialized. */
+static inline void fid_table_lock(VIRTIO9PDevice *s)
+{
+    if (s->aio)
+        pthread_mutex_lock(&s->aio->fid_lock);
+}
+
+static inline void fid_table_unlock(VIRTIO9PDevice *s)
+{
+    if (s->aio)
+        pthread_mutex_unlock(&s->aio->fid_lock);
+}
+
+static inline uint32_t fid_hash(VIRTIO9PDevice *s, uint32_t fid)
+{
+    return (fid * 0x9e3779b1U) >> (32 - s->fid_table_bits);
+}
+
+/* return the slot of fid, or the empty slot where it can be inserted */
+static uint32_t fid_lookup(VIRTIO9PDevice *s, uint32_t fid)
+{
+    uint32_t mask = (1U << s->fid_table_bits) - 1;
+    uint32_t i;
+
+    for(i = fid_hash(s, fid); s->fid_table[i]; i = (i + 1) & mask) {
+        if (s->fid_table[i]->fid == fid)
+            break;
+    }
+    return i;
+}
+
+static void fid_table_resize(VIRTIO9PDevice *s, int bits)
+{
+    FIDDesc **old_table = s->fid_table;
+    int i, old_size = old_table ? 1 << s->fid_table_bits : 0;
+
+    s->fid_table_bits = bits;
+    s->fid_table = (FIDDesc **)mallocz(sizeof(s->fid_table[0]) << bits);
+    for(i = 0; i < old_size; i++) {
+        if (old_table[i])
+            s->fid_table[fid_lookup(s, old_table[i]->fid)] = old_table[i];
+    }
+    free(old_table);
+}
+
+static FIDDesc *fid_alloc(VIRTIO9PDevice *s)
+{
+    FIDDesc *f;
+    int i;
+
+    if (!s->fid_free_list) {
+        /* the chunks are never freed */
+        f = (FIDDesc *)malloc(sizeof(*f) * FID_POOL_CHUNK);
+        for(i = 0; i < FID_POOL_CHUNK; i++) {
+            f[i].next_free = s->fid_free_list;
+            s->fid_free_list = &f[i];
+        }
+    }
+    f = s->fid_free_list;
+    s->fid_free_list = f->next_free;
+    return f;
+}
+
+static FIDDesc *fid_find1(VIRTIO9PDevice *s, uint32_t fid)
+{
+    return s->fid_table[fid_lookup(s, fid)];
+}
+
+static FSFile *fid_find(VIRTIO9PDevice *s, uint32_t fid)
+{
+    FIDDesc *f;
+    FSFile *fd;
+
+    fid_table_lock(s);
+    f = fid_find1(s, fid);
+    fd = f ? f->fd : NULL;
+    fid_table_unlock(s);
+    return fd;
+}
+
+static void fid_delete(VIRTIO9PDevice *s, uint32_t fid)
+{
+    uint32_t mask;
+    uint32_t i, j, k;
+    FIDDesc *f;
+
+    fid_table_lock(s);
+    mask = (1U << s->fid_table_bits) - 1;
+    i = fid_lookup(s, fid);
+    f = s->fid_table[i];
+    if (!f) {
+        fid_table_unlock(s);
+        return;
+    }
+    s->fs->fs_delete(s->fs, f->fd);
+    f->next_free = s->fid_free_list;
+    s->fid_free_list = f;
+    s->fid_count--;
+    /* move back the following entries of the probe sequence so that
+       no tombstone is needed */
+    for(j = (i + 1) & mask; s->fid_table[j]; j = (j + 1) & mask) {
+        k = fid_hash(s, s->fid_table[j]->fid);
+        if (((j - k) & mask) >= ((j - i) & mask)) {
+            s->fid_table[i] = s->fid_table[j];
+            i = j;
+        }
+    }
+    s->fid_table[i] = NULL;
+    fid_table_unlock(s);
+}
+
+static void fid_set(VIRTIO9PDevice *s, uint32_t fid, FSFile *fd)
+{
+    FIDDesc *f;
+    uint32_t i;
+
+    fid_table_lock(s);
+    i = fid_lookup(s, fid);
+    f = s->fid_table[i];
+    if (f) {
+        s->fs->fs_delete(s->fs, f->fd);
+        f->fd = fd;
+        fid_table_unlock(s);
+        return;
+    }
+    /* keep the load factor below 3/4 */
+    if ((s->fid_count + 1) * 4 > 3 << s->fid_table_bits) {
+        fid_table_resize(s, s->fid_table_bits + 1);
+        i = fid_lookup(s, fid);
+    }
+    f = fid_alloc(s);
+    f->fid = fid;
+    f->fd = fd;
+    s->fid_table[i] = f;
+    s->fid_count++;
+    fid_table_unlock(s);
+}
+
+typedef struct {
+    uint8_t tag;
+    const char *name;
+} Virtio9POPName;
+
+static const Virtio9POPName virtio_9p_op_names[] = {
+    { 8, "statfs" },
+    { 12, "lopen" },
+    { 14, "lcreate" },
+    { 16, "symlink" },
+    { 18, "mknod" },
+    { 22, "readlink" },
+    { 24, "getattr" },
+    { 26, "setattr" },
+    { 30, "xattrwalk" },
+    { 40, "readdir" },
+    { 50, "fsync" },
+    { 52, "lock" },
+    { 54, "getlock" },
+    { 70, "link" },
+    { 72, "mkdir" },
+    { 74, "renameat" },
+    { 76, "unlinkat" },
+    { 100, "version" },
+    { 104, "attach" },
+    { 108, "flush" },
+    { 110, "walk" },
+    { 116, "read" },
+    { 118, "write" },
+    { 120, "clunk" },
+    { 0, NULL },
+};
+
+static const char *get_9p_op_name(int tag)
+{
+    const Virtio9POPName *p;
+    for(p = virtio_9p_op_names; p->name != NULL; p++) {
+        if (p->tag == tag)
+            return p->name;
+    }
+    return NULL;
+}
+
+/* statistics, always collected. The counters are updated atomically
+   since the requests may be executed by the worker threads. */
+
+static void virtio_9p_stat_start(VIRTIO9PDevice *s, int desc_idx,
+                                 uint8_t id, uint32_t size)
+{
+    VIRTIO9PReqStat *rs = &s->req_stats[desc_idx];
+    rs->id = id;
+    rs->size = size;
+    rs->start_time = virtio_get_time_ns();
+    virtio_trace(s, VTRACE_EV_SUBMIT, 0, desc_idx, id, size);
+}
+
+static void virtio_9p_stat_end(VIRTIO9PDevice *s, int desc_idx, int len,
+                               BOOL is_error)
+{
+    VIRTIO9PReqStat *rs = &s->req_stats[desc_idx];
+    P9OpStats *st = &s->op_stats[rs->id];
+    int64_t d;
+
+    d = virtio_get_time_ns() - rs->start_time;
+    virtio_trace(s, VTRACE_EV_COMPLETE, 0, desc_idx, is_error, len);
+    __atomic_fetch_add(&st->requests, 1, __ATOMIC_RELAXED);
+    if (is_error)
+        __atomic_fetch_add(&st->errors, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&st->bytes_in, rs->size, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&st->bytes_out, len, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&st->latency_hist[virtio_hist_bucket(d > 0 ? d : 0)],
+                       1, __ATOMIC_RELAXED);
+}
+
+/* write the statistics in JSON */
+void virtio_9p_dump_stats(VIRTIODevice *s1, FILE *f)
+{
+    VIRTIO9PDevice *s = (VIRTIO9PDevice *)s1;
+    FSDevice *fs = s->fs;
+    FSStats fst;
+    P9OpStats *st;
+    const char *name;
+    char name_buf[16];
+    int i, n;
+
+    fprintf(f, "{\n  \"ops\": {");
+    n = 0;
+    for(i = 0; i < VIRTIO_9P_STAT_OPS; i++) {
+        st = &s->op_stats[i];
+        if (st->requests == 0)
+            continue;
+        name = get_9p_op_name(i);
+        if (!name) {
+            snprintf(name_buf, sizeof(name_buf), "op%d", i);
+            name = name_buf;
+        }
+        fprintf(f, "%s\n    \"%s\": { \"requests\": %" PRIu64
+                ", \"errors\": %" PRIu64 ", \"bytes_in\": %" PRIu64
+                ", \"bytes_out\": %" PRIu64 ", \"latency_ns_log2\": ",
+                n > 0 ? "," : "", name, st->requests, st->errors,
+                st->bytes_in, st->bytes_out);
+        virtio_dump_hist(f, st->latency_hist);
+        fprintf(f, " }");
+        n++;
+    }
+    fprintf(f, "\n  }");
+    if (fs->fs_get_stats) {
+        memset(&fst, 0, sizeof(fst));
+        fs->fs_get_stats(fs, &fst);
+        fprintf(f, ",\n  \"caches\": {\n"
+                "    \"attr\": { \"hits\": %" PRIu64 ", \"misses\": %" PRIu64
+                " },\n"
+                "    \"readdir\": { \"hits\": %" PRIu64 ", \"misses\": %" PRIu64
+                " },\n"
+                "    \"writeback\": { \"buffered_writes\": %" PRIu64
+                ", \"flushes\": %" PRIu64 " }\n  }",
+                fst.attr_hits, fst.attr_misses, fst.dir_hits, fst.dir_misses,
+                fst.wb_writes, fst.wb_flushes);
+    }
+    fprintf(f, "\n}\n");
+    fflush(f);
+}
+
+static int marshall(VIRTIO9PDevice *s, 
+                    uint8_t *buf1, int max_len, const char *fmt, ...)
+{
+    va_list ap;
+    int c;
+    uint32_t val;
+    uint64_t val64;
+    uint8_t *buf, *buf_end;
+
+#ifdef DEBUG_VIRTIO
+    
+        printf(" ->");
+#endif
+    va_start(ap, fmt);
+    buf = buf1;
+    buf_end = buf1 + max_len;
+    for(;;) {
+        c = *fmt++;
+        if (c == '\0')
+            break;
+        switch(c) {
+        case 'b':
+            assert(buf + 1 <= buf_end);
+            val = va_arg(ap, int);
+#ifdef DEBUG_VIRTIO
+            
+                printf(" b=%d", val);
+#endif
+            buf[0] = val;
+            buf += 1;
+            break;
+        case 'h':
+            assert(buf + 2 <= buf_end);
+            val = va_arg(ap, int);
+#ifdef DEBUG_VIRTIO
+            
+                printf(" h=%d", val);
+#endif
+            put_le16(buf, val);
+            buf += 2;
+            break;
+        case 'w':
+            assert(buf + 4 <= buf_end);
+            val = va_arg(ap, int);
+#ifdef DEBUG_VIRTIO
+            
+                printf(" w=%d", val);
+#endif
+            put_le32(buf, val);
+            buf += 4;
+            break;
+        case 'd':
+            assert(buf + 8 <= buf_end);
+            val64 = va_arg(ap, uint64_t);
+#ifdef DEBUG_VIRTIO
+            
+                printf(" d=%" PRId64, val64);
+#endif
+            put_le64(buf, val64);
+            buf += 8;
+            break;
+        case 's':
+            {
+                char *str;
+                int len;
+                str = va_arg(ap, char *);
+#ifdef DEBUG_VIRTIO
+                
+                    printf(" s=\"%s\"", str);
+#endif
+                len = strlen(str);
+                assert(len <= 65535);
+                assert(buf + 2 + len <= buf_end);
+                put_le16(buf, len);
+                buf += 2;
+                memcpy(buf, str, len);
+                buf += len;
+            }
+            break;
+        case 'Q':
+            {
+                FSQID *qid;
+                assert(buf + 13 <= buf_end);
+                qid = va_arg(ap, FSQID *);
+#ifdef DEBUG_VIRTIO
+                
+                    printf(" Q=%d:%d:%" PRIu64, qid->type, qid->version, qid->path);
+#endif
+                buf[0] = qid->type;
+                put_le32(buf + 1, qid->version);
+                put_le64(buf + 5, qid->path);
+                buf += 13;
+            }
+            break;
+        default:
+            abort();
+        }
+    }
+    va_end(ap);
+    return buf - buf1;
+}
+
+/* return < 0 if error */
+/* XXX: free allocated strings in case of error */
+static int unmarshall(VIRTIO9PDevice *s, int queue_idx,
+                      int desc_idx, int *poffset, const char *fmt, ...)
+{
+    VIRTIODevice *s1 = (VIRTIODevice *)s;
+    va_list ap;
+    int offset, c;
+    uint8_t buf[16];
+
+    offset = *poffset;
+    va_start(ap, fmt);
+    for(;;) {
+        c = *fmt++;
+        if (c == '\0')
+            break;
+        switch(c) {
+        case 'b':
+            {
+                uint8_t *ptr;
+                if (memcpy_from_queue(s1, buf, queue_idx, desc_idx, offset, 1))
+                    return -1;
+                ptr = va_arg(ap, uint8_t *);
+                *ptr = buf[0];
+                offset += 1;
+#ifdef DEBUG_VIRTIO
+                
+                    printf(" b=%d", *ptr);
+#endif
+            }
+            break;
+        case 'h':
+            {
+                uint16_t *ptr;
+                if (memcpy_from_queue(s1, buf, queue_idx, desc_idx, offset, 2))
+                    return -1;
+                ptr = va_arg(ap, uint16_t *);
+                *ptr = get_le16(buf);
+                offset += 2;
+#ifdef DEBUG_VIRTIO
+                
+                    printf(" h=%d", *ptr);
+#endif
+            }
+            break;
+        case 'w':
+            {
+                uint32_t *ptr;
+                if (memcpy_from_queue(s1, buf, queue_idx, desc_idx, offset, 4))
+                    return -1;
+                ptr = va_arg(ap, uint32_t *);
+                *ptr = get_le32(buf);
+                offset += 4;
+#ifdef DEBUG_VIRTIO
+                
+                    printf(" w=%d", *ptr);
+#endif
+            }
+            break;
+        case 'd':
+            {
+                uint64_t *ptr;
+                if (memcpy_from_queue(s1, buf, queue_idx, desc_idx, offset, 8))
+                    return -1;
+                ptr = va_arg(ap, uint64_t *);
+                *ptr = get_le64(buf);
+                offset += 8;
+#ifdef DEBUG_VIRTIO
+                
+                    printf(" d=%" PRId64, *ptr);
+#endif
+            }
+            break;
+        case 's':
+            {
+                char *str, **ptr;
+                int len;
+
+                if (memcpy_from_queue(s1, buf, queue_idx, desc_idx, offset, 2))
+                    return -1;
+                len = get_le16(buf);
+                offset += 2;
+                str = (char*)malloc(len + 1);
+                if (memcpy_from_queue(s1, str, queue_idx, desc_idx, offset, len))
+                    return -1;
+                str[len] = '\0';
+                offset += len;
+                ptr = va_arg(ap, char **);
+                *ptr = str;
+#ifdef DEBUG_VIRTIO
+                
+                    printf(" s=\"%s\"", *ptr);
+#endif
+            }
+            break;
+        default:
+            abort();
+        }
+    }
+    va_end(ap);
+    *poffset = offset;
+    return 0;
+}
+
+/* called by a worker thread when the reply of a request is written */
+static void virtio_9p_async_done(VIRTIO9PDevice *s, int desc_idx, int len)
+{
+    VIRTIO9PAIO *aio = s->aio;
+    VIRTIO9PReq *req = &aio->reqs[desc_idx];
+
+    req->reply_len = len;
+    aio->done.post(req);
+}
+
+static void virtio_9p_complete(VIRTIO9PDevice *s, int queue_idx,
+                               int desc_idx, int len, BOOL is_error)
+{
+    virtio_9p_stat_end(s, desc_idx, len, is_error);
+    /* the used ring is only updated by the simulator thread */
+    if (s->aio)
+        virtio_9p_async_done(s, desc_idx, len);
+    else
+        virtio_consume_desc((VIRTIODevice *)s, queue_idx, desc_idx, len);
+}
+
+static void virtio_9p_send_reply(VIRTIO9PDevice *s, int queue_idx,
+                                 int desc_idx, uint8_t id, uint16_t tag, 
+                                 uint8_t *buf, int buf_len)
+{
+    uint8_t *buf1;
+    int len;
+
+#ifdef DEBUG_VIRTIO
+     {
+        if (id == 6)
+            printf(" (error)");
+        printf("\n");
+    }
+#endif
+    len = buf_len + 7;
+    buf1 = (uint8_t*)malloc(len);
+    put_le32(buf1, len);
+    buf1[4] = id + 1;
+    put_le16(buf1 + 5, tag);
+    memcpy(buf1 + 7, buf, buf_len);
+    memcpy_to_queue((VIRTIODevice *)s, queue_idx, desc_idx, 0, buf1, len);
+    virtio_9p_complete(s, queue_idx, desc_idx, len, id == 6);
+    free(buf1);
+}
+
+static void virtio_9p_send_error(VIRTIO9PDevice *s, int queue_idx,
+                                 int desc_idx, uint16_t tag, uint32_t error)
+{
+    uint8_t buf[4];
+    int buf_len;
+
+    buf_len = marshall(s, buf, sizeof(buf), "w", -error);
+    virtio_9p_send_reply(s, queue_idx, desc_idx, 6, tag, buf, buf_len);
+}
+
+typedef struct {
+    VIRTIO9PDevice *dev;
+    int queue_idx;
+    int desc_idx;
+    uint16_t tag;
+} P9OpenInfo;
+
+static void virtio_9p_open_reply(FSDevice *fs, FSQID *qid, int err,
+                                 P9OpenInfo *oi)
+{
+    VIRTIO9PDevice *s = oi->dev;
+    uint8_t buf[32];
+    int buf_len;
+    
+    if (err < 0) {
+        virtio_9p_send_error(s, oi->queue_idx, oi->desc_idx, oi->tag, err);
+    } else {
+        buf_len = marshall(s, buf, sizeof(buf),
+                           "Qw", qid, s->msize - 24);
+        virtio_9p_send_reply(s, oi->queue_idx, oi->desc_idx, 12, oi->tag,
+                             buf, buf_len);
+    }
+    free(oi);
+}
+
+static void virtio_9p_open_cb(FSDevice *fs, FSQID *qid, int err,
+                              void *opaque)
+{
+    P9OpenInfo *oi = (P9OpenInfo *)opaque;
+    VIRTIO9PDevice *s = oi->dev;
+    int queue_idx = oi->queue_idx;
+    
+    virtio_9p_open_reply(fs, qid, err, oi);
+
+    if (s->aio)
+        return;
+    s->req_in_progress = FALSE;
+
+    /* handle next requests */
+    queue_notify((VIRTIODevice *)s, queue_idx);
+}
+
+/* execute a request and send its reply. In asynchronous mode, it is
+   called by the worker threads. */
+static void virtio_9p_handle_request(VIRTIO9PDevice *s, int queue_idx,
+                                     int desc_idx, int read_size,
+                                     int write_size)
+{
+    VIRTIODevice *s1 = (VIRTIODevice *)s;
+    int offset, header_len;
+    uint8_t id;
+    uint16_t tag;
+    uint8_t buf[1024];
+    int buf_len, err;
+    FSDevice *fs = s->fs;
+
+    offset = 0;
+    header_len = 4 + 1 + 2;
+    if (memcpy_from_queue(s1, buf, queue_idx, desc_idx, offset, header_len)) {
+        virtio_9p_stat_start(s, desc_idx, 0, 0);
+        tag = 0;
+        goto protocol_error;
+    }
+    id = buf[4];
+    tag = get_le16(buf + 5);
+    virtio_9p_stat_start(s, desc_idx, id, get_le32(buf));
+    offset += header_len;
+    
+#ifdef DEBUG_VIRTIO
+     {
+        const char *name;
+        name = get_9p_op_name(id);
+        printf("9p: op=");
+        if (name)
+            printf("%s", name);
+        else
+            printf("%d", id);
+    }
+#endif
+    /* Note: same subset as JOR1K */
+    switch(id) {
+    case 8: /* statfs */
+        {
+            FSStatFS st;
+
+            fs->fs_statfs(fs, &st);
+            buf_len = marshall(s, buf, sizeof(buf),
+                               "wwddddddw", 
+                               0,
+                               st.f_bsize,
+                               st.f_blocks,
+                               st.f_bfree,
+                               st.f_bavail,
+                               st.f_files,
+                               st.f_ffree,
+                               0, /* id */
+                               256 /* max filename length */
+                               );
+            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
+        }
+        break;
+    case 12: /* lopen */
+        {
+            uint32_t fid, flags;
+            FSFile *f;
+            FSQID qid;
+            P9OpenInfo *oi;
+            
+            if (unmarshall(s, queue_idx, desc_idx, &offset,
+                           "ww", &fid, &flags))
+                goto protocol_error;
+#ifdef DEBUG_VIRTIO
+            printf("Virtio 9p fs lopen: fid = %d, flags = %d\n", fid, flags);
+#endif
+            f = fid_find(s, fid);
+            if (!f)
+                goto fid_not_found;
+            oi = (P9OpenInfo *)malloc(sizeof(*oi));
+            oi->dev = s;
+            oi->queue_idx = queue_idx;
+            oi->desc_idx = desc_idx;
+            oi->tag = tag;
+            err = fs->fs_open(fs, &qid, f, flags, virtio_9p_open_cb, oi);
+            if (err <= 0) {
+                virtio_9p_open_reply(fs, &qid, err, oi);
+            } else if (!s->aio) {
+                s->req_in_progress = TRUE;
+            }
+        }
+        break;
+    case 14: /* lcreate */
+        {
+            uint32_t fid, flags, mode, gid;
+            char *name;
+            FSFile *f;
+            FSQID qid;
+
+            if (unmarshall(s, queue_idx, desc_idx, &offset,
+                           "wswww", &fid, &name, &flags, &mode, &gid))
+                goto protocol_error;
+            f = fid_find(s, fid);
+            if (!f) {
+                err = -P9_EPROTO;
+            } else {
+                err = fs->fs_create(fs, &qid, f, name, flags, mode, gid);
+            }
+            free(name);
+            if (err) 
+                goto error;
+            buf_len = marshall(s, buf, sizeof(buf),
+                               "Qw", &qid, s->msize - 24);
+            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
+        }
+        break;
+    case 16: /* symlink */
+        {
+            uint32_t fid, gid;
+            char *name, *symgt;
+            FSFile *f;
+            FSQID qid;
+
+            if (unmarshall(s, queue_idx, desc_idx, &offset,
+                           "wssw", &fid, &name, &symgt, &gid))
+                goto protocol_error;
+            f = fid_find(s, fid);
+            if (!f) {
+                err = -P9_EPROTO;
+            } else {
+                err = fs->fs_symlink(fs, &qid, f, name, symgt, gid);
+            }
+            free(name);
+            free(symgt);
+            if (err)
+                goto error;
+            buf_len = marshall(s, buf, sizeof(buf),
+                               "Q", &qid);
+            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
+        }
+        break;
+    case 18: /* mknod */
+        {
+            uint32_t fid, mode, major, minor, gid;
+            char *name;
+            FSFile *f;
+            FSQID qid;
+
+            if (unmarshall(s, queue_idx, desc_idx, &offset,
+                           "wswwww", &fid, &name, &mode, &major, &minor, &gid))
+                goto protocol_error;
+            f = fid_find(s, fid);
+            if (!f) {
+                err = -P9_EPROTO;
+            } else {
+                err = fs->fs_mknod(fs, &qid, f, name, mode, major, minor, gid);
+            }
+            free(name);
+            if (err)
+                goto error;
+            buf_len = marshall(s, buf, sizeof(buf),
+                               "Q", &qid);
+            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
+        }
+        break;
+    case 22: /* readlink */
+        {
+            uint32_t fid;
+            char buf1[1024];
+            FSFile *f;
+
+            if (unmarshall(s, queue_idx, desc_idx, &offset,
+                           "w", &fid))
+                goto protocol_error;
+            f = fid_find(s, fid);
+            if (!f) {
+                err = -P9_EPROTO;
+            } else {
+                err = fs->fs_readlink(fs, buf1, sizeof(buf1), f);
+            }
+            if (err)
+                goto error;
+            buf_len = marshall(s, buf, sizeof(buf), "s", buf1);
+            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
+        }
+        break;
+    case 24: /* getattr */
+        {
+            uint32_t fid;
+            uint64_t mask;
+            FSFile *f;
+            FSStat st;
+
+            if (unmarshall(s, queue_idx, desc_idx, &offset,
+                           "wd", &fid, &mask))
+                goto protocol_error;
+            f = fid_find(s, fid);
+            if (!f)
+                goto fid_not_found;
+            err = fs->fs_stat(fs, f, &st);
+            if (err)
+                goto error;
+
+            buf_len = marshall(s, buf, sizeof(buf),
+                               "dQwwwddddddddddddddd", 
+                               mask, &st.qid,
+                               st.st_mode, st.st_uid, st.st_gid,
+                               st.st_nlink, st.st_rdev, st.st_size,
+                               st.st_blksize, st.st_blocks,
+                               st.st_atime_sec, (uint64_t)st.st_atime_nsec,
+                               st.st_mtime_sec, (uint64_t)st.st_mtime_nsec,
+                               st.st_ctime_sec, (uint64_t)st.st_ctime_nsec,
+                               (uint64_t)0, (uint64_t)0,
+                               (uint64_t)0, (uint64_t)0);
+            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
+        }
+        break;
+    case 26: /* setattr */
+        {
+            uint32_t fid, mask, mode, uid, gid;
+            uint64_t size, atime_sec, atime_nsec, mtime_sec, mtime_nsec;
+            FSFile *f;
+
+            if (unmarshall(s, queue_idx, desc_idx, &offset,
+                           "wwwwwddddd", &fid, &mask, &mode, &uid, &gid,
+                           &size, &atime_sec, &atime_nsec, 
+                           &mtime_sec, &mtime_nsec))
+                goto protocol_error;
+            f = fid_find(s, fid);
+            if (!f)
+                goto fid_not_found;
+            err = fs->fs_setattr(fs, f, mask, mode, uid, gid, size, atime_sec,
+                                 atime_nsec, mtime_sec, mtime_nsec);
+            if (err)
+                goto error;
+            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, NULL, 0);
+        }
+        break;
+    case 30: /* xattrwalk */
+        {
+            /* not supported yet */
+            err = -P9_ENOTSUP;
+            goto error;
+        }
+        break;
+    case 40: /* readdir */
+        {
+            uint32_t fid, count;
+            uint64_t offs;
+            uint8_t *buf;
+            int n;
+            FSFile *f;
+
+            if (unmarshall(s, queue_idx, desc_idx, &offset,
+                           "wdw", &fid, &offs, &count))
+                goto protocol_error;
+            f = fid_find(s, fid);
+            if (!f)
+                goto fid_not_found;
+            /* the reply must fit in the guest writable buffers:
+               7 byte header + 4 byte count */
+            if (write_size < 11)
+                goto protocol_error;
+            count = min_int(count, write_size - 11);
+            buf = (uint8_t*)malloc(count + 4);
+            n = fs->fs_readdir(fs, f, offs, buf + 4, count);
+            if (n < 0) {
+                free(buf);
+                err = n;
+                goto error;
+            }
+            put_le32(buf, n);
+            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, n + 4);
+            free(buf);
+        }
+        break;
+    case 50: /* fsync */
+        {
+            uint32_t fid;
+            FSFile *f;
+            if (unmarshall(s, queue_idx, desc_idx, &offset,
+                           "w", &fid))
+                goto protocol_error;
+            f = fid_find(s, fid);
+            if (!f)
+                goto fid_not_found;
+            /* only the data buffered by the server is written */
+            if (fs->fs_fsync) {
+                err = fs->fs_fsync(fs, f);
+                if (err < 0)
+                    goto error;
+            }
+            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, NULL, 0);
+        }
+        break;
+    case 52: /* lock */
+        {
+            uint32_t fid;
+            FSFile *f;
+            FSLock lock;
+            
+            if (unmarshall(s, queue_idx, desc_idx, &offset,
+                           "wbwddws", &fid, &lock.type, &lock.flags,
+                           &lock.start, &lock.length,
+                           &lock.proc_id, &lock.client_id))
+                goto protocol_error;
+            f = fid_find(s, fid);
+            if (!f)
+                err = -P9_EPROTO;
+            else
+                err = fs->fs_lock(fs, f, &lock);
+            free(lock.client_id);
+            if (err < 0)
+                goto error;
+            buf_len = marshall(s, buf, sizeof(buf), "b", err);
+            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
+        }
+        break;
+    case 54: /* getlock */
+        {
+            uint32_t fid;
+            FSFile *f;
+            FSLock lock;
+            
+            if (unmarshall(s, queue_idx, desc_idx, &offset,
+                           "wbddws", &fid, &lock.type,
+                           &lock.start, &lock.length,
+                           &lock.proc_id, &lock.client_id))
+                goto protocol_error;
+            f = fid_find(s, fid);
+            if (!f)
+                err = -P9_EPROTO;
+            else
+                err = fs->fs_getlock(fs, f, &lock);
+            if (err < 0) {
+                free(lock.client_id);
+                goto error;
+            }
+            buf_len = marshall(s, buf, sizeof(buf), "bddws",
+                               &lock.type,
+                               &lock.start, &lock.length,
+                               &lock.proc_id, &lock.client_id);
+            free(lock.client_id);
+            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
+        }
+        break;
+    case 70: /* link */
+        {
+            uint32_t dfid, fid;
+            char *name;
+            FSFile *f, *df;
+
+            if (unmarshall(s, queue_idx, desc_idx, &offset,
+                           "wws", &dfid, &fid, &name))
+                goto protocol_error;
+            df = fid_find(s, dfid);
+            f = fid_find(s, fid);
+            if (!df || !f) {
+                err = -P9_EPROTO;
+            } else {
+                err = fs->fs_link(fs, df, f, name);
+            }
+            free(name);
+            if (err)
+                goto error;
+            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, NULL, 0);
+        }
+        break;
+    case 72: /* mkdir */
+        {
+            uint32_t fid, mode, gid;
+            char *name;
+            FSFile *f;
+            FSQID qid;
+
+            if (unmarshall(s, queue_idx, desc_idx, &offset,
+                           "wsww", &fid, &name, &mode, &gid))
+                goto protocol_error;
+            f = fid_find(s, fid);
+            if (!f)
+                goto fid_not_found;
+            err = fs->fs_mkdir(fs, &qid, f, name, mode, gid);
+            if (err != 0)
+                goto error;
+            buf_len = marshall(s, buf, sizeof(buf), "Q", &qid);
+            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
+        }
+        break;
+    case 74: /* renameat */
+        {
+            uint32_t fid, new_fid;
+            char *name, *new_name;
+            FSFile *f, *new_f;
+
+            if (unmarshall(s, queue_idx, desc_idx, &offset,
+                           "wsws", &fid, &name, &new_fid, &new_name))
+                goto protocol_error;
+            f = fid_find(s, fid);
+            new_f = fid_find(s, new_fid);
+            if (!f || !new_f) {
+                err = -P9_EPROTO;
+            } else {
+                err = fs->fs_renameat(fs, f, name, new_f, new_name);
+            }
+            free(name);
+            free(new_name);
+            if (err != 0)
+                goto error;
+            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, NULL, 0);
+        }
+        break;
+    case 76: /* unlinkat */
+        {
+            uint32_t fid, flags;
+            char *name;
+            FSFile *f;
+
+            if (unmarshall(s, queue_idx, desc_idx, &offset,
+                           "wsw", &fid, &name, &flags))
+                goto protocol_error;
+            f = fid_find(s, fid);
+            if (!f) {
+                err = -P9_EPROTO;
+            } else {
+                err = fs->fs_unlinkat(fs, f, name);
+            }
+            free(name);
+            if (err != 0)
+                goto error;
+            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, NULL, 0);
+        }
+        break;
+    case 100: /* version */
+        {
+            uint32_t msize;
+            char *version;
+            if (unmarshall(s, queue_idx, desc_idx, &offset, 
+                           "ws", &msize, &version))
+                goto protocol_error;
+            if (msize > s->max_msize)
+                msize = s->max_msize;
+            s->msize = msize;
+            //            printf("version: msize=%d version=%s\n", msize, version);
+            free(version);
+            buf_len = marshall(s, buf, sizeof(buf), "ws", s->msize, "9P2000.L");
+            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
+        }
+        break;
+    case 104: /* attach */
+        {
+            uint32_t fid, afid, uid;
+            char *uname, *aname;
+            FSQID qid;
+            FSFile *f;
+            
+            if (unmarshall(s, queue_idx, desc_idx, &offset, 
+                           "wwssw", &fid, &afid, &uname, &aname, &uid))
+                goto protocol_error;
+            err = fs->fs_attach(fs, &f, &qid, uid, uname, aname);
+            if (err != 0)
+                goto error;
+            fid_set(s, fid, f);
+            free(uname);
+            free(aname);
+            buf_len = marshall(s, buf, sizeof(buf), "Q", &qid);
+            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
+        }
+        break;
+    case 108: /* flush */
+        {
+            uint16_t oldtag;
+            if (unmarshall(s, queue_idx, desc_idx, &offset, 
+                           "h", &oldtag))
+                goto protocol_error;
+            /* ignored */
+            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, NULL, 0);
+        }
+        break;
+    case 110: /* walk */
+        {
+            uint32_t fid, newfid;
+            uint16_t nwname;
+            FSQID *qids;
+            char **names;
+            FSFile *f;
+            int i;
+
+            if (unmarshall(s, queue_idx, desc_idx, &offset, 
+                           "wwh", &fid, &newfid, &nwname))
+                goto protocol_error;
+            f = fid_find(s, fid);
+            if (!f)
+                goto fid_not_found;
+            names = (char**)mallocz(sizeof(names[0]) * nwname);
+            qids = (FSQID*)malloc(sizeof(qids[0]) * nwname);
+            for(i = 0; i < nwname; i++) {
+                if (unmarshall(s, queue_idx, desc_idx, &offset, 
+                               "s", &names[i])) {
+                    err = -P9_EPROTO;
+                    goto walk_done;
+                }
+            }
+            err = fs->fs_walk(fs, &f, qids, f, nwname, names);
+        walk_done:
+            for(i = 0; i < nwname; i++) {
+                free(names[i]);
+            }
+            free(names);
+            if (err < 0) {
+                free(qids);
+                goto error;
+            }
+            buf_len = marshall(s, buf, sizeof(buf), "h", err);
+            for(i = 0; i < err; i++) {
+                buf_len += marshall(s, buf + buf_len, sizeof(buf) - buf_len,
+                                    "Q", &qids[i]);
+            }
+            free(qids);
+            fid_set(s, newfid, f);
+            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
+        }
+        break;
+    case 116: /* read */
+        {
+            uint32_t fid, count;
+            uint64_t offs;
+            uint8_t *buf, hdr[11];
+            int n, iovcnt;
+            FSFile *f;
+            struct iovec host_iov[VIRTIO_9P_MAX_HOST_IOV];
+
+            if (unmarshall(s, queue_idx, desc_idx, &offset,
+                           "wdw", &fid, &offs, &count))
+                goto protocol_error;
+            f = fid_find(s, fid);
+            if (!f)
+                goto fid_not_found;
+            /* the reply is the header, the size and the data */
+            if (write_size < (int)sizeof(hdr))
+                goto protocol_error;
+            count = min_int(count, write_size - sizeof(hdr));
+            iovcnt = -1;
+            if (fs->fs_readv && count > 0)
+                iovcnt = virtio_queue_get_host_iov(s1, queue_idx, desc_idx,
+                                                   sizeof(hdr), count, TRUE,
+                                                   host_iov,
+                                                   VIRTIO_9P_MAX_HOST_IOV);
+            if (iovcnt > 0) {
+                n = fs->fs_readv(fs, f, offs, host_iov, iovcnt);
+                if (n < 0) {
+                    err = n;
+                    goto error;
+                }
+                put_le32(hdr, n + sizeof(hdr));
+                hdr[4] = id + 1;
+                put_le16(hdr + 5, tag);
+                put_le32(hdr + 7, n);
+                memcpy_to_queue(s1, queue_idx, desc_idx, 0, hdr, sizeof(hdr));
+                virtio_9p_complete(s, queue_idx, desc_idx, n + sizeof(hdr),
+                                   FALSE);
+                break;
             }
+            buf = (uint8_t*)malloc(count + 4);
+            n = fs->fs_read(fs, f, offs, buf + 4, count);
+            if (n < 0) {
+                err = n;
+                free(buf);
+                goto error;
+            }
+            put_le32(buf, n);
+            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, n + 4);
+            free(buf);
+        }
+        break;
+    case 118: /* write */
+        {
+            uint32_t fid, count;
+            uint64_t offs;
+            uint8_t *buf1;
+            int n, iovcnt;
+            FSFile *f;
+            struct iovec host_iov[VIRTIO_9P_MAX_HOST_IOV];
+
+            if (unmarshall(s, queue_idx, desc_idx, &offset,
+                           "wdw", &fid, &offs, &count))
+                goto protocol_error;
+            f = fid_find(s, fid);
+            if (!f)
+                goto fid_not_found;
+            iovcnt = -1;
+            if (fs->fs_writev && count > 0)
+                iovcnt = virtio_queue_get_host_iov(s1, queue_idx, desc_idx,
+                                                   offset, count, FALSE,
+                                                   host_iov,
+                                                   VIRTIO_9P_MAX_HOST_IOV);
+            if (iovcnt > 0) {
+                n = fs->fs_writev(fs, f, offs, host_iov, iovcnt);
+                if (n < 0) {
+                    err = n;
+                    goto error;
+                }
+                buf_len = marshall(s, buf, sizeof(buf), "w", n);
+                virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf,
+                                     buf_len);
+                break;
+            }
+            buf1 = (uint8_t*)malloc(count);
+            if (memcpy_from_queue(s1, buf1, queue_idx, desc_idx, offset,
+                                  count)) {
+                free(buf1);
+                goto protocol_error;
+            }
+            n = fs->fs_write(fs, f, offs, buf1, count);
+            free(buf1);
+            if (n < 0) {
+                err = n;
+                goto error;
+            }
+            buf_len = marshall(s, buf, sizeof(buf), "w", n);
+            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
+        }
+        break;
+    case 120: /* clunk */
+        {
+            uint32_t fid;
+            
+            if (unmarshall(s, queue_idx, desc_idx, &offset, 
+                           "w", &fid))
+                goto protocol_error;
+            fid_delete(s, fid);
+            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, NULL, 0);
+        }
+        break;
+    default:
+        printf("9p: unsupported operation id=%d\n", id);
+        goto protocol_error;
+    }
+    return;
+ error:
+    virtio_9p_send_error(s, queue_idx, desc_idx, tag, err);
+    return;
+ protocol_error:
+ fid_not_found:
+    err = -P9_EPROTO;
+    goto error;
+}
+
+static void *virtio_9p_aio_worker(void *opaque)
+{
+    VIRTIO9PAIO *aio = (VIRTIO9PAIO *)opaque;
+    VIRTIO9PReq *req;
+
+    for(;;) {
+        pthread_mutex_lock(&aio->lock);
+        while (!aio->submit_head && !aio->stop)
+            pthread_cond_wait(&aio->cond, &aio->lock);
+        req = aio->submit_head;
+        if (!req) {
+            pthread_mutex_unlock(&aio->lock);
             break;
-        default:
-            abort();
         }
+        aio->submit_head = req->next;
+        if (!aio->submit_head)
+            aio->submit_tail = &aio->submit_head;
+        pthread_mutex_unlock(&aio->lock);
+
+        virtio_9p_handle_request(aio->dev, 0, req->desc_idx,
+                                 req->read_size, req->write_size);
+    }
+    return NULL;
+}
+
+/* set the fids of the request from the start of its T-message. The
+   fids follow the header, except for renameat whose second fid is
+   after a name. */
+static void virtio_9p_req_get_fids(VIRTIO9PDevice *s, VIRTIO9PReq *req)
+{
+    uint8_t buf[7 + 4 * VIRTIO_9P_REQ_MAX_FIDS];
+    int i, n;
+
+    req->nb_fids = 0;
+    req->barrier = TRUE;
+    if (req->read_size < 7 ||
+        memcpy_from_queue(s, buf, 0, req->desc_idx, 0, 7))
+        return;
+    switch(buf[4]) {
+    case 8: /* statfs */
+    case 12: /* lopen */
+    case 14: /* lcreate */
+    case 16: /* symlink */
+    case 18: /* mknod */
+    case 22: /* readlink */
+    case 24: /* getattr */
+    case 26: /* setattr */
+    case 40: /* readdir */
+    case 50: /* fsync */
+    case 52: /* lock */
+    case 54: /* getlock */
+    case 72: /* mkdir */
+    case 76: /* unlinkat */
+    case 104: /* attach */
+    case 116: /* read */
+    case 118: /* write */
+    case 120: /* clunk */
+        n = 1;
+        break;
+    case 30: /* xattrwalk */
+    case 70: /* link */
+    case 110: /* walk */
+        n = 2;
+        break;
+    default:
+        /* version, flush, renameat and the unsupported operations */
+        return;
+    }
+    if (req->read_size < 7 + 4 * n ||
+        memcpy_from_queue(s, buf + 7, 0, req->desc_idx, 7, 4 * n))
+        return;
+    for(i = 0; i < n; i++)
+        req->fids[i] = get_le32(buf + 7 + 4 * i);
+    req->nb_fids = n;
+    req->barrier = FALSE;
+}
+
+static BOOL virtio_9p_req_conflict(const VIRTIO9PReq *a, const VIRTIO9PReq *b)
+{
+    int i, j;
+
+    if (a->barrier || b->barrier)
+        return TRUE;
+    for(i = 0; i < a->nb_fids; i++) {
+        for(j = 0; j < b->nb_fids; j++) {
+            if (a->fids[i] == b->fids[j])
+                return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* submit the requests which do not conflict with a previous one */
+static void virtio_9p_async_dispatch(VIRTIO9PDevice *s)
+{
+    VIRTIO9PAIO *aio = s->aio;
+    VIRTIO9PReq *req, *head, **tail;
+    int i, j;
+
+    head = NULL;
+    tail = &head;
+    for(i = 0; i < aio->nb_active; i++) {
+        req = aio->active[i];
+        if (req->dispatched)
+            continue;
+        for(j = 0; j < i; j++) {
+            if (virtio_9p_req_conflict(aio->active[j], req))
+                break;
+        }
+        if (j < i)
+            continue;
+        req->dispatched = TRUE;
+        req->next = NULL;
+        *tail = req;
+        tail = &req->next;
+    }
+    if (!head)
+        return;
+    pthread_mutex_lock(&aio->lock);
+    *aio->submit_tail = head;
+    aio->submit_tail = tail;
+    pthread_cond_broadcast(&aio->cond);
+    pthread_mutex_unlock(&aio->lock);
+}
+
+static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
+                                   int desc_idx, int read_size,
+                                   int write_size)
+{
+    VIRTIO9PDevice *s = (VIRTIO9PDevice *)s1;
+    VIRTIO9PAIO *aio = s->aio;
+    VIRTIO9PReq *req;
+
+    if (queue_idx != 0)
+        return 0;
+
+    if (aio) {
+        req = &aio->reqs[desc_idx];
+        req->desc_idx = desc_idx;
+        req->read_size = read_size;
+        req->write_size = write_size;
+        req->dispatched = FALSE;
+        virtio_9p_req_get_fids(s, req);
+        /* cannot overflow: each active request owns a descriptor */
+        assert(aio->nb_active < MAX_QUEUE_NUM);
+        aio->active[aio->nb_active++] = req;
+        virtio_9p_async_dispatch(s);
+        return 0;
+    }
+
+    if (s->req_in_progress)
+        return -1;
+
+    virtio_9p_handle_request(s, queue_idx, desc_idx, read_size, write_size);
+    return 0;
+}
+
+/* remove a completed request from the active list. Return FALSE if it
+   is not there, e.g. dropped by a reset. */
+static BOOL virtio_9p_async_remove(VIRTIO9PAIO *aio, VIRTIO9PReq *req)
+{
+    int i;
+
+    for(i = 0; i < aio->nb_active; i++) {
+        if (aio->active[i] == req)
+            break;
+    }
+    if (i == aio->nb_active)
+        return FALSE;
+    aio->nb_active--;
+    memmove(&aio->active[i], &aio->active[i + 1],
+            sizeof(aio->active[0]) * (aio->nb_active - i));
+    return TRUE;
+}
+
+/* complete the requests executed by the worker threads and let the
+   filesystem write its buffers. Must be called periodically from the
+   simulator thread. */
+void virtio_9p_poll(VIRTIODevice *s1)
+{
+    VIRTIO9PDevice *s = (VIRTIO9PDevice *)s1;
+    VIRTIO9PAIO *aio = s->aio;
+    QueueState *qs = &s1->queue[0];
+    VIRTIO9PReq *req, *next;
+
+    if (s->fs->fs_poll)
+        s->fs->fs_poll(s->fs);
+    if (!aio || !aio->done.pending())
+        return;
+    /* the completions are published together */
+    qs->batch_used = TRUE;
+    for(req = aio->done.take(); req; req = next) {
+        next = req->next;
+        if (virtio_9p_async_remove(aio, req))
+            virtio_consume_desc(s1, 0, req->desc_idx, req->reply_len);
+    }
+    qs->batch_used = FALSE;
+    virtio_queue_flush_used(s1, 0);
+    virtio_9p_async_dispatch(s);
+}
+
+/* execute the requests on nb_threads host threads. Return < 0 if the
+   threads could not be created. */
+int virtio_9p_set_async(VIRTIODevice *s1, int nb_threads)
+{
+    VIRTIO9PDevice *s = (VIRTIO9PDevice *)s1;
+    VIRTIO9PAIO *aio;
+    int i;
+
+    if (nb_threads <= 0 || s->aio)
+        return 0;
+    aio = (VIRTIO9PAIO *)mallocz(sizeof(*aio));
+    aio->dev = s;
+    aio->threads = (pthread_t *)mallocz(sizeof(aio->threads[0]) * nb_threads);
+    pthread_mutex_init(&aio->lock, NULL);
+    pthread_cond_init(&aio->cond, NULL);
+    pthread_mutex_init(&aio->fid_lock, NULL);
+    aio->submit_tail = &aio->submit_head;
+    for(i = 0; i < nb_threads; i++) {
+        if (pthread_create(&aio->threads[i], NULL, virtio_9p_aio_worker,
+                           aio) != 0)
+            break;
+    }
+    aio->nb_threads = i;
+    if (i == 0) {
+        free(aio->threads);
+        free(aio);
+        return -1;
+    }
+    s->aio = aio;
+    return 0;
+}
+
+/* execute the submitted requests and stop the threads. Their
+   completions are not delivered. */
+void virtio_9p_stop_async(VIRTIODevice *s1)
+{
+    VIRTIO9PDevice *s = (VIRTIO9PDevice *)s1;
+    VIRTIO9PAIO *aio = s->aio;
+    int i;
+
+    if (!aio)
+        return;
+    pthread_mutex_lock(&aio->lock);
+    aio->stop = TRUE;
+    pthread_cond_broadcast(&aio->cond);
+    pthread_mutex_unlock(&aio->lock);
+    for(i = 0; i < aio->nb_threads; i++)
+        pthread_join(aio->threads[i], NULL);
+    s->aio = NULL;
+    pthread_mutex_destroy(&aio->lock);
+    pthread_cond_destroy(&aio->cond);
+    pthread_mutex_destroy(&aio->fid_lock);
+    free(aio->threads);
+    free(aio);
+}
+
+/* the requests executed by the worker threads may still write their
+   reply in the guest memory, so they are completed, but not returned
+   to the guest. The requests not dispatched yet are dropped. */
+static void virtio_9p_reset(VIRTIODevice *s1)
+{
+    VIRTIO9PDevice *s = (VIRTIO9PDevice *)s1;
+    VIRTIO9PAIO *aio = s->aio;
+    VIRTIO9PReq *req, *next;
+    int i;
+
+    if (!aio)
+        return;
+    for(;;) {
+        for(req = aio->done.take(); req; req = next) {
+            next = req->next;
+            virtio_9p_async_remove(aio, req);
+        }
+        for(i = 0; i < aio->nb_active; i++) {
+            if (aio->active[i]->dispatched)
+                break;
+        }
+        if (i == aio->nb_active)
+            break;
+        sched_yield();
+    }
+    aio->nb_active = 0;
+}
+
+/* device state: the fids are saved by path and reopened on restore.
+   The host directory itself is not saved. */
+
+static BOOL virtio_9p_busy(VIRTIODevice *s1)
+{
+    VIRTIO9PDevice *s = (VIRTIO9PDevice *)s1;
+    return s->req_in_progress || (s->aio && s->aio->nb_active > 0);
+}
+
+static int virtio_9p_save(VIRTIODevice *s1, device_state_writer_t *w)
+{
+    VIRTIO9PDevice *s = (VIRTIO9PDevice *)s1;
+    FSDevice *fs = s->fs;
+    char path[4096];
+    uint32_t uid;
+    int i, flags;
+    FIDDesc *f;
+
+    if (s->fid_count > 0 && !fs->fs_get_file_info)
+        return -1;
+    w->put_u32(s->msize);
+    w->put_u32(s->fid_count);
+    for(i = 0; i < 1 << s->fid_table_bits; i++) {
+        f = s->fid_table[i];
+        if (!f)
+            continue;
+        if (fs->fs_get_file_info(fs, f->fd, path, sizeof(path),
+                                 &uid, &flags) < 0)
+            return -1;
+        /* the restored device reads the data from the host files */
+        if (flags >= 0 && fs->fs_fsync)
+            fs->fs_fsync(fs, f->fd);
+        w->put_u32(f->fid);
+        w->put_u32(uid);
+        w->put_u32(flags);
+        w->put_string(path);
+    }
+    return 0;
+}
+
+static void virtio_9p_clear_fids(VIRTIO9PDevice *s)
+{
+    uint32_t mask = (1U << s->fid_table_bits) - 1;
+    uint32_t i;
+
+    /* fid_delete() moves the following entries back */
+    for(i = 0; s->fid_count > 0; i = (i + 1) & mask) {
+        if (s->fid_table[i])
+            fid_delete(s, s->fid_table[i]->fid);
+    }
+}
+
+static int virtio_9p_load(VIRTIODevice *s1, device_state_reader_t *r)
+{
+    VIRTIO9PDevice *s = (VIRTIO9PDevice *)s1;
+    FSDevice *fs = s->fs;
+    uint32_t fid, uid, n, i;
+    int flags;
+    std::string path;
+    FSFile *root, *f;
+    FSQID qid;
+
+    virtio_9p_clear_fids(s);
+    s->msize = r->get_u32();
+    if (s->msize > s->max_msize)
+        return -1;
+    n = r->get_u32();
+    for(i = 0; i < n && r->ok(); i++) {
+        fid = r->get_u32();
+        uid = r->get_u32();
+        flags = r->get_u32();
+        path = r->get_string();
+        if (!r->ok() || fs->fs_attach(fs, &root, &qid, uid, "", "") < 0)
+            return -1;
+        if (path.empty()) {
+            f = root;
+        } else {
+            f = fs_walk_path(fs, root, path.c_str());
+            fs->fs_delete(fs, root);
+        }
+        if (f && flags >= 0 &&
+            fs->fs_open(fs, &qid, f, flags, NULL, NULL) != 0) {
+            fs->fs_delete(fs, f);
+            f = NULL;
+        }
+        if (!f) {
+            fprintf(stderr, "virtio-9p: cannot reopen '%s'\n", path.c_str());
+            return -1;
+        }
+        fid_set(s, fid, f);
+    }
+    return 0;
+}
+
+VIRTIODevice *virtio_9p_init(VIRTIOBusDef *bus, FSDevice *fs,
+                             const char *mount_tag, uint32_t max_msize,
+                             const simif_t* sim)
+
+{
+    VIRTIO9PDevice *s;
+    int len;
+    uint8_t *cfg;
+
+    len = strlen(mount_tag);
+    s = (VIRTIO9PDevice*)mallocz(sizeof(*s));
+    virtio_init(s, bus,
+                9, 2 + len, virtio_9p_recv_request, sim);
+    s->device_features |= 1 << 0;
+
+    /* set the mount tag */
+    cfg = s->config_space;
+    cfg[0] = len;
+    cfg[1] = len >> 8;
+    memcpy(cfg + 2, mount_tag, len);
+
+#ifdef DEBUG_VIRTIO
+    printf("Config space: %#x%x", cfg[0], cfg[1]);
+    for (int k = 0; k < len; k++) {
+        putchar(cfg[2+k]);
+    }
+    putchar('\n');
+#endif 
+
+    s->device_busy = virtio_9p_busy;
+    s->device_reset = virtio_9p_reset;
+    s->device_save = virtio_9p_save;
+    s->device_load = virtio_9p_load;
+    s->fs = fs;
+    s->op_stats = (P9OpStats *)mallocz(sizeof(s->op_stats[0]) *
+                                       VIRTIO_9P_STAT_OPS);
+    if (max_msize < DEFAULT_9P_MSIZE)
+        max_msize = DEFAULT_9P_MSIZE;
+    else if (max_msize > MAX_9P_MSIZE)
+        max_msize = MAX_9P_MSIZE;
+    s->max_msize = max_msize;
+    s->msize = DEFAULT_9P_MSIZE;
+    fid_table_resize(s, FID_TABLE_MIN_BITS);
+
+    return (VIRTIODevice *)s;
+}
+
+/*********************************************************************/
+/* virtio-fs device (FUSE over virtio) */
+
+/* configuration space */
+#define VIRTIO_FS_CONFIG_TAG        0 /* not null terminated */
+#define VIRTIO_FS_TAG_SIZE         36
+#define VIRTIO_FS_CONFIG_NUM_QUEUES 36 /* le32 */
+#define VIRTIO_FS_CONFIG_SIZE      40
+
+/* queue 0 is the high priority queue (FORGET), the request queues
+   follow */
+
+/* FUSE protocol, from linux/fuse.h */
+#define FUSE_KERNEL_VERSION 7
+#define FUSE_KERNEL_MINOR_VERSION 31
+#define FUSE_ROOT_ID 1
+
+#define FUSE_LOOKUP        1
+#define FUSE_FORGET        2
+#define FUSE_GETATTR       3
+#define FUSE_SETATTR       4
+#define FUSE_READLINK      5
+#define FUSE_SYMLINK       6
+#define FUSE_MKNOD         8
+#define FUSE_MKDIR         9
+#define FUSE_UNLINK       10
+#define FUSE_RMDIR        11
+#define FUSE_RENAME       12
+#define FUSE_LINK         13
+#define FUSE_OPEN         14
+#define FUSE_READ         15
+#define FUSE_WRITE        16
+#define FUSE_STATFS       17
+#define FUSE_RELEASE      18
+#define FUSE_FSYNC        20
+#define FUSE_FLUSH        25
+#define FUSE_INIT         26
+#define FUSE_OPENDIR      27
+#define FUSE_READDIR      28
+#define FUSE_RELEASEDIR   29
+#define FUSE_FSYNCDIR     30
+#define FUSE_CREATE       35
+#define FUSE_INTERRUPT    36
+#define FUSE_DESTROY      38
+#define FUSE_BATCH_FORGET 42
+#define FUSE_READDIRPLUS  44
+#define FUSE_RENAME2      45
+
+/* FUSE_INIT flags */
+#define FUSE_ASYNC_READ       (1 << 0)
+#define FUSE_ATOMIC_O_TRUNC   (1 << 3)
+#define FUSE_BIG_WRITES       (1 << 5)
+#define FUSE_AUTO_INVAL_DATA  (1 << 12)
+#define FUSE_DO_READDIRPLUS   (1 << 13)
+#define FUSE_READDIRPLUS_AUTO (1 << 14)
+#define FUSE_PARALLEL_DIROPS  (1 << 18)
+#define FUSE_MAX_PAGES        (1 << 22)
+#define FUSE_CACHE_SYMLINKS   (1 << 23)
+
+/* fuse_open_out.open_flags */
+#define FOPEN_DIRECT_IO  (1 << 0)
+#define FOPEN_KEEP_CACHE (1 << 1)
+#define FOPEN_CACHE_DIR  (1 << 3)
+
+/* fuse_setattr_in.valid */
+#define FATTR_MODE      (1 << 0)
+#define FATTR_UID       (1 << 1)
+#define FATTR_GID       (1 << 2)
+#define FATTR_SIZE      (1 << 3)
+#define FATTR_ATIME     (1 << 4)
+#define FATTR_MTIME     (1 << 5)
+#define FATTR_FH        (1 << 6)
+#define FATTR_ATIME_NOW (1 << 7)
+#define FATTR_MTIME_NOW (1 << 8)
+#define FATTR_CTIME     (1 << 10)
+
+#define FUSE_GETATTR_FH (1 << 0)
+
+#define FUSE_IN_HEADER_SIZE  40
+#define FUSE_OUT_HEADER_SIZE 16
+#define FUSE_ATTR_SIZE       88
+#define FUSE_ENTRY_OUT_SIZE  (40 + FUSE_ATTR_SIZE)
+#define FUSE_ATTR_OUT_SIZE   (16 + FUSE_ATTR_SIZE)
+#define FUSE_OPEN_OUT_SIZE   16
+#define FUSE_INIT_OUT_SIZE   64
+#define FUSE_KSTATFS_SIZE    80
+#define FUSE_READ_IN_SIZE    40
+#define FUSE_WRITE_IN_SIZE   40
+#define FUSE_DIRENT_SIZE     24 /* without the name */
+
+/* the request arguments, except the data of FUSE_WRITE: two names
+   (FUSE_RENAME2) or a name and a symbolic link target */
+#define VIRTIO_FS_MAX_IN (FUSE_IN_HEADER_SIZE + 64 + 2 * 4096)
+
+/* the data of the read and write requests is transferred directly
+   between the guest buffers and the files, one fragment per guest
+   page */
+#define VIRTIO_FS_MAX_HOST_IOV (VIRTIO_FS_MAX_WRITE / 4096 + 2)
+
+/* A node is an inode known by the guest, from the lookups it has not
+   forgotten. Nodes are found by their nodeid and by their host inode
+   number, so that the hard links of a file share a node. The backend
+   files are named by path: a node keeps its parent and its name and
+   is walked again from its parent after a directory was renamed. */
+typedef struct VIRTIOFSNode {
+    uint64_t nodeid;
+    uint64_t ino;
+    uint64_t nlookup;
+    int nb_children; /* nodes whose parent it is */
+    struct VIRTIOFSNode *parent; /* NULL for the root */
+    char *name;
+    FSFile *file; /* walked, not opened */
+    uint32_t rename_gen; /* s->rename_gen when file was walked */
+    struct VIRTIOFSNode *id_next; /* in the hash tables */
+    struct VIRTIOFSNode *ino_next;
+} VIRTIOFSNode;
+
+#define VIRTIO_FS_NODE_HASH_MIN_BITS 6
+
+struct VIRTIOFSDevice : public VIRTIODevice {
+    FSDevice *fs;
+    int num_request_queues;
+    uint32_t max_write;
+    int cache_mode; /* VIRTIO_FS_CACHE_x */
+    int timeout_ms; /* entry and attribute validity */
+    uint32_t minor; /* negotiated minor version, 0 before FUSE_INIT */
+    uint64_t next_nodeid;
+    uint32_t rename_gen; /* incremented when a directory is renamed */
+    VIRTIOFSNode *root;
+    int nb_nodes;
+    int node_hash_bits;
+    VIRTIOFSNode **id_hash;
+    VIRTIOFSNode **ino_hash;
+    /* opened files, indexed by file handle. NULL if the entry is free */
+    FSFile **handles;
+    int nb_handles;
+    int max_handles;
+};
+
+static inline uint32_t virtio_fs_hash(VIRTIOFSDevice *s, uint64_t v)
+{
+    return (uint32_t)((v * 0x9e3779b97f4a7c15ULL) >> (64 - s->node_hash_bits));
+}
+
+static VIRTIOFSNode *virtio_fs_node_find(VIRTIOFSDevice *s, uint64_t nodeid)
+{
+    VIRTIOFSNode *n;
+
+    for(n = s->id_hash[virtio_fs_hash(s, nodeid)]; n; n = n->id_next) {
+        if (n->nodeid == nodeid)
+            return n;
     }
-    va_end(ap);
-    *poffset = offset;
-    return 0;
+    return NULL;
 }
 
-static void virtio_9p_send_reply(VIRTIO9PDevice *s, int queue_idx,
-                                 int desc_idx, uint8_t id, uint16_t tag, 
-                                 uint8_t *buf, int buf_len)
+static VIRTIOFSNode *virtio_fs_node_find_ino(VIRTIOFSDevice *s, uint64_t ino)
 {
-    uint8_t *buf1;
-    int len;
+    VIRTIOFSNode *n;
 
-#ifdef DEBUG_VIRTIO
-     {
-        if (id == 6)
-            printf(" (error)");
-        printf("\n");
+    for(n = s->ino_hash[virtio_fs_hash(s, ino)]; n; n = n->ino_next) {
+        if (n->ino == ino)
+            return n;
     }
-#endif
-    len = buf_len + 7;
-    buf1 = (uint8_t*)malloc(len);
-    put_le32(buf1, len);
-    buf1[4] = id + 1;
-    put_le16(buf1 + 5, tag);
-    memcpy(buf1 + 7, buf, buf_len);
-    memcpy_to_queue((VIRTIODevice *)s, queue_idx, desc_idx, 0, buf1, len);
-    virtio_consume_desc((VIRTIODevice *)s, queue_idx, desc_idx, len);
-    free(buf1);
+    return NULL;
 }
 
-static void virtio_9p_send_error(VIRTIO9PDevice *s, int queue_idx,
-                                 int desc_idx, uint16_t tag, uint32_t error)
+static void virtio_fs_node_hash_add(VIRTIOFSDevice *s, VIRTIOFSNode *n)
 {
-    uint8_t buf[4];
-    int buf_len;
+    uint32_t h;
+
+    h = virtio_fs_hash(s, n->nodeid);
+    n->id_next = s->id_hash[h];
+    s->id_hash[h] = n;
+    h = virtio_fs_hash(s, n->ino);
+    n->ino_next = s->ino_hash[h];
+    s->ino_hash[h] = n;
+}
 
-    buf_len = marshall(s, buf, sizeof(buf), "w", -error);
-    virtio_9p_send_reply(s, queue_idx, desc_idx, 6, tag, buf, buf_len);
+static void virtio_fs_node_hash_resize(VIRTIOFSDevice *s, int bits)
+{
+    VIRTIOFSNode **id_hash, *n, *next;
+    int i, size;
+
+    id_hash = s->id_hash;
+    size = s->id_hash ? 1 << s->node_hash_bits : 0;
+    free(s->ino_hash);
+    s->node_hash_bits = bits;
+    s->id_hash = (VIRTIOFSNode **)mallocz(sizeof(s->id_hash[0]) << bits);
+    s->ino_hash = (VIRTIOFSNode **)mallocz(sizeof(s->ino_hash[0]) << bits);
+    for(i = 0; i < size; i++) {
+        for(n = id_hash[i]; n; n = next) {
+            next = n->id_next;
+            virtio_fs_node_hash_add(s, n);
+        }
+    }
+    free(id_hash);
 }
 
-typedef struct {
-    VIRTIO9PDevice *dev;
-    int queue_idx;
-    int desc_idx;
-    uint16_t tag;
-} P9OpenInfo;
+static void virtio_fs_node_hash_remove(VIRTIOFSDevice *s, VIRTIOFSNode *n)
+{
+    VIRTIOFSNode **pn;
+
+    for(pn = &s->id_hash[virtio_fs_hash(s, n->nodeid)]; *pn != n;
+        pn = &(*pn)->id_next)
+        continue;
+    *pn = n->id_next;
+    for(pn = &s->ino_hash[virtio_fs_hash(s, n->ino)]; *pn != n;
+        pn = &(*pn)->ino_next)
+        continue;
+    *pn = n->ino_next;
+}
 
-static void virtio_9p_open_reply(FSDevice *fs, FSQID *qid, int err,
-                                 P9OpenInfo *oi)
+/* free the node and then its ancestors while they are not referenced */
+static void virtio_fs_node_put(VIRTIOFSDevice *s, VIRTIOFSNode *n)
 {
-    VIRTIO9PDevice *s = oi->dev;
-    uint8_t buf[32];
-    int buf_len;
-    
-    if (err < 0) {
-        virtio_9p_send_error(s, oi->queue_idx, oi->desc_idx, oi->tag, err);
-    } else {
-        buf_len = marshall(s, buf, sizeof(buf),
-                           "Qw", qid, s->msize - 24);
-        virtio_9p_send_reply(s, oi->queue_idx, oi->desc_idx, 12, oi->tag,
-                             buf, buf_len);
+    VIRTIOFSNode *parent;
+
+    while (n && n != s->root && n->nlookup == 0 && n->nb_children == 0) {
+        parent = n->parent;
+        virtio_fs_node_hash_remove(s, n);
+        s->fs->fs_delete(s->fs, n->file);
+        free(n->name);
+        free(n);
+        s->nb_nodes--;
+        if (parent)
+            parent->nb_children--;
+        n = parent;
     }
-    free(oi);
 }
 
-static void virtio_9p_open_cb(FSDevice *fs, FSQID *qid, int err,
-                              void *opaque)
+static void virtio_fs_node_set_name(VIRTIOFSDevice *s, VIRTIOFSNode *n,
+                                    VIRTIOFSNode *parent, const char *name)
 {
-    P9OpenInfo *oi = (P9OpenInfo *)opaque;
-    VIRTIO9PDevice *s = oi->dev;
-    int queue_idx = oi->queue_idx;
-    
-    virtio_9p_open_reply(fs, qid, err, oi);
+    VIRTIOFSNode *p, *old_parent;
 
-    s->req_in_progress = FALSE;
+    /* a directory moved on the host side cannot become its own
+       ancestor */
+    for(p = parent; p; p = p->parent) {
+        if (p == n)
+            return;
+    }
+    old_parent = n->parent;
+    parent->nb_children++;
+    n->parent = parent;
+    free(n->name);
+    n->name = strdup(name);
+    if (old_parent) {
+        old_parent->nb_children--;
+        virtio_fs_node_put(s, old_parent);
+    }
+}
 
-    /* handle next requests */
-    queue_notify((VIRTIODevice *)s, queue_idx);
+/* backend file of the node, walked again if a directory was renamed
+   since its last walk */
+static FSFile *virtio_fs_node_file(VIRTIOFSDevice *s, VIRTIOFSNode *n)
+{
+    FSDevice *fs = s->fs;
+    FSFile *dir_f, *f;
+    FSQID qid;
+    int ret;
+
+    if (n->rename_gen != s->rename_gen && n->parent) {
+        dir_f = virtio_fs_node_file(s, n->parent);
+        ret = fs->fs_walk(fs, &f, &qid, dir_f, 1, &n->name);
+        if (ret == 1) {
+            fs->fs_delete(fs, n->file);
+            n->file = f;
+        } else {
+            fs->fs_delete(fs, f);
+        }
+        n->rename_gen = s->rename_gen;
+    }
+    return n->file;
 }
 
-static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
-                                   int desc_idx, int read_size,
-                                   int write_size)
+/* the node of the host inode ino, found as name in the directory
+   parent. f becomes its backend file. */
+static VIRTIOFSNode *virtio_fs_node_get(VIRTIOFSDevice *s, uint64_t ino,
+                                        VIRTIOFSNode *parent, const char *name,
+                                        FSFile *f)
+{
+    VIRTIOFSNode *n;
+
+    n = virtio_fs_node_find_ino(s, ino);
+    if (n) {
+        if (n == s->root) {
+            s->fs->fs_delete(s->fs, f);
+        } else {
+            /* the most recent name is kept */
+            virtio_fs_node_set_name(s, n, parent, name);
+            s->fs->fs_delete(s->fs, n->file);
+            n->file = f;
+            n->rename_gen = s->rename_gen;
+        }
+        return n;
+    }
+    if (s->nb_nodes >= 1 << s->node_hash_bits)
+        virtio_fs_node_hash_resize(s, s->node_hash_bits + 1);
+    n = (VIRTIOFSNode *)mallocz(sizeof(*n));
+    n->nodeid = s->next_nodeid++;
+    n->ino = ino;
+    n->file = f;
+    n->rename_gen = s->rename_gen;
+    virtio_fs_node_set_name(s, n, parent, name);
+    virtio_fs_node_hash_add(s, n);
+    s->nb_nodes++;
+    return n;
+}
+
+/* look up name in the directory dir. Return its node, whose lookup
+   count is incremented, or NULL and the error in *perr. */
+static VIRTIOFSNode *virtio_fs_lookup(VIRTIOFSDevice *s, VIRTIOFSNode *dir,
+                                      const char *name, FSStat *st, int *perr)
 {
-    VIRTIO9PDevice *s = (VIRTIO9PDevice *)s1;
-    int offset, header_len;
-    uint8_t id;
-    uint16_t tag;
-    uint8_t buf[1024];
-    int buf_len, err;
     FSDevice *fs = s->fs;
+    FSFile *f;
+    FSQID qid;
+    VIRTIOFSNode *n;
+    char *names[1];
+    int ret;
 
-    if (queue_idx != 0)
-        return 0;
-    
-    if (s->req_in_progress)
-        return -1;
-    
-    offset = 0;
-    header_len = 4 + 1 + 2;
-    if (memcpy_from_queue(s1, buf, queue_idx, desc_idx, offset, header_len)) {
-        tag = 0;
-        goto protocol_error;
+    names[0] = (char *)name;
+    ret = fs->fs_walk(fs, &f, &qid, virtio_fs_node_file(s, dir), 1, names);
+    if (ret != 1) {
+        fs->fs_delete(fs, f);
+        *perr = -P9_ENOENT;
+        return NULL;
     }
-    //size = get_le32(buf);
-    id = buf[4];
-    tag = get_le16(buf + 5);
-    offset += header_len;
-    
-#ifdef DEBUG_VIRTIO
-     {
-        const char *name;
-        name = get_9p_op_name(id);
-        printf("9p: op=");
-        if (name)
-            printf("%s", name);
-        else
-            printf("%d", id);
+    ret = fs->fs_stat(fs, f, st);
+    if (ret < 0) {
+        fs->fs_delete(fs, f);
+        *perr = ret;
+        return NULL;
     }
-#endif
-    /* Note: same subset as JOR1K */
-    switch(id) {
-    case 8: /* statfs */
-        {
-            FSStatFS st;
+    n = virtio_fs_node_get(s, st->qid.path, dir, name, f);
+    n->nlookup++;
+    return n;
+}
 
-            fs->fs_statfs(fs, &st);
-            buf_len = marshall(s, buf, sizeof(buf),
-                               "wwddddddw", 
-                               0,
-                               st.f_bsize,
-                               st.f_blocks,
-                               st.f_bfree,
-                               st.f_bavail,
-                               st.f_files,
-                               st.f_ffree,
-                               0, /* id */
-                               256 /* max filename length */
-                               );
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
-        }
-        break;
-    case 12: /* lopen */
-        {
-            uint32_t fid, flags;
-            FSFile *f;
-            FSQID qid;
-            P9OpenInfo *oi;
-            
-            if (unmarshall(s, queue_idx, desc_idx, &offset,
-                           "ww", &fid, &flags))
-                goto protocol_error;
-#ifdef DEBUG_VIRTIO
-            printf("Virtio 9p fs lopen: fid = %d, flags = %d\n", fid, flags);
-#endif
-            f = fid_find(s, fid);
-            if (!f)
-                goto fid_not_found;
-            oi = (P9OpenInfo *)malloc(sizeof(*oi));
-            oi->dev = s;
-            oi->queue_idx = queue_idx;
-            oi->desc_idx = desc_idx;
-            oi->tag = tag;
-            err = fs->fs_open(fs, &qid, f, flags, virtio_9p_open_cb, oi);
-            if (err <= 0) {
-                virtio_9p_open_reply(fs, &qid, err, oi);
-            } else {
-                s->req_in_progress = TRUE;
-            }
+static void virtio_fs_forget(VIRTIOFSDevice *s, uint64_t nodeid,
+                             uint64_t nlookup)
+{
+    VIRTIOFSNode *n;
+
+    n = virtio_fs_node_find(s, nodeid);
+    if (!n || n == s->root)
+        return;
+    n->nlookup = nlookup < n->nlookup ? n->nlookup - nlookup : 0;
+    virtio_fs_node_put(s, n);
+}
+
+static void virtio_fs_fh_set(VIRTIOFSDevice *s, int fh, FSFile *f)
+{
+    while (fh >= s->nb_handles) {
+        if (s->nb_handles >= s->max_handles) {
+            s->max_handles = max_int(64, s->max_handles * 2);
+            s->handles = (FSFile **)realloc(s->handles, sizeof(s->handles[0]) *
+                                            s->max_handles);
         }
-        break;
-    case 14: /* lcreate */
-        {
-            uint32_t fid, flags, mode, gid;
-            char *name;
-            FSFile *f;
-            FSQID qid;
+        s->handles[s->nb_handles++] = NULL;
+    }
+    s->handles[fh] = f;
+}
 
-            if (unmarshall(s, queue_idx, desc_idx, &offset,
-                           "wswww", &fid, &name, &flags, &mode, &gid))
-                goto protocol_error;
-            f = fid_find(s, fid);
-            if (!f) {
-                err = -P9_EPROTO;
-            } else {
-                err = fs->fs_create(fs, &qid, f, name, flags, mode, gid);
-            }
-            free(name);
-            if (err) 
-                goto error;
-            buf_len = marshall(s, buf, sizeof(buf),
-                               "Qw", &qid, s->msize - 24);
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
+static int virtio_fs_fh_alloc(VIRTIOFSDevice *s, FSFile *f)
+{
+    int i;
+
+    for(i = 0; i < s->nb_handles; i++) {
+        if (!s->handles[i])
+            break;
+    }
+    virtio_fs_fh_set(s, i, f);
+    return i;
+}
+
+static FSFile *virtio_fs_fh_find(VIRTIOFSDevice *s, uint64_t fh)
+{
+    if (fh >= (uint64_t)s->nb_handles)
+        return NULL;
+    return s->handles[fh];
+}
+
+static void virtio_fs_fh_free(VIRTIOFSDevice *s, uint64_t fh)
+{
+    FSFile *f = virtio_fs_fh_find(s, fh);
+
+    if (!f)
+        return;
+    s->fs->fs_delete(s->fs, f);
+    s->handles[fh] = NULL;
+    while (s->nb_handles > 0 && !s->handles[s->nb_handles - 1])
+        s->nb_handles--;
+}
+
+/* forget all the nodes except the root and close the files, e.g. when
+   the guest unmounts */
+static void virtio_fs_clear(VIRTIOFSDevice *s)
+{
+    VIRTIOFSNode *n, *next;
+    int i;
+
+    for(i = 0; i < s->nb_handles; i++) {
+        if (s->handles[i])
+            s->fs->fs_delete(s->fs, s->handles[i]);
+    }
+    s->nb_handles = 0;
+    for(i = 0; s->id_hash && i < 1 << s->node_hash_bits; i++) {
+        for(n = s->id_hash[i]; n; n = next) {
+            next = n->id_next;
+            if (n == s->root)
+                continue;
+            s->fs->fs_delete(s->fs, n->file);
+            free(n->name);
+            free(n);
         }
-        break;
-    case 16: /* symlink */
-        {
-            uint32_t fid, gid;
-            char *name, *symgt;
-            FSFile *f;
-            FSQID qid;
+    }
+    free(s->id_hash);
+    s->id_hash = NULL;
+    virtio_fs_node_hash_resize(s, VIRTIO_FS_NODE_HASH_MIN_BITS);
+    s->root->nb_children = 0;
+    virtio_fs_node_hash_add(s, s->root);
+    s->nb_nodes = 1;
+    s->next_nodeid = FUSE_ROOT_ID + 1;
+    s->minor = 0;
+}
+
+static void virtio_fs_put_attr(uint8_t *p, const FSStat *st)
+{
+    put_le64(p, st->qid.path);
+    put_le64(p + 8, st->st_size);
+    put_le64(p + 16, st->st_blocks);
+    put_le64(p + 24, st->st_atime_sec);
+    put_le64(p + 32, st->st_mtime_sec);
+    put_le64(p + 40, st->st_ctime_sec);
+    put_le32(p + 48, st->st_atime_nsec);
+    put_le32(p + 52, st->st_mtime_nsec);
+    put_le32(p + 56, st->st_ctime_nsec);
+    put_le32(p + 60, st->st_mode);
+    put_le32(p + 64, st->st_nlink);
+    put_le32(p + 68, st->st_uid);
+    put_le32(p + 72, st->st_gid);
+    put_le32(p + 76, st->st_rdev);
+    put_le32(p + 80, st->st_blksize);
+    put_le32(p + 84, 0);
+}
+
+static void virtio_fs_put_timeout(VIRTIOFSDevice *s, uint8_t *sec,
+                                  uint8_t *nsec)
+{
+    put_le64(sec, s->timeout_ms / 1000);
+    put_le32(nsec, (s->timeout_ms % 1000) * 1000000);
+}
+
+/* fuse_entry_out. A nodeid of 0 with no attributes is a negative entry,
+   cached by the guest for the entry timeout. */
+static void virtio_fs_put_entry(VIRTIOFSDevice *s, uint8_t *p,
+                                uint64_t nodeid, const FSStat *st)
+{
+    memset(p, 0, FUSE_ENTRY_OUT_SIZE);
+    put_le64(p, nodeid);
+    virtio_fs_put_timeout(s, p + 16, p + 32);
+    virtio_fs_put_timeout(s, p + 24, p + 36);
+    if (st)
+        virtio_fs_put_attr(p + 40, st);
+}
+
+static void virtio_fs_put_open(VIRTIOFSDevice *s, uint8_t *p, int fh,
+                               BOOL is_dir)
+{
+    uint32_t flags = 0;
+
+    if (s->cache_mode == VIRTIO_FS_CACHE_ALWAYS)
+        flags = is_dir ? FOPEN_CACHE_DIR : FOPEN_KEEP_CACHE;
+    else if (s->cache_mode == VIRTIO_FS_CACHE_NONE && !is_dir)
+        flags = FOPEN_DIRECT_IO;
+    put_le64(p, fh);
+    put_le32(p + 8, flags);
+    put_le32(p + 12, 0);
+}
+
+/* the reply header, after len bytes of data already written to the
+   buffer */
+static void virtio_fs_reply_hdr(VIRTIOFSDevice *s, int queue_idx,
+                                int desc_idx, uint64_t unique, int err,
+                                int len)
+{
+    uint8_t hdr[FUSE_OUT_HEADER_SIZE];
+
+    if (err < 0)
+        len = 0;
+    len += FUSE_OUT_HEADER_SIZE;
+    put_le32(hdr, len);
+    put_le32(hdr + 4, err);
+    put_le64(hdr + 8, unique);
+    if (memcpy_to_queue(s, queue_idx, desc_idx, 0, hdr, sizeof(hdr)) < 0)
+        len = 0;
+    virtio_trace(s, VTRACE_EV_COMPLETE, queue_idx, desc_idx, err < 0, len);
+    virtio_consume_desc(s, queue_idx, desc_idx, len);
+}
+
+static void virtio_fs_reply(VIRTIOFSDevice *s, int queue_idx, int desc_idx,
+                            uint64_t unique, int err, const void *buf,
+                            int len)
+{
+    if (err >= 0 && len > 0 &&
+        memcpy_to_queue(s, queue_idx, desc_idx, FUSE_OUT_HEADER_SIZE,
+                        buf, len) < 0)
+        err = -EIO;
+    virtio_fs_reply_hdr(s, queue_idx, desc_idx, unique, err, len);
+}
+
+/* null terminated string of the request at *ppos */
+static const char *virtio_fs_get_name(const uint8_t *in, int in_len, int *ppos)
+{
+    const uint8_t *p, *end;
 
-            if (unmarshall(s, queue_idx, desc_idx, &offset,
-                           "wssw", &fid, &name, &symgt, &gid))
-                goto protocol_error;
-            f = fid_find(s, fid);
-            if (!f) {
-                err = -P9_EPROTO;
-            } else {
-                err = fs->fs_symlink(fs, &qid, f, name, symgt, gid);
-            }
-            free(name);
-            free(symgt);
-            if (err)
-                goto error;
-            buf_len = marshall(s, buf, sizeof(buf),
-                               "Q", &qid);
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
-        }
-        break;
-    case 18: /* mknod */
-        {
-            uint32_t fid, mode, major, minor, gid;
-            char *name;
-            FSFile *f;
-            FSQID qid;
+    if (*ppos >= in_len)
+        return NULL;
+    p = in + *ppos;
+    end = (const uint8_t *)memchr(p, '\0', in_len - *ppos);
+    if (!end)
+        return NULL;
+    *ppos += end - p + 1;
+    return (const char *)p;
+}
 
-            if (unmarshall(s, queue_idx, desc_idx, &offset,
-                           "wswwww", &fid, &name, &mode, &major, &minor, &gid))
-                goto protocol_error;
-            f = fid_find(s, fid);
-            if (!f) {
-                err = -P9_EPROTO;
+/* FUSE_READDIR and FUSE_READDIRPLUS: the entries of the backend, in
+   the 9P format, are converted to fuse_dirent or fuse_direntplus.
+   The offset of an entry is the position of the next one, so the
+   entries which do not fit are read again by the next request. */
+static int virtio_fs_readdir(VIRTIOFSDevice *s, VIRTIOFSNode *dir, FSFile *f,
+                             uint64_t offset, uint32_t size, BOOL plus,
+                             uint8_t *out)
+{
+    FSDevice *fs = s->fs;
+    uint8_t *ents, *e, *p;
+    char name[256];
+    VIRTIOFSNode *n;
+    FSStat st;
+    uint64_t ino;
+    int ret, pos, out_len, name_len, ent_len, d_type, err;
+
+    ents = (uint8_t *)malloc(size);
+    ret = fs->fs_readdir(fs, f, offset, ents, size);
+    if (ret < 0) {
+        free(ents);
+        return ret;
+    }
+    out_len = 0;
+    for(pos = 0; pos + 24 <= ret; pos += 24 + name_len) {
+        e = ents + pos;
+        ino = get_le64(e + 5);
+        offset = get_le64(e + 13);
+        d_type = e[21];
+        name_len = get_le16(e + 22);
+        ent_len = (FUSE_DIRENT_SIZE + name_len + 7) & ~7;
+        if (plus)
+            ent_len += FUSE_ENTRY_OUT_SIZE;
+        if (out_len + ent_len > (int)size || name_len >= (int)sizeof(name))
+            break;
+        p = out + out_len;
+        if (plus) {
+            memcpy(name, e + 24, name_len);
+            name[name_len] = '\0';
+            /* "." and ".." are not looked up */
+            n = NULL;
+            if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0)
+                n = virtio_fs_lookup(s, dir, name, &st, &err);
+            if (n) {
+                virtio_fs_put_entry(s, p, n->nodeid, &st);
+                ino = st.qid.path;
             } else {
-                err = fs->fs_mknod(fs, &qid, f, name, mode, major, minor, gid);
+                memset(p, 0, FUSE_ENTRY_OUT_SIZE);
+                put_le64(p + 40, ino);
+                put_le32(p + 40 + 60, d_type << 12);
             }
-            free(name);
-            if (err)
-                goto error;
-            buf_len = marshall(s, buf, sizeof(buf),
-                               "Q", &qid);
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
+            p += FUSE_ENTRY_OUT_SIZE;
         }
-        break;
-    case 22: /* readlink */
-        {
-            uint32_t fid;
-            char buf1[1024];
-            FSFile *f;
+        memset(p, 0, (FUSE_DIRENT_SIZE + name_len + 7) & ~7);
+        put_le64(p, ino);
+        put_le64(p + 8, offset);
+        put_le32(p + 16, name_len);
+        put_le32(p + 20, d_type);
+        memcpy(p + FUSE_DIRENT_SIZE, e + 24, name_len);
+        out_len += ent_len;
+    }
+    free(ents);
+    return out_len;
+}
 
-            if (unmarshall(s, queue_idx, desc_idx, &offset,
-                           "w", &fid))
-                goto protocol_error;
-            f = fid_find(s, fid);
-            if (!f) {
-                err = -P9_EPROTO;
-            } else {
-                err = fs->fs_readlink(fs, buf1, sizeof(buf1), f);
-            }
-            if (err)
-                goto error;
-            buf_len = marshall(s, buf, sizeof(buf), "s", buf1);
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
-        }
-        break;
-    case 24: /* getattr */
-        {
-            uint32_t fid;
-            uint64_t mask;
-            FSFile *f;
-            FSStat st;
+static int virtio_fs_init_reply(VIRTIOFSDevice *s, const uint8_t *arg,
+                                int arg_len, uint8_t *out)
+{
+    uint32_t major, minor, max_readahead, flags, want;
+
+    if (arg_len < 16)
+        return -EINVAL;
+    major = get_le32(arg);
+    minor = get_le32(arg + 4);
+    max_readahead = get_le32(arg + 8);
+    flags = get_le32(arg + 12);
+    if (major < FUSE_KERNEL_VERSION)
+        return -EPROTO;
+    /* a new session */
+    virtio_fs_clear(s);
+    memset(out, 0, FUSE_INIT_OUT_SIZE);
+    put_le32(out, FUSE_KERNEL_VERSION);
+    if (major > FUSE_KERNEL_VERSION) {
+        /* the guest retries with our major version */
+        return 8;
+    }
+    s->minor = min_int(minor, FUSE_KERNEL_MINOR_VERSION);
+    want = FUSE_ASYNC_READ | FUSE_ATOMIC_O_TRUNC | FUSE_BIG_WRITES |
+        FUSE_AUTO_INVAL_DATA | FUSE_DO_READDIRPLUS | FUSE_READDIRPLUS_AUTO |
+        FUSE_PARALLEL_DIROPS | FUSE_MAX_PAGES;
+    if (s->cache_mode != VIRTIO_FS_CACHE_NONE)
+        want |= FUSE_CACHE_SYMLINKS;
+    put_le32(out + 4, s->minor);
+    put_le32(out + 8, max_readahead);
+    put_le32(out + 12, flags & want);
+    put_le16(out + 16, 64); /* max_background */
+    put_le16(out + 18, 48); /* congestion_threshold */
+    put_le32(out + 20, s->max_write);
+    put_le32(out + 24, 1); /* time_gran in ns */
+    put_le16(out + 28, s->max_write / 4096); /* max_pages */
+    return FUSE_INIT_OUT_SIZE;
+}
 
-            if (unmarshall(s, queue_idx, desc_idx, &offset,
-                           "wd", &fid, &mask))
-                goto protocol_error;
-            f = fid_find(s, fid);
-            if (!f)
-                goto fid_not_found;
-            err = fs->fs_stat(fs, f, &st);
-            if (err)
-                goto error;
+static uint32_t virtio_fs_setattr_mask(uint32_t valid)
+{
+    uint32_t mask = 0;
+
+    if (valid & FATTR_MODE)
+        mask |= P9_SETATTR_MODE;
+    if (valid & FATTR_UID)
+        mask |= P9_SETATTR_UID;
+    if (valid & FATTR_GID)
+        mask |= P9_SETATTR_GID;
+    if (valid & FATTR_SIZE)
+        mask |= P9_SETATTR_SIZE;
+    /* without _SET, the time is the current time */
+    if (valid & FATTR_ATIME) {
+        mask |= P9_SETATTR_ATIME;
+        if (!(valid & FATTR_ATIME_NOW))
+            mask |= P9_SETATTR_ATIME_SET;
+    }
+    if (valid & FATTR_MTIME) {
+        mask |= P9_SETATTR_MTIME;
+        if (!(valid & FATTR_MTIME_NOW))
+            mask |= P9_SETATTR_MTIME_SET;
+    }
+    if (valid & FATTR_CTIME)
+        mask |= P9_SETATTR_CTIME;
+    return mask;
+}
 
-            buf_len = marshall(s, buf, sizeof(buf),
-                               "dQwwwddddddddddddddd", 
-                               mask, &st.qid,
-                               st.st_mode, st.st_uid, st.st_gid,
-                               st.st_nlink, st.st_rdev, st.st_size,
-                               st.st_blksize, st.st_blocks,
-                               st.st_atime_sec, (uint64_t)st.st_atime_nsec,
-                               st.st_mtime_sec, (uint64_t)st.st_mtime_nsec,
-                               st.st_ctime_sec, (uint64_t)st.st_ctime_nsec,
-                               (uint64_t)0, (uint64_t)0,
-                               (uint64_t)0, (uint64_t)0);
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
-        }
-        break;
-    case 26: /* setattr */
+/* execute a request and send its reply */
+static void virtio_fs_handle_request(VIRTIOFSDevice *s, int queue_idx,
+                                     int desc_idx, int read_size,
+                                     int write_size)
+{
+    FSDevice *fs = s->fs;
+    uint8_t in[VIRTIO_FS_MAX_IN];
+    uint8_t out[FUSE_ENTRY_OUT_SIZE + FUSE_OPEN_OUT_SIZE];
+    const uint8_t *arg;
+    const char *name, *name1;
+    VIRTIOFSNode *node, *n;
+    FSFile *f;
+    FSQID qid;
+    FSStat st;
+    uint64_t unique, nodeid;
+    uint32_t opcode, gid;
+    int in_len, arg_len, pos, err, len;
+
+    in_len = min_int(read_size, sizeof(in));
+    if (in_len < FUSE_IN_HEADER_SIZE ||
+        memcpy_from_queue(s, in, queue_idx, desc_idx, 0, in_len) < 0) {
+        virtio_consume_desc(s, queue_idx, desc_idx, 0);
+        return;
+    }
+    opcode = get_le32(in + 4);
+    unique = get_le64(in + 8);
+    nodeid = get_le64(in + 16);
+    gid = get_le32(in + 28);
+    arg = in + FUSE_IN_HEADER_SIZE;
+    arg_len = in_len - FUSE_IN_HEADER_SIZE;
+    virtio_trace(s, VTRACE_EV_SUBMIT, queue_idx, desc_idx, opcode, read_size);
+
+    /* the requests without reply */
+    switch(opcode) {
+    case FUSE_FORGET:
+        if (arg_len >= 8)
+            virtio_fs_forget(s, nodeid, get_le64(arg));
+        goto no_reply;
+    case FUSE_BATCH_FORGET:
         {
-            uint32_t fid, mask, mode, uid, gid;
-            uint64_t size, atime_sec, atime_nsec, mtime_sec, mtime_nsec;
-            FSFile *f;
-
-            if (unmarshall(s, queue_idx, desc_idx, &offset,
-                           "wwwwwddddd", &fid, &mask, &mode, &uid, &gid,
-                           &size, &atime_sec, &atime_nsec, 
-                           &mtime_sec, &mtime_nsec))
-                goto protocol_error;
-            f = fid_find(s, fid);
-            if (!f)
-                goto fid_not_found;
-            err = fs->fs_setattr(fs, f, mask, mode, uid, gid, size, atime_sec,
-                                 atime_nsec, mtime_sec, mtime_nsec);
-            if (err)
-                goto error;
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, NULL, 0);
+            uint32_t i, count;
+
+            if (arg_len < 8)
+                goto no_reply;
+            count = get_le32(arg);
+            if (count > (uint32_t)(arg_len - 8) / 16)
+                count = (arg_len - 8) / 16;
+            for(i = 0; i < count; i++)
+                virtio_fs_forget(s, get_le64(arg + 8 + i * 16),
+                                 get_le64(arg + 16 + i * 16));
         }
-        break;
-    case 30: /* xattrwalk */
-        {
-            /* not supported yet */
-            err = -P9_ENOTSUP;
+        goto no_reply;
+    case FUSE_INTERRUPT:
+        /* the requests are executed synchronously */
+        goto no_reply;
+    case FUSE_INIT:
+        len = virtio_fs_init_reply(s, arg, arg_len, out);
+        if (len < 0) {
+            err = len;
             goto error;
         }
+        virtio_fs_reply(s, queue_idx, desc_idx, unique, 0, out, len);
+        return;
+    default:
         break;
-    case 40: /* readdir */
-        {
-            uint32_t fid, count;
-            uint64_t offs;
-            uint8_t *buf;
-            int n;
-            FSFile *f;
-
-            if (unmarshall(s, queue_idx, desc_idx, &offset,
-                           "wdw", &fid, &offs, &count))
-                goto protocol_error;
-            f = fid_find(s, fid);
-            if (!f)
-                goto fid_not_found;
-            buf = (uint8_t*)malloc(count + 4);
-            n = fs->fs_readdir(fs, f, offs, buf + 4, count);
-            if (n < 0) {
-                err = n;
+    }
+    if (s->minor == 0) {
+        err = -EIO;
+        goto error;
+    }
+    node = virtio_fs_node_find(s, nodeid);
+    if (!node && opcode != FUSE_STATFS && opcode != FUSE_DESTROY) {
+        err = -ESTALE;
+        goto error;
+    }
+    pos = 0;
+    switch(opcode) {
+    case FUSE_LOOKUP:
+        name = virtio_fs_get_name(arg, arg_len, &pos);
+        if (!name)
+            goto inval;
+        n = virtio_fs_lookup(s, node, name, &st, &err);
+        if (!n) {
+            if (err != -P9_ENOENT || s->timeout_ms == 0)
                 goto error;
-            }
-            put_le32(buf, n);
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, n + 4);
-            free(buf);
-        }
-        break;
-    case 50: /* fsync */
-        {
-            uint32_t fid;
-            if (unmarshall(s, queue_idx, desc_idx, &offset,
-                           "w", &fid))
-                goto protocol_error;
-            /* ignored */
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, NULL, 0);
+            virtio_fs_put_entry(s, out, 0, NULL);
+        } else {
+            virtio_fs_put_entry(s, out, n->nodeid, &st);
         }
+        virtio_fs_reply(s, queue_idx, desc_idx, unique, 0, out,
+                        FUSE_ENTRY_OUT_SIZE);
         break;
-    case 52: /* lock */
+    case FUSE_GETATTR:
+        f = NULL;
+        if (arg_len >= 16 && (get_le32(arg) & FUSE_GETATTR_FH))
+            f = virtio_fs_fh_find(s, get_le64(arg + 8));
+        if (!f)
+            f = virtio_fs_node_file(s, node);
+        goto reply_attr;
+    case FUSE_SETATTR:
         {
-            uint32_t fid;
-            FSFile *f;
-            FSLock lock;
-            
-            if (unmarshall(s, queue_idx, desc_idx, &offset,
-                           "wbwddws", &fid, &lock.type, &lock.flags,
-                           &lock.start, &lock.length,
-                           &lock.proc_id, &lock.client_id))
-                goto protocol_error;
-            f = fid_find(s, fid);
+            uint32_t valid;
+
+            if (arg_len < 88)
+                goto inval;
+            valid = get_le32(arg);
+            f = NULL;
+            if (valid & FATTR_FH)
+                f = virtio_fs_fh_find(s, get_le64(arg + 8));
             if (!f)
-                err = -P9_EPROTO;
-            else
-                err = fs->fs_lock(fs, f, &lock);
-            free(lock.client_id);
+                f = virtio_fs_node_file(s, node);
+            err = fs->fs_setattr(fs, f, virtio_fs_setattr_mask(valid),
+                                 get_le32(arg + 68), get_le32(arg + 76),
+                                 get_le32(arg + 80), get_le64(arg + 16),
+                                 get_le64(arg + 32), get_le32(arg + 56),
+                                 get_le64(arg + 40), get_le32(arg + 60));
             if (err < 0)
                 goto error;
-            buf_len = marshall(s, buf, sizeof(buf), "b", err);
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
         }
+    reply_attr:
+        err = fs->fs_stat(fs, f, &st);
+        if (err < 0)
+            goto error;
+        memset(out, 0, FUSE_ATTR_OUT_SIZE);
+        virtio_fs_put_timeout(s, out, out + 8);
+        virtio_fs_put_attr(out + 16, &st);
+        virtio_fs_reply(s, queue_idx, desc_idx, unique, 0, out,
+                        FUSE_ATTR_OUT_SIZE);
         break;
-    case 54: /* getlock */
+    case FUSE_READLINK:
         {
-            uint32_t fid;
-            FSFile *f;
-            FSLock lock;
-            
-            if (unmarshall(s, queue_idx, desc_idx, &offset,
-                           "wbddws", &fid, &lock.type,
-                           &lock.start, &lock.length,
-                           &lock.proc_id, &lock.client_id))
-                goto protocol_error;
-            f = fid_find(s, fid);
-            if (!f)
-                err = -P9_EPROTO;
-            else
-                err = fs->fs_getlock(fs, f, &lock);
-            if (err < 0) {
-                free(lock.client_id);
+            char buf[4096];
+
+            err = fs->fs_readlink(fs, buf, sizeof(buf),
+                                  virtio_fs_node_file(s, node));
+            if (err < 0)
                 goto error;
-            }
-            buf_len = marshall(s, buf, sizeof(buf), "bddws",
-                               &lock.type,
-                               &lock.start, &lock.length,
-                               &lock.proc_id, &lock.client_id);
-            free(lock.client_id);
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
+            virtio_fs_reply(s, queue_idx, desc_idx, unique, 0, buf,
+                            strlen(buf));
         }
         break;
-    case 70: /* link */
+    case FUSE_SYMLINK:
+        name = virtio_fs_get_name(arg, arg_len, &pos);
+        name1 = virtio_fs_get_name(arg, arg_len, &pos);
+        if (!name || !name1)
+            goto inval;
+        err = fs->fs_symlink(fs, &qid, virtio_fs_node_file(s, node),
+                             name, name1, gid);
+        goto reply_new_entry;
+    case FUSE_MKNOD:
         {
-            uint32_t dfid, fid;
-            char *name;
-            FSFile *f, *df;
-
-            if (unmarshall(s, queue_idx, desc_idx, &offset,
-                           "wws", &dfid, &fid, &name))
-                goto protocol_error;
-            df = fid_find(s, dfid);
-            f = fid_find(s, fid);
-            if (!df || !f) {
-                err = -P9_EPROTO;
-            } else {
-                err = fs->fs_link(fs, df, f, name);
-            }
-            free(name);
-            if (err)
-                goto error;
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, NULL, 0);
+            uint32_t rdev;
+
+            if (arg_len < 16)
+                goto inval;
+            pos = 16;
+            name = virtio_fs_get_name(arg, arg_len, &pos);
+            if (!name)
+                goto inval;
+            /* new_encode_dev() of the guest */
+            rdev = get_le32(arg + 4);
+            err = fs->fs_mknod(fs, &qid, virtio_fs_node_file(s, node), name,
+                               get_le32(arg), (rdev & 0xfff00) >> 8,
+                               (rdev & 0xff) | ((rdev >> 12) & 0xfff00), gid);
         }
+        goto reply_new_entry;
+    case FUSE_MKDIR:
+        if (arg_len < 8)
+            goto inval;
+        pos = 8;
+        name = virtio_fs_get_name(arg, arg_len, &pos);
+        if (!name)
+            goto inval;
+        err = fs->fs_mkdir(fs, &qid, virtio_fs_node_file(s, node), name,
+                           get_le32(arg), gid);
+    reply_new_entry:
+        if (err < 0)
+            goto error;
+        n = virtio_fs_lookup(s, node, name, &st, &err);
+        if (!n)
+            goto error;
+        virtio_fs_put_entry(s, out, n->nodeid, &st);
+        virtio_fs_reply(s, queue_idx, desc_idx, unique, 0, out,
+                        FUSE_ENTRY_OUT_SIZE);
         break;
-    case 72: /* mkdir */
+    case FUSE_LINK:
+        if (arg_len < 8)
+            goto inval;
+        pos = 8;
+        name = virtio_fs_get_name(arg, arg_len, &pos);
+        n = virtio_fs_node_find(s, get_le64(arg));
+        if (!name || !n)
+            goto inval;
+        err = fs->fs_link(fs, virtio_fs_node_file(s, node),
+                          virtio_fs_node_file(s, n), name);
+        goto reply_new_entry;
+    case FUSE_UNLINK:
+    case FUSE_RMDIR:
+        name = virtio_fs_get_name(arg, arg_len, &pos);
+        if (!name)
+            goto inval;
+        err = fs->fs_unlinkat(fs, virtio_fs_node_file(s, node), name);
+        if (err < 0)
+            goto error;
+        virtio_fs_reply(s, queue_idx, desc_idx, unique, 0, NULL, 0);
+        break;
+    case FUSE_RENAME:
+    case FUSE_RENAME2:
         {
-            uint32_t fid, mode, gid;
-            char *name;
-            FSFile *f;
-            FSQID qid;
-
-            if (unmarshall(s, queue_idx, desc_idx, &offset,
-                           "wsww", &fid, &name, &mode, &gid))
-                goto protocol_error;
-            f = fid_find(s, fid);
-            if (!f)
-                goto fid_not_found;
-            err = fs->fs_mkdir(fs, &qid, f, name, mode, gid);
-            if (err != 0)
+            char *names[1];
+
+            pos = (opcode == FUSE_RENAME2) ? 16 : 8;
+            if (arg_len < pos)
+                goto inval;
+            /* RENAME_NOREPLACE and RENAME_EXCHANGE are not supported */
+            if (opcode == FUSE_RENAME2 && get_le32(arg + 8) != 0)
+                goto inval;
+            n = virtio_fs_node_find(s, get_le64(arg));
+            name = virtio_fs_get_name(arg, arg_len, &pos);
+            name1 = virtio_fs_get_name(arg, arg_len, &pos);
+            if (!n || !name || !name1)
+                goto inval;
+            err = fs->fs_renameat(fs, virtio_fs_node_file(s, node), name,
+                                  virtio_fs_node_file(s, n), name1);
+            if (err < 0)
                 goto error;
-            buf_len = marshall(s, buf, sizeof(buf), "Q", &qid);
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
+            /* rename the node of the entry if the guest knows it */
+            names[0] = (char *)name1;
+            if (fs->fs_walk(fs, &f, &qid, virtio_fs_node_file(s, n), 1,
+                            names) == 1 &&
+                virtio_fs_node_find_ino(s, qid.path)) {
+                if (qid.type & P9_QTDIR)
+                    s->rename_gen++;
+                virtio_fs_node_get(s, qid.path, n, name1, f);
+            } else {
+                fs->fs_delete(fs, f);
+            }
+            virtio_fs_reply(s, queue_idx, desc_idx, unique, 0, NULL, 0);
         }
         break;
-    case 74: /* renameat */
+    case FUSE_OPEN:
+    case FUSE_OPENDIR:
+        if (arg_len < 8)
+            goto inval;
+        f = fs_dup(fs, virtio_fs_node_file(s, node));
+        err = fs->fs_open(fs, &qid, f,
+                          opcode == FUSE_OPEN ? get_le32(arg) : P9_O_RDONLY,
+                          NULL, NULL);
+        if (err != 0) {
+            fs->fs_delete(fs, f);
+            if (err > 0)
+                err = -EIO;
+            goto error;
+        }
+        virtio_fs_put_open(s, out, virtio_fs_fh_alloc(s, f),
+                           opcode == FUSE_OPENDIR);
+        virtio_fs_reply(s, queue_idx, desc_idx, unique, 0, out,
+                        FUSE_OPEN_OUT_SIZE);
+        break;
+    case FUSE_CREATE:
+        if (arg_len < 16)
+            goto inval;
+        pos = 16;
+        name = virtio_fs_get_name(arg, arg_len, &pos);
+        if (!name)
+            goto inval;
+        f = fs_dup(fs, virtio_fs_node_file(s, node));
+        err = fs->fs_create(fs, &qid, f, name, get_le32(arg), get_le32(arg + 4),
+                            gid);
+        if (err == 0) {
+            n = virtio_fs_lookup(s, node, name, &st, &err);
+            if (n) {
+                virtio_fs_put_entry(s, out, n->nodeid, &st);
+                virtio_fs_put_open(s, out + FUSE_ENTRY_OUT_SIZE,
+                                   virtio_fs_fh_alloc(s, f), FALSE);
+                virtio_fs_reply(s, queue_idx, desc_idx, unique, 0, out,
+                                FUSE_ENTRY_OUT_SIZE + FUSE_OPEN_OUT_SIZE);
+                break;
+            }
+        }
+        fs->fs_delete(fs, f);
+        goto error;
+    case FUSE_READ:
         {
-            uint32_t fid, new_fid;
-            char *name, *new_name;
-            FSFile *f, *new_f;
+            struct iovec host_iov[VIRTIO_FS_MAX_HOST_IOV];
+            uint32_t size;
+            uint64_t offset;
+            uint8_t *buf;
+            int n1, iovcnt;
 
-            if (unmarshall(s, queue_idx, desc_idx, &offset,
-                           "wsws", &fid, &name, &new_fid, &new_name))
-                goto protocol_error;
-            f = fid_find(s, fid);
-            new_f = fid_find(s, new_fid);
-            if (!f || !new_f) {
-                err = -P9_EPROTO;
-            } else {
-                err = fs->fs_renameat(fs, f, name, new_f, new_name);
+            if (arg_len < FUSE_READ_IN_SIZE)
+                goto inval;
+            f = virtio_fs_fh_find(s, get_le64(arg));
+            if (!f)
+                goto badf;
+            offset = get_le64(arg + 8);
+            /* the size is given by the guest */
+            size = get_le32(arg + 16);
+            if (size > (uint32_t)max_int(write_size - FUSE_OUT_HEADER_SIZE, 0))
+                size = max_int(write_size - FUSE_OUT_HEADER_SIZE, 0);
+            iovcnt = -1;
+            if (fs->fs_readv && size > 0)
+                iovcnt = virtio_queue_get_host_iov(s, queue_idx, desc_idx,
+                                                   FUSE_OUT_HEADER_SIZE, size,
+                                                   TRUE, host_iov,
+                                                   VIRTIO_FS_MAX_HOST_IOV);
+            if (iovcnt > 0) {
+                n1 = fs->fs_readv(fs, f, offset, host_iov, iovcnt);
+                virtio_fs_reply_hdr(s, queue_idx, desc_idx, unique,
+                                    min_int(n1, 0), n1);
+                break;
             }
-            free(name);
-            free(new_name);
-            if (err != 0)
-                goto error;
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, NULL, 0);
+            buf = (uint8_t *)malloc(size);
+            if (!buf && size > 0)
+                goto nomem;
+            n1 = fs->fs_read(fs, f, offset, buf, size);
+            virtio_fs_reply(s, queue_idx, desc_idx, unique, min_int(n1, 0),
+                            buf, n1);
+            free(buf);
         }
         break;
-    case 76: /* unlinkat */
+    case FUSE_WRITE:
         {
-            uint32_t fid, flags;
-            char *name;
-            FSFile *f;
+            struct iovec host_iov[VIRTIO_FS_MAX_HOST_IOV];
+            uint32_t size;
+            uint64_t offset;
+            uint8_t *buf;
+            int n1, iovcnt, data_pos;
 
-            if (unmarshall(s, queue_idx, desc_idx, &offset,
-                           "wsw", &fid, &name, &flags))
-                goto protocol_error;
-            f = fid_find(s, fid);
-            if (!f) {
-                err = -P9_EPROTO;
+            if (arg_len < FUSE_WRITE_IN_SIZE)
+                goto inval;
+            f = virtio_fs_fh_find(s, get_le64(arg));
+            if (!f)
+                goto badf;
+            offset = get_le64(arg + 8);
+            size = get_le32(arg + 16);
+            data_pos = FUSE_IN_HEADER_SIZE + FUSE_WRITE_IN_SIZE;
+            if (size > s->max_write || data_pos + size > (uint32_t)read_size)
+                goto inval;
+            iovcnt = -1;
+            if (fs->fs_writev && size > 0)
+                iovcnt = virtio_queue_get_host_iov(s, queue_idx, desc_idx,
+                                                   data_pos, size, FALSE,
+                                                   host_iov,
+                                                   VIRTIO_FS_MAX_HOST_IOV);
+            if (iovcnt > 0) {
+                n1 = fs->fs_writev(fs, f, offset, host_iov, iovcnt);
             } else {
-                err = fs->fs_unlinkat(fs, f, name);
+                buf = (uint8_t *)malloc(size);
+                memcpy_from_queue(s, buf, queue_idx, desc_idx, data_pos, size);
+                n1 = fs->fs_write(fs, f, offset, buf, size);
+                free(buf);
             }
-            free(name);
-            if (err != 0)
+            if (n1 < 0) {
+                err = n1;
                 goto error;
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, NULL, 0);
+            }
+            put_le32(out, n1);
+            put_le32(out + 4, 0);
+            virtio_fs_reply(s, queue_idx, desc_idx, unique, 0, out, 8);
         }
         break;
-    case 100: /* version */
+    case FUSE_STATFS:
         {
-            uint32_t msize;
-            char *version;
-            if (unmarshall(s, queue_idx, desc_idx, &offset, 
-                           "ws", &msize, &version))
-                goto protocol_error;
-            if (msize > MAX_9P_MSIZE)
-                msize = MAX_9P_MSIZE;
-            s->msize = msize;
-            //            printf("version: msize=%d version=%s\n", msize, version);
-            free(version);
-            buf_len = marshall(s, buf, sizeof(buf), "ws", s->msize, "9P2000.L");
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
+            FSStatFS stf;
+
+            fs->fs_statfs(fs, &stf);
+            memset(out, 0, FUSE_KSTATFS_SIZE);
+            put_le64(out, stf.f_blocks);
+            put_le64(out + 8, stf.f_bfree);
+            put_le64(out + 16, stf.f_bavail);
+            put_le64(out + 24, stf.f_files);
+            put_le64(out + 32, stf.f_ffree);
+            put_le32(out + 40, stf.f_bsize);
+            put_le32(out + 44, 255); /* namelen */
+            put_le32(out + 48, stf.f_bsize); /* frsize */
+            virtio_fs_reply(s, queue_idx, desc_idx, unique, 0, out,
+                            FUSE_KSTATFS_SIZE);
         }
         break;
-    case 104: /* attach */
+    case FUSE_RELEASE:
+    case FUSE_RELEASEDIR:
+        if (arg_len < 8)
+            goto inval;
+        virtio_fs_fh_free(s, get_le64(arg));
+        virtio_fs_reply(s, queue_idx, desc_idx, unique, 0, NULL, 0);
+        break;
+    case FUSE_FLUSH:
+    case FUSE_FSYNC:
+    case FUSE_FSYNCDIR:
+        if (arg_len < 8)
+            goto inval;
+        f = virtio_fs_fh_find(s, get_le64(arg));
+        if (!f)
+            goto badf;
+        /* only the data buffered by the backend is written */
+        err = 0;
+        if (fs->fs_fsync && opcode != FUSE_FSYNCDIR)
+            err = fs->fs_fsync(fs, f);
+        if (err < 0)
+            goto error;
+        virtio_fs_reply(s, queue_idx, desc_idx, unique, 0, NULL, 0);
+        break;
+    case FUSE_READDIR:
+    case FUSE_READDIRPLUS:
         {
-            uint32_t fid, afid, uid;
-            char *uname, *aname;
-            FSQID qid;
-            FSFile *f;
-            
-            if (unmarshall(s, queue_idx, desc_idx, &offset, 
-                           "wwssw", &fid, &afid, &uname, &aname, &uid))
-                goto protocol_error;
-            err = fs->fs_attach(fs, &f, &qid, uid, uname, aname);
-            if (err != 0)
-                goto error;
-            fid_set(s, fid, f);
-            free(uname);
-            free(aname);
-            buf_len = marshall(s, buf, sizeof(buf), "Q", &qid);
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
+            uint32_t size;
+            uint8_t *buf;
+
+            if (arg_len < FUSE_READ_IN_SIZE)
+                goto inval;
+            f = virtio_fs_fh_find(s, get_le64(arg));
+            if (!f)
+                goto badf;
+            size = get_le32(arg + 16);
+            if (size > (uint32_t)max_int(write_size - FUSE_OUT_HEADER_SIZE, 0))
+                size = max_int(write_size - FUSE_OUT_HEADER_SIZE, 0);
+            buf = (uint8_t *)malloc(size);
+            if (!buf && size > 0)
+                goto nomem;
+            len = virtio_fs_readdir(s, node, f, get_le64(arg + 8), size,
+                                    opcode == FUSE_READDIRPLUS, buf);
+            virtio_fs_reply(s, queue_idx, desc_idx, unique, min_int(len, 0),
+                            buf, len);
+            free(buf);
         }
         break;
-    case 108: /* flush */
-        {
-            uint16_t oldtag;
-            if (unmarshall(s, queue_idx, desc_idx, &offset, 
-                           "h", &oldtag))
-                goto protocol_error;
-            /* ignored */
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, NULL, 0);
+    case FUSE_DESTROY:
+        virtio_fs_clear(s);
+        virtio_fs_reply(s, queue_idx, desc_idx, unique, 0, NULL, 0);
+        break;
+    default:
+        /* the guest then stops using the operation (xattrs, access,
+           locks, fallocate, lseek, DAX mappings...) */
+        err = -ENOSYS;
+        goto error;
+    }
+    return;
+ inval:
+    err = -EINVAL;
+    goto error;
+ nomem:
+    err = -ENOMEM;
+    goto error;
+ badf:
+    err = -EBADF;
+ error:
+    virtio_fs_reply_hdr(s, queue_idx, desc_idx, unique, err, 0);
+    return;
+ no_reply:
+    virtio_trace(s, VTRACE_EV_COMPLETE, queue_idx, desc_idx, 0, 0);
+    virtio_consume_desc(s, queue_idx, desc_idx, 0);
+}
+
+static int virtio_fs_recv_request(VIRTIODevice *s1, int queue_idx,
+                                  int desc_idx, int read_size,
+                                  int write_size)
+{
+    VIRTIOFSDevice *s = (VIRTIOFSDevice *)s1;
+
+    virtio_fs_handle_request(s, queue_idx, desc_idx, read_size, write_size);
+    return 0;
+}
+
+/* let the filesystem write its buffers. Must be called periodically
+   from the simulator thread. */
+void virtio_fs_poll(VIRTIODevice *s1)
+{
+    VIRTIOFSDevice *s = (VIRTIOFSDevice *)s1;
+
+    if (s->fs->fs_poll)
+        s->fs->fs_poll(s->fs);
+}
+
+static void virtio_fs_reset(VIRTIODevice *s1)
+{
+    VIRTIOFSDevice *s = (VIRTIOFSDevice *)s1;
+
+    if (s->root)
+        virtio_fs_clear(s);
+}
+
+static int virtio_fs_put_path(VIRTIOFSDevice *s, device_state_writer_t *w,
+                              FSFile *f, int *popen_flags)
+{
+    char path[4096];
+    uint32_t uid;
+
+    if (s->fs->fs_get_file_info(s->fs, f, path, sizeof(path), &uid,
+                                popen_flags) < 0)
+        return -1;
+    w->put_string(path);
+    return 0;
+}
+
+/* The nodes and the opened files are saved by path and walked again
+   on restore, as the 9p fids. */
+static int virtio_fs_save(VIRTIODevice *s1, device_state_writer_t *w)
+{
+    VIRTIOFSDevice *s = (VIRTIOFSDevice *)s1;
+    FSDevice *fs = s->fs;
+    VIRTIOFSNode *n;
+    int i, flags;
+
+    if ((s->nb_nodes > 1 || s->nb_handles > 0) && !fs->fs_get_file_info)
+        return -1;
+    w->put_u32(s->minor);
+    w->put_u64(s->next_nodeid);
+    w->put_u32(s->nb_nodes - 1);
+    for(i = 0; i < 1 << s->node_hash_bits; i++) {
+        for(n = s->id_hash[i]; n; n = n->id_next) {
+            if (n == s->root)
+                continue;
+            w->put_u64(n->nodeid);
+            w->put_u64(n->nlookup);
+            w->put_u64(n->parent->nodeid);
+            w->put_string(n->name);
+            if (virtio_fs_put_path(s, w, virtio_fs_node_file(s, n),
+                                   &flags) < 0)
+                return -1;
+        }
+    }
+    w->put_u32(s->nb_handles);
+    for(i = 0; i < s->nb_handles; i++) {
+        if (!s->handles[i]) {
+            w->put_u32(-1);
+            continue;
+        }
+        w->put_u32(0);
+        if (virtio_fs_put_path(s, w, s->handles[i], &flags) < 0)
+            return -1;
+        /* the restored device reads the data from the host files */
+        if (fs->fs_fsync)
+            fs->fs_fsync(fs, s->handles[i]);
+        w->put_u32(flags);
+    }
+    return 0;
+}
+
+static FSFile *virtio_fs_walk_path(VIRTIOFSDevice *s, const std::string& path)
+{
+    if (path.empty())
+        return fs_dup(s->fs, s->root->file);
+    return fs_walk_path(s->fs, s->root->file, path.c_str());
+}
+
+static int virtio_fs_load(VIRTIODevice *s1, device_state_reader_t *r)
+{
+    VIRTIOFSDevice *s = (VIRTIOFSDevice *)s1;
+    FSDevice *fs = s->fs;
+    VIRTIOFSNode *n;
+    std::vector<std::pair<VIRTIOFSNode *, uint64_t> > nodes;
+    std::string path;
+    FSFile *f;
+    FSQID qid;
+    FSStat st;
+    uint32_t i, nb_nodes, nb_handles;
+    int flags;
+
+    virtio_fs_clear(s);
+    s->minor = r->get_u32();
+    s->next_nodeid = r->get_u64();
+    nb_nodes = r->get_u32();
+    for(i = 0; i < nb_nodes && r->ok(); i++) {
+        n = (VIRTIOFSNode *)mallocz(sizeof(*n));
+        n->nodeid = r->get_u64();
+        n->nlookup = r->get_u64();
+        nodes.push_back(std::make_pair(n, r->get_u64()));
+        n->name = strdup(r->get_string().c_str());
+        path = r->get_string();
+        n->file = virtio_fs_walk_path(s, path);
+        if (!r->ok() || !n->file || fs->fs_stat(fs, n->file, &st) < 0) {
+            fprintf(stderr, "virtio-fs: cannot find '%s'\n", path.c_str());
+            /* virtio_fs_clear() frees the nodes already in the tables */
+            if (n->file)
+                fs->fs_delete(fs, n->file);
+            free(n->name);
+            free(n);
+            return -1;
+        }
+        n->ino = st.qid.path;
+        n->rename_gen = s->rename_gen;
+        if (s->nb_nodes >= 1 << s->node_hash_bits)
+            virtio_fs_node_hash_resize(s, s->node_hash_bits + 1);
+        virtio_fs_node_hash_add(s, n);
+        s->nb_nodes++;
+    }
+    /* the parents may be saved after their children */
+    for(i = 0; i < nodes.size(); i++) {
+        n = virtio_fs_node_find(s, nodes[i].second);
+        if (!n)
+            return -1;
+        nodes[i].first->parent = n;
+        n->nb_children++;
+    }
+
+    nb_handles = r->get_u32();
+    for(i = 0; i < nb_handles && r->ok(); i++) {
+        if ((int)r->get_u32() < 0)
+            continue;
+        path = r->get_string();
+        flags = r->get_u32();
+        f = virtio_fs_walk_path(s, path);
+        if (f && flags >= 0 &&
+            fs->fs_open(fs, &qid, f, flags, NULL, NULL) != 0) {
+            fs->fs_delete(fs, f);
+            f = NULL;
+        }
+        if (!f) {
+            fprintf(stderr, "virtio-fs: cannot reopen '%s'\n", path.c_str());
+            return -1;
+        }
+        virtio_fs_fh_set(s, i, f);
+    }
+    return r->ok() ? 0 : -1;
+}
+
+VIRTIODevice *virtio_fs_init(VIRTIOBusDef *bus, FSDevice *fs, const char *tag,
+                             int num_request_queues, uint32_t max_write,
+                             int cache_mode, int timeout_ms,
+                             const simif_t* sim)
+{
+    VIRTIOFSDevice *s;
+    FSFile *f;
+    FSQID qid;
+
+    s = (VIRTIOFSDevice *)mallocz(sizeof(*s));
+    virtio_init(s, bus, 26, VIRTIO_FS_CONFIG_SIZE, virtio_fs_recv_request,
+                sim);
+    s->num_request_queues = min_int(max_int(num_request_queues, 1),
+                                    VIRTIO_FS_MAX_REQUEST_QUEUES);
+    strncpy((char *)s->config_space + VIRTIO_FS_CONFIG_TAG, tag,
+            VIRTIO_FS_TAG_SIZE);
+    put_le32(s->config_space + VIRTIO_FS_CONFIG_NUM_QUEUES,
+             s->num_request_queues);
+    s->device_reset = virtio_fs_reset;
+    s->device_save = virtio_fs_save;
+    s->device_load = virtio_fs_load;
+    s->fs = fs;
+    s->max_write = min_int(max_int(max_write, 4096), VIRTIO_FS_MAX_WRITE) &
+        ~4095;
+    s->cache_mode = cache_mode;
+    s->timeout_ms = cache_mode == VIRTIO_FS_CACHE_NONE ? 0 : timeout_ms;
+
+    if (fs->fs_attach(fs, &f, &qid, 0, "", "") < 0)
+        return NULL;
+    s->root = (VIRTIOFSNode *)mallocz(sizeof(*s->root));
+    s->root->nodeid = FUSE_ROOT_ID;
+    s->root->ino = qid.path;
+    s->root->nlookup = 1; /* never forgotten */
+    s->root->file = f;
+    virtio_fs_clear(s);
+    return (VIRTIODevice *)s;
+}
+
+/*********************************************************************/
+/* console device */
+
+#define VIRTIO_CONSOLE_F_SIZE        0
+#define VIRTIO_CONSOLE_F_MULTIPORT   1
+#define VIRTIO_CONSOLE_F_EMERG_WRITE 2
+
+/* configuration space offsets */
+#define VIRTIO_CONSOLE_CONFIG_COLS         0
+#define VIRTIO_CONSOLE_CONFIG_ROWS         2
+#define VIRTIO_CONSOLE_CONFIG_MAX_NR_PORTS 4
+#define VIRTIO_CONSOLE_CONFIG_EMERG_WR     8
+#define VIRTIO_CONSOLE_CONFIG_SIZE        12
+
+/* control messages */
+#define VIRTIO_CONSOLE_DEVICE_READY  0
+#define VIRTIO_CONSOLE_DEVICE_ADD    1
+#define VIRTIO_CONSOLE_DEVICE_REMOVE 2
+#define VIRTIO_CONSOLE_PORT_READY    3
+#define VIRTIO_CONSOLE_CONSOLE_PORT  4
+#define VIRTIO_CONSOLE_RESIZE        5
+#define VIRTIO_CONSOLE_PORT_OPEN     6
+#define VIRTIO_CONSOLE_PORT_NAME     7
+
+/* id (le32), event (le16), value (le16), followed by the name for
+   VIRTIO_CONSOLE_PORT_NAME */
+#define VIRTIO_CONSOLE_CTRL_SIZE 8
+
+/* queues: receive and transmit of port 0, then of the control
+   channel with VIRTIO_CONSOLE_F_MULTIPORT, then of the ports 1... */
+#define VIRTIO_CONSOLE_CTRL_RX 2
+#define VIRTIO_CONSOLE_CTRL_TX 3
+
+#define VIRTIO_CONSOLE_MAX_CTRL 64 /* messages waiting for the driver */
+#define VIRTIO_CONSOLE_TX_BUF_SIZE 65536
+
+typedef struct {
+    uint32_t id;
+    uint16_t event;
+    uint16_t value;
+} VIRTIOConsoleCtrl;
+
+typedef struct {
+    CharacterDevice *cs; /* NULL if the data are dropped */
+    char *name; /* NULL if none */
+    BOOL guest_open; /* opened by a program of the guest */
+    /* buffers of the transmit queue received in the current
+       notification, written to the backend at its end */
+    int nb_tx;
+    int tx_desc[MAX_QUEUE_NUM];
+} VIRTIOConsolePort;
+
+typedef struct VIRTIOConsoleDevice {
+    VIRTIODevice common;
+    int nb_ports;
+    VIRTIOConsolePort ports[VIRTIO_CONSOLE_MAX_PORTS];
+    /* FIFO of the control messages to the driver */
+    VIRTIOConsoleCtrl ctrl[VIRTIO_CONSOLE_MAX_CTRL];
+    int ctrl_head;
+    int ctrl_count;
+    uint8_t *tx_buf; /* copy of the buffers not in host memory */
+} VIRTIOConsoleDevice;
+
+static int virtio_console_rx_queue(int port)
+{
+    return port == 0 ? 0 : 2 * port + 2;
+}
+
+/* port of a data queue */
+static int virtio_console_queue_port(int queue_idx)
+{
+    return queue_idx < 2 ? 0 : (queue_idx - 2) / 2;
+}
+
+static void virtio_console_queue_ctrl(VIRTIOConsoleDevice *s1, uint32_t id,
+                                      int event, int value)
+{
+    VIRTIOConsoleCtrl *c;
+
+    if (s1->ctrl_count >= VIRTIO_CONSOLE_MAX_CTRL)
+        return;
+    c = &s1->ctrl[(s1->ctrl_head + s1->ctrl_count) % VIRTIO_CONSOLE_MAX_CTRL];
+    c->id = id;
+    c->event = event;
+    c->value = value;
+    s1->ctrl_count++;
+}
+
+/* send the queued control messages for which the driver has buffers */
+static void virtio_console_send_ctrl(VIRTIOConsoleDevice *s1)
+{
+    VIRTIODevice *s = &s1->common;
+    QueueState *qs = &s->queue[VIRTIO_CONSOLE_CTRL_RX];
+    uint8_t buf[VIRTIO_CONSOLE_CTRL_SIZE];
+    VIRTIOConsoleCtrl *c;
+    VIRTIOIOVec *iov;
+    const char *name;
+    int desc_idx, ret, len;
+    BOOL sent;
+
+    if (!qs->ready || !virtio_has_feature(s, VIRTIO_CONSOLE_F_MULTIPORT))
+        return;
+    sent = FALSE;
+    qs->batch_used = TRUE;
+    while (s1->ctrl_count > 0) {
+        ret = virtio_queue_peek(s, VIRTIO_CONSOLE_CTRL_RX, &desc_idx);
+        if (ret == 0)
+            break;
+        virtio_queue_advance(s, VIRTIO_CONSOLE_CTRL_RX);
+        if (ret < 0)
+            continue;
+        iov = virtio_get_iov(s, VIRTIO_CONSOLE_CTRL_RX, desc_idx);
+        virtio_trace(s, VTRACE_EV_POP, VIRTIO_CONSOLE_CTRL_RX, desc_idx,
+                     0, iov->write_size);
+        c = &s1->ctrl[s1->ctrl_head];
+        put_le32(buf, c->id);
+        put_le16(buf + 4, c->event);
+        put_le16(buf + 6, c->value);
+        len = min_int(VIRTIO_CONSOLE_CTRL_SIZE, iov->write_size);
+        memcpy_to_queue(s, VIRTIO_CONSOLE_CTRL_RX, desc_idx, 0, buf, len);
+        name = s1->ports[c->id].name;
+        if (c->event == VIRTIO_CONSOLE_PORT_NAME && name &&
+            len == VIRTIO_CONSOLE_CTRL_SIZE) {
+            /* the name is not null terminated */
+            ret = min_int(strlen(name), iov->write_size - len);
+            memcpy_to_queue(s, VIRTIO_CONSOLE_CTRL_RX, desc_idx, len,
+                            name, ret);
+            len += ret;
+        }
+        virtio_consume_desc(s, VIRTIO_CONSOLE_CTRL_RX, desc_idx, len);
+        s1->ctrl_head = (s1->ctrl_head + 1) % VIRTIO_CONSOLE_MAX_CTRL;
+        s1->ctrl_count--;
+        sent = TRUE;
+    }
+    qs->batch_used = FALSE;
+    if (sent) {
+        virtio_queue_flush_used(s, VIRTIO_CONSOLE_CTRL_RX);
+        virtio_update_avail_event(s, VIRTIO_CONSOLE_CTRL_RX);
+    }
+}
+
+static void virtio_console_ctrl_request(VIRTIOConsoleDevice *s1,
+                                        int desc_idx, int read_size)
+{
+    VIRTIODevice *s = &s1->common;
+    uint8_t buf[VIRTIO_CONSOLE_CTRL_SIZE];
+    uint32_t id;
+    int event, value, i;
+
+    if (read_size < VIRTIO_CONSOLE_CTRL_SIZE ||
+        memcpy_from_queue(s, buf, VIRTIO_CONSOLE_CTRL_TX, desc_idx, 0,
+                          VIRTIO_CONSOLE_CTRL_SIZE) < 0)
+        goto done;
+    id = get_le32(buf);
+    event = get_le16(buf + 4);
+    value = get_le16(buf + 6);
+#ifdef DEBUG_VIRTIO
+    if (s->debug & VIRTIO_DEBUG_IO)
+        printf("console ctrl: id=%d event=%d value=%d\n", id, event, value);
+#endif
+    switch(event) {
+    case VIRTIO_CONSOLE_DEVICE_READY:
+        if (value) {
+            for(i = 0; i < s1->nb_ports; i++)
+                virtio_console_queue_ctrl(s1, i, VIRTIO_CONSOLE_DEVICE_ADD, 0);
         }
         break;
-    case 110: /* walk */
-        {
-            uint32_t fid, newfid;
-            uint16_t nwname;
-            FSQID *qids;
-            char **names;
-            FSFile *f;
-            int i;
+    case VIRTIO_CONSOLE_PORT_READY:
+        if (!value || id >= (uint32_t)s1->nb_ports)
+            break;
+        if (id == 0)
+            virtio_console_queue_ctrl(s1, id, VIRTIO_CONSOLE_CONSOLE_PORT, 1);
+        if (s1->ports[id].name)
+            virtio_console_queue_ctrl(s1, id, VIRTIO_CONSOLE_PORT_NAME, 0);
+        /* the host side of a port is always connected */
+        virtio_console_queue_ctrl(s1, id, VIRTIO_CONSOLE_PORT_OPEN, 1);
+        break;
+    case VIRTIO_CONSOLE_PORT_OPEN:
+        if (id < (uint32_t)s1->nb_ports)
+            s1->ports[id].guest_open = (value != 0);
+        break;
+    default:
+        break;
+    }
+ done:
+    virtio_consume_desc(s, VIRTIO_CONSOLE_CTRL_TX, desc_idx, 0);
+    virtio_console_send_ctrl(s1);
+}
+
+static void virtio_console_notify_end(VIRTIODevice *s, int queue_idx);
+
+static int virtio_console_recv_request(VIRTIODevice *s, int queue_idx,
+                                       int desc_idx, int read_size,
+                                       int write_size)
+{
+    VIRTIOConsoleDevice *s1 = (VIRTIOConsoleDevice *)s;
+    VIRTIOConsolePort *p;
+
+    if (queue_idx == VIRTIO_CONSOLE_CTRL_TX) {
+        virtio_console_ctrl_request(s1, desc_idx, read_size);
+    } else if (queue_idx & 1) {
+        /* a guest may publish the same head several times, so the batch
+           can be full before the end of the notification */
+        p = &s1->ports[virtio_console_queue_port(queue_idx)];
+        if (p->nb_tx == MAX_QUEUE_NUM)
+            virtio_console_notify_end(s, queue_idx);
+        p->tx_desc[p->nb_tx++] = desc_idx;
+    }
+    return 0;
+}
+
+/* write the buffers of the transmit queue received in the notification
+   with as few backend calls as possible */
+static void virtio_console_notify_end(VIRTIODevice *s, int queue_idx)
+{
+    VIRTIOConsoleDevice *s1 = (VIRTIOConsoleDevice *)s;
+    VIRTIOConsolePort *p;
+    struct iovec iov[VIRTIO_CONSOLE_MAX_IOV];
+    VIRTIOIOVec *viov;
+    int i, n, ret, desc_idx, pos, len;
+
+    if (queue_idx == VIRTIO_CONSOLE_CTRL_TX || !(queue_idx & 1))
+        return;
+    p = &s1->ports[virtio_console_queue_port(queue_idx)];
+    n = 0;
+    for(i = 0; i < p->nb_tx; i++) {
+        desc_idx = p->tx_desc[i];
+        viov = virtio_get_iov(s, queue_idx, desc_idx);
+        if (!p->cs || viov->read_size == 0)
+            continue;
+        ret = virtio_queue_get_host_iov(s, queue_idx, desc_idx, 0,
+                                        viov->read_size, FALSE, iov + n,
+                                        VIRTIO_CONSOLE_MAX_IOV - n);
+        if (ret >= 0) {
+            n += ret;
+            continue;
+        }
+        /* the iovec array is full or the buffer is not in host memory */
+        if (n > 0) {
+            p->cs->write_data(p->cs->opaque, iov, n);
+            n = 0;
+        }
+        ret = virtio_queue_get_host_iov(s, queue_idx, desc_idx, 0,
+                                        viov->read_size, FALSE, iov,
+                                        VIRTIO_CONSOLE_MAX_IOV);
+        if (ret >= 0) {
+            n = ret;
+            continue;
+        }
+        /* copied */
+        for(pos = 0; pos < viov->read_size; pos += len) {
+            len = min_int(viov->read_size - pos, VIRTIO_CONSOLE_TX_BUF_SIZE);
+            memcpy_from_queue(s, s1->tx_buf, queue_idx, desc_idx, pos, len);
+            iov[0].iov_base = s1->tx_buf;
+            iov[0].iov_len = len;
+            p->cs->write_data(p->cs->opaque, iov, 1);
+        }
+    }
+    if (n > 0)
+        p->cs->write_data(p->cs->opaque, iov, n);
+    /* published together by virtio_queue_notify() */
+    for(i = 0; i < p->nb_tx; i++)
+        virtio_consume_desc(s, queue_idx, p->tx_desc[i], 0);
+    p->nb_tx = 0;
+}
+
+/* number of bytes the guest can currently receive on the port */
+int virtio_console_get_write_len(VIRTIODevice *s, int port)
+{
+    VIRTIOConsoleDevice *s1 = (VIRTIOConsoleDevice *)s;
+    int queue_idx = virtio_console_rx_queue(port);
+    QueueState *qs = &s->queue[queue_idx];
+    uint16_t last_avail_idx;
+    BOOL avail_wrap_counter;
+    int desc_idx, ret, len, n;
+
+    if (port >= s1->nb_ports || !qs->ready ||
+        (port > 0 && !virtio_has_feature(s, VIRTIO_CONSOLE_F_MULTIPORT)))
+        return 0;
+    last_avail_idx = qs->last_avail_idx;
+    avail_wrap_counter = qs->avail_wrap_counter;
+    len = 0;
+    for(n = 0; n < (int)qs->num; n++) {
+        ret = virtio_queue_peek(s, queue_idx, &desc_idx);
+        if (ret == 0)
+            break;
+        virtio_queue_advance(s, queue_idx);
+        if (ret > 0)
+            len += virtio_get_iov(s, queue_idx, desc_idx)->write_size;
+    }
+    qs->last_avail_idx = last_avail_idx;
+    qs->avail_wrap_counter = avail_wrap_counter;
+    return len;
+}
+
+/* give the data received by the backend to the guest, spread over as
+   many buffers as needed. Return the number of bytes written. */
+int virtio_console_write_data(VIRTIODevice *s, int port, const uint8_t *buf,
+                              int buf_len)
+{
+    int queue_idx = virtio_console_rx_queue(port);
+    QueueState *qs = &s->queue[queue_idx];
+    int desc_idx, ret, pos, len;
+
+    if (virtio_console_get_write_len(s, port) == 0)
+        return 0;
+    qs->batch_used = TRUE;
+    pos = 0;
+    while (pos < buf_len) {
+        ret = virtio_queue_peek(s, queue_idx, &desc_idx);
+        if (ret == 0)
+            break;
+        virtio_queue_advance(s, queue_idx);
+        if (ret < 0)
+            continue;
+        len = min_int(virtio_get_iov(s, queue_idx, desc_idx)->write_size,
+                      buf_len - pos);
+        virtio_trace(s, VTRACE_EV_POP, queue_idx, desc_idx, 0, len);
+        memcpy_to_queue(s, queue_idx, desc_idx, 0, buf + pos, len);
+        virtio_consume_desc(s, queue_idx, desc_idx, len);
+        pos += len;
+    }
+    qs->batch_used = FALSE;
+    virtio_queue_flush_used(s, queue_idx);
+    virtio_update_avail_event(s, queue_idx);
+    return pos;
+}
+
+/* send the pending control messages once the driver has buffers */
+void virtio_console_poll(VIRTIODevice *s)
+{
+    VIRTIOConsoleDevice *s1 = (VIRTIOConsoleDevice *)s;
+
+    if (s1->ctrl_count > 0)
+        virtio_console_send_ctrl(s1);
+}
+
+static void virtio_console_reset(VIRTIODevice *s)
+{
+    VIRTIOConsoleDevice *s1 = (VIRTIOConsoleDevice *)s;
+    int i;
+
+    s1->ctrl_head = 0;
+    s1->ctrl_count = 0;
+    for(i = 0; i < s1->nb_ports; i++) {
+        s1->ports[i].guest_open = FALSE;
+        s1->ports[i].nb_tx = 0;
+    }
+}
+
+static int virtio_console_save(VIRTIODevice *s, device_state_writer_t *w)
+{
+    VIRTIOConsoleDevice *s1 = (VIRTIOConsoleDevice *)s;
+    VIRTIOConsoleCtrl *c;
+    int i;
+
+    w->put_u32(s1->nb_ports);
+    for(i = 0; i < s1->nb_ports; i++)
+        w->put_u8(s1->ports[i].guest_open);
+    w->put_u32(s1->ctrl_count);
+    for(i = 0; i < s1->ctrl_count; i++) {
+        c = &s1->ctrl[(s1->ctrl_head + i) % VIRTIO_CONSOLE_MAX_CTRL];
+        w->put_u32(c->id);
+        w->put_u16(c->event);
+        w->put_u16(c->value);
+    }
+    return 0;
+}
+
+static int virtio_console_load(VIRTIODevice *s, device_state_reader_t *r)
+{
+    VIRTIOConsoleDevice *s1 = (VIRTIOConsoleDevice *)s;
+    VIRTIOConsoleCtrl *c;
+    int i, n;
 
-            if (unmarshall(s, queue_idx, desc_idx, &offset, 
-                           "wwh", &fid, &newfid, &nwname))
-                goto protocol_error;
-            f = fid_find(s, fid);
-            if (!f)
-                goto fid_not_found;
-            names = (char**)mallocz(sizeof(names[0]) * nwname);
-            qids = (FSQID*)malloc(sizeof(qids[0]) * nwname);
-            for(i = 0; i < nwname; i++) {
-                if (unmarshall(s, queue_idx, desc_idx, &offset, 
-                               "s", &names[i])) {
-                    err = -P9_EPROTO;
-                    goto walk_done;
-                }
-            }
-            err = fs->fs_walk(fs, &f, qids, f, nwname, names);
-        walk_done:
-            for(i = 0; i < nwname; i++) {
-                free(names[i]);
-            }
-            free(names);
-            if (err < 0) {
-                free(qids);
-                goto error;
-            }
-            buf_len = marshall(s, buf, sizeof(buf), "h", err);
-            for(i = 0; i < err; i++) {
-                buf_len += marshall(s, buf + buf_len, sizeof(buf) - buf_len,
-                                    "Q", &qids[i]);
-            }
-            free(qids);
-            fid_set(s, newfid, f);
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
-        }
-        break;
-    case 116: /* read */
-        {
-            uint32_t fid, count;
-            uint64_t offs;
-            uint8_t *buf;
-            int n;
-            FSFile *f;
+    virtio_console_reset(s);
+    if (r->get_u32() != (uint32_t)s1->nb_ports)
+        return -1;
+    for(i = 0; i < s1->nb_ports; i++)
+        s1->ports[i].guest_open = r->get_u8();
+    n = r->get_u32();
+    if (n < 0 || n > VIRTIO_CONSOLE_MAX_CTRL)
+        return -1;
+    for(i = 0; i < n; i++) {
+        c = &s1->ctrl[i];
+        c->id = r->get_u32();
+        c->event = r->get_u16();
+        c->value = r->get_u16();
+        if (c->id >= (uint32_t)s1->nb_ports)
+            return -1;
+    }
+    s1->ctrl_count = n;
+    return 0;
+}
 
-            if (unmarshall(s, queue_idx, desc_idx, &offset,
-                           "wdw", &fid, &offs, &count))
-                goto protocol_error;
-            f = fid_find(s, fid);
-            if (!f)
-                goto fid_not_found;
-            buf = (uint8_t*)malloc(count + 4);
-            n = fs->fs_read(fs, f, offs, buf + 4, count);
-            if (n < 0) {
-                err = n;
-                free(buf);
-                goto error;
-            }
-            put_le32(buf, n);
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, n + 4);
-            free(buf);
-        }
-        break;
-    case 118: /* write */
-        {
-            uint32_t fid, count;
-            uint64_t offs;
-            uint8_t *buf1;
-            int n;
-            FSFile *f;
+/* port 0 is the console (hvc0 in Linux). With more than one port,
+   VIRTIO_CONSOLE_F_MULTIPORT is offered and the ports 1... are
+   named by names[] (an entry can be NULL). The input is polled by the
+   caller with virtio_console_get_write_len() and
+   virtio_console_write_data(). */
+VIRTIODevice *virtio_console_init(VIRTIOBusDef *bus, CharacterDevice **ports,
+                                  const char **names, int nb_ports,
+                                  const simif_t* sim)
+{
+    VIRTIOConsoleDevice *s;
+    int i;
 
-            if (unmarshall(s, queue_idx, desc_idx, &offset,
-                           "wdw", &fid, &offs, &count))
-                goto protocol_error;
-            f = fid_find(s, fid);
-            if (!f)
-                goto fid_not_found;
-            buf1 = (uint8_t*)malloc(count);
-            if (memcpy_from_queue(s1, buf1, queue_idx, desc_idx, offset,
-                                  count)) {
-                free(buf1);
-                goto protocol_error;
-            }
-            n = fs->fs_write(fs, f, offs, buf1, count);
-            free(buf1);
-            if (n < 0) {
-                err = n;
-                goto error;
+    s = (VIRTIOConsoleDevice *) mallocz(sizeof(*s));
+    virtio_init(&s->common, bus, 3, VIRTIO_CONSOLE_CONFIG_SIZE,
+                virtio_console_recv_request, sim);
+    s->common.device_notify_end = virtio_console_notify_end;
+    s->common.device_reset = virtio_console_reset;
+    s->common.device_save = virtio_console_save;
+    s->common.device_load = virtio_console_load;
+    s->nb_ports = min_int(max_int(nb_ports, 1), VIRTIO_CONSOLE_MAX_PORTS);
+    for(i = 0; i < s->nb_ports; i++) {
+        s->ports[i].cs = ports[i];
+        if (names && names[i])
+            s->ports[i].name = strdup(names[i]);
+        s->common.queue[virtio_console_rx_queue(i)].manual_recv = TRUE;
+    }
+    if (s->nb_ports > 1) {
+        s->common.device_features |= 1 << VIRTIO_CONSOLE_F_MULTIPORT;
+        s->common.queue[VIRTIO_CONSOLE_CTRL_RX].manual_recv = TRUE;
+    }
+    put_le32(s->common.config_space + VIRTIO_CONSOLE_CONFIG_MAX_NR_PORTS,
+             s->nb_ports);
+    s->tx_buf = (uint8_t *) malloc(VIRTIO_CONSOLE_TX_BUF_SIZE);
+    return (VIRTIODevice *)s;
+}
+
+/*********************************************************************/
+/* balloon device */
+
+#define VIRTIO_BALLOON_F_MUST_TELL_HOST 0
+#define VIRTIO_BALLOON_F_STATS_VQ       1
+#define VIRTIO_BALLOON_F_DEFLATE_ON_OOM 2
+#define VIRTIO_BALLOON_F_FREE_PAGE_HINT 3
+#define VIRTIO_BALLOON_F_PAGE_POISON    4
+#define VIRTIO_BALLOON_F_REPORTING      5
+
+/* configuration space offsets */
+#define VIRTIO_BALLOON_CONFIG_NUM_PAGES    0 /* target, set by the device */
+#define VIRTIO_BALLOON_CONFIG_ACTUAL       4 /* set by the driver */
+#define VIRTIO_BALLOON_CONFIG_FREE_PAGE_ID 8
+#define VIRTIO_BALLOON_CONFIG_POISON_VAL  12
+#define VIRTIO_BALLOON_CONFIG_SIZE        16
+
+/* the page frame numbers of the inflate and deflate queues are in
+   units of 4 KiB, whatever the guest page size */
+#define VIRTIO_BALLOON_PFN_SHIFT 12
+
+/* statsq and free_page_vq are not offered, so the reporting queue
+   follows the deflate queue */
+#define VIRTIO_BALLOON_INFLATE_Q   0
+#define VIRTIO_BALLOON_DEFLATE_Q   1
+#define VIRTIO_BALLOON_REPORTING_Q 2
+
+/* PFNs read at once from an inflate or deflate buffer */
+#define VIRTIO_BALLOON_PFN_BATCH 256
+
+typedef struct {
+    uint64_t inflated_pages;
+    uint64_t deflated_pages;
+    uint64_t reports; /* reporting buffers */
+    uint64_t reported_bytes;
+    uint64_t released_bytes; /* host memory given back */
+} VIRTIOBalloonStats;
+
+typedef struct VIRTIOBalloonDevice {
+    VIRTIODevice common;
+    VIRTIOBalloonStats stats;
+} VIRTIOBalloonDevice;
+
+static VIRTIORAMDiscardFunc *virtio_ram_discard_func;
+
+/* replace the default release of the guest RAM, e.g. for a simulator
+   whose memory is not made of host pages */
+void virtio_set_ram_discard(VIRTIORAMDiscardFunc *func)
+{
+    virtio_ram_discard_func = func;
+}
+
+static uint64_t virtio_discard_ram(VIRTIODevice *s, uint64_t paddr,
+                                   uint64_t len)
+{
+    if (virtio_ram_discard_func)
+        return virtio_ram_discard_func(s->sim, paddr, len);
+    return dma_discard_ram(s->sim, paddr, len);
+}
+
+/* with VIRTIO_BALLOON_F_PAGE_POISON, the reported pages must keep the
+   poison value, so only a zero value lets the pages be released */
+static BOOL virtio_balloon_can_discard(VIRTIOBalloonDevice *s)
+{
+    return !virtio_has_feature(&s->common, VIRTIO_BALLOON_F_PAGE_POISON) ||
+        get_le32(s->common.config_space + VIRTIO_BALLOON_CONFIG_POISON_VAL) == 0;
+}
+
+/* the PFNs of an inflate or deflate buffer. The pages given to the
+   balloon are released, the pages taken back need nothing: they are
+   filled with zeros when the guest touches them again. */
+static void virtio_balloon_pfns(VIRTIOBalloonDevice *s, int queue_idx,
+                                int desc_idx, int read_size)
+{
+    VIRTIODevice *s1 = &s->common;
+    uint8_t buf[VIRTIO_BALLOON_PFN_BATCH * 4];
+    uint64_t start, next, pfn;
+    int pos, len, i;
+
+    start = next = 0;
+    for(pos = 0; pos + 4 <= read_size; pos += len) {
+        len = min_int(read_size - pos, sizeof(buf)) & ~3;
+        if (memcpy_from_queue(s1, buf, queue_idx, desc_idx, pos, len) < 0)
+            break;
+        if (queue_idx == VIRTIO_BALLOON_DEFLATE_Q) {
+            s->stats.deflated_pages += len / 4;
+            continue;
+        }
+        s->stats.inflated_pages += len / 4;
+        /* the Linux driver gives the pages of a large guest page in
+           consecutive entries */
+        for(i = 0; i < len; i += 4) {
+            pfn = get_le32(buf + i);
+            if (pfn != next) {
+                if (next != start)
+                    s->stats.released_bytes +=
+                        virtio_discard_ram(s1, start << VIRTIO_BALLOON_PFN_SHIFT,
+                                           (next - start) << VIRTIO_BALLOON_PFN_SHIFT);
+                start = pfn;
             }
-            buf_len = marshall(s, buf, sizeof(buf), "w", n);
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
+            next = pfn + 1;
         }
+    }
+    if (next != start)
+        s->stats.released_bytes +=
+            virtio_discard_ram(s1, start << VIRTIO_BALLOON_PFN_SHIFT,
+                               (next - start) << VIRTIO_BALLOON_PFN_SHIFT);
+}
+
+/* free page reporting: each segment of the buffer is a range of pages
+   which the guest has freed. It does not use them until the buffer is
+   returned. */
+static void virtio_balloon_report(VIRTIOBalloonDevice *s, int queue_idx,
+                                  int desc_idx)
+{
+    VIRTIODevice *s1 = &s->common;
+    VIRTIOIOVec *iov = virtio_get_iov(s1, queue_idx, desc_idx);
+    BOOL discard = virtio_balloon_can_discard(s);
+    int i;
+
+    s->stats.reports++;
+    for(i = 0; i < iov->nb_segs; i++) {
+        s->stats.reported_bytes += iov->seg[i].len;
+        if (discard)
+            s->stats.released_bytes +=
+                virtio_discard_ram(s1, iov->seg[i].addr, iov->seg[i].len);
+    }
+}
+
+static int virtio_balloon_recv_request(VIRTIODevice *s1, int queue_idx,
+                                       int desc_idx, int read_size,
+                                       int write_size)
+{
+    VIRTIOBalloonDevice *s = (VIRTIOBalloonDevice *)s1;
+
+    virtio_trace(s1, VTRACE_EV_SUBMIT, queue_idx, desc_idx, queue_idx,
+                 read_size + write_size);
+    switch(queue_idx) {
+    case VIRTIO_BALLOON_INFLATE_Q:
+    case VIRTIO_BALLOON_DEFLATE_Q:
+        virtio_balloon_pfns(s, queue_idx, desc_idx, read_size);
         break;
-    case 120: /* clunk */
-        {
-            uint32_t fid;
-            
-            if (unmarshall(s, queue_idx, desc_idx, &offset, 
-                           "w", &fid))
-                goto protocol_error;
-            fid_delete(s, fid);
-            virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, NULL, 0);
-        }
+    case VIRTIO_BALLOON_REPORTING_Q:
+        if (virtio_has_feature(s1, VIRTIO_BALLOON_F_REPORTING))
+            virtio_balloon_report(s, queue_idx, desc_idx);
         break;
     default:
-        printf("9p: unsupported operation id=%d\n", id);
-        goto protocol_error;
+        break;
     }
+    virtio_trace(s1, VTRACE_EV_COMPLETE, queue_idx, desc_idx, 0, 0);
+    virtio_consume_desc(s1, queue_idx, desc_idx, 0);
     return 0;
- error:
-    virtio_9p_send_error(s, queue_idx, desc_idx, tag, err);
+}
+
+/* ask the guest to give num_pages 4 KiB pages to the balloon */
+void virtio_balloon_set_target(VIRTIODevice *s1, uint32_t num_pages)
+{
+    if (get_le32(s1->config_space + VIRTIO_BALLOON_CONFIG_NUM_PAGES) ==
+        num_pages)
+        return;
+    put_le32(s1->config_space + VIRTIO_BALLOON_CONFIG_NUM_PAGES, num_pages);
+    if (s1->status & VIRTIO_STATUS_DRIVER_OK)
+        virtio_config_change_notify(s1);
+}
+
+/* pages currently in the balloon, as reported by the guest */
+uint32_t virtio_balloon_get_actual(VIRTIODevice *s1)
+{
+    return get_le32(s1->config_space + VIRTIO_BALLOON_CONFIG_ACTUAL);
+}
+
+/* write the statistics in JSON */
+void virtio_balloon_dump_stats(VIRTIODevice *s1, FILE *f)
+{
+    VIRTIOBalloonDevice *s = (VIRTIOBalloonDevice *)s1;
+    VIRTIOBalloonStats *st = &s->stats;
+
+    fprintf(f, "{\n  \"target_pages\": %u,\n  \"actual_pages\": %u,\n"
+            "  \"inflated_pages\": %" PRIu64 ",\n"
+            "  \"deflated_pages\": %" PRIu64 ",\n"
+            "  \"reports\": %" PRIu64 ",\n"
+            "  \"reported_bytes\": %" PRIu64 ",\n"
+            "  \"released_bytes\": %" PRIu64 "\n}\n",
+            get_le32(s1->config_space + VIRTIO_BALLOON_CONFIG_NUM_PAGES),
+            virtio_balloon_get_actual(s1), st->inflated_pages,
+            st->deflated_pages, st->reports, st->reported_bytes,
+            st->released_bytes);
+    fflush(f);
+}
+
+VIRTIODevice *virtio_balloon_init(VIRTIOBusDef *bus, uint32_t num_pages,
+                                  int deflate_on_oom, int reporting,
+                                  const simif_t* sim)
+{
+    VIRTIOBalloonDevice *s;
+
+    s = (VIRTIOBalloonDevice *)mallocz(sizeof(*s));
+    virtio_init(&s->common, bus, 5, VIRTIO_BALLOON_CONFIG_SIZE,
+                virtio_balloon_recv_request, sim);
+    /* VIRTIO_BALLOON_F_FREE_PAGE_HINT is not offered: the hinted pages
+       can be reused by the guest without notice, so they could only be
+       skipped by a migration that tracks the dirty pages */
+    s->common.device_features |= 1 << VIRTIO_BALLOON_F_PAGE_POISON;
+    if (deflate_on_oom)
+        s->common.device_features |= 1 << VIRTIO_BALLOON_F_DEFLATE_ON_OOM;
+    if (reporting)
+        s->common.device_features |= 1 << VIRTIO_BALLOON_F_REPORTING;
+    put_le32(s->common.config_space + VIRTIO_BALLOON_CONFIG_NUM_PAGES,
+             num_pages);
+    return (VIRTIODevice *)s;
+}
+
+/*********************************************************************/
+/* persistent memory device */
+
+#define VIRTIO_PMEM_F_SHMEM_REGION 0
+
+/* configuration space offsets */
+#define VIRTIO_PMEM_CONFIG_START 0
+#define VIRTIO_PMEM_CONFIG_SIZE  8
+#define VIRTIO_PMEM_CONFIG_SPACE_SIZE 16
+
+#define VIRTIO_PMEM_REQ_TYPE_FLUSH 0
+#define VIRTIO_PMEM_SHMEM_REGION_ID 0
+
+/* the guest maps the region with huge pages if it is aligned */
+#define VIRTIO_PMEM_ALIGN (2 << 20)
+/* bytes read or written back at once */
+#define VIRTIO_PMEM_IO_SIZE (1 << 20)
+#define VIRTIO_PMEM_MAX_IOV (VIRTIO_PMEM_IO_SIZE / DMA_PAGE_SIZE)
+
+typedef struct {
+    uint64_t flushes;
+    uint64_t written_bytes; /* written back to the image */
+    uint64_t errors;
+} VIRTIOPmemStats;
+
+typedef struct VIRTIOPmemDevice {
+    VIRTIODevice common;
+    BlockDevice *bs;
+    uint64_t image_size; /* bytes of the image at the start of the region */
+    /* the image file mapped read only, NULL if the writes are not written
+       back. It shares the page cache with the writes of bs, so a flush
+       writes the pages of the region which differ from it. */
+    const uint8_t *image_map;
+    size_t image_map_size;
+    VIRTIOPmemStats stats;
+} VIRTIOPmemDevice;
+
+/* write [offset, offset + len) of the region to the image, len <=
+   VIRTIO_PMEM_IO_SIZE. Return < 0 if error. */
+static int virtio_pmem_write_back(VIRTIOPmemDevice *s, uint64_t offset,
+                                  uint64_t len)
+{
+    BlockDevice *bs = s->bs;
+    struct iovec iov[VIRTIO_PMEM_MAX_IOV];
+    int iovcnt;
+
+    iovcnt = virtio_shm_get_host_iov(&s->common, VIRTIO_PMEM_SHMEM_REGION_ID,
+                                     offset, len, iov, VIRTIO_PMEM_MAX_IOV);
+    if (iovcnt < 0)
+        return -1;
+    /* the I/O of the device is synchronous */
+    if (bs->writev_async(bs, offset / SECTOR_SIZE, iov, iovcnt,
+                         NULL, NULL) < 0)
+        return -1;
+    s->stats.written_bytes += len;
     return 0;
- protocol_error:
- fid_not_found:
-    err = -P9_EPROTO;
-    goto error;
 }
 
-VIRTIODevice *virtio_9p_init(VIRTIOBusDef *bus, FSDevice *fs,
-                             const char *mount_tag, const simif_t* sim)
+/* write back the pages of the region which differ from the image, then
+   make them persistent. The comparison is exact, but reads the whole
+   region and the image pages of the page cache. */
+int virtio_pmem_flush(VIRTIODevice *s1)
+{
+    VIRTIOPmemDevice *s = (VIRTIOPmemDevice *)s1;
+    BlockDevice *bs = s->bs;
+    struct iovec iov;
+    uint64_t offset, start, run_len, len;
+    int ret;
+
+    if (!s->image_map)
+        return 0;
+    ret = 0;
+    start = 0;
+    run_len = 0;
+    for(offset = 0; offset < s->image_size; offset += len) {
+        len = s->image_size - offset;
+        if (len > DMA_PAGE_SIZE)
+            len = DMA_PAGE_SIZE;
+        if (virtio_shm_get_host_iov(s1, VIRTIO_PMEM_SHMEM_REGION_ID, offset,
+                                    len, &iov, 1) < 0)
+            return -1;
+        if (memcmp(iov.iov_base, s->image_map + offset, len) != 0) {
+            if (run_len == 0)
+                start = offset;
+            run_len += len;
+            if (run_len < VIRTIO_PMEM_IO_SIZE)
+                continue;
+        } else if (run_len == 0) {
+            continue;
+        }
+        /* a run of dirty pages, ended by a clean page or the I/O size */
+        if (virtio_pmem_write_back(s, start, run_len) < 0)
+            ret = -1;
+        run_len = 0;
+    }
+    if (run_len > 0 && virtio_pmem_write_back(s, start, run_len) < 0)
+        ret = -1;
+    if (block_device_flush(bs) < 0)
+        ret = -1;
+    return ret;
+}
 
+/* read the image into the region and clear the rest of the region */
+static int virtio_pmem_load(VIRTIOPmemDevice *s, uint64_t region_size)
 {
-    VIRTIO9PDevice *s;
-    int len;
-    uint8_t *cfg;
+    BlockDevice *bs = s->bs;
+    struct iovec iov[VIRTIO_PMEM_MAX_IOV];
+    uint64_t offset, len, pos;
+    int iovcnt, i;
+
+    for(offset = 0; offset < region_size; offset += len) {
+        len = region_size - offset;
+        if (len > VIRTIO_PMEM_IO_SIZE)
+            len = VIRTIO_PMEM_IO_SIZE;
+        iovcnt = virtio_shm_get_host_iov(&s->common,
+                                         VIRTIO_PMEM_SHMEM_REGION_ID, offset,
+                                         len, iov, VIRTIO_PMEM_MAX_IOV);
+        if (iovcnt < 0)
+            return -1;
+        for(i = 0; i < iovcnt; i++)
+            memset(iov[i].iov_base, 0, iov[i].iov_len);
+        if (offset >= s->image_size)
+            continue;
+        /* the image ends on a sector boundary */
+        if (len > s->image_size - offset) {
+            len = s->image_size - offset;
+            for(i = 0, pos = 0; pos + iov[i].iov_len < len; i++)
+                pos += iov[i].iov_len;
+            iov[i].iov_len = len - pos;
+            iovcnt = i + 1;
+        }
+        if (bs->readv_async(bs, offset / SECTOR_SIZE, iov, iovcnt,
+                            NULL, NULL) < 0)
+            return -1;
+    }
+    return 0;
+}
 
-    len = strlen(mount_tag);
-    s = (VIRTIO9PDevice*)mallocz(sizeof(*s));
-    virtio_init(s, bus,
-                9, 2 + len, virtio_9p_recv_request, sim);
-    s->device_features = 1 << 0;
+/* the request is a le32 type, the response a le32 status which is not 0
+   if the flush failed */
+static int virtio_pmem_recv_request(VIRTIODevice *s1, int queue_idx,
+                                    int desc_idx, int read_size,
+                                    int write_size)
+{
+    VIRTIOPmemDevice *s = (VIRTIOPmemDevice *)s1;
+    uint8_t buf[4];
+    uint32_t type, ret;
 
-    /* set the mount tag */
-    cfg = s->config_space;
-    cfg[0] = len;
-    cfg[1] = len >> 8;
-    memcpy(cfg + 2, mount_tag, len);
+    if (read_size < 4 || write_size < 4 ||
+        memcpy_from_queue(s1, buf, queue_idx, desc_idx, 0, 4) < 0) {
+        virtio_consume_desc(s1, queue_idx, desc_idx, 0);
+        return 0;
+    }
+    type = get_le32(buf);
+    virtio_trace(s1, VTRACE_EV_SUBMIT, queue_idx, desc_idx, type, 0);
+    if (type == VIRTIO_PMEM_REQ_TYPE_FLUSH) {
+        s->stats.flushes++;
+        ret = virtio_pmem_flush(s1) < 0;
+    } else {
+        ret = 1;
+    }
+    if (ret)
+        s->stats.errors++;
+    virtio_trace(s1, VTRACE_EV_COMPLETE, queue_idx, desc_idx, ret, 0);
+    put_le32(buf, ret);
+    memcpy_to_queue(s1, queue_idx, desc_idx, 0, buf, 4);
+    virtio_consume_desc(s1, queue_idx, desc_idx, 4);
+    return 0;
+}
 
-#ifdef DEBUG_VIRTIO
-    printf("Config space: %#x%x", cfg[0], cfg[1]);
-    for (int k = 0; k < len; k++) {
-        putchar(cfg[2+k]);
+/* write the statistics in JSON */
+void virtio_pmem_dump_stats(VIRTIODevice *s1, FILE *f)
+{
+    VIRTIOPmemDevice *s = (VIRTIOPmemDevice *)s1;
+    VIRTIOPmemStats *st = &s->stats;
+
+    fprintf(f, "{\n  \"image_bytes\": %" PRIu64 ",\n"
+            "  \"flushes\": %" PRIu64 ",\n"
+            "  \"written_bytes\": %" PRIu64 ",\n"
+            "  \"errors\": %" PRIu64 "\n}\n",
+            s->image_size, st->flushes, st->written_bytes, st->errors);
+    fflush(f);
+}
+
+/* The region at base is RAM of the simulator which the guest does not
+   use otherwise, see virtio_set_shm_region(). It is the image size
+   rounded up to VIRTIO_PMEM_ALIGN. */
+VIRTIODevice *virtio_pmem_init(VIRTIOBusDef *bus, BlockDevice *bs,
+                               uint64_t base, int write_back,
+                               const simif_t* sim)
+{
+    VIRTIOPmemDevice *s;
+    BlockDeviceFile *bf;
+    uint64_t region_size;
+    void *map;
+
+    s = (VIRTIOPmemDevice *)mallocz(sizeof(*s));
+    virtio_init(&s->common, bus, 27, VIRTIO_PMEM_CONFIG_SPACE_SIZE,
+                virtio_pmem_recv_request, sim);
+    s->bs = bs;
+    s->image_size = bs->get_sector_count(bs) * SECTOR_SIZE;
+    region_size = (s->image_size + VIRTIO_PMEM_ALIGN - 1) &
+        ~(uint64_t)(VIRTIO_PMEM_ALIGN - 1);
+    if (region_size == 0 ||
+        virtio_set_shm_region(&s->common, VIRTIO_PMEM_SHMEM_REGION_ID,
+                              base, region_size) < 0)
+        goto fail;
+    /* a compressed image is opened in snapshot mode: nothing to write
+       back */
+    bf = bs->opaque;
+    if (write_back && bf->mode == BF_MODE_RW && !bf->snapshot &&
+        bf->fd >= 0) {
+        s->image_map_size = s->image_size;
+        map = mmap(NULL, s->image_map_size, PROT_READ, MAP_SHARED, bf->fd, 0);
+        if (map == MAP_FAILED)
+            goto fail;
+        s->image_map = (const uint8_t *)map;
     }
-    putchar('\n');
-#endif 
+    if (virtio_pmem_load(s, region_size) < 0)
+        goto fail;
+    /* older drivers only read the configuration space */
+    s->common.device_features |= 1 << VIRTIO_PMEM_F_SHMEM_REGION;
+    put_le64(s->common.config_space + VIRTIO_PMEM_CONFIG_START, base);
+    put_le64(s->common.config_space + VIRTIO_PMEM_CONFIG_SIZE, region_size);
+    return (VIRTIODevice *)s;
+ fail:
+    if (s->image_map)
+        munmap((void *)s->image_map, s->image_map_size);
+    free(s);
+    return NULL;
+}
+
+/*********************************************************************/
+/* network device */
+
+#define VIRTIO_NET_F_CSUM         0
+#define VIRTIO_NET_F_GUEST_CSUM   1
+#define VIRTIO_NET_F_MAC          5
+#define VIRTIO_NET_F_GUEST_TSO4   7
+#define VIRTIO_NET_F_HOST_TSO4    11
+#define VIRTIO_NET_F_MRG_RXBUF    15
+#define VIRTIO_NET_F_STATUS       16
+#define VIRTIO_NET_F_CTRL_VQ      17
+#define VIRTIO_NET_F_MQ           22
+
+/* control queue */
+#define VIRTIO_NET_OK  0
+#define VIRTIO_NET_ERR 1
+
+#define VIRTIO_NET_CTRL_MQ 4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET 0
+
+/* VIRTIONetHeader.flags */
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM 1
+#define VIRTIO_NET_HDR_F_DATA_VALID 2
+
+/* VIRTIONetHeader.gso_type */
+#define VIRTIO_NET_HDR_GSO_NONE   0
+#define VIRTIO_NET_HDR_GSO_TCPV4  1
+#define VIRTIO_NET_HDR_GSO_ECN    0x80
+
+#define ETH_HEADER_SIZE 14
+#define NET_MAX_IP_LEN 65535
+#define NET_MAX_FRAME_LEN ((int) sizeof(VIRTIONetHeader) + ETH_HEADER_SIZE + \
+                           NET_MAX_IP_LEN)
+
+/* TCP flags */
+#define TCP_FLAG_FIN 0x01
+#define TCP_FLAG_SYN 0x02
+#define TCP_FLAG_RST 0x04
+#define TCP_FLAG_PSH 0x08
+#define TCP_FLAG_ACK 0x10
+#define TCP_FLAG_CWR 0x80
+
+/* pcap capture */
+
+#define NET_CAPTURE_RING_SIZE (8 << 20) /* must be a power of two */
+#define NET_CAPTURE_SNAPLEN 262144
+#define PCAP_RECORD_HEADER_SIZE 16
+
+/* The simulation thread appends the pcap records to a ring buffer
+   which is written to the file by a dedicated thread, so capturing a
+   frame is a copy and no system call. The frames which do not fit in
+   the ring are dropped from the capture. */
+typedef struct NetCapture {
+    int fd;
+    int snaplen;
+    uint8_t *ring;
+    uint64_t head; /* written by the simulation thread */
+    uint64_t tail; /* written by the writer thread */
+    uint64_t nb_dropped;
+    int stop;
+    pthread_t thread;
+} NetCapture;
+
+static void net_capture_copy(NetCapture *c, uint64_t pos,
+                             const uint8_t *buf, int len)
+{
+    int offset, n;
+
+    offset = pos & (NET_CAPTURE_RING_SIZE - 1);
+    n = min_int(len, NET_CAPTURE_RING_SIZE - offset);
+    memcpy(c->ring + offset, buf, n);
+    memcpy(c->ring, buf + n, len - n);
+}
+
+/* record the frame of len bytes in iov, skipping its first skip bytes */
+static void net_capture_packet(NetCapture *c, const struct iovec *iov,
+                               int iovcnt, int skip, int len)
+{
+    uint8_t hdr[PCAP_RECORD_HEADER_SIZE];
+    struct timespec ts;
+    uint64_t pos;
+    int cap_len, n, i;
+
+    len -= skip;
+    if (len <= 0)
+        return;
+    cap_len = min_int(len, c->snaplen);
+    pos = c->head;
+    if (pos + PCAP_RECORD_HEADER_SIZE + cap_len -
+        __atomic_load_n(&c->tail, __ATOMIC_ACQUIRE) > NET_CAPTURE_RING_SIZE) {
+        c->nb_dropped++;
+        return;
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    put_le32(hdr, ts.tv_sec);
+    put_le32(hdr + 4, ts.tv_nsec / 1000);
+    put_le32(hdr + 8, cap_len);
+    put_le32(hdr + 12, len);
+    net_capture_copy(c, pos, hdr, PCAP_RECORD_HEADER_SIZE);
+    pos += PCAP_RECORD_HEADER_SIZE;
+    for(i = 0; i < iovcnt && cap_len > 0; i++) {
+        n = iov[i].iov_len;
+        if (skip >= n) {
+            skip -= n;
+            continue;
+        }
+        n = min_int(n - skip, cap_len);
+        net_capture_copy(c, pos, (uint8_t *) iov[i].iov_base + skip, n);
+        pos += n;
+        cap_len -= n;
+        skip = 0;
+    }
+    __atomic_store_n(&c->head, pos, __ATOMIC_RELEASE);
+}
+
+static void *net_capture_thread(void *opaque)
+{
+    NetCapture *c = (NetCapture *) opaque;
+    uint64_t head, tail;
+    int offset, n, ret, stop;
+
+    tail = c->tail;
+    for(;;) {
+        stop = __atomic_load_n(&c->stop, __ATOMIC_ACQUIRE);
+        head = __atomic_load_n(&c->head, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            if (stop)
+                break;
+            usleep(10000);
+            continue;
+        }
+        offset = tail & (NET_CAPTURE_RING_SIZE - 1);
+        n = min_int(head - tail, NET_CAPTURE_RING_SIZE - offset);
+        ret = write(c->fd, c->ring + offset, n);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "virtio-net: pcap write error: %s\n",
+                    strerror(errno));
+            /* the following records are discarded */
+            ret = n;
+        }
+        tail += ret;
+        __atomic_store_n(&c->tail, tail, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
 
-    s->fs = fs;
-    s->msize = 8192;
-    init_list_head(&s->fid_list);
+static NetCapture *net_capture_open(const char *filename, int snaplen)
+{
+    NetCapture *c;
+    uint8_t hdr[24];
+    int fd;
 
-    return (VIRTIODevice *)s;
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return NULL;
+    if (snaplen <= 0)
+        snaplen = NET_CAPTURE_SNAPLEN;
+    /* version 2.4, microsecond time stamps, Ethernet */
+    put_le32(hdr, 0xa1b2c3d4);
+    put_le16(hdr + 4, 2);
+    put_le16(hdr + 6, 4);
+    put_le32(hdr + 8, 0);
+    put_le32(hdr + 12, 0);
+    put_le32(hdr + 16, snaplen);
+    put_le32(hdr + 20, 1);
+    if (write(fd, hdr, sizeof(hdr)) != sizeof(hdr)) {
+        close(fd);
+        return NULL;
+    }
+    c = (NetCapture *) mallocz(sizeof(*c));
+    c->fd = fd;
+    c->snaplen = snaplen;
+    c->ring = (uint8_t *) malloc(NET_CAPTURE_RING_SIZE);
+    if (pthread_create(&c->thread, NULL, net_capture_thread, c) != 0) {
+        free(c->ring);
+        free(c);
+        close(fd);
+        return NULL;
+    }
+    return c;
 }
 
-/*********************************************************************/
-/* network device */
+/* write the remaining records and close the file */
+static void net_capture_close(NetCapture *c)
+{
+    __atomic_store_n(&c->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(c->thread, NULL);
+    if (c->nb_dropped > 0) {
+        fprintf(stderr, "virtio-net: %" PRIu64
+                " frames dropped from the pcap capture\n", c->nb_dropped);
+    }
+    close(c->fd);
+    free(c->ring);
+    free(c);
+}
 
 typedef struct VIRTIONetDevice {
     VIRTIODevice common;
     EthernetDevice *es;
     int header_size;
+    int max_queue_pairs;
+    int curr_queue_pairs; /* set by the driver with VIRTIO_NET_F_MQ */
+    /* consecutive received TCP segments merged into one frame for
+       VIRTIO_NET_F_GUEST_TSO4 */
+    uint8_t *rx_merge_buf;
+    int rx_merge_len; /* 0 if no frame is held */
+    int rx_merge_hdr_len; /* Ethernet, IP and TCP headers */
+    int rx_merge_seg_size; /* payload length of the first segment */
+    int rx_merge_nb_segs;
+    int rx_merge_queue_idx;
+    int offload_flags; /* last flags given to es->set_offload() */
+    uint8_t *tx_buf; /* frame copied from the guest */
+    uint8_t *tx_seg_buf; /* segment of virtio_net_send_tso4() */
+    /* frames sent without copy (write_packet_async()) */
+    int tx_gen; /* incremented on reset, the older frames are ignored */
+    int tx_async_pending; /* frames not done yet */
+    uint32_t tx_done_mask; /* queue pairs with new used elements */
+    uint32_t tx_blocked_mask; /* queue pairs waiting for the backend */
+    NetCapture *capture; /* NULL if the frames are not captured */
 } VIRTIONetDevice;
 
 typedef struct {
@@ -2131,6 +9529,291 @@ typedef struct {
     uint16_t num_buffers;
 } VIRTIONetHeader;
 
+static uint32_t net_checksum_add(uint32_t sum, const uint8_t *buf, int len)
+{
+    int i;
+
+    for(i = 0; i + 1 < len; i += 2)
+        sum += (buf[i] << 8) | buf[i + 1];
+    if (len & 1)
+        sum += buf[len - 1] << 8;
+    return sum;
+}
+
+/* one's complement of the folded sum */
+static uint16_t net_checksum_fold(uint32_t sum)
+{
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return ~sum;
+}
+
+/* Return the length of the Ethernet, IPv4 and TCP headers of buf if it
+   is an unfragmented TCP/IPv4 frame, otherwise -1. *pframe_len is set
+   to the frame length without the Ethernet padding. */
+static int net_tcp4_header_len(const uint8_t *buf, int len, int *pframe_len)
+{
+    const uint8_t *ip, *tcp;
+    int ihl, thl, ip_len;
+
+    if (len < ETH_HEADER_SIZE + 20 || get_be16(buf + 12) != 0x0800)
+        return -1;
+    ip = buf + ETH_HEADER_SIZE;
+    ihl = (ip[0] & 0xf) * 4;
+    ip_len = get_be16(ip + 2);
+    if ((ip[0] >> 4) != 4 || ihl < 20 || ip[9] != 6 ||
+        (get_be16(ip + 6) & 0x3fff) != 0 ||
+        ip_len > len - ETH_HEADER_SIZE || ip_len < ihl + 20)
+        return -1;
+    tcp = ip + ihl;
+    thl = (tcp[12] >> 4) * 4;
+    if (thl < 20 || ihl + thl > ip_len)
+        return -1;
+    *pframe_len = ETH_HEADER_SIZE + ip_len;
+    return ETH_HEADER_SIZE + ihl + thl;
+}
+
+/* Hash of the addresses and ports of an IPv4 frame, 0 for other
+   frames. A connection is always given the same value. */
+uint32_t net_flow_hash(const uint8_t *buf, int len)
+{
+    const uint8_t *ip;
+    uint32_t h;
+    int ihl;
+
+    if (len < ETH_HEADER_SIZE + 20 || get_be16(buf + 12) != 0x0800)
+        return 0;
+    ip = buf + ETH_HEADER_SIZE;
+    ihl = (ip[0] & 0xf) * 4;
+    h = get_be32(ip + 12) * 0x9e3779b1 + get_be32(ip + 16);
+    /* the ports are only in the first fragment */
+    if ((ip[9] == 6 || ip[9] == 17) && (get_be16(ip + 6) & 0x3fff) == 0 &&
+        len >= ETH_HEADER_SIZE + ihl + 4)
+        h = h * 0x9e3779b1 + get_be32(ip + ihl);
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    return h;
+}
+
+static void net_ip4_set_checksum(uint8_t *ip)
+{
+    int ihl = (ip[0] & 0xf) * 4;
+    put_be16(ip + 10, 0);
+    put_be16(ip + 10, net_checksum_fold(net_checksum_add(0, ip, ihl)));
+}
+
+/* sum of the TCP pseudo header */
+static uint32_t net_tcp4_pseudo_sum(const uint8_t *ip)
+{
+    int ihl = (ip[0] & 0xf) * 4;
+    return net_checksum_add(0, ip + 12, 8) + 6 + get_be16(ip + 2) - ihl;
+}
+
+static void net_tcp4_set_checksum(uint8_t *ip)
+{
+    int ihl = (ip[0] & 0xf) * 4;
+    uint8_t *tcp = ip + ihl;
+
+    put_be16(tcp + 16, 0);
+    put_be16(tcp + 16, net_checksum_fold(
+                 net_checksum_add(net_tcp4_pseudo_sum(ip), tcp,
+                                  get_be16(ip + 2) - ihl)));
+}
+
+/* split a TCP/IPv4 frame of the guest into segments of gso_size
+   bytes of payload, with their checksums */
+static void virtio_net_send_tso4(VIRTIONetDevice *s1, int queue_pair,
+                                 uint8_t *buf, int len, int gso_size)
+{
+    EthernetDevice *es = s1->es;
+    int hdr_len, frame_len, ihl, payload_len, pos, n;
+    uint8_t *seg, *ip, *tcp, flags;
+    uint32_t seq;
+    uint16_t ip_id;
+
+    hdr_len = net_tcp4_header_len(buf, len, &frame_len);
+    if (hdr_len < 0 || gso_size <= 0) {
+        es->write_packet(es, queue_pair, buf, len);
+        return;
+    }
+    ihl = (buf[ETH_HEADER_SIZE] & 0xf) * 4;
+    payload_len = frame_len - hdr_len;
+    ip_id = get_be16(buf + ETH_HEADER_SIZE + 4);
+    tcp = buf + ETH_HEADER_SIZE + ihl;
+    seq = get_be32(tcp + 4);
+    flags = tcp[13];
+    seg = s1->tx_seg_buf;
+    for(pos = 0; pos < payload_len || pos == 0; pos += gso_size) {
+        n = min_int(gso_size, payload_len - pos);
+        memcpy(seg, buf, hdr_len);
+        memcpy(seg + hdr_len, buf + hdr_len + pos, n);
+        ip = seg + ETH_HEADER_SIZE;
+        put_be16(ip + 2, hdr_len - ETH_HEADER_SIZE + n);
+        put_be16(ip + 4, ip_id++);
+        net_ip4_set_checksum(ip);
+        tcp = ip + ihl;
+        put_be32(tcp + 4, seq + pos);
+        tcp[13] = flags;
+        if (pos + n < payload_len)
+            tcp[13] &= ~(TCP_FLAG_FIN | TCP_FLAG_PSH);
+        if (pos != 0)
+            tcp[13] &= ~TCP_FLAG_CWR;
+        net_tcp4_set_checksum(ip);
+        es->write_packet(es, queue_pair, seg, hdr_len + n);
+    }
+}
+
+/* apply the checksum and segmentation offloads requested by the
+   guest, which the backends do not support */
+static void virtio_net_send_packet(VIRTIONetDevice *s1, int queue_pair,
+                                   const VIRTIONetHeader *h,
+                                   uint8_t *buf, int len)
+{
+    VIRTIODevice *s = &s1->common;
+    EthernetDevice *es = s1->es;
+    int start, offset;
+
+    if ((h->gso_type & ~VIRTIO_NET_HDR_GSO_ECN) == VIRTIO_NET_HDR_GSO_TCPV4 &&
+        virtio_has_feature(s, VIRTIO_NET_F_HOST_TSO4)) {
+        virtio_net_send_tso4(s1, queue_pair, buf, len, h->gso_size);
+        return;
+    }
+    if ((h->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) &&
+        virtio_has_feature(s, VIRTIO_NET_F_CSUM)) {
+        /* the guest put the sum of the pseudo header in the checksum
+           field */
+        start = h->csum_start;
+        offset = h->csum_offset;
+        if (start + offset + 2 <= len) {
+            put_be16(buf + start + offset,
+                     net_checksum_fold(net_checksum_add(0, buf + start,
+                                                        len - start)));
+        }
+    }
+    es->write_packet(es, queue_pair, buf, len);
+}
+
+static void virtio_net_ctrl_request(VIRTIONetDevice *s1, int desc_idx,
+                                    int read_size, int write_size)
+{
+    VIRTIODevice *s = &s1->common;
+    int queue_idx = 2 * s1->max_queue_pairs;
+    uint8_t buf[4], ack;
+    int n;
+
+    ack = VIRTIO_NET_ERR;
+    if (read_size >= 2 &&
+        memcpy_from_queue(s, buf, queue_idx, desc_idx, 0,
+                          min_int(read_size, sizeof(buf))) >= 0) {
+        if (buf[0] == VIRTIO_NET_CTRL_MQ &&
+            buf[1] == VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET && read_size >= 4) {
+            n = get_le16(buf + 2);
+            if (n >= 1 && n <= s1->max_queue_pairs) {
+                s1->curr_queue_pairs = n;
+                ack = VIRTIO_NET_OK;
+            }
+        }
+    }
+    if (write_size >= 1)
+        memcpy_to_queue(s, queue_idx, desc_idx, write_size - 1, &ack, 1);
+    virtio_consume_desc(s, queue_idx, desc_idx, min_int(write_size, 1));
+}
+
+/* Send the frame from the guest memory. Return 1 if it was sent or
+   queued, 0 if it must be copied and -1 if the backend cannot accept
+   it now. */
+static int virtio_net_send_nocopy(VIRTIONetDevice *s1, int queue_idx,
+                                  int desc_idx, const VIRTIONetHeader *h,
+                                  int read_size)
+{
+    VIRTIODevice *s = &s1->common;
+    EthernetDevice *es = s1->es;
+    struct iovec iov[NET_MAX_IOV];
+    int offset, n;
+    uintptr_t opaque;
+
+    if (!es->write_packet_async && !es->write_packetv)
+        return 0;
+    if (es->vnet_hdr_len > 0) {
+        /* the header of the guest is passed unchanged */
+        if (es->vnet_hdr_len != s1->header_size)
+            return 0;
+        offset = 0;
+    } else {
+        /* the offloads done by the device modify the frame */
+        if ((h->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) ||
+            h->gso_type != VIRTIO_NET_HDR_GSO_NONE)
+            return 0;
+        offset = s1->header_size;
+    }
+    n = virtio_queue_get_host_iov(s, queue_idx, desc_idx, offset,
+                                  read_size - offset, FALSE, iov, NET_MAX_IOV);
+    if (n < 0)
+        return 0;
+    if (es->write_packet_async) {
+        /* the descriptor is consumed by virtio_net_write_done() */
+        opaque = ((uintptr_t) s1->tx_gen << 24) | (queue_idx << 16) | desc_idx;
+        if (!es->write_packet_async(es, queue_idx / 2, iov, n, (void *) opaque))
+            return -1;
+        virtio_trace(s, VTRACE_EV_SUBMIT, queue_idx, desc_idx, 1,
+                     read_size - offset);
+        s1->tx_async_pending++;
+    } else {
+        es->write_packetv(es, queue_idx / 2, iov, n);
+        virtio_consume_desc(s, queue_idx, desc_idx, 0);
+    }
+    return 1;
+}
+
+/* called when the backend has sent a frame of virtio_net_send_nocopy() */
+static void virtio_net_write_done(EthernetDevice *es, void *opaque)
+{
+    VIRTIODevice *s = (VIRTIODevice *) es->device_opaque;
+    VIRTIONetDevice *s1 = (VIRTIONetDevice *)s;
+    uintptr_t v = (uintptr_t) opaque;
+    int queue_idx = (v >> 16) & 0xff;
+    int desc_idx = v & 0xffff;
+    QueueState *qs = &s->queue[queue_idx];
+    BOOL batch_used;
+
+    /* sent before a device reset */
+    if ((int) (v >> 24) != s1->tx_gen)
+        return;
+    s1->tx_async_pending--;
+    virtio_trace(s, VTRACE_EV_COMPLETE, queue_idx, desc_idx, 0, 0);
+    /* the used ring is updated by virtio_net_poll() */
+    batch_used = qs->batch_used;
+    qs->batch_used = TRUE;
+    virtio_consume_desc(s, queue_idx, desc_idx, 0);
+    qs->batch_used = batch_used;
+    s1->tx_done_mask |= 1 << (queue_idx / 2);
+}
+
+/* capture the frame sent by the guest in the descriptor desc_idx */
+static void virtio_net_capture_tx(VIRTIONetDevice *s1, int queue_idx,
+                                  int desc_idx, int read_size)
+{
+    struct iovec iov[NET_MAX_IOV];
+    int len, n;
+
+    len = read_size - s1->header_size;
+    if (len <= 0 || len > NET_MAX_FRAME_LEN)
+        return;
+    n = virtio_queue_get_host_iov(&s1->common, queue_idx, desc_idx,
+                                  s1->header_size, len, FALSE, iov,
+                                  NET_MAX_IOV);
+    if (n < 0) {
+        if (memcpy_from_queue(&s1->common, s1->tx_buf, queue_idx, desc_idx,
+                              s1->header_size, len) < 0)
+            return;
+        iov[0].iov_base = s1->tx_buf;
+        iov[0].iov_len = len;
+        n = 1;
+    }
+    net_capture_packet(s1->capture, iov, n, 0, len);
+}
+
 static int virtio_net_recv_request(VIRTIODevice *s, int queue_idx,
                                    int desc_idx, int read_size,
                                    int write_size)
@@ -2139,62 +9822,455 @@ static int virtio_net_recv_request(VIRTIODevice *s, int queue_idx,
     EthernetDevice *es = s1->es;
     VIRTIONetHeader h;
     uint8_t *buf;
-    int len;
+    int len, ret;
 
-    if (queue_idx == 1) {
+    if (queue_idx == 2 * s1->max_queue_pairs) {
+        virtio_net_ctrl_request(s1, desc_idx, read_size, write_size);
+    } else if ((queue_idx & 1) && queue_idx < 2 * s1->max_queue_pairs) {
         /* send to network */
         if (memcpy_from_queue(s, &h, queue_idx, desc_idx, 0, s1->header_size) < 0)
             return 0;
+        ret = virtio_net_send_nocopy(s1, queue_idx, desc_idx, &h, read_size);
+        if (ret < 0) {
+            /* retried by virtio_net_poll() */
+            s1->tx_blocked_mask |= 1 << (queue_idx / 2);
+            return -1;
+        }
+        /* the frame stays in the guest memory until the next guest
+           instruction */
+        if (s1->capture && ret >= 0)
+            virtio_net_capture_tx(s1, queue_idx, desc_idx, read_size);
+        if (ret > 0)
+            return 0;
         len = read_size - s1->header_size;
-        buf = (uint8_t*) malloc(len);
-        memcpy_from_queue(s, buf, queue_idx, desc_idx, s1->header_size, len);
-        es->write_packet(es, buf, len);
-        free(buf);
+        buf = s1->tx_buf;
+        if (len < 0 || es->vnet_hdr_len + len > NET_MAX_FRAME_LEN) {
+            /* dropped */
+        } else if (es->vnet_hdr_len > 0) {
+            /* the backend does the offloads */
+            if (s1->header_size < (int) sizeof(h))
+                h.num_buffers = 0;
+            memset(buf, 0, es->vnet_hdr_len);
+            memcpy(buf, &h, min_int(sizeof(h), es->vnet_hdr_len));
+            memcpy_from_queue(s, buf + es->vnet_hdr_len, queue_idx, desc_idx,
+                              s1->header_size, len);
+            es->write_packet(es, queue_idx / 2, buf, es->vnet_hdr_len + len);
+        } else {
+            memcpy_from_queue(s, buf, queue_idx, desc_idx, s1->header_size, len);
+            virtio_net_send_packet(s1, queue_idx / 2, &h, buf, len);
+        }
         virtio_consume_desc(s, queue_idx, desc_idx, 0);
     }
     return 0;
 }
 
-static bool virtio_net_can_write_packet(EthernetDevice *es)
+/* receive queue of the frames of the backend queue pair
+   queue_pair. NET_QUEUE_ANY frames are steered by their flow hash */
+static int virtio_net_rx_queue(VIRTIONetDevice *s1, int queue_pair,
+                               const uint8_t *buf, int len)
+{
+    if (queue_pair < 0)
+        queue_pair = net_flow_hash(buf, len);
+    return 2 * ((unsigned int) queue_pair % s1->curr_queue_pairs);
+}
+
+static bool virtio_net_can_write_packet(EthernetDevice *es, int queue_pair)
 {
     VIRTIODevice *s = (VIRTIODevice *) es->device_opaque;
-    QueueState *qs = &s->queue[0];
-    uint16_t avail_idx;
+    VIRTIONetDevice *s1 = (VIRTIONetDevice *)s;
+    int i;
+
+    if (queue_pair >= 0)
+        return virtio_queue_has_avail(s, virtio_net_rx_queue(s1, queue_pair,
+                                                             NULL, 0));
+    /* the frame may be steered to any of them */
+    for(i = 0; i < s1->curr_queue_pairs; i++) {
+        if (!virtio_queue_has_avail(s, 2 * i))
+            return false;
+    }
+    return true;
+}
+
+/* Write the frame with the header h to the receive queue. Return
+   FALSE if the guest has not made enough buffers available yet, the
+   frame can then be written again later. With VIRTIO_NET_F_MRG_RXBUF,
+   a frame is spread over as many buffers as needed and num_buffers is
+   set in the header of the first one. */
+static bool virtio_net_write_frame(VIRTIONetDevice *s1, int queue_idx,
+                                   const VIRTIONetHeader *h1,
+                                   const uint8_t *buf, int buf_len)
+{
+    VIRTIODevice *s = &s1->common;
+    QueueState *qs = &s->queue[queue_idx];
+    int desc_tab[MAX_QUEUE_NUM], len_tab[MAX_QUEUE_NUM];
+    int desc_idx, n, i, pos, len, l, total_len, ret;
+    uint16_t last_avail_idx;
+    BOOL avail_wrap_counter, mergeable, batch_used;
+    uint8_t h[sizeof(VIRTIONetHeader)];
+    VIRTIOIOVec *iov;
 
     if (!qs->ready)
-        return FALSE;
-    avail_idx = virtio_read16(s, qs->avail_addr + 2);
-    return qs->last_avail_idx != avail_idx;
+        return false;
+    mergeable = virtio_has_feature(s, VIRTIO_NET_F_MRG_RXBUF);
+    total_len = s1->header_size + buf_len;
+    /* take the buffers, the ring position is restored if they do not
+       hold the whole frame */
+    last_avail_idx = qs->last_avail_idx;
+    avail_wrap_counter = qs->avail_wrap_counter;
+    n = 0;
+    len = 0;
+    while (len < total_len) {
+        ret = virtio_queue_peek(s, queue_idx, &desc_idx);
+        if (ret == 0)
+            goto no_buffer;
+        virtio_queue_advance(s, queue_idx);
+        if (ret < 0)
+            continue; /* skip the malformed buffer */
+        iov = virtio_get_iov(s, queue_idx, desc_idx);
+        if ((!mergeable && iov->write_size < total_len) ||
+            (n == (int)qs->num - 1 && len + iov->write_size < total_len)) {
+            /* it does not fit in a buffer or in the whole ring: drop
+               it and keep the buffers */
+            qs->last_avail_idx = last_avail_idx;
+            qs->avail_wrap_counter = avail_wrap_counter;
+            return true;
+        }
+        desc_tab[n] = desc_idx;
+        len_tab[n] = min_int(iov->write_size, total_len - len);
+        len += len_tab[n];
+        n++;
+    }
+
+    h[0] = h1->flags;
+    h[1] = h1->gso_type;
+    put_le16(h + 2, h1->hdr_len);
+    put_le16(h + 4, h1->gso_size);
+    put_le16(h + 6, h1->csum_start);
+    put_le16(h + 8, h1->csum_offset);
+    put_le16(h + 10, mergeable ? n : 0);
+    /* publish all the used elements at once */
+    batch_used = qs->batch_used;
+    qs->batch_used = TRUE;
+    pos = 0; /* position in the header followed by the frame */
+    for(i = 0; i < n; i++) {
+        len = len_tab[i];
+        /* the receive buffers are not popped by virtio_queue_notify() */
+        virtio_trace(s, VTRACE_EV_POP, queue_idx, desc_tab[i], 0, len);
+        l = 0;
+        if (pos < s1->header_size) {
+            l = min_int(s1->header_size - pos, len);
+            memcpy_to_queue(s, queue_idx, desc_tab[i], 0, h + pos, l);
+        }
+        if (l < len)
+            memcpy_to_queue(s, queue_idx, desc_tab[i], l,
+                            buf + pos + l - s1->header_size, len - l);
+        virtio_consume_desc(s, queue_idx, desc_tab[i], len);
+        pos += len;
+    }
+    qs->batch_used = batch_used;
+    if (!batch_used)
+        virtio_queue_flush_used(s, queue_idx);
+    virtio_update_avail_event(s, queue_idx);
+    return true;
+ no_buffer:
+    qs->last_avail_idx = last_avail_idx;
+    qs->avail_wrap_counter = avail_wrap_counter;
+    return false;
+}
+
+/* write the merged TCP segments, as a single segment or as a GSO
+   frame whose checksum is computed by the guest like a TAP device
+   does */
+static bool virtio_net_rx_merge_flush(VIRTIONetDevice *s1)
+{
+    VIRTIONetHeader h;
+    uint8_t *ip, *tcp;
+    int ihl;
+
+    memset(&h, 0, sizeof(h));
+    ip = s1->rx_merge_buf + ETH_HEADER_SIZE;
+    ihl = (ip[0] & 0xf) * 4;
+    if (s1->rx_merge_nb_segs == 1) {
+        h.flags = VIRTIO_NET_HDR_F_DATA_VALID;
+    } else {
+        tcp = ip + ihl;
+        put_be16(ip + 2, s1->rx_merge_len - ETH_HEADER_SIZE);
+        net_ip4_set_checksum(ip);
+        put_be16(tcp + 16, ~net_checksum_fold(net_tcp4_pseudo_sum(ip)));
+        h.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        h.gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+        h.hdr_len = s1->rx_merge_hdr_len;
+        h.gso_size = s1->rx_merge_seg_size;
+        h.csum_start = ETH_HEADER_SIZE + ihl;
+        h.csum_offset = 16;
+    }
+    if (!virtio_net_write_frame(s1, s1->rx_merge_queue_idx, &h,
+                                s1->rx_merge_buf, s1->rx_merge_len))
+        return false;
+    s1->rx_merge_len = 0;
+    return true;
+}
+
+/* append the segment to the held frame if it directly follows it in
+   the same connection */
+static bool virtio_net_rx_merge(VIRTIONetDevice *s1, const uint8_t *buf,
+                                int hdr_len, int frame_len)
+{
+    uint8_t *buf1 = s1->rx_merge_buf;
+    uint8_t *ip, *ip1, *tcp, *tcp1;
+    int ihl, n;
+
+    n = frame_len - hdr_len;
+    if (hdr_len != s1->rx_merge_hdr_len ||
+        n > s1->rx_merge_seg_size ||
+        s1->rx_merge_len + n - ETH_HEADER_SIZE > NET_MAX_IP_LEN ||
+        s1->rx_merge_len - hdr_len !=
+        s1->rx_merge_nb_segs * s1->rx_merge_seg_size)
+        return false;
+    ip = (uint8_t *) buf + ETH_HEADER_SIZE;
+    ip1 = buf1 + ETH_HEADER_SIZE;
+    ihl = (ip[0] & 0xf) * 4;
+    tcp = ip + ihl;
+    tcp1 = ip1 + ihl;
+    /* same addresses, ports and TCP options, in sequence */
+    if (memcmp(buf, buf1, ETH_HEADER_SIZE) ||
+        ip[0] != ip1[0] || ip[1] != ip1[1] ||
+        memcmp(ip + 12, ip1 + 12, ihl - 12) ||
+        memcmp(tcp, tcp1, 4) ||
+        memcmp(tcp + 20, tcp1 + 20, hdr_len - ETH_HEADER_SIZE - ihl - 20) ||
+        get_be32(tcp + 4) != get_be32(tcp1 + 4) + s1->rx_merge_len - hdr_len ||
+        (tcp1[13] & TCP_FLAG_PSH) ||
+        (tcp[13] & ~TCP_FLAG_PSH) != TCP_FLAG_ACK)
+        return false;
+    memcpy(buf1 + s1->rx_merge_len, buf + hdr_len, n);
+    s1->rx_merge_len += n;
+    s1->rx_merge_nb_segs++;
+    /* the last acknowledgement and window are kept */
+    memcpy(tcp1 + 8, tcp + 8, 4);
+    memcpy(tcp1 + 14, tcp + 14, 2);
+    tcp1[13] |= tcp[13];
+    return true;
+}
+
+/* frame prefixed by the virtio-net header of the backend */
+static bool virtio_net_write_vnet_frame(VIRTIONetDevice *s1, int queue_idx,
+                                        const uint8_t *buf, int buf_len)
+{
+    VIRTIODevice *s = &s1->common;
+    int hdr_len = s1->es->vnet_hdr_len;
+    VIRTIONetHeader h;
+
+    memset(&h, 0, sizeof(h));
+    h.flags = buf[0];
+    h.gso_type = buf[1];
+    h.hdr_len = get_le16(buf + 2);
+    h.gso_size = get_le16(buf + 4);
+    h.csum_start = get_le16(buf + 6);
+    h.csum_offset = get_le16(buf + 8);
+    /* frames received before the offloads of the guest were given to
+       the backend */
+    if ((h.gso_type != VIRTIO_NET_HDR_GSO_NONE &&
+         !virtio_has_feature(s, VIRTIO_NET_F_GUEST_TSO4)) ||
+        ((h.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) &&
+         !virtio_has_feature(s, VIRTIO_NET_F_GUEST_CSUM)))
+        return true;
+    if (!virtio_has_feature(s, VIRTIO_NET_F_GUEST_CSUM))
+        h.flags &= ~VIRTIO_NET_HDR_F_DATA_VALID;
+    return virtio_net_write_frame(s1, queue_idx, &h, buf + hdr_len,
+                                  buf_len - hdr_len);
 }
 
-static void virtio_net_write_packet(EthernetDevice *es, const uint8_t *buf, int buf_len)
+static bool virtio_net_write_packet1(EthernetDevice *es, int queue_pair,
+                                     const uint8_t *buf, int buf_len)
 {
     VIRTIODevice *s = (VIRTIODevice *) es->device_opaque;
     VIRTIONetDevice *s1 = (VIRTIONetDevice *)s;
-    int queue_idx = 0;
-    QueueState *qs = &s->queue[queue_idx];
-    int desc_idx;
     VIRTIONetHeader h;
-    int len, read_size, write_size;
-    uint16_t avail_idx;
+    int hdr_len, frame_len, queue_idx;
+    uint8_t *tcp;
+
+    if (es->vnet_hdr_len > 0) {
+        if (buf_len < es->vnet_hdr_len)
+            return true;
+        queue_idx = virtio_net_rx_queue(s1, queue_pair,
+                                        buf + es->vnet_hdr_len,
+                                        buf_len - es->vnet_hdr_len);
+        return virtio_net_write_vnet_frame(s1, queue_idx, buf, buf_len);
+    }
+    queue_idx = virtio_net_rx_queue(s1, queue_pair, buf, buf_len);
+
+    memset(&h, 0, sizeof(h));
+    /* the backends check the received checksums */
+    if (virtio_has_feature(s, VIRTIO_NET_F_GUEST_CSUM))
+        h.flags = VIRTIO_NET_HDR_F_DATA_VALID;
+    if (!virtio_has_feature(s, VIRTIO_NET_F_GUEST_TSO4))
+        return virtio_net_write_frame(s1, queue_idx, &h, buf, buf_len);
+
+    hdr_len = net_tcp4_header_len(buf, buf_len, &frame_len);
+    if (s1->rx_merge_len > 0) {
+        if (hdr_len > 0 && queue_idx == s1->rx_merge_queue_idx &&
+            virtio_net_rx_merge(s1, buf, hdr_len, frame_len))
+            return true;
+        if (!virtio_net_rx_merge_flush(s1))
+            return false;
+    }
+    if (hdr_len > 0 && frame_len > hdr_len) {
+        tcp = (uint8_t *) buf + ETH_HEADER_SIZE +
+            (buf[ETH_HEADER_SIZE] & 0xf) * 4;
+        if (tcp[13] == TCP_FLAG_ACK) {
+            /* hold it until the next segment or the next poll */
+            memcpy(s1->rx_merge_buf, buf, frame_len);
+            s1->rx_merge_len = frame_len;
+            s1->rx_merge_hdr_len = hdr_len;
+            s1->rx_merge_seg_size = frame_len - hdr_len;
+            s1->rx_merge_nb_segs = 1;
+            s1->rx_merge_queue_idx = queue_idx;
+            return true;
+        }
+    }
+    return virtio_net_write_frame(s1, queue_idx, &h, buf, buf_len);
+}
 
-    if (!qs->ready)
-        return;
-    avail_idx = virtio_read16(s, qs->avail_addr + 2);
-    if (qs->last_avail_idx == avail_idx)
-        return;
-    desc_idx = virtio_read16(s, qs->avail_addr + 4 + 
-                             (qs->last_avail_idx & (qs->num - 1)) * 2);
-    if (get_desc_rw_size(s, &read_size, &write_size, queue_idx, desc_idx))
-        return;
-    len = s1->header_size + buf_len; 
-    if (len > write_size)
-        return;
-    memset(&h, 0, s1->header_size);
-    memcpy_to_queue(s, queue_idx, desc_idx, 0, &h, s1->header_size);
-    memcpy_to_queue(s, queue_idx, desc_idx, s1->header_size, buf, buf_len);
-    virtio_consume_desc(s, queue_idx, desc_idx, len);
-    qs->last_avail_idx++;
+static bool virtio_net_write_packet(EthernetDevice *es, int queue_pair,
+                                    const uint8_t *buf, int buf_len)
+{
+    VIRTIONetDevice *s1 = (VIRTIONetDevice *) es->device_opaque;
+    struct iovec iov;
+
+    if (!virtio_net_write_packet1(es, queue_pair, buf, buf_len))
+        return false;
+    /* a frame refused by the device is given again later, so it is
+       captured once accepted */
+    if (s1->capture) {
+        iov.iov_base = (void *) buf;
+        iov.iov_len = buf_len;
+        net_capture_packet(s1->capture, &iov, 1, es->vnet_hdr_len, buf_len);
+    }
+    return true;
+}
+
+/* Capture the frames exchanged with the guest to the pcap file
+   filename, each truncated to snaplen bytes (0 for the default). The
+   capture is stopped if filename is NULL. Return -1 if the file cannot
+   be created. */
+int virtio_net_set_capture(VIRTIODevice *s, const char *filename, int snaplen)
+{
+    VIRTIONetDevice *s1 = (VIRTIONetDevice *)s;
+
+    if (s1->capture) {
+        net_capture_close(s1->capture);
+        s1->capture = NULL;
+    }
+    if (filename) {
+        s1->capture = net_capture_open(filename, snaplen);
+        if (!s1->capture)
+            return -1;
+    }
+    return 0;
+}
+
+/* publish the frames sent by the backend, update its offloads and
+   write the held frame. Called on each device tick. */
+void virtio_net_poll(VIRTIODevice *s)
+{
+    VIRTIONetDevice *s1 = (VIRTIONetDevice *)s;
+    EthernetDevice *es = s1->es;
+    uint32_t mask;
+    int flags, i;
+
+    mask = s1->tx_done_mask;
+    s1->tx_done_mask = 0;
+    for(i = 0; mask != 0; i++, mask >>= 1) {
+        if (mask & 1)
+            virtio_queue_flush_used(s, 2 * i + 1);
+    }
+    /* resume the transmit queues once the backend has room */
+    mask = s1->tx_blocked_mask;
+    s1->tx_blocked_mask = 0;
+    for(i = 0; mask != 0; i++, mask >>= 1) {
+        if (mask & 1)
+            queue_notify(s, 2 * i + 1);
+    }
+
+    if (es->set_offload) {
+        flags = 0;
+        if (virtio_has_feature(s, VIRTIO_NET_F_GUEST_CSUM)) {
+            flags |= NET_OFFLOAD_CSUM;
+            if (virtio_has_feature(s, VIRTIO_NET_F_GUEST_TSO4))
+                flags |= NET_OFFLOAD_TSO4;
+        }
+        if (flags != s1->offload_flags) {
+            es->set_offload(es, flags);
+            s1->offload_flags = flags;
+        }
+    }
+    if (s1->rx_merge_len > 0)
+        virtio_net_rx_merge_flush(s1);
+}
+
+static void virtio_net_reset(VIRTIODevice *s)
+{
+    VIRTIONetDevice *s1 = (VIRTIONetDevice *)s;
+
+    s1->curr_queue_pairs = 1;
+    s1->rx_merge_len = 0;
+    s1->tx_gen = (s1->tx_gen + 1) & 0xff;
+    s1->tx_async_pending = 0;
+    s1->tx_done_mask = 0;
+    s1->tx_blocked_mask = 0;
+}
+
+/* device state: the connections of the backend are not saved */
+static BOOL virtio_net_busy(VIRTIODevice *s)
+{
+    VIRTIONetDevice *s1 = (VIRTIONetDevice *)s;
+    return s1->tx_async_pending > 0 || s1->tx_done_mask != 0;
+}
+
+static int virtio_net_save(VIRTIODevice *s, device_state_writer_t *w)
+{
+    VIRTIONetDevice *s1 = (VIRTIONetDevice *)s;
+
+    w->put_u32(s1->curr_queue_pairs);
+    w->put_u32(s1->rx_merge_len);
+    if (s1->rx_merge_len > 0) {
+        w->put_u32(s1->rx_merge_hdr_len);
+        w->put_u32(s1->rx_merge_seg_size);
+        w->put_u32(s1->rx_merge_nb_segs);
+        w->put_u32(s1->rx_merge_queue_idx);
+        w->put_bytes(s1->rx_merge_buf, s1->rx_merge_len);
+    }
+    return 0;
+}
+
+static int virtio_net_load(VIRTIODevice *s, device_state_reader_t *r)
+{
+    VIRTIONetDevice *s1 = (VIRTIONetDevice *)s;
+
+    s1->curr_queue_pairs = r->get_u32();
+    s1->rx_merge_len = r->get_u32();
+    if (s1->curr_queue_pairs < 1 ||
+        s1->curr_queue_pairs > s1->max_queue_pairs ||
+        s1->rx_merge_len < 0 ||
+        s1->rx_merge_len > ETH_HEADER_SIZE + NET_MAX_IP_LEN) {
+        s1->rx_merge_len = 0;
+        return -1;
+    }
+    if (s1->rx_merge_len > 0) {
+        s1->rx_merge_hdr_len = r->get_u32();
+        s1->rx_merge_seg_size = r->get_u32();
+        s1->rx_merge_nb_segs = r->get_u32();
+        s1->rx_merge_queue_idx = r->get_u32();
+        r->get_bytes(s1->rx_merge_buf, s1->rx_merge_len);
+        if (s1->rx_merge_queue_idx >= 2 * s1->max_queue_pairs) {
+            s1->rx_merge_len = 0;
+            return -1;
+        }
+    }
+    s1->tx_blocked_mask = 0;
+    /* the backend is given the offloads on the next poll */
+    s1->offload_flags = -1;
+    return 0;
 }
 
 static void virtio_net_set_carrier(EthernetDevice *es, bool carrier_state)
@@ -2213,42 +10289,237 @@ static void virtio_net_set_carrier(EthernetDevice *es, bool carrier_state)
 #endif
 }
 
-VIRTIODevice *virtio_net_init(VIRTIOBusDef *bus, EthernetDevice *es, const simif_t* sim)
+VIRTIODevice *virtio_net_init(VIRTIOBusDef *bus, EthernetDevice *es,
+                              int nb_queue_pairs, const simif_t* sim)
 {
     VIRTIONetDevice *s;
+    int i;
 
     s = (VIRTIONetDevice *) mallocz(sizeof(*s));
+    /* mac, status, max_virtqueue_pairs and padding */
     virtio_init(&s->common, bus,
-                1, 6 + 2, virtio_net_recv_request, sim);
-    /* VIRTIO_NET_F_MAC, VIRTIO_NET_F_STATUS */
-    s->common.device_features = (1 << 5) /* | (1 << 16) */;
-    s->common.queue[0].manual_recv = TRUE;
+                1, 12, virtio_net_recv_request, sim);
+    s->common.device_features |= (1 << VIRTIO_NET_F_MAC) |
+        (1 << VIRTIO_NET_F_MRG_RXBUF) /* | (1 << VIRTIO_NET_F_STATUS) */;
+    /* checksums and TCP segmentation done by the host */
+    s->common.device_features |= (1 << VIRTIO_NET_F_CSUM) |
+        (1 << VIRTIO_NET_F_GUEST_CSUM) | (1 << VIRTIO_NET_F_HOST_TSO4) |
+        (1 << VIRTIO_NET_F_GUEST_TSO4);
+    s->rx_merge_buf = (uint8_t *) malloc(ETH_HEADER_SIZE + NET_MAX_IP_LEN);
+    s->tx_buf = (uint8_t *) malloc(NET_MAX_FRAME_LEN);
+    s->tx_seg_buf = (uint8_t *) malloc(NET_MAX_FRAME_LEN);
+    s->max_queue_pairs = min_int(max_int(nb_queue_pairs, 1),
+                                 NET_MAX_QUEUE_PAIRS);
+    s->curr_queue_pairs = 1;
+    if (s->max_queue_pairs > 1) {
+        s->common.device_features |= (1 << VIRTIO_NET_F_CTRL_VQ) |
+            (1 << VIRTIO_NET_F_MQ);
+    }
+    s->common.device_reset = virtio_net_reset;
+    s->common.device_busy = virtio_net_busy;
+    s->common.device_save = virtio_net_save;
+    s->common.device_load = virtio_net_load;
+    for(i = 0; i < s->max_queue_pairs; i++)
+        s->common.queue[2 * i].manual_recv = TRUE;
     s->es = es;
     memcpy(s->common.config_space, es->mac_addr, 6);
     /* status */
     s->common.config_space[6] = 0;
     s->common.config_space[7] = 0;
+    put_le16(s->common.config_space + 8, s->max_queue_pairs);
 
+    /* num_buffers is always present with VIRTIO_F_VERSION_1 or
+       VIRTIO_NET_F_MRG_RXBUF */
     s->header_size = sizeof(VIRTIONetHeader);
     
     es->device_opaque = s;
+    es->nb_queue_pairs = s->max_queue_pairs;
     es->device_can_write_packet = virtio_net_can_write_packet;
     es->device_write_packet = virtio_net_write_packet;
     es->device_set_carrier = virtio_net_set_carrier;
+    es->device_write_done = virtio_net_write_done;
     return (VIRTIODevice *)s;
 }
 
 
+/* Placement of the index-th instance of a device type: from the addr=
+   and irq= arguments, otherwise the default placement of the type
+   shifted by the instance index. */
+void virtio_mmio_placement(const std::vector<std::string>& sargs, int index,
+                           reg_t default_addr, uint32_t default_irq,
+                           reg_t *paddr, uint32_t *pirq)
+{
+  *paddr = default_addr + (reg_t)index * VIRTIO_INSTANCE_ADDR_STRIDE;
+  *pirq = default_irq + index * VIRTIO_INSTANCE_IRQ_STRIDE;
+  for (auto arg : sargs) {
+    size_t eq_idx = arg.find('=');
+    if (eq_idx == std::string::npos)
+      continue;
+    std::string key = arg.substr(0, eq_idx);
+    std::string val = arg.substr(eq_idx + 1);
+    if (key == "addr")
+      *paddr = strtoull(val.c_str(), NULL, 0);
+    else if (key == "irq")
+      *pirq = strtoul(val.c_str(), NULL, 0);
+  }
+}
+
+/* DTS node of a virtio-mmio device. The first instance of a type is
+   labelled with its name, the next ones with the instance index. */
+std::string virtio_mmio_generate_dts(const char *name, int index,
+                                     reg_t addr, uint32_t irq)
+{
+  std::stringstream s;
+
+  s << "    " << name;
+  if (index > 0)
+    s << index;
+  s << std::hex << ": virtio@" << addr << " {\n"
+       "      compatible = \"virtio,mmio\";\n"
+       "      interrupt-parent = <&PLIC>;\n"
+       "      interrupts = <" << std::dec << irq;
+  s << std::hex << ">;\n"
+       "      reg = <0x" << (addr >> 32) << " 0x" << (addr & (uint32_t)-1) <<
+                   " 0x" << ((reg_t)VIRTIO_SIZE >> 32) << " 0x" <<
+                   ((reg_t)VIRTIO_SIZE & (uint32_t)-1) << ">;\n"
+       "    };\n";
+  return s.str();
+}
+
+/* Find the virtio-mmio node of the device at addr. *pirq is set from
+   its interrupts property if it has one. Return the node offset or a
+   negative libfdt error. */
+int fdt_parse_virtio_mmio(const void *fdt, reg_t addr, uint32_t *pirq)
+{
+  int nodeoffset, rc, len;
+  const fdt32_t *reg_p;
+  reg_t node_addr;
+
+  nodeoffset = -1;
+  for (;;) {
+    nodeoffset = fdt_node_offset_by_compatible(fdt, nodeoffset, "virtio,mmio");
+    if (nodeoffset < 0)
+      return nodeoffset;
+    rc = fdt_get_node_addr_size(fdt, nodeoffset, &node_addr, NULL, "reg");
+    if (rc >= 0 && node_addr == addr)
+      break;
+  }
+
+  reg_p = (fdt32_t *)fdt_getprop(fdt, nodeoffset, "interrupts", &len);
+  if (reg_p && len >= 4)
+    *pirq = fdt32_to_cpu(*reg_p);
+  return nodeoffset;
+}
+
 virtio_base_t::virtio_base_t(
       const simif_t* sim,
       abstract_interrupt_controller_t *intctrl,
       uint32_t interrupt_id,
       std::vector<std::string> sargs)
-  : sim(sim), intctrl(intctrl), interrupt_id(interrupt_id)
-{}
+  : sim(sim), intctrl(intctrl), interrupt_id(interrupt_id),
+    virtio_dev(NULL), irq(NULL)
+{
+  /* options shared by all virtio devices */
+  for (auto arg : sargs) {
+    size_t eq_idx = arg.find('=');
+    if (eq_idx == std::string::npos)
+      continue;
+    std::string key = arg.substr(0, eq_idx);
+    std::string val = arg.substr(eq_idx + 1);
+    if (key == "irq_batch")
+      irq_max_batch = strtol(val.c_str(), NULL, 0);
+    else if (key == "irq_delay")
+      irq_max_delay = strtol(val.c_str(), NULL, 0);
+    else if (key == "trace")
+      trace_file = val;
+    else if (key == "trace_events")
+      trace_events = strtol(val.c_str(), NULL, 0);
+    else if (key == "poll")
+      poll_idle_ticks = strtol(val.c_str(), NULL, 0);
+    else if (key == "stats" && stats_fname.empty())
+      stats_fname = val; /* the first one, as for the device options */
+  }
+}
+
+void virtio_base_t::setup_common_options() {
+    virtio_set_irq_coalescing(virtio_dev, irq_max_batch, irq_max_delay);
+    virtio_set_polling(virtio_dev, poll_idle_ticks);
+    if (!trace_file.empty() &&
+        virtio_set_trace(virtio_dev, trace_file.c_str(), trace_events) < 0) {
+        fprintf(stderr, "virtio: cannot create the trace file '%s': %s\n",
+                trace_file.c_str(), strerror(errno));
+    }
+}
+
+void virtio_base_t::setup_stats(void (*func)(VIRTIODevice *s, FILE *f)) {
+    stats_func = func;
+    stats_seen = virtio_stats_request_count();
+    virtio_install_stats_signal();
+}
+
+/* to the `stats` file if given, otherwise to stderr */
+void virtio_base_t::dump_stats() {
+    FILE *f = stderr;
+
+    if (!stats_func || !virtio_dev)
+        return;
+    if (!stats_fname.empty()) {
+        f = fopen(stats_fname.c_str(), "w");
+        if (!f) {
+            perror(stats_fname.c_str());
+            return;
+        }
+    }
+    stats_func(virtio_dev, f);
+    if (f != stderr)
+        fclose(f);
+}
 
+/* the derived class has completed the requests and flushed its backend */
 virtio_base_t::~virtio_base_t() {
+    dump_stats();
+    /* write the last events */
+    if (virtio_dev)
+        virtio_set_trace(virtio_dev, NULL, 0);
+}
+
+void virtio_base_t::tick(reg_t rtc_ticks) {
+    if (stats_func && stats_seen != virtio_stats_request_count()) {
+        stats_seen = virtio_stats_request_count();
+        dump_stats();
+    }
+    if (virtio_dev)
+        virtio_tick(virtio_dev, rtc_ticks);
+}
+
+#define VIRTIO_BASE_STATE_VERSION 1
+
+void virtio_base_t::drain() {
+    while (virtio_is_busy(virtio_dev)) {
+        poll();
+        sched_yield();
+    }
+}
+
+bool virtio_base_t::checkpoint(std::vector<uint8_t>& blob, const std::string& prefix) {
+    size_t start = blob.size();
+
+    drain();
+    device_state_writer_t w(blob, "virtio", VIRTIO_BASE_STATE_VERSION);
+    if (!save_backend(w, prefix) || virtio_save_state(virtio_dev, &w) < 0) {
+        blob.resize(start);
+        return false;
+    }
+    w.end();
+    return true;
+}
+
+bool virtio_base_t::restore(const std::vector<uint8_t>& blob) {
+    device_state_reader_t r(blob, "virtio", VIRTIO_BASE_STATE_VERSION);
 
+    drain();
+    /* the backend first: the restored queues are processed at once */
+    return r.ok() && load_backend(r) && virtio_load_state(virtio_dev, &r) == 0;
 }
 
 bool virtio_base_t::load(reg_t addr, size_t len, uint8_t *bytes) {
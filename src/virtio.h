@@ -25,6 +25,7 @@
 #define VIRTIO_H
 
 #include <sys/select.h>
+#include <sys/uio.h>
 #include <riscv/abstract_device.h>
 #include <riscv/simif.h>
 #include <riscv/abstract_interrupt_controller.h>
@@ -78,25 +79,87 @@ struct VIRTIODevice;
 #define VIRTIO_DEBUG_9P (1 << 1)
 
 void virtio_set_debug(VIRTIODevice *s, int debug_flags);
+void virtio_set_irq_coalescing(VIRTIODevice *s, int max_batch, int max_delay);
+/* process the queues in virtio_tick() instead of at each notification,
+   polling a busy queue with the notifications suppressed until it has
+   been empty for idle_ticks ticks. 0 disables the polling mode. */
+void virtio_set_polling(VIRTIODevice *s, int idle_ticks);
+void virtio_tick(VIRTIODevice *s, uint64_t rtc_ticks);
+/* deadlines of the device, see device_sched.h. Its timers are run by
+   virtio_tick() and keep their delay across a checkpoint restore. */
+struct device_sched_t;
+device_sched_t *virtio_get_sched(VIRTIODevice *s);
+/* statistics dump on SIGUSR1 */
+void virtio_install_stats_signal(void);
+int virtio_stats_request_count(void);
+/* binary event trace, see virtio-trace.h */
+int virtio_set_trace(VIRTIODevice *s, const char *filename, int nb_events);
+/* shared memory region 'id' (VIRTIO_MMIO_SHM_*) at the guest physical
+   address base. len = 0 removes it. Return < 0 if error. */
+int virtio_set_shm_region(VIRTIODevice *s, int id, uint64_t base,
+                          uint64_t len);
+/* return in host_iov the host memory of [offset, offset + count) of the
+   region, merging the contiguous pages. Return the number of entries or
+   -1 if the range is outside the region or max_iov is too small. */
+int virtio_shm_get_host_iov(VIRTIODevice *s, int id, uint64_t offset,
+                            uint64_t count, struct iovec *host_iov,
+                            int max_iov);
+
+/* device state, see checkpoint.h */
+class device_state_writer_t;
+class device_state_reader_t;
+
+int virtio_is_busy(VIRTIODevice *s);
+int virtio_save_state(VIRTIODevice *s, device_state_writer_t *w);
+int virtio_load_state(VIRTIODevice *s, device_state_reader_t *r);
 
 /* block device */
 
-typedef void BlockDeviceCompletionFunc(VIRTIODevice *opaque, int ret);
+typedef void BlockDeviceCompletionFunc(void *opaque, int ret);
 
 struct BlockDevice ;
 struct BlockDeviceFile;
+struct BlockDeviceAIO;
+struct BlockDeviceSnapshot;
+struct BlockDeviceOverlay;
+struct BlockDeviceReadCache;
+struct BlockDeviceURing;
+struct BlockDeviceCImg;
 
 typedef enum {
     BF_MODE_RO,
     BF_MODE_RW,
     BF_MODE_SNAPSHOT,
+    BF_MODE_MMAP, /* read only, the image is mapped in memory */
+    BF_MODE_MMAP_SNAPSHOT, /* private copy-on-write mapping */
+    BF_MODE_OVERLAY, /* the writes go to an overlay file */
 } BlockDeviceModeEnum;
 
+typedef enum {
+    BF_CACHE_WRITETHROUGH, /* the writes go to the host page cache */
+    BF_CACHE_WRITEBACK, /* the writes are cached until the guest flushes */
+    BF_CACHE_NONE, /* O_DIRECT */
+} BlockDeviceCacheEnum;
+
+typedef struct {
+    uint64_t sector_num;
+    uint32_t nb_sectors;
+} BlockDeviceRange;
+
 typedef struct BlockDeviceFile {
-    FILE *f;
+    int fd; /* accessed with preadv/pwritev, -1 if none */
     int64_t nb_sectors;
     BlockDeviceModeEnum mode;
-    uint8_t **sector_table;
+    int direct; /* opened with O_DIRECT */
+    /* BF_MODE_SNAPSHOT, or write-back cache in BF_MODE_RW */
+    struct BlockDeviceSnapshot *snapshot;
+    struct BlockDeviceOverlay *overlay; /* BF_MODE_OVERLAY only */
+    uint8_t *map; /* BF_MODE_MMAP and BF_MODE_MMAP_SNAPSHOT only */
+    size_t map_size;
+    struct BlockDeviceAIO *aio; /* NULL if the I/O is synchronous */
+    struct BlockDeviceReadCache *rcache; /* NULL if no read cache */
+    struct BlockDeviceURing *uring; /* NULL if io_uring is not used */
+    struct BlockDeviceCImg *cimg; /* NULL if not a compressed image */
 } BlockDeviceFile;
 
 
@@ -104,27 +167,119 @@ struct BlockDevice {
     int64_t (*get_sector_count)(BlockDevice *bs);
     int (*read_async)(BlockDevice *bs,
                       uint64_t sector_num, uint8_t *buf, int n,
-                      BlockDeviceCompletionFunc *cb, VIRTIODevice *opaque);
+                      BlockDeviceCompletionFunc *cb, void *opaque);
     int (*write_async)(BlockDevice *bs,
                        uint64_t sector_num, const uint8_t *buf, int n,
-                       BlockDeviceCompletionFunc *cb, VIRTIODevice *opaque);
+                       BlockDeviceCompletionFunc *cb, void *opaque);
+    /* same as read_async/write_async with a scatter-gather list. The
+       iovec array does not need to be valid after the call. */
+    int (*readv_async)(BlockDevice *bs,
+                       uint64_t sector_num, const struct iovec *iov, int iovcnt,
+                       BlockDeviceCompletionFunc *cb, void *opaque);
+    int (*writev_async)(BlockDevice *bs,
+                        uint64_t sector_num, const struct iovec *iov, int iovcnt,
+                        BlockDeviceCompletionFunc *cb, void *opaque);
+    /* make the completed writes persistent */
+    int (*flush_async)(BlockDevice *bs,
+                       BlockDeviceCompletionFunc *cb, void *opaque);
+    /* the content of the discarded sectors is undefined. The zeroed
+       sectors read as zero; if unmap is set, they can be
+       deallocated. NULL if the device is read only. */
+    int (*discard_async)(BlockDevice *bs,
+                         const BlockDeviceRange *ranges, int nb_ranges,
+                         BlockDeviceCompletionFunc *cb, void *opaque);
+    int (*write_zeroes_async)(BlockDevice *bs,
+                              const BlockDeviceRange *ranges, int nb_ranges,
+                              int unmap,
+                              BlockDeviceCompletionFunc *cb, void *opaque);
+    /* submit the requests queued since the last call, e.g. at the end
+       of a queue notification. Can be NULL. */
+    void (*submit)(BlockDevice *bs);
+    /* deliver the completed asynchronous requests. Can be NULL. */
+    void (*poll)(BlockDevice *bs);
     BlockDeviceFile *opaque;
 };
 
-BlockDevice *block_device_init(const char *filename, BlockDeviceModeEnum mode);
-VIRTIODevice *virtio_block_init(VIRTIOBusDef *bus, BlockDevice *bs, const simif_t* sim);
+BlockDevice *block_device_init(const char *filename, BlockDeviceModeEnum mode,
+                               BlockDeviceCacheEnum cache);
+int block_device_set_async(BlockDevice *bs, int nb_threads);
+void block_device_stop_async(BlockDevice *bs);
+int block_device_set_read_cache(BlockDevice *bs, int size_mb);
+int block_device_set_io_uring(BlockDevice *bs);
+int block_device_set_chunk_cache(BlockDevice *bs, int size_mb);
+int block_device_flush(BlockDevice *bs);
+int block_device_open_overlay(BlockDevice *bs, const char *filename);
+int block_device_commit(BlockDevice *bs, const char *base_filename);
+int block_device_checkpoint(BlockDevice *bs, const char *filename);
+int block_device_restore(BlockDevice *bs, const char *filename);
+VIRTIODevice *virtio_block_init(VIRTIOBusDef *bus, BlockDevice *bs,
+                                const simif_t* sim, int num_queues);
+void virtio_block_dump_stats(VIRTIODevice *s, FILE *f);
+void virtio_block_set_merge(VIRTIODevice *s, int merge, int sort);
 
 struct FSDevice;
 
-VIRTIODevice *virtio_9p_init(VIRTIOBusDef *bus, FSDevice *fs, const char *mount_tag, const simif_t* sim);
+VIRTIODevice *virtio_9p_init(VIRTIOBusDef *bus, FSDevice *fs, const char *mount_tag,
+                             uint32_t max_msize, const simif_t* sim);
+int virtio_9p_set_async(VIRTIODevice *s, int nb_threads);
+void virtio_9p_stop_async(VIRTIODevice *s);
+void virtio_9p_poll(VIRTIODevice *s);
+void virtio_9p_dump_stats(VIRTIODevice *s, FILE *f);
+
+/* virtio-fs device */
+
+/* maximum data size of a FUSE_WRITE request */
+#define VIRTIO_FS_MAX_WRITE (1 << 20)
+
+/* the request queues after the high priority queue */
+#define VIRTIO_FS_MAX_REQUEST_QUEUES 16
+
+/* guest caching of the entries, attributes and file data */
+#define VIRTIO_FS_CACHE_NONE   0 /* no validity, direct I/O */
+#define VIRTIO_FS_CACHE_AUTO   1 /* 1 second validity */
+#define VIRTIO_FS_CACHE_ALWAYS 2 /* 1 day validity, file data kept */
+
+VIRTIODevice *virtio_fs_init(VIRTIOBusDef *bus, FSDevice *fs, const char *tag,
+                             int num_request_queues, uint32_t max_write,
+                             int cache_mode, int timeout_ms,
+                             const simif_t* sim);
+void virtio_fs_poll(VIRTIODevice *s);
 
 typedef struct EthernetDevice EthernetDevice; 
 
+/* EthernetDevice.set_offload() flags */
+#define NET_OFFLOAD_CSUM (1 << 0)
+#define NET_OFFLOAD_TSO4 (1 << 1)
+
+#define NET_MAX_QUEUE_PAIRS 8
+#define NET_MAX_IOV 64 /* maximum number of buffers of a frame */
+/* queue pair of the frames of a single queue backend: the device
+   steers them by flow */
+#define NET_QUEUE_ANY (-1)
+
 struct EthernetDevice {
     uint8_t mac_addr[6]; /* mac address of the interface */
-    void (*write_packet)(EthernetDevice *net,
+    /* queue_pair is the virtio-net queue pair of the frame */
+    void (*write_packet)(EthernetDevice *net, int queue_pair,
                          const uint8_t *buf, int len);
+    /* optional: same as write_packet() for a frame in several
+       buffers */
+    void (*write_packetv)(EthernetDevice *net, int queue_pair,
+                          const struct iovec *iov, int iovcnt);
+    /* optional: send the frame without copying it. The buffers stay
+       valid until device_write_done() is called with opaque. Return
+       false if the frame cannot be queued now. */
+    bool (*write_packet_async)(EthernetDevice *net, int queue_pair,
+                               const struct iovec *iov, int iovcnt,
+                               void *opaque);
     void *opaque;
+    /* if non zero, the frames exchanged with the backend in both
+       directions are prefixed by a virtio-net header of this size
+       (with num_buffers) and the offloads are done by the backend */
+    int vnet_hdr_len;
+    /* optional: give received frames with the offloads accepted by
+       the guest (NET_OFFLOAD_x). May be called by any thread. */
+    void (*set_offload)(EthernetDevice *net, int flags);
 #if !defined(EMSCRIPTEN)
     void (*select_fill)(EthernetDevice *net, int *pfd_max,
                         fd_set *rfds, fd_set *wfds, fd_set *efds,
@@ -135,13 +290,86 @@ struct EthernetDevice {
 #endif
     /* the following is set by the device */
     void *device_opaque;
-    bool (*device_can_write_packet)(EthernetDevice *net);
-    void (*device_write_packet)(EthernetDevice *net,
+    int nb_queue_pairs;
+    /* queue_pair is in 0..nb_queue_pairs-1 or NET_QUEUE_ANY */
+    bool (*device_can_write_packet)(EthernetDevice *net, int queue_pair);
+    /* return false if the guest has not enough buffers yet */
+    bool (*device_write_packet)(EthernetDevice *net, int queue_pair,
                                 const uint8_t *buf, int len);
     void (*device_set_carrier)(EthernetDevice *net, bool carrier_state);
+    void (*device_write_done)(EthernetDevice *net, void *opaque);
+    void *opaque_io; /* set by net_io_start() */
+};
+
+VIRTIODevice *virtio_net_init(VIRTIOBusDef *bus, EthernetDevice *es,
+                              int nb_queue_pairs, const simif_t* sim);
+uint32_t net_flow_hash(const uint8_t *buf, int len);
+void virtio_net_poll(VIRTIODevice *s);
+int virtio_net_set_capture(VIRTIODevice *s, const char *filename, int snaplen);
+
+/* console device */
+
+typedef struct CharacterDevice CharacterDevice;
+
+struct CharacterDevice {
+    void *opaque;
+    /* write the data sent by the guest. The buffers received in a
+       queue notification are given at once, in at most
+       VIRTIO_CONSOLE_MAX_IOV entries. */
+    void (*write_data)(void *opaque, const struct iovec *iov, int iovcnt);
 };
 
-VIRTIODevice *virtio_net_init(VIRTIOBusDef *bus, EthernetDevice *es, const simif_t* sim);
+#define VIRTIO_CONSOLE_MAX_IOV 64
+
+/* the queues of the control channel and of each port must fit in
+   MAX_QUEUE */
+#define VIRTIO_CONSOLE_MAX_PORTS 7
+
+VIRTIODevice *virtio_console_init(VIRTIOBusDef *bus, CharacterDevice **ports,
+                                  const char **names, int nb_ports,
+                                  const simif_t* sim);
+int virtio_console_get_write_len(VIRTIODevice *s, int port);
+int virtio_console_write_data(VIRTIODevice *s, int port, const uint8_t *buf,
+                              int buf_len);
+void virtio_console_poll(VIRTIODevice *s);
+
+/* balloon device */
+
+/* release the host memory of the guest RAM [paddr, paddr + len), which
+   then reads as zero. Return the number of bytes released. */
+typedef uint64_t VIRTIORAMDiscardFunc(const simif_t *sim, uint64_t paddr,
+                                      uint64_t len);
+void virtio_set_ram_discard(VIRTIORAMDiscardFunc *func);
+
+VIRTIODevice *virtio_balloon_init(VIRTIOBusDef *bus, uint32_t num_pages,
+                                  int deflate_on_oom, int reporting,
+                                  const simif_t* sim);
+void virtio_balloon_set_target(VIRTIODevice *s, uint32_t num_pages);
+uint32_t virtio_balloon_get_actual(VIRTIODevice *s);
+void virtio_balloon_dump_stats(VIRTIODevice *s, FILE *f);
+
+/* persistent memory device: the image is read into the shared memory
+   region at base. With write_back, a flush writes the changed pages
+   back to it. Return NULL if the region is not RAM. */
+VIRTIODevice *virtio_pmem_init(VIRTIOBusDef *bus, BlockDevice *bs,
+                               uint64_t base, int write_back,
+                               const simif_t* sim);
+int virtio_pmem_flush(VIRTIODevice *s);
+void virtio_pmem_dump_stats(VIRTIODevice *s, FILE *f);
+
+/* Several instances of a device type may be given. Without addr= and
+   irq=, the instance n is placed at the default address of the type
+   plus n * VIRTIO_INSTANCE_ADDR_STRIDE and uses its default IRQ plus
+   n * VIRTIO_INSTANCE_IRQ_STRIDE. */
+#define VIRTIO_INSTANCE_ADDR_STRIDE 0x10000
+#define VIRTIO_INSTANCE_IRQ_STRIDE  8
+
+void virtio_mmio_placement(const std::vector<std::string>& sargs, int index,
+                           reg_t default_addr, uint32_t default_irq,
+                           reg_t *paddr, uint32_t *pirq);
+std::string virtio_mmio_generate_dts(const char *name, int index,
+                                     reg_t addr, uint32_t irq);
+int fdt_parse_virtio_mmio(const void *fdt, reg_t addr, uint32_t *pirq);
 
 class virtio_base_t : public abstract_device_t {
 public:
@@ -153,12 +381,42 @@ public:
   ~virtio_base_t();
   bool load(reg_t addr, size_t len, uint8_t* bytes) override;
   bool store(reg_t addr, size_t len, const uint8_t* bytes) override;
+  void tick(reg_t rtc_ticks) override;
+  // Device state, see checkpoint.h. The requests in progress are
+  // completed first. The files referenced by the state (block device
+  // overlay) are named after prefix. Return false if the state cannot
+  // be saved.
+  bool checkpoint(std::vector<uint8_t>& blob, const std::string& prefix);
+  // must be called once the guest memory is restored
+  bool restore(const std::vector<uint8_t>& blob);
 private:
   const simif_t* sim;
   abstract_interrupt_controller_t *intctrl;
   uint32_t interrupt_id;
+  int irq_max_batch = 1;
+  int irq_max_delay = 0;
+  int poll_idle_ticks = 0;
+  std::string trace_file;
+  int trace_events = 0;
+  std::string stats_fname; // JSON statistics, stderr if empty
+  void (*stats_func)(VIRTIODevice *s, FILE *f) = NULL;
+  int stats_seen = 0; // SIGUSR1 requests already handled
 
 protected:
+  // must be called by the derived class once virtio_dev is created
+  void setup_common_options();
+  // the statistics of the device are written by func to the `stats`
+  // file, on SIGUSR1 and when the device is destroyed
+  void setup_stats(void (*func)(VIRTIODevice *s, FILE *f));
+  void dump_stats();
+  // deliver the completions of the asynchronous backend
+  virtual void poll() {}
+  // wait for the requests in progress
+  void drain();
+  // state of the backend, saved before the virtio device state
+  virtual bool save_backend(device_state_writer_t& w, const std::string& prefix) { return true; }
+  virtual bool load_backend(device_state_reader_t& r) { return true; }
+
   VIRTIODevice* virtio_dev;
   IRQSpike* irq;
 };